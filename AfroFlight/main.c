@@ -1,20 +1,43 @@
 #include "main.h"
-#include <math.h>
 
 /* global vars visible elsewhere */
 _Config Config;                                                      // Main settings struct
-s16 Motors[MAX_MOTORS] = { 0, };                                     // Global motors struct for mixer.c
+__tiny s16 Motors[MAX_MOTORS] = { 0, };                              // Global motors struct for mixer.c
+_LoopStats LoopStats = { 0, };                                       // Control loop timing, read out over UART
 
 /* local static vars */
 static u8 Armed = FALSE;                                             // Motors armed or not :)
 static u16 Loop = 0;                                                 // Loop counter used for slow timing
-static vu16 rtc200us = 0;                                            // 
-static u16 Rtc1sec = 0;                                              // Semi-accurate 1sec resolution timer used for flight hours and running tasks that shouldn't have to happen too often.
+static vu16 rtc200us = 0;                                            // 200us ticks into the current second
+static vu16 Rtc1sec = 0;                                             // Semi-accurate 1sec resolution timer used for flight hours and running tasks that shouldn't have to happen too often.
+static vu8 LoopTick = 0;                                             // 200us ticks into the current loop period
+static vu8 LoopPending = 0;                                          // loop periods started by TIM4 and not run yet
 static u8 FlightMode = FC_MODE_ACRO;                                 // current flight mode as defined by "Switch"
 static u8 OldFlightMode = FC_MODE_ACRO;                              // previous value of flight mode
 static u8 FCFlags = 0;                                               // FC flags, such as low voltage etc [ In progress ]
-static s32 integral[3] = { 0, };				     // PID integral term
-static s32 last_error[3] = { 0, };			             // PID Last proportional error
+static __tiny s16 integral[3] = { 0, };				     // PID integral term
+static __tiny s16 errorHistory[3][2] = { 0, };			             // PID errors of the last two loops
+static __tiny u8 errorIndex = 0;                                     // errorHistory[] slot of the oldest error
+
+#define CONFIG_VERSION  (4)                                          // bump when _Config changes
+#define LOOP_TICKS      (10)                                         // 200us ticks per control loop, 500Hz
+#define TICK_US         (200)
+#define TIM4_COUNT_US   (8)                                          // TIM4 count, 16MHz / 128
+#define SEQ_TICKS       (5)                                          // 200us ticks per sequencer step, 1ms
+
+/* Buzzer and LED sequencer: Count pulses of Length ms on and Delay ms off, stepped from TIM4 */
+enum { SEQ_BUZZER = 0, SEQ_LED, SEQ_CHANNELS };
+
+typedef struct _Sequence {
+    vu8 Count;                                                       // pulses left, 0 when idle
+    vu8 On;
+    vu16 Timer;                                                      // ms left in the current phase
+    u16 Length;
+    u16 Delay;
+} _Sequence;
+
+static _Sequence Sequence[SEQ_CHANNELS];
+static u8 SeqTick = 0;
 
 /* Main configuration struct, saved in eeprom */
 static const _Config DefaultConfig = {
@@ -25,20 +48,18 @@ static const _Config DefaultConfig = {
     GYRO_NORMAL,                // PitchGyroDirection
     GYRO_NORMAL,                // YawGyroDirection
 
-    25,                         // Gain for roll/pitch gyros
-    25,                         // Gain for yaw gyro
-
-    2,                          // Divider for pitch/roll gyros
-    2,                          // Divider for yaw gyro
-
     2,                          // StickP: Roll/Pitch stick P-term
     5,                          // StickD: Roll/Pitch stick D-term
     8,                          // YawStickP: Yaw-stick P-term
 
-    3,                          // Divider for pitch/roll stick
-    4,                          // Divider for yaw stick
-    25,                         // Yaw P
-    9                           // Yaw I
+    {
+        // GyroGain, StickGain, P, PDiv, I, IDiv, D, DDiv, IntegralLimit
+        { 25, 4, 1, 2, 1, 104, 3, 10, 10000 },      // Roll: P 0.5, I 0.0012, D 0.3
+        { 25, 4, 1, 2, 1, 104, 3, 10, 10000 },      // Pitch
+        { 25, 10, 2, 5, 3, 125, 3, 10, 32000 }      // Yaw: P 0.4, I 0.003, D 0.3
+    },
+    { 0, },                     // CustomMixer, empty
+    0                           // Baud: UART_Init()'s
 };
 
 /* Fixed lookup table for TIM1/2 Pulse Width registers */
@@ -70,16 +91,83 @@ __inline void PWM_WriteMotors(void)
     // set motor limits (0 -> 1000)
     for (i = 0; i < MAX_MOTORS; i++) {
         // Clamp final values 0..1000us
-        Motors[i] = CLAMP(Motors[i], 0, 1000);
+        Motors[i] = fix_clamp16(Motors[i], 0, 1000);
         // Our hardware PWM timer uses 0.5us precision, so to turn to PWM pulses, double it
         PWM_SetPulseWidth(i, PULSE_1MS + (Motors[i] << 1));
     }
 }
 
-/* 2ms RTC timer, to make 1s counter */
+static void Sequence_Output(u8 Channel, u8 On)
+{
+    if (Channel == SEQ_BUZZER) {
+        if (On) {
+            BUZZ_ON;
+        } else {
+            BUZZ_OFF;
+        }
+    } else {
+        if (On) {
+            LED_ON;
+        } else {
+            LED_OFF;
+        }
+    }
+}
+
+/* 1ms step of all channels, TIM4 context */
+static void Sequence_Tick(void)
+{
+    _Sequence *s;
+    u8 i;
+
+    for (i = 0; i < SEQ_CHANNELS; i++) {
+        s = &Sequence[i];
+        if (!s->Count || --s->Timer)
+            continue;
+        if (s->On) {
+            Sequence_Output(i, FALSE);
+            s->On = FALSE;
+            s->Timer = s->Delay ? s->Delay : 1;
+        } else if (--s->Count) {
+            Sequence_Output(i, TRUE);
+            s->On = TRUE;
+            s->Timer = s->Length;
+        }
+    }
+}
+
+/* Starts a pattern, replacing whatever the channel was playing */
+static void Sequence_Start(u8 Channel, u8 Count, u16 Length, u16 Delay)
+{
+    _Sequence *s = &Sequence[Channel];
+
+    // idle while the fields change, Count last makes it live again
+    s->Count = 0;
+    if (!Count || !Length)
+        return;
+    s->Length = Length;
+    s->Delay = Delay;
+    s->Timer = Length;
+    s->On = TRUE;
+    Sequence_Output(Channel, TRUE);
+    s->Count = Count;
+}
+
+/* 200us RTC timer: 1s counter, the control loop periods and the sequencer */
 __near __interrupt void TIM4_UPD_OVF_IRQHandler(void)
 {
-    rtc200us++;
+    if (++rtc200us > 4999) {
+        rtc200us = 0;
+        Rtc1sec++;
+    }
+    if (++LoopTick == LOOP_TICKS) {
+        LoopTick = 0;
+        LoopPending++;
+    }
+    if (++SeqTick == SEQ_TICKS) {
+        SeqTick = 0;
+        Sequence_Tick();
+    }
     // Optimize away a call() - TIM4_ClearITPendingBit(TIM4_IT_UPDATE);
     TIM4->SR1 = (u8)(~TIM4_IT_UPDATE);
     // fire off gyro sensor reading (every 200us)...
@@ -148,7 +236,58 @@ static void Acc_Calibration(void)
     // TODO
 }
 
-/* PID loop */
+/*
+ * error * Mul / Div without a 32 bit multiply or divide: both divisions are 16/8 and map onto the hardware
+ * divider (quotient and remainder from one DIV), only the remainder part needs the full precision.
+ */
+static s16 PID_MulDiv(s16 Value, u8 Mul, u8 Div)
+{
+    u16 m, q, r;
+
+    if (Mul == 0 || Div == 0)
+        return 0;
+    m = Value < 0 ? -Value : Value;
+    q = m / Div;
+    r = m % Div;
+    // saturate instead of wrapping with big gains
+    if (q > 32767 / Mul)
+        q = 32767;
+    else
+        q = q * Mul + (u16)(r * Mul) / Div;
+    if (q > 32767)
+        q = 32767;
+    return Value < 0 ? -(s16)q : (s16)q;
+}
+
+/* One rate PID step for Axis, output in motor units (us) */
+static s16 PID_Update(u8 Axis, s16 Error)
+{
+    const _PIDGains *pid = &Config.PID[Axis];
+    s16 limit = pid->IntegralLimit;
+    s16 derivative;
+    s32 sum;
+
+    // D on the change over two loops, as a single 2ms step is mostly gyro noise
+    derivative = Error - errorHistory[Axis][errorIndex];
+    errorHistory[Axis][errorIndex] = Error;
+
+    sum = (s32)integral[Axis] + Error;
+    integral[Axis] = (s16)fix_clamp32(sum, -limit, limit);
+
+    sum = (s32)PID_MulDiv(Error, pid->P, pid->PDiv) + PID_MulDiv(integral[Axis] >> 3, pid->I, pid->IDiv) + PID_MulDiv(derivative, pid->D, pid->DDiv);
+    return (s16)fix_clamp32(sum, -MAX_THROTTLE, MAX_THROTTLE);
+}
+
+u8 PID_SetGains(u8 Axis, const _PIDGains *Gains)
+{
+    if (Axis > YAW || Gains->GyroGain > PID_GYRO_GAIN_MAX || Gains->StickGain > PID_STICK_GAIN_MAX || Gains->IntegralLimit < 0)
+        return FALSE;
+    memcpy(&Config.PID[Axis], Gains, sizeof(_PIDGains));
+    integral[Axis] = 0;
+    return TRUE;
+}
+
+/* Rate PID loop */
 void pidloop(void)
 {
     u8 i;
@@ -158,16 +297,6 @@ void pidloop(void)
     s16 Throttle;                                         // Throttle setpoint
     s16 Yaw;                                              // Yaw setpoint
 
-    float setpoint;
-    float error;
-    static float error_d[3][3] = { 0, };
-    static float error_old[3][3] = { 0, };
-    static float error_sum[3] = { 0, };
-    static u8 index;
-    float p_set;
-    float i_set;
-    float d_set;
-
     // get RC stuff in. ControlChannels[] is updated every 50hz.
     Roll = ControlChannels[RC_ROLL];
     Pitch = ControlChannels[RC_PITCH];
@@ -175,34 +304,35 @@ void pidloop(void)
     Throttle = ControlChannels[RC_THROTTLE];
 
     // prep gyro
-    lgyro[0] = gyro[0] - gyroZero[0];
-    lgyro[1] = gyro[1] - gyroZero[1];
-    lgyro[2] = gyro[2] - gyroZero[2];
+    lgyro[0] = gyroZero[0] - gyro[0];
+    lgyro[1] = gyroZero[1] - gyro[1];
+    lgyro[2] = gyroZero[2] - gyro[2];
 
     // Throttle is low, do stuff like arming etc
     if (Throttle < 0 || !Armed) {
         u8 command = RC_GetCommand();
 
         if (command == RC_COMMAND_ARM) {
-            Beep(1, 500, 0);
-            Armed = TRUE;
-            // printf("Motors Armed!!\r\n");
+            // not before the gyro offsets are in
+            if (GyroCal.State == GYROCAL_DONE) {
+                Beep(1, 200, 0);
+                Armed = TRUE;
+            }
         } else if (command == RC_COMMAND_DISARM) {
+            Beep(2, 200, 100);
             Armed = FALSE;
-            Beep(2, 500, 100);
-            // printf("Motors Disarmed!!\r\n");
         } else if (command == RC_COMMAND_GYROCAL) {
             Beep(3, 50, 50);
-            Gyro_Calibrate();
+            Gyro_CalibrateStart();
         } else if (command == RC_COMMAND_ACCCAL) {
             Beep(2, 50, 50);
             Acc_Calibration();
         }
 
         // Clear out PID integrals
-        error_sum[ROLL] = 0;
-        error_sum[PITCH] = 0;
-        error_sum[YAW] = 0;
+        integral[ROLL] = 0;
+        integral[PITCH] = 0;
+        integral[YAW] = 0;
     } else {
         // Flight Mode
         OldFlightMode = FlightMode;
@@ -216,56 +346,22 @@ void pidloop(void)
         Throttle = MAX_THROTTLE;
 
     // D history
-    index++;
-    index = index % 2;
+    errorIndex ^= 1;
 
     // ROLL
-    if (Config.RollGyroDirection == GYRO_NORMAL)
+    if (Config.RollGyroDirection == GYRO_REVERSED)
         lgyro[ROLL] = -lgyro[ROLL];
-
-    setpoint = Roll * 4.0f; // roll stick position
-    error = (lgyro[ROLL] * 25.0f) - setpoint; // calculate difference between angular velocity and stick position
-    // this calculates the angular velocity
-    error_d[ROLL][index] = error - error_old[ROLL][index];
-    error_old[ROLL][index] = error;
-    d_set = error_d[ROLL][index] * 0.3f; // Kd;
-    error_sum[ROLL] += error; // integrate the above
-    error_sum[ROLL] = CLAMP(error_sum[ROLL], -10000, 10000);
-    p_set = error * 0.5f; // Kp
-    i_set = error * 0.0012f; // Ki
-    Roll = -(p_set + i_set + d_set);
+    Roll = PID_Update(ROLL, Roll * Config.PID[ROLL].StickGain - lgyro[ROLL] * Config.PID[ROLL].GyroGain);
 
     // PITCH
-    if (Config.PitchGyroDirection == GYRO_NORMAL)
+    if (Config.PitchGyroDirection == GYRO_REVERSED)
         lgyro[PITCH] = -lgyro[PITCH];
-
-    setpoint = Pitch * 4.0f; // pitch stick position
-    error = (lgyro[PITCH] * 25.0f) - setpoint; // calculate difference between angular velocity and stick position
-    // this calculates the angular velocity
-    error_d[PITCH][index] = error - error_old[PITCH][index];
-    error_old[PITCH][index] = error;
-    d_set = error_d[PITCH][index] * 0.3f; // Kd;
-    error_sum[PITCH] += error; // integrate the above
-    error_sum[PITCH] = CLAMP(error_sum[PITCH], -10000, 10000);
-    p_set = error * 0.5f; // Kp
-    i_set = error * 0.0012f; // Ki
-    Pitch = -(p_set + i_set + d_set);
+    Pitch = PID_Update(PITCH, Pitch * Config.PID[PITCH].StickGain - lgyro[PITCH] * Config.PID[PITCH].GyroGain);
 
     // YAW
-    if (Config.YawGyroDirection == GYRO_NORMAL)
-            lgyro[YAW] = -lgyro[YAW];
-
-    setpoint = Yaw * 10.0f; // pitch stick position
-    error = (lgyro[YAW] * 25.0f) - setpoint; // calculate difference between angular velocity and stick position
-    // this calculates the angular velocity
-    error_d[YAW][index] = error - error_old[YAW][index];
-    error_old[YAW][index] = error;
-    d_set = error_d[YAW][index] * 0.3f; // Kd;
-    error_sum[YAW] += error; // integrate the above
-    error_sum[YAW] = CLAMP(error_sum[YAW], -32000, 32000);
-    p_set = error * 0.4f; // Kp
-    i_set = error * 0.003f; // Ki
-    Yaw = -(p_set + i_set + d_set);
+    if (Config.YawGyroDirection == GYRO_REVERSED)
+        lgyro[YAW] = -lgyro[YAW];
+    Yaw = PID_Update(YAW, Yaw * Config.PID[YAW].StickGain - lgyro[YAW] * Config.PID[YAW].GyroGain);
 
     // Multirotor mixing (mixer.c)
     Mixer(Throttle, Roll, Pitch, Yaw);
@@ -280,135 +376,254 @@ void pidloop(void)
     PWM_WriteMotors();		// output ESC signal
 }
 
-/* Non-pid rate loop */
-void loop(void)
-{
-    u8 i;
-    s32 emax = 132000;
-    s32 imax, derivative;
-    s32 ppart;
-    s32 ipart;
-    s32 error;
-    s16 lgyro[3]; // loop gyro
+/* Where each ConfigField lives, indexed by the field */
+static const struct {
+    u8 *Data;
+    u8 Size;
+} ConfigFields[CONFIG_FIELDS] = {
+    { Config.ChannelMapping, sizeof(Config.ChannelMapping) },
+    { &Config.Mixer, 1 },
+    { &Config.VoltagePerCellMin, 1 },
+    { &Config.RollGyroDirection, 1 },
+    { &Config.PitchGyroDirection, 1 },
+    { &Config.YawGyroDirection, 1 },
+    { &Config.StickP, 1 },
+    { &Config.StickD, 1 },
+    { &Config.YawStickP, 1 },
+    { (u8 *)&Config.PID[ROLL], sizeof(_PIDGains) },
+    { (u8 *)&Config.PID[PITCH], sizeof(_PIDGains) },
+    { (u8 *)&Config.PID[YAW], sizeof(_PIDGains) },
+    { (u8 *)&Config.CustomMixer, sizeof(_CustomMixer) }
+};
 
-    s16 Roll;					          // Roll setpoint
-    s16 Pitch;                                            // Pitch setpoint
-    s16 Throttle;                                         // Throttle setpoint
-    s16 Yaw;                                              // Yaw setpoint
+/* Data EEPROM layout: CONFIG_VERSION, Config, crc8 of the Config bytes */
+#define EEPROM_CRC          (1 + sizeof(_Config))
 
-    // get RC stuff in. ControlChannels[] is updated every 50hz.
-    Roll = ControlChannels[RC_ROLL];
-    Pitch = ControlChannels[RC_PITCH];
-    Yaw = ControlChannels[RC_YAW];
-    Throttle = ControlChannels[RC_THROTTLE];
+/* Save progress, one step per data EEPROM byte: version cleared, Config, crc, version */
+enum { COMMIT_VERSION_CLEAR = 0, COMMIT_DATA = 1, COMMIT_CRC = 1 + sizeof(_Config), COMMIT_VERSION, COMMIT_IDLE };
 
-    // prep gyro
-    lgyro[0] = gyroZero[0] - gyro[0];
-    lgyro[1] = gyroZero[1] - gyro[1];
-    lgyro[2] = gyroZero[2] - gyro[2];
+static u8 CommitStep = COMMIT_IDLE;
+static u8 CommitCrc;
+static u8 CommitWriting = FALSE;                                     // a byte is being programmed
 
-    // Throttle is low, do stuff like arming etc
-    if (Throttle < 0 || !Armed) {
-        u8 command = RC_GetCommand();
+const u8 *Config_GetField(u8 Field, u8 *Size)
+{
+    if (Field >= CONFIG_FIELDS)
+        return NULL;
+    *Size = ConfigFields[Field].Size;
+    return ConfigFields[Field].Data;
+}
 
-        if (command == RC_COMMAND_ARM) {
-            Beep(1, 200, 0);
-            Armed = TRUE;
-        } else if (command == RC_COMMAND_DISARM) {
-            Beep(2, 200, 100);
-            Armed = FALSE;
-        } else if (command == RC_COMMAND_GYROCAL) {
-            Beep(3, 50, 50);
-            Gyro_Calibrate();
-        } else if (command == RC_COMMAND_ACCCAL) {
-            Beep(2, 50, 50);
-            Acc_Calibration();
-        }
+static u8 Config_CheckField(u8 Field, const u8 *Data)
+{
+    u8 i;
 
-        // Clear out PID integrals
-        integral[ROLL] = 0;
-        integral[PITCH] = 0;
-        integral[YAW] = 0;
-    } else {
-        // Flight Mode
-        OldFlightMode = FlightMode;
-        FlightMode = RC_GetSwitchMode();
+    switch (Field) {
+        case CONFIG_CHANNELMAPPING:
+            for (i = 0; i < sizeof(Config.ChannelMapping); i++) {
+                if (Data[i] >= PPM_NUM_INPUTS)
+                    return FALSE;
+            }
+            break;
+        case CONFIG_MIXER:
+            return Data[0] <= CUSTOM_COPTER;
+        case CONFIG_ROLLGYRODIRECTION:
+        case CONFIG_PITCHGYRODIRECTION:
+        case CONFIG_YAWGYRODIRECTION:
+            return Data[0] <= GYRO_REVERSED;
     }
+    return TRUE;
+}
 
-    // Rescale Throttle to 0..1000us
-    Throttle = (Throttle * 10) >> 3;	// 0-800 -> 0-1000
-    imax = Throttle;
-    if (imax < 0)
-        imax = 0;
+u8 Config_SetField(u8 Field, const u8 *Data, u8 Size)
+{
+    u8 ok;
+
+    if (Field >= CONFIG_FIELDS || Size != ConfigFields[Field].Size)
+        return FALSE;
+
+    switch (Field) {
+        // the only ones to tune in the air
+        case CONFIG_PID_ROLL:
+        case CONFIG_PID_PITCH:
+        case CONFIG_PID_YAW:
+            ok = PID_SetGains(Field - CONFIG_PID_ROLL, (const _PIDGains *)Data);
+            break;
+        case CONFIG_CUSTOMMIXER:
+            ok = Mixer_SetCustom((const _CustomMixer *)Data);
+            break;
+        default:
+            ok = !Armed && Config_CheckField(Field, Data);
+            if (ok)
+                memcpy(ConfigFields[Field].Data, Data, Size);
+            break;
+    }
+    // a save underway starts over, so the EEPROM gets one consistent Config
+    if (ok && CommitStep != COMMIT_IDLE)
+        CommitStep = COMMIT_VERSION_CLEAR;
+    return ok;
+}
 
-    // Limit throttle just in case
-    if (Throttle > MAX_THROTTLE)
-        Throttle = MAX_THROTTLE;
-        
-    // TODO STM8 has hardware division for 8 and 16bit values. There is no need to use shifts.
-    // Rewrite this using proper division factors to allow finer grained control over gains.
-    // Lose GainInADC stuff since there are no pots to twist.
+/* crc8, polynomial 0x07 like afrowii's parameter records */
+static u8 Config_Crc8(u8 Crc, u8 Data)
+{
+    u8 i;
 
-    // ROLL
-    lgyro[ROLL] = (lgyro[ROLL] * Config.RollPitchGyroGain) >> Config.RollPitchGyroDiv;
-    if (Config.RollGyroDirection == GYRO_REVERSED)
-        lgyro[ROLL] = -lgyro[ROLL];
-    Roll -= lgyro[ROLL];
+    Crc ^= Data;
+    for (i = 0; i < 8; i++)
+        Crc = (Crc & 0x80) ? (u8)((Crc << 1) ^ 0x07) : (u8)(Crc << 1);
+    return Crc;
+}
 
-    // PITCH
-    lgyro[PITCH] = (lgyro[PITCH] * Config.RollPitchGyroGain) >> Config.RollPitchGyroDiv;
-    if (Config.PitchGyroDirection == GYRO_REVERSED)
-            lgyro[PITCH] = -lgyro[PITCH];
-    Pitch -= lgyro[PITCH];
+/* Anything but a matching version and crc (blank chip, older layout, a save cut short) loads the defaults */
+static void Config_Load(void)
+{
+    const u8 *eeprom = (const u8 *)(u16)FLASH_DATA_START_PHYSICAL_ADDRESS;
+    u8 i, crc = 0;
+
+    for (i = 0; i < sizeof(Config); i++)
+        crc = Config_Crc8(crc, eeprom[1 + i]);
+    if (eeprom[0] == CONFIG_VERSION && eeprom[EEPROM_CRC] == crc)
+        memcpy(&Config, eeprom + 1, sizeof(Config));
+    else
+        memcpy(&Config, &DefaultConfig, sizeof(Config));
+}
 
-    // YAW
-    lgyro[YAW] = (lgyro[YAW] * Config.YawGyroGain) >> Config.YawGyroDiv;
-    if (Config.YawGyroDirection == GYRO_REVERSED)
-            lgyro[YAW] = -lgyro[YAW];
-
-#if 1
-    // Yaw PID
-    error = Yaw - lgyro[YAW];
-    ppart = error * Config.YawP;
-    ppart = CLAMP(ppart, -emax, emax);
-
-    integral[YAW] += error;
-    ipart = integral[YAW] * Config.YawI;
-    ipart = CLAMP(ipart, -imax, imax);
-
-    derivative = (s16)(error - last_error[YAW]);
-    last_error[YAW] = error;
-    Yaw += (s16)(ppart >> 4) + (s16)(ipart >> 4) + (s16)(derivative >> 4);
-#else
-    // Yaw normal
-    Yaw -= lgyro[YAW];
-#endif
+u8 Config_Save(void)
+{
+    if (Armed)
+        return FALSE;
+    // a save already underway starts over, picking up whatever changed since
+    CommitStep = COMMIT_VERSION_CLEAR;
+    return TRUE;
+}
 
-    // Multirotor mixing (mixer.c)
-    Mixer(Throttle, Roll, Pitch, Yaw);
+u8 Config_Saving(void)
+{
+    return CommitStep != COMMIT_IDLE;
+}
 
-    // Kill off motors when not armed. Really.
-    if (Throttle < 0 || !Armed) {
-        for (i = 0; i < MAX_MOTORS; i++)
-            Motors[i] = 0;
+/*
+ * One step of a queued save, from the loop's slack. The data EEPROM programs a byte (~3ms) while the
+ * program flash keeps running, so a step only starts a byte or notices it finished; the loop never waits
+ * for the EEPROM. Only bytes that differ are programmed, and the version goes last so a save that's cut
+ * short doesn't load. Paused while armed.
+ */
+static void Config_Update(void)
+{
+    u8 *eeprom = (u8 *)(u16)FLASH_DATA_START_PHYSICAL_ADDRESS;
+    u8 offset, data;
+
+    if (CommitWriting) {
+        // reading clears EOP, no polling it twice
+        if (!(FLASH->IAPSR & FLASH_IAPSR_EOP))
+            return;
+        CommitWriting = FALSE;
+        if (CommitStep == COMMIT_IDLE)
+            FLASH->IAPSR &= (u8)(~FLASH_IAPSR_DUL);
+    }
+    if (CommitStep == COMMIT_IDLE || Armed)
+        return;
+
+    if (CommitStep == COMMIT_VERSION_CLEAR) {
+        // unlock data EEPROM
+        FLASH->DUKR = FLASH_RASS_KEY2;
+        FLASH->DUKR = FLASH_RASS_KEY1;
+        CommitCrc = 0;
+        offset = 0;
+        data = 0;
+    } else if (CommitStep < COMMIT_CRC) {
+        offset = CommitStep;
+        data = ((const u8 *)&Config)[CommitStep - COMMIT_DATA];
+        CommitCrc = Config_Crc8(CommitCrc, data);
+    } else if (CommitStep == COMMIT_CRC) {
+        offset = EEPROM_CRC;
+        data = CommitCrc;
+    } else {
+        offset = 0;
+        data = CONFIG_VERSION;
     }
 
-    // Output to ESCs
-    PWM_WriteMotors();		// output ESC signal
+    if (eeprom[offset] != data) {
+        (void)FLASH->IAPSR;     // reading clears a stale EOP
+        eeprom[offset] = data;
+        CommitWriting = TRUE;
+    }
+    if (++CommitStep == COMMIT_IDLE && !CommitWriting)
+        FLASH->IAPSR &= (u8)(~FLASH_IAPSR_DUL);
+}
+
+/* us since the last loop period started, counting periods that started since */
+static u16 Loop_Elapsed(void)
+{
+    u8 ticks, count;
+
+    disableInterrupts();
+    ticks = LoopPending * LOOP_TICKS + LoopTick;
+    count = TIM4->CNTR;
+    // wrapped but not serviced yet, the count is already of the next tick
+    if (TIM4->SR1 & TIM4_IT_UPDATE) {
+        ticks++;
+        count = TIM4->CNTR;
+    }
+    enableInterrupts();
+    return ticks * TICK_US + count * TIM4_COUNT_US;
+}
+
+/*
+ * Low priority work in the slack after the flight step. Each task only starts while the current period
+ * has time left, whatever doesn't fit waits for a later loop.
+ */
+static void Loop_Background(void)
+{
+    // we "receive" signals often, which set flags. then transmit will happen less often.
+    if (LoopPending)
+        return;
+    UART_ReceiveTelemetry();
+
+    // see if we wanna process anything (250Hz)
+    if (LoopPending)
+        return;
+    if (Loop % 2 == 0)
+        UART_TransmitTelemetry();
+
+    // Low-priority loop activities, ~10Hz (later when the slack runs short)
+    if (LoopPending)
+        return;
+    if (Loop >= 50) {
+        if (Voltage_Check()) {
+            // keep the alarm going, feedback beeps (arming etc) still get through between
+            if (!Sequence[SEQ_BUZZER].Count)
+                Beep(1, 100, 0);
+            if (!Sequence[SEQ_LED].Count)
+                Led_Blink(255, 100, 100);
+            FLAG_SET(FCFlags, FC_FLAG_LOWVOLTAGE);
+        } else if (FLAG_ISSET(FCFlags, FC_FLAG_LOWVOLTAGE)) {
+            FLAG_CLEAR(FCFlags, FC_FLAG_LOWVOLTAGE);
+            Led_Blink(0, 0, 0);
+        }
+        Loop = 0;
+    }
+
+    // queued config save, a byte at a time
+    if (LoopPending)
+        return;
+    Config_Update();
 }
 
 void main(void)
 {
     u8 i;
-    u16 rtcOld;
+    u8 pending;
+    u16 busy;
 
     HW_Init();                  // Clocks, GPIO, PWM, I2C
     UART_Init();                // UART
     RC_Init();                  // PPM Input
     Sensors_Init();             // ADC + SPI Sensors
     
-    // TODO eeprom
-    memcpy(&Config, &DefaultConfig, sizeof(Config));
+    Config_Load();
+    UART_BaudBoot();            // the rate the last ground station settled on
 
     // Enable interrupts to start stuff up
     enableInterrupts();
@@ -421,77 +636,74 @@ void main(void)
 
     // Check sticks
     RC_Calibrate(1);
-    // Check gyro/motion
-    Gyro_Calibrate();
-
-    // blink the led for lulz again
-    for (i = 0; i < 5; i++) {
-        LED_TOGGLE;
-        delay_ms(200);
-    }
-
     LED_OFF;
+    // Check gyro/motion, finishes in the main loop
+    Gyro_CalibrateStart();
 
     // 0.8 second final beep
     Beep(1, 500, 400);
-    // Battery check (will beep number of cells)
+    Beep_Wait();
+    // Battery check (will beep number of cells, while the loop already runs)
     Voltage_Init();
 
-    // main loop
+    // main loop, one pass per TIM4 loop period (500Hz)
+    LoopPending = 0;
     while (1) {
-        if (rtc200us > 4999) {
-            rtc200us = 0;
-            Rtc1sec++;
+        // sleep until the period starts. An interrupt landing between the test and wfi only delays the
+        // wakeup to the next one, the ADC end of conversion follows every tick within a few us
+        while (!LoopPending)
+            wfi();
+        disableInterrupts();
+        pending = LoopPending;
+        LoopPending = 0;
+        enableInterrupts();
+        // more than one period passed: the last loop ran into this one, and periods were skipped.
+        // Only counted armed, beeps and calibration block on the ground
+        if (pending > 1 && Armed) {
+            LoopStats.Overruns++;
+            LoopStats.Skipped += pending - 1;
         }
-        rtcOld = rtc200us;
         Loop++;
- 
-        // This checks for "Commands" from RC module. Returns stuff like arm/disarm/calibrate/etc
-        RC_Update();
-
-        // Main flight loop, don't call it THAT often :)
-#if 0
-        pidloop();
-#else
-        loop();
-#endif
-
-        // let's try: we "receive" signals often, which set flags. then transmit will happen less often. or something.
-        UART_ReceiveTelemetry();
-        
-        // see if we wanna process anything (250Hz)
-        if (Loop % 2 == 0)
-            UART_TransmitTelemetry();
-
-        // Low-priority loop activities
-        if (Loop > 50) {
-            if (Voltage_Check()) {
-                FLAG_SET(FCFlags, FC_FLAG_LOWVOLTAGE);
-                BUZZ_ON;
-            } else {
-                FLAG_CLEAR(FCFlags, FC_FLAG_LOWVOLTAGE);
-                BUZZ_OFF;
-            }
-            Loop = 0;
-        }
 
-        // artificial delay
         // update + average sensors
         Sensors_ReadACC();
         Sensors_ReadADC();
-        while (rtc200us % 10 != 0); // idle until loop reaches 500Hz
+
+        // This checks for "Commands" from RC module. Returns stuff like arm/disarm/calibrate/etc
+        RC_Update();
+        Gyro_CalibrateUpdate();
+
+        // Main flight loop
+        pidloop();
+        busy = Loop_Elapsed();
+        LoopStats.Flight = busy;
+        if (busy > LoopStats.FlightMax)
+            LoopStats.FlightMax = busy;
+
+        Loop_Background();
+        busy = Loop_Elapsed();
+        if (busy > LoopStats.BusyMax)
+            LoopStats.BusyMax = busy;
     }
 }
 
-// Blocking Beep (not ISR-based)
+// Non-blocking, played by the TIM4 sequencer
 void Beep(u8 Count, u16 Length, u16 Delay)
 {
-    u8 i;
+    Sequence_Start(SEQ_BUZZER, Count, Length, Delay);
+}
 
-    for (i = 0; i < Count; i++) {
-        BUZZ_ON;
-        delay_ms(Length);
-        BUZZ_OFF;
-        delay_ms(Delay);
-    }
+// Setup code that wants the beeps to pace it
+void Beep_Wait(void)
+{
+    while (Sequence[SEQ_BUZZER].Count)
+        wfi();
+}
+
+// Non-blocking LED pattern, Count 0 stops it (LED off)
+void Led_Blink(u8 Count, u16 Length, u16 Delay)
+{
+    Sequence_Start(SEQ_LED, Count, Length, Delay);
+    if (!Count)
+        LED_OFF;
 }
@@ -27,13 +27,25 @@ typedef int32_t s32;
 typedef volatile int32_t vs32;
 #define __inline inline
 #define __near 
+#define __tiny
 #define __interrupt
 #else /* _MSC_VER */
 #define __inline @inline
 #define __near @near
+#define __tiny @tiny                    // zero page: one byte direct addressing, for the loop's hot state only
 #define __interrupt @interrupt
+// Cosmic has no stdint.h, the headers shared with afrowii want these names
+typedef u8 uint8_t;
+typedef u16 uint16_t;
+typedef u32 uint32_t;
+typedef s8 int8_t;
+typedef s16 int16_t;
+typedef s32 int32_t;
 #endif
 
+#include "../afrowii/fixmath.h"                                          // clamps and Q multiplies, shared with afrowii and CShred
+#include "../afrowii/hwreg.h"                                            // register accessors for the interrupt handlers, shared with afrowii
+
 #define ADC_GYRO_ROLL	(0)
 #define ADC_GYRO_PITCH	(1)
 #define ADC_GYRO_YAW	(2)
@@ -83,13 +95,44 @@ enum {
 };
 
 #define MAX_LIPO_CELL_VOLTAGE (43)
-#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
 
 enum GyroDirection { GYRO_NORMAL = 0, GYRO_REVERSED };
 enum GyroArrayIndex { ROLL = 0, PITCH, YAW };
 enum MotorIndex { MOTOR1 = 0, MOTOR2, MOTOR3, MOTOR4, MOTOR5, MOTOR6 };
 enum FlightControlMode { FC_MODE_ACRO = 0, FC_MODE_HOVER, FC_MODE_DONGS };
 
+/* Rate PID gains of one axis. The error is Stick * StickGain - gyro * GyroGain, each term is error * N / Div
+   through the 16/8 hardware divider, a Div of 0 turns the term off. */
+typedef struct _PIDGains {
+    u8 GyroGain;                        // gyro counts into the error, up to PID_GYRO_GAIN_MAX
+    u8 StickGain;                       // stick into the error (setpoint), up to PID_STICK_GAIN_MAX
+    u8 P;                               // P-term
+    u8 PDiv;
+    u8 I;                               // I-term, applied to the integral / 8
+    u8 IDiv;
+    u8 D;                               // D-term, applied to the change of the error over two loops
+    u8 DDiv;
+    s16 IntegralLimit;                  // integral clamp, error units
+} _PIDGains;
+
+#define PID_GYRO_GAIN_MAX   (31)        // 10 bit gyro * 31 stays clear of 16 bits
+#define PID_STICK_GAIN_MAX  (15)
+
+/* Mixer coefficients of one motor in 1/MIX_ONE, MIX_ONE * 1000us still fits 16 bits */
+#define MIX_ONE             (32)
+
+typedef struct _MotorMix {
+    s8 Throttle;
+    s8 Roll;
+    s8 Pitch;
+    s8 Yaw;
+} _MotorMix;
+
+typedef struct _CustomMixer {
+    u8 Motors;                          // motor count, 0..MAX_MOTORS
+    _MotorMix Mix[MAX_MOTORS];
+} _CustomMixer;
+
 typedef struct _Config {
     u8 ChannelMapping[6];               // Individual RC channels mapping
     u8 Mixer;                           // Selected Mixer (Tri,  Quad, etc)
@@ -98,23 +141,51 @@ typedef struct _Config {
     u8 PitchGyroDirection;              // Direction of Pitch gyro
     u8 YawGyroDirection;                // Direction of Yaw gyro
     
-    u8 RollPitchGyroGain;               // Gain for roll/pitch gyros
-    u8 YawGyroGain;                     // Gain for yaw gyro
-    
-    u8 RollPitchGyroDiv;                // Divider for pitch/roll gyros
-    u8 YawGyroDiv;                      // Divider for yaw gyro
-    
     u8 StickP;                          // Roll/Pitch stick P-term
     u8 StickD;                          // Roll/Pitch stick D-term
     u8 YawStickP;                       // Yaw-stick P-term
     
-    u8 RollPitchStickGain;              // Divider for pitch/roll stick
-    u8 YawStickGain;                    // Divider for yaw stick
-    u8 YawP;                            // Yaw P
-    u8 YawI;                            // Yaw I
+    _PIDGains PID[3];                   // Rate PID per axis [ ROLL | PITCH | YAW ]
+    _CustomMixer CustomMixer;           // Motor table of the CUSTOM_COPTER mixer
+    u8 Baud;                            // UART rate to boot at, set by the 'B' negotiation, not a field
 } _Config;
 
+/* Config fields for the UART field access, in _Config order */
+enum ConfigField {
+    CONFIG_CHANNELMAPPING = 0, CONFIG_MIXER, CONFIG_VOLTAGEPERCELLMIN, CONFIG_ROLLGYRODIRECTION,
+    CONFIG_PITCHGYRODIRECTION, CONFIG_YAWGYRODIRECTION, CONFIG_STICKP, CONFIG_STICKD, CONFIG_YAWSTICKP,
+    CONFIG_PID_ROLL, CONFIG_PID_PITCH, CONFIG_PID_YAW, CONFIG_CUSTOMMIXER,
+    CONFIG_FIELDS
+};
+
+/* Control loop timing, all times in us from the start of the loop period (LOOP_TICKS * 200us) */
+typedef struct _LoopStats {
+    u16 Overruns;                       // loops that ran past their period
+    u16 Skipped;                        // periods lost to them
+    u16 Flight;                         // sensors + RC + PID + motors of the last loop
+    u16 FlightMax;
+    u16 BusyMax;                        // flight plus background work
+} _LoopStats;
+
 extern _Config Config;
-extern s16 Motors[MAX_MOTORS];
+extern __tiny s16 Motors[MAX_MOTORS];
+extern _LoopStats LoopStats;
 
+/* Count beeps of Length ms with Delay ms between, played from the TIM4 tick without blocking */
 void Beep(u8 Count, u16 Length, u16 Delay);
+/* Waits until the beeps are played, for setup code only */
+void Beep_Wait(void);
+/* LED pattern like Beep(), Count 0 stops it */
+void Led_Blink(u8 Count, u16 Length, u16 Delay);
+/* Replace the gains of one axis, FALSE if they're out of range */
+u8 PID_SetGains(u8 Axis, const _PIDGains *Gains);
+/* Replace the CUSTOM_COPTER table, FALSE if it's out of range or in use while armed */
+u8 Mixer_SetCustom(const _CustomMixer *Mix);
+/* Config field and its size, NULL for an unknown field */
+const u8 *Config_GetField(u8 Field, u8 *Size);
+/* Replace one field, FALSE if the size or the value is off, or it can't change while armed (all but the PIDs) */
+u8 Config_SetField(u8 Field, const u8 *Data, u8 Size);
+/* Queue writing Config to the data EEPROM, done in the loop's slack while disarmed. FALSE while armed */
+u8 Config_Save(void);
+/* TRUE while a save is still being written */
+u8 Config_Saving(void);
@@ -1,72 +1,106 @@
 #include "main.h"
 
-void Mixer(s16 Throttle, s16 Roll, s16 Pitch, s16 Yaw)
+/*
+ * Motor tables, coefficients in 1/MIX_ONE. Motors are numbered from motor 1 at the front around towards
+ * the +Roll side: Pitch is cos and Roll is sin of that angle, Yaw alternates with the prop direction.
+ */
+static const _MotorMix MixQuad[] = {
+    { MIX_ONE,         0,  MIX_ONE, -MIX_ONE },
+    { MIX_ONE,   MIX_ONE,        0,  MIX_ONE },
+    { MIX_ONE,  -MIX_ONE,        0,  MIX_ONE },
+    { MIX_ONE,         0, -MIX_ONE, -MIX_ONE }
+};
+
+// halve the power because we got 2 motors per axis
+static const _MotorMix MixQuadX[] = {
+    { MIX_ONE,  16,  16, -MIX_ONE },
+    { MIX_ONE, -16,  16,  MIX_ONE },
+    { MIX_ONE, -16, -16, -MIX_ONE },
+    { MIX_ONE,  16, -16,  MIX_ONE }
+};
+
+// 28/32 ~ sin 60
+static const _MotorMix MixHex[] = {
+    { MIX_ONE,   0,  MIX_ONE, -MIX_ONE },
+    { MIX_ONE,  28,  16,  MIX_ONE },
+    { MIX_ONE,  28, -16, -MIX_ONE },
+    { MIX_ONE,   0, -MIX_ONE,  MIX_ONE },
+    { MIX_ONE, -28, -16, -MIX_ONE },
+    { MIX_ONE, -28,  16,  MIX_ONE }
+};
+
+static const _MotorMix MixHexX[] = {
+    { MIX_ONE,  16,  28, -MIX_ONE },
+    { MIX_ONE,  MIX_ONE,   0,  MIX_ONE },
+    { MIX_ONE,  16, -28, -MIX_ONE },
+    { MIX_ONE, -16, -28,  MIX_ONE },
+    { MIX_ONE, -MIX_ONE,   0, -MIX_ONE },
+    { MIX_ONE, -16,  28,  MIX_ONE }
+};
+
+// coaxial: 1/2 front pair, 4/5 below them, 3/6 the rear arm
+static const _MotorMix MixY6[] = {
+    { MIX_ONE,  28,  16, -MIX_ONE },
+    { MIX_ONE, -28,  16, -MIX_ONE },
+    { MIX_ONE,   0, -MIX_ONE,  MIX_ONE },
+    { MIX_ONE,  28,  16,  MIX_ONE },
+    { MIX_ONE, -28,  16,  MIX_ONE },
+    { MIX_ONE,   0, -MIX_ONE, -MIX_ONE }
+};
+
+#define MIXER(t)    { t, sizeof(t) / sizeof(_MotorMix) }
+
+static const struct {
+    const _MotorMix *Mix;
+    u8 Motors;
+} MixerTable[] = {
+    { NULL, 0 },                // TRI_COPTER
+    MIXER(MixQuad),             // QUAD_COPTER
+    MIXER(MixQuadX),            // QUAD_X_COPTER
+    { NULL, 0 },                // Y4_COPTER
+    MIXER(MixHex),              // HEX_COPTER
+    MIXER(MixY6),               // Y6_COPTER
+    MIXER(MixHexX),             // HEX_X_COPTER
+};
+
+u8 Mixer_SetCustom(const _CustomMixer *Mix)
 {
     u8 i;
 
-    if (Config.Mixer == QUAD_COPTER) {
-        for (i = 0; i < 4; i++)
-            Motors[i] = Throttle;
-        // (Add) Adjust roll gyro output to motors
-        Motors[MOTOR2] += Roll;
-        Motors[MOTOR3] -= Roll;
-        // (Add) Adjust pitch gyro output to motors
-        Motors[MOTOR1] += Pitch;
-        Motors[MOTOR4] -= Pitch;
-        // (Add) Adjust yaw gyro output to motors
-        Motors[MOTOR1] -= Yaw;
-        Motors[MOTOR2] += Yaw;
-        Motors[MOTOR3] += Yaw;
-        Motors[MOTOR4] -= Yaw;
-    } else if (Config.Mixer ==  QUAD_X_COPTER) {
-        for (i = 0; i < 4; i++)
-            Motors[i] = Throttle;
-	// Roll
-	Roll = Roll >> 1; // halve the power because we got 2 motors
-        Motors[MOTOR1] += Roll;
-        Motors[MOTOR2] -= Roll;
-        Motors[MOTOR3] -= Roll;
-        Motors[MOTOR4] += Roll;
-        // Pitch
-	Pitch = Pitch >> 1; // halve the power because we got 2 motors
-        Motors[MOTOR1] += Pitch;
-        Motors[MOTOR2] += Pitch;
-        Motors[MOTOR3] -= Pitch;
-        Motors[MOTOR4] -= Pitch;
-        // Yaw
-        Motors[MOTOR1] -= Yaw;
-        Motors[MOTOR2] += Yaw;
-        Motors[MOTOR3] -= Yaw;
-        Motors[MOTOR4] += Yaw;
-    } else if (Config.Mixer == Y6_COPTER) {
-        for (i = 0; i < 6; i++)
-            Motors[i] = Throttle;
-	// Roll
-	Roll = (Roll * 7) >> 3;
-        Motors[MOTOR1] += Roll;
-        Motors[MOTOR4] += Roll;
-        Motors[MOTOR2] -= Roll;
-        Motors[MOTOR5] -= Roll;
-	// Pitch
-        Motors[MOTOR3] -= Pitch;
-        Motors[MOTOR6] -= Pitch;
-	Pitch = Pitch >> 1; // halve the power because we got 2 motors
-        Motors[MOTOR1] += Pitch;
-        Motors[MOTOR2] += Pitch;
-        Motors[MOTOR4] += Pitch;
-        Motors[MOTOR5] += Pitch;
-	// Yaw
-        Motors[MOTOR1] -= Yaw;
-        Motors[MOTOR2] -= Yaw;
-        Motors[MOTOR3] += Yaw;
-        Motors[MOTOR4] += Yaw;
-        Motors[MOTOR5] += Yaw;
-        Motors[MOTOR6] -= Yaw;
+    // don't swap the table of the frame in the air
+    if (Mix->Motors > MAX_MOTORS || (Armed && Config.Mixer == CUSTOM_COPTER))
+        return FALSE;
+    for (i = 0; i < Mix->Motors; i++) {
+        if (Mix->Mix[i].Throttle < 0 || Mix->Mix[i].Throttle > MIX_ONE || abs(Mix->Mix[i].Roll) > MIX_ONE || abs(Mix->Mix[i].Pitch) > MIX_ONE || abs(Mix->Mix[i].Yaw) > MIX_ONE)
+            return FALSE;
+    }
+    memcpy(&Config.CustomMixer, Mix, sizeof(_CustomMixer));
+    return TRUE;
+}
+
+/* One pass over the active table: Throttle and the PID outputs (each within +-1000us) times the coefficients */
+void Mixer(s16 Throttle, s16 Roll, s16 Pitch, s16 Yaw)
+{
+    const _MotorMix *mix;
+    u8 i, count;
+
+    if (Config.Mixer == CUSTOM_COPTER) {
+        mix = Config.CustomMixer.Mix;
+        count = Config.CustomMixer.Motors;
+    } else if (Config.Mixer < CUSTOM_COPTER) {
+        mix = MixerTable[Config.Mixer].Mix;
+        count = MixerTable[Config.Mixer].Motors;
+    } else {
+        count = 0;
     }
 
-    // Limit lowest motor  value to avoid stopping motor
-    for (i = 0; i < MAX_MOTORS; i++) {
+    for (i = 0; i < count; i++, mix++) {
+        Motors[i] = ((Throttle * mix->Throttle) >> 5) + ((Roll * mix->Roll) >> 5) + ((Pitch * mix->Pitch) >> 5) + ((Yaw * mix->Yaw) >> 5);
+        // Limit lowest motor  value to avoid stopping motor
         if (Motors[i] < MIN_THROTTLE)
             Motors[i] = MIN_THROTTLE;
     }
+    // outputs the frame doesn't use stay stopped
+    for (; i < MAX_MOTORS; i++)
+        Motors[i] = 0;
 }
@@ -5,8 +5,12 @@ static u8 ControlChannelsReceived = 0;
 static u8 GoodPulses = 0;
 static u8 PulseIndex;
 static u16 PreviousValue;
-static u16 CurrentValue;
-static u16 CapturedValue;
+/* The ISR only stores the edge to edge times (timer ticks) in PulseWidth[PulseFront ^ 1] and flips PulseFront
+   at the sync gap, RC_Decode() checks and converts them in the main loop */
+static u16 PulseWidth[2][PPM_NUM_INPUTS];
+static volatile u8 PulseFront = 0;
+static volatile u8 PulseCount;                                                  // channels in PulseWidth[PulseFront]
+static volatile u8 PulseReady = 0;
 static s16 CaptureValue[PPM_NUM_INPUTS];
 static s16 PrevCaptureValue[PPM_NUM_INPUTS];
 
@@ -19,41 +23,54 @@ static u8 LastRCCommand = RC_COMMAND_NONE;
 static u16 CommandTimer = 0;
 
 /* Exported 4 control channels, for faster access. The rest are accessed through RC_GetChannel() */
-s16 ControlChannels[4] = { 0, 0, 0, 0 };
+__tiny s16 ControlChannels[4] = { 0, 0, 0, 0 };
 
 __near __interrupt void TIM3_CAP_COM_IRQHandler(void)
 {
-    if (TIM3_GetITStatus(TIM3_IT_CC1) == SET) {
-        PreviousValue = CurrentValue;
-        CurrentValue = TIM3_GetCapture1();
-    }
+    u16 CurrentValue = tim3_capture1();
+    u16 CapturedValue = CurrentValue - PreviousValue;                           // wraps the timer overflow right
 
-    TIM3_ClearITPendingBit(TIM3_IT_CC1);
-    
-    if (CurrentValue > PreviousValue) {
-        CapturedValue = (CurrentValue - PreviousValue);
-    } else {
-        CapturedValue = ((0xFFFF - PreviousValue) + CurrentValue);
-    }
+    tim3_cc1Clear();
+    PreviousValue = CurrentValue;
 
     if (CapturedValue > 8000) {
+        // sync gap. While the front frame waits to be decoded, this one is dropped
+        if (PulseIndex && !PulseReady) {
+            PulseCount = PulseIndex;
+            PulseFront ^= 1;
+            PulseReady = 1;
+        }
         PulseIndex = 0;
-    } else if (CapturedValue > 1500 && CapturedValue < 4500) { // div2, 750 to 2250 ms
-        if (PulseIndex < PPM_NUM_INPUTS) {
-            s16 tmp = CapturedValue >> 1;
+    } else if (PulseIndex < PPM_NUM_INPUTS) {
+        PulseWidth[PulseFront ^ 1][PulseIndex++] = CapturedValue;
+    }
+}
+
+// Take over the frame the ISR published since the last call, called from the main loop
+static void RC_Decode(void)
+{
+    const u16 *frame;
+    u8 i;
+
+    if (!PulseReady)
+        return;
+    frame = PulseWidth[PulseFront];
+    for (i = 0; i < PulseCount; i++) {
+        if (frame[i] > 1500 && frame[i] < 4500) {                               // div2, 750 to 2250 ms
+            s16 tmp = frame[i] >> 1;
             // save channel difference for expo calculation and trash lower few bits to reduce noise
-            PrevCaptureValue[PulseIndex] = ((tmp - CaptureValue[PulseIndex]) / 3) * 3;
-            CaptureValue[PulseIndex] = tmp;
+            PrevCaptureValue[i] = ((tmp - CaptureValue[i]) / 3) * 3;
+            CaptureValue[i] = tmp;
 
             // let the rest of the code know we got enough to do stick inputs
-            if (PulseIndex >= 4)
+            if (i >= 4)
                 ControlChannelsReceived = 1;
 
-            PulseIndex++;
             if (GoodPulses < 200)
                 GoodPulses += 10;
         }
     }
+    PulseReady = 0;                                                             // the ISR may flip PulseFront again
 }
 
 void RC_Init(void)
@@ -61,8 +78,7 @@ void RC_Init(void)
     u8 i;
     PulseIndex = 0;
     PreviousValue = 0;
-    CurrentValue = 0;
-    CapturedValue = 0;
+    PulseReady = 0;
     GoodPulses = 0;
     
     for (i = 0; i < PPM_NUM_INPUTS; i++) {
@@ -94,6 +110,7 @@ void RC_Calibrate(u8 MotorsEnable)
 	do {
 	    // switch and throttle stick must be zero in order to proceed
             vu16 sw, th;
+            RC_Decode();
             sw = RC_GetChannel(RC_SWITCH);
             th = RC_GetChannel(RC_THROTTLE);
 	    if (GoodPulses < 100 || sw > 1200 || th > 1200) {
@@ -108,6 +125,7 @@ void RC_Calibrate(u8 MotorsEnable)
 		LED_TOGGLE;	// give signal to pilot
                 // 75 ms delay
                 Beep(3, 15, 10); // beep attention
+                Beep_Wait();
 	    }
 	    delay_ms(1);
 	} while (SignalGood < 500);
@@ -150,7 +168,10 @@ u8 RC_GetSwitchMode(void)
 
 void RC_Update(void)
 {
-    u8 command = _RCCommand();
+    u8 command;
+
+    RC_Decode();
+    command = _RCCommand();
 
     // decrement signal level... too many loops without rx input and we're in emergency mode
     if (GoodPulses) {
@@ -20,7 +20,7 @@ u8 RC_GetQuality(void);
 
 /* These are the 4 main control channels - roll/pitch/yaw/throttle. They will update in about 50Hz - so we
    can save time from recalculating stick parameters in main loop. use RC_XXX defines to access indexes */
-extern s16 ControlChannels[4];
+extern __tiny s16 ControlChannels[4];
 
 #define RC_THROTTLE             (0)
 #define RC_PITCH                (1)
@@ -7,7 +7,11 @@
 #define ADXL_MULTI_BIT     0x40
 #define ADXL_X0_ADDR       0x32
 #define ADXL_RATE_ADDR     0x2C
+#define ADXL_INT_ENABLE_ADDR 0x2E
+#define ADXL_INT_MAP_ADDR  0x2F
+#define ADXL_INT_WATERMARK 0x02
 #define ADXL_FIFO_ADDR     0x38
+#define ADXL_FIFO_STATUS_ADDR 0x39
 #define ADXL_RATE_100      0x0A
 #define ADXL_RATE_200      0x0B
 #define ADXL_RATE_400      0x0C
@@ -24,53 +28,62 @@
 #define ADXL_RANGE_8G      0x02
 #define ADXL_RANGE_16G     0x03
 #define ADXL_FIFO_STREAM   0x80
+// FIFO entries per INT1 watermark interrupt: 3200Hz / 6, a little faster than the 500Hz loop
+#define ADXL_WATERMARK     6
+#define ADXL_INT_HIGH      (GPIO_ReadInputPin(GPIOD, GPIO_PIN_0))
+// restart the sums before they overflow s16, as the ADC does
+#define ACC_SUM_MAX        15
+
+#define GYRO_CAL_SAMPLES   32                                // * 1023 still fits the u16 sums
+#define GYRO_CAL_INTERVAL  8                                 // loops between samples, 32 x 16ms
+#define GYRO_CAL_SPREAD    4                                 // max - min per axis, counts
+#define GYRO_ZERO_MIN      300
+#define GYRO_ZERO_MAX      500
 
 // Perform a lowpass filter on acc data instead of averaging noise
 #define LOWPASS_ACC
 
 /* Gyro Pitch/Roll/Yaw final measurements */
-vs16 gyro[3] = { 512, 512, 512 };
+__tiny vs16 gyro[3] = { 512, 512, 512 };
 /* Accelerometer X/Y/Z */
 vs16 acc[3] = { 0, 0, 0 };
 /* Battery voltage, v * 10 */
 vs16 battery = 100;
 /* Gyro offsets */
-s16 gyroZero[3] = { 0, 0, 0 };                                // used for calibrating Gyros on ground
+__tiny s16 gyroZero[3] = { 0, 0, 0 };                         // used for calibrating Gyros on ground
+/* Gyro calibration progress */
+_GyroCal GyroCal = { GYROCAL_IDLE, 0, 0 };
 
 /* Accumulated sensor values - this is set by ADC and SPI read interrupts */
 /* 0:Pitch 1:Roll 2:Yaw 3:Battery Voltage 4:AX 5:AY 6:AZ */
 static vs16 sensorInputs[7] = { 0, };
 /* How many samples are added up in sensorInputs[0..3] by 200us ADC interrupt */
 static u8 adcSampleCount = 0;
+/* How many samples are in sensorInputs[4..6], from the accel FIFO interrupt */
+static vu8 accSampleCount = 0;
+/* Gyro calibration running sums */
+static u16 calSum[3], calMin[3], calMax[3];
+static u8 calTick;
 
 static u16 batteryWarning;	// Battery Warning Voltage
 static u16 voltageLevel = 100;	// Battery Voltage
 
+// SPI registers directly, these run several hundred times per FIFO drain
 static u8 ADXL_WriteByte(u8 Data)
 {
     /* Wait until the transmit buffer is empty */
-    while (SPI_GetFlagStatus(SPI_FLAG_TXE) == RESET);
+    while (!(SPI->SR & SPI_SR_TXE));
     /* Send the byte */
-    SPI_SendData(Data);
+    SPI->DR = Data;
     /* Wait to receive a byte*/
-    while(SPI_GetFlagStatus(SPI_FLAG_RXNE) == RESET);
+    while (!(SPI->SR & SPI_SR_RXNE));
     /*Return the byte read from the SPI bus */ 
-    return SPI_ReceiveData();
+    return SPI->DR;
 }
 
 static u8 ADXL_ReadByte(void)
 {
-    vu8 Data = 0;
-    /* Wait until the transmit buffer is empty */
-    while (SPI_GetFlagStatus(SPI_FLAG_TXE) == RESET);
-    /* Send the byte */
-    SPI_SendData(0xFF); // Dummy Byte
-    /* Wait until a data is received */
-    while (SPI_GetFlagStatus(SPI_FLAG_RXNE) == RESET);
-    /* Get the received data */
-    Data = SPI_ReceiveData();
-    /* Return the shifted data */
-    return Data;
+    return ADXL_WriteByte(0xFF); // Dummy Byte
 }
 
 static void ADXL_Init(void)
@@ -89,10 +102,20 @@ static void ADXL_Init(void)
     ADXL_WriteByte((ADXL_RANGE_8G & 0x03) | ADXL_FULL_RES | ADXL_4WIRE);
     ADXL_OFF;
 
-    // Fifo depth = 16
+    // Fifo watermark, stream mode
     ADXL_ON;
     ADXL_WriteByte(ADXL_FIFO_ADDR);
-    ADXL_WriteByte((16 & 0x1f) | ADXL_FIFO_STREAM);
+    ADXL_WriteByte((ADXL_WATERMARK & 0x1f) | ADXL_FIFO_STREAM);
+    ADXL_OFF;
+
+    // Watermark interrupt on INT1, active high
+    ADXL_ON;
+    ADXL_WriteByte(ADXL_INT_MAP_ADDR);
+    ADXL_WriteByte(0);
+    ADXL_OFF;
+    ADXL_ON;
+    ADXL_WriteByte(ADXL_INT_ENABLE_ADDR);
+    ADXL_WriteByte(ADXL_INT_WATERMARK);
     ADXL_OFF;
 
     ADXL_ON;
@@ -101,32 +124,56 @@ static void ADXL_Init(void)
     ADXL_OFF;
 }
 
-static u8 ADXL_GetAccelValues(void)
+/*
+ * Empty the accel FIFO into sensorInputs[4..6]. FIFO_STATUS is read once for the entry count, then each
+ * entry is one 6 byte burst of DATAX0..DATAZ1. The ADXL345 only pops an entry when CS goes high after its
+ * data registers, so one burst per entry is as contiguous as it gets.
+ */
+static void ADXL_DrainFifo(void)
 {
-    vu8 i;
-    
+    u8 entries, i, j;
+    u8 raw[6];
+
     ADXL_ON;
-    ADXL_WriteByte(ADXL_X0_ADDR | ADXL_MULTI_BIT | ADXL_READ_BIT);
-    for (i = 0; i < 3; i++) {
-        u8 i1, i2;
-        i1 = ADXL_ReadByte();
-        i2 = ADXL_ReadByte();
+    ADXL_WriteByte(ADXL_FIFO_STATUS_ADDR | ADXL_READ_BIT);
+    entries = ADXL_ReadByte() & 0x3F;
+    ADXL_OFF;
 
+    for (i = 0; i < entries; i++) {
+        ADXL_ON;
+        ADXL_WriteByte(ADXL_X0_ADDR | ADXL_MULTI_BIT | ADXL_READ_BIT);
+        for (j = 0; j < 6; j++)
+            raw[j] = ADXL_ReadByte();
+        ADXL_OFF;
+
+#ifndef LOWPASS_ACC
+        // consumer took the sums (or they're about to overflow), start over
+        if (accSampleCount == 0 || accSampleCount > ACC_SUM_MAX) {
+            sensorInputs[4] = 0;
+            sensorInputs[5] = 0;
+            sensorInputs[6] = 0;
+            accSampleCount = 0;
+        }
+#endif
+        for (j = 0; j < 3; j++) {
+            s16 v = raw[2 * j] | raw[2 * j + 1] << 8;
 #ifdef LOWPASS_ACC
-        // new result = 0.95 * previous_result + 0.05 * current_data
-        sensorInputs[i + 4] = ((sensorInputs[i + 4] * 19) / 20) + (((i1 | i2 << 8) * 5) / 100);
+            // new result = 0.95 * previous_result + 0.05 * current_data
+            sensorInputs[j + 4] = ((sensorInputs[j + 4] * 19) / 20) + ((v * 5) / 100);
 #else
-        sensorInputs[i + 4] += (i1 | i2 << 8);
+            sensorInputs[j + 4] += v;
 #endif
+        }
+        accSampleCount++;
+        // the next FIFO entry needs 5us after the data registers were read
+        delay_us(5);
     }
+}
 
-    // skip over this register
-    ADXL_ReadByte();
-    // FIFO_STATUS register (last few bits = fifo remaining)
-    i = ADXL_ReadByte();
-    ADXL_OFF;
-
-    return i & 0x7F; // return number of entires left in fifo
+/* Accel INT1, FIFO reached the watermark */
+__near __interrupt void EXTI_PORTD_IRQHandler(void)
+{
+    ADXL_DrainFifo();
 }
 
 /*
@@ -154,11 +201,11 @@ __near __interrupt void ADC1_IRQHandler(void)
 
     // Get 4 ADC readings from buffer
     for (i = 0; i < 4; i++)
-        sensorInputs[i] += ADC1_GetBufferValue(i);
+        sensorInputs[i] += adc1_buffer(i);
 
     adcSampleCount++;
 
-    ADC1_ClearITPendingBit(ADC1_CSR_EOC);
+    adc1_eocClear();
 }
 
 /* Public functions */
@@ -176,8 +223,10 @@ void Sensors_Init(void)
     GPIO_Init(GPIOE, GPIO_PIN_5, GPIO_MODE_OUT_PP_HIGH_FAST);
     ADXL_OFF;
     
-    // Accel INT1 input tied to interrupt (TODO). Input-only for now.
-    GPIO_Init(GPIOD, GPIO_PIN_0, GPIO_MODE_IN_FL_NO_IT);
+    // Accel INT1 input, rising edge interrupt (watermark). EXTI_CR1 is only writable with interrupts off,
+    // which they still are this early
+    GPIO_Init(GPIOD, GPIO_PIN_0, GPIO_MODE_IN_FL_IT);
+    EXTI->CR1 = (u8)((EXTI->CR1 & ~EXTI_CR1_PDIS) | (0x01 << 6));
 
     //  ADC1
     ADC1_DeInit();
@@ -191,96 +240,94 @@ void Sensors_Init(void)
     ADXL_Init();
 }
 
-/* 
- * Find Gyro offset, and make sure model was not moving during the operation. Will beep and flash LED if some movement is detected.
- * This function uses 270 bytes of stack. I gotta fix this, thats ridiculous.
-*/
-void Gyro_Calibrate(void)
+/*
+ * Gyro offsets, found while the main loop runs. Gyro_CalibrateUpdate() takes a sample every
+ * GYRO_CAL_INTERVAL loops and keeps only running sums and min/max per axis. A spread over GYRO_CAL_SPREAD
+ * means the model moved, the run starts over. An offset outside GYRO_ZERO_MIN..MAX is a broken gyro, that
+ * fails for good: the buzzer keeps going and arming stays locked.
+ */
+void Gyro_CalibrateStart(void)
 {
-    u8 i, j;
-    u16 gyroCheck[8 * 3];       // gyro offset calc
-    s16 gyroDiff = 0;
-
-    // read some samples up
-    Sensors_ReadADC();
-    delay_ms(2);
-
-    do {
-        for (i = 0; i < 3; i++)
-            gyroZero[i] = 0;
-
-        for (i = 0; i < 8; i++) {
-            for (j = 0; j < 3; j++) {
-                Sensors_ReadADC();
-                delay_ms(2);
-                gyroZero[j] += gyro[j];
-                gyroCheck[i + (j * 8)] = gyro[j];
-            }
-            delay_ms(100);
-        }
+    GyroCal.State = GYROCAL_RUNNING;
+    GyroCal.Samples = 0;
+    GyroCal.Restarts = 0;
+    calTick = 0;
+    Led_Blink(255, 50, 50);
+}
 
-        for (i = 0; i < 3; i++) {
-            gyroZero[i] = gyroZero[i] >> 3;
-            // Check for unreasonable gyro values (0 or 1023 when its broken, etc...
-            // Just beep and flash, you can't fly with broken gyros :(
-            if (gyroZero[i] > 500 || gyroZero[i] < 300) {
-                while (1) {
-                    Sensors_ReadADC();
-                    Beep(1, 400, 50);
-                    Beep(2, 100, 25);
-                    LED_TOGGLE;
-                }
-            }
-        }
+void Gyro_CalibrateUpdate(void)
+{
+    u8 i;
+    u16 g;
+
+    if (GyroCal.State != GYROCAL_RUNNING || ++calTick < GYRO_CAL_INTERVAL)
+        return;
+    calTick = 0;
 
-	LED_TOGGLE;
-
-        // compare mean value vs individual values
-        // if individual values differ from mean, then the copter was moved. Redo offset measurement.
-        gyroDiff = 0;
-	for (i = 0; i < 8; i++) {
-            for (j = 0; j < 3; j++) {
-                u16 temp = gyroZero[j] - gyroCheck[i + (j * 8)];
-                gyroDiff += abs(temp);
-            }
-	}
-        printf("GyroDiff: %d\r\n", (u16)gyroDiff);
-        if (gyroDiff > 8)
+    for (i = 0; i < 3; i++) {
+        g = gyro[i];
+        if (GyroCal.Samples == 0) {
+            calSum[i] = g;
+            calMin[i] = g;
+            calMax[i] = g;
+            continue;
+        }
+        calSum[i] += g;
+        if (g < calMin[i])
+            calMin[i] = g;
+        if (g > calMax[i])
+            calMax[i] = g;
+        if (calMax[i] - calMin[i] > GYRO_CAL_SPREAD) {
+            // moved, redo offset measurement
+            GyroCal.Samples = 0;
+            if (GyroCal.Restarts < 255)
+                GyroCal.Restarts++;
             Beep(2, 50, 10);
-    } while (gyroDiff > 8);
+            return;
+        }
+    }
+    if (++GyroCal.Samples < GYRO_CAL_SAMPLES)
+        return;
 
-    printf("Gyro Calibrated: %d, %d, %d\r\n", gyroZero[0], gyroZero[1], gyroZero[2]);
-    LED_OFF;
+    for (i = 0; i < 3; i++) {
+        g = calSum[i] / GYRO_CAL_SAMPLES;
+        // Check for unreasonable gyro values (0 or 1023 when its broken, etc...
+        // you can't fly with broken gyros :(
+        if (g > GYRO_ZERO_MAX || g < GYRO_ZERO_MIN) {
+            GyroCal.State = GYROCAL_FAILED;
+            Beep(255, 400, 100);
+            Led_Blink(255, 100, 25);
+            return;
+        }
+    }
+    for (i = 0; i < 3; i++)
+        gyroZero[i] = calSum[i] / GYRO_CAL_SAMPLES;
+    GyroCal.State = GYROCAL_DONE;
+    Led_Blink(0, 0, 0);
 }
 
+/* Commit what the FIFO interrupt collected since the last call */
 void Sensors_ReadACC(void)
 {
-    u8 count = 0;
-    u8 remaining = 0;
-    u8 i = 0;
-
-    // Next up is accel fifo + avg
-    do {
-        count++;
-        remaining = ADXL_GetAccelValues();
-    } while ((count < 32) && (remaining > 0));
-
+    disableInterrupts();
+    // INT1 already high without an edge (at startup, or a FIFO overrun): the interrupt would never come
+    if (accSampleCount == 0 && ADXL_INT_HIGH)
+        ADXL_DrainFifo();
 #ifdef LOWPASS_ACC
     // commit current values to acc[]
     acc[0] = sensorInputs[4];
     acc[1] = sensorInputs[5];
     acc[2] = sensorInputs[6];
 #else
-    // accel + average
-    acc[0] = sensorInputs[4] / count;
-    acc[1] = sensorInputs[5] / count;
-    acc[2] = sensorInputs[6] / count;
-
-    // clear out averaging results
-    sensorInputs[4] = 0;
-    sensorInputs[5] = 0;
-    sensorInputs[6] = 0;
+    // accel + average, the interrupt clears the sums on its next sample
+    if (accSampleCount) {
+        acc[0] = sensorInputs[4] / accSampleCount;
+        acc[1] = sensorInputs[5] / accSampleCount;
+        acc[2] = sensorInputs[6] / accSampleCount;
+    }
 #endif
+    accSampleCount = 0;
+    enableInterrupts();
 }
 
 void Sensors_ReadADC(void)
@@ -318,7 +365,7 @@ void Voltage_Init(void)
     }
     batteryWarning = i * Config.VoltagePerCellMin;	// 3.3V per cell minimum, configurable in GUI
 
-    // Beep (blocking) number of cells
+    // Beep number of cells
     Beep(i, 80, 200);
 }
 
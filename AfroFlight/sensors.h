@@ -2,16 +2,29 @@
 
 // The values exported by this module
 /* Gyro Pitch/Roll/Yaw final measurements */
-extern vs16 gyro[3];
+extern __tiny vs16 gyro[3];
 /* Accelerometer X/Y/Z */
 extern vs16 acc[3];
 /* Battery voltage */
 extern vs16 battery;
 /* used for calibrating Gyros on ground */
-extern s16 gyroZero[3];
+extern __tiny s16 gyroZero[3];
+
+enum { GYROCAL_IDLE = 0, GYROCAL_RUNNING, GYROCAL_DONE, GYROCAL_FAILED };
+
+typedef struct _GyroCal {
+    u8 State;                           // GYROCAL_xxx
+    u8 Samples;                         // of the current run, GYRO_CAL_SAMPLES completes it
+    u8 Restarts;                        // runs thrown away because the model moved
+} _GyroCal;
+
+/* Gyro calibration progress, Gyro_CalibrateUpdate() sets gyroZero[] when done */
+extern _GyroCal GyroCal;
 
 void Sensors_Init(void);
-void Gyro_Calibrate(void);
+/* Gyro offsets, run once per loop after Sensors_ReadADC() until GyroCal.State is DONE or FAILED */
+void Gyro_CalibrateStart(void);
+void Gyro_CalibrateUpdate(void);
 
 void Sensors_ReadADC(void);
 void Sensors_ReadACC(void);
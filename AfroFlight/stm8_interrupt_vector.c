@@ -34,7 +34,7 @@ void @near (* const _vectab[])() =
     NonHandledInterrupt,   /* irq5 - External interrupt 2 (GPIOC) */
 
     (void @near (*)())0x8200,
-    NonHandledInterrupt,   /* irq6 - External interrupt 3 (GPIOD) */
+    EXTI_PORTD_IRQHandler,   /* irq6 - External interrupt 3 (GPIOD) */
 
     (void @near (*)())0x8200,
     NonHandledInterrupt,   /* irq7 - External interrupt 4 (GPIOE) */
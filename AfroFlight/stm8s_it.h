@@ -44,6 +44,7 @@ extern void @near I2C_IRQHandler(void); /* I2C */
 extern void @near UART1_RX_IRQHandler(void); /* UART1 RX */
 extern void @near UART1_TX_IRQHandler(void); /* UART1 TX */
 extern void @near TIM3_CAP_COM_IRQHandler(void); /* TIM3 CAP/COM */
+extern void @near EXTI_PORTD_IRQHandler(void); /* EXTI PORTD */
 extern void @near TIM3_UPD_OVF_BRK_IRQHandler(void); /* TIM3 UPD/OVF/BRK */
 extern void @near TIM2_CAP_COM_IRQHandler(void); /* TIM2 CAP/COM */
 extern void @near TIM2_UPD_OVF_BRK_IRQHandler(void); /* TIM2 UPD/OVF/BRK */
@@ -1,192 +1,117 @@
 #include "main.h"
-#include <stdarg.h>
+#include "../afrowii/ringbuf.h"                                          // afrowii's serial ring, same ISR/main split
 
+/*
+ * Binary frames, the same framing as afrowii's serialCom(): '$', len, cmd, payload[len], xor of len..payload.
+ * Replies use it too. The length prefix needs no escaping, a parser that lost sync drops the frame on the
+ * checksum and picks up at the next '$'.
+ */
 #define TX_BUFFER_SIZE   (0x80)
 #define RX_BUFFER_SIZE   (0x80)
+#define RX_RING_SIZE     (0x80)                                         // power of 2, ~22ms at 57600 baud
+#define RX_BUDGET        (48)                                           // bytes parsed per UART_ReceiveTelemetry()
+#define FRAME_START      '$'
+#define BAUD_FALLBACK    (1000)                                         // UART_ReceiveTelemetry() calls, ~2s of loops
 #define countof(a)   (sizeof(a) / sizeof(*(a)))
 
+enum { RX_IDLE = 0, RX_LEN, RX_CMD, RX_PAYLOAD, RX_CHECK };
+
 static u8 TxBuffer[TX_BUFFER_SIZE];                                     // Transmit buffer
-static u8 RxBuffer[RX_BUFFER_SIZE];                                     // Receive buffer
-static u8 RxLocked = FALSE;                                             // After receiving full buffer lock it while main loop process it
-static u8 TxComplete = FALSE;                                           // Transmission complete
-static u8 TxBytes = 0;                                                  // When sending raw data, this is used to specify buffer length
-static u8 RxBytes = 0;                                                  // number of bytes received
+static u8 RxBuffer[RX_BUFFER_SIZE];                                     // Payload of the frame being parsed
+static u8 RxStorage[RX_RING_SIZE];
+static ring_t RxRing = RING_INIT(RxStorage);                           // Received bytes, RX interrupt to main loop
+static u8 TxComplete = TRUE;                                            // Transmission complete
+static u8 TxBytes = 0;                                                  // Length of the frame in TxBuffer
+static u8 TxPos = 0;                                                    // Next byte the TX interrupt sends
 static u16 UartRequest = 0;                                             // What data do we want returned from FC?
+static u8 SaveResult = FALSE;                                           // Config_Save() result for the 'S' reply
+static u8 FieldReply[2];                                                // 'F'/'W' reply: field, Config_SetField() result
+
+/*
+ * 'B' rates, by index. The link starts at [0], 'B' moves it up to 1MBaud (16MHz / 16): acknowledged at the old
+ * rate, switched once that's out. The first frame at the new rate confirms it and it's saved as Config.Baud,
+ * the rate the next boot starts at. A rate no frame confirms within BAUD_FALLBACK, after a 'B' or at boot,
+ * drops back to [0].
+ */
+static const u32 Bauds[] = { 57600, 115200, 250000, 500000, 1000000 };
+static u8 Baud = 0;                                                     // index in use
+static u8 BaudNext = 0;                                                 // acknowledged, switched to once that's out
+static u8 BaudConfirmed = TRUE;
+static u8 BaudSave = FALSE;                                             // Config.Baud changed, saved when disarmed
+static u16 BaudWait;                                                    // calls left to confirm Baud
 
 static const _UARTVersion UARTVersion = {
     0x01,       // Hardware
     0x01,       // Software
-    0x01,       // Protocol
+    0x02,       // Protocol: binary frames
 };
 
 __near __interrupt void UART2_TX_IRQHandler(void)
 {
-    static u8 buffer_ptr = 0;
-
-    if (!TxComplete) {
-        u8 ch;
-        buffer_ptr++;
-        ch = TxBuffer[buffer_ptr];      // 1st byte was already sent in UART_Transmit() to fire off the interrupt
-        if (TxBytes == 0 || buffer_ptr == TX_BUFFER_SIZE)) {
-            buffer_ptr = 0;
-            TxComplete = TRUE;
-        } else {
-            // transmit it, this will call back interrupt
-            UART2_SendData8(ch);
-            TxBytes--;
-        }
+    if (TxPos < TxBytes) {
+        // transmit it, this will call back interrupt
+        uart2_put(TxBuffer[TxPos++]);
     } else {
-        buffer_ptr = 0;
-        UART2_ITConfig(UART2_IT_TXE, DISABLE);
-        memset(TxBuffer, 0, sizeof(TxBuffer));
+        uart2_txeIrq(0);
+        TxComplete = TRUE;
     }
 }
 
+/* Only queues, the main loop parses. Nothing is thrown away unless the ring is full */
 __near __interrupt void UART2_RX_IRQHandler(void)
 {
-    static u8 buffer_ptr = 0;
-    u8 ch;
-
-    // receive byte
-    ch = (u8)(UART2_ReceiveData8() & 0x7F);
-
-    // if we haven't processed our buffer yet ignore it for now
-    if (RxLocked)
-        return;
-
-    if (buffer_ptr < RX_BUFFER_SIZE) {
-        if (ch == '\n') {
-            // end of receive, lock buffer and fire off to processing
-            RxBytes = buffer_ptr;
-            buffer_ptr = 0; // reset it
-            RxLocked = TRUE;
-        } else {
-            // fill buffer
-            RxBuffer[buffer_ptr++] = ch;
-        }
-    } else {
-        // overflow
-        buffer_ptr = 0;
-        RxLocked = FALSE;
-    }
+    // receive byte, counted in RxRing.overflow if it doesn't fit
+    ring_put(&RxRing, uart2_get());
 }
 
-static const char hexcode[] = "0123456789ABCDEF";
-
-static void UART_Decode(void)
+/* Frames are built in place: UART_FrameStart(), any number of UART_FrameAdd(), UART_FrameSend() */
+static void UART_FrameStart(u8 cmd)
 {
-    u8 len = RxBytes - 2;
-    u8 *ptr = RxBuffer + 2;
-    u8 *dptr = RxBuffer + 2;
-    u8 ch1, ch2 = 0;
-    
-    while (len) {
-        ch1 = *ptr++;
-        ch2 = *ptr++;
-        *dptr = (u8)((ch1 < 57) ? (ch1 - 48) : (ch1 - 55)) << 4 | (u8)((ch2 < 57) ? (ch2 - 48) : (ch2 - 55));
-        dptr++;
-        len -= 2;
-    }
+    TxBuffer[0] = FRAME_START;
+    TxBuffer[1] = 0;
+    TxBuffer[2] = cmd;
+    TxBytes = 3;
 }
 
-// Transmit blocks of data. each block is buffer * + size of buffer. can be more than one.
-void UART_Transmit(u8 cmd, u8 nblocks, ...)
+static void UART_FrameAdd(const void *data, u8 len)
 {
-    va_list va;
-    u8 pt = 0;
-    u8 *data = NULL;
-    u8 ptr = 0;
-    u8 len = 0;
-    u8 ch, b, c;
-
-    va_start(va, nblocks);
-
-    // sync char + cmd
-    TxBuffer[pt++] = '$';
-    TxBuffer[pt++] = cmd;
-    
-    if (nblocks) {
-        data = va_arg(va, u8 *);
-        len = (u8)va_arg(va, int);
-        ptr = 0;
-        nblocks--;
-    }
+    if (TxBytes + len > TX_BUFFER_SIZE - 1)
+        len = TX_BUFFER_SIZE - 1 - TxBytes;
+    memcpy(TxBuffer + TxBytes, data, len);
+    TxBytes += len;
+}
 
-    while (len) {
-        if (len) {
-            ch = data[ptr++];
-            len--;
-            if ((!len) && nblocks) {
-                // TxBuffer[pt++] = '$';
-                data = va_arg(va, u8 *);
-                len = (u8)va_arg(va, int);
-                ptr = 0;
-                nblocks--;
-            }
-            TxBuffer[pt++] = hexcode[ch >> 4 & 0xF];
-            TxBuffer[pt++] = hexcode[ch & 0xF];
-        }
-    }
+static void UART_FrameSend(void)
+{
+    u8 i, check;
 
-    va_end(va);
-    // last char
-    TxBuffer[pt] = '\n';
-    // number of bytes to send
-    TxBytes = pt;
+    TxBuffer[1] = TxBytes - 3;
+    check = TxBuffer[1];
+    for (i = 2; i < TxBytes; i++)
+        check ^= TxBuffer[i];
+    TxBuffer[TxBytes++] = check;
     // send off 1st byte to start the process
     TxComplete = FALSE;
-    UART2_SendData8(TxBuffer[0]);
-    UART2_ITConfig(UART2_IT_TXE, ENABLE);
+    TxPos = 1;
+    uart2_put(TxBuffer[0]);
+    uart2_txeIrq(1);
 }
 
-void UART_TransmitRaw(u8 cmd, u8 nblocks, ...)
+void UART_Transmit(u8 cmd, const void *data, u8 len)
 {
-    va_list va;
-    u8 pt = 0;
-    u8 *data = NULL;
-    u8 ptr = 0;
-    u8 len = 0;
-    u8 ch, b, c;
-
-    va_start(va, nblocks);
-
-    // sync char (0xAA twice)
-    TxBuffer[pt++] = 0xAA;
-    TxBuffer[pt++] = 0xAA;
-
-    if (nblocks) {
-        data = va_arg(va, u8 *);
-        len = (u8)va_arg(va, int);
-        ptr = 0;
-        nblocks--;
-    }
-
-    while (len) {
-        if (len) {
-            ch = data[ptr++];
-            len--;
-            if ((!len) && nblocks) {
-                TxBuffer[pt++] = ch;
-                TxBuffer[pt++] = 0xAA;
-                data = va_arg(va, u8 *);
-                len = (u8)va_arg(va, int);
-                ptr = 0;
-                nblocks--;
-            } else {
-                TxBuffer[pt++] = ch;
-            }
-        }
-    }
+    UART_FrameStart(cmd);
+    UART_FrameAdd(data, len);
+    UART_FrameSend();
+}
 
-    va_end(va);
-    // last char
-    TxBuffer[pt] = '\n';
-    // number of bytes to send
-    TxBytes = pt;
-    // send off 1st byte to start the process
-    TxComplete = FALSE;
-    UART2_SendData8(TxBuffer[0]);
-    UART2_ITConfig(UART2_IT_TXE, ENABLE);
+/* gyro, battery, acc */
+static void UART_TransmitSensors(u8 cmd)
+{
+    UART_FrameStart(cmd);
+    UART_FrameAdd((const void *)gyro, sizeof(gyro));
+    UART_FrameAdd((const void *)&battery, sizeof(battery));
+    UART_FrameAdd((const void *)acc, sizeof(acc));
+    UART_FrameSend();
 }
 
 char putchar(char c)
@@ -198,25 +123,94 @@ char putchar(char c)
     return c;
 }
 
-void UART_Init(void)
+static void UART_SetBaud(u8 Index)
 {
-    const char *welcome = "AfroFlightST rev 0";
+    Baud = BaudNext = Index;
+    BaudConfirmed = Index == 0;
+    BaudWait = BAUD_FALLBACK;
     UART2_DeInit();
-    UART2_Init((u32)57600, UART2_WORDLENGTH_8D, UART2_STOPBITS_1, UART2_PARITY_NO, UART2_SYNCMODE_CLOCK_DISABLE, UART2_MODE_TXRX_ENABLE);
-    UART2_ITConfig(UART2_IT_TXE, ENABLE);
+    UART2_Init(Bauds[Index], UART2_WORDLENGTH_8D, UART2_STOPBITS_1, UART2_PARITY_NO, UART2_SYNCMODE_CLOCK_DISABLE, UART2_MODE_TXRX_ENABLE);
     UART2_ITConfig(UART2_IT_RXNE_OR, ENABLE);
+}
+
+void UART_Init(void)
+{
+    const char *welcome = "AfroFlightST rev 0";
 
-    UART_Transmit('W', 1, welcome, strlen(welcome));
+    UART_SetBaud(0);
+    UART_Transmit('W', welcome, strlen(welcome));
 }
 
-void UART_ReceiveTelemetry(void)
+void UART_BaudBoot(void)
 {
-    if (!RxLocked)
-        return;
+    if (Config.Baud && Config.Baud < countof(Bauds)) {
+        // after the welcome
+        while (!TxComplete || !uart2_txDone());
+        UART_SetBaud(Config.Baud);
+    }
+}
+
+/* once per UART_ReceiveTelemetry() */
+static void UART_BaudUpdate(void)
+{
+    if (BaudNext != Baud) {
+        if (TxComplete && uart2_txDone())
+            UART_SetBaud(BaudNext);
+    } else if (!BaudConfirmed && --BaudWait == 0) {
+        UART_SetBaud(0);        // the pc never followed, or there is none since boot
+    }
+    // Config_Save() writes all of Config, field changes not saved yet with 'S' go along
+    if (BaudSave && Config_Save())
+        BaudSave = FALSE;
+}
+
+/* 'B': index acknowledged, count, then the rates / 100, u16 each */
+static void UART_TransmitBaud(void)
+{
+    u16 rate;
+    u8 i, head[2];
 
-    UART_Decode();
+    UART_FrameStart('B');
+    head[0] = BaudNext;
+    head[1] = countof(Bauds);
+    UART_FrameAdd(head, sizeof(head));
+    for (i = 0; i < countof(Bauds); i++) {
+        rate = Bauds[i] / 100;
+        UART_FrameAdd(&rate, sizeof(rate));
+    }
+    UART_FrameSend();
+}
+
+/* 'F': field, result, data. Field 0xFF (none asked for) carries CONFIG_FIELDS and Config_Saving() instead */
+static void UART_TransmitField(void)
+{
+    const u8 *data;
+    u8 size, status[2];
+
+    UART_FrameStart('F');
+    UART_FrameAdd(FieldReply, sizeof(FieldReply));
+    data = Config_GetField(FieldReply[0], &size);
+    if (data) {
+        UART_FrameAdd(data, size);
+    } else if (FieldReply[0] == 0xFF) {
+        status[0] = CONFIG_FIELDS;
+        status[1] = Config_Saving();
+        UART_FrameAdd(status, sizeof(status));
+    }
+    UART_FrameSend();
+}
 
-    switch (RxBuffer[1]) {
+/* One complete, checked frame */
+static void UART_Command(u8 cmd, const u8 *payload, u8 len)
+{
+    if (!BaudConfirmed && BaudNext == Baud) {
+        BaudConfirmed = TRUE;
+        if (Config.Baud != Baud) {
+            Config.Baud = Baud;
+            BaudSave = TRUE;
+        }
+    }
+    switch (cmd) {
         case 'V':       // Version info
             FLAG_SET(UartRequest, UART_REQ_VERSION);
             break;
@@ -232,28 +226,139 @@ void UART_ReceiveTelemetry(void)
         case 's':       // Stop continous analog values
             FLAG_CLEAR(UartRequest, UART_REQ_ADCDATACONT);
             break;
+        case 'C':       // Config dump
+            FLAG_SET(UartRequest, UART_REQ_CONFIG);
+            break;
+        case 'P':       // PID gains of one axis: axis, _PIDGains. Replies with the config
+            if (len == 1 + sizeof(_PIDGains))
+                PID_SetGains(payload[0], (const _PIDGains *)(payload + 1));
+            FLAG_SET(UartRequest, UART_REQ_CONFIG);
+            break;
+        case 'M':       // CUSTOM_COPTER motor table: _CustomMixer. Replies with the config
+            if (len == sizeof(_CustomMixer))
+                Mixer_SetCustom((const _CustomMixer *)payload);
+            FLAG_SET(UartRequest, UART_REQ_CONFIG);
+            break;
+        case 'F':       // One config field: field. Without one, the field count and whether a save is still writing
+            FieldReply[0] = len ? payload[0] : 0xFF;
+            FieldReply[1] = !len || payload[0] < CONFIG_FIELDS;
+            FLAG_SET(UartRequest, UART_REQ_FIELD);
+            break;
+        case 'W':       // Change one config field: field, data. Replies with the result and the field as it is now
+            FieldReply[0] = len ? payload[0] : 0xFF;
+            FieldReply[1] = len && Config_SetField(payload[0], payload + 1, len - 1);
+            FLAG_SET(UartRequest, UART_REQ_FIELD);
+            break;
+        case 'G':       // Gyro calibration progress and offsets
+            FLAG_SET(UartRequest, UART_REQ_GYROCAL);
+            break;
+        case 'L':       // Loop timing, then RX bytes lost
+            FLAG_SET(UartRequest, UART_REQ_LOOPSTATS);
+            break;
+        case 'l':       // Reset loop timing
+            memset(&LoopStats, 0, sizeof(LoopStats));
+            RxRing.overflow = 0;
+            break;
+        case 'S':       // Save config to EEPROM (disarmed only), written in the background, see 'F'
+            SaveResult = Config_Save();
+            FLAG_SET(UartRequest, UART_REQ_SAVE);
+            break;
+        case 'B':       // UART rate: index into the rates of the reply, 0xFF (or none) only asks
+            if (len == 1 && payload[0] < countof(Bauds) && payload[0] != Baud) {
+                BaudNext = payload[0];
+                if (BaudNext == 0 && Config.Baud) {
+                    Config.Baud = 0;    // nothing to confirm at the base rate
+                    BaudSave = TRUE;
+                }
+            }
+            FLAG_SET(UartRequest, UART_REQ_BAUD);
+            break;
     }
+}
+
+/*
+ * Parse what the RX interrupt queued, up to RX_BUDGET bytes. Frames are picked up incrementally and each
+ * complete one runs right away, so several commands in one burst all get through.
+ */
+void UART_ReceiveTelemetry(void)
+{
+    static u8 state = RX_IDLE;
+    static u8 len, pos, check, cmd;
+    u8 n, ch;
 
-    RxLocked = FALSE;
-    RxBytes = 0;    
+    UART_BaudUpdate();
+    for (n = 0; n < RX_BUDGET && ring_count(&RxRing); n++) {
+        ch = ring_get(&RxRing);
+
+        switch (state) {
+            case RX_IDLE:
+                if (ch == FRAME_START)
+                    state = RX_LEN;
+                break;
+            case RX_LEN:
+                len = ch;
+                check = ch;
+                pos = 0;
+                state = len <= RX_BUFFER_SIZE ? RX_CMD : RX_IDLE;
+                break;
+            case RX_CMD:
+                cmd = ch;
+                check ^= ch;
+                state = len ? RX_PAYLOAD : RX_CHECK;
+                break;
+            case RX_PAYLOAD:
+                RxBuffer[pos] = ch;
+                check ^= ch;
+                if (++pos == len)
+                    state = RX_CHECK;
+                break;
+            case RX_CHECK:
+                if (ch == check)
+                    UART_Command(cmd, RxBuffer, len);
+                state = RX_IDLE;
+                break;
+        }
+    }
 }
 
 void UART_TransmitTelemetry(void)
 {
-    // send stuff out
+    // send stuff out, one frame per call: the next one would overwrite TxBuffer while it's sent
     if (!TxComplete)
         return;
 
     if (FLAG_ISSET(UartRequest, UART_REQ_VERSION)) {
-        UART_Transmit('V', 1, (u8 *)&UARTVersion, sizeof(UARTVersion));
+        UART_Transmit('V', &UARTVersion, sizeof(UARTVersion));
         FLAG_CLEAR(UartRequest, UART_REQ_VERSION);
-    }
-    if (FLAG_ISSET(UartRequest, UART_REQ_ADCDATA)) {
-        UART_Transmit('A', 3, (u8 *)gyro, sizeof(gyro), (u8 *)&battery, sizeof(s16), (u8 *)acc, sizeof(acc));
+    } else if (FLAG_ISSET(UartRequest, UART_REQ_CONFIG)) {
+        UART_Transmit('C', &Config, sizeof(Config));
+        FLAG_CLEAR(UartRequest, UART_REQ_CONFIG);
+    } else if (FLAG_ISSET(UartRequest, UART_REQ_LOOPSTATS)) {
+        UART_FrameStart('L');
+        UART_FrameAdd(&LoopStats, sizeof(LoopStats));
+        UART_FrameAdd(&RxRing.overflow, sizeof(RxRing.overflow));
+        UART_FrameSend();
+        FLAG_CLEAR(UartRequest, UART_REQ_LOOPSTATS);
+    } else if (FLAG_ISSET(UartRequest, UART_REQ_GYROCAL)) {
+        UART_FrameStart('G');
+        UART_FrameAdd(&GyroCal, sizeof(GyroCal));
+        UART_FrameAdd(gyroZero, sizeof(gyroZero));
+        UART_FrameSend();
+        FLAG_CLEAR(UartRequest, UART_REQ_GYROCAL);
+    } else if (FLAG_ISSET(UartRequest, UART_REQ_FIELD)) {
+        UART_TransmitField();
+        FLAG_CLEAR(UartRequest, UART_REQ_FIELD);
+    } else if (FLAG_ISSET(UartRequest, UART_REQ_BAUD)) {
+        UART_TransmitBaud();
+        FLAG_CLEAR(UartRequest, UART_REQ_BAUD);
+    } else if (FLAG_ISSET(UartRequest, UART_REQ_SAVE)) {
+        UART_Transmit('S', &SaveResult, sizeof(SaveResult));
+        FLAG_CLEAR(UartRequest, UART_REQ_SAVE);
+    } else if (FLAG_ISSET(UartRequest, UART_REQ_ADCDATA)) {
+        UART_TransmitSensors('A');
         FLAG_CLEAR(UartRequest, UART_REQ_ADCDATA);
-    }
-    if (FLAG_ISSET(UartRequest, UART_REQ_ADCDATACONT)) {
-        UART_TransmitRaw('a', 3, (u8 *)gyro, sizeof(gyro), (u8 *)&battery, sizeof(s16), (u8 *)acc, sizeof(acc));
+    } else if (FLAG_ISSET(UartRequest, UART_REQ_ADCDATACONT)) {
+        UART_TransmitSensors('a');
         // Don't clear this flag as its continous
     }
     if (FLAG_ISSET(UartRequest, UART_REQ_REBOOT)) {
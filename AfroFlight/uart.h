@@ -11,11 +11,19 @@ enum {
     UART_REQ_ADCDATA                    = 1 << 1,
     UART_REQ_ADCDATACONT                = 1 << 2,
     UART_REQ_ADCDATASTOP                = 1 << 3,
+    UART_REQ_CONFIG                     = 1 << 4,
+    UART_REQ_SAVE                       = 1 << 5,
+    UART_REQ_LOOPSTATS                  = 1 << 6,
+    UART_REQ_GYROCAL                    = 1 << 8,
+    UART_REQ_FIELD                      = 1 << 9,
+    UART_REQ_BAUD                       = 1 << 10,
     
     UART_REQ_REBOOT                     = 1 << 7
 };
 
 void UART_Init(void);
-void UART_Transmit(u8 cmd, u8 nblocks, ...);
+/* Config.Baud once the config is loaded */
+void UART_BaudBoot(void);
+void UART_Transmit(u8 cmd, const void *data, u8 len);
 void UART_ReceiveTelemetry(void);
 void UART_TransmitTelemetry(void);
@@ -13,12 +13,27 @@
 //  Last Updated : 28 Dec 2008
 //***************************************************************************
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/delay.h>
 #include <compat/twi.h>
 #include "i2c.h"
 
 #define MAX_TRIES 1
 
+volatile uint16_t i2c_nacks[I2C_QUEUE_MAX];
+volatile uint16_t i2c_errors;
+
+// batch for the TWI interrupt
+static uint8_t queue_data[I2C_QUEUE_MAX];
+static uint8_t queue_address;
+static uint8_t queue_count;
+static uint8_t queue_pos;
+#ifdef T580
+static uint8_t queue_dummy;		// dummy byte sent, data next
+#endif
+static volatile uint8_t queue_busy;
+static uint8_t queue_stuck;
+
 static uint8_t i2c_transmit(uint8_t type)
 {
     uint8_t count = 0;
@@ -64,6 +79,16 @@ int i2c_write(uint8_t address, uint8_t data)
     unsigned char twi_status;
     char r_val = -1;
 
+    // polling, without TWIE: let a queued batch finish first (~1ms at most, else the bus hung)
+    while (queue_busy && ++n)
+	_delay_us(4);
+    if (queue_busy) {
+	TWCR = 0;
+	i2c_errors++;
+	queue_busy = 0;
+    }
+    n = 0;
+
     // Transmit Start Condition
     twi_status = i2c_transmit(I2C_START);
 
@@ -114,6 +139,86 @@ int i2c_write(uint8_t address, uint8_t data)
     return r_val;
 }
 
+// next slave of the batch after a repeated START, or the STOP
+static inline void i2c_queue_next(void)
+{
+    if (++queue_pos < queue_count) {
+	TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+    } else {
+	TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+	queue_busy = 0;
+    }
+}
+
+ISR(TWI_vect)
+{
+    switch (TWSR & 0xF8) {
+    case TW_START:
+    case TW_REP_START:
+	TWDR = (queue_address + (queue_pos << 1)) | TW_WRITE;
+	TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+	break;
+    case TW_MT_SLA_ACK:
+#ifdef T580
+	// transmit dummy byte
+	TWDR = 0xA2;
+	queue_dummy = 1;
+#else
+	TWDR = queue_data[queue_pos];
+#endif
+	TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+	break;
+    case TW_MT_DATA_ACK:
+#ifdef T580
+	if (queue_dummy) {
+	    queue_dummy = 0;
+	    TWDR = queue_data[queue_pos];
+	    TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+	    break;
+	}
+#endif
+	i2c_queue_next();
+	break;
+    case TW_MT_SLA_NACK:
+    case TW_MT_DATA_NACK:
+	// this ESC missed it, the others still get theirs
+	i2c_nacks[queue_pos]++;
+	i2c_queue_next();
+	break;
+    default:
+	// bus error or lost arbitration: drop the rest of the batch
+	i2c_errors++;
+	TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+	queue_busy = 0;
+	break;
+    }
+}
+
+uint8_t i2c_queue(uint8_t address, const uint8_t *data, uint8_t count)
+{
+    uint8_t i;
+
+    if (queue_busy) {
+	// no interrupt for too long: the bus hung, start over
+	if (++queue_stuck < I2C_QUEUE_STUCK)
+	    return 0;
+	TWCR = 0;
+	i2c_errors++;
+	queue_busy = 0;
+    }
+    queue_stuck = 0;
+    if (count > I2C_QUEUE_MAX)
+	count = I2C_QUEUE_MAX;
+    for (i = 0; i < count; i++)
+	queue_data[i] = data[i];
+    queue_address = address;
+    queue_count = count;
+    queue_pos = 0;
+    queue_busy = 1;
+    TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+    return 1;
+}
+
 #if 0
 int i2c_readbyte(unsigned int i2c_address, unsigned int dev_id, unsigned int dev_addr, char *data)
 {
@@ -6,7 +6,16 @@
 #define I2C_STOP  2
 #define SCL_CLOCK 400000L
 
+#define I2C_QUEUE_MAX 8		// bytes per i2c_queue() batch
+#define I2C_QUEUE_STUCK 10	// i2c_queue() calls a batch may take before the TWI is reset
+
 void i2c_init(void);
 int i2c_write(uint8_t address, uint8_t data);
+// Interrupt driven: data[i] goes to address + 2 * i, one byte per slave with repeated STARTs and a
+// single STOP. Returns 0 (and drops the values) while the last batch is still on the bus
+uint8_t i2c_queue(uint8_t address, const uint8_t *data, uint8_t count);
+
+extern volatile uint16_t i2c_nacks[I2C_QUEUE_MAX];	// per slave of a batch: address or data not acknowledged
+extern volatile uint16_t i2c_errors;			// batches given up: bus error, lost arbitration or stuck
 
 #endif	/* I2C_H_ */
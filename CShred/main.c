@@ -1,23 +1,24 @@
 // #define SPEKTRUM
 
-#include <math.h>
-#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include <avr/eeprom.h>
+#include <avr/wdt.h>
 #include <inttypes.h>
 #include "uart.h"
 #include "spektrum.h"
 #include "i2c.h"
+#include "../afrowii/fixmath.h"
 
 typedef uint8_t u8;
 typedef int8_t s8;
 typedef uint16_t u16;
 typedef int16_t s16;
 typedef uint32_t u32;
+typedef int32_t s32;
 
 enum {
     FC_STATUS_RCINVALID = 0x01,
@@ -37,6 +38,9 @@ enum {
 #define ADC_ACC_Z	(5)
 #define ADC_ACC_ROLL	(6)
 #define ADC_ACC_PITCH	(7)
+#define ADC_CHANNELS	(8)
+#define ADC_OVERSAMPLE	(4)		// conversions per channel and round, power of 2
+#define ADC_OVERSAMPLE_SHIFT (2)
 
 #define PARAM_XACC_OFFSET   22
 #define PARAM_YACC_OFFSET   23
@@ -46,7 +50,7 @@ enum {
 #define MAX_LIPO_CELL_VOLTAGE (43)
 #define USART_BAUD 115200ul
 #define USART_UBBR_VALUE ((F_CPU / (USART_BAUD << 4)) - 1)
-#define TIMER0_RELOAD_VALUE  250
+#define TICK_HZ  1000		// Timer 2 system tick
 
 #define RED_OFF   PORTB &= ~(_BV(PORTB0));
 #define RED_ON    PORTB |= (_BV(PORTB0));
@@ -66,14 +70,21 @@ enum {
 #define LED2_OFF         PORTC &= ~(_BV(PORTC3));
 #define LED2_TOGGLE      PORTC ^=  (_BV(PORTC3));
 
-#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
-// #define LIMIT_MIN_MAX(value, min, max) { if (value <= min) value = min; else if (value >= max) value = max; }
 
-FILE uart_str = FDEV_SETUP_STREAM(uart_putchar, uart_getchar, _FDEV_SETUP_RW);
+// Fixed point: the gains are converted from the settings once, in settings_apply(). Qn is a value * 2^n.
+// TO_Q() is for constants only, SETTING_Q() is x * k in Qq with k folded into an integer by the compiler
+// (in Q(q + 8), rounded back), so no float code is linked in. It is within 1 of TO_Q(x * k, q)
+#define TO_Q(x, q)      ((s32)((x) * (float)(1UL << (q)) + 0.5f))
+#define SETTING_Q(x, k, q)  (((s32)(x) * TO_Q((k) * 256.0f, (q)) + 128) >> 8)
+#define LF_SHIFT        (8)		// Lf*, stick * Lf is Q8
+#define ANGLE_SHIFT     (8)		// Meas_angle_*, Q8 so the complementary filter has no dead band
+#define ANGLE_MAX       (4000000L)	// Meas_angle_* clip, as the hover integral. fix_mulq16() needs < 2^30 in Q8
+#define BAUD_FALLBACK   (2000)		// ms without a frame from the pc before a raised baud rate drops back to UART_BAUD
+// #define LIMIT_MIN_MAX(value, min, max) { if (value <= min) value = min; else if (value >= max) value = max; }
 
-static float Lf;		// stick sensitivity
-static float Lfdynamic_roll;	// dynamic stick sensitvity (used for flying loopings)
-static float Lfdynamic_pitch;	// dynamic stick sensitvity (used for flying loopings)
+static s32 Lf;			// stick sensitivity, Q8
+static s32 Lfdynamic_roll;	// dynamic stick sensitvity (used for flying loopings), Q8
+static s32 Lfdynamic_pitch;	// dynamic stick sensitvity (used for flying loopings), Q8
 static u8 Motors_on = 0;	// self explanatory, right...?!
 static u8 State = 0;		// Contains selected control loop state: 0 = Motors off, 1 = Acrobatic mode, 2 = Hover mode
 static u8 Old_state;		// Contains the state of the last cycle
@@ -135,13 +146,26 @@ static const u8 DefaultSettings[] = {
 
 // --Read Receiver (Rx)--
 #define MAX_CHANNELS 12
+#define RC_CHANNEL(c) ((c) < RC_CHANNELS ? (c) : 0)	// channel 0 is never received, it reads as centered
 volatile int PPM_in[26] = { 0, };
 volatile int PPM_diff[26] = { 0, };
-volatile unsigned char NewPpmData = 1;
+volatile int PPM_frame[RC_CHANNELS];	// the last complete frame, the receiver code copies PPM_in[] here at its end
+volatile unsigned char NewPpmData = 1;	// 0: PPM_frame[] is new
+static s16 Rc_in[RC_CHANNELS];		// the loop's copy of PPM_frame[], changes only in Rc_update()
+static s16 Throttle_stick;		// (3-228), derived from Rc_in[] once per frame
+static s16 Pitch_stick;
+static s16 Roll_stick;
+static s16 Yaw_stick;
+static s16 Switch_stick;
 volatile unsigned char RC_Quality = 0;
+// PPM ISR results: the ISR fills PpmWidth[PpmFront ^ 1] with the raw edge to edge times of a frame and flips
+// PpmFront at its sync gap, Ppm_update() turns them into PPM_in[]/PPM_diff[]/RC_Quality in the loop
+static volatile u16 PpmWidth[2][MAX_CHANNELS];
+static volatile u8 PpmFront = 0;
+static volatile u8 PpmCount;		// channels 1..PpmCount-1 are in PpmWidth[PpmFront]
+static volatile u8 PpmReady = 0;
 static u16 BeepTime = 2500;
 static u16 BeepMask = 0xFFFF;
-extern unsigned char SpektrumTimer;
 
 /*
     M1 = CW
@@ -175,42 +199,38 @@ static u16 Pitch_init;		// gyro offset
 static u16 Yaw_init;		// gyro offset
 
 static s16 Meas_roll;		// angular velocity reading from gyros
-static float Meas_angle_roll;	// the angle of the copter including acc signal (only in Hover mode)
+static s32 Meas_angle_roll;	// the angle of the copter including acc signal (only in Hover mode), Q8
 
 static s16 Meas_pitch;		// angular velocity reading from gyros
-static float Meas_angle_pitch;	// the angle of the copter including acc signal (only in Hover mode)
+static s32 Meas_angle_pitch;	// the angle of the copter including acc signal (only in Hover mode), Q8
 
-static float P_set_roll;	// P output including scaling (gain)
-static float I_set_roll;	// I output including scaling (gain)
-static float D_set_roll;	// D output including scaling (gain)
+static s16 P_set_roll;		// P output including scaling (gain)
+static s16 I_set_roll;		// I output including scaling (gain)
+static s16 D_set_roll;		// D output including scaling (gain)
 
-static float P_set_pitch;	// P output including scaling (gain)
-static float I_set_pitch;	// I output including scaling (gain)
-static float D_set_pitch;	// D output including scaling (gain)
+static s16 P_set_pitch;		// P output including scaling (gain)
+static s16 I_set_pitch;		// I output including scaling (gain)
+static s16 D_set_pitch;		// D output including scaling (gain)
 
 static s16 Yaw_gyro;		// angular velocity reading from gyroscope
 static s16 Yaw_gyro_i;		// yaw gyro var
-static float Yaw_gyro_scale;	// scaled-down values
-static float Yaw_gyro_i_scale;	// scaled-down values
-
-static float P_sens;		// roll/pitch P control loop sensitivity
-static float I_sens;		// roll/pitch I control loop sensitivity
-static float D_sens;		// roll/pitch D control loop sensitivity
-static float Yaw_p_sens;	// yaw P sensitivity
-static float Yaw_i_sens;	// yaw I sensitivity
+static s16 Yaw_gyro_scale;	// scaled-down values
+static s16 Yaw_gyro_i_scale;	// scaled-down values
 
 static u8 Gyro_i_enable = 0;	// 0 or 1: don't perform gyro integration when motors off
 
-static float Error_pitch_d[3];	// As Single
-static float Error_roll_d[3];	// As Single
-static float Error_pitch_old[3];// As Single
-static float Error_roll_old[3];	// As Single
+static s32 Error_roll_sum;	// roll integral
+static s32 Error_pitch_sum;	// pitch integral
+static s16 Error_pitch_d[3];	// As Integer
+static s16 Error_roll_d[3];	// As Integer
+static s16 Error_pitch_old[3];	// As Integer
+static s16 Error_roll_old[3];	// As Integer
 static u8 Looper;		// As Byte
-static float D_sens_acro;	// As Single
+static s16 D_sens_acro;		// Q10
 
-static float Dd_sens;		// As Single
-static float Dd_set_pitch;	// As Single
-static float Dd_set_roll;	// As Single
+static s16 Dd_sens;		// Q12
+static s16 Dd_set_pitch;	// As Integer
+static s16 Dd_set_roll;		// As Integer
 
 //'--Acc--
 static s16 Xacc;		// accelerometer pitch
@@ -240,21 +260,21 @@ static u8 Pitch_gyro_dir;	// As Byte
 static u8 Yaw_gyro_dir;		// As Byte
 static u8 Xacc_dir;		// As Byte
 static u8 Yacc_dir;		// As Byte
-static float P_sens_acro;	// As Single
-static float I_sens_acro;	// As Single
-static float P_sens_hover;	// As Single
-static float I_sens_hover;	// As Single
-static float D_sens_hover;	// As Single
-static float Yaw_p_sens_eep;	// As Single
-static float Yaw_i_sens_eep;	// As Single
-static float Acc_influence;	// As Single
-static float Gyro_influence;	// As Single
+static s16 P_sens_acro;		// Q12
+static s16 I_sens_acro;		// Q20
+static u16 P_sens_hover;	// Q20, through fix_mulq16()
+static u16 I_sens_hover;	// Q31, through fix_mulq16()
+static s16 D_sens_hover;	// Q12
+static s16 Yaw_p_sens_eep;	// Q14
+static s16 Yaw_i_sens_eep;	// Q20
+static u16 Acc_influence;	// Q16, the gyro gets the rest
 static s16 Xacc_scale;		// As Integer
 static s16 Yacc_scale;		// As Integer
-static float Lf_acro;		// As Single
-static float Lf_hover;		// As Single
+static s32 Lf_acro;		// Q8
+static s32 Lf_hover;		// Q8
 static s16 Lf_yaw;		// As Integer
 static u8 Lf_boost;		// As Byte
+static s16 Lf_boosted[14];	// Lf_acro * DynamicBoost[], Q8, from settings_apply()
 static u16 Idle_up;		// As Word
 static s16 Xacc_offset;		// As Integer
 static s16 Yacc_offset;		// As Integer
@@ -266,9 +286,31 @@ static u8 Switchchannel = 5;	// RC channel currently used for controlling flight
 static u8 MixerType = QUAD_X;   // Type of mixer currently in use
 
 volatile s16 CountMilliseconds = 0;
+// Loop timing per stage in Timer 1 ticks (3.2us), since the last 't' reply
+enum { STAGE_RC, STAGE_ACC, STAGE_GYRO, STAGE_MIXER, STAGE_MOTORS, STAGE_LED, STAGE_VOLTAGE, STAGE_GUI, STAGE_LOOP, STAGES };
+static u16 Stage_min[STAGES];
+static u16 Stage_max[STAGES];
+static u32 Stage_sum[STAGES];
+static u16 Stage_count;		// loops since the last 't' reply
+static u8 StreamPeriod = 0;	// ms between unrequested 's' frames, 0 = only on request
+static s16 StreamLast;		// CountMilliseconds of the last streamed frame
+static u8 Stream_seq;		// last byte of every 's' frame, the pc counts the gaps
+// 'B' rates, and the shortest stream period for each: a 30 byte 's' frame takes 7.8ms at 38400 Bd,
+// 2.6ms at 115200 and 1.2ms at 250000 Bd. The link stays below 40% busy
+static const u32 Bauds[] = { UART_BAUD, 115200, 250000 };
+static const u8 Stream_min[] = { 20, 7, 5 };
+static u8 Baud = 0;		// index into Bauds[] in use
+static u8 Baud_next = 0;	// acknowledged, switched to when the acknowledge is out
+static s16 Rx_last;		// CountMilliseconds of the last frame from the pc
+
+// ADC ISR results: the ISR fills AdcValue[AdcFront ^ 1] and flips AdcFront when a round is complete
+static volatile u16 AdcValue[2][ADC_CHANNELS];
+static volatile u8 AdcFront = 0;
 
 static void acc_calibration(void);
 static void gyro_calibration(void);
+static void Ppm_update(void);
+static u8 Rc_update(void);
 
 static void Mixer();		// prepare all signals for motors and servo
 static void Gyro();		// read and prepare gyro's
@@ -280,10 +322,42 @@ static void Failsave();		// safety: turn off motors if reception is lost
 static void Guiconnection();
 
 static void settings_write(void);
+static void settings_apply(u8 i);
+static u8 settings_set(u8 i, u8 value);
 static void settings_load(void);
 
 static u16 Getadc(u8 channel);
 
+// 'R': the next start goes to the boot section. BASCOM had it at $3c00 words on the m328p, the same 1K words
+// (BOOTSZ = 10) on the m644p start at $7c00 words, 0xF800 bytes
+#define BOOT_START	(0xF800)	// byte address
+#define BOOT_MAGIC	(0xB007)
+static u16 Boot_request __attribute__((section(".noinit")));	// not cleared by the C startup
+
+// Runs from .init3, before .data and .bss are set up: a watchdog reset leaves the watchdog on, and the reset
+// that Bootloader() asks for goes on to the boot section with every peripheral at its reset state.
+// Naked code in .init3 has no return, it falls through into the rest of the startup
+static void __attribute__((naked, used, section(".init3"))) Boot_check(void)
+{
+    if (MCUSR & _BV(WDRF)) {
+	MCUSR = 0;
+	wdt_disable();
+	if (Boot_request == BOOT_MAGIC) {
+	    Boot_request = 0;
+	    ((void (*)(void))(BOOT_START / 2))();
+	}
+    }
+}
+
+static void Bootloader(void)
+{
+    while (EECR & _BV(EERIE));	// let the background settings commit finish
+    while (EECR & _BV(EEPE));
+    Boot_request = BOOT_MAGIC;
+    wdt_enable(WDTO_15MS);
+    for (;;);
+}
+
 void beep(u8 count, u16 duration)
 {
     return;
@@ -326,7 +400,8 @@ static void rctest(void)
     if (Motorsenable == 1) {
 	do {
 	    // 'switch (channel5) and throttle stick must be zero in order to proceed
-	    if (RC_Quality == 0 || PPM_in[Switchchannel] > -120 || PPM_in[Throttlechannel] > -120) {
+	    Rc_update();
+	    if (RC_Quality == 0 || Rc_in[Switchchannel] > -120 || Rc_in[Throttlechannel] > -120) {
 		// no RC signal or sticks not in correct position
 		if (Rc_on_counter > 0)
 		    Rc_on_counter--;
@@ -341,6 +416,10 @@ static void rctest(void)
 		_delay_ms(75);
 	    }
 	    _delay_ms(1);
+	    Ppm_update();
+#ifdef SPEKTRUM
+	    spektrum_update();
+#endif
 	} while (Rc_on_counter < 500);
 
 	// turn off led
@@ -392,12 +471,12 @@ static void acc_calibration(void)
 	}
 	calibrated = 1;
     }
-    printf("Acc Calibrated: %d, %d\r\n", AccY_init, AccX_init);
     Settings[PARAM_XACC_OFFSET] = AccX_init - 384;
     Settings[PARAM_YACC_OFFSET] = AccY_init - 384;
 
+    settings_apply(PARAM_XACC_OFFSET);
+    settings_apply(PARAM_YACC_OFFSET);
     settings_write();
-    settings_load();
 
     RED_OFF;
 }
@@ -467,45 +546,35 @@ static void gyro_calibration(void)
 		continue;	                        // if individual values differ from mean, then the copter was moved. Redo offset measurement.
 	}
     } while (Checkdiff > 2);
-
-    printf("Gyro Calibrated: %d, %d, %d\r\n", Roll_init, Pitch_init, Yaw_init);
     RED_OFF;
 }
 
-ISR(TIMER0_OVF_vect)
+// 1ms system tick. Finer timing reads Timer 1, which runs free at F_CPU / 64
+ISR(TIMER2_COMPA_vect)
 {
-    static u8 cnt_1ms = 1, cnt = 0;
     u8 beep_on = 0;
 
-    if (SpektrumTimer)
-	SpektrumTimer--;
-
-    if (!cnt--) {
-	cnt = 9;
-	CountMilliseconds++;
-	cnt_1ms++;
-	cnt_1ms %= 2;
+    CountMilliseconds++;
 
-	if (BeepTime) {
-	    if (BeepTime > 10)
-		BeepTime -= 10;
-	    else
-		BeepTime = 0;
+    if (BeepTime) {
+	if (BeepTime > 10)
+	    BeepTime -= 10;
+	else
+	    BeepTime = 0;
 
-	    if (BeepTime & BeepMask)
-		beep_on = 1;
-	    else
-		beep_on = 0;
-	} else {
+	if (BeepTime & BeepMask)
+	    beep_on = 1;
+	else
 	    beep_on = 0;
-	    BeepMask = 0xffff;
-	}
+    } else {
+	beep_on = 0;
+	BeepMask = 0xffff;
+    }
 
-	if (beep_on) {
-	    BUZZ_ON;
-	} else {
-	    BUZZ_OFF;
-	}
+    if (beep_on) {
+	BUZZ_ON;
+    } else {
+	BUZZ_OFF;
     }
 }
 
@@ -532,80 +601,102 @@ ISR(TIMER0_OVF_vect)
  */
 ISR(TIMER1_CAPT_vect)
 {				// typical rate of 1 ms to 2 ms
-    int16_t signal = 0, tmp;
-    static int16_t index;
+    static uint8_t index;
     static uint16_t oldICR1 = 0;
+    uint16_t now = ICR1;
+    uint16_t signal;
 
     // 16bit Input Capture Register ICR1 contains the timer value TCNT1
-    // at the time the edge was detected
-
-    // calculate the time delay to the previous event time which is stored in oldICR1
-    // calculatiing the difference of the two uint16_t and converting the result to an int16_t
-    // implicit handles a timer overflow 65535 -> 0 the right way.
-    signal = (uint16_t) ICR1 - oldICR1;
-    oldICR1 = ICR1;
+    // at the time the edge was detected. The uint16_t difference to the previous
+    // event handles a timer overflow 65535 -> 0 the right way.
+    signal = now - oldICR1;
+    oldICR1 = now;
 
     //sync gap? (3.52 ms < signal < 25.6 ms)
     if ((signal > 1100) && (signal < 8000)) {
-	// if a sync gap happens and there where at least 4 channels decoded before
-	// then the NewPpmData flag is reset indicating valid data in the PPM_in[] array.
-	if (index >= 4) {
-	    NewPpmData = 0;	// Null means NewData for the first 4 channels
+	// at least 4 channels before it make a frame. While the front one waits to be decoded, this one is dropped
+	if (index >= 4 && !PpmReady) {
+	    PpmCount = index;
+	    PpmFront ^= 1;
+	    PpmReady = 1;
 	}
 	// synchronize channel index
 	index = 1;
-    } else {			// within the PPM frame
-	if (index < MAX_CHANNELS - 1) {	// PPM24 supports 12 channels
-	    // check for valid signal length (0.8 ms < signal < 2.1984 ms)
-	    // signal range is from 1.0ms/3.2us = 312 to 2.0ms/3.2us = 625
-	    if ((signal > 250) && (signal < 687)) {
-		// shift signal to zero symmetric range  -154 to 159
-		signal -= 470;	// offset of 1.4912 ms ??? (469 * 3.2s = 1.5008 ms)
-		// check for stable signal
-		if (abs(signal - PPM_in[index]) < 6) {
-		    if (RC_Quality < 200)
-			RC_Quality += 10;
-		    else
-			RC_Quality = 200;
-		}
-		// If signal is the same as before +/- 1, just keep it there.
-		if (signal >= PPM_in[index] - 1 && signal <= PPM_in[index] + 1) {
-		    // In addition, if the signal is very close to 0, just set it to 0.
-		    if (signal >= -1 && signal <= 1) {
-			tmp = 0;
-		    } else {
-			tmp = PPM_in[index];
-		    }
-		} else
-		    tmp = signal;
-		// calculate signal difference on good signal level
-		if (RC_Quality >= 195)
-		    PPM_diff[index] = ((tmp - PPM_in[index]) / 3) * 3;	// cut off lower 3 bit for nois reduction
-		else
-		    PPM_diff[index] = 0;
-		PPM_in[index] = CLAMP(tmp, -127, 127);	// update channel value
-	    }
-	    index++;		// next channel
+    } else if (index < MAX_CHANNELS - 1)	// PPM24 supports 12 channels
+	PpmWidth[PpmFront ^ 1][index++] = signal;
+}
+
+// Decode the last frame TIMER1_CAPT_vect published into PPM_in[]/PPM_diff[] and PPM_frame[], if one came
+// in since the last call. Call it from the loop, it returns right away without a new frame.
+static void Ppm_update(void)
+{
+    const volatile u16 *frame;
+    int16_t signal, tmp;
+    u8 index;
+
+    if (!PpmReady)
+	return;
+    frame = PpmWidth[PpmFront];
+    for (index = 1; index < PpmCount; index++) {
+	signal = frame[index];
+	// check for valid signal length (0.8 ms < signal < 2.1984 ms)
+	// signal range is from 1.0ms/3.2us = 312 to 2.0ms/3.2us = 625
+	if (signal <= 250 || signal >= 687)
+	    continue;
+	// shift signal to zero symmetric range  -154 to 159
+	signal -= 470;		// offset of 1.4912 ms ??? (469 * 3.2s = 1.5008 ms)
+	// check for stable signal
+	if (abs(signal - PPM_in[index]) < 6) {
+	    if (RC_Quality < 200)
+		RC_Quality += 10;
+	    else
+		RC_Quality = 200;
 	}
+	// If signal is the same as before +/- 1, just keep it there.
+	if (signal >= PPM_in[index] - 1 && signal <= PPM_in[index] + 1) {
+	    // In addition, if the signal is very close to 0, just set it to 0.
+	    if (signal >= -1 && signal <= 1) {
+		tmp = 0;
+	    } else {
+		tmp = PPM_in[index];
+	    }
+	} else
+	    tmp = signal;
+	// calculate signal difference on good signal level
+	if (RC_Quality >= 195)
+	    PPM_diff[index] = ((tmp - PPM_in[index]) / 3) * 3;	// cut off lower 3 bit for nois reduction
+	else
+	    PPM_diff[index] = 0;
+	PPM_in[index] = fix_clamp16(tmp, -127, 127);	// update channel value
     }
+
+    for (index = 0; index < RC_CHANNELS; index++)
+	PPM_frame[index] = PPM_in[index];
+    NewPpmData = 0;		// Null means NewData for the first 4 channels
+    PpmReady = 0;		// the ISR may flip PpmFront again
 }
 
 static inline void timer_init(void)
 {
-    // Timer 0: 9.7kHz general-purpose timer used for blinking leds and beeping
+    // Timer 0: 9.7kHz fast PWM on OC0A/OC0B (pressure offset), no interrupt
     TCCR0B = 2;			// Prescaler /8
     TCCR0A = (1 << COM0A1) | (1 << COM0B1) | 3;	//fast PWM
     OCR0A = 0;
     OCR0B = 180;
-    TCNT0 = (unsigned char) -TIMER0_RELOAD_VALUE;	// reload
-    TIMSK0 |= _BV(TOIE0);
 
-#ifndef SPEKTRUM
-    // Timer 1: ICP timer for PPM input    
+    // Timer 2: TICK_HZ system tick, CTC
+    TCCR2A = (1 << WGM21);
+    TCCR2B = (1 << CS22) | (1 << CS20);	// Prescaler /128
+    OCR2A = F_CPU / 128 / TICK_HZ - 1;
+    TIMSK2 |= _BV(OCIE2A);
+
+    // Timer 1: free running timestamps at F_CPU / 64, 3.2us. ICP timer for PPM input,
+    // the Spektrum receiver measures its byte gaps with it
     TCCR1A &= ~((1 << COM1A1) | (1 << COM1A0) | (1 << COM1B1) | (1 << COM1B0) | (1 << WGM11) | (1 << WGM10));
     TCCR1B &= ~((1 << WGM13) | (1 << WGM12) | (1 << CS12));
     TCCR1B |= (1 << CS11) | (1 << CS10) | (1 << ICES1) | (1 << ICNC1);
     TCCR1C &= ~((1 << FOC1A) | (1 << FOC1B));
+#ifndef SPEKTRUM
     // Set ICP to input, internal pull up
     PORTD |= _BV(PIND6);
     DDRD &= ~(_BV(PIND6));
@@ -614,17 +705,88 @@ static inline void timer_init(void)
 #endif
 }
 
+/********************************************************************/
+/*   ADC round robin: all 8 channels, ADC_OVERSAMPLE times each     */
+/********************************************************************/
+// Every conversion complete starts the next one, so the ADC never idles. A round is
+// 8 * ADC_OVERSAMPLE conversions of ~21us (ADC clock 20MHz / 32), ~0.7ms. The averages
+// go to the back buffer, which then becomes the front, so a reader never sees half a round.
+ISR(ADC_vect)
+{
+    static u16 sum[ADC_CHANNELS];
+    static u8 channel = 0, count = 0;
+    u8 i, back;
+
+    sum[channel] += ADCW;
+    if (++channel == ADC_CHANNELS) {
+	channel = 0;
+	if (++count == ADC_OVERSAMPLE) {
+	    count = 0;
+	    back = AdcFront ^ 1;
+	    for (i = 0; i < ADC_CHANNELS; i++) {
+		AdcValue[back][i] = sum[i] >> ADC_OVERSAMPLE_SHIFT;
+		sum[i] = 0;
+	    }
+	    AdcFront = back;
+	}
+    }
+    // next channel, single conversion mode so the new mux setting applies right away
+    ADMUX = channel;
+    ADCSRA |= _BV(ADSC);
+}
+
 static inline void analog_init(void)
 {
     // external ADC reference       
     ADMUX = 0;
     // ADCSRA = (1 << ADEN) | (1 << ADSC) | (0 << ADATE) | (0 << ADPS2) | (1 << ADPS1) | (1 << ADPS0); // mine
-    ADCSRA = (1 << ADEN) | (1 << ADSC) | (0 << ADATE) | (1 << ADPS2) | (0 << ADPS1) | (1 << ADPS0);
+    // first conversion of the round robin, it runs from ADC_vect once interrupts are on
+    ADCSRA = (1 << ADEN) | (1 << ADSC) | (0 << ADATE) | (1 << ADIE) | (1 << ADPS2) | (0 << ADPS1) | (1 << ADPS0);
+}
+
+// Timer 1 runs free at F_CPU / 64. The capture ISR also reads a 16 bit register of it, the shared
+// TEMP byte must not change between the two halves of TCNT1
+static inline u16 Ticks(void)
+{
+    u16 t;
+    u8 sreg = SREG;
+
+    cli();
+    t = TCNT1;
+    SREG = sreg;
+    return t;
+}
+
+// Account the time since start to stage, returns now for the next stage
+static u16 Stage_end(u8 stage, u16 start)
+{
+    u16 now = Ticks();
+    u16 t = now - start;
+
+    if (t < Stage_min[stage])
+	Stage_min[stage] = t;
+    if (t > Stage_max[stage])
+	Stage_max[stage] = t;
+    Stage_sum[stage] += t;
+    return now;
+}
+
+static void Stage_reset(void)
+{
+    u8 i;
+
+    for (i = 0; i < STAGES; i++) {
+	Stage_min[i] = 0xffff;
+	Stage_max[i] = 0;
+	Stage_sum[i] = 0;
+    }
+    Stage_count = 0;
 }
 
 int main(void)
 {
     int i;
+    u16 t, loop_start;
 
     // I/O pins
     DDRB = 0x1B;		// LEDs and Pressure Offset
@@ -642,7 +804,6 @@ int main(void)
 #ifdef SPEKTRUM
     spektrum_init();
 #endif
-    stdout = stdin = &uart_str;
 
     _delay_ms(100);
     sei();			// Enable Interrupts
@@ -677,41 +838,77 @@ int main(void)
     GRN_ON;                     // All green
     BUZZ_OFF;
 
+    Stage_reset();
+    loop_start = Ticks();
     while (1) {
+	t = loop_start;
+	Ppm_update();
+#ifdef SPEKTRUM
+	spektrum_update();
+#endif
+	Rc_update();
+	t = Stage_end(STAGE_RC, t);
 	Acc();
+	t = Stage_end(STAGE_ACC, t);
 	Gyro();
+	t = Stage_end(STAGE_GYRO, t);
 	Mixer();
+	t = Stage_end(STAGE_MIXER, t);
 	Send_mots();
+	t = Stage_end(STAGE_MOTORS, t);
 	Led();
+	t = Stage_end(STAGE_LED, t);
 	Voltage();
+	t = Stage_end(STAGE_VOLTAGE, t);
 	// Failsave();
 	Guiconnection();
+	Stage_end(STAGE_GUI, t);
+
+	// the whole loop: one Ticks() apart from the next loop's first stage
+	loop_start = Stage_end(STAGE_LOOP, loop_start);
+	if (++Stage_count == 0xffff)
+	    Stage_reset();	// an hour of loops without a 't' request, keep the sums from overflowing
     }
 }
 
+// Latest average of a channel from ADC_vect, it only changes every ~0.7ms
 u16 Getadc(u8 channel)
 {
-    // choose channel
-    ADMUX = channel & 0x07;
-    // start the conversion
-    ADCSRA |= _BV(ADSC);
-    // ADSC is cleared when the conversion finishes
-    while (bit_is_set(ADCSRA, ADSC));
+    return AdcValue[AdcFront][channel & 0x07];
+}
 
-    return ADCW;
+// Take over a frame the receiver code published since the last call and derive the sticks
+// from it. Returns 1 on a new frame. Everything else reads Rc_in[] and the *_stick values,
+// which therefore never mix two frames.
+static u8 Rc_update(void)
+{
+    u8 i, sreg;
+
+    if (NewPpmData)
+	return 0;
+    sreg = SREG;
+    cli();
+    for (i = 0; i < RC_CHANNELS; i++)
+	Rc_in[i] = PPM_frame[i];
+    NewPpmData = 1;
+    SREG = sreg;
+
+    Throttle_stick = (u16)(Rc_in[Throttlechannel] + 127) * 228U / 255 + 3;	// (3-228)
+    Pitch_stick = Rc_in[Pitchchannel] / 4;
+    Roll_stick = Rc_in[Rollchannel] / 4;
+    Yaw_stick = Rc_in[Yawchannel] / 4;
+    Switch_stick = Rc_in[Switchchannel];
+    return 1;
 }
 
-static const float DynamicBoost[] = { 5.8f, 6.1f, 6.3f, 6.5f, 6.8f, 7.2f, 7.6f, 8.1f, 8.7f, 9.4f, 10.2f, 11.0f, 12.0f, 13.6f };
+// 1 .. 2.35 times Lf_acro in Q12: the BASCOM table went 5.8 .. 13.6 from its default acro sensitivity of 5.8
+static const u16 DynamicBoost[] = { 4096, 4308, 4449, 4590, 4802, 5083, 5368, 5721, 6143, 6636, 7202, 7767, 8473, 9604 };
 
 void Mixer(void)
 {
     int i;
     static int cal_counter = 0;
 
-    s16 throttle_stick = ((PPM_in[Throttlechannel] + 127) * (228.0f / 255.0f)) + 3;	// (3-228)
-    s16 pitch_stick = PPM_in[Pitchchannel] / 4;
-    s16 roll_stick = PPM_in[Rollchannel] / 4;
-    s16 switch_channel = PPM_in[Switchchannel];
 
 #if 0
     printf("Throttle: %d, State: %d Motors: %d\r\n", throttle, State, Motorsenable);
@@ -719,7 +916,7 @@ void Mixer(void)
 
     if (State == 0) {
 	// Motors off. Do various calibration things here
-	if (PPM_in[Throttlechannel] > 100 && PPM_in[Yawchannel] < -100) {
+	if (Rc_in[Throttlechannel] > 100 && Rc_in[Yawchannel] < -100) {
 	    // ACC calibration (Throttle stick up+left)
 	    cal_counter++;
 	    if (cal_counter == 1000) {
@@ -730,7 +927,7 @@ void Mixer(void)
 		BeepTime = 1000;
 		BeepMask = 0xFFFF;
 	    }
-	} else if (PPM_in[Throttlechannel] > 100 && PPM_in[Yawchannel] > 100) {
+	} else if (Rc_in[Throttlechannel] > 100 && Rc_in[Yawchannel] > 100) {
 	    // Gyro calibration (Throttle stick up+right)
 	    cal_counter++;
 	    if (cal_counter == 1000) {
@@ -753,21 +950,15 @@ void Mixer(void)
 	s16 Lookup_pos_roll;
 
 	if (State == 1) {	// only when in acro mode
-	    Lookup_pos_pitch = abs(pitch_stick);	// make a variable that grows when stick is out of centre
+	    Lookup_pos_pitch = abs(Pitch_stick);	// make a variable that grows when stick is out of centre
 	    Lookup_pos_pitch = Lookup_pos_pitch - 25;
-	    Lookup_pos_pitch = CLAMP(Lookup_pos_pitch, 0, 13);
-	    if (Lookup_pos_pitch != 0)
-		Lfdynamic_pitch = DynamicBoost[Lookup_pos_pitch];	// TODO Lookup(lookup_pos_nick , Dta)        'look for a new sensitivity factor in a table
-	    else
-		Lfdynamic_pitch = Lf;
+	    Lookup_pos_pitch = fix_clamp16(Lookup_pos_pitch, 0, 13);
+	    Lfdynamic_pitch = Lf_boosted[Lookup_pos_pitch];	// [0] is Lf_acro, which Lf is in acro mode
 
-	    Lookup_pos_roll = abs(roll_stick);	//               'make a variable that grows when stick is out of centre
+	    Lookup_pos_roll = abs(Roll_stick);	//               'make a variable that grows when stick is out of centre
 	    Lookup_pos_roll = Lookup_pos_roll - 26;
-	    Lookup_pos_roll = CLAMP(Lookup_pos_roll, 0, 13);
-	    if (Lookup_pos_roll != 0)
-		Lfdynamic_roll = DynamicBoost[Lookup_pos_roll];	// TODO Lookup(lookup_pos_roll , Dta)        'look for a new sensitivity factor in a table
-	    else
-		Lfdynamic_roll = Lf;
+	    Lookup_pos_roll = fix_clamp16(Lookup_pos_roll, 0, 13);
+	    Lfdynamic_roll = Lf_boosted[Lookup_pos_roll];
 	}
     } else {
 	Lfdynamic_roll = Lf;
@@ -776,44 +967,29 @@ void Mixer(void)
 
     // ACRO MODE (angular velocity control, ACC = off)
     if (Motorsenable == 1) {	// only listen to receiver (and especially channel 5) when user enabled the motors in the GUI
-	if (switch_channel > -40 && switch_channel < 40) {	// switch in middle = motors on; sempf(5) is the idle up switch
+	if (Switch_stick > -40 && Switch_stick < 40) {	// switch in middle = motors on; sempf(5) is the idle up switch
 	    Minthrottle = Idle_up;	//                                        'minimum throttle
 	    Gyro_i_enable = 1;	//                                        'start integrating the gyroscope signals
 	    Lf = Lf_acro;	//                                             '5.8                                                  'nick and roll sensitivity
-	    P_sens = P_sens_acro;	//                                    '0.45                                             'Gyro_P sensitivity roll and nick
-	    I_sens = I_sens_acro;	//                                    '0.001                                            'Gyro_I Sensitivity roll and nick
-	    D_sens = D_sens_acro;	//                                    'no D available in Acro mode (calculating it only yields noise)
-	    Yaw_p_sens = Yaw_p_sens_eep;	//                             'Gyro_P Sensitivity yaw
-	    Yaw_i_sens = Yaw_i_sens_eep;	//                             'Gyro_I Sensitivity yaw
 	    Motors_on = 1;	//
 	    State = 1;		//                                               'flight mode: acrobatic
 	}
 	// 'HOVER MODE (angle control, ACC = on)
-	if (switch_channel >= 40) {	// switch top = motors on
+	if (Switch_stick >= 40) {	// switch top = motors on
 	    Minthrottle = Idle_up;	//                                       'minimum throttle
 	    Gyro_i_enable = 1;	//                                       'start integrating the gyroscope signals
 	    Lf = Lf_hover;	//                                          '450                                                  'nick and roll sensitivity (much bigger, because a different control loop is used)
-	    P_sens = P_sens_hover;	//                                   '0.0025                                           'Gyro_P sensitivity roll and nick (corresponds to Gyro_I in acro mode)
-	    I_sens = I_sens_hover;	//                                   '0.0000015                                        'Gyro_I sensitivity roll and nick (this is a double integral, thats why the value is so low)
-	    D_sens = D_sens_hover;	//                                   '0.4                                              'Gyro_D sensitivity roll and nick (corresponds to Gyro_P in acro mode)
-	    Yaw_p_sens = Yaw_p_sens_eep;	//                             'Gyro_P Sensitivity yaw
-	    Yaw_i_sens = Yaw_i_sens_eep;	//                             'Gyro_I Sensitivity yaw
 	    Motors_on = 1;	//
 	    State = 2;		//                                               'flight mode: hover
 	}
 
-	if (switch_channel < -40) {	// switch bottom = motors off
-	    if (throttle_stick < 20) {	//                     'only turn motors off when throttle stick is also on bottom
+	if (Switch_stick < -40) {	// switch bottom = motors off
+	    if (Throttle_stick < 20) {	//                     'only turn motors off when throttle stick is also on bottom
 		Minthrottle = 0;	//                                             'no minimum throttle = motors off
 		Gyro_i_enable = 0;	//                                      'do not integrate gyros anymore
 		Motors_on = 0;	//
 		State = 0;	//                                              'flight mode: off
 		Lf = 0;		//                                                 'don't react to stick movements
-		P_sens = 0;	//                                             'don't react to gyros
-		I_sens = 0;	//                                             'don't react to gyros
-		D_sens = 0;	//                                             'don't react to gyros
-		Yaw_p_sens = 0;	//                                         'don't react to gyros
-		Yaw_i_sens = 0;	//                                         'don't react to gyros
 	    }
 	}
     } else {			// 'if motors were not enabled in GUI or if EEprom emty: always stay in GUI mode
@@ -822,11 +998,6 @@ void Mixer(void)
 	Motors_on = 0;		//
 	State = 0;		//                                                'flight mode: off
 	Lf = 0;			//                                                   'don't react to stick movements
-	P_sens = 0;		//                                               'don't react to gyros
-	I_sens = 0;		//                                               'don't react to gyros
-	D_sens = 0;		//                                               'don't react to gyros
-	Yaw_p_sens = 0;		//                                           'don't react to gyros
-	Yaw_i_sens = 0;		//                                           'don't react to gyros
     }
 
     // Mix components
@@ -847,7 +1018,7 @@ void Mixer(void)
 
         // Init with throttle
         for (i = 0; i < 4; i++)
-            Motors[i] = throttle_stick + Minthrottle;
+            Motors[i] = Throttle_stick + Minthrottle;
 
         // Mixer
         if (MixerType == QUAD) {
@@ -898,22 +1069,16 @@ void Mixer(void)
 static inline void Gyro(void)
 {
     int i;
-    s16 yaw_stick = PPM_in[Yawchannel] / 4;
-    s16 pitch_stick = PPM_in[Pitchchannel] / 4;
-    s16 roll_stick = PPM_in[Rollchannel] / 4;
-
-    float Setpoint_roll;	// Stick position
-    float Error_roll;		// Stick position - current position
-    float Error_roll_sum;	// Integral of the above
-    float Setpoint_pitch;	// Stick position
-    float Error_pitch;		// Stick position - current position
-    float Error_pitch_sum;	// Integral of the above
+
+    s32 Setpoint_roll;		// Stick position
+    s32 Error_roll;		// Stick position - current position
+    s32 Setpoint_pitch;		// Stick position
+    s32 Error_pitch;		// Stick position - current position
+    s32 tmp;
     s16 Yaw_diff;		// yaw gyro var
 
     if (Old_state != State) {	// 'compare state of last cycle with current state
-	Error_roll = 0;		// 'otherwise things would start mixing up...
-	Error_pitch = 0;
-	Meas_roll = 0;
+	Meas_roll = 0;		// 'otherwise things would start mixing up...
 	Meas_pitch = 0;
 	Error_roll_sum = 0;
 	Error_pitch_sum = 0;
@@ -927,14 +1092,13 @@ static inline void Gyro(void)
 	}
 
 	if (State == 2) {
-	    Meas_angle_roll = Yacc;	            // when switching from acro mode to hover mode
-	    Meas_angle_pitch = Xacc;	            // start with a "close to reality" angle
+	    Meas_angle_roll = (s32)Yacc << ANGLE_SHIFT;	    // when switching from acro mode to hover mode
+	    Meas_angle_pitch = (s32)Xacc << ANGLE_SHIFT;    // start with a "close to reality" angle
 	} else {
 	    Meas_angle_roll = 0;
 	    Meas_angle_pitch = 0;
 	}
 	Yaw_gyro_i = 0;
-	Yaw_diff = 0;
     }
 
     Old_state = State;
@@ -955,20 +1119,20 @@ static inline void Gyro(void)
 	    Meas_roll = Meas_roll - Roll_init;	// subtract offset
 	}
 
-	Setpoint_roll = roll_stick * Lfdynamic_roll;	// roll stick position
+	Setpoint_roll = (Roll_stick * Lfdynamic_roll + (1 << (LF_SHIFT - 1))) >> LF_SHIFT;	// roll stick position
 	Error_roll = Meas_roll - Setpoint_roll;	// calculate difference between angular velocity and stick position
 	// this calculates the angular velocity (D-term in acro mode)
 	Error_roll_d[Looper] = Error_roll - Error_roll_old[Looper];
 	Error_roll_old[Looper] = Error_roll;
-	D_set_roll = Error_roll_d[Looper] * D_sens;
+	D_set_roll = fix_clamp32(((s32)Error_roll_d[Looper] * D_sens_acro) >> 10, -32000, 32000);
 	// clip here
 	Error_roll_sum = Error_roll_sum + Error_roll;	// integrate the above
-	Error_roll_sum = CLAMP(Error_roll_sum, -10000, 10000);
-	P_set_roll = Error_roll * P_sens;	// multiply with gain
+	Error_roll_sum = fix_clamp32(Error_roll_sum, -10000, 10000);
+	P_set_roll = (Error_roll * P_sens_acro) >> 12;	// multiply with gain
         // don't integrate when motors off
 	if (Gyro_i_enable == 0)
 	    Error_roll_sum = 0;
-	I_set_roll = Error_roll_sum * I_sens;	// multiply with gain
+	I_set_roll = (Error_roll_sum * I_sens_acro) >> 20;	// multiply with gain
 
 	// Pitch
 	Meas_pitch = Getadc(ADC_GYRO_PITCH);	// see above
@@ -978,26 +1142,23 @@ static inline void Gyro(void)
 	    Meas_pitch = Pitch_init - Meas_pitch;
 	}
 
-	Setpoint_pitch = pitch_stick * Lfdynamic_pitch;
+	Setpoint_pitch = (Pitch_stick * Lfdynamic_pitch + (1 << (LF_SHIFT - 1))) >> LF_SHIFT;
 	Error_pitch = Meas_pitch - Setpoint_pitch;
 	// this calculates the angular velocity (D-term in acro mode)
 	Error_pitch_d[Looper] = Error_pitch - Error_pitch_old[Looper];
 	Error_pitch_old[Looper] = Error_pitch;
-	D_set_pitch = Error_pitch_d[Looper] * D_sens;
+	D_set_pitch = fix_clamp32(((s32)Error_pitch_d[Looper] * D_sens_acro) >> 10, -32000, 32000);
 	// clip here
 	Error_pitch_sum = Error_pitch_sum + Error_pitch;
-	Error_pitch_sum = CLAMP(Error_pitch_sum, -10000, 10000);
-	P_set_pitch = Error_pitch * P_sens;
+	Error_pitch_sum = fix_clamp32(Error_pitch_sum, -10000, 10000);
+	P_set_pitch = (Error_pitch * P_sens_acro) >> 12;
 	if (Gyro_i_enable == 0)
 	    Error_pitch_sum = 0;
-	I_set_pitch = Error_pitch_sum * I_sens;
+	I_set_pitch = (Error_pitch_sum * I_sens_acro) >> 20;
     }
 
     // HOVER MODE = Angle control
     if (State == 2 || State == 0) {
-	float Accy_temp;	// used for complementary filtering
-	float Accx_temp;	// used for complementary filtering
-
 	// for angular acceleration measurement
 	// acceleration will be calculated as the difference in velocity between
 	// loop n and loop n+2
@@ -1018,9 +1179,9 @@ static inline void Gyro(void)
 	// this calculates the angular velocity (D-term in acro mode)
 	Error_roll_d[Looper] = Meas_roll - Error_roll_old[Looper];
 	Error_roll_old[Looper] = Meas_roll;
-	Dd_set_roll = Error_roll_d[Looper] * Dd_sens;
+	Dd_set_roll = ((s32)Error_roll_d[Looper] * Dd_sens) >> 12;
 	// integrate gyro signal
-	Meas_angle_roll = Meas_angle_roll + Meas_roll;
+	Meas_angle_roll = Meas_angle_roll + ((s32)Meas_roll << ANGLE_SHIFT);
 
 	// this might require some further explanation:
 	// The gyroscopes can only measure differences in rotational speed. Integrated over a long time (e.g. 11 minutes of flight)
@@ -1028,19 +1189,20 @@ static inline void Gyro(void)
 	// copter, but it reacts pretty slowly. And it contains quite some noise. The following lines of code combine the fast
 	// signal of the gyroscopes and the absolute precision of the accelerometer. In the end, you get the best out of both worlds:
 
-	Meas_angle_roll = Meas_angle_roll * Gyro_influence;	// 0.99 take 0.99 of gyro integral and 0.01 of acc...
-	Accy_temp = Yacc * Acc_influence;	                // 0.01
-	Meas_angle_roll = Meas_angle_roll + Accy_temp;	        // ...and put these two together (complementary filtering)
+	// 0.99 of gyro integral and 0.01 of acc, as angle + (acc - angle) * 0.01 (complementary filtering)
+	Meas_angle_roll = Meas_angle_roll + fix_mulq16(((s32)Yacc << ANGLE_SHIFT) - Meas_angle_roll, Acc_influence);
+	Meas_angle_roll = fix_clamp32(Meas_angle_roll, -(ANGLE_MAX << ANGLE_SHIFT), ANGLE_MAX << ANGLE_SHIFT);
 
-	Setpoint_roll = roll_stick * Lf;	                // roll stick position * stick sensitivity
+	Setpoint_roll = Roll_stick * Lf;	                // roll stick position * stick sensitivity, both Q8
 	Error_roll = Meas_angle_roll - Setpoint_roll;	        // current angle minus desired angle (stick position)
-	Error_roll_sum = Error_roll_sum + Error_roll;	        // integral of an integral
-	Error_roll_sum = CLAMP(Error_roll_sum, -4000000, 4000000);	// integral clipping
-	P_set_roll = Error_roll * P_sens;	                // multiply with gain
+	Error_roll_sum = Error_roll_sum + (Error_roll >> ANGLE_SHIFT);	// integral of an integral
+	Error_roll_sum = fix_clamp32(Error_roll_sum, -4000000, 4000000);	// integral clipping
+	tmp = fix_mulq16(Error_roll, P_sens_hover) >> (20 - 16 + ANGLE_SHIFT);	// multiply with gain
+	P_set_roll = fix_clamp32(tmp, -32000, 32000);
 	if (Gyro_i_enable == 0)
 	    Error_roll_sum = 0;
-	I_set_roll = Error_roll_sum * I_sens;	                // multiply with gain
-	D_set_roll = Meas_roll * D_sens;	                // multiply with gain
+	I_set_roll = fix_mulq16(Error_roll_sum, I_sens_hover) >> (31 - 16);	// multiply with gain
+	D_set_roll = ((s32)Meas_roll * D_sens_hover) >> 12;	// multiply with gain
 
 	// Pitch
 	Meas_pitch = Getadc(ADC_GYRO_PITCH);	                // see above
@@ -1053,23 +1215,23 @@ static inline void Gyro(void)
 	// this calculates the angular velocity (D-term in acro mode)
 	Error_pitch_d[Looper] = Meas_pitch - Error_pitch_old[Looper];
 	Error_pitch_old[Looper] = Meas_pitch;
-	Dd_set_pitch = Error_pitch_d[Looper] * Dd_sens;
+	Dd_set_pitch = ((s32)Error_pitch_d[Looper] * Dd_sens) >> 12;
 
-	Meas_angle_pitch = Meas_angle_pitch + Meas_pitch;
-	Meas_angle_pitch = Meas_angle_pitch * Gyro_influence;	// 0.99
-	Accx_temp = Xacc * Acc_influence;	                // 0.01
-	Meas_angle_pitch = Meas_angle_pitch + Accx_temp;
-	Setpoint_pitch = pitch_stick * Lf;
+	Meas_angle_pitch = Meas_angle_pitch + ((s32)Meas_pitch << ANGLE_SHIFT);
+	Meas_angle_pitch = Meas_angle_pitch + fix_mulq16(((s32)Xacc << ANGLE_SHIFT) - Meas_angle_pitch, Acc_influence);
+	Meas_angle_pitch = fix_clamp32(Meas_angle_pitch, -(ANGLE_MAX << ANGLE_SHIFT), ANGLE_MAX << ANGLE_SHIFT);
+	Setpoint_pitch = Pitch_stick * Lf;
 	Error_pitch = Meas_angle_pitch - Setpoint_pitch;
-	Error_pitch_sum = Error_pitch_sum + Error_pitch;
-	Error_pitch_sum = CLAMP(Error_pitch_sum, -4000000, 4000000);	// integral clipping
+	Error_pitch_sum = Error_pitch_sum + (Error_pitch >> ANGLE_SHIFT);
+	Error_pitch_sum = fix_clamp32(Error_pitch_sum, -4000000, 4000000);	// integral clipping
 
-	P_set_pitch = Error_pitch * P_sens;
+	tmp = fix_mulq16(Error_pitch, P_sens_hover) >> (20 - 16 + ANGLE_SHIFT);
+	P_set_pitch = fix_clamp32(tmp, -32000, 32000);
 	if (Gyro_i_enable == 0) {
 	    Error_pitch_sum = 0;
 	}
-	I_set_pitch = Error_pitch_sum * I_sens;
-	D_set_pitch = Meas_pitch * D_sens;
+	I_set_pitch = fix_mulq16(Error_pitch_sum, I_sens_hover) >> (31 - 16);
+	D_set_pitch = ((s32)Meas_pitch * D_sens_hover) >> 12;
     }
 
     // Yaw
@@ -1080,19 +1242,19 @@ static inline void Gyro(void)
 	Yaw_gyro = Yaw_init - Yaw_gyro;
     }
 
-    Yaw_diff = yaw_stick * Lf_yaw;	                        // yaw stick position
+    Yaw_diff = Yaw_stick * Lf_yaw;	                        // yaw stick position
     if (Yaw_gyro_dir == 1)
 	Yaw_diff = -Yaw_diff;
 
     Yaw_diff = Yaw_diff - Yaw_gyro;	                        // stick position - current angular velocity
     Yaw_gyro_i = Yaw_gyro_i + Yaw_diff;	                        // integral of the above
-    Yaw_gyro_i = CLAMP(Yaw_gyro_i, -32000, 32000);	        // protect from overflow
+    Yaw_gyro_i = fix_clamp16(Yaw_gyro_i, -32000, 32000);	        // protect from overflow
 
-    Yaw_gyro_scale = Yaw_diff * Yaw_p_sens;	                // multiply with gain
+    Yaw_gyro_scale = ((s32)Yaw_diff * Yaw_p_sens_eep) >> 14;	// multiply with gain
     // integrate only when motors on
     if (Gyro_i_enable == 0)
 	Yaw_gyro_i = 0;
-    Yaw_gyro_i_scale = Yaw_gyro_i * Yaw_i_sens;	                // multiply with gain
+    Yaw_gyro_i_scale = ((s32)Yaw_gyro_i * Yaw_i_sens_eep) >> 20;	// multiply with gain
 }
 
 void Acc()
@@ -1212,6 +1374,7 @@ void Led(void)
 static void Send_mots()
 {
     u8 i;
+    u8 out[4];
     
     for (i = 0; i < 4; i++) {
         s16 Limit = (Motors_on == 1) ? Minthrottle : 0;
@@ -1225,11 +1388,13 @@ static void Send_mots()
 
     if (Failure < 15 && Motorsenable == 1) {	// 'if there are NO problems with the receiver and shrediquette was programmed: run motors
         for (i = 0; i < 4; i++)
-            i2c_write(MOTOR_START_ADDR + (i * 2), Motors[i]);
+            out[i] = Motors[i];
     } else {			// 'if there are problems with the receiver: turn off motors
         for (i = 0; i < 4; i++)
-            i2c_write(MOTOR_START_ADDR + (i * 2), 0);
+            out[i] = 0;
     }
+    // all four in one interrupt driven batch. Still busy with the last one: these are dropped, the next loop sends newer ones
+    i2c_queue(MOTOR_START_ADDR, out, 4);
 }
 
 void Voltage()
@@ -1250,116 +1415,238 @@ void Failsave()
     // handle differently
 }
 
+// Integer rescale of a reading to 0..254 for the gui: fix_clamp32(v / div, -127, 127) + 127
+static u8 Sensorbyte(s32 v, s16 div)
+{
+    v /= div;
+    return fix_clamp32(v, -127, 127) + 127;
+}
+
+// The 's' frame: 13 sensor bytes, the first 12 PPM channels, sequence number
+static void Sensorsend(void)
+{
+    u8 i;
+    u8 Sensor[13 + 12 + 1];
+
+    // rescale the readings from the sensors to a value ranging from 0 to 255
+    Sensor[0] = Sensorbyte(Meas_roll, 2);
+    Sensor[1] = Sensorbyte(Meas_angle_roll >> ANGLE_SHIFT, 200);
+    Sensor[2] = Sensorbyte(Yacc, 200);
+    Sensor[3] = Sensorbyte(Meas_pitch, 2);
+    Sensor[4] = Sensorbyte(Meas_angle_pitch >> ANGLE_SHIFT, 200);
+    Sensor[5] = Sensorbyte(Xacc, 200);
+    Sensor[6] = Sensorbyte(Yaw_gyro, 2);
+
+    Sensor[7] = Rc_in[Throttlechannel] + 127;
+    Sensor[8] = Rc_in[Rollchannel] + 127;
+    Sensor[9] = Rc_in[Pitchchannel] + 127;
+    Sensor[10] = Rc_in[Yawchannel] + 127;
+    Sensor[11] = Rc_in[Switchchannel] + 127;
+
+    Sensor[12] = Voltage_Level;
+
+    // RC channel data too (12 channels)
+    for (i = 0; i < 12; i++)
+	Sensor[13 + i] = Rc_in[i] + 127;
+    Sensor[25] = Stream_seq++;	// also counts frames the TX ring had no room for
+    uart_send('s', Sensor, sizeof(Sensor));
+}
+
 void Guiconnection()
 {
-    char uartBuffer[8];		// Dim A As String * 8
-    int i;
-    u8 ch;
+    u8 frame[UART_FRAME_MAX];
+    u8 cmd;
     u8 len;
-    float tmp;
-    u8 Sensor[13];
-
-    if (State == 0) {		// don't listen to serial commands when motors running!
-	char *ptr = uartBuffer;
-	len = sizeof(uartBuffer);
-	memset(uartBuffer, 0, sizeof(uartBuffer));
-	if (bit_is_set(UCSR0A, RXC0)) {
-	    do {
-		loop_until_bit_is_set(UCSR0A, RXC0);
-		// get the char
-		ch = UDR0;
-		if (ch == '\r' || ch == '\n') {
-		    break;
-		} else {
-		    *ptr++ = ch;
-		    len--;
+    u8 sreg;
+    s16 now;
+
+    sreg = SREG;		// CountMilliseconds is two bytes, don't let TIMER2_COMPA_vect split the read
+    cli();
+    now = CountMilliseconds;
+    SREG = sreg;
+
+    // frames from the pc, collected by the uart interrupt. Never waits on the uart
+    while (uart_receive(&cmd, frame, &len)) {
+	Rx_last = now;
+	switch (cmd) {
+	case 'r':
+	    // output all parameters
+	    uart_send('p', Settings, sizeof(Settings));
+	    break;
+	case 's':
+	    // output realtime sensor data, cheap enough to be allowed with the motors running
+	    Sensorsend();
+	    break;
+	case 'S':
+	    // subscribe: one byte, ms between 's' frames, 0 stops. Allowed in flight
+	    if (len == 1) {
+		StreamPeriod = frame[0];
+		if (StreamPeriod && StreamPeriod < Stream_min[Baud])
+		    StreamPeriod = Stream_min[Baud];
+		StreamLast = now;
+	    }
+	    break;
+	case 'W':
+	    // pc changes parameters: (index, value) pairs, only the ones that differ from its last 'p'.
+	    // Every pair is acknowledged in an 'a' frame with the value now in use, so the pc sees
+	    // what didn't take. Nothing takes while flying, the gains would change under the control
+	    // loops, and the acc offsets come from acc_calibration(), not from the pc
+	    {
+		u8 i;
+		u8 o = 0;
+		u8 changed = 0;
+
+		for (i = 0; i + 1 < len; i += 2) {
+		    u8 id = frame[i];
+
+		    if (id >= sizeof(Settings))
+			continue;
+		    if (State == 0 && id != PARAM_XACC_OFFSET && id != PARAM_YACC_OFFSET)
+			changed |= settings_set(id, frame[i + 1]);
+		    frame[o++] = id;	// the answer overwrites pairs already read
+		    frame[o++] = Settings[id];
 		}
-	    } while (bit_is_set(UCSR0A, RXC0) || len > 0);
-
-	    if (strlen(uartBuffer) == 0)
-		return;
-
-	    if (strstr(uartBuffer, "cr!")) {
-		// output all parameters
-		_delay_ms(25);
-		printf("s#p!\r\n");	// tell pc that data will follow
-		fwrite(Settings, 1, sizeof(Settings), stdout);	// print the list of parameters that can be modified
-		printf("\r\n");
-	    } else if (strstr(uartBuffer, "cs!")) {
-		// output realtime sensor data
-		printf("ss!\r\n");	// tell pc that sensor data will follow
-		// rescale the readings from the sensors to a value ranging from 0 to 255
-		// and put these values in an array "sensor(X)"
-		tmp = Meas_roll / 2;
-		Sensor[0] = CLAMP(tmp, -127, 127) + 127;
-
-		tmp = Meas_angle_roll / 200.0f;
-		Sensor[1] = CLAMP(tmp, -127, 127) + 127;
-
-		tmp = (float) Yacc / 200.0f;
-		Sensor[2] = CLAMP(tmp, -127, 127) + 127;
-
-		tmp = Meas_pitch / 2;
-		Sensor[3] = CLAMP(tmp, -127, 127) + 127;
-
-		tmp = Meas_angle_pitch / 200.0f;
-		Sensor[4] = CLAMP(tmp, -127, 127) + 127;
-
-		tmp = (float) Xacc / 200.0f;
-		Sensor[5] = CLAMP(tmp, -127, 127) + 127;
-
-		tmp = Yaw_gyro / 2;
-		Sensor[6] = CLAMP(tmp, -127, 127) + 127;
-
-		Sensor[7] = PPM_in[Throttlechannel] + 127;
-		Sensor[8] = PPM_in[Rollchannel] + 127;
-		Sensor[9] = PPM_in[Pitchchannel] + 127;
-		Sensor[10] = PPM_in[Yawchannel] + 127;
-		Sensor[11] = PPM_in[Switchchannel] + 127;
-
-		Sensor[12] = Voltage_Level;
-
-		// write out sensor data
-		fwrite(Sensor, 1, sizeof(Sensor), stdout);
-		// write out RC channel data too (12 channels)
-		for (i = 0; i < 12; i++) {
-		    u8 out = PPM_in[i] + 127;
-		    fwrite(&out, 1, 1, stdout);
+		// in use right away, the eeprom follows in the background
+		if (changed)
+		    settings_write();
+		uart_send('a', frame, o);
+	    }
+	    break;
+	case 'B':
+	    // baud rate, one byte index into Bauds[]. Acknowledged at the old rate, then switched.
+	    // Falls back to UART_BAUD after BAUD_FALLBACK without a frame
+	    if (len == 1 && frame[0] < sizeof(Bauds) / sizeof(Bauds[0])) {
+		uart_send('b', frame, 1);
+		Baud_next = frame[0];
+	    }
+	    break;
+	case 'T':
+	    // loop timing: count, then min, max, average per stage in Timer 1 ticks, u16 each. Restarts the statistics
+	    {
+		u16 out[1 + 3 * STAGES];
+		u8 i;
+
+		out[0] = Stage_count;
+		for (i = 0; i < STAGES; i++) {
+		    out[1 + i * 3] = Stage_count ? Stage_min[i] : 0;
+		    out[2 + i * 3] = Stage_max[i];
+		    out[3 + i * 3] = Stage_count ? Stage_sum[i] / Stage_count : 0;
 		}
-		printf("\r\n");
-	    } else if (strstr(uartBuffer, "ci!")) {
-		u8 xacc_temp, yacc_temp;
-		xacc_temp = Settings[PARAM_XACC_OFFSET];
-		yacc_temp = Settings[PARAM_YACC_OFFSET];
-
-		// pc wants to transfer parameters
-		fread(Settings, 1, sizeof(Settings), stdin);
-
-		Settings[PARAM_XACC_OFFSET] = xacc_temp;
-		Settings[PARAM_YACC_OFFSET] = yacc_temp;
-
-		//'Ms_h = 0 : I2csend M_h , Ms_h    'turn off the motors
-		//'Ms_r = 0 : I2csend M_r , Ms_r
-		//'Ms_l = 0 : I2csend M_l , Ms_l
-		_delay_ms(10);
-		// save parameters to eeprom
-		settings_write();
-		_delay_ms(50);
-		settings_load();
-	    } else if (strstr(uartBuffer, "reset!")) {
-		_delay_ms(100);
-		// TODO $3c00                                             '$3c00 -> m328p; $1c00 -> m168
+		if (uart_send('t', out, sizeof(out)))
+		    Stage_reset();
 	    }
+	    break;
+	case 'R':
+	    if (State == 0)
+		Bootloader();
+	    break;
 	}
     }
+
+    if (Baud_next != Baud && uart_tx_idle()) {
+	Baud = Baud_next;
+	uart_set_baud(Bauds[Baud]);
+	if (StreamPeriod && StreamPeriod < Stream_min[Baud])
+	    StreamPeriod = Stream_min[Baud];
+	Rx_last = now;
+    } else if (Baud && (s16)(now - Rx_last) > BAUD_FALLBACK) {
+	// the pc is gone or never followed
+	Baud = Baud_next = 0;
+	uart_set_baud(UART_BAUD);
+	StreamPeriod = 0;
+    }
+
+    if (StreamPeriod && (s16)(now - StreamLast) >= StreamPeriod) {
+	// a frame the TX ring can't take is skipped, not queued for later
+	StreamLast = now;
+	Sensorsend();
+    }
 }
 
-static void settings_write(void)
+// Next Settings[] byte EE_READY_vect compares with the EEPROM, sizeof(Settings) when idle
+static volatile u8 Settings_next = sizeof(Settings);
+
+// Background commit: every byte that differs from Settings[] is written, one per interrupt.
+// A write takes ~3.4ms and the interrupt only comes back once it is done, unchanged bytes
+// cost a read each. Same as eeprom_update_byte(), without waiting.
+ISR(EE_READY_vect)
 {
     u8 i;
 
-    for (i = 0; i < 33; i++)
-	eeprom_write_byte((u8 *)i, Settings[i]);
+    while ((i = Settings_next) < sizeof(Settings)) {
+	Settings_next = i + 1;
+	EEAR = i;
+	EECR |= _BV(EERE);
+	if (EEDR != Settings[i]) {
+	    EEDR = Settings[i];
+	    EECR |= _BV(EEMPE);
+	    EECR |= _BV(EEPE);	// within 4 cycles of EEMPE, interrupts are off in here
+	    return;
+	}
+    }
+    EECR &= ~_BV(EERIE);	// all of it in the EEPROM
+}
+
+// Start (or restart, after further changes) the background commit of Settings[], returns at once
+static void settings_write(void)
+{
+    Settings_next = 0;
+    EECR |= _BV(EERIE);
+}
+
+// Convert one setting to what the control loops use
+static void settings_apply(u8 i)
+{
+    u8 j;
+
+    // the 6.0 / 2.2 gyro rescale is folded in. Each Q is the finest that still holds Settings[] = 255
+    switch (i) {
+    case 0: Motorsenable = Settings[0]; break;
+    case 1: Roll_gyro_dir = Settings[1]; break;
+    case 2: Pitch_gyro_dir = Settings[2]; break;
+    case 3: Yaw_gyro_dir = Settings[3]; break;
+    case 4: Xacc_dir = Settings[4]; break;
+    case 5: Yacc_dir = Settings[5]; break;
+    case 6: P_sens_acro = SETTING_Q(Settings[6], 6.0f / 2.2f / 255, 12); break;
+    case 7: I_sens_acro = SETTING_Q(Settings[7], 6.0f / 2.2f / 25500, 20); break;
+    case 8: P_sens_hover = SETTING_Q(Settings[8], 6.0f / 2.2f / 25500, 20); break;
+    case 9: I_sens_hover = SETTING_Q(Settings[9], 6.0f / 2.2f / 25500000, 31); break;	//                            'decrease factor to  12800000
+    case 10: D_sens_hover = SETTING_Q(Settings[10], 6.0f / 2.2f / 255, 12); break;
+    case 11: Yaw_p_sens_eep = SETTING_Q(Settings[11], 1.0f / 255, 14); break;
+    case 12: Yaw_i_sens_eep = SETTING_Q(Settings[12], 1.0f / 25500, 20); break;
+    case 13: Acc_influence = SETTING_Q(Settings[13], 1.0f / 3000, 16); break;
+    case 14: Xacc_scale = Settings[14] * 11 / 30; break;
+    case 15: Yacc_scale = Settings[15] * 11 / 30; break;
+    case 16:
+	Lf_acro = SETTING_Q(Settings[16], 1.0f / 25.5f, LF_SHIFT);
+	for (j = 0; j < sizeof(DynamicBoost) / sizeof(DynamicBoost[0]); j++)
+	    Lf_boosted[j] = ((s32)Lf_acro * DynamicBoost[j] + 2048) >> 12;
+	break;
+    case 17: Lf_hover = (s32)Settings[17] * 4 << LF_SHIFT; break;
+    case 18: Lf_yaw = Settings[18] / 17; break;
+    case 19: Lf_boost = Settings[19]; break;
+    case 20: Idle_up = Settings[20]; break;
+    case 21: Voltage_Cell_Min = Settings[21]; break;
+    case PARAM_XACC_OFFSET: Xacc_offset = Settings[PARAM_XACC_OFFSET] + 384; break;
+    case PARAM_YACC_OFFSET: Yacc_offset = Settings[PARAM_YACC_OFFSET] + 384; break;
+    case 24: Throttlechannel = RC_CHANNEL(Settings[24]); break;
+    case 25: Pitchchannel = RC_CHANNEL(Settings[25]); break;
+    case 26: Rollchannel = RC_CHANNEL(Settings[26]); break;
+    case 27: Yawchannel = RC_CHANNEL(Settings[27]); break;
+    case 28: D_sens_acro = SETTING_Q(Settings[28], 6.0f / 2.2f / 50, 10); break;
+    case 29: Dd_sens = SETTING_Q(Settings[29], 1.0f / 50, 12); break;
+    case 30: Switchchannel = RC_CHANNEL(Settings[30]); break;
+    }
+}
+
+// Store one setting and convert it if it changed. Returns 1 then, settings_write() commits it
+static u8 settings_set(u8 i, u8 value)
+{
+    if (Settings[i] == value)
+	return 0;
+    Settings[i] = value;
+    settings_apply(i);
+    return 1;
 }
 
 static void settings_load(void)
@@ -1382,47 +1669,6 @@ static void settings_load(void)
     if (blank)
 	memcpy(Settings, DefaultSettings, sizeof(Settings));
 
-    Motorsenable = Settings[0];
-    Roll_gyro_dir = Settings[1];
-    Pitch_gyro_dir = Settings[2];
-    Yaw_gyro_dir = Settings[3];
-    Xacc_dir = Settings[4];
-    Yacc_dir = Settings[5];
-    P_sens_acro = Settings[6] / 255.0f;
-    I_sens_acro = Settings[7] / 25500.0f;
-    P_sens_hover = Settings[8] / 25500.0f;
-    I_sens_hover = Settings[9] / 25500000.0f;	//                            'decrease factor to  12800000
-    D_sens_hover = Settings[10] / 255.0f;
-    Yaw_p_sens_eep = Settings[11] / 255.0f;
-    Yaw_i_sens_eep = Settings[12] / 25500.0f;
-    Acc_influence = Settings[13] / 3000.0f;
-    Gyro_influence = 1 - Acc_influence;
-    Xacc_scale = Settings[14];
-    Yacc_scale = Settings[15];
-    Lf_acro = Settings[16] / 25.5f;
-    Lf_hover = Settings[17] * 4.0f;
-    Lf_yaw = Settings[18] / 17;
-    Lf_boost = Settings[19];
-    Idle_up = Settings[20];
-    Voltage_Cell_Min = Settings[21];
-    Xacc_offset = Settings[PARAM_XACC_OFFSET] + 384;
-    Yacc_offset = Settings[PARAM_YACC_OFFSET] + 384;
-    Throttlechannel = Settings[24];
-    Pitchchannel = Settings[25];
-    Rollchannel = Settings[26];
-    Yawchannel = Settings[27];
-    D_sens_acro = Settings[28] / 50.0f;
-    Dd_sens = Settings[29] / 50.0f;
-    Switchchannel = Settings[30];
-
-    P_sens_acro *= 6.0 / 2.2;
-    I_sens_acro *= 6.0 / 2.2;
-    D_sens_acro *= 6.0 / 2.2;
-
-    P_sens_hover *= 6.0 / 2.2;
-    I_sens_hover *= 6.0 / 2.2;
-    D_sens_hover *= 6.0 / 2.2;
-
-    Xacc_scale *= 2.2 / 6.0;
-    Yacc_scale *= 2.2 / 6.0;
+    for (i = 0; i < 33; i++)
+	settings_apply(i);
 }
@@ -3,11 +3,14 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <stdlib.h>
+#include "spektrum.h"
+#include "../afrowii/fixmath.h"
 
 #define SPEKTRUM_NORMAL
 
 extern int PPM_in[26];
 extern int PPM_diff[26];
+extern int PPM_frame[RC_CHANNELS];
 extern unsigned char NewPpmData;
 extern unsigned char RC_Quality;
 
@@ -81,10 +84,10 @@ extern unsigned char RC_Quality;
 //
 // ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
-#define MIN_FRAMEGAP 68		// 7ms
-#define MAX_BYTEGAP  3		// 310us
-
-unsigned char SpektrumTimer = 0;
+// Gaps are measured on Timer 1, free running at F_CPU / 64 (3.2us at 20MHz), it wraps after 210ms
+#define T1_TICKS(us) ((uint16_t)((us) * (F_CPU / 1000000UL) / 64))
+#define MIN_FRAMEGAP T1_TICKS(7000)	// 7ms
+#define MAX_BYTEGAP  T1_TICKS(310)	// 310us
 
 //############################################################################
 // USART1 initialisation from killagreg
@@ -148,138 +151,119 @@ void spektrum_init(void)
     return;
 }
 
-#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
+
+#define SPEKTRUM_FRAME 16	// bytes
+#define SPEKTRUM_SKIP  0xff	// Fill position while waiting for the next frame gap
+
+// The ISR only collects bytes. A complete frame flips Front, spektrum_update() decodes it
+static uint8_t SpektrumBuf[2][SPEKTRUM_FRAME];
+static volatile uint8_t SpektrumFront;
+static volatile uint8_t SpektrumReady = 0;
 
 SIGNAL(USART1_RX_vect)
 {
-    static unsigned char Sync = 0, FrameCnt = 0, ByteHigh = 0, ReSync = 1, Frame2 = 0;
-    unsigned int Channel, index = 0;
-    signed int signal = 0, tmp;
-    int bCheckDelay;
+    static uint8_t Fill = SPEKTRUM_SKIP;	// next byte of SpektrumBuf[SpektrumFront ^ 1]
+    static uint16_t LastByte;			// arrival of the previous byte
+    uint16_t now = TCNT1;
+    uint16_t gap;
     uint8_t c;
 
     c = UDR1;			// get data byte
-    if (ReSync == 1) {
-	// wait for beginning of new frame
-	ReSync = 0;
-	SpektrumTimer = MIN_FRAMEGAP;
-	FrameCnt = 0;
-	Sync = 0;
-	ByteHigh = 0;
-    } else {
-	if (!SpektrumTimer)
-	    bCheckDelay = 1;
-	else
-	    bCheckDelay = 0;	//CheckDelay(FrameTimer);
-	if (Sync == 0) {
-	    if (bCheckDelay) {
-		// nach einer Pause von mind. 7ms erstes Sync-Character gefunden
-		// Zeichen ignorieren, da Bedeutung unbekannt
-		Sync = 1;
-		FrameCnt++;
-		SpektrumTimer = MAX_BYTEGAP;
-	    } else {
-		// Zeichen kam vor Ablauf der 7ms Sync-Pause
-		// warten auf erstes Sync-Zeichen
-		SpektrumTimer = MIN_FRAMEGAP;
-		FrameCnt = 0;
-		Sync = 0;
-		ByteHigh = 0;
-	    }
-	} else if ((Sync == 1) && !bCheckDelay) {
-	    // zweites Sync-Character ignorieren, Bedeutung unbekannt
-	    Sync = 2;
-	    FrameCnt++;
-	    SpektrumTimer = MAX_BYTEGAP;
-	} else if ((Sync == 2) && !bCheckDelay) {
-	    SpektrumTimer = MAX_BYTEGAP;
-	    // Datenbyte high
-	    ByteHigh = c;
-	    if (FrameCnt == 2) {
-		// is 1st Byte of Channel-data
-		// Frame 1 with Channel 1-7 comming next
-		Frame2 = 0;
-		if (ByteHigh & 0x80) {
-		    // DS9: Frame 2 with Channel 8-9 comming next
-		    Frame2 = 1;
-		}
+    gap = now - LastByte;
+    LastByte = now;
+
+    if (gap >= MIN_FRAMEGAP)
+	Fill = 0;		// nach einer Pause von mind. 7ms: erstes Sync-Zeichen
+    else if (gap > MAX_BYTEGAP)
+	Fill = SPEKTRUM_SKIP;	// hier stimmt was nicht: auf die naechste Pause warten
+
+    if (Fill < SPEKTRUM_FRAME) {
+	SpektrumBuf[SpektrumFront ^ 1][Fill++] = c;
+	if (Fill == SPEKTRUM_FRAME) {
+	    // 16 Bytes eingetroffen -> Komplett. While the front one waits to be decoded, this one is dropped
+	    if (!SpektrumReady) {
+		SpektrumFront ^= 1;
+		SpektrumReady = 1;
 	    }
-	    Sync = 3;
-	    FrameCnt++;
-	} else if ((Sync == 3) && !bCheckDelay) {
-	    // Datenbyte low
-	    // High-Byte for next channel comes next
-	    SpektrumTimer = MAX_BYTEGAP;
-	    Sync = 2;
-	    FrameCnt++;
-	    Channel = ((unsigned int) ByteHigh << 8) | c;
+	    Fill = SPEKTRUM_SKIP;
+	}
+    }
+}
+
+/*
+ * Decode the last complete frame into PPM_in[]/PPM_diff[], if one came in since the
+ * last call. Call it from the loop, it returns right away without a new frame.
+ */
+void spektrum_update(void)
+{
+    const uint8_t *frame;
+    unsigned int Channel, index;
+    signed int signal, tmp;
+    uint8_t i, ByteHigh;
+
+    if (!SpektrumReady)
+	return;
+    frame = SpektrumBuf[SpektrumFront];
+
+    // 2 sync bytes, Bedeutung unbekannt, then 7 channels of 2 bytes
+    for (i = 2; i < SPEKTRUM_FRAME; i += 2) {
+	ByteHigh = frame[i];
+	Channel = ((unsigned int) ByteHigh << 8) | frame[i + 1];
 #if defined(SPEKTRUM_NORMAL)
-	    signal = Channel & 0x3ff;
-	    signal -= 0x200;	// Offset, range 0x000..0x3ff?
-	    signal = signal / 3;	// scaling to fit PPM resolution
-	    index = (ByteHigh >> 2) & 0x0f;
+	signal = Channel & 0x3ff;
+	signal -= 0x200;	// Offset, range 0x000..0x3ff?
+	signal = signal / 3;	// scaling to fit PPM resolution
+	index = (ByteHigh >> 2) & 0x0f;
 #endif
 #if 0
 #if defined(SPEKTRUM_HIRES)
-	    signal = Channel & 0x7ff;
-	    signal -= 0x400;	// Offset, range 0x000..0x7ff?
-	    signal = signal / 6;	// scaling to fit PPM resolution
-	    index = (ByteHigh >> 3) & 0x0f;
+	signal = Channel & 0x7ff;
+	signal -= 0x400;	// Offset, range 0x000..0x7ff?
+	signal = signal / 6;	// scaling to fit PPM resolution
+	index = (ByteHigh >> 3) & 0x0f;
 #else
-	    signal = Channel & 0x3ff;
-	    signal -= 360;	// Offset, range 0x000..0x3ff?
-	    signal = signal / 2;	// scaling to fit PPM resolution
-	    index = (ByteHigh >> 2) & 0x0f;
+	signal = Channel & 0x3ff;
+	signal -= 360;		// Offset, range 0x000..0x3ff?
+	signal = signal / 2;	// scaling to fit PPM resolution
+	index = (ByteHigh >> 2) & 0x0f;
 #endif
 #endif
-	    index++;
-	    if (index < 13) {
-		// Stabiles Signal
-		if (abs(signal - PPM_in[index]) < 6) {
-		    if (RC_Quality < 200)
-			RC_Quality += 10;
-		    else {
-			RC_Quality = 200;
-			TIMSK1 &= ~_BV(ICIE1);	// disable PPM-Input
-		    }
+	index++;
+	if (index < 13) {
+	    // Stabiles Signal
+	    if (abs(signal - PPM_in[index]) < 6) {
+		if (RC_Quality < 200)
+		    RC_Quality += 10;
+		else {
+		    RC_Quality = 200;
+		    TIMSK1 &= ~_BV(ICIE1);	// disable PPM-Input
 		}
-		tmp = (3 * (PPM_in[index]) + signal) / 4;
-		if (tmp > signal + 1)
-		    tmp--;
-		else if (tmp < signal - 1)
-		    tmp++;
-
-		if (RC_Quality >= 180)
-		    PPM_diff[index] = ((tmp - PPM_in[index]) / 3) * 3;
-		else
-		    PPM_diff[index] = 0;
+	    }
+	    tmp = (3 * (PPM_in[index]) + signal) / 4;
+	    if (tmp > signal + 1)
+		tmp--;
+	    else if (tmp < signal - 1)
+		tmp++;
 
-		PPM_in[index] = CLAMP(tmp, -127, 127);
+	    if (RC_Quality >= 180)
+		PPM_diff[index] = ((tmp - PPM_in[index]) / 3) * 3;
+	    else
+		PPM_diff[index] = 0;
 
-	    } else if (index > 17)
-		ReSync = 1;	// hier stimmt was nicht: neu synchronisieren
-	} else {
-	    // hier stimmt was nicht: neu synchronisieren
-	    ReSync = 1;
-	    FrameCnt = 0;
-	    Frame2 = 0;
-	    // new frame next, nach fruehestens 7ms erwartet
-	    SpektrumTimer = MIN_FRAMEGAP;
+	    PPM_in[index] = fix_clamp16(tmp, -127, 127);
+	} else if (index > 17) {
+	    // hier stimmt was nicht: der Rest des Frames ist unbrauchbar
+	    break;
 	}
+    }
 
-	// 16 Bytes eingetroffen -> Komplett
-	if (FrameCnt >= 16) {
-	    // Frame complete
-	    if (Frame2 == 0) {
-		// Null bedeutet: Neue Daten
-		// nur beim ersten Frame (CH 0-7) setzen
-		if (!ReSync)
-		    NewPpmData = 0;
-	    }
-	    FrameCnt = 0;
-	    Frame2 = 0;
-	    Sync = 0;
-	    SpektrumTimer = MIN_FRAMEGAP;
-	}
+    // Null bedeutet: Neue Daten, nur beim ersten Frame (CH 0-7) setzen
+    // DS9: bit 7 of the first channel marks frame 2 with channel 8-9
+    if (i >= SPEKTRUM_FRAME && !(frame[2] & 0x80)) {
+	for (i = 0; i < RC_CHANNELS; i++)
+	    PPM_frame[i] = PPM_in[i];
+	NewPpmData = 0;
     }
+
+    SpektrumReady = 0;		// the ISR may flip Front again
 }
@@ -1,6 +1,9 @@
 #ifndef SPEKTRUM_H_
 #define SPEKTRUM_H_
 
+#define RC_CHANNELS 13		// PPM_frame[] size: channels 1..12, 0 unused
+
 void spektrum_init(void);
+void spektrum_update(void);
 
 #endif	/* SPEKTRUM_H_ */
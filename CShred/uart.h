@@ -6,30 +6,45 @@
  * this stuff is worth it, you can buy me a beer in return.        Joerg Wunsch
  * ----------------------------------------------------------------------------
  *
- * Stdio demo, UART declarations
+ * UART declarations
  *
  * $Id: uart.h 1008 2005-12-28 21:38:59Z joerg_wunsch $
  */
 
 /*
- * Perform UART startup initialization.
+ * Interrupt driven UART with binary frames:
+ *
+ *   '$', len, cmd, payload[len], xor of len, cmd and payload
+ *
+ * Received bytes queue in a ring from the RX interrupt, uart_receive() picks
+ * the frames out of it. uart_send() queues a frame for the UDRE interrupt and
+ * returns right away. Neither ever waits on the UART.
  */
-void uart_init(void);
 
 /*
- * Send one character to the UART.
+ * Perform UART startup initialization.
  */
-int uart_putchar(char c, FILE * stream);
+void uart_init(void);
+
+#define UART_BAUD  38400ul
+#define UART_RX_RING 64		// power of 2, ~16ms of input at 38400 Bd
+#define UART_TX_RING 128	// power of 2, room for a few replies
+#define UART_FRAME_MAX 40	// largest payload received, uart_send() takes up to UART_TX_RING - 4
+#define UART_FRAME_START '$'
+
+void uart_set_baud(uint32_t baud);
+uint8_t uart_tx_idle(void);
 
 /*
- * Size of internal line buffer used by uart_getchar().
+ * Queue a frame. Returns 0, and drops it, if the TX ring can't take all of it.
  */
-#define UART_BAUD  38400ul
-#define RX_BUFSIZE 256
+uint8_t uart_send(uint8_t cmd, const void *data, uint8_t len);
 
 /*
- * Receive one character from the UART.  The actual reception is
- * line-buffered, and one character is returned from the buffer at
- * each invokation.
+ * Next complete frame, payload needs UART_FRAME_MAX bytes. Returns 0 when no
+ * frame is complete yet.
  */
-int uart_getchar(FILE * stream);
+uint8_t uart_receive(uint8_t *cmd, uint8_t *payload, uint8_t *len);
+
+extern volatile uint16_t uart_rx_overruns;	// bytes lost to a full RX ring
+extern uint16_t uart_frame_errors;		// frames dropped: bad checksum or too long
@@ -5,6 +5,7 @@ using System.Diagnostics;
 using System.IO.Ports;
 using XComponent.SliderBar;
 using System.Collections;
+using System.Collections.Generic;
 using System.Drawing;
 using System.Runtime.CompilerServices;
 using Microsoft.VisualBasic;
@@ -50,6 +51,8 @@ public class MainForm : Form
     private CheckBox checkBoxT2;
     private Button clearRxD;
     private Button Compare_Settings;
+    private Button plotbutton;
+    private plotform plot;
     private IContainer components;
     private ComboBox comport;
     private Button connect;
@@ -155,7 +158,29 @@ public class MainForm : Form
     private ProgressBar progressBar4;
     private bool readsens;
     private Button readsettings;
-    private string readvar;
+    private byte[] rxframe = new byte[64];	// reader thread only, as the other rx* fields
+    private Queue<byte[]> rxqueue = new Queue<byte[]>();
+    // 'B' rates of the firmware, by index. The connection starts at [0] and asks for fastbaud
+    private static readonly int[] bauds = new int[] { 38400, 115200, 250000 };
+    private const byte fastbaud = 2;
+    private const byte streamperiod = 10;	// ms, the firmware holds it to what the baud rate allows
+    private bool baudasked;
+    private int baudwait;	// timer ticks left for a frame at the new rate, 0: none expected
+    private int lastseq = -1;
+    private int streamgaps;
+    private int keepalive;
+    private bool variablevalid;	// variable[] holds the board's settings, from a 'p' or the 'a' acknowledges
+    private int uploadpending;	// 'W' pairs not acknowledged yet
+    private int uploadrefused;
+    private int uploadwait;
+    private byte[] uploadpairs = new byte[2 * 33];
+    private int uploadlen;
+    private int uploadsent;
+    private int rxstate;
+    private int rxlen;
+    private int rxpos;
+    private byte rxcmd;
+    private byte rxcheck;
     private Button resetmC;
     private ComboBox rollbox;
     private byte rollchannel;
@@ -354,6 +379,15 @@ public class MainForm : Form
         this.startupdelay.Enabled = true;
     }
 
+    public void PlotbuttonClick(object sender, EventArgs e)
+    {
+        if (plot == null || plot.IsDisposed) {
+            plot = new plotform();
+        }
+        plot.Show();
+        plot.BringToFront();
+    }
+
     public void Button2Click(object sender, EventArgs e)
     {
         // TODO FIX
@@ -563,9 +597,13 @@ public class MainForm : Form
                 serialPort.Close();
 
             serialPort.PortName = comport.SelectedItem.ToString();
+            serialPort.BaudRate = bauds[0];
             serialPort.Open();
             if (serialPort.IsOpen) {
                 errorcounter = 0;
+                baudasked = false;
+                lastseq = -1;
+                streamgaps = 0;
                 pingshrediquette.Enabled = true;
                 searchlabel.Visible = true;
                 timer1.Enabled = true;
@@ -612,7 +650,7 @@ public class MainForm : Form
                     this.avrdudeout.Clear();
                     this.progressBar4.Value = this.progressBar4.Minimum;
                     this.progressBar4.PerformStep();
-                    this.serialPort.Write("reset!\r");
+                    this.sendframe((byte)'R', null, 0, 0);
                     Thread.Sleep(100);
                     this.resetmCClick(RuntimeHelpers.GetObjectValue(sender), e);
                     Thread.Sleep(100);
@@ -687,7 +725,94 @@ public class MainForm : Form
 
     public void getparams()
     {
-        serialPort.Write("cr!\r");
+        sendframe((byte)'r', null, 0, 0);
+    }
+
+    // Frames as the controller uses them: '$', len, cmd, payload, xor of len, cmd and payload
+    private void sendframe(byte cmd, byte[] data, int offset, int len)
+    {
+        byte[] frame = new byte[len + 4];
+        byte check = (byte)(len ^ cmd);
+
+        frame[0] = (byte)'$';
+        frame[1] = (byte)len;
+        frame[2] = cmd;
+        for (int i = 0; i < len; i++) {
+            frame[3 + i] = data[offset + i];
+            check ^= data[offset + i];
+        }
+        frame[3 + len] = check;
+        serialPort.Write(frame, 0, frame.Length);
+    }
+
+    // Reader thread: runs whatever has arrived through the frame parser. Complete frames, the
+    // command byte followed by the payload, are queued for Timer1Tick. Bad checksums count as errors
+    private void SerialPortDataReceived(object sender, SerialDataReceivedEventArgs e)
+    {
+        byte[] buf = new byte[256];
+        int n;
+
+        try {
+            while ((n = serialPort.BytesToRead) > 0) {
+                n = serialPort.Read(buf, 0, Math.Min(n, buf.Length));
+                for (int i = 0; i < n; i++) {
+                    parsebyte(buf[i]);
+                }
+            }
+        } catch (Exception) {
+            // port closed under us
+        }
+    }
+
+    private void parsebyte(byte c)
+    {
+        switch (rxstate) {
+        case 0:
+            if (c == '$')
+                rxstate = 1;
+            break;
+        case 1:
+            rxlen = c;
+            rxcheck = c;
+            rxpos = 0;
+            rxstate = rxlen < rxframe.Length ? 2 : 0;
+            break;
+        case 2:
+            rxcmd = c;
+            rxcheck ^= c;
+            rxstate = rxlen > 0 ? 3 : 4;
+            break;
+        case 3:
+            rxframe[rxpos++] = c;
+            rxcheck ^= c;
+            if (rxpos == rxlen)
+                rxstate = 4;
+            break;
+        default:
+            rxstate = 0;
+            if (c == rxcheck) {
+                if (rxcmd == 's' && rxlen == 26) {
+                    capture.Sensor(rxframe, 0, rxlen);     // history and recording at the full rate
+                }
+                byte[] frame = new byte[rxlen + 1];
+                frame[0] = rxcmd;
+                Array.Copy(rxframe, 0, frame, 1, rxlen);
+                lock (rxqueue) {
+                    rxqueue.Enqueue(frame);
+                }
+            } else {
+                Interlocked.Increment(ref errorcounter);
+            }
+            break;
+        }
+    }
+
+    // Next frame from the reader thread, null when there is none
+    private byte[] nextframe()
+    {
+        lock (rxqueue) {
+            return rxqueue.Count > 0 ? rxqueue.Dequeue() : null;
+        }
     }
 
     private void InitializeComponent()
@@ -699,6 +824,7 @@ public class MainForm : Form
         this.tabPage1 = new System.Windows.Forms.TabPage();
         this.showdebug = new System.Windows.Forms.CheckBox();
         this.Compare_Settings = new System.Windows.Forms.Button();
+        this.plotbutton = new System.Windows.Forms.Button();
         this.RxD = new System.Windows.Forms.GroupBox();
         this.static48 = new System.Windows.Forms.Label();
         this.bytecounter = new System.Windows.Forms.Label();
@@ -3154,6 +3280,7 @@ public class MainForm : Form
         // tabPage4
         // 
         this.tabPage4.Controls.Add(this.static99);
+        this.tabPage4.Controls.Add(this.plotbutton);
         this.tabPage4.Controls.Add(this.Battery);
         this.tabPage4.Controls.Add(this.groupBox12);
         this.tabPage4.Controls.Add(this.groupBox11);
@@ -3167,6 +3294,16 @@ public class MainForm : Form
         this.tabPage4.Text = "Realtime data";
         this.tabPage4.UseVisualStyleBackColor = true;
         // 
+        // plotbutton
+        // 
+        this.plotbutton.Location = new System.Drawing.Point(575, 57);
+        this.plotbutton.Name = "plotbutton";
+        this.plotbutton.Size = new System.Drawing.Size(68, 40);
+        this.plotbutton.TabIndex = 6;
+        this.plotbutton.Text = "Plot /\r\nrecord";
+        this.plotbutton.UseVisualStyleBackColor = true;
+        this.plotbutton.Click += new System.EventHandler(this.PlotbuttonClick);
+        // 
         // static99
         // 
         this.static99.Location = new System.Drawing.Point(56, 7);
@@ -3894,6 +4031,7 @@ public class MainForm : Form
         this.serialPort.BaudRate = 38400;
         this.serialPort.PortName = "COM5";
         this.serialPort.ReadTimeout = 1000;
+        this.serialPort.DataReceived += new System.IO.Ports.SerialDataReceivedEventHandler(this.SerialPortDataReceived);
         // 
         // timer1
         // 
@@ -4213,19 +4351,7 @@ public class MainForm : Form
                 if (readtext.Length < 0x1f) {
                     Interaction.MsgBox("You attempted to load an outdated settings file. The new firmware requires new settings.", MsgBoxStyle.OkOnly, null);
                 } else {
-                    this.serialPort.Write("ci!\r");
-                    this.serialPort.Write(this.outvar, 1, 0x21);
-                    this.timer1.Enabled = false;
-                    this.k = 1;
-                    do {
-                        Thread.Sleep(100);
-                        this.progressBar2.PerformStep();
-                        this.k++;
-                    }
-                    while (this.k <= 0x21);
-                    this.getparams();
-                    this.timer1.Enabled = true;
-                    this.progressBar2.Value = this.progressBar2.Maximum;
+                    this.uploadchanged();
                 }
             }
         } else {
@@ -4358,6 +4484,7 @@ public class MainForm : Form
                     serialPort.DiscardInBuffer();
                 } catch (Exception) { }
                 readsens = true;
+                streamsensors(streamperiod);
                 timersens.Enabled = true;
             }
         } else {
@@ -4369,11 +4496,20 @@ public class MainForm : Form
                 serialPort.DiscardOutBuffer();
             } catch (Exception) {
             }
+            if (readsens && serialPort.IsOpen) {
+                streamsensors(0);
+            }
             readsens = false;
             timersens.Enabled = false;
         }
     }
 
+    // The controller sends an 's' frame every period ms by itself, also in flight. 0 stops it
+    private void streamsensors(byte period)
+    {
+        sendframe((byte)'S', new byte[] { period }, 0, 1);
+    }
+
     public void TextBoxGTextChanged(object sender, EventArgs e)
     {
         this.checkinput(RuntimeHelpers.GetObjectValue(sender));
@@ -4471,27 +4607,14 @@ public class MainForm : Form
         if (!serialPort.IsOpen) {
             timer1.Enabled = false;
         } else {
-            if (readsens) {
-                serialPort.Write("cs!\r");
-            }
-
-            if (serialPort.BytesToRead > 0) {
-                try {
-                    readvar = serialPort.ReadLine();
-                } catch (Exception) {
-                }
-
-                try {
-                    if (readvar.Contains("sp!")) {
-                        pingshrediquette.Enabled = false;
-                        timer1.Enabled = false;
-                        Interaction.MsgBox("The firmware in the tricopter is outdated. Please download the new version! This GUI won't work otherwise.\n\rYou will not be able to use your old settings.\n\rSome things may have changed, including the direction of control inputs.\n\rYou have to check all settings again before mounting the propellers!\n\r\n\rThe first thing to do after you have flashed a new firmware, is to upload the standard parameters!", MsgBoxStyle.OkOnly, "Important!");
-                    }
-
-                    if (readvar.Contains("s#p!")) {
+            try {
+                byte[] f;
+                // at most one timer tick late, the reader thread has them ready
+                while ((f = nextframe()) != null) {
+                    baudwait = 0;
+                    if (f[0] == 'p' && f.Length == 1 + 33) {
                         pingshrediquette.Enabled = false;
                         searchlabel.Visible = false;
-                        readvar = "";
                         connect.BackColor = Color.LightGreen;
                         connect.Enabled = false;
                         Text = "TriGUI by William Thielicke (w.th@gmx.de) - CONNECTED";
@@ -4506,51 +4629,21 @@ public class MainForm : Form
                         writeall.Enabled = true;
                         toolStatusLabel.Text = "Connected (" + serialPort.PortName + ", @" + serialPort.BaudRate + " baud) - Shrediquette found.";
                         isconnected = true;
+                        if (!baudasked) {
+                            baudasked = true;
+                            sendframe((byte)'B', new byte[] { fastbaud }, 0, 1);
+                        }
 
-                        if ((serialPort.BytesToRead > 0) && !readsens) {
-                            bytesRead = this.serialPort.Read(variable, 0, 33);
+                        if (!readsens) {
+                            bytesRead = 33;
+                            Array.Copy(f, 1, variable, 0, 33);
+                            variablevalid = true;
                             bytecounter.Text = bytesRead.ToString() + "/33 bytes";
-                            MainSettings.MotorsEnabled = variable[0] == 1 ? true : false;
-                            rollgyrodir = this.variable[1];
-                            nickgyrodir = this.variable[2];
-                            yawgyrodir = this.variable[3];
-                            xaccdir = this.variable[4];
-                            yaccdir = this.variable[5];
-                            acrop = this.variable[6];
-                            acroi = this.variable[7];
-                            hoverp = this.variable[8];
-                            hoveri = this.variable[9];
-                            hoverd = this.variable[10];
-                            yawp = this.variable[11];
-                            yawi = this.variable[12];
-                            accinfluence = this.variable[13];
-                            xaccscale = this.variable[14];
-                            yaccscale = this.variable[15];
-                            lfacro = this.variable[16];
-                            lfhover = this.variable[17];
-                            lfyaw = this.variable[18];
-                            lfboost = this.variable[19];
-                            minthrottle = this.variable[20];
-                            voltage = this.variable[21];
-                            xacc_offset = this.variable[22];
-                            yacc_offset = this.variable[23];
-                            throttlechannel = this.variable[24];
-                            nickchannel = this.variable[25];
-                            rollchannel = this.variable[26];
-                            yawchannel = this.variable[27];
-                            acrod = this.variable[28];
-                            hoverdd = this.variable[29];
-                            switchchannel = variable[30];
+                            takevariables();
 
                             foreach (byte b in variable) {
                                 textRxD.AppendText(b.ToString() + "\r\n");
                             }
-                            try {
-                                this.serialPort.DiscardInBuffer();
-                            } catch (Exception exception2) {
-                                ProjectData.SetProjectError(exception2);
-                                ProjectData.ClearProjectError();
-                            }
                         }
                         this.progressBar2.Value = this.progressBar2.Maximum;
                         this.labelok.Visible = true;
@@ -4560,45 +4653,68 @@ public class MainForm : Form
                         }
                     }
 
-                    if (readvar.Contains("r#s!")) {
-                        // read in R/C channel data
-                        if (serialPort.BytesToRead > 0) {
-                            bytesRead = this.serialPort.Read(rcdata, 0, 24);
-                            try {
-                                this.serialPort.DiscardInBuffer();
-                            } catch (Exception) { }
-                            try {
-                                this.serialPort.DiscardOutBuffer();
-                            } catch (Exception) { }
+                    if (f[0] == 's' && f.Length == 1 + 26) {
+                        Array.Copy(f, 1, sensors, 1, 13);
+                        Array.Copy(f, 1 + 13, rcdata, 0, 12);
+                        // sequence number: every frame the firmware made but we didn't get is a gap
+                        if (lastseq >= 0 && (byte)(f[26] - lastseq - 1) != 0) {
+                            streamgaps += (byte)(f[26] - lastseq - 1);
+                            toolStatusLabel.Text = "Connected (" + serialPort.PortName + ", @" + serialPort.BaudRate + " baud) - " + streamgaps.ToString() + " sensor frames lost";
                         }
+                        lastseq = f[26];
                     }
 
-                    if (readvar.Contains("ss!")) {
-                        readvar = "";
-                        if (serialPort.BytesToRead > 0) {
-                            bytesRead = this.serialPort.Read(sensors, 1, 13);
-                            bytesRead = serialPort.Read(rcdata, 0, 24);
-                            try {
-                                serialPort.DiscardInBuffer();
-                            } catch (Exception) { }
-                            try {
-                                serialPort.DiscardOutBuffer();
-                            } catch (Exception) { }
+                    if (f[0] == 'a' && uploadpending > 0) {
+                        for (int i = 1; i + 1 < f.Length; i += 2) {
+                            if (f[i] >= 33)
+                                continue;
+                            if (f[i + 1] != outvar[f[i] + 1])
+                                uploadrefused++;
+                            variable[f[i]] = f[i + 1];
+                            uploadpending = Math.Max(uploadpending - 1, 0);
+                            progressBar2.PerformStep();
+                        }
+                        takevariables();
+                        uploadnext();
+                        if (uploadpending == 0) {
+                            labelok.Visible = uploadrefused == 0;
+                            toolStatusLabel.Text = (progressBar2.Maximum - uploadrefused).ToString() + " parameter(s) written"
+                                + (uploadrefused == 0 ? "." : ", " + uploadrefused.ToString() + " refused (motors running?).");
                         }
                     }
-                    if (this.readvar.Contains("Error reading channel:")) {
-                        try {
-                            errorcounter++;
-                            errorlabel.Text = errorcounter.ToString();
-                        } catch (Exception) { }
+
+                    if (f[0] == 'b' && f.Length == 2 && f[1] < bauds.Length) {
+                        // the acknowledge is the last thing at the old rate
+                        serialPort.BaudRate = bauds[f[1]];
+                        getparams();	// its 'p' confirms the new rate
+                        baudwait = 2000 / timer1.Interval;
+                        toolStatusLabel.Text = "Connected (" + serialPort.PortName + ", @" + serialPort.BaudRate + " baud) - Shrediquette found.";
                     }
-                    textRxD.ScrollToCaret();
-                    updateboxes();
-                } catch (Exception exception6) {
-                    ProjectData.SetProjectError(exception6);
-                    this.textRxD.AppendText("Error in understanding tricopter...");
-                    ProjectData.ClearProjectError();
                 }
+                errorlabel.Text = errorcounter.ToString();
+                if (uploadpending > 0 && --uploadwait <= 0) {
+                    toolStatusLabel.Text = uploadpending.ToString() + " parameter(s) not acknowledged, write again.";
+                    uploadpending = 0;
+                }
+
+                // no answer at the new rate for 2s: the firmware drops back to [0] by itself, follow it
+                // and stay there (baudasked), a rate that failed once fails again
+                if (baudwait > 0 && --baudwait == 0) {
+                    serialPort.BaudRate = bauds[0];
+                    toolStatusLabel.Text = "Connected (" + serialPort.PortName + ", @" + serialPort.BaudRate + " baud) - fast rate failed.";
+                }
+
+                // the firmware drops back to 38400 baud after 2s without a frame: renew the subscription every second
+                if (isconnected && ++keepalive >= 1000 / timer1.Interval) {
+                    keepalive = 0;
+                    streamsensors(readsens ? streamperiod : (byte)0);
+                }
+                textRxD.ScrollToCaret();
+                updateboxes();
+            } catch (Exception exception6) {
+                ProjectData.SetProjectError(exception6);
+                this.textRxD.AppendText("Error in understanding tricopter...");
+                ProjectData.ClearProjectError();
             }
         }
     }
@@ -4688,6 +4804,42 @@ public class MainForm : Form
         this.textBoxm.Text = easyI.ToString();
     }
 
+    // The settings fields updateboxes() shows, from variable[]
+    private void takevariables()
+    {
+        MainSettings.MotorsEnabled = variable[0] == 1 ? true : false;
+        rollgyrodir = this.variable[1];
+        nickgyrodir = this.variable[2];
+        yawgyrodir = this.variable[3];
+        xaccdir = this.variable[4];
+        yaccdir = this.variable[5];
+        acrop = this.variable[6];
+        acroi = this.variable[7];
+        hoverp = this.variable[8];
+        hoveri = this.variable[9];
+        hoverd = this.variable[10];
+        yawp = this.variable[11];
+        yawi = this.variable[12];
+        accinfluence = this.variable[13];
+        xaccscale = this.variable[14];
+        yaccscale = this.variable[15];
+        lfacro = this.variable[16];
+        lfhover = this.variable[17];
+        lfyaw = this.variable[18];
+        lfboost = this.variable[19];
+        minthrottle = this.variable[20];
+        voltage = this.variable[21];
+        xacc_offset = this.variable[22];
+        yacc_offset = this.variable[23];
+        throttlechannel = this.variable[24];
+        nickchannel = this.variable[25];
+        rollchannel = this.variable[26];
+        yawchannel = this.variable[27];
+        acrod = this.variable[28];
+        hoverdd = this.variable[29];
+        switchchannel = variable[30];
+    }
+
     public void updateboxes()
     {
         try {
@@ -4775,7 +4927,6 @@ public class MainForm : Form
             Interaction.MsgBox("You are not connected to Shrediquette DLX.", MsgBoxStyle.OkOnly, "Error");
             this.toolStatusLabel.Text = "Not connected";
         } else if (Interaction.MsgBox("Transfer all parameters?", MsgBoxStyle.OkCancel, "Sure?") == MsgBoxResult.Ok) {
-            this.serialPort.Write("ci!\r");
             if (this.deactivatemotors.Checked) {
                 this.outvar[1] = 123;
             } else {
@@ -4813,18 +4964,45 @@ public class MainForm : Form
             this.outvar[31] = (byte)(this.switchbox.SelectedIndex + 1);
             this.outvar[0x20] = 0;
             this.outvar[0x21] = 0;
-            this.serialPort.Write(this.outvar, 1, 0x21);
-            this.timer1.Enabled = false;
-            this.k = 1;
-            do {
-                Thread.Sleep(80);
-                this.progressBar2.PerformStep();
-                this.k++;
-            }
-            while (this.k <= 0x21);
-            this.getparams();
-            this.timer1.Enabled = true;
+            this.uploadchanged();
+        }
+    }
+
+    // Send outvar[1..33] as 'W' (index, value) pairs, only the ones that differ from variable[]. The
+    // board acknowledges every pair with the value it now uses ('a', handled in Timer1Tick), which is
+    // what variable[] keeps. A lost acknowledge leaves variable[] old, the next upload sends that one again
+    private void uploadchanged()
+    {
+        this.uploadlen = 0;
+        this.uploadsent = 0;
+        this.uploadrefused = 0;
+        for (int i = 0; i < 33; i++) {
+            // 22, 23: acc offsets, the board has its own from the calibration
+            if (i == 22 || i == 23 || (this.variablevalid && this.outvar[i + 1] == this.variable[i]))
+                continue;
+            this.uploadpairs[this.uploadlen++] = (byte)i;
+            this.uploadpairs[this.uploadlen++] = this.outvar[i + 1];
+        }
+        this.uploadpending = this.uploadlen / 2;
+        this.progressBar2.Maximum = Math.Max(this.uploadpending, 1);
+        this.progressBar2.Value = 0;
+        this.uploadnext();
+        if (this.uploadpending == 0) {
             this.progressBar2.Value = this.progressBar2.Maximum;
+            this.labelok.Visible = true;
+            this.toolStatusLabel.Text = "No parameters changed, nothing written.";
+        }
+    }
+
+    // One 'W' frame at a time, the next goes with its acknowledge: the firmware's receive ring holds 64 bytes
+    private void uploadnext()
+    {
+        int n = Math.Min(this.uploadlen - this.uploadsent, 2 * 16);
+
+        if (n > 0) {
+            this.sendframe((byte)'W', this.uploadpairs, this.uploadsent, n);
+            this.uploadsent += n;
+            this.uploadwait = 1000 / this.timer1.Interval;
         }
     }
 
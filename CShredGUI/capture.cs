@@ -0,0 +1,304 @@
+using System;
+using System.IO;
+
+// A fixed size history of samples, each a time in seconds and one value per channel.
+// Filled from the serial reader thread, read by the plot: lock the ring around any access
+public class samplering
+{
+    // Fields
+    public readonly string[] names;
+    private float[][] values;
+    private double[] times;
+    private int head;
+    private int count;
+
+    // Methods
+    public samplering(string[] names, int capacity)
+    {
+        this.names = names;
+        this.values = new float[capacity][];
+        this.times = new double[capacity];
+    }
+
+    public int Count
+    {
+        get { return this.count; }
+    }
+
+    public int Channels
+    {
+        get { return this.names.Length; }
+    }
+
+    // The oldest sample goes when it is full
+    public void Add(double time, float[] v)
+    {
+        this.times[this.head] = time;
+        this.values[this.head] = v;
+        this.head = (this.head + 1) % this.times.Length;
+        if (this.count < this.times.Length)
+            this.count++;
+    }
+
+    public void Clear()
+    {
+        this.head = 0;
+        this.count = 0;
+    }
+
+    // i = 0 is the oldest sample kept
+    public double Time(int i)
+    {
+        return this.times[(this.head - this.count + i + this.times.Length) % this.times.Length];
+    }
+
+    public float Value(int i, int channel)
+    {
+        return this.values[(this.head - this.count + i + this.times.Length) % this.times.Length][channel];
+    }
+}
+
+// The live sensor stream: history for the plot and, while recording, every 's' frame to a file.
+//
+// Recording file (*.shl): "SHL1", the payload length n (26: 13 sensors, 12 rc channels, sequence), then
+// per frame a little endian u32 of ms since the start and the n payload bytes as the firmware sent them
+public static class capture
+{
+    // Fields
+    public static readonly string[] sensornames = new string[] {
+        "Gyro roll", "Angle roll", "Acc roll", "Gyro pitch", "Angle pitch", "Acc pitch", "Gyro yaw",
+        "Throttle", "Roll", "Pitch", "Yaw", "Switch", "Voltage"
+    };
+    public static readonly samplering live = new samplering(sensornames, 65536);	// 10 minutes at 100Hz
+    private static System.Diagnostics.Stopwatch clock = System.Diagnostics.Stopwatch.StartNew();
+    private static BinaryWriter recording;
+    private static long recordstart;
+    private static int recorded;
+
+    // Methods
+    // Reader thread, one 's' payload
+    public static void Sensor(byte[] payload, int offset, int len)
+    {
+        long now = clock.ElapsedMilliseconds;
+        float[] v = new float[sensornames.Length];
+
+        for (int i = 0; i < v.Length; i++) {
+            v[i] = payload[offset + i];
+        }
+        lock (live) {
+            live.Add(now / 1000.0, v);
+            if (recording != null) {
+                recording.Write((uint)(now - recordstart));
+                recording.Write(payload, offset, len);
+                recorded++;
+            }
+        }
+    }
+
+    public static void Record(string path, int len)
+    {
+        lock (live) {
+            Stop();
+            recording = new BinaryWriter(new BufferedStream(File.Create(path), 65536));
+            recording.Write(new char[] { 'S', 'H', 'L', '1' });
+            recording.Write((byte)len);
+            recordstart = clock.ElapsedMilliseconds;
+            recorded = 0;
+        }
+    }
+
+    public static void Stop()
+    {
+        lock (live) {
+            if (recording != null) {
+                recording.Close();
+                recording = null;
+            }
+        }
+    }
+
+    public static bool Recording
+    {
+        get { return recording != null; }
+    }
+
+    public static int Recorded
+    {
+        get { return recorded; }
+    }
+}
+
+// Reads the afrowii blackbox log (see the blackbox section of afrowii/MultiWii_afro.c, and
+// blackbox_decode.c, which this follows), as a capture of the serial link with the 0xB8 chunks
+// or as the bare record stream. Every log in the file ends up in one ring, time in seconds
+public static class blackbox
+{
+    private const byte sync = 0xB8;
+    private const int fieldsmax = 15 + 8 + 4;
+
+    // Fields
+    private static byte[] data;
+    private static int pos;
+
+    // Methods
+    public static samplering Load(string path, out string info)
+    {
+        byte[] file = File.ReadAllBytes(path);
+        byte[] records = Unchunk(file);
+
+        if (records.Length == 0) {
+            records = file;     // no chunks: the record stream only
+        }
+        return Decode(records, out info);
+    }
+
+    // The payloads of all chunks with a good checksum, in order. A bad one may have started on a
+    // data byte that happened to be 0xB8, so scanning goes on right after its sync byte
+    private static byte[] Unchunk(byte[] file)
+    {
+        MemoryStream o = new MemoryStream();
+        int i = 0;
+
+        while (i + 2 < file.Length) {
+            if (file[i] != sync) {
+                i++;
+                continue;
+            }
+            int len = file[i + 1];
+            if (i + 2 + len >= file.Length)
+                break;
+            byte check = (byte)len;
+            for (int k = 0; k < len; k++) {
+                check ^= file[i + 2 + k];
+            }
+            if (check == file[i + 2 + len]) {
+                o.Write(file, i + 2, len);
+                i += len + 3;
+            } else {
+                i++;
+            }
+        }
+        return o.ToArray();
+    }
+
+    private static bool GetU(out uint v)
+    {
+        int shift = 0;
+        int c;
+
+        v = 0;
+        do {
+            if (pos >= data.Length || shift > 28)
+                return false;
+            c = data[pos++];
+            v |= (uint)(c & 0x7F) << shift;
+            shift += 7;
+        } while ((c & 0x80) != 0);
+        return true;
+    }
+
+    private static bool GetS(out int v)
+    {
+        uint u;
+
+        v = 0;
+        if (!GetU(out u))
+            return false;
+        v = (int)(u >> 1) ^ -(int)(u & 1);
+        return true;
+    }
+
+    private static string[] Names(uint motors)
+    {
+        string[] n = new string[15 + motors + 4];
+        string[] groups = new string[] { "gyro", "acc", "P", "I", "D" };
+        string axis = "rpy";
+        int k = 0;
+
+        foreach (string g in groups) {
+            for (int a = 0; a < 3; a++) {
+                n[k++] = g + "_" + axis[a];
+            }
+        }
+        for (uint m = 0; m < motors; m++) {
+            n[k++] = "motor" + m.ToString();
+        }
+        n[k++] = "rc_roll";
+        n[k++] = "rc_pitch";
+        n[k++] = "rc_yaw";
+        n[k++] = "rc_throttle";
+        return n;
+    }
+
+    private static samplering Decode(byte[] records, out string info)
+    {
+        samplering ring = null;
+        int[] f = new int[fieldsmax];
+        uint version = 0, fields = 0, motors = 0, divider = 0, acc1g = 0, refcycle = 0, time = 0, u;
+        bool header = false, intra = false;
+        int logs = 0, bad = 0, v;
+        long dropped = 0;
+
+        data = records;
+        pos = 0;
+        while (pos < data.Length) {
+            byte c = data[pos++];
+            switch (c) {
+            case (byte)'H':
+                if (!GetU(out version) || !GetU(out fields) || !GetU(out motors) || !GetU(out divider)
+                    || !GetU(out acc1g) || !GetU(out refcycle))
+                    goto done;
+                header = version == 1 && fields <= fieldsmax && fields == 15 + motors + 4;
+                intra = false;
+                if (header) {
+                    // later logs have to match the first, the ring has one set of channels
+                    if (ring == null) {
+                        ring = new samplering(Names(motors), 1 << 20);
+                    } else if (ring.Channels != fields) {
+                        header = false;
+                    }
+                    logs++;
+                }
+                break;
+            case (byte)'I':
+            case (byte)'P':
+                if (!header || (c == 'P' && !intra)) {
+                    bad++;
+                    intra = false;
+                    break;
+                }
+                if (!GetU(out u))
+                    goto done;
+                time = c == 'I' ? u : time + u;
+                for (int i = 0; i < fields; i++) {
+                    if (!GetS(out v))
+                        goto done;
+                    f[i] = c == 'I' ? v : f[i] + v;
+                }
+                intra = true;
+                float[] s = new float[fields];
+                for (int i = 0; i < fields; i++) {
+                    s[i] = f[i];
+                }
+                ring.Add(time / 1000000.0, s);
+                break;
+            case (byte)'E':
+                if (!GetU(out u))
+                    goto done;
+                dropped += u;
+                header = false;
+                break;
+            default:
+                // out of step (a chunk lost on the wire): wait for the next header or intra record
+                bad++;
+                intra = false;
+                break;
+            }
+        }
+    done:
+        info = logs.ToString() + " log(s), " + (ring == null ? 0 : ring.Count).ToString() + " records, every " + divider.ToString()
+            + " loop(s), " + dropped.ToString() + " dropped on the board, " + bad.ToString() + " bytes out of step";
+        data = null;
+        return ring;
+    }
+}
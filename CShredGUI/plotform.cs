@@ -0,0 +1,289 @@
+using System.Windows.Forms;
+using System;
+using System.IO;
+using System.ComponentModel;
+using System.Drawing;
+
+// Scrolling plot of the live sensor stream or of an imported blackbox log. Each pixel column shows the
+// min..max of the samples that fall into it, so drawing costs the width of the panel, not the sample rate
+public class plotform : Form
+{
+    // Fields
+    private IContainer components;
+    private plotpanel panel;
+    private CheckedListBox channels;
+    private ComboBox window;
+    private Button record;
+    private Button import;
+    private Button live;
+    private Label status;
+    private Timer redraw;
+    private SaveFileDialog saveFileDialog1;
+    private OpenFileDialog openFileDialog1;
+    private samplering shown;
+    private static readonly double[] windows = new double[] { 2, 5, 10, 30, 120, 0 };
+    private static readonly Color[] colors = new Color[] {
+        Color.Red, Color.Green, Color.Blue, Color.DarkOrange, Color.Purple, Color.Teal, Color.Brown,
+        Color.Magenta, Color.Olive, Color.Navy, Color.Gray, Color.DarkCyan, Color.Black
+    };
+
+    // Methods
+    public plotform()
+    {
+        this.InitializeComponent();
+        this.Display(capture.live, "Live");
+        this.window.SelectedIndex = 2;
+    }
+
+    private void Display(samplering ring, string title)
+    {
+        this.shown = ring;
+        this.panel.ring = ring;
+        this.channels.Items.Clear();
+        for (int i = 0; i < this.panel.enabled.Length; i++) {
+            this.panel.enabled[i] = i < 3;
+        }
+        foreach (string n in ring.names) {
+            this.channels.Items.Add(n, this.channels.Items.Count < 3);
+        }
+        this.Text = "Plot - " + title;
+        this.live.Enabled = ring != capture.live;
+    }
+
+    private void ChannelsItemCheck(object sender, ItemCheckEventArgs e)
+    {
+        this.panel.enabled[e.Index] = e.NewValue == CheckState.Checked;
+    }
+
+    private void WindowSelectedIndexChanged(object sender, EventArgs e)
+    {
+        this.panel.window = windows[this.window.SelectedIndex];
+    }
+
+    private void RecordClick(object sender, EventArgs e)
+    {
+        if (capture.Recording) {
+            capture.Stop();
+            this.record.Text = "Record...";
+            return;
+        }
+        this.saveFileDialog1.InitialDirectory = Environment.CurrentDirectory;
+        if (this.saveFileDialog1.ShowDialog() == DialogResult.OK) {
+            try {
+                capture.Record(this.saveFileDialog1.FileName, 26);
+                this.record.Text = "Stop";
+            } catch (Exception ex) {
+                MessageBox.Show(ex.Message, "Error", MessageBoxButtons.OK, MessageBoxIcon.Error);
+            }
+        }
+    }
+
+    private void ImportClick(object sender, EventArgs e)
+    {
+        string info;
+
+        this.openFileDialog1.InitialDirectory = Environment.CurrentDirectory;
+        if (this.openFileDialog1.ShowDialog() != DialogResult.OK)
+            return;
+        try {
+            samplering r = blackbox.Load(this.openFileDialog1.FileName, out info);
+            this.status.Text = info;
+            if (r != null && r.Count > 0) {
+                this.Display(r, Path.GetFileName(this.openFileDialog1.FileName));
+                this.window.SelectedIndex = windows.Length - 1;
+            }
+        } catch (Exception ex) {
+            MessageBox.Show(ex.Message, "Error", MessageBoxButtons.OK, MessageBoxIcon.Error);
+        }
+    }
+
+    private void LiveClick(object sender, EventArgs e)
+    {
+        this.Display(capture.live, "Live");
+        this.window.SelectedIndex = 2;
+    }
+
+    private void RedrawTick(object sender, EventArgs e)
+    {
+        if (capture.Recording) {
+            this.status.Text = capture.Recorded.ToString() + " frames recorded";
+        }
+        if (this.shown == capture.live) {
+            this.panel.Invalidate();
+        }
+    }
+
+    protected override void OnFormClosed(FormClosedEventArgs e)
+    {
+        capture.Stop();
+        base.OnFormClosed(e);
+    }
+
+    protected override void Dispose(bool disposing)
+    {
+        if (disposing && (this.components != null)) {
+            this.components.Dispose();
+        }
+        base.Dispose(disposing);
+    }
+
+    private void InitializeComponent()
+    {
+        this.components = new Container();
+        this.panel = new plotpanel();
+        this.channels = new CheckedListBox();
+        this.window = new ComboBox();
+        this.record = new Button();
+        this.import = new Button();
+        this.live = new Button();
+        this.status = new Label();
+        this.redraw = new Timer(this.components);
+        this.saveFileDialog1 = new SaveFileDialog();
+        this.openFileDialog1 = new OpenFileDialog();
+        this.SuspendLayout();
+        this.panel.Anchor = AnchorStyles.Top | AnchorStyles.Bottom | AnchorStyles.Left | AnchorStyles.Right;
+        this.panel.BorderStyle = BorderStyle.Fixed3D;
+        this.panel.Location = new Point(12, 12);
+        this.panel.Name = "panel";
+        this.panel.Size = new Size(620, 400);
+        this.panel.TabIndex = 0;
+        this.channels.Anchor = AnchorStyles.Top | AnchorStyles.Bottom | AnchorStyles.Right;
+        this.channels.CheckOnClick = true;
+        this.channels.Location = new Point(640, 12);
+        this.channels.Name = "channels";
+        this.channels.Size = new Size(130, 304);
+        this.channels.TabIndex = 1;
+        this.channels.ItemCheck += new ItemCheckEventHandler(this.ChannelsItemCheck);
+        this.window.Anchor = AnchorStyles.Bottom | AnchorStyles.Right;
+        this.window.DropDownStyle = ComboBoxStyle.DropDownList;
+        this.window.Items.AddRange(new object[] { "2 s", "5 s", "10 s", "30 s", "2 min", "All" });
+        this.window.Location = new Point(640, 322);
+        this.window.Name = "window";
+        this.window.Size = new Size(130, 21);
+        this.window.TabIndex = 2;
+        this.window.SelectedIndexChanged += new EventHandler(this.WindowSelectedIndexChanged);
+        this.record.Anchor = AnchorStyles.Bottom | AnchorStyles.Right;
+        this.record.Location = new Point(640, 349);
+        this.record.Name = "record";
+        this.record.Size = new Size(130, 23);
+        this.record.TabIndex = 3;
+        this.record.Text = "Record...";
+        this.record.UseVisualStyleBackColor = true;
+        this.record.Click += new EventHandler(this.RecordClick);
+        this.import.Anchor = AnchorStyles.Bottom | AnchorStyles.Right;
+        this.import.Location = new Point(640, 378);
+        this.import.Name = "import";
+        this.import.Size = new Size(64, 23);
+        this.import.TabIndex = 4;
+        this.import.Text = "Blackbox...";
+        this.import.UseVisualStyleBackColor = true;
+        this.import.Click += new EventHandler(this.ImportClick);
+        this.live.Anchor = AnchorStyles.Bottom | AnchorStyles.Right;
+        this.live.Location = new Point(706, 378);
+        this.live.Name = "live";
+        this.live.Size = new Size(64, 23);
+        this.live.TabIndex = 5;
+        this.live.Text = "Live";
+        this.live.UseVisualStyleBackColor = true;
+        this.live.Click += new EventHandler(this.LiveClick);
+        this.status.Anchor = AnchorStyles.Bottom | AnchorStyles.Left | AnchorStyles.Right;
+        this.status.Location = new Point(12, 418);
+        this.status.Name = "status";
+        this.status.Size = new Size(758, 18);
+        this.status.TabIndex = 6;
+        this.redraw.Interval = 40;      // 25 frames a second, however fast the data comes
+        this.redraw.Enabled = true;
+        this.redraw.Tick += new EventHandler(this.RedrawTick);
+        this.saveFileDialog1.DefaultExt = "shl";
+        this.saveFileDialog1.Filter = "Sensor recording (*.shl)|*.shl";
+        this.openFileDialog1.Filter = "Blackbox log (*.bin)|*.bin|All files (*.*)|*.*";
+        this.AutoScaleDimensions = new SizeF(6f, 13f);
+        this.ClientSize = new Size(782, 442);
+        this.Controls.Add(this.panel);
+        this.Controls.Add(this.channels);
+        this.Controls.Add(this.window);
+        this.Controls.Add(this.record);
+        this.Controls.Add(this.import);
+        this.Controls.Add(this.live);
+        this.Controls.Add(this.status);
+        this.Name = "plotform";
+        this.Text = "Plot";
+        this.ResumeLayout(false);
+    }
+
+    // The drawing surface
+    private class plotpanel : Panel
+    {
+        public samplering ring;
+        public bool[] enabled = new bool[64];
+        public double window = 10;     // seconds up to the newest sample, 0 = all
+
+        public plotpanel()
+        {
+            this.DoubleBuffered = true;
+            this.ResizeRedraw = true;
+            this.BackColor = Color.White;
+        }
+
+        protected override void OnPaint(PaintEventArgs e)
+        {
+            int w = this.ClientSize.Width, h = this.ClientSize.Height;
+
+            base.OnPaint(e);
+            if (this.ring == null || w < 2 || h < 2)
+                return;
+            lock (this.ring) {
+                int n = this.ring.Count;
+                if (n < 2)
+                    return;
+                // the oldest sample inside the window
+                int first = 0;
+                if (this.window > 0) {
+                    double from = this.ring.Time(n - 1) - this.window;
+                    first = n - 1;
+                    while (first > 0 && this.ring.Time(first - 1) >= from)
+                        first--;
+                }
+                int count = n - first;
+                if (count < 2)
+                    return;
+                for (int c = 0; c < this.ring.Channels && c < this.enabled.Length; c++) {
+                    if (!this.enabled[c])
+                        continue;
+                    // scaled to the panel over what is visible
+                    float lo = float.MaxValue, hi = float.MinValue;
+                    for (int i = first; i < n; i++) {
+                        float v = this.ring.Value(i, c);
+                        if (v < lo) lo = v;
+                        if (v > hi) hi = v;
+                    }
+                    if (hi <= lo)
+                        hi = lo + 1;
+                    float scale = (h - 1) / (hi - lo);
+                    using (Pen pen = new Pen(colors[c % colors.Length])) {
+                        int lasty = -1;
+                        for (int x = 0; x < w; x++) {
+                            int s0 = first + (int)((long)count * x / w);
+                            int s1 = first + (int)((long)count * (x + 1) / w);
+                            if (s1 <= s0)
+                                s1 = s0 + 1;
+                            float cmin = float.MaxValue, cmax = float.MinValue;
+                            for (int i = s0; i < s1 && i < n; i++) {
+                                float v = this.ring.Value(i, c);
+                                if (v < cmin) cmin = v;
+                                if (v > cmax) cmax = v;
+                            }
+                            int ytop = h - 1 - (int)((cmax - lo) * scale);
+                            int ybottom = h - 1 - (int)((cmin - lo) * scale);
+                            // join the columns, then the spread of this one
+                            if (lasty >= 0)
+                                e.Graphics.DrawLine(pen, x - 1, lasty, x, (ytop + ybottom) / 2);
+                            e.Graphics.DrawLine(pen, x, ytop, x, ybottom == ytop ? ytop + 1 : ybottom);
+                            lasty = (ytop + ybottom) / 2;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
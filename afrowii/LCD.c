@@ -1,6 +1,48 @@
 // ************************************************************************************************************
 // LCD & display & monitoring
 // ************************************************************************************************************
+#if defined(LCD_ETPP)
+// ---------------------------- Eagle Tree Power Panel -----------------------------------
+// A PCF2119 on the sensor bus. setup() writes the splash blocking, the loop never waits for it: LCDprint() and
+// lcdSetCursor() collect what the screen cache sends into one queued write of at most LCD_FLUSH_BYTES, and
+// lcdFlush() only starts one once the last is done and the bus has nothing queued. So the display goes out in
+// the bus slack after the sensor jobs, and a sensor job queued behind a write waits one short transfer at most
+#define ETPP_ADDRESS	0x76
+#define ETPP_CTRL_CMD	0x80		// control byte: one command byte follows, then another control byte
+#define ETPP_CTRL_DATA	0x40		// control byte: the rest of the write is display data
+#define ETPP_CHAR(c)	((c) > 0x0F ? (c) | 0x80 : (c))	// character set R is ASCII + 0x80, 0..15 are custom
+
+static i2cJob_t etppJob;
+static uint8_t etppBuf[LCD_FLUSH_BYTES];
+static uint8_t etppLen = 0;
+
+void i2c_ETPP_init()
+{
+    uint8_t buf[5] = { ETPP_ADDRESS, 0x00, 0x24, 0x0C, 0x06 };	// 2x16 lines, display on, no cursor, move right
+
+    i2c_write(buf, sizeof(buf));
+    etppJob.address = ETPP_ADDRESS;
+    etppJob.buf = etppBuf;
+    etppJob.read = 0;
+    etppJob.done = NULL;
+    etppJob.status = I2C_SUCCESS;
+}
+
+// blocking, for setup()
+void i2c_ETPP_print(uint8_t row, const char *s)
+{
+    uint8_t buf[4 + 16], n = 4;
+
+    buf[0] = ETPP_ADDRESS;
+    buf[1] = ETPP_CTRL_CMD;
+    buf[2] = row ? 0xC0 : 0x80;		// set DDRAM address, line 2 starts at 0x40
+    buf[3] = ETPP_CTRL_DATA;
+    for (; *s && n < sizeof(buf); s++)
+	buf[n++] = ETPP_CHAR(*s);
+    i2c_write(buf, n);
+}
+#endif
+
 #ifdef LCD_CONF
 
 typedef void (*formatter_func_ptr) (void *, uint8_t, uint8_t);
@@ -42,6 +84,8 @@ static lcd_param_def_t __PM = { &LPMM, 1, 1, 0 };
 static lcd_param_def_t __PS = { &LPMS, 1, 1, 0 };
 static lcd_param_def_t __PT = { &LTU8, 0, 1, 1 };
 static lcd_param_def_t __VB = { &LTU8, 1, 1, 0 };
+static lcd_param_def_t __GY = { &LTU8, 0, 1, 1 };
+static lcd_param_def_t __VA = { &LTU8, 1, 1, 1 };
 // Parameters
 static lcd_param_t lcd_param[] = {
     {"PITCH&ROLL P", &P8[ROLL], &__P}
@@ -61,6 +105,10 @@ static lcd_param_t lcd_param[] = {
     , {"PITCH&ROLL RATE", &rollPitchRate, &__RC}
     , {"YAW RATE", &yawRate, &__RC}
     , {"THROTTLE PID", &dynThrPID, &__RC}
+#if defined(ITG3200) || defined(MPU6000SPI)
+    , {"GYRO DLPF 0-6", &gyroDlpf, &__GY}
+    , {"GYRO RATE DIV", &gyroRateDiv, &__GY}
+#endif
 #ifdef POWERMETER
     , {"pMeter Motor 0", &pMeter[0], &__PM}, {"pMeter Motor 1", &pMeter[1], &__PM}, {"pMeter Motor 2", &pMeter[2], &__PM}
 #if (NUMBER_MOTOR > 3)
@@ -77,6 +125,10 @@ static lcd_param_t lcd_param[] = {
 #endif
 #ifdef VBAT
     , {"Battery Volt", &vbat, &__VB}
+#if !defined(PARAM_IN_PLACE)     // no RAM copy to step, 'V' sets them
+    , {"VBAT ALARM 1", &vbatAlarm.level1, &__VA}, {"VBAT ALARM 2", &vbatAlarm.level2, &__VA}
+    , {"VBAT ALARM 3", &vbatAlarm.level3, &__VA}, {"VBAT NO BATTERY", &vbatAlarm.none, &__VA}
+#endif
 #endif
 };
 #define PARAMMAX (sizeof(lcd_param)/sizeof(lcd_param_t) - 1)
@@ -89,6 +141,10 @@ void LCDprint(uint8_t i)
 {
 #if defined(LCD_TEXTSTAR)
     Serial.print(i, BYTE);
+#elif defined(LCD_ETPP)
+    if (!etppLen)
+	etppJob.subaddr = ETPP_CTRL_DATA;
+    etppBuf[etppLen++] = ETPP_CHAR(i);
 #else
     LCDPIN_OFF delayMicroseconds(BITDELAY);
     for (uint8_t mask = 0x01; mask; mask <<= 1) {
@@ -112,7 +168,7 @@ void LCDprintChar(const char *s)
 
 void initLCD()
 {
-    blinkLED(20, 30, 1);
+    ledBlink(20);
 #if defined(LCD_TEXTSTAR)
     // Cat's Whisker Technologies 'TextStar' Module CW-LCD-02
     // http://cats-whisker.com/resources/documents/cw-lcd-02_datasheet.pdf
@@ -121,11 +177,8 @@ void initLCD()
     LCDprint(0x43);
     LCDprint(0x02);		//cursor blink mode
     LCDprint(0x0c);		//clear screen
-    LCDprintChar("MultiWii Config");
-    LCDprint(0x0d);		// carriage return
-    LCDprintChar("for all params");
-    delay(2500);
-    LCDprint(0x0c);		//clear screen
+#elif defined(LCD_ETPP)
+    // set up by setup(), the cache redraws every cell
 #else
     Serial.end();
     //init LCD
@@ -135,6 +188,114 @@ void initLCD()
 
 static char line1[17], line2[17];
 
+// ----------------------------- screen cache ------------------------------------
+// line1/line2 are drawn into, lcdFlush() sends the cells that differ from what the display shows,
+// at most LCD_FLUSH_BYTES bytes (cursor moves included) per call. A call picks up the scan where the
+// previous one ran out of bytes, so cells that change all the time can't starve the others.
+#if defined(LCD_TEXTSTAR)
+#define LCD_CURSOR_BYTES 4
+#elif defined(LCD_ETPP)
+#define LCD_CURSOR_BYTES 2		// the command and the control byte after it
+#else
+#define LCD_CURSOR_BYTES 2
+#endif
+static char lcdShown[2][16];	// 0: unknown
+static uint8_t lcdCursor = 0xFF;	// row * 16 + column of the next write, 0xFF unknown
+static uint8_t lcdScan = 0;	// cell the next lcdFlush() starts at
+
+void lcdInvalidate()
+{
+    memset(lcdShown, 0, sizeof(lcdShown));
+    lcdCursor = 0xFF;
+}
+
+// clear screen, which also tells the cache what the display holds
+void lcdClear()
+{
+#if defined(LCD_TEXTSTAR)
+    LCDprint(0x0c);
+    memset(lcdShown, ' ', sizeof(lcdShown));
+    lcdCursor = 0;
+#else
+    lcdInvalidate();
+#endif
+}
+
+void lcdSetCursor(uint8_t row, uint8_t col)
+{
+#if defined(LCD_TEXTSTAR)
+    LCDprint(0xFE);
+    LCDprint('P');
+    LCDprint(row + 1);
+    LCDprint(col + 1);
+#elif defined(LCD_ETPP)
+    etppJob.subaddr = ETPP_CTRL_CMD;	// only ever the start of a write, see lcdFlush()
+    etppBuf[0] = (row ? 0xC0 : 0x80) + col;
+    etppBuf[1] = ETPP_CTRL_DATA;
+    etppLen = 2;
+#else
+    LCDprint(0xFE);
+    LCDprint((row ? 192 : 128) + col);
+#endif
+}
+
+#if defined(LCD_ETPP)
+static void etppSend()
+{
+    if (!etppLen)
+	return;
+    etppJob.len = etppLen;
+    etppLen = 0;
+    i2c_submit(&etppJob);		// refused: the status says so, the next lcdFlush() redraws
+}
+#else
+#define etppSend()
+#endif
+
+// 1 once the display matches line1/line2, cells past the end of a line are blanks
+uint8_t lcdFlush()
+{
+    uint8_t len[2], i, cell, row, col, n, sent = 0;
+    char c;
+
+#if defined(LCD_ETPP)
+    if (etppJob.status == I2C_PENDING || !i2c_isIdle())
+	return 0;			// the last write or a sensor job is still on the bus
+    if (etppJob.status != I2C_SUCCESS) {
+	etppJob.status = I2C_SUCCESS;	// the device stats of 'Z' have the failure
+	lcdInvalidate();
+    }
+#endif
+    len[0] = strlen(line1);
+    len[1] = strlen(line2);
+    for (i = 0; i < 32; i++) {
+	cell = (lcdScan + i) & 31;
+	row = cell >> 4;
+	col = cell & 15;
+	c = col < len[row] ? (row ? line2 : line1)[col] : ' ';
+	if (c == lcdShown[row][col])
+	    continue;
+	n = (cell == lcdCursor) ? 1 : 1 + LCD_CURSOR_BYTES;
+#if defined(LCD_ETPP)
+	if (sent && (sent + n > LCD_FLUSH_BYTES || n > 1)) {	// a cursor move starts a write
+#else
+	if (sent && sent + n > LCD_FLUSH_BYTES) {
+#endif
+	    lcdScan = cell;
+	    etppSend();
+	    return 0;
+	}
+	if (n > 1)
+	    lcdSetCursor(row, col);
+	LCDprint(c);
+	sent += n;
+	lcdShown[row][col] = c;
+	lcdCursor = col == 15 ? 0xFF : cell + 1;	// no wrap from the end of line 1 to line 2
+    }
+    etppSend();
+    return 1;
+}
+
 void __u8Inc(void *var, int8_t inc)
 {
     *(uint8_t *) var += inc;
@@ -220,94 +381,150 @@ static uint8_t lcdStickState[3];
 #define IsHigh(x) (lcdStickState[x] & 0x2)
 #define IsMid(x)  (!lcdStickState[x])
 
-void configurationLoop()
+// ----------------------------- configuration menu ------------------------------------
+// configurationStart() opens the menu, configurationLoop() is a 50Hz task that reads the sticks (and the
+// TEXTSTAR keys handed over by serialCom) and redraws through the screen cache. Nothing blocks: the main loop,
+// the outputs and the other tasks keep running, rcTask() leaves the stick commands alone while the menu is on.
+enum {
+    LCDCONF_OFF = 0,
+    LCDCONF_SPLASH,
+    LCDCONF_EDIT,
+    LCDCONF_EXIT
+};
+
+#define LCD_CONF_REPEAT 10	// runs: a held stick steps 5 times a second
+#define LCD_CONF_RELEASE 0xFF	// wait for the sticks to be centered once
+
+static struct {
+    uint8_t state;
+    uint8_t p;			// parameter shown
+    uint8_t key;		// last TEXTSTAR key, 0 if none
+    uint8_t repeat;		// runs until a held stick acts again
+    uint8_t refresh;
+    uint32_t until;		// end of the splash / exit message
+} lcdConf;
+
+uint8_t configurationActive()
+{
+    return lcdConf.state != LCDCONF_OFF;
+}
+
+void configurationKey(uint8_t key)
 {
-    uint8_t i, p;
-    uint8_t LCD = 1;
-    uint8_t refreshLCD = 1;
-    uint8_t key = 0;
+    lcdConf.key = key;
+}
+
+void configurationStart()
+{
+    if (lcdConf.state != LCDCONF_OFF)
+	return;
     initLCD();
-    p = 0;
-    while (LCD == 1) {
-	if (refreshLCD) {
-	    blinkLED(10, 20, 1);
-	    strcpy(line2, "                ");
-	    strcpy(line1, "                ");
-	    i = 0;
-	    char *point = lcd_param[p].paramText;
-	    while (*point)
-		line1[i++] = *point++;
-	    lcd_param[p].def->type->fmt(lcd_param[p].var, lcd_param[p].def->multiplier, lcd_param[p].def->decimal);
-#if defined(LCD_TEXTSTAR)
-	    LCDprint(0xFE);
-	    LCDprint('L');
-	    LCDprint(1);
-	    LCDprintChar(line1);	//refresh line 1 of LCD
-	    LCDprint(0xFE);
-	    LCDprint('L');
-	    LCDprint(2);
-	    LCDprintChar(line2);	//refresh line 2 of LCD
+    lcdInvalidate();
+    strcpy(line1, "MultiWii Config");
+    strcpy(line2, "for all params");
+    lcdConf.state = LCDCONF_SPLASH;
+    lcdConf.until = currentTime + 2500000;
+    lcdConf.p = 0;
+    lcdConf.key = 0;
+    lcdConf.repeat = LCD_CONF_RELEASE;	// the sticks that opened the menu are still held
+}
+
+static void configurationExit(uint8_t save)
+{
+    ledBlink(20);
+    if (save) {
+	strcpy(line1, "Saving Settings");
+	writeParams();		// paramTask() commits it to the eeprom
+    } else
+	strcpy(line1, "skipping Save.");	// eeprom has only 100.000 write cycles
+    strcpy(line2, "..done! Exit.");
+    lcdConf.state = LCDCONF_EXIT;
+#ifdef LCD_TELEMETRY
+    lcdConf.until = currentTime + 1000000;	// keep exit message visible for one second before telemetry takes the display again
 #else
-	    LCDprint(0xFE);
-	    LCDprint(128);
-	    LCDprintChar(line1);
-	    LCDprint(0xFE);
-	    LCDprint(192);
-	    LCDprintChar(line2);
+    lcdConf.until = currentTime;
 #endif
-	    refreshLCD = 0;
+}
+
+void configurationLoop()
+{
+    uint8_t i, key, p;
+    char *point;
+
+    switch (lcdConf.state) {
+    case LCDCONF_OFF:
+	return;
+    case LCDCONF_SPLASH:
+	if (lcdFlush() && (int32_t) (currentTime - lcdConf.until) >= 0) {
+	    lcdConf.state = LCDCONF_EDIT;
+	    lcdConf.refresh = 1;
 	}
-#if defined(LCD_TEXTSTAR)
-	key = (Serial.available()? Serial.read() : 0);
+	return;
+    case LCDCONF_EXIT:
+	if (lcdFlush() && (int32_t) (currentTime - lcdConf.until) >= 0) {
+#if !defined(LCD_TEXTSTAR) && !defined(LCD_ETPP)
+	    Serial.begin(SERIAL_COM_SPEED);
 #endif
-	for (i = ROLL; i < THROTTLE; i++) {
-	    uint16_t Tmp = readRawRC(i);
-	    lcdStickState[i] = (Tmp < MINCHECK) | ((Tmp > MAXCHECK) << 1);
-	};
-	if (IsLow(YAW) && IsHigh(PITCH))
-	    LCD = 0;		// save and exit
-	else if (IsHigh(YAW) && IsHigh(PITCH))
-	    LCD = 2;		// exit without save: eeprom has only 100.000 write cycles
-	else if (key == LCD_MENU_NEXT || (IsLow(PITCH))) {	//switch config param with pitch
-	    refreshLCD = 1;
-	    p++;
-	    if (p > PARAMMAX)
-		p = 0;
-	} else if (key == LCD_MENU_PREV || (IsHigh(PITCH))) {
-	    refreshLCD = 1;
-	    p--;
-	    if (p == 0xFF)
-		p = PARAMMAX;
-	} else if (key == LCD_VALUE_DOWN || (IsLow(ROLL))) {	//+ or - param with low and high roll
-	    refreshLCD = 1;
-	    lcd_param[p].def->type->inc(lcd_param[p].var, -lcd_param[p].def->increment);
-	    if (p == 0)
-		memcpy(lcd_param[4].var, lcd_param[0].var, 1);
-	} else if (key == LCD_VALUE_UP || (IsHigh(ROLL))) {
-	    refreshLCD = 1;
-	    lcd_param[p].def->type->inc(lcd_param[p].var, +lcd_param[p].def->increment);
-	    if (p == 0)
-		memcpy(lcd_param[4].var, lcd_param[0].var, 1);
+	    lcdConf.state = LCDCONF_OFF;
 	}
-    }				// while (LCD == 1)
-    blinkLED(20, 30, 1);
-#if defined(LCD_TEXTSTAR)
-    LCDprint(0x0c);		//clear screen
-    if (LCD == 0)
-	LCDprintChar("Saving Settings..");
-    else
-	LCDprintChar("skipping Save.");
-#endif
-    if (LCD == 0)
-	writeParams();
-#if defined(LCD_TEXTSTAR)
-    LCDprintChar("..done! Exit.");
-#else
-    Serial.begin(SERIAL_COM_SPEED);
-#endif
-#ifdef LCD_TELEMETRY
-    delay(1000);		// keep exit message visible for one second even if (auto)telemetry continues writing in main loop
-#endif
+	return;
+    }
+
+    key = lcdConf.key;
+    lcdConf.key = 0;
+    for (i = ROLL; i < THROTTLE; i++)
+	lcdStickState[i] = (rcData[i] < MINCHECK) | ((rcData[i] > MAXCHECK) << 1);
+    if (IsMid(ROLL) && IsMid(PITCH) && IsMid(YAW))
+	lcdConf.repeat = 0;
+    else if (lcdConf.repeat) {
+	if (lcdConf.repeat != LCD_CONF_RELEASE)
+	    lcdConf.repeat--;
+	memset(lcdStickState, 0, sizeof(lcdStickState));	// held, not yet time to act again
+    } else
+	lcdConf.repeat = LCD_CONF_REPEAT;
+
+    p = lcdConf.p;
+    if (IsLow(YAW) && IsHigh(PITCH)) {
+	configurationExit(1);	// save and exit
+	return;
+    } else if (IsHigh(YAW) && IsHigh(PITCH)) {
+	configurationExit(0);	// exit without save
+	return;
+    } else if (key == LCD_MENU_NEXT || (IsLow(PITCH))) {	//switch config param with pitch
+	lcdConf.refresh = 1;
+	p++;
+	if (p > PARAMMAX)
+	    p = 0;
+    } else if (key == LCD_MENU_PREV || (IsHigh(PITCH))) {
+	lcdConf.refresh = 1;
+	p--;
+	if (p == 0xFF)
+	    p = PARAMMAX;
+    } else if (key == LCD_VALUE_DOWN || (IsLow(ROLL))) {	//+ or - param with low and high roll
+	lcdConf.refresh = 1;
+	lcd_param[p].def->type->inc(lcd_param[p].var, -lcd_param[p].def->increment);
+	if (p == 0)
+	    memcpy(lcd_param[4].var, lcd_param[0].var, 1);
+    } else if (key == LCD_VALUE_UP || (IsHigh(ROLL))) {
+	lcdConf.refresh = 1;
+	lcd_param[p].def->type->inc(lcd_param[p].var, +lcd_param[p].def->increment);
+	if (p == 0)
+	    memcpy(lcd_param[4].var, lcd_param[0].var, 1);
+    }
+    lcdConf.p = p;
+
+    if (lcdConf.refresh) {
+	ledBlink(10);
+	strcpy(line2, "                ");
+	strcpy(line1, "                ");
+	i = 0;
+	point = lcd_param[p].paramText;
+	while (*point)
+	    line1[i++] = *point++;
+	lcd_param[p].def->type->fmt(lcd_param[p].var, lcd_param[p].def->multiplier, lcd_param[p].def->decimal);
+	lcdConf.refresh = 0;
+    }
+    lcdFlush();			// a few cells per run, the rest on the next ones
 }
 #endif
 
@@ -315,15 +532,41 @@ void configurationLoop()
 // -------------------- telemtry output to LCD over serial ----------------------------------
 
 #ifdef LCD_TELEMETRY
+// lcdBar(s,n,v) : draw a bar graph into s - n number of chars for width, v value in % to display
+void lcdBar(char *s, uint8_t n, int16_t v)
+{
+    uint8_t i;
+
+    v = (v * n + 50) / 100;
+    for (i = 0; i < n; i++)
+	s[i] = i < v ? 0xFF : ' ';	// 0xFF: full block in the HD44780 character set
+}
+
+// a page is drawn again every lcdPagePeriod ms but not faster than LCD_TELEMETRY, lcdFlush() then sends
+// only the cells that changed, a few per run of telemetryTask()
+static const uint16_t lcdPagePeriod[5] = { 100, 500, 250, 100, 500 };	// 'A'..'E'
+
 void lcd_telemetry()
 {
-    // LCD_BAR(n,v) : draw a bar graph - n number of chars for width, v value in % to display
-#ifdef LCD_TEXTSTAR
-#define LCD_BAR(n,v) { LCDprint(0xFE);LCDprint('b');LCDprint(n);LCDprint(v); }
-#else
-#define LCD_BAR(n,v) {}		// add your own implementation here
-#endif
+    static uint8_t page = 0;
+    static uint32_t drawn;
+    uint32_t period;
     uint16_t intPowerMeterSum;
+    uint16_t unit;
+    uint16_t v;
+    uint8_t i;
+
+    if (telemetry < 'A' || telemetry > 'E')
+	return;
+    period = lcdPagePeriod[telemetry - 'A'] * 1000UL;
+    if (period < LCD_TELEMETRY)
+	period = LCD_TELEMETRY;
+    if (telemetry == page && currentTime - drawn < period) {
+	lcdFlush();
+	return;
+    }
+    page = telemetry;
+    drawn = currentTime;
 
     switch (telemetry) {	// output telemetry data, if one of four modes is set
     case 'C':			// button C on Textstar LCD -> cycle time
@@ -346,15 +589,9 @@ void lcd_telemetry()
 	line2[10] = '0' + cycleTimeMax / 100 - (cycleTimeMax / 1000) * 10;
 	line2[11] = '0' + cycleTimeMax / 10 - (cycleTimeMax / 100) * 10;
 	line2[12] = '0' + cycleTimeMax - (cycleTimeMax / 10) * 10;
-	LCDprint(0xFE);
-	LCDprint('L');
-	LCDprint(2);
-	LCDprintChar(line2);	//refresh line 2 of LCD
+#else
+	line2[0] = 0;		// blank line
 #endif
-	LCDprint(0xFE);
-	LCDprint('L');
-	LCDprint(1);
-	LCDprintChar(line1);	//refresh line 1 of LCD
 	break;
     case 'B':			// button B on Textstar LCD -> Voltage, PowerSum and power alarm trigger value
 	strcpy(line1, "__._V   _____mAh");	//uint8_t vbat, intPowerMeterSum
@@ -374,26 +611,18 @@ void lcd_telemetry()
 	line1[12] = '0' + intPowerMeterSum - (intPowerMeterSum / 10) * 10;
 	//line2[13] = '0'+powerTrigger1/100; line2[14] = '0'+powerTrigger1/10-(powerTrigger1/100)*10; line2[15] = '0'+powerTrigger1-(powerTrigger1/10)*10;
 #endif
-	LCDprint(0xFE);
-	LCDprint('L');
-	LCDprint(1);
-	LCDprintChar(line1);	//refresh line 1 of LCD
-	LCDprint(0xFE);
-	LCDprint('L');
-	LCDprint(2);		//position on line 2 of LCD
+	strcpy(line2, "                ");
 #ifdef VBAT
-	LCD_BAR(7, (((vbat - VBATLEVEL1_3S) * 100) / VBATREF));
-	LCDprintChar("  ");
+	lcdBar(line2, 7, (((vbat - vbatAlarm.level1) * 100) / VBATREF));
 #endif
 #ifdef POWERMETER
 	//     intPowerMeterSum = (pMeter[PMOTOR_SUM]/PLEVELDIV);
 	//   pAlarm = (uint32_t) powerTrigger1 * (uint32_t) PLEVELSCALE * (uint32_t) PLEVELDIV; // need to cast before multiplying
 	if (powerTrigger1)
-	    LCD_BAR(7, (intPowerMeterSum / powerTrigger1 * 2));	// bar graph powermeter (scale intPowerMeterSum/powerTrigger1 with *100/PLEVELSCALE)
+	    lcdBar(line2 + 9, 7, (intPowerMeterSum / powerTrigger1 * 2));	// bar graph powermeter (scale intPowerMeterSum/powerTrigger1 with *100/PLEVELSCALE)
 #endif
 	break;
     case 'A':			// button A on Textstar LCD -> angles 
-	uint16_t unit;
 	strcpy(line1, "Deg ___._  ___._");
 	/*            0123456789.12345 */
 	strcpy(line2, "___,_A max___,_A");	//uin16_t cycleTimeMax
@@ -426,46 +655,44 @@ void lcd_telemetry()
 	line2[11] = '0' + unit / 1000 - (unit / 10000) * 10;
 	line2[12] = '0' + unit / 100 - (unit / 1000) * 10;
 	line2[14] = '0' + unit / 10 - (unit / 100) * 10;
-	LCDprint(0xFE);
-	LCDprint('L');
-	LCDprint(2);
-	LCDprintChar(line2);	//refresh line 2 of LCD
+#else
+	line2[0] = 0;
 #endif
-	LCDprint(0xFE);
-	LCDprint('L');
-	LCDprint(1);
-	LCDprintChar(line1);	//refresh line 1 of LCD
 	break;
     case 'D':			// button D on Textstar LCD -> sensors
 #define GYROLIMIT 20		// threshold: for larger values replace bar with dots
-#define ACCLIMIT 30		// threshold: for larger values replace bar with dots      LCDprint(0xFE);LCDprint('L');LCDprint(1);LCDprintChar("G "); //refresh line 1 of LCD
-	if (abs(gyroData[0]) < GYROLIMIT) {
-	LCD_BAR(4, (GYROLIMIT + gyroData[0]) * 50 / GYROLIMIT)} else
-	    LCDprintChar("....");
-	LCDprint(' ');
-	if (abs(gyroData[1]) < GYROLIMIT) {
-	LCD_BAR(4, (GYROLIMIT + gyroData[1]) * 50 / GYROLIMIT)} else
-	    LCDprintChar("....");
-	LCDprint(' ');
-	if (abs(gyroData[2]) < GYROLIMIT) {
-	LCD_BAR(4, (GYROLIMIT + gyroData[2]) * 50 / GYROLIMIT)} else
-	    LCDprintChar("....");
-	LCDprint(0xFE);
-	LCDprint('L');
-	LCDprint(2);
-	LCDprintChar("A ");	//refresh line 2 of LCD
-	if (abs(accSmooth[0]) < ACCLIMIT) {
-	LCD_BAR(4, (ACCLIMIT + accSmooth[0]) * 50 / ACCLIMIT)} else
-	    LCDprintChar("....");
-	LCDprint(' ');
-	if (abs(accSmooth[1]) < ACCLIMIT) {
-	LCD_BAR(4, (ACCLIMIT + accSmooth[1]) * 50 / ACCLIMIT)} else
-	    LCDprintChar("....");
-	LCDprint(' ');
-	if (abs(accSmooth[2] - acc_1G) < ACCLIMIT) {
-	LCD_BAR(4, (ACCLIMIT + accSmooth[2] - acc_1G) * 50 / ACCLIMIT)} else
-	    LCDprintChar("....");
+#define ACCLIMIT 30		// threshold: for larger values replace bar with dots
+	strcpy(line1, "G .... .... ....");
+	/*            0123456789.12345 */
+	strcpy(line2, "A .... .... ....");
+	for (i = 0; i < 3; i++) {
+	    if (abs(gyroData[i]) < GYROLIMIT)
+		lcdBar(line1 + 2 + i * 5, 4, (GYROLIMIT + gyroData[i]) * 50 / GYROLIMIT);
+	    v = i == 2 ? accSmooth[2] - acc_1G : accSmooth[i];
+	    if (abs((int16_t) v) < ACCLIMIT)
+		lcdBar(line2 + 2 + i * 5, 4, (ACCLIMIT + (int16_t) v) * 50 / ACCLIMIT);
+	}
+	break;
+    case 'E':			// auto hopping only -> acc vibration rms, % of ACC rejected updates, clip counts
+	strcpy(line1, "V___ ___ ___ __%");
+	/*            0123456789.12345 */
+	strcpy(line2, "C ____ ____ ____");
+	for (i = 0; i < 3; i++) {
+	    v = accVib.rms[i] > 999 ? 999 : accVib.rms[i];
+	    line1[1 + i * 4] = '0' + v / 100;
+	    line1[2 + i * 4] = '0' + v / 10 - (v / 100) * 10;
+	    line1[3 + i * 4] = '0' + v - (v / 10) * 10;
+	    v = accVib.clip[i] > 9999 ? 9999 : accVib.clip[i];
+	    line2[2 + i * 5] = '0' + v / 1000;
+	    line2[3 + i * 5] = '0' + v / 100 - (v / 1000) * 10;
+	    line2[4 + i * 5] = '0' + v / 10 - (v / 100) * 10;
+	    line2[5 + i * 5] = '0' + v - (v / 10) * 10;
+	}
+	v = accVib.rejected > 99 ? 99 : accVib.rejected;
+	line1[13] = '0' + v / 10;
+	line1[14] = '0' + v - (v / 10) * 10;
 	break;
     }				// end switch (telemetry) 
+    lcdFlush();
 }				// end function
 #endif				//  LCD_TELEMETRY
@@ -13,6 +13,11 @@ November  2011     V1.9
 #include "config.h"
 #include "def.h"
 #include "sysdep.h"
+#include "seqcount.h"
+#include "pool.h"
+#include "pt.h"
+#include "fixmath.h"
+#include "hwreg.h"
 
 #define   VERSION  19
 
@@ -55,24 +60,49 @@ static uint8_t magMode = 0;     // if compass heading hold is a activated
 static uint8_t baroMode = 0;    // if altitude hold is activated
 static uint8_t GPSModeHome = 0; // if GPS RTH is activated
 static uint8_t GPSModeHold = 0; // if GPS PH is activated
-static int16_t gyroADC[3], accADC[3], magADC[3];
+// The gyro -> PID -> mixer state is __tiny: on the STM8 it lives in the zero page (.bsct/.ubsct, 256 bytes it
+// shares with Cosmic's runtime registers) and every access is a one byte direct or short indexed address instead
+// of a two byte one. The zero page entries of the linker map are what landed there, clnk stops the build if it
+// overflows, and ram_static() counts it. Keep it to what pidCompute() and mixTable() touch every loop
+static __tiny int16_t gyroADC[3];
+static int16_t accADC[3], magADC[3];
 static int16_t accSmooth[3];    // projection of smoothed and normalized gravitation force vector on x/y/z axis, as measured by accelerometer
 static int16_t accTrim[2] = { 0, 0 };
 static int16_t heading, magHold;
 static uint8_t calibratedACC = 0;
 static uint8_t vbat;            // battery voltage in 0.1V steps
+// With PARAM_IN_PLACE a parameter nothing reads every loop is a constant default and a name that reads the value
+// where the EEPROM has it, see paramData(). Written through paramWrite(), which takes either kind
+#define PARAM_VALUE(type, id)   (*(const type *)paramData(paramIndex(id)))
+typedef struct vbatAlarm_t {
+    uint8_t level1, level2, level3;     // 0.1V, buzzer slow / faster / fastest below each
+    uint8_t none;                       // 0.1V, below this there is no battery plugged in, stay quiet
+} vbatAlarm_t;
+#if defined(PARAM_IN_PLACE)
+static const vbatAlarm_t vbatAlarmDefault = { VBATLEVEL1_3S, VBATLEVEL2_3S, VBATLEVEL3_3S, NO_VBAT };
+#define vbatAlarm               PARAM_VALUE(vbatAlarm_t, 23)
+#else
+static vbatAlarm_t vbatAlarm = { VBATLEVEL1_3S, VBATLEVEL2_3S, VBATLEVEL3_3S, NO_VBAT };
+#endif
 static uint8_t okToArm = 0;
+static uint16_t bootSetupMs = 0;        // ms from reset to the end of setup(), see powerUpWait()
+static uint16_t bootReadyMs = 0;        // and to the end of the boot calibration, 0 until then
 static uint8_t rcOptions;
 static int32_t pressure;
 static int32_t BaroAlt;
+static uint8_t baroSamples = 0;         // bumped by the baro driver with every new BaroAlt
+static uint8_t baroOsr = MS561101BA_OSR;        // MS561101BA oversampling, 0..4 = OSR 256..4096
+static uint8_t gyroDlpf = GYRO_DLPF_DEFAULT;    // ITG3200/MPU6000 DLPF_CFG 0..6, 256Hz..5Hz
+static uint8_t gyroRateDiv = GYRO_DIV_DEFAULT;  // ITG3200/MPU6000 SMPLRT_DIV, output rate / (div + 1)
 static int32_t EstVelocity;
 static int32_t EstAlt;          // in cm
 static uint8_t buzzerState = 0;
 static uint16_t i2cErrorCounter = 0;    // number of i2c errors on bus
+static uint16_t serialFrameErrors = 0;  // framed serial commands dropped on a bad checksum or length
 
 #ifdef STM8
 /* 0:Pitch 1:Roll 2:Yaw 3:Battery Voltage 4:AX 5:AY 6:AZ */
-static volatile s16 sensorInputs[7] = { 0, };
+static s16 sensorInputs[7] = { 0, };
 #endif
 
 //for log
@@ -80,6 +110,7 @@ static uint16_t cycleTimeMax = 0;       // highest ever cycle time
 static uint16_t cycleTimeMin = 65535;   // lowest ever cycle time
 static uint16_t powerMax = 0;   // highest ever current
 static uint16_t powerAvg = 0;   // last known current
+static uint16_t powerDraw = 0;  // last powermeter sample, in pMeter units per PSENSOR_PERIOD
 
 // **********************
 // power meter
@@ -102,47 +133,179 @@ static uint8_t telemetry_auto = 0;
 #define MINCHECK 1100
 #define MAXCHECK 1900
 
-volatile int16_t failsafeCnt = 0;
-
+// failsafe stage, from the age of rcLinkTime each time rcTask() runs. Every stage keeps the ones before it
+enum {
+    FAILSAFE_NONE = 0,
+    FAILSAFE_LEVEL,         // FAILSAVE_DELAY without a link: level mode, sticks centred, throttle held
+    FAILSAFE_DESCEND,       // FAILSAVE_DESCEND_DELAY later: throttle to FAILSAVE_THR0TTLE
+    FAILSAFE_DISARM         // FAILSAVE_OFF_DELAY after that: motors off
+};
+static uint8_t failsafeStage = FAILSAFE_NONE;
 static int16_t failsafeEvents = 0;
 static int16_t rcData[8];       // interval [1000;2000]
-static int16_t rcCommand[4];    // interval [1000;2000] for THROTTLE and [-500;+500] for ROLL/PITCH/YAW 
+static __tiny int16_t rcCommand[4];    // interval [1000;2000] for THROTTLE and [-500;+500] for ROLL/PITCH/YAW 
 
 static uint8_t rcRate8;
 static uint8_t rcExpo8;
 static int16_t lookupRX[7];     //  lookup table for expo & RC rate
-volatile uint8_t rcFrameComplete;       // for serial rc receiver Spektrum
+static uint8_t tpaLookup[9];    //  ROLL/PITCH P and D factor (128: 1) at the tpaCurve breakpoints, see rcShape()
+static uint8_t rateSlope[3];    //  rollPitchRate/yawRate as the factor taken off per stick step, << 9
+// published by the receiver interrupt once a whole frame is in rcValue[]: computeRC() runs on the flag
+// instead of a fixed rate and clears it. rcFrameCount is the sequence count of rcValue[] and rcFrameTime,
+// micros() at the sync. rcLinkTime goes with them, the rcFrameTime of the last frame that counts as a link
+// (not an SBUS repeat of a lost frame)
+volatile uint8_t rcFrameComplete;
+seq_t rcFrameCount;
+volatile uint32_t rcFrameTime;
+volatile uint32_t rcLinkTime;
 
 // **************
 // gyro+acc IMU
 // **************
-static int16_t gyroData[3] = { 0, 0, 0 };
-static int16_t gyroZero[3] = { 0, 0, 0 };
+static __tiny int16_t gyroData[3] = { 0, 0, 0 };
+static __tiny int16_t gyroZero[3] = { 0, 0, 0 };
 static int16_t accZero[3] = { 0, 0, 0 };
 static int16_t magZero[3] = { 0, 0, 0 };
 static int16_t angle[2] = { 0, 0 };     // absolute angle inclination in multiple of 0.1 degree    180 deg = 1800
+// angle[] and heading take an atan2 each and most loops nobody looks at them (ACRO, no telemetry due), so
+// getEstimatedAttitude() only marks them stale and the readers bring them up to date first with
+// attitudeAngles() / attitudeHeading(). The LEVEL and heading hold PIDs run at the outer loop rate, the
+// rest (gimbal, telemetry) when it's there.
+#define ATT_ANGLES  1
+#define ATT_HEADING 2
+static uint8_t attitudeStale = 0;
 static int8_t smallAngle25 = 1;
+#if defined(GYRO_DRDY)
+static uint32_t gyroSampleTime = 0;     // data ready timestamp of the last gyro sample read
+#endif
+#if defined(SENSOR_LINK)
+static uint16_t sensorLinkDt = 0;       // the sensor node's time between its last two samples, 0 while down
+#endif
+#if defined(HIL_INJECT)
+// Bench harness input, see the 'h' command and hil_bench.c: the last frame stands in for the gyro and acc
+// readings at the top of GYRO_Common()/ACC_Common() until none came for HIL_TIMEOUT
+#define HIL_TIMEOUT         50000       // us
+static int16_t hilGyro[3], hilAcc[3];
+static uint32_t hilTime = 0;            // currentTime of the last frame, 0 before the first
+#if defined(BIT_EXACT)
+// Parity image, see the 'x' command and parity_bench.c: a loop runs for each step frame, on its clock. The
+// injection is on for every loop, the frame went in just before it
+#define HIL_ACTIVE()        1
+static uint32_t parityTime = 0;         // us, the log time of the step frame
+static uint16_t paritySteps = 0;        // frames taken, sent back with the motors
+static uint8_t parityStep = 0;          // a frame came in, its loop hasn't run
+#else
+#define HIL_ACTIVE()        (hilTime && currentTime - hilTime < HIL_TIMEOUT)
+#endif
+#endif
+// The loop's clock: currentTime, the attitude estimator's dt and the failsafe age. The parity image runs on the
+// step frames' time, so a host and a board that take the same frames see the same times
+#if defined(BIT_EXACT)
+#define loopMicros()        parityTime
+#else
+#define loopMicros()        micros()
+#endif
+
+// Biquad filter bank applied at the end of GYRO_Common()/ACC_Common(), per axis. 0 Hz leaves a stage out.
+typedef struct sensorFilter_t {
+    uint16_t gyroLpf[3];        // Hz, 2nd order Butterworth low pass
+    uint16_t gyroNotch[3];      // Hz, notch centre
+    uint16_t accLpf[3];
+    uint16_t accNotch[3];
+} sensorFilter_t;
+#if defined(PARAM_IN_PLACE)
+static const sensorFilter_t sensorFilterDefault = { { 0 } };
+#define sensorFilter            PARAM_VALUE(sensorFilter_t, 20)
+#else
+static sensorFilter_t sensorFilter;
+#endif
 
 // *************************
 // motor and servo functions
 // *************************
-static int16_t axisPID[3];
-static int16_t motor[8];
+static __tiny int16_t axisPID[3];
+static __tiny int16_t motor[8];
 static int16_t servo[4] = { 1500, 1500, 1500, 1500 };
 static uint8_t mixerConfiguration = MULTITYPE_QUADX;
 static uint8_t useServo = 0;
 static uint8_t numberMotor = 4;
+// What the per-cycle code reads instead of the three above. With FIXED_FRAME they are constants and the
+// frame checks and motor loop bounds fold away, the variables stay for the setup code, the EEPROM and the GUI.
+// The motor counts are those of mixers[], a MULTITYPE_CUSTOM build still takes its count from the table in EEPROM.
+#if defined(FIXED_FRAME)
+#define FRAME               FIXED_FRAME
+#define FRAME_MOTORS        (FRAME == MULTITYPE_CUSTOM ? numberMotor : FRAME == MULTITYPE_GIMBAL ? 0 : \
+                             FRAME == MULTITYPE_FLYING_WING ? 1 : FRAME == MULTITYPE_BI ? 2 : FRAME == MULTITYPE_TRI ? 3 : \
+                             FRAME == MULTITYPE_Y6 || FRAME == MULTITYPE_HEX6 || FRAME == MULTITYPE_HEX6X ? 6 : \
+                             FRAME >= MULTITYPE_OCTOX8 ? 8 : 4)
+#if defined(SERVO_TILT)
+#define FRAME_SERVO         1
+#else
+#define FRAME_SERVO         (FRAME == MULTITYPE_BI || FRAME == MULTITYPE_TRI || FRAME == MULTITYPE_GIMBAL || FRAME == MULTITYPE_FLYING_WING)
+#endif
+#else
+#define FRAME               mixerConfiguration
+#define FRAME_MOTORS        numberMotor
+#define FRAME_SERVO         useServo
+#endif
+
+// Mixer weights per motor, 1/64 fixed point (64 = 1.0)
+typedef struct motorMix_t {
+    int8_t throttle;
+    int8_t roll;
+    int8_t pitch;
+    int8_t yaw;
+} motorMix_t;
+
+typedef struct customMixer_t {
+    uint8_t motors;
+    motorMix_t mix[8];
+} customMixer_t;                        // MULTITYPE_CUSTOM
+#if defined(PARAM_IN_PLACE)
+static const customMixer_t customMixerDefault = { 0 };
+#define customMixer             PARAM_VALUE(customMixer_t, 18)
+#else
+static customMixer_t customMixer;
+#endif
+
+// loops where mixTable() had to move the collective / shrink the differential, saturating, for telemetry
+static uint8_t mixShifted = 0;
+static uint8_t mixScaled = 0;
 
 // **********************
 // EEPROM & LCD functions
 // **********************
-static uint8_t P8[7], I8[7], D8[7];     //8 bits is much faster and the code is much shorter
-static uint8_t dynP8[3], dynI8[3], dynD8[3];
+static __tiny uint8_t P8[7], I8[7], D8[7];     //8 bits is much faster and the code is much shorter
+static __tiny uint8_t dynP8[3], dynI8[3], dynD8[3];
 static uint8_t rollPitchRate;
 static uint8_t yawRate;
 static uint8_t dynThrPID;
+static uint8_t tpaCurve[8];             // TPA, % of the ROLL/PITCH P and D taken off at throttle 1125, 1250 .. 2000
+                                        // (1000: none). All 0: dynThrPID's curve, none up to 1500, dynThrPID at 2000
 static uint8_t activate[8];
 
+#if defined(TUNING_PROFILES)
+// The variables above (and rcRate8, rcExpo8, lookupRX[] ..) are the profile in use, tuningSelect() copies a
+// profile and its tables into them. Edits go there and writeParams() stores them back into tuning[tuningActive]
+typedef struct {
+    uint8_t P8[7], I8[7], D8[7];
+    uint8_t rcRate8, rcExpo8, rollPitchRate, yawRate, dynThrPID;
+    uint8_t tpaCurve[8];
+} tuning_t;
+
+static tuning_t tuning[TUNING_PROFILES];           // the EEPROM records, tuning[0] under the old ids
+static struct {
+    int16_t lookupRX[7];
+    uint8_t tpaLookup[9];
+    uint8_t rateSlope[3];
+} tuningTables[TUNING_PROFILES];                    // from paramApply()
+static uint8_t activateProfile[2];                  // rcOptions bits of profiles 2 and 3, like activate[]
+static uint8_t tuningActive = 0;
+#define TUNING_PARAM(v)     &tuning[0].v, sizeof(tuning[0].v)
+#else
+#define TUNING_PARAM(v)     &v, sizeof(v)
+#endif
+
 enum {
     GIMBAL_TILTONLY = 1
 };
@@ -151,9 +314,27 @@ enum {
 static uint8_t gimbalFlags = 0;                 // To be determined
 static int8_t gimbalGainPitch = 10;             // Amount of servo gain per angle of inclination for pitch (can be negative to invert movement)
 static int8_t gimbalGainRoll = 10;              // Amount of servo gain per angle of inclination for roll (can be negative to invert movement)
+static uint8_t gimbalLead = 0;                  // gyro rate feed-forward, n / 256 of gyroData is added to the angle
+#ifdef DIGITAL_SERVO
+#define SERVO_RATE_DEFAULT  200
+#else
+#define SERVO_RATE_DEFAULT  50
+#endif
+#if defined(PARAM_IN_PLACE)
+static const uint16_t servoRateDefault = SERVO_RATE_DEFAULT;
+#define servoRate               PARAM_VALUE(uint16_t, 24)
+#else
+static uint16_t servoRate = SERVO_RATE_DEFAULT; // Hz, all servo outputs
+#endif
+static uint8_t serialSpeed = 0;                 // GUI link rate to boot at, the last one confirmed after a 'K'
 
 /* prototypes */
 void serialCom(void);
+static uint8_t paramIndex(uint8_t id);
+static const void *paramData(uint8_t i);
+static uint8_t paramWrite(uint8_t i, const void *data);
+static void mixerSelect(void);
+static void serialSpeedBoot(void);
 void initOutput(void);
 void initSensors(void);
 void readEEPROM(void);
@@ -163,3008 +344,9363 @@ void initializeServo(void);
 void writeMotors(void);
 void computeRC(void);
 void writeServos(void);
+void configurationStart(void);
 void configurationLoop(void);
+uint8_t configurationActive(void);
+void configurationKey(uint8_t key);
+void lcdClear(void);
+#if defined(LCD_ETPP)
+void i2c_ETPP_init(void);
+void i2c_ETPP_print(uint8_t row, const char *s);
+#endif
 void writeParams(void);
+#if defined(TUNING_PROFILES)
+static void tuningSelect(uint8_t k);
+#endif
 void Mag_getADC(void);
 void Baro_update(void);
 void computeIMU(void);
-void mixTable(void);
+RAMFUNC void mixTable(void);
 void annexCode(void);
+void taskRun(void);
+#if defined(LOOP_ISR)
+static void loopTick(void);
+#endif
 uint8_t WMP_getRawADC(void);
-void getEstimatedAttitude(void);
+uint8_t WMP_poll(void);
+RAMFUNC void getEstimatedAttitude(void);
+static void attitudeAngles(void);
+static void attitudeHeading(void);
+#if defined(GYRO_BIAS_TRACKING) && !defined(IMU_QUATERNION)
+#define GYRO_BIAS 1
+void gyroBiasReset(void);
+#else
+#define GYRO_BIAS 0
+#endif
 void getEstimatedAltitude(void);
-void ACC_getADC(void);
-void Gyro_getADC(void);
 void GYRO_Common(void);
-void Device_Mag_getADC(void);
+void adcTrigger(void);
+void filterSetup(void);
+uint8_t Device_Mag_getADC(void);      // 1 when magADC[] was updated
+int16_t atan2_dd(int32_t y, int32_t x);
+int16_t sin_dd(int16_t a);
+static uint16_t isqrt32(uint32_t v);
 void ACC_Common(void);
-void Gyro_init(void);
+void accVibGate(uint8_t accepted);
 #if defined(BARO)
 void Baro_init(void);
 #endif
-void ACC_init(void);
 void Mag_init(void);
+#if defined(GYRO_DRDY)
+void Gyro_waitDataReady(void);
+#endif
+#if defined(MPU6000SPI)
+int16_t MPU6000_getTemperature(void);
+#endif
+
+// gyro and acc drivers, picked by initSensors() from the ones compiled in
+typedef struct {
+    uint8_t (*detect)(void);            // 1 when the chip answers with its id, NULL if it can't be probed
+    void (*init)(void);
+    void (*read)(void);                 // gyroADC[] / accADC[], through GYRO_Common() / ACC_Common()
+    uint8_t (*setConfig)(void);         // 1 when gyroDlpf/gyroRateDiv changed and were written to the sensor
+    void (*decode)(const uint8_t *raw); // read() without the bus: 6 bytes from i2cReg, NULL if it isn't that simple
+    uint8_t i2cAddress, i2cReg;
+} sensorDriver_t;
+static const sensorDriver_t *gyroDev = NULL;
+static const sensorDriver_t *accDev = NULL;
 
 /* local I2C Prototypes */
 void i2c_getSixRawADC(uint8_t add, uint8_t reg);
 void i2c_writeReg(uint8_t add, uint8_t reg, uint8_t val);
 uint8_t i2c_readReg(uint8_t add, uint8_t reg);
+uint8_t i2c_probeReg(uint8_t add, uint8_t reg, uint8_t mask, uint8_t id);
+void i2c_submitJob(i2cJob_t *job, uint8_t add, uint8_t reg, uint8_t *buf, uint8_t len, uint8_t read);
+uint8_t i2c_jobDone(i2cJob_t *job);
+uint8_t i2c_runChain(i2cJob_t *job, uint8_t n);
+#if I2C_BUS
+void i2c_postReg(uint8_t add, uint8_t reg, uint8_t val);
+#endif
+
+// LED and buzzer pattern played by ledTask(), annexCode() leaves the LED alone while it's on
+static uint8_t ledToggles = 0;
 
-void blinkLED(uint8_t num, uint8_t wait, uint8_t repeat)
+void ledBlink(uint8_t toggles)
 {
-    uint8_t i, r;
-    for (r = 0; r < repeat; r++) {
-        for (i = 0; i < num; i++) {
-            LEDPIN_TOGGLE;
-            BUZZERPIN_ON;
-            delay(wait);
-            BUZZERPIN_OFF;
-        }
-        delay(60);
+    ledToggles = toggles;
+}
+
+void ledTask(void)
+{
+    if (!ledToggles)
+        return;
+    LEDPIN_TOGGLE;
+    if (--ledToggles & 1) {
+        BUZZERPIN_ON;
+    } else {
+        BUZZERPIN_OFF;
     }
 }
 
 // **********************
 // GPS
 // **********************
-static int32_t GPS_latitude, GPS_longitude;
+static int32_t GPS_latitude, GPS_longitude;             // 1e-7 deg
 static int32_t GPS_latitude_home, GPS_longitude_home;
 static uint8_t GPS_fix, GPS_fix_home = 0;
 static uint8_t GPS_numSat;
-static uint16_t GPS_distanceToHome;
-static int16_t GPS_directionToHome = 0;
+static uint16_t GPS_distanceToHome;                     // m
+static int16_t GPS_directionToHome = 0;                 // deg, 0 north, clockwise
 static uint8_t GPS_update = 0;
 
-void annexCode(void)
+#if defined(GPS)
+// gpsTask() hands at most GPS_RX_BUDGET bytes per run to GPS_newFrame(), a byte at a time parser for NMEA GGA
+// and u-blox UBX NAV-POSLLH + NAV-SOL, whichever the receiver sends. UBX is cheaper: binary fields and a
+// checksum over bytes, where NMEA needs ASCII to fixed point conversion for every field
+#define GPS_RX_BUDGET       48          // bytes per run: 9.6kB/s at the 5ms period
+#define GPS_FIELD_MAX       12          // an NMEA field longer than this is cut, ddmm.mmmmm fits
+#define GPS_UBX_MAX         52          // payload bytes kept, NAV-SOL is the longest one parsed
+
+enum {
+    GPS_IDLE = 0,
+    GPS_NMEA,                           // sentence body, up to the '*'
+    GPS_NMEA_CK1,
+    GPS_NMEA_CK2,
+    GPS_UBX_SYNC2,
+    GPS_UBX_CLASS,
+    GPS_UBX_ID,
+    GPS_UBX_LEN1,
+    GPS_UBX_LEN2,
+    GPS_UBX_PAYLOAD,
+    GPS_UBX_CKA,
+    GPS_UBX_CKB
+};
+
+static struct {
+    uint8_t state;
+    uint8_t check, ckA, ckB;            // NMEA xor, UBX Fletcher
+    // NMEA: the field being read, the GGA values get committed on a good checksum
+    uint8_t field, pos, gga;
+    char text[GPS_FIELD_MAX + 1];
+    int32_t lat, lon;
+    uint8_t fix, numSat;
+    // UBX
+    uint8_t cls, id;
+    uint16_t len, n;
+    uint8_t payload[GPS_UBX_MAX];
+    uint8_t solFix, solNumSat;           // from the last NAV-SOL, used with the next NAV-POSLLH
+} gps;
+static uint16_t gpsErrors = 0;          // sentences / messages with a bad checksum
+static int16_t gpsLonScale = 16384;     // cos(home latitude), Q14
+
+static uint8_t gpsHex(char c)
+{
+    return c <= '9' ? c - '0' : (c & ~0x20) - 'A' + 10;
+}
+
+// NMEA [d]ddmm.mmmmm to 1e-7 deg: minutes x 1e5 times 1e7 / 60 / 1e5 = x 5 / 3
+static int32_t gpsCoord(const char *s)
+{
+    int32_t ipart = 0, frac = 0;
+    uint8_t digits = 0;
+
+    while (*s >= '0' && *s <= '9')
+        ipart = ipart * 10 + (*s++ - '0');
+    if (*s == '.')
+        s++;
+    for (; digits < 5; digits++) {
+        frac *= 10;
+        if (*s >= '0' && *s <= '9')
+            frac += *s++ - '0';
+    }
+    return (ipart / 100) * 10000000L + ((ipart % 100) * 100000L + frac) * 5 / 3;
+}
+
+static void gpsNmeaField(void)
 {
-    //this code is executed at each loop and won't interfere with control loop if it lasts less than 650 microseconds
-    static uint32_t serialTime;
-    static uint32_t buzzerTime, calibratedAccTime, telemetryTime, telemetryAutoTime, psensorTime;
-    static uint8_t buzzerFreq;  //delay between buzzer ring
-    uint8_t axis, prop1, prop2;
-    uint16_t pMeterRaw, powerValue;     //used for current reading
-    static uint8_t ind;
-    uint16_t vbatRaw = 0;
-    static uint16_t vbatRawArray[8];
     uint8_t i;
 
-    // PITCH & ROLL only dynamic PID adjustment,  depending on throttle value
-    if (rcData[THROTTLE] < 1500) {
-        prop2 = 100;
-    } else {
-        if (rcData[THROTTLE] < 2000) {
-            prop2 = 100 - (uint16_t) dynThrPID *(rcData[THROTTLE] - 1500) / 500;
-        } else {
-            prop2 = 100 - dynThrPID;
+    gps.text[gps.pos] = 0;
+    if (gps.field == 0) {
+        gps.gga = gps.pos == 5 && gps.text[2] == 'G' && gps.text[3] == 'G' && gps.text[4] == 'A';   // GPGGA, GNGGA
+    } else if (gps.gga) {
+        switch (gps.field) {
+        case 2:
+            gps.lat = gpsCoord(gps.text);
+            break;
+        case 3:
+            if (gps.text[0] == 'S')
+                gps.lat = -gps.lat;
+            break;
+        case 4:
+            gps.lon = gpsCoord(gps.text);
+            break;
+        case 5:
+            if (gps.text[0] == 'W')
+                gps.lon = -gps.lon;
+            break;
+        case 6:
+            gps.fix = gps.text[0] > '0';
+            break;
+        case 7:
+            gps.numSat = 0;
+            for (i = 0; i < gps.pos; i++)
+                gps.numSat = gps.numSat * 10 + gps.text[i] - '0';
+            break;
         }
     }
+    gps.field++;
+    gps.pos = 0;
+}
 
-    for (axis = 0; axis < 3; axis++) {
-        uint16_t tmp = min(abs(rcData[axis] - MIDRC), 500);
-#if DEADBAND
-        if (tmp > DEADBAND) {
-            tmp -= DEADBAND;
+static int32_t gpsLE32(const uint8_t *p)
+{
+    return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+// 1 when the message was a position
+static uint8_t gpsUbxMessage(void)
+{
+    if (gps.cls != 0x01)                // NAV
+        return 0;
+    if (gps.id == 0x06 && gps.len >= 48) {      // NAV-SOL: gpsFix, flags.gpsFixOK, numSV
+        gps.solFix = (gps.payload[10] == 2 || gps.payload[10] == 3) && (gps.payload[11] & 1);
+        gps.solNumSat = gps.payload[47];
+    } else if (gps.id == 0x02 && gps.len >= 28) {       // NAV-POSLLH: lon, lat
+        GPS_longitude = gpsLE32(&gps.payload[4]);
+        GPS_latitude = gpsLE32(&gps.payload[8]);
+        GPS_fix = gps.solFix;
+        GPS_numSat = gps.solNumSat;
+        return 1;
+    }
+    return 0;
+}
+
+// one byte from the receiver, 1 when it completed a position
+uint8_t GPS_newFrame(uint8_t c)
+{
+    switch (gps.state) {
+    case GPS_IDLE:
+        if (c == '$') {
+            gps.state = GPS_NMEA;
+            gps.check = 0;
+            gps.field = 0;
+            gps.pos = 0;
+            gps.gga = 0;
+        } else if (c == 0xB5)
+            gps.state = GPS_UBX_SYNC2;
+        break;
+    case GPS_NMEA:
+        if (c == '*') {
+            gpsNmeaField();
+            gps.state = GPS_NMEA_CK1;
+        } else if (c == '$' || c == '\r' || c == '\n') {
+            gps.state = GPS_IDLE;       // cut short
         } else {
-            tmp = 0;
+            gps.check ^= c;
+            if (c == ',')
+                gpsNmeaField();
+            else if (gps.pos < GPS_FIELD_MAX)
+                gps.text[gps.pos++] = c;
         }
-#endif
-        if (axis != 2) {        // ROLL & PITCH
-            uint16_t tmp2 = tmp / 100;
-            rcCommand[axis] = lookupRX[tmp2] + (tmp - tmp2 * 100) * (lookupRX[tmp2 + 1] - lookupRX[tmp2]) / 100;
-            prop1 = 100 - (uint16_t) rollPitchRate *tmp / 500;
-            prop1 = (uint16_t) prop1 *prop2 / 100;
-        } else {                // YAW
-            rcCommand[axis] = tmp;
-            prop1 = 100 - (uint16_t) yawRate *tmp / 500;
+        break;
+    case GPS_NMEA_CK1:
+        gps.ckA = gpsHex(c) << 4;
+        gps.state = GPS_NMEA_CK2;
+        break;
+    case GPS_NMEA_CK2:
+        gps.state = GPS_IDLE;
+        if ((gps.ckA | gpsHex(c)) != gps.check) {
+            gpsErrors++;
+            break;
         }
-        dynP8[axis] = (uint16_t) P8[axis] * prop1 / 100;
-        dynD8[axis] = (uint16_t) D8[axis] * prop1 / 100;
-        if (rcData[axis] < MIDRC)
-            rcCommand[axis] = -rcCommand[axis];
+        if (!gps.gga || gps.field < 8)
+            break;
+        GPS_fix = gps.fix;
+        GPS_numSat = gps.numSat;
+        if (gps.fix) {
+            GPS_latitude = gps.lat;
+            GPS_longitude = gps.lon;
+        }
+        return 1;
+    case GPS_UBX_SYNC2:
+        gps.state = c == 0x62 ? GPS_UBX_CLASS : GPS_IDLE;
+        break;
+    case GPS_UBX_CLASS:
+        gps.cls = c;
+        gps.ckA = gps.ckB = c;
+        gps.state = GPS_UBX_ID;
+        break;
+    case GPS_UBX_ID:
+        gps.id = c;
+        gps.ckB += gps.ckA += c;
+        gps.state = GPS_UBX_LEN1;
+        break;
+    case GPS_UBX_LEN1:
+        gps.len = c;
+        gps.ckB += gps.ckA += c;
+        gps.state = GPS_UBX_LEN2;
+        break;
+    case GPS_UBX_LEN2:
+        gps.len |= (uint16_t)c << 8;
+        gps.ckB += gps.ckA += c;
+        gps.n = 0;
+        gps.state = gps.len > 512 ? GPS_IDLE : gps.len ? GPS_UBX_PAYLOAD : GPS_UBX_CKA;        // longer: not a message
+        break;
+    case GPS_UBX_PAYLOAD:
+        if (gps.n < GPS_UBX_MAX)
+            gps.payload[gps.n] = c;
+        gps.ckB += gps.ckA += c;
+        if (++gps.n == gps.len)
+            gps.state = GPS_UBX_CKA;
+        break;
+    case GPS_UBX_CKA:
+        gps.state = c == gps.ckA ? GPS_UBX_CKB : GPS_IDLE;
+        if (c != gps.ckA)
+            gpsErrors++;
+        break;
+    case GPS_UBX_CKB:
+        gps.state = GPS_IDLE;
+        if (c != gps.ckB) {
+            gpsErrors++;
+            break;
+        }
+        return gpsUbxMessage();
     }
+    return 0;
+}
+
+// cos() of a latitude in 1e-7 deg, Q14. Taylor to x^6, within 0.1% up to 90 deg
+static int16_t gpsCosQ14(int32_t lat)
+{
+    int32_t x, x2, c;
+
+    if (lat < 0)
+        lat = -lat;
+    x = lat / 1000 * 286 / 10000;       // rad, Q14
+    x2 = (x * x) >> 14;
+    c = 16384 - ((x2 * (16384 - ((x2 * (16384 - x2 / 30)) >> 14) / 12)) >> 15);
+    return c < 0 ? 0 : c;
+}
+
+// Flat earth distance and direction from (lat1, lon1) to (lat2, lon2), all integer. The error is well
+// below the GPS noise within the 40km it covers, further away the distance saturates
+void GPS_distance(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2, uint16_t *dist, int16_t *bearing)
+{
+    int32_t dN, dE;
+
+    dN = constrain(lat2 - lat1, -3600000L, 3600000L);          // 1e-7 deg, ~1.1cm
+    dE = constrain(lon2 - lon1, -3600000L, 3600000L);
+    dE = ((dE / 64) * gpsLonScale) >> 8;
+    dN = ((dN / 8) * 1459) >> 14;                               // m, 1e-7 deg = 1459 / 2^17 m
+    dE = ((dE / 8) * 1459) >> 14;
+    *dist = isqrt32((uint32_t)(dN * dN) + (uint32_t)(dE * dE));
+    *bearing = atan2_dd(dE, dN) / 10;
+}
 
-    rcCommand[THROTTLE] = MINTHROTTLE + (int32_t) (MAXTHROTTLE - MINTHROTTLE) * (rcData[THROTTLE] - MINCHECK) / (2000 - MINCHECK);
+void gpsTask(void)
+{
+    uint8_t n;
 
-#if (POWERMETER == 2)
-    if (micros() > psensorTime + 19977 /*20000 */ ) {   // 50Hz, but avoid bulking of timed tasks
-        pMeterRaw = analogRead(PSENSORPIN);
-        powerValue = (PSENSORNULL > pMeterRaw ? PSENSORNULL - pMeterRaw : pMeterRaw - PSENSORNULL);     // do not use abs(), it would induce implicit cast to uint and overrun
-#ifdef LOG_VALUES
-        if (powerValue < 333) { // only accept reasonable values. 333 is empirical
-            if (powerValue > powerMax)
-                powerMax = powerValue;
-            powerAvg = powerValue;
+    for (n = 0; n < GPS_RX_BUDGET && gpsSerial_available(); n++) {
+        if (!GPS_newFrame(gpsSerial_read()))
+            continue;
+        if (GPS_update == 1)
+            GPS_update = 0;
+        else
+            GPS_update = 1;
+        if (GPS_fix == 1) {
+            if (GPS_fix_home == 0) {
+                GPS_fix_home = 1;
+                GPS_latitude_home = GPS_latitude;
+                GPS_longitude_home = GPS_longitude;
+                gpsLonScale = gpsCosQ14(GPS_latitude);
+            }
+            GPS_distance(GPS_latitude, GPS_longitude, GPS_latitude_home, GPS_longitude_home, &GPS_distanceToHome, &GPS_directionToHome);
         }
-#endif
-        pMeter[PMOTOR_SUM] += (uint32_t) powerValue;
-        psensorTime = micros();
     }
+}
 #endif
 
-#if defined(VBAT)
-#ifdef STM8
-    vbatRawArray[(ind++) % 8] = sensorInputs[3];        // VBAT_ADC
-#else
-    vbatRawArray[(ind++) % 8] = analogRead(V_BATPIN);
+// **********************
+// loop profiler
+// **********************
+#if defined(LOOP_PROFILER) || defined(HOSTSIM)
+enum {
+    PROFILE_computeIMU = 0,
+    PROFILE_annexCode,
+    PROFILE_getEstimatedAttitude,
+    PROFILE_getEstimatedAltitude,
+    PROFILE_PID,
+    PROFILE_mixTable,
+    PROFILE_writeMotors,
+    PROFILE_serialCom,
+    PROFILE_Baro_update,
+    PROFILE_sensorChain,
+    PROFILE_COUNT
+};
 #endif
-    for (i = 0; i < 8; i++)
-        vbatRaw += vbatRawArray[i];
-    vbat = (vbatRaw / (VBATSCALE / 4));   // result is Vbatt in 0.1V steps
-    if (vbat > 2)
-        vbat -= 2;
 
-    if ((vbat > VBATLEVEL1_3S)
-#if defined(POWERMETER)
-        && ((pMeter[PMOTOR_SUM] < pAlarm) || (pAlarm == 0))
-#endif
-        || (NO_VBAT > vbat))    // ToLuSe
-    {                           //VBAT ok AND powermeter ok, buzzer off
-        buzzerFreq = 0;
-        buzzerState = 0;
-        BUZZERPIN_OFF;
-#if defined(POWERMETER)
-    } else if (pMeter[PMOTOR_SUM] > pAlarm) {   // sound alarm for powermeter
-        buzzerFreq = 4;
-#endif
-    } else if (vbat > VBATLEVEL2_3S)
-        buzzerFreq = 1;
-    else if (vbat > VBATLEVEL3_3S)
-        buzzerFreq = 2;
-    else
-        buzzerFreq = 4;
-    if (buzzerFreq) {
-        if (buzzerState && (currentTime > buzzerTime + 250000)) {
-            buzzerState = 0;
-            BUZZERPIN_OFF;
-            buzzerTime = currentTime;
-        } else if (!buzzerState && (currentTime > (buzzerTime + (2000000 >> buzzerFreq)))) {
-            buzzerState = 1;
-            BUZZERPIN_ON;
-            buzzerTime = currentTime;
-        }
-    }
-#endif
+#if defined(HOSTSIM)
+// the host simulator times the same stages in ns with the host clock and prints them on exit
+#define PROFILE_BEGIN(s)    sim_profileBegin(PROFILE_##s)
+#define PROFILE_END(s)      sim_profileEnd(PROFILE_##s, #s)
+#elif defined(LOOP_PROFILER)
+#define PROFILE_BUCKETS 6               // <128, <256, <512, <1024, <2048, >=2048 us
 
-    if ((calibratingA > 0 && (ACC || nunchuk)) || (calibratingG > 0)) { // Calibration phasis
-        LEDPIN_TOGGLE;
-    } else {
-        if (calibratedACC == 1) {
-            LEDPIN_OFF;
-        }
-        if (armed) {
-            LEDPIN_ON;
-        }
+static struct {
+    uint16_t min, max;
+    uint32_t sum;
+    uint16_t count;
+    uint8_t hist[PROFILE_BUCKETS];
+    uint32_t cycleSum;          // full resolution, for 'p'
+    uint16_t cycleCount;
+} profile[PROFILE_COUNT];
+static uint32_t profileStart[PROFILE_COUNT];
+
+// cycles() is the DWT counter on the STM32: a read is one load, and every sample rounds to the nearest us
+#define PROFILE_BEGIN(s)    profileStart[PROFILE_##s] = cycles()
+#define PROFILE_END(s)      profileAdd(PROFILE_##s)
+
+void profileAdd(uint8_t stage)
+{
+    uint32_t c = cycles() - profileStart[stage];
+    uint32_t t = (c + CYCLES_PER_US / 2) / CYCLES_PER_US;
+    uint16_t us = t > 0xFFFF ? 0xFFFF : t;
+    uint8_t b = 0, i;
+
+    if (profile[stage].count == 0 || us < profile[stage].min)
+        profile[stage].min = us;
+    if (us > profile[stage].max)
+        profile[stage].max = us;
+    if (profile[stage].count < 0xFFFF) {
+        profile[stage].sum += us;
+        profile[stage].count++;
     }
-
-    if (currentTime > calibratedAccTime) {
-        if (smallAngle25 == 0) {
-            calibratedACC = 0;  //the multi uses ACC and is not calibrated or is too much inclinated
-            LEDPIN_TOGGLE;
-            calibratedAccTime = currentTime + 500000;
-        } else {
-            calibratedACC = 1;
-        }
+    if (profile[stage].cycleCount < 0xFFFF && c <= ~profile[stage].cycleSum) {
+        profile[stage].cycleSum += c;
+        profile[stage].cycleCount++;
     }
+    for (t = us >> 7; t && b < PROFILE_BUCKETS - 1; t >>= 1)
+        b++;
+    // histogram decays instead of saturating, so it shows the recent shape of the distribution
+    if (++profile[stage].hist[b] == 255)
+        for (i = 0; i < PROFILE_BUCKETS; i++)
+            profile[stage].hist[i] >>= 1;
+}
 
-    if (currentTime > serialTime) {     // 50Hz
-        serialCom();
-        serialTime = currentTime + 20000;
+// 'P' reply: stage count, then min, max, mean (us) and the histogram per stage. min/max/mean restart afterwards.
+void profileSerialize(void)
+{
+    uint8_t s, i;
+
+    serialize8('P');
+    serialize8(PROFILE_COUNT);
+    for (s = 0; s < PROFILE_COUNT; s++) {
+        serialize16(profile[s].min);
+        serialize16(profile[s].max);
+        serialize16(profile[s].count ? profile[s].sum / profile[s].count : 0);
+        for (i = 0; i < PROFILE_BUCKETS; i++)
+            serialize8(profile[s].hist[i]);
+        profile[s].max = 0;
+        profile[s].sum = 0;
+        profile[s].count = 0;
     }
-#ifdef LCD_TELEMETRY_AUTO
-    if ((telemetry_auto) && (micros() > telemetryAutoTime + LCD_TELEMETRY_AUTO)) {      // every 2 seconds
-        telemetry++;
-        if (telemetry == 'E')
-            telemetry = 'Z';
-        else if ((telemetry < 'A') || (telemetry > 'D'))
-            telemetry = 'A';
+    serialize8('P');
+}
 
-        telemetryAutoTime = micros();   // why use micros() and not the variable currentTime ?
-    }
+// 'p' reply: 1 if the RAMFUNC stages ran from SRAM, stage count, then the mean in cycles (32 bit) per stage,
+// restarted afterwards. One build of each placement gives the before and after
+void profileCyclesSerialize(void)
+{
+    uint8_t s;
+    uint32_t mean;
+
+    serialize8('p');
+#if defined(STM32F1) && defined(RAM_FUNCTIONS)
+    serialize8(1);
+#else
+    serialize8(0);
 #endif
-#ifdef LCD_TELEMETRY
-    if (micros() > telemetryTime + LCD_TELEMETRY) {     // 10Hz
-        if (telemetry)
-            lcd_telemetry();
-        telemetryTime = micros();
+    serialize8(PROFILE_COUNT);
+    for (s = 0; s < PROFILE_COUNT; s++) {
+        mean = profile[s].cycleCount ? profile[s].cycleSum / profile[s].cycleCount : 0;
+        serialize16(mean);
+        serialize16(mean >> 16);
+        profile[s].cycleSum = 0;
+        profile[s].cycleCount = 0;
     }
-#endif
+    serialize8('p');
 }
+#else
+#define PROFILE_BEGIN(s)
+#define PROFILE_END(s)
+#endif
 
-void setup()
+#if defined(LATENCY_BENCH)
+// **********************
+// latency benchmark
+// **********************
+// micros() stamps along the loop, taken from the RC frame sync (rcFrameTime, in the receiver interrupt) and from
+// the gyro sample (its data ready stamp, else the end of the last read) through to the motor outputs written.
+// The stick paths only count loops that picked up a new frame. PROBE_LATENCY goes high with the frame sync and
+// low once that frame's motor outputs are written, so its width is the stick to motor latency on a scope.
+enum {
+    LAT_STICK_RC = 0,           // frame sync -> computeRC() done
+    LAT_STICK_ANNEX,            //            -> annexCode() done, rcCommand[] shaped
+    LAT_STICK_PID,              //            -> PID done
+    LAT_STICK_MOTOR,            //            -> motors written
+    LAT_GYRO_PID,               // gyro sample -> PID done
+    LAT_GYRO_MOTOR,             //             -> motors written
+    LAT_MIX_MOTOR,              // mixTable() start -> motors written, servos included
+    LAT_COUNT
+};
+#define LAT_BUCKETS 8                   // <64, <128 .. <4096, >=4096 us
+
+static struct {
+    uint16_t min, max;
+    uint32_t sum;
+    uint16_t count;
+    uint8_t hist[LAT_BUCKETS];
+} latency[LAT_COUNT];
+static uint32_t latAnnexTime;           // annexCode() done in this loop
+
+static void latencyAdd(uint8_t path, uint32_t t)
 {
-    LEDPIN_PINMODE;
-    BUZZERPIN_PINMODE;
-    STABLEPIN_PINMODE;
-    POWERPIN_OFF;
-    Serial_begin(SERIAL_COM_SPEED);
-    readEEPROM();
-    initOutput();
-    checkFirstTime();
-    configureReceiver();
-    initSensors();
-    previousTime = micros();
-#if defined(GIMBAL)
-    calibratingA = 400;
-#endif
-    calibratingG = 400;
-#if defined(POWERMETER)
-    for (uint8_t i = 0; i <= PMOTOR_SUM; i++)
-        pMeter[i] = 0;
-#endif
-#if defined(GPS)
-    GPS_SERIAL.begin(GPS_BAUD);
-#endif
-#if defined(LCD_ETPP)
-    i2c_ETPP_init();
-    i2c_ETPP_set_cursor(0, 0);
-    LCDprintChar("MultiWii");
-    i2c_ETPP_set_cursor(0, 1);
-    LCDprintChar("Ready to Fly!");
-#endif
+    uint16_t us = t > 0xFFFF ? 0xFFFF : t;
+    uint8_t b = 0, i;
+
+    if (latency[path].count == 0 || us < latency[path].min)
+        latency[path].min = us;
+    if (us > latency[path].max)
+        latency[path].max = us;
+    if (latency[path].count < 0xFFFF) {
+        latency[path].sum += us;
+        latency[path].count++;
+    }
+    for (t = us >> 6; t && b < LAT_BUCKETS - 1; t >>= 1)
+        b++;
+    if (++latency[path].hist[b] == 255)         // decays like the profiler's
+        for (i = 0; i < LAT_BUCKETS; i++)
+            latency[path].hist[i] >>= 1;
 }
 
-// ******** Main Loop *********
-void loop(void)
+// 'N' reply: path count, then min, max, mean (us), sample count and the histogram per path. All but the
+// histogram restart afterwards. Then the interrupt source count and the worst case entry latency (us) of each,
+// see irq_latencyMax().
+void latencySerialize(void)
 {
-    static uint8_t rcDelayCommand;      // this indicates the number of time (multiple of RC measurement at 50Hz) the sticks must be maintained to run or switch off motors
-    uint8_t axis, i;
-    int16_t error, errorAngle;
-    int16_t delta, deltaSum;
-    int16_t PTerm, ITerm, DTerm;
-    static int16_t lastGyro[3] = { 0, 0, 0 };
-    static int16_t delta1[3], delta2[3];
-    static int16_t errorGyroI[3] = { 0, 0, 0 };
-    static int16_t errorAngleI[2] = { 0, 0 };
-
-    static uint32_t rcTime = 0;
-    static int16_t initialThrottleHold;
-    static int16_t errorAltitudeI = 0;
-    int16_t AltPID = 0;
-    static int16_t lastVelError = 0;
-    static int32_t AltHold;
-    
-#ifdef SPEKTRUM
-    if (rcFrameComplete)
-        computeRC();
+    uint8_t s, i;
+
+    serialize8('N');
+    serialize8(LAT_COUNT);
+    for (s = 0; s < LAT_COUNT; s++) {
+        serialize16(latency[s].min);
+        serialize16(latency[s].max);
+        serialize16(latency[s].count ? latency[s].sum / latency[s].count : 0);
+        serialize16(latency[s].count);
+        for (i = 0; i < LAT_BUCKETS; i++)
+            serialize8(latency[s].hist[i]);
+        latency[s].max = 0;
+        latency[s].sum = 0;
+        latency[s].count = 0;
+    }
+    serialize8(IRQ_LAT_COUNT);
+    for (s = 0; s < IRQ_LAT_COUNT; s++)
+        serialize16(irq_latencyMax(s));
+    serialize8('N');
+}
 #endif
 
-    if (currentTime > rcTime) { // 50Hz
-        rcTime = currentTime + 20000;
-#if !(defined(SPEKTRUM) || defined(BTSERIAL))
-        computeRC();
+// **********************
+// slow task scheduler
+// **********************
+// Everything that isn't on the gyro->PID->motor path runs from here, out of annexCode() in the gap
+// between the two gyro reads. Each task has a fixed period and a phase offset so that two slow tasks
+// don't land on the same loop. Due tasks run in priority order (lower first) until their worst case
+// budgets add up to TASK_LOOP_BUDGET, whatever is left is picked up on the next loop.
+// With LOOP_ISR they are the background loop() instead: the inner loop interrupt preempts them, so due tasks
+// run in priority order for as long as they take and the budgets only matter to each other.
+#define TASK_LOOP_BUDGET    650         // us, the interleaving delay annexCode() has to fit in
+
+enum {
+    TASK_RC = 0,
+    TASK_OUTER,
+#if BARO
+    TASK_BARO,
 #endif
-        // Failsafe routine - added by MIS
-#if defined(FAILSAFE)
-        if (failsafeCnt > (5 * FAILSAVE_DELAY) && armed == 1) { // Stabilize, and set Throttle to specified level
-            for (i = 0; i < 3; i++)
-                rcData[i] = MIDRC;      // after specified guard time after RC signal is lost (in 0.1sec)
-            rcData[THROTTLE] = FAILSAVE_THR0TTLE;
-            if (failsafeCnt > 5 * (FAILSAVE_DELAY + FAILSAVE_OFF_DELAY)) {      // Turn OFF motors after specified Time (in 0.1sec)
-                armed = 0;      //This will prevent the copter to automatically rearm if failsafe shuts it down and prevents
-                okToArm = 0;    //to restart accidentely by just reconnect to the tx - you will have to switch off first to rearm
-            }
-            failsafeEvents++;
-        }
-        failsafeCnt++;
+#if MAG
+    TASK_MAG,
 #endif
-        // end of failsave routine - next change is made with RcOptions setting
-        if (rcData[THROTTLE] < MINCHECK) {
-            errorGyroI[ROLL] = 0;
-            errorGyroI[PITCH] = 0;
-            errorGyroI[YAW] = 0;
-            errorAngleI[ROLL] = 0;
-            errorAngleI[PITCH] = 0;
-            rcDelayCommand++;
-            if (rcData[YAW] < MINCHECK && rcData[PITCH] < MINCHECK && armed == 0) {
-                if (rcDelayCommand == 20)
-                    calibratingG = 400;
-            } else if (rcData[YAW] > MAXCHECK && rcData[PITCH] > MAXCHECK && armed == 0) {
-                if (rcDelayCommand == 20) {
-                    servo[0] = 1500;    //we center the yaw gyro in conf mode
-                    writeServos();
-#ifdef LCD_CONF
-                    configurationLoop();        //beginning LCD configuration
+    TASK_SERIAL,
+#if defined(VBAT)
+    TASK_BATTERY,
 #endif
-                    previousTime = micros();
-                }
-            } else if (activate[BOXARM] > 0) {
-                if ((rcOptions & activate[BOXARM]) && okToArm)
-                    armed = 1;
-                else if (armed)
-                    armed = 0;
-                rcDelayCommand = 0;
-            } else if ((rcData[YAW] < MINCHECK || rcData[ROLL] < MINCHECK) && armed == 1) {
-                if (rcDelayCommand == 20)
-                    armed = 0;  // rcDelayCommand = 20 => 20x20ms = 0.4s = time to wait for a specific RC command to be acknowledged
-            } else if ((rcData[YAW] > MAXCHECK || rcData[ROLL] > MAXCHECK) && rcData[PITCH] < MAXCHECK && armed == 0 && calibratingG == 0 && calibratedACC == 1) {
-                if (rcDelayCommand == 20)
-                    armed = 1;
-#ifdef LCD_TELEMETRY_AUTO
-            } else if (rcData[ROLL] < MINCHECK && rcData[PITCH] > MAXCHECK && armed == 0) {
-                if (rcDelayCommand == 20) {
-                    if (telemetry_auto) {
-                        telemetry_auto = 0;
-                        telemetry = 0;
-                    } else
-                        telemetry_auto = 1;
-                }
+#if defined(LCD_TELEMETRY) || defined(LCD_TELEMETRY_AUTO)
+    TASK_TELEMETRY,
 #endif
-            } else
-                rcDelayCommand = 0;
-        } else if (rcData[THROTTLE] > MAXCHECK && armed == 0) {
-            if (rcData[YAW] < MINCHECK && rcData[PITCH] < MINCHECK) {
-                if (rcDelayCommand == 20)
-                    calibratingA = 400;
-                rcDelayCommand++;
-            } else if (rcData[PITCH] > MAXCHECK) {
-                accTrim[PITCH]++;
-                writeParams();
-                accTrim[PITCH] += 2;
-                writeParams();
-            } else if (rcData[PITCH] < MINCHECK) {
-                accTrim[PITCH]--;
-                writeParams();
-                accTrim[PITCH] -= 2;
-                writeParams();
-            } else if (rcData[ROLL] > MAXCHECK) {
-                accTrim[ROLL]++;
-                writeParams();
-                accTrim[ROLL] += 2;
-                writeParams();
-            } else if (rcData[ROLL] < MINCHECK) {
-                accTrim[ROLL]--;
-                writeParams();
-                accTrim[ROLL] -= 2;
-                writeParams();
-            } else {
-                rcDelayCommand = 0;
-            }
-        }
-#ifdef LOG_VALUES
-        else if (armed) {       // update min and max values here, so do not get cycle time of the motor arming (which is way higher than normal)
-            if (cycleTime > cycleTimeMax)
-                cycleTimeMax = cycleTime;       // remember highscore
-            if (cycleTime < cycleTimeMin)
-                cycleTimeMin = cycleTime;       // remember lowscore
-        }
+#if defined(SERIAL_STREAM)
+    TASK_STREAM,
 #endif
+#if defined(WATCH)
+    TASK_WATCH,
+#endif
+#if defined(BLACKBOX)
+    TASK_BLACKBOX,
+#endif
+#if defined(DYN_NOTCH)
+    TASK_NOTCH,
+#endif
+#if defined(LCD_CONF)
+    TASK_LCDCONF,
+#endif
+#if defined(GPS)
+    TASK_GPS,
+#endif
+#if defined(SERIAL_BENCH)
+    TASK_BENCH,
+#endif
+    TASK_PARAM,
+    TASK_CRC,
+    TASK_LED,
+    TASK_COUNT
+};
 
-        rcOptions = (rcData[AUX1] < 1300) + (1300 < rcData[AUX1] && rcData[AUX1] < 1700) * 2 + (rcData[AUX1] > 1700) * 4 + (rcData[AUX2] < 1300) * 8 + (1300 < rcData[AUX2] && rcData[AUX2] < 1700) * 16 + (rcData[AUX2] > 1700) * 32;
-
-        //note: if FAILSAFE is disable, failsafeCnt > 5 * FAILSAVE_DELAY is always false
-        if (((rcOptions & activate[BOXACC]) || (failsafeCnt > 5 * FAILSAVE_DELAY)) && (ACC || nunchuk)) {
-            // bumpless transfer to Level mode
-            if (!accMode) {
-                errorAngleI[ROLL] = 0;
-                errorAngleI[PITCH] = 0;
-                accMode = 1;
-            }
-        } else
-            accMode = 0;        // modified by MIS for failsave support
-
-        if ((rcOptions & activate[BOXARM]) == 0)
-            okToArm = 1;
-        if (accMode == 1) {
-            STABLEPIN_ON;
-        } else {
-            STABLEPIN_OFF;
-        }
-
+typedef struct {
+    void (*run)(void);
+    uint32_t period;                    // us
+    uint32_t phase;                     // us, first run after startup
+    uint8_t priority;
+    uint16_t budget;                    // us, worst case
+} taskDef_t;
+
+void rcTask(void);
+void outerTask(void);
+void batteryTask(void);
+void telemetryTask(void);
+void streamTask(void);
+void watchSample(void);
+void watchTask(void);
+void sensorNodeSend(void);
+void blackboxLog(void);
+void blackboxOverrun(uint8_t task, uint16_t us);
+void blackboxCamera(uint16_t shot, uint32_t edge);
+static void cameraTrigger(void);
+void blackboxTask(void);
+void blackboxInit(void);
+void sysidInject(void);
+void notchTask(void);
+void paramTask(void);
+void crcTask(void);
+void ledTask(void);
+void gpsTask(void);
+void benchTask(void);
+
+static const taskDef_t taskTable[TASK_COUNT] = {
+    { rcTask,               20000,   0,     0, 200 },
+    { outerTask,            5000,    1250,  0, 150 },      // 200Hz angle/heading/altitude loop
 #if BARO
-        if (rcOptions & activate[BOXBARO]) {
-            if (baroMode == 0) {
-                baroMode = 1;
-                AltHold = EstAlt;
-                initialThrottleHold = rcCommand[THROTTLE];
-                errorAltitudeI = 0;
-                lastVelError = 0;
-                EstVelocity = 0;
-            }
-        } else
-            baroMode = 0;
+    { Baro_update,          5000,    2500,  2, 150 },
 #endif
 #if MAG
-        if (rcOptions & activate[BOXMAG]) {
-            if (magMode == 0) {
-                magMode = 1;
-                magHold = heading;
-            }
-        } else
-            magMode = 0;
+    { Mag_getADC,           20000,   7500,  2, 100 },      // 50Hz, the HMC58x3 output rate is set to 75/50Hz
 #endif
-    }
-#if GPS
-    if (rcOptions & activate[BOXGPSHOME])
-        GPSModeHome = 1;
-    else
-        GPSModeHome = 0;
-    if (rcOptions & activate[BOXGPSHOLD])
-        GPSModeHold = 1;
-    else
-        GPSModeHold = 0;
+#if defined(HIL_INJECT)
+    { serialCom,            5000,    2500,  1, 400 },       // the bench harness frames come at up to 200Hz
+#else
+    { serialCom,            20000,   10000, 1, 400 },
 #endif
-
-#if MAG
-    Mag_getADC();
+#if defined(VBAT)
+    { batteryTask,          100000,  15000, 4, 150 },      // analogRead() of the current sensor included
 #endif
-#if BARO
-    Baro_update();
+#if defined(LCD_TELEMETRY) || defined(LCD_TELEMETRY_AUTO)
+    { telemetryTask,        20000,   15000, 5, LCD_TASK_BUDGET + 100 },    // pages are drawn at their own rate, see lcd_telemetry()
+#endif
+#if defined(SERIAL_STREAM)
+    { streamTask,           10000,   5000,  1, 250 },      // STREAM_PERIOD
+#endif
+#if defined(WATCH)
+    { watchTask,            10000,   7500,  1, 250 },      // a WATCH_FRAME per run
+#endif
+#if defined(BLACKBOX)
+    { blackboxTask,         2000,    500,   1, 200 },
+#endif
+#if defined(DYN_NOTCH)
+    { notchTask,            10000,   3000,  4, 400 },      // one axis per run, a 256 point FFT
+#endif
+#if defined(LCD_CONF)
+    { configurationLoop,    20000,   17500, 5, LCD_TASK_BUDGET },      // idle unless the LCD menu is open
+#endif
+#if defined(GPS)
+    { gpsTask,              5000,    3750,  3, 150 },      // GPS_RX_BUDGET bytes per run
 #endif
+#if defined(SERIAL_BENCH)
+    { benchTask,            1000,    500,   1, 150 },      // every loop, BENCH_PER_RUN frames
+#endif
+    { paramTask,            100000,  60000, 6, 50 },       // only writes anything while disarmed
+    { crcTask,              10000,   8750,  6, 650 },      // CRC_SLICE words a run where the CRC is software
+    { ledTask,              30000,   12500, 5, 20 },
+};
 
-    computeIMU();
-    // Measure loop rate just afer reading the sensors
-    currentTime = micros();
-    cycleTime = currentTime - previousTime;
-    previousTime = currentTime;
+static uint32_t taskNext[TASK_COUNT];
+static uint8_t taskInit = 0;
+
+// Loop deadline. A cycleTime past LOOP_OVERRUN is counted and blamed on the slowest task that ran in it
+// (TASK_NONE: none ran, the gyro->PID->motor path or an interrupt took the time). The last one also goes into
+// the stream's status group and the blackbox. LOOP_WATCHDOG resets the board on top if a loop never ends.
+#define LOOP_OVERRUN        5000        // us
+#define TASK_NONE           0xFF
+static uint16_t loopOverruns = 0;
+static uint8_t loopOverrunTask = TASK_NONE;
+static uint16_t loopOverrunTime = 0;    // us, its cycleTime
+static uint8_t loopSlowTask = TASK_NONE;        // of the tasks since the last check
+static uint16_t loopSlowUs = 0;
+
+#if defined(SWO_TRACE)
+// trace_event() ids on the SWO, the value that goes with each
+enum {
+    TRACE_LOOP = 1,             // cycleTime, us
+    TRACE_OVERRUN,              // loopOverrunTask << 16 | cycleTime
+    TRACE_TASK,                 // taskTable[] index << 16 | us it ran
+};
+#endif
 
-#if MAG
-    if (abs(rcCommand[YAW]) < 70 && magMode) {
-        int16_t dif = heading - magHold;
-        if (dif <= -180)
-            dif += 360;
-        if (dif >= +180)
-            dif -= 360;
-        if (smallAngle25)
-            rcCommand[YAW] -= dif * P8[PIDMAG] / 30;    // 18 deg
-    } else
-        magHold = heading;
+static void loopDeadline(void)
+{
+#if defined(SWO_TRACE)
+    trace_event(TRACE_LOOP, cycleTime);
+#endif
+    if (cycleTime > LOOP_OVERRUN) {
+        if (loopOverruns < 0xFFFF)
+            loopOverruns++;
+        loopOverrunTask = loopSlowTask;
+        loopOverrunTime = cycleTime;
+#if defined(BLACKBOX)
+        blackboxOverrun(loopOverrunTask, loopOverrunTime);
+#endif
+#if defined(SWO_TRACE)
+        trace_event(TRACE_OVERRUN, (uint32_t)loopOverrunTask << 16 | cycleTime);
+#endif
+    }
+    loopSlowTask = TASK_NONE;
+    loopSlowUs = 0;
+}
+
+void taskRun(void)
+{
+    uint8_t i, best;
+#if !defined(LOOP_ISR)
+    uint16_t spent = 0;
 #endif
+    uint32_t t;
 
-#if BARO
-    if (baroMode) {
-        if (abs(rcCommand[THROTTLE] - initialThrottleHold) > 20) {
-            baroMode = 0;
-            errorAltitudeI = 0;
+    if (!taskInit) {
+        for (i = 0; i < TASK_COUNT; i++)
+            taskNext[i] = currentTime + taskTable[i].phase;
+        taskInit = 1;
+    }
+
+    for (;;) {
+        best = TASK_COUNT;
+        for (i = 0; i < TASK_COUNT; i++) {
+            if ((int32_t)(currentTime - taskNext[i]) < 0)
+                continue;
+            if (best == TASK_COUNT || taskTable[i].priority < taskTable[best].priority)
+                best = i;
         }
-        //**** Alt. Set Point stabilization PID ****
-        error = constrain(AltHold - EstAlt, -1000, 1000);       //  +/-10m,  1 decimeter accuracy
-        errorAltitudeI += error;
-        errorAltitudeI = constrain(errorAltitudeI, -30000, 30000);
+        if (best == TASK_COUNT)
+            return;
+#if !defined(LOOP_ISR)
+        // The first task always gets to run, the rest only if they still fit
+        if (spent && spent + taskTable[best].budget > TASK_LOOP_BUDGET)
+            return;
+        spent += taskTable[best].budget;
+#endif
 
-        PTerm = P8[PIDALT] * error / 100;       // 16 bits is ok here
-        ITerm = (int32_t) I8[PIDALT] * errorAltitudeI / 40000;
+        taskNext[best] += taskTable[best].period;
+        if ((int32_t)(currentTime - taskNext[best]) >= 0)
+            taskNext[best] = currentTime + taskTable[best].period;     // fell a whole period behind, don't try to catch up
+        t = micros();
+        taskTable[best].run();
+        t = micros() - t;
+#if defined(SWO_TRACE)
+        trace_event(TRACE_TASK, (uint32_t)best << 16 | min(t, 0xFFFF));
+#endif
+#if !defined(LOOP_ISR)
+        // with LOOP_ISR a task can't make the inner loop late, its overruns stay TASK_NONE
+        if (t > loopSlowUs) {
+            loopSlowUs = t > 0xFFFF ? 0xFFFF : t;
+            loopSlowTask = best;
+        }
+#endif
+    }
+}
 
-        AltPID = PTerm + ITerm;
+// ************************************************************************************************************
+// RC shaping: expo/rate curve, yaw rate, TPA and the dynamic P/D that go with them
+// ************************************************************************************************************
+// Only depends on rcData[ROLL..THROTTLE] and the tuning, so it's worked out again when one of the sticks
+// moved (at most once per RC frame) or paramApply() ran, and every loop copies the result to rcCommand[].
+static int16_t rcShaped[4];
+static int16_t rcShapeIn[4];            // rcData[] rcShaped[] and dynP8/dynD8 were built from
+static uint8_t rcShapeStale = 1;        // tuning changed
+
+#if defined(RC_INTERPOLATION)
+// rcShaped[] ROLL..YAW moves to the new frame's value in a straight line over rcFramePeriod, from wherever the
+// last ramp got to. computeRC() measures the period off rcFrameTime, one division per frame for rcFrameInvQ24
+#define RC_PERIOD_MIN       2000        // us, frame intervals outside of these don't count
+#define RC_PERIOD_MAX       40000
+static uint16_t rcFramePeriod = 0;      // us, 0: not known, no ramp
+static uint32_t rcFrameInvQ24;          // 2^24 / rcFramePeriod
+static int16_t rcRampFrom[3], rcRampOut[3];
+static uint32_t rcRampStart;
+static uint8_t rcRampNew = 0;           // rcShape() ran since the last loop
+#endif
 
-        //**** Velocity stabilization PD ****        
-        error = constrain(EstVelocity * 2, -30000, 30000);
-        delta = error - lastVelError;
-        lastVelError = error;
+// The P/D factors are 128 for 1, so it's shifts and no divides: TPA is one interpolated step of
+// tpaLookup[], the stick part rateSlope[] times the deflection.
+static void rcShape(void)
+{
+    uint8_t axis, tpa, prop;
+    uint16_t t;
 
-        PTerm = (int32_t) error *P8[PIDVEL] / 800;
-        DTerm = (int32_t) delta *D8[PIDVEL] / 16;
+    // PITCH & ROLL only dynamic PID adjustment, depending on throttle value. t is 1000..2000 stretched
+    // to 0..1022, x 1.023 puts the breakpoints 125 of throttle apart onto every 128
+    t = constrain(rcData[THROTTLE], 1000, 2000) - 1000;
+    t += (t >> 6) + (t >> 7);
+    tpa = tpaLookup[t >> 7] + (((int16_t) tpaLookup[(t >> 7) + 1] - tpaLookup[t >> 7]) * (int16_t) (t & 127) >> 7);
 
-        rcCommand[THROTTLE] = initialThrottleHold + constrain(AltPID - (PTerm - DTerm), -100, +100);
-    }
-#endif
-    //**** PITCH & ROLL & YAW PID ****    
     for (axis = 0; axis < 3; axis++) {
-        if (accMode == 1 && axis < 2) { //LEVEL MODE
-            // 50 degrees max inclination
-            errorAngle = constrain(2 * rcCommand[axis], -500, +500) - angle[axis] + accTrim[axis];      // 16 bits is ok here
-#ifdef LEVEL_PDF
-            PTerm = -(int32_t) angle[axis] * P8[PIDLEVEL] / 100;
-#else
-            PTerm = (int32_t) errorAngle * P8[PIDLEVEL] / 100;   //32 bits is needed for calculation: errorAngle*P8[PIDLEVEL] could exceed 32768   16 bits is ok for result
+        uint16_t tmp = min(abs(rcData[axis] - MIDRC), 500);
+#if DEADBAND
+        if (tmp > DEADBAND) {
+            tmp -= DEADBAND;
+        } else {
+            tmp = 0;
+        }
 #endif
-
-            errorAngleI[axis] = constrain(errorAngleI[axis] + errorAngle, -10000, +10000);      //WindUp     //16 bits is ok here
-            ITerm = ((int32_t) errorAngleI[axis] * I8[PIDLEVEL]) >> 12; //32 bits is needed for calculation:10000*I8 could exceed 32768   16 bits is ok for result
-        } else {                //ACRO MODE or YAW axis
-            if (abs(rcCommand[axis]) < 350)
-                error = rcCommand[axis] * 10 * 8 / P8[axis];    // 16 bits is needed for calculation: 350*10*8 = 28000      16 bits is ok for result if P8>2 (P>0.2)
-            else
-                error = (int32_t) rcCommand[axis] * 10 * 8 / P8[axis];  //32 bits is needed for calculation: 500*5*10*8 = 200000   16 bits is ok for result if P8>2 (P>0.2)
-            error -= gyroData[axis];
-
-            PTerm = rcCommand[axis];
-            errorGyroI[axis] = constrain(errorGyroI[axis] + error, -16000, +16000);     //WindUp       //16 bits is ok here
-            if (abs(gyroData[axis]) > 640)
-                errorGyroI[axis] = 0;
-            ITerm = (errorGyroI[axis] / 125 * I8[axis]) >> 6;   //16 bits is ok here 16000/125 = 128 ; 128*250 = 32000
+        if (axis != 2) {        // ROLL & PITCH
+            uint16_t tmp2 = tmp / 100;
+            // signed: a 16 bit int would take the uint16_t in unsigned
+            rcShaped[axis] = lookupRX[tmp2] + (int16_t) (tmp - tmp2 * 100) * (lookupRX[tmp2 + 1] - lookupRX[tmp2]) / 100;
+            prop = 128 - (rateSlope[axis] * tmp >> 9);
+            prop = (uint16_t) prop *tpa >> 7;
+        } else {                // YAW
+            rcShaped[axis] = tmp;
+            prop = 128 - (rateSlope[axis] * tmp >> 9);
         }
+        dynP8[axis] = (uint16_t) P8[axis] * prop >> 7;
+        dynD8[axis] = (uint16_t) D8[axis] * prop >> 7;
+        if (rcData[axis] < MIDRC)
+            rcShaped[axis] = -rcShaped[axis];
+    }
 
-        if (abs(gyroData[axis]) < 160)
-            PTerm -= gyroData[axis] * dynP8[axis] / 10 / 8;     //16 bits is needed for calculation   160*200 = 32000         16 bits is ok for result
-        else
-            PTerm -= (int32_t) gyroData[axis] * dynP8[axis] / 10 / 8;   //32 bits is needed for calculation   
+    rcShaped[THROTTLE] = MINTHROTTLE + (int32_t) (MAXTHROTTLE - MINTHROTTLE) * (rcData[THROTTLE] - MINCHECK) / (2000 - MINCHECK);
 
-        delta = gyroData[axis] - lastGyro[axis];        //16 bits is ok here, the dif between 2 consecutive gyro reads is limited to 800
-        lastGyro[axis] = gyroData[axis];
-        deltaSum = delta1[axis] + delta2[axis] + delta;
-        delta2[axis] = delta1[axis];
-        delta1[axis] = delta;
+    for (axis = 0; axis < 4; axis++)
+        rcShapeIn[axis] = rcData[axis];
+    rcShapeStale = 0;
+#if defined(RC_INTERPOLATION)
+    rcRampNew = 1;
+#endif
+}
 
-        if (abs(deltaSum) < 640)
-            DTerm = (deltaSum * dynD8[axis]) >> 5;      //16 bits is needed for calculation 640*50 = 32000           16 bits is ok for result 
-        else
-            DTerm = ((int32_t) deltaSum * dynD8[axis]) >> 5;    //32 bits is needed for calculation
+#if defined(RC_INTERPOLATION)
+static void rcInterpolate(void)
+{
+    uint8_t axis;
+    uint32_t t;
+    int32_t frac;
 
-        axisPID[axis] = PTerm + ITerm - DTerm;
+    if (rcRampNew) {
+        rcRampNew = 0;
+        for (axis = 0; axis < 3; axis++)
+            rcRampFrom[axis] = rcRampOut[axis];
+        rcRampStart = currentTime - cycleTime;  // this loop is already one loop into the ramp
+    }
+    t = currentTime - rcRampStart;
+    for (axis = 0; axis < 3; axis++) {
+        if (rcFramePeriod && t < rcFramePeriod) {
+            frac = (t * rcFrameInvQ24) >> 8;    // Q16, t < 2^16 and the product < 2^24
+            rcCommand[axis] = rcRampFrom[axis] + ((int32_t)(rcShaped[axis] - rcRampFrom[axis]) * frac >> 16);
+        }
+        rcRampOut[axis] = rcCommand[axis];
     }
+}
+#endif
 
-    mixTable();
-    writeServos();
-    writeMotors();
+void annexCode(void)
+{
+    //this code is executed at each loop and won't interfere with control loop if it lasts less than 650 microseconds
+    static uint32_t calibratedAccTime;
+    uint8_t axis;
 
-    //GPS
-#if GPS
-    while (GPS_SERIAL.available()) {
-        if (GPS_newFrame(GPS_SERIAL.read())) {
-            if (GPS_update == 1)
-                GPS_update = 0;
-            else
-                GPS_update = 1;
-            if (GPS_fix == 1) {
-                if (GPS_fix_home == 0) {
-                    GPS_fix_home = 1;
-                    GPS_latitude_home = GPS_latitude;
-                    GPS_longitude_home = GPS_longitude;
-                }
-                GPS_distance(GPS_latitude_home, GPS_longitude_home, GPS_latitude, GPS_longitude, &GPS_distanceToHome, &GPS_directionToHome);
-            }
+    if (rcShapeStale || rcData[ROLL] != rcShapeIn[ROLL] || rcData[PITCH] != rcShapeIn[PITCH]
+        || rcData[YAW] != rcShapeIn[YAW] || rcData[THROTTLE] != rcShapeIn[THROTTLE])
+        rcShape();
+    // loop() adds the heading/altitude hold on top, so start from the pilot's command every time
+    for (axis = 0; axis < 4; axis++)
+        rcCommand[axis] = rcShaped[axis];
+#if defined(RC_INTERPOLATION)
+    rcInterpolate();
+#endif
+
+    if (ledToggles) {
+        // ledTask() is playing a pattern
+    } else if ((calibratingA > 0 && (ACC || nunchuk)) || (calibratingG > 0)) { // Calibration phasis
+        LEDPIN_TOGGLE;
+    } else {
+        if (bootReadyMs == 0)
+            bootReadyMs = millis();
+        if (calibratedACC == 1) {
+            LEDPIN_OFF;
+        }
+        if (armed) {
+            LEDPIN_ON;
+        }
+    }
+
+    if (currentTime > calibratedAccTime) {
+        if (smallAngle25 == 0) {
+            calibratedACC = 0;  //the multi uses ACC and is not calibrated or is too much inclinated
+            LEDPIN_TOGGLE;
+            calibratedAccTime = currentTime + 500000;
+        } else {
+            calibratedACC = 1;
         }
     }
+
+#if !defined(LOOP_ISR)
+    taskRun();
 #endif
 }
 
-/* EEPROM --------------------------------------------------------------------- */
-static uint8_t checkNewConf = 148;
-
-typedef struct eep_entry_t {
-    void *var;
-    uint8_t size;
-} eep_entry_t;
+#if defined(VBAT)
+// Battery monitor, a 10Hz task: the voltage goes through a running sum (a first order low pass, 8 times the
+// ADC value so the VBATSCALE formula is unchanged), the powermeter current is integrated over the
+// measured time since the last sample, and the buzzer alarm follows vbatAlarm / pAlarm.
+#define PSENSOR_PERIOD      20000       // us, PLEVELDIV is calibrated for one sample per 20ms
 
-// ************************************************************************************************************
-// EEPROM Layout definition
-// ************************************************************************************************************
-volatile eep_entry_t eep_entry[] = {
-    &checkNewConf, sizeof(checkNewConf),
-    &P8, sizeof(P8),
-    &I8, sizeof(I8),
-    &D8, sizeof(D8),
-    &rcRate8, sizeof(rcRate8),
-    &rcExpo8, sizeof(rcExpo8),
-    &rollPitchRate, sizeof(rollPitchRate),
-    &yawRate, sizeof(yawRate),
-    &dynThrPID, sizeof(dynThrPID),
-    &accZero, sizeof(accZero),
-    &magZero, sizeof(magZero),
-    &accTrim, sizeof(accTrim),
-    &activate, sizeof(activate),
-    &powerTrigger1, sizeof(powerTrigger1),
-    &mixerConfiguration, sizeof(mixerConfiguration),
-    &gimbalFlags, sizeof(gimbalFlags),
-    &gimbalGainPitch, sizeof(gimbalGainPitch),
-    &gimbalGainRoll, sizeof(gimbalGainRoll)
+#if defined(LOG_VALUES) || (POWERMETER == 1)
+/* true cubic function; when divided by vbat_max=126 (12.6V) for 3 cell battery this gives maximum value of ~ 1000 */
+static const uint32_t amperes[64] = { 0, 4, 13, 31, 60, 104, 165, 246, 350, 481, 640, 831, 1056, 1319, 1622, 1969, 2361, 2803, 3297, 3845, 4451, 5118, 5848, 6645,
+    7510, 8448, 9461, 10551, 11723, 12978, 14319, 15750, 17273, 18892, 20608, 22425, 24346, 26374, 28512, 30762, 33127, 35611,
+    38215, 40944, 43799, 46785, 49903, 53156, 56548, 60081, 63759, 67583, 71558, 75685, 79968, 84410, 89013, 93781, 98716, 103821,
+    109099, 114553, 120186, 126000
 };
-#define EEBLOCK_SIZE sizeof(eep_entry)/sizeof(eep_entry_t)
-// ************************************************************************************************************
 
-void readEEPROM(void)
+// Soft powermeter, sampled with the battery task: the mapped ESC input of every motor is weighted by the time
+// since the last sample and counted in PSENSOR_PERIOD samples like the hard sensor, so the readings no longer
+// depend on the cycle time. dt is taken in 16us steps to keep the products in 32 bits.
+static void logMotorsPower(void)
 {
+    static uint32_t powerTime;
+    static uint16_t powerRest[PMOTOR_SUM + 1];
+    uint32_t amp, ampSum = 0, charge, dt;
     uint8_t i;
-    uint8_t _address = eep_entry[0].size;
 
-    eeprom_open();
-    for (i = 1; i < EEBLOCK_SIZE; i++) {
-        eeprom_read_block(eep_entry[i].var, (void *) (_address), eep_entry[i].size);
-        _address += eep_entry[i].size;
+    dt = min(currentTime - powerTime, 250000) >> 4;
+    if (powerTime == 0)
+        dt = 0;
+    powerTime = currentTime;
+    if (!vbat)                  // by all means - must avoid division by zero
+        return;
+    for (i = 0; i < FRAME_MOTORS; i++) {
+        amp = amperes[(constrain(motor[i], 1000, 2000) - 1000) >> 4] / vbat;    // range mapped from [1000:2000] => [0:1000]; then break that up into 64 ranges; lookup amp
+        ampSum += amp;
+#ifdef LOG_VALUES
+        charge = amp * dt + powerRest[i];       // sum up over time the mapped ESC input
+        pMeter[i] += charge / (PSENSOR_PERIOD >> 4);
+        powerRest[i] = charge % (PSENSOR_PERIOD >> 4);
+#endif
     }
-    eeprom_close();
-
-#if defined(POWERMETER)
-    pAlarm = (uint32_t) powerTrigger1 *(uint32_t) PLEVELSCALE *(uint32_t) PLEVELDIV;    // need to cast before multiplying
+#if (POWERMETER == 1)
+    charge = ampSum * dt + powerRest[PMOTOR_SUM];       // total sum over all motors
+    pMeter[PMOTOR_SUM] += charge / (PSENSOR_PERIOD >> 4);
+    powerRest[PMOTOR_SUM] = charge % (PSENSOR_PERIOD >> 4);
+    powerDraw = ampSum;
 #endif
-    for (i = 0; i < 7; i++)
-        lookupRX[i] = (2500 + rcExpo8 * (i * i - 25)) * i * (int32_t) rcRate8 / 1250;
 }
+#endif
 
-void writeParams(void)
+void batteryTask(void)
 {
-    uint8_t i;
-    uint8_t _address = 0;
+    static uint32_t buzzerTime;
+    static uint8_t buzzerFreq;  //delay between buzzer ring
+    static uint16_t vbatSum;    // running sum, 8 * the vbat ADC value
+    uint16_t vbatRaw;
+#if (POWERMETER == 2)
+    static uint32_t psensorTime, psensorRest;
+    uint16_t pMeterRaw, powerValue;     //used for current reading
+#endif
 
-    eeprom_open();
-    for (i = 0; i < EEBLOCK_SIZE; i++) {
-        eeprom_write_block(eep_entry[i].var, (void *)(_address), eep_entry[i].size); 
-        _address += eep_entry[i].size;
+#ifdef STM8
+    vbatRaw = sensorInputs[3];  // VBAT_ADC
+#else
+    vbatRaw = analogRead(V_BATPIN);
+#endif
+    if (vbatSum == 0)
+        vbatSum = vbatRaw << 3; // start from the first reading, not from an empty battery
+    else
+        vbatSum = vbatSum - (vbatSum >> 3) + vbatRaw;
+    vbat = (vbatSum / (VBATSCALE / 4));   // result is Vbatt in 0.1V steps
+    if (vbat > 2)
+        vbat -= 2;
+
+#if (POWERMETER == 2)
+    pMeterRaw = analogRead(PSENSORPIN);
+    powerValue = (PSENSORNULL > pMeterRaw ? PSENSORNULL - pMeterRaw : pMeterRaw - PSENSORNULL);     // do not use abs(), it would induce implicit cast to uint and overrun
+#ifdef LOG_VALUES
+    if (powerValue < 333) { // only accept reasonable values. 333 is empirical
+        if (powerValue > powerMax)
+            powerMax = powerValue;
+        powerAvg = powerValue;
     }
-    eeprom_close();
+#endif
+    // charge in PSENSOR_PERIOD samples, whatever rate this actually runs at
+    if (psensorTime) {
+        psensorRest += (uint32_t) powerValue * min(currentTime - psensorTime, 250000);
+        pMeter[PMOTOR_SUM] += psensorRest / PSENSOR_PERIOD;
+        psensorRest %= PSENSOR_PERIOD;
+    }
+    psensorTime = currentTime;
+    powerDraw = powerValue;
+#endif
+#if defined(LOG_VALUES) || (POWERMETER == 1)
+    logMotorsPower();
+#endif
 
-    readEEPROM();
-    blinkLED(15, 20, 1);
+    if ((vbat > vbatAlarm.level1)
+#if defined(POWERMETER)
+        && ((pMeter[PMOTOR_SUM] < pAlarm) || (pAlarm == 0))
+#endif
+        || (vbatAlarm.none > vbat))     // ToLuSe
+    {                           //VBAT ok AND powermeter ok, buzzer off
+        buzzerFreq = 0;
+        buzzerState = 0;
+        BUZZERPIN_OFF;
+#if defined(POWERMETER)
+    } else if (pMeter[PMOTOR_SUM] > pAlarm) {   // sound alarm for powermeter
+        buzzerFreq = 4;
+#endif
+    } else if (vbat > vbatAlarm.level2)
+        buzzerFreq = 1;
+    else if (vbat > vbatAlarm.level3)
+        buzzerFreq = 2;
+    else
+        buzzerFreq = 4;
+    if (buzzerFreq) {
+        if (buzzerState && (currentTime > buzzerTime + 250000)) {
+            buzzerState = 0;
+            BUZZERPIN_OFF;
+            buzzerTime = currentTime;
+        } else if (!buzzerState && (currentTime > (buzzerTime + (2000000 >> buzzerFreq)))) {
+            buzzerState = 1;
+            BUZZERPIN_ON;
+            buzzerTime = currentTime;
+        }
+    }
 }
+#endif
 
-void checkFirstTime(void)
+#if defined(LCD_TELEMETRY) || defined(LCD_TELEMETRY_AUTO)
+void telemetryTask(void)
 {
-    uint8_t test_val, i;
+#ifdef LCD_TELEMETRY_AUTO
+    static uint32_t telemetryAutoTime;
 
-    eeprom_open();
-    eeprom_read_block(&test_val, (void *)0, 1);
-    eeprom_close();
+    if ((telemetry_auto) && (currentTime > telemetryAutoTime + LCD_TELEMETRY_AUTO)) {      // every 2 seconds
+        telemetry++;
+        if (telemetry == 'F')
+            telemetry = 'Z';
+        else if ((telemetry < 'A') || (telemetry > 'E'))
+            telemetry = 'A';
 
-    if (test_val == checkNewConf)
-        return;
+        telemetryAutoTime = currentTime;
+    }
+#endif
+#ifdef LCD_TELEMETRY
+#ifdef LCD_CONF
+    if (configurationActive())
+        return;                     // the menu has the display
+#endif
+    if (telemetry)
+        lcd_telemetry();
+#endif
+}
+#endif
 
-    P8[ROLL] = 40;
-    I8[ROLL] = 30;
-    D8[ROLL] = 23;
-    P8[PITCH] = 40;
-    I8[PITCH] = 30;
-    D8[PITCH] = 23;
-    P8[YAW] = 85;
-    I8[YAW] = 0;
-    D8[YAW] = 0;
-    P8[PIDALT] = 47;
-    I8[PIDALT] = 0;
-    D8[PIDALT] = 0;
-    P8[PIDVEL] = 0;
-    I8[PIDVEL] = 0;
-    D8[PIDVEL] = 0;
-    P8[PIDLEVEL] = 90;
-    I8[PIDLEVEL] = 45;
-    P8[PIDMAG] = 40;
-    rcRate8 = 45;               // = 0.9 in GUI
-    rcExpo8 = 65;
-    rollPitchRate = 0;
-    yawRate = 0;
-    dynThrPID = 0;
-    for (i = 0; i < 8; i++)
-        activate[i] = 0;
-    accTrim[0] = 0;
-    accTrim[1] = 0;
-    powerTrigger1 = 0;
-    mixerConfiguration = MULTITYPE_QUADX;
-    gimbalFlags = 0;
-    gimbalGainPitch = 10;
-    gimbalGainRoll = 10;
-    writeParams();
+// Startup. Sensors power up with the MCU, so their datasheet power up times count from reset: powerUpWait()
+// only sleeps through what's left of one, by then the EEPROM, outputs and receiver are usually done. A reset
+// the firmware issues itself (MPU6000_reset()) is started early and waited for by the driver that needs it.
+// How long it all took is in bootSetupMs and bootReadyMs, for the 'H' command
+static void powerUpWait(uint16_t ms)
+{
+    while (micros() < (uint32_t)ms * 1000)
+        ;
 }
 
-/* RX -------------------------------------------------------------------------------- */
-static uint8_t pinRcChannel[8] = { ROLLPIN, PITCHPIN, YAWPIN, THROTTLEPIN, AUX1PIN, AUX2PIN, CAM1PIN, CAM2PIN };
-volatile uint16_t rcPinValue[8] = { 1500, 1500, 1500, 1500, 1500, 1500, 1500, 1500 };   // interval [1000;2000]
+void setup()
+{
+    LEDPIN_PINMODE;
+    BUZZERPIN_PINMODE;
+    STABLEPIN_PINMODE;
+    POWERPIN_OFF;
+    Serial_begin(SERIAL_COM_SPEED);
+    readEEPROM();
+    initOutput();
+    checkFirstTime();
+#if !defined(SENSOR_NODE)
+    serialSpeedBoot();                  // the flight node listens at SENSOR_NODE from the start
+#endif
+    configureReceiver();
+    initSensors();
+    previousTime = loopMicros();
+#if defined(GIMBAL)
+    calibratingA = 400;
+#endif
+    calibratingG = 400;
+#if defined(POWERMETER)
+    for (uint8_t i = 0; i <= PMOTOR_SUM; i++)
+        pMeter[i] = 0;
+#endif
+#if defined(GPS)
+    gpsSerial_init(GPS_BAUD);
+#endif
+#if defined(LCD_ETPP)
+    i2c_ETPP_init();                    // blocking, the loop doesn't run yet
+    i2c_ETPP_print(0, "MultiWii");
+    i2c_ETPP_print(1, "Ready to Fly!");
+#endif
+#if defined(BLACKBOX_SD)
+    blackboxInit();
+#endif
+    bootSetupMs = millis();
+#if defined(SWO_TRACE)
+    trace_printf("afrowii %d up in %lums, mixer %d\n", VERSION, (unsigned long)bootSetupMs, mixerConfiguration);
+#endif
+#if defined(LOOP_WATCHDOG)
+    watchdog_init(LOOP_WATCHDOG);
+#endif
+#if defined(LOOP_ISR)
+    loopIsr_init(LOOP_ISR, loopTick);   // main() goes on as the background, see loop()
+#endif
+}
 
-// ***PPM SUM SIGNAL***
-#ifdef SERIAL_SUM_PPM
-static uint8_t rcChannel[8] = { SERIAL_SUM_PPM };
+// ************************************************************************************************************
+// Rate / level PID
+// ************************************************************************************************************
+// One kernel for the three axes, every product in 32 bit so there is no range dependent 16 bit shortcut.
+// The integrators hold error x cycles of PID_REF_CYCLE in Q8 and the D term is the 3 sample gyro delta over
+// the same cycles, both scaled by the measured cycleTime: the gains mean the same at any loop rate and are
+// the old ones when the loop runs at PID_REF_CYCLE.
+#define PID_I_SHIFT         8
+
+typedef struct {
+    int32_t errorGyroI;         // Q8, +/-16000
+    int32_t errorAngleI;        // Q8, +/-10000, level mode, ROLL/PITCH only
+    int16_t lastGyro;           // FIX_SIMD: YAW only, see pidGyroRP
+    int16_t delta1, delta2;
+#if defined(BLACKBOX)
+    int16_t P, I, D;            // last terms, for the log
 #endif
-volatile uint16_t rcValue[8] = { 1500, 1500, 1500, 1500, 1500, 1500, 1500, 1500 };      // interval [1000;2000]
+} pidState_t;
 
-#if defined(STM8) && defined(SERIAL_SUM_PPM)
-/* for single channel PWM input mode */
-static uint16_t riseValue = 0;
-static uint16_t fallValue = 0;
-static uint8_t captureState = 0;
-static uint8_t usePPM = 1;
+// shared between the RC task (resets, mode switches), outerTask() and pidCompute() in loop()
+static __tiny pidState_t pidState[3];
+#if defined(FIX_SIMD)
+static fix_pair_t pidGyroRP, pidDelta1RP, pidDelta2RP;    // the D history of ROLL | PITCH, packed
 #endif
+static __tiny int16_t levelTerm[2];            // level mode angle P + I, replaces the stick term of the rate PID
+static int16_t headingCorrection = 0;   // MAG heading hold, taken off rcCommand[YAW]
+static int16_t altHoldThrottle;         // BARO altitude hold, replaces rcCommand[THROTTLE]
+static int16_t initialThrottleHold;
+static int16_t errorAltitudeI = 0;
+static int16_t lastVelError = 0;
+static int32_t AltHold;
 
-// Configure receiver pins
-void configureReceiver(void)
+#if defined(FAILSAFE)
+// stage for the time since the last frame with a link. The thresholds are in 0.1s from config.h, the age in
+// micros() goes at most 20ms past one before the 50Hz rcTask() sees it, however the frames stopped
+static uint8_t failsafeCheck(void)
 {
-    uint8_t chan, a;
-#if defined(STM8)
-    // Configure GPIO pin for ppm input
-    GPIO_Init(GPIOD, GPIO_PIN_2, GPIO_MODE_IN_FL_NO_IT);
-
-    // when we're in camera gimbal mode, allow single PWM rx input for tilt compensation. useful? no idea.
-    if ((mixerConfiguration == MULTITYPE_GIMBAL) && (gimbalFlags & GIMBAL_TILTONLY))
-        usePPM = 0;
+    uint32_t link, age;
+    uint8_t frame;
 
-    TIM3_TimeBaseInit(TIM3_PRESCALER_8, 0xFFFF);
-    TIM3_ICInit(TIM3_CHANNEL_1, TIM3_ICPOLARITY_RISING, TIM3_ICSELECTION_DIRECTTI, TIM3_ICPSC_DIV1, 0x0);
-    TIM3_ITConfig(TIM3_IT_CC1, ENABLE);
-    TIM3_Cmd(ENABLE);
-#endif
+    do {
+        frame = seq_begin(&rcFrameCount);
+        link = rcLinkTime;
+    } while (seq_retry(&rcFrameCount, frame));
+    age = loopMicros() - link;
+    if ((int32_t)age <= 0)
+        return FAILSAFE_NONE;           // a frame came in since the clock was read
+    if (age > (FAILSAVE_DELAY + FAILSAVE_DESCEND_DELAY + FAILSAVE_OFF_DELAY) * 100000UL)
+        return FAILSAFE_DISARM;
+    if (age > (FAILSAVE_DELAY + FAILSAVE_DESCEND_DELAY) * 100000UL)
+        return FAILSAFE_DESCEND;
+    if (age > FAILSAVE_DELAY * 100000UL)
+        return FAILSAFE_LEVEL;
+    return FAILSAFE_NONE;
 }
+#endif
 
-#if defined(STM8) && defined(SERIAL_SUM_PPM)
-__near __interrupt void TIM3_CAP_COM_IRQHandler(void)
+// 50Hz: failsafe, stick commands and mode switches
+void rcTask(void)
 {
-    uint16_t diff;
-    static uint16_t now;
-    static uint16_t last = 0;
-    static uint8_t chan = 0;
+    static uint8_t rcDelayCommand;      // this indicates the number of time (multiple of RC measurement at 50Hz) the sticks must be maintained to run or switch off motors
+    uint8_t i;
 
-    if (TIM3_GetITStatus(TIM3_IT_CC1) == SET) {
-        last = now;
-        now = TIM3_GetCapture1();
+    // Failsafe routine - added by MIS
+#if defined(FAILSAFE)
+    failsafeStage = failsafeCheck();
+    if (failsafeStage != FAILSAFE_NONE && armed == 1) { // Stabilize, rcData[THROTTLE] is still the last frame's
+        for (i = 0; i < 3; i++)
+            rcData[i] = MIDRC;
+        if (failsafeStage >= FAILSAFE_DESCEND)
+            rcData[THROTTLE] = FAILSAVE_THR0TTLE;
+        if (failsafeStage == FAILSAFE_DISARM) {
+            armed = 0;      //This will prevent the copter to automatically rearm if failsafe shuts it down and prevents
+            okToArm = 0;    //to restart accidentely by just reconnect to the tx - you will have to switch off first to rearm
+        }
+        failsafeEvents++;
     }
-
-    TIM3_ClearITPendingBit(TIM3_IT_CC1);
-
-    if (!usePPM) {
-        // single-channel PWM input
-        if (captureState == 0)
-            riseValue = now;
-        else
-            fallValue = now;
-
-        if (captureState == 0) {
-            // switch states
-            captureState = 1;
-            TIM3_ICInit(TIM3_CHANNEL_1, TIM3_ICPOLARITY_FALLING, TIM3_ICSELECTION_DIRECTTI, TIM3_ICPSC_DIV1, 0x0);
+#endif
+    // end of failsave routine - next change is made with RcOptions setting
+#ifdef LCD_CONF
+    if (configurationActive())
+        rcDelayCommand = 0;         // the sticks drive the LCD menu
+    else
+#endif
+    if (rcData[THROTTLE] < MINCHECK) {
+        for (i = 0; i < 3; i++) {
+            pidState[i].errorGyroI = 0;
+            pidState[i].errorAngleI = 0;
+        }
+        rcDelayCommand++;
+        if (rcData[YAW] < MINCHECK && rcData[PITCH] < MINCHECK && armed == 0) {
+            if (rcDelayCommand == 20)
+                calibratingG = 400;
+        } else if (rcData[YAW] > MAXCHECK && rcData[PITCH] > MAXCHECK && armed == 0) {
+            if (rcDelayCommand == 20) {
+                servo[0] = 1500;    //we center the yaw gyro in conf mode
+                writeServos();
+#ifdef LCD_CONF
+                configurationStart();       //beginning LCD configuration
+#endif
+            }
+        } else if (activate[BOXARM] > 0) {
+            if ((rcOptions & activate[BOXARM]) && okToArm)
+                armed = 1;
+            else if (armed)
+                armed = 0;
+            rcDelayCommand = 0;
+        } else if ((rcData[YAW] < MINCHECK || rcData[ROLL] < MINCHECK) && armed == 1) {
+            if (rcDelayCommand == 20)
+                armed = 0;  // rcDelayCommand = 20 => 20x20ms = 0.4s = time to wait for a specific RC command to be acknowledged
+        } else if ((rcData[YAW] > MAXCHECK || rcData[ROLL] > MAXCHECK) && rcData[PITCH] < MAXCHECK && armed == 0 && calibratingG == 0 && calibratedACC == 1) {
+            if (rcDelayCommand == 20)
+                armed = 1;
+#ifdef LCD_TELEMETRY_AUTO
+        } else if (rcData[ROLL] < MINCHECK && rcData[PITCH] > MAXCHECK && armed == 0) {
+            if (rcDelayCommand == 20) {
+                if (telemetry_auto) {
+                    telemetry_auto = 0;
+                    telemetry = 0;
+                } else
+                    telemetry_auto = 1;
+            }
+#endif
+        } else
+            rcDelayCommand = 0;
+    } else if (rcData[THROTTLE] > MAXCHECK && armed == 0) {
+        if (rcData[YAW] < MINCHECK && rcData[PITCH] < MINCHECK) {
+            if (rcDelayCommand == 20)
+                calibratingA = 400;
+            rcDelayCommand++;
+        } else if (rcData[PITCH] > MAXCHECK) {
+            accTrim[PITCH]++;
+            writeParams();
+            accTrim[PITCH] += 2;
+            writeParams();
+        } else if (rcData[PITCH] < MINCHECK) {
+            accTrim[PITCH]--;
+            writeParams();
+            accTrim[PITCH] -= 2;
+            writeParams();
+        } else if (rcData[ROLL] > MAXCHECK) {
+            accTrim[ROLL]++;
+            writeParams();
+            accTrim[ROLL] += 2;
+            writeParams();
+        } else if (rcData[ROLL] < MINCHECK) {
+            accTrim[ROLL]--;
+            writeParams();
+            accTrim[ROLL] -= 2;
+            writeParams();
         } else {
-            // capture compute
-            if (fallValue > riseValue)
-                rcValue[PITCH] = fallValue - riseValue;
-            else
-                rcValue[PITCH] = (0xffff - riseValue) + fallValue;
-            
-            // 0.5us resolution, so we halve it for real stuff. And it ends up in the PITCH channel (camera tilt use)
-            rcValue[PITCH] >>= 1;
-
-            // switch state
-            captureState = 0;
-            TIM3_ICInit(TIM3_CHANNEL_1, TIM3_ICPOLARITY_RISING, TIM3_ICSELECTION_DIRECTTI, TIM3_ICPSC_DIV1, 0x0);
+            rcDelayCommand = 0;
         }
-        return;
     }
-
-    if (now > last) {
-        diff = (now - last);
-    } else {
-        diff = ((0xFFFF - last) + now);
+#ifdef LOG_VALUES
+    else if (armed) {       // update min and max values here, so do not get cycle time of the motor arming (which is way higher than normal)
+        if (cycleTime > cycleTimeMax)
+            cycleTimeMax = cycleTime;       // remember highscore
+        if (cycleTime < cycleTimeMin)
+            cycleTimeMin = cycleTime;       // remember lowscore
     }
+#endif
 
-    if (diff > 8000) {
-        chan = 0;
+    rcOptions = (rcData[AUX1] < 1300) + (1300 < rcData[AUX1] && rcData[AUX1] < 1700) * 2 + (rcData[AUX1] > 1700) * 4 + (rcData[AUX2] < 1300) * 8 + (1300 < rcData[AUX2] && rcData[AUX2] < 1700) * 16 + (rcData[AUX2] > 1700) * 32;
+#if defined(TUNING_PROFILES)
+    // the profile the switches pick, in use from the next loop on
+    i = (rcOptions & activateProfile[0]) ? 1 : (TUNING_PROFILES > 2 && (rcOptions & activateProfile[1])) ? 2 : 0;
+    if (i != tuningActive)
+        tuningSelect(i);
+#endif
+
+    //note: if FAILSAFE is disable, failsafeStage stays FAILSAFE_NONE
+    if (((rcOptions & activate[BOXACC]) || failsafeStage != FAILSAFE_NONE) && (ACC || nunchuk)) {
+        // bumpless transfer to Level mode
+        if (!accMode) {
+            pidState[ROLL].errorAngleI = 0;
+            pidState[PITCH].errorAngleI = 0;
+            levelTerm[ROLL] = 0;
+            levelTerm[PITCH] = 0;
+            accMode = 1;
+        }
+    } else
+        accMode = 0;        // modified by MIS for failsave support
+
+    if ((rcOptions & activate[BOXARM]) == 0)
+        okToArm = 1;
+    if (accMode == 1) {
+        STABLEPIN_ON;
     } else {
-        if (diff > 1500 && diff < 4500 && chan < 8) {   // div2, 750 to 2250 ms Only if the signal is between these values it is valid, otherwise the failsafe counter should move up
-            uint16_t tmp = diff >> 1;
-            rcValue[chan] = tmp;
+        STABLEPIN_OFF;
+    }
 
-#if defined(FAILSAFE)
-            if (failsafeCnt > 20)
-                failsafeCnt -= 20;
-            else
-                failsafeCnt = 0;        // clear FailSafe counter - added by MIS  //incompatible to quadroppm
+#if BARO
+    if (rcOptions & activate[BOXBARO]) {
+        if (baroMode == 0) {
+            baroMode = 1;
+            AltHold = EstAlt;
+            initialThrottleHold = rcCommand[THROTTLE];
+            altHoldThrottle = initialThrottleHold;
+            errorAltitudeI = 0;
+            lastVelError = 0;
+        }
+    } else
+        baroMode = 0;
 #endif
+#if MAG
+    if (rcOptions & activate[BOXMAG]) {
+        if (magMode == 0) {
+            magMode = 1;
+            attitudeHeading();
+            magHold = heading;
         }
-        chan++;
-    }
-}
+    } else
+        magMode = 0;
+#endif
+#if defined(CAMTRIG)
+    cameraTrigger();
 #endif
+}
 
-uint16_t readRawRC(uint8_t chan)
+#if defined(CAMTRIG)
+// ************************************************************************************************************
+// Camera trigger
+// ************************************************************************************************************
+// The BOXCAMTRIG switch going on asks for a shot, and with CAM_INTERVAL so does every CAM_INTERVAL ms it stays on
+// after that. A shot waits for CAM_TIME_LOW past the end of the last pulse, then shutter_fire() has the timer put
+// out the whole pulse. The shot count and the time of each leading edge go to the blackbox, so pictures can be
+// matched to the log to the microsecond whatever the 50Hz of rcTask() adds to when they are taken.
+static uint16_t camShots = 0;
+static uint32_t camShotTime;            // micros() of the last leading edge
+
+static void cameraTrigger(void)
 {
-    // We return the value correctly copied when the IRQ's where disabled
-    return rcValue[rcChannel[chan]];                
+    static uint8_t camWasOn = 0, camPending = 0;
+    uint8_t on = (rcOptions & activate[BOXCAMTRIG]) != 0;
+    uint32_t edge;
+
+    if (on && !camWasOn)
+        camPending = 1;                 // the switch went on, taken even if it's off again by then
+    camWasOn = on;
+    // the next one of the series only while the switch stays on
+    if (!camPending && !(on && CAM_INTERVAL && camShots && currentTime - camShotTime >= CAM_INTERVAL * 1000UL))
+        return;
+    if (camShots && currentTime - camShotTime < (CAM_TIME_HIGH + CAM_TIME_LOW) * 1000UL)
+        return;                         // the last pulse and the pause after it
+    if (!shutter_fire(CAM_TIME_HIGH, &edge))
+        return;
+    camPending = 0;
+    camShots++;
+    camShotTime = edge;
+#if defined(BLACKBOX)
+    blackboxCamera(camShots, edge);
+#endif
 }
+#endif
 
-void computeRC()
+// ************************************************************************************************************
+// Outer loop
+// ************************************************************************************************************
+// Angle, heading and altitude hold change far slower than the rates, so they run from the scheduler and
+// hand their results to the inner loop (gyro, rate PID, mixer, motors) in levelTerm[], headingCorrection
+// and altHoldThrottle. The inner loop rate can go up without paying for them on every cycle.
+void outerTask(void)
 {
-    static int16_t rcData4Values[8][4], rcDataMean[8];
-    static uint8_t rc4ValuesIndex = 0;
-    uint8_t chan, a;
+    static uint32_t lastRun;
+    uint32_t elapsed = currentTime - lastRun;
+    int16_t dtQ8;                       // since the last run in PID_REF_CYCLE
+    uint8_t axis;
+    int16_t error;
+    int32_t PTerm, ITerm;
+#if BARO
+    int16_t delta, AltPID, DTerm;
+#endif
 
-    rc4ValuesIndex++;
-    for (chan = 0; chan < 8; chan++) {
-        rcData4Values[chan][rc4ValuesIndex % 4] = readRawRC(chan);
-        rcDataMean[chan] = 0;
-        for (a = 0; a < 4; a++)
-            rcDataMean[chan] += rcData4Values[chan][a];
-        rcDataMean[chan] = (rcDataMean[chan] + 2) / 4;
-        if (rcDataMean[chan] < rcData[chan] - 3)
-            rcData[chan] = rcDataMean[chan] + 2;
-        if (rcDataMean[chan] > rcData[chan] + 3)
-            rcData[chan] = rcDataMean[chan] - 2;
+    lastRun = currentTime;
+    // the first run, or the scheduler fell behind
+    elapsed = constrain(elapsed, PID_REF_CYCLE / 4, (uint32_t)PID_REF_CYCLE * 8);
+    dtQ8 = (elapsed << PID_I_SHIFT) / PID_REF_CYCLE;
+
+#if BARO
+    getEstimatedAltitude();
+    if (baroMode) {
+        if (abs(rcCommand[THROTTLE] - initialThrottleHold) > 20) {
+            baroMode = 0;
+            errorAltitudeI = 0;
+        }
+        //**** Alt. Set Point stabilization PID ****
+        error = fix_clamp32(AltHold - EstAlt, -1000, 1000);     //  +/-10m,  1 decimeter accuracy
+        errorAltitudeI = fix_clamp32(errorAltitudeI + (((int32_t) error * dtQ8) >> PID_I_SHIFT), -30000, 30000);
+
+        PTerm = (int32_t) P8[PIDALT] * error / 100;     // up to 255 * 1000, past a 16 bit int
+        ITerm = FIX_DIV((int32_t) I8[PIDALT] * errorAltitudeI, 40000, 23);     // under 2^23 in
+
+        AltPID = PTerm + ITerm;
+
+        //**** Velocity stabilization PD ****        
+        error = fix_clamp32(EstVelocity * 2, -30000, 30000);
+        delta = error - lastVelError;
+        lastVelError = error;
+
+        PTerm = FIX_DIV((int32_t) error * P8[PIDVEL], 800, 17);         // under 2^23 in
+        DTerm = (int32_t) delta *D8[PIDVEL] * 16 / dtQ8;        // / 16 per PID_REF_CYCLE
+
+        altHoldThrottle = initialThrottleHold + fix_clamp32(AltPID - (PTerm - DTerm), -100, +100);
+    }
+#endif
+
+#if MAG
+    headingCorrection = 0;
+    // magHold only matters while magMode is on, it's set again when it comes on
+    if (magMode)
+        attitudeHeading();
+    if (abs(rcCommand[YAW]) < 70 && magMode) {
+        int16_t dif = heading - magHold;
+        if (dif <= -180)
+            dif += 360;
+        if (dif >= +180)
+            dif -= 360;
+        if (smallAngle25)
+            headingCorrection = (int32_t) dif * P8[PIDMAG] / 30;        // 18 deg. 180 * 255 is past a 16 bit int
+    } else
+        magHold = heading;
+#endif
+
+    if (accMode == 1) {
+        attitudeAngles();
+        for (axis = 0; axis < 2; axis++) {
+            // 50 degrees max inclination
+            error = fix_clamp16(2 * rcCommand[axis], -500, +500) - angle[axis] + accTrim[axis];
+            // |error| * P8 stays under 2^20
+#ifdef LEVEL_PDF
+            PTerm = -FIX_DIV((int32_t) angle[axis] * P8[PIDLEVEL], 100, 16);
+#else
+            PTerm = FIX_DIV((int32_t) error * P8[PIDLEVEL], 100, 16);
+#endif
+            pidState[axis].errorAngleI = fix_clamp32(pidState[axis].errorAngleI + (int32_t) error * dtQ8,
+                                                     -10000L << PID_I_SHIFT, +10000L << PID_I_SHIFT);  //WindUp
+            ITerm = ((pidState[axis].errorAngleI >> PID_I_SHIFT) * I8[PIDLEVEL]) >> 12;
+            levelTerm[axis] = PTerm + ITerm;
+        }
     }
 }
 
-/* OUTPUT ------------------------------------------------------------------------------------- */
-void writeServos()
+#if defined(LOOP_RATE_AUTO)
+// Boot time loop rate, see LOOP_RATE_AUTO. The first LOOP_RATE_PROBE loops run free and loopRateMeasure()
+// keeps the slowest, the boot calibration and whatever tasks are due then included. After that loopRatePace()
+// holds the top of loop() to the chosen period; with none fitting the loop stays free running.
+#define LOOP_RATE_PROBE     256
+static const uint16_t loopRatePeriods[] = { 500, 1000, 2000, 3000, 4000 };  // us, fastest first
+static uint16_t loopPeriod = 0;         // us, 0 while probing or free running
+static uint16_t loopCostMax = 0;        // us, the slowest probe loop
+static uint16_t loopRateProbe = LOOP_RATE_PROBE;
+static uint32_t loopSlot;               // start of the next loop
+static __tiny int16_t loopDtQ8, loopDInvQ8;    // pidCompute()'s cycle scaling at loopPeriod
+
+static void loopRatePace(void)
 {
-    if (!useServo)
+    if (!loopPeriod)
         return;
-
-    // STM8 PWM is actually 0.5us precision, so we double it
-    if (mixerConfiguration == MULTITYPE_TRI || mixerConfiguration == MULTITYPE_BI) {
-        /* One servo on Motor #4 */
-        pwmWrite(4, servo[0]);
-        if (mixerConfiguration == MULTITYPE_BI)
-            pwmWrite(5, servo[1]);
-    } else {
-        /* Two servos for camstab or FLYING_WING */
-        pwmWrite(4, servo[1]);
-        pwmWrite(5, servo[2]);
-    }
+    while ((int32_t)(micros() - loopSlot) < 0);
+    loopSlot += loopPeriod;
+    if ((int32_t)(micros() - loopSlot) >= 0)
+        loopSlot = micros() + loopPeriod;       // fell a whole period behind, don't try to catch up
 }
 
-void writeMotors(void)
+static void loopRateMeasure(uint32_t us)
 {
     uint8_t i;
 
-    for (i = 0; i < numberMotor; i++)
-        pwmWrite(i, motor[i]);
+    if (!loopRateProbe)
+        return;
+    if (us > loopCostMax)
+        loopCostMax = us > 0xFFFF ? 0xFFFF : us;
+    if (--loopRateProbe)
+        return;
+    for (i = 0; i < sizeof(loopRatePeriods) / sizeof(loopRatePeriods[0]); i++) {
+        if ((uint32_t)loopCostMax + (loopCostMax >> 2) <= loopRatePeriods[i]) {
+            loopPeriod = loopRatePeriods[i];
+            loopDtQ8 = ((uint32_t)loopPeriod << PID_I_SHIFT) / PID_REF_CYCLE;
+            loopDInvQ8 = ((uint32_t)PID_REF_CYCLE << PID_I_SHIFT) / loopPeriod;
+            loopSlot = micros();
+            break;
+        }
+    }
 }
+#endif
 
-void writeAllMotors(int16_t mc)
+RAMFUNC static void pidCompute(void)
 {
-    uint8_t i;
-    // Sends commands to all motors
-    for (i = 0; i < numberMotor; i++)
-        motor[i] = mc;
-    writeMotors();
-}
-
-#if defined(LOG_VALUES) || (POWERMETER == 1)
-void logMotorsPower(void)
-{
-    uint32_t amp;
-    uint8_t i;
-    /* true cubic function; when divided by vbat_max=126 (12.6V) for 3 cell battery this gives maximum value of ~ 1000 */
-    const uint32_t amperes[64] = { 0, 4, 13, 31, 60, 104, 165, 246, 350, 481, 640, 831, 1056, 1319, 1622, 1969, 2361, 2803, 3297, 3845, 4451, 5118, 5848, 6645,
-        7510, 8448, 9461, 10551, 11723, 12978, 14319, 15750, 17273, 18892, 20608, 22425, 24346, 26374, 28512, 30762, 33127, 35611,
-        38215, 40944, 43799, 46785, 49903, 53156, 56548, 60081, 63759, 67583, 71558, 75685, 79968, 84410, 89013, 93781, 98716, 103821,
-        109099, 114553, 120186, 126000
-    };
-
-    if (vbat) {                 // by all means - must avoid division by zero 
-        for (i = 0; i < numberMotor; i++) {
-            amp = amperes[(motor[i] - 1000) >> 4] / vbat;       // range mapped from [1000:2000] => [0:1000]; then break that up into 64 ranges; lookup amp
+    uint8_t axis;
+    uint16_t dt;
+    int16_t dtQ8, dInvQ8;
+    int32_t error, PTerm, ITerm, DTerm;
+    int16_t delta, deltaSum;
+    pidState_t *s;
+#if defined(FIX_SIMD)
+    fix_pair_t g, d, sumRP;
+#endif
 
-#ifdef LOG_VALUES
-            pMeter[i] += amp;   // sum up over time the mapped ESC input 
+#if defined(LOOP_RATE_AUTO)
+    if (loopPeriod && abs((int16_t)(cycleTime - loopPeriod)) < (loopPeriod >> 3)) {
+        dtQ8 = loopDtQ8;                // on time, no divisions
+        dInvQ8 = loopDInvQ8;
+    } else
 #endif
-#if (POWERMETER == 1)
-            pMeter[PMOTOR_SUM] += amp;  // total sum over all motors
+    {
+        dt = constrain(cycleTime, PID_REF_CYCLE / 4, PID_REF_CYCLE * 4);
+        dtQ8 = ((uint32_t)dt << PID_I_SHIFT) / PID_REF_CYCLE;          // this cycle in PID_REF_CYCLE
+        dInvQ8 = ((uint32_t)PID_REF_CYCLE << PID_I_SHIFT) / dt;
+    }
+#if defined(FIX_SIMD)
+    // ROLL and PITCH deltas and 3 sample sums two at a time. They are far inside 16 bits, the saturating
+    // adds come out like the scalar ones
+    g = fix_pack16(gyroData[ROLL], gyroData[PITCH]);
+    d = fix_qsub16(g, pidGyroRP);
+    pidGyroRP = g;
+    sumRP = fix_qadd16(fix_qadd16(pidDelta1RP, pidDelta2RP), d);
+    pidDelta2RP = pidDelta1RP;
+    pidDelta1RP = d;
+#endif
+    for (axis = 0; axis < 3; axis++) {
+        s = &pidState[axis];
+        if (accMode == 1 && axis < 2) { //LEVEL MODE, the angle loop runs in outerTask()
+            PTerm = levelTerm[axis];
+            ITerm = 0;
+        } else {                //ACRO MODE or YAW axis
+            // the gyro carries GYRO_FRAC bits more than the gains are for, taken off in the terms
+            error = (int32_t) rcCommand[axis] * 10 * 8 * GYRO_FINE / P8[axis] - gyroData[axis];
+            PTerm = rcCommand[axis];
+            s->errorGyroI = fix_clamp32(s->errorGyroI + error * dtQ8, -16000L * GYRO_FINE << PID_I_SHIFT, +16000L * GYRO_FINE << PID_I_SHIFT);   //WindUp
+            if (abs(gyroData[axis]) > 640 * GYRO_FINE)
+                s->errorGyroI = 0;
+            ITerm = ((s->errorGyroI >> (PID_I_SHIFT + GYRO_FRAC)) * I8[axis] * 131) >> 20;   // / 125 * I8 / 64
+        }
+        PTerm -= ((int32_t) gyroData[axis] * dynP8[axis] * 205 + (1 << (13 + GYRO_FRAC))) >> (14 + GYRO_FRAC);    // / 10 / 8
+
+#if defined(FIX_SIMD)
+        if (axis != YAW) {
+            deltaSum = axis == ROLL ? fix_lo16(sumRP) : fix_hi16(sumRP);
+        } else
 #endif
+        {
+            delta = gyroData[axis] - s->lastGyro;   // the dif between 2 consecutive gyro reads is limited to GYRO_GLITCH
+            s->lastGyro = gyroData[axis];
+            deltaSum = s->delta1 + s->delta2 + delta;
+            s->delta2 = s->delta1;
+            s->delta1 = delta;
         }
+        DTerm = ((int32_t) deltaSum * dynD8[axis] * dInvQ8) >> (5 + PID_I_SHIFT + GYRO_FRAC);
+
+        axisPID[axis] = PTerm + ITerm - DTerm;
+#if defined(BLACKBOX)
+        s->P = PTerm;
+        s->I = ITerm;
+        s->D = DTerm;
+#endif
     }
 }
-#endif
 
-void initOutput()
+#if defined(BIT_EXACT)
+// answer to a step frame, once its loop ran: 'x', step count (16 bit), motor[8], 'x'. parity_bench.c lines the
+// board's replies up against the simulator's by the count
+static void paritySerialize(void)
 {
-    if (mixerConfiguration == MULTITYPE_BI || mixerConfiguration == MULTITYPE_TRI || mixerConfiguration == MULTITYPE_GIMBAL || mixerConfiguration == MULTITYPE_FLYING_WING)
-        useServo = 1;
+    uint8_t i;
 
-#if defined(SERVO_TILT) || defined(CAMTRIG)
-    useServo = 1;
+    Serial_reset();
+    serialize8('x');
+    serialize16(paritySteps);
+    for (i = 0; i < 8; i++)
+        serialize16(motor[i]);
+    serialize8('x');
+    Serial_commitBuffer();
+}
 #endif
 
-    switch (mixerConfiguration) {
-        case MULTITYPE_GIMBAL:
-            numberMotor = 0;
-            break;
-        case MULTITYPE_FLYING_WING:
-            numberMotor = 1;
-            break;
-        case MULTITYPE_BI:
-            numberMotor = 2;
-            break;
-        case MULTITYPE_TRI:
-            numberMotor = 3;
-            break;
+// ******** Main Loop *********
+// With LOOP_ISR this is the inner loop interrupt and loop() below is the background
+#if defined(LOOP_ISR)
+static void loopTick(void)
+#else
+void loop(void)
+#endif
+{
+#if defined(LOOP_RATE_AUTO)
+    uint32_t loopStart;
+#endif
+#if defined(LATENCY_BENCH)
+    uint32_t latFrame = 0, latGyro, latPid, t;
+    uint8_t latNewFrame = 0, frame;
+#endif
 
-        case MULTITYPE_QUADP:
-        case MULTITYPE_QUADX:
-        case MULTITYPE_Y4:
-            numberMotor = 4;
-            break;
+#if defined(BIT_EXACT)
+    if (!parityStep) {
+        serialCom();                    // between step frames the board only listens
+        return;
+    }
+#endif
+#if defined(LOOP_RATE_AUTO)
+    loopRatePace();
+    loopStart = micros();
+#endif
+    PROBE_HI(PROBE_LOOP);
+    if (rcFrameComplete) {
+        computeRC();
+#if defined(LATENCY_BENCH)
+        do {
+            frame = seq_begin(&rcFrameCount);
+            latFrame = rcFrameTime;
+        } while (seq_retry(&rcFrameCount, frame));
+        latencyAdd(LAT_STICK_RC, micros() - latFrame);
+        latNewFrame = 1;
+#endif
+    }
+#if I2C_BUS
+    i2c_poll();
+#endif
 
-        case MULTITYPE_Y6:
-        case MULTITYPE_HEX6:
-        case MULTITYPE_HEX6X:
-            numberMotor = 6;
-            break;
+#if GPSPRESENT
+    if (rcOptions & activate[BOXGPSHOME])
+        GPSModeHome = 1;
+    else
+        GPSModeHome = 0;
+    if (rcOptions & activate[BOXGPSHOLD])
+        GPSModeHold = 1;
+    else
+        GPSModeHold = 0;
+#endif
 
-        case MULTITYPE_OCTOX8:
-        case MULTITYPE_OCTOFLATP:
-        case MULTITYPE_OCTOFLATX:
-            numberMotor = 8;
-            break;
+    PROFILE_BEGIN(computeIMU);
+    computeIMU();
+    PROFILE_END(computeIMU);
+    PROBE_TOGGLE(PROBE_STAGE);
+    // Measure loop rate just afer reading the sensors
+    currentTime = loopMicros();
+    cycleTime = currentTime - previousTime;
+    previousTime = currentTime;
+#if defined(SENSOR_LINK)
+    if (sensorLinkDt)
+        cycleTime = sensorLinkDt;       // the gyro sample interval, not the link's jitter
+#endif
+#if defined(LATENCY_BENCH)
+#if defined(GYRO_DRDY)
+    latGyro = gyroSampleTime;
+#else
+    latGyro = currentTime;              // the last gyro read ended computeIMU()
+#endif
+    if (latNewFrame)
+        latencyAdd(LAT_STICK_ANNEX, latAnnexTime - latFrame);
+#endif
+    loopDeadline();
+#if defined(SENSOR_NODE)
+    sensorNodeSend();                   // the flight node runs the PID and the motors
+    PROBE_LO(PROBE_LOOP);
+#else
+    // outerTask() runs from annexCode() in computeIMU() when due, apply what it last worked out
+#if MAG
+    if (magMode)
+        rcCommand[YAW] -= headingCorrection;
+#endif
+#if BARO
+    if (baroMode)
+        rcCommand[THROTTLE] = altHoldThrottle;
+#endif
+    //**** PITCH & ROLL & YAW PID ****
+    PROFILE_BEGIN(PID);
+    pidCompute();
+    PROFILE_END(PID);
+#if defined(SYSID)
+    sysidInject();
+#endif
+    PROBE_TOGGLE(PROBE_STAGE);
+#if defined(LATENCY_BENCH)
+    latPid = micros();
+    latencyAdd(LAT_GYRO_PID, latPid - latGyro);
+    if (latNewFrame)
+        latencyAdd(LAT_STICK_PID, latPid - latFrame);
+#endif
+
+    PROFILE_BEGIN(mixTable);
+    mixTable();
+    PROFILE_END(mixTable);
+    writeServos();
+    PROFILE_BEGIN(writeMotors);
+    writeMotors();
+    PROFILE_END(writeMotors);
+    PROBE_TOGGLE(PROBE_STAGE);
+    PROBE_LO(PROBE_LOOP);
+#if defined(LATENCY_BENCH)
+    t = micros();
+    latencyAdd(LAT_MIX_MOTOR, t - latPid);
+    latencyAdd(LAT_GYRO_MOTOR, t - latGyro);
+    if (latNewFrame) {
+        PROBE_LO(PROBE_LATENCY);
+        latencyAdd(LAT_STICK_MOTOR, t - latFrame);
     }
+#endif
+#endif                          /* !SENSOR_NODE */
+#if defined(BIT_EXACT)
+    paritySerialize();
+    parityStep = 0;                     // serialCom() takes no frame while it's set, not even from the tasks
+#endif
+#if defined(BLACKBOX)
+    blackboxLog();
+#endif
+#if defined(LOOP_RATE_AUTO)
+    loopRateMeasure(micros() - loopStart);
+#endif
+#if defined(WATCH)
+    watchSample();
+#endif
+#if defined(SWO_TRACE)
+    trace_flush();
+#endif
+#if defined(LOOP_WATCHDOG)
+    watchdog_kick();
+#endif
 
-    // This handles motor and servo initialization in one place
-    pwmInit(useServo);
-    writeAllMotors(1000);
-    delay(300);
 }
 
-void mixTable()
+#if defined(LOOP_ISR)
+// Background: the slow tasks, in between inner loops. Once none is due it sleeps, the next inner loop has moved
+// currentTime on when it wakes
+void loop(void)
 {
-    int16_t maxMotor;
-    uint8_t i, axis;
-    static uint8_t camCycle = 0;
-    static uint8_t camState = 0;
-    static uint32_t camTime = 0;
-
-#define PIDMIX(X,Y,Z) rcCommand[THROTTLE] + axisPID[ROLL]*X + axisPID[PITCH]*Y + YAW_DIRECTION * axisPID[YAW]*Z
+    taskRun();
+    loopIsr_idle();
+}
+#endif
 
-    if (numberMotor > 3) {
-        //prevent "yaw jump" during yaw correction
-        axisPID[YAW] = constrain(axisPID[YAW], -100 - abs(rcCommand[YAW]), +100 + abs(rcCommand[YAW]));
-    }
+/* EEPROM --------------------------------------------------------------------- */
+// The table is constant, in flash next to the code. With PARAM_IN_PLACE the entries of STORED_PARAM() have no
+// variable: the value is read from the newest record in the EEPROM, def while there is none
+typedef struct eep_entry_t {
+    uint8_t id;
+    void *var;
+    uint8_t size;
+#if defined(PARAM_IN_PLACE)
+    const void *def;
+#endif
+} eep_entry_t;
+#if defined(PARAM_IN_PLACE)
+#define STORED_PARAM(v)     NULL, sizeof(v##Default), &v##Default
+#else
+#define STORED_PARAM(v)     &v, sizeof(v)
+#endif
 
-    switch (mixerConfiguration) {
-        case MULTITYPE_BI:
-            motor[0] = PIDMIX(+1, 0, 0);        //LEFT
-            motor[1] = PIDMIX(-1, 0, 0);        //RIGHT        
-            servo[0] = constrain(1500 + YAW_DIRECTION * (axisPID[YAW] + axisPID[PITCH]), 1020, 2000);   //LEFT
-            servo[1] = constrain(1500 + YAW_DIRECTION * (axisPID[YAW] - axisPID[PITCH]), 1020, 2000);   //RIGHT
-            break;
+// ************************************************************************************************************
+// EEPROM Layout definition
+// ************************************************************************************************************
+// Records carry the id, not the position in this table. A new parameter gets the next free id, one that
+// changes size or meaning gets a new id too, and an id is never reused: 1..254 (0 and 0xFF end the log).
+static const eep_entry_t eep_entry[] = {
+    { 1, TUNING_PARAM(P8) },
+    { 2, TUNING_PARAM(I8) },
+    { 3, TUNING_PARAM(D8) },
+    { 4, TUNING_PARAM(rcRate8) },
+    { 5, TUNING_PARAM(rcExpo8) },
+    { 6, TUNING_PARAM(rollPitchRate) },
+    { 7, TUNING_PARAM(yawRate) },
+    { 8, TUNING_PARAM(dynThrPID) },
+    { 9, &accZero, sizeof(accZero) },
+    { 10, &magZero, sizeof(magZero) },
+    { 11, &accTrim, sizeof(accTrim) },
+    { 12, &activate, sizeof(activate) },
+    { 13, &powerTrigger1, sizeof(powerTrigger1) },
+    { 14, &mixerConfiguration, sizeof(mixerConfiguration) },
+    { 15, &gimbalFlags, sizeof(gimbalFlags) },
+    { 16, &gimbalGainPitch, sizeof(gimbalGainPitch) },
+    { 17, &gimbalGainRoll, sizeof(gimbalGainRoll) },
+    { 18, STORED_PARAM(customMixer) },
+    { 19, &baroOsr, sizeof(baroOsr) },
+    { 20, STORED_PARAM(sensorFilter) },
+    { 21, &gyroDlpf, sizeof(gyroDlpf) },
+    { 22, &gyroRateDiv, sizeof(gyroRateDiv) },
+    { 23, STORED_PARAM(vbatAlarm) },
+    { 24, STORED_PARAM(servoRate) },
+    { 25, &gimbalLead, sizeof(gimbalLead) },
+    { 26, &serialSpeed, sizeof(serialSpeed) },
+    { 27, TUNING_PARAM(tpaCurve) },
+#if defined(TUNING_PROFILES)
+    { 28, &activateProfile, sizeof(activateProfile) },
+    { 29, &tuning[1], sizeof(tuning_t) },
+#if TUNING_PROFILES > 2
+    { 30, &tuning[2], sizeof(tuning_t) },
+#endif
+#endif
+};
+#define EEBLOCK_SIZE sizeof(eep_entry)/sizeof(eep_entry_t)
+// ************************************************************************************************************
 
-        case MULTITYPE_TRI:
-            motor[0] = PIDMIX(0, +4 / 3, 0);    //REAR
-            motor[1] = PIDMIX(-1, -2 / 3, 0);   //RIGHT
-            motor[2] = PIDMIX(+1, -2 / 3, 0);   //LEFT
-            servo[0] = constrain(TRI_YAW_MIDDLE + YAW_DIRECTION * axisPID[YAW], TRI_YAW_CONSTRAINT_MIN, TRI_YAW_CONSTRAINT_MAX);        //REAR
-            break;
+// The EEPROM starts with a header {PARAM_MAGIC, PARAM_VERSION, crc8, 0xFF} followed by a log of records
+// {id, size, data[size], crc8}, padded to an even length for the STM32 flash. A commit only appends the
+// entries that differ from their newest record, and the log is erased and written out in full once it
+// runs out of room, so the flash page sees one erase per ~100 trim commits instead of one per write.
+// A record id of 0 or 0xFF ends the log: erased flash reads 0xFF, and on the STM8 the byte after the
+// last record is zeroed to cut off stale records.
+// Records of ids this firmware doesn't know, or with a size other than the table's (another firmware
+// version), are stepped over and dropped by the next compaction; the parameters they don't cover keep
+// their defaults, so adding or retiring a parameter no longer throws away the rest of the setup.
+// writeParams() only marks the parameters dirty, paramTask() commits them once the copter is disarmed
+// and nothing has changed for PARAM_COMMIT_DELAY, so trimming with the sticks no longer stalls the loop.
+#define PARAM_MAGIC         0xA7
+#define PARAM_VERSION       2           // record format, 1 was the index keyed log behind checkNewConf
+#define PARAM_HEADER_SIZE   4
+#define PARAM_DATA_MAX      34          // largest entry, a TUNING_PROFILES profile (customMixer is 33)
+#define PARAM_RECORD_MAX    38          // largest entry + 3, even
+#define PARAM_COMMIT_DELAY  500000      // us
+#define PARAM_NONE          0xFFFF
+#define PARAM_UNKNOWN       0xFF
+
+static uint16_t paramAddr[EEBLOCK_SIZE];    // newest record of each entry, PARAM_NONE if there is none
+static uint16_t paramEnd;                   // where the next record goes
+static uint8_t paramValid = 0;              // the header matched at boot
+static uint8_t paramDirty = 0;
+static uint32_t paramDirtyTime;
+
+static uint8_t crc8(const uint8_t *p, uint8_t n)
+{
+    uint8_t crc = 0, i;
 
-        case MULTITYPE_QUADP:
-            motor[0] = PIDMIX(0, +1, -1);       //REAR
-            motor[1] = PIDMIX(-1, 0, +1);       //RIGHT
-            motor[2] = PIDMIX(+1, 0, +1);       //LEFT
-            motor[3] = PIDMIX(0, -1, -1);       //FRONT
-            break;
+    while (n--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++)
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
 
-        case MULTITYPE_QUADX:
-            motor[0] = PIDMIX(-1, +1, -1);      //REAR_R
-            motor[1] = PIDMIX(-1, -1, +1);      //FRONT_R
-            motor[2] = PIDMIX(+1, +1, +1);      //REAR_L
-            motor[3] = PIDMIX(+1, -1, -1);      //FRONT_L
-            break;
+static uint8_t paramRecordSize(uint8_t size)
+{
+    return (size + 4) & ~1;
+}
 
-        case MULTITYPE_Y4:
-            motor[0] = PIDMIX(+0, +1, -1);      //REAR_1 CW
-            motor[1] = PIDMIX(-1, -1, 0);       //FRONT_R CCW
-            motor[2] = PIDMIX(+0, +1, +1);      //REAR_2 CCW
-            motor[3] = PIDMIX(+1, -1, 0);       //FRONT_L CW
-            break;
+static uint8_t paramIndex(uint8_t id)
+{
+    uint8_t i;
 
-        case MULTITYPE_Y6:
-            motor[0] = PIDMIX(+0, +4 / 3, +1);  //REAR
-            motor[1] = PIDMIX(-1, -2 / 3, -1);  //RIGHT
-            motor[2] = PIDMIX(+1, -2 / 3, -1);  //LEFT
-            motor[3] = PIDMIX(+0, +4 / 3, -1);  //UNDER_REAR
-            motor[4] = PIDMIX(-1, -2 / 3, +1);  //UNDER_RIGHT
-            motor[5] = PIDMIX(+1, -2 / 3, +1);  //UNDER_LEFT    
-            break;
+    for (i = 0; i < EEBLOCK_SIZE; i++)
+        if (eep_entry[i].id == id)
+            return i;
+    return PARAM_UNKNOWN;
+}
 
-        case MULTITYPE_HEX6:
-            motor[0] = PIDMIX(-1 / 2, +1 / 2, +1);      //REAR_R
-            motor[1] = PIDMIX(-1 / 2, -1 / 2, -1);      //FRONT_R
-            motor[2] = PIDMIX(+1 / 2, +1 / 2, +1);      //REAR_L
-            motor[3] = PIDMIX(+1 / 2, -1 / 2, -1);      //FRONT_L
-            motor[4] = PIDMIX(+0, -1, +1);      //FRONT
-            motor[5] = PIDMIX(+0, +1, -1);      //REAR
+// One pass over the log at boot, loading every good record straight into its parameter: the newest one
+// wins, and its address is kept so later lookups are direct. There is no RAM copy of the whole block
+// to read in one go, the STM8 doesn't have the RAM. Returns 0 when the header doesn't match.
+static uint8_t paramLoad(void)
+{
+    uint8_t rec[PARAM_RECORD_MAX];
+    uint16_t size = eeprom_size();
+    uint8_t i, n;
+
+    for (i = 0; i < EEBLOCK_SIZE; i++)
+        paramAddr[i] = PARAM_NONE;
+    paramEnd = size;                    // no usable log, the first commit starts over
+    eeprom_read_block(rec, (void *)0, PARAM_HEADER_SIZE);
+    if (rec[0] != PARAM_MAGIC || rec[1] != PARAM_VERSION || rec[2] != crc8(rec, 2))
+        return 0;
+    paramEnd = PARAM_HEADER_SIZE;
+    for (;;) {
+        if (paramEnd + 2 > size)
             break;
-
-        case MULTITYPE_HEX6X:
-            motor[0] = PIDMIX(-1 / 2, +1 / 2, +1);      //REAR_R
-            motor[1] = PIDMIX(-1 / 2, -1 / 2, +1);      //FRONT_R
-            motor[2] = PIDMIX(+1 / 2, +1 / 2, -1);      //REAR_L
-            motor[3] = PIDMIX(+1 / 2, -1 / 2, -1);      //FRONT_L
-            motor[4] = PIDMIX(-1, +0, -1);      //RIGHT
-            motor[5] = PIDMIX(+1, +0, +1);      //LEFT
+        eeprom_read_block(rec, (void *)paramEnd, 2);
+        if (rec[0] == 0 || rec[0] == 0xFF)
             break;
-
-        case MULTITYPE_OCTOX8:
-            motor[0] = PIDMIX(-1, +1, -1);      //REAR_R
-            motor[1] = PIDMIX(-1, -1, +1);      //FRONT_R
-            motor[2] = PIDMIX(+1, +1, +1);      //REAR_L
-            motor[3] = PIDMIX(+1, -1, -1);      //FRONT_L
-            motor[4] = PIDMIX(-1, +1, +1);      //UNDER_REAR_R
-            motor[5] = PIDMIX(-1, -1, -1);      //UNDER_FRONT_R
-            motor[6] = PIDMIX(+1, +1, -1);      //UNDER_REAR_L
-            motor[7] = PIDMIX(+1, -1, +1);      //UNDER_FRONT_L
+        n = paramRecordSize(rec[1]);
+        if (rec[1] > PARAM_DATA_MAX || paramEnd + n > size) {
+            paramEnd = size;            // garbage, compact on the next commit
             break;
-
-        case MULTITYPE_OCTOFLATP:
-            motor[0] = PIDMIX(+7 / 10, -7 / 10, +1);    //FRONT_L
-            motor[1] = PIDMIX(-7 / 10, -7 / 10, +1);    //FRONT_R
-            motor[2] = PIDMIX(-7 / 10, +7 / 10, +1);    //REAR_R
-            motor[3] = PIDMIX(+7 / 10, +7 / 10, +1);    //REAR_L
-            motor[4] = PIDMIX(+0, -1, -1);      //FRONT
-            motor[5] = PIDMIX(-1, +0, -1);      //RIGHT
-            motor[6] = PIDMIX(+0, +1, -1);      //REAR
-            motor[7] = PIDMIX(+1, +0, -1);      //LEFT 
+        }
+        eeprom_read_block(rec, (void *)paramEnd, n);
+        if (rec[rec[1] + 2] != crc8(rec, rec[1] + 2)) {
+            paramEnd = size;            // torn write, compact on the next commit
             break;
+        }
+        i = paramIndex(rec[0]);
+        if (i != PARAM_UNKNOWN && rec[1] == eep_entry[i].size) {
+            if (eep_entry[i].var)
+                memcpy(eep_entry[i].var, rec + 2, rec[1]);
+            paramAddr[i] = paramEnd;
+        }
+        paramEnd += n;
+    }
+    return 1;
+}
 
-        case MULTITYPE_OCTOFLATX:
-            motor[0] = PIDMIX(+1, -1 / 2, +1);  //MIDFRONT_L
-            motor[1] = PIDMIX(-1 / 2, -1, +1);  //FRONT_R
-            motor[2] = PIDMIX(-1, +1 / 2, +1);  //MIDREAR_R
-            motor[3] = PIDMIX(+1 / 2, +1, +1);  //REAR_L
-            motor[4] = PIDMIX(+1 / 2, -1, -1);  //FRONT_L
-            motor[5] = PIDMIX(-1, -1 / 2, -1);  //MIDFRONT_R
-            motor[6] = PIDMIX(-1 / 2, +1, -1);  //REAR_R
-            motor[7] = PIDMIX(+1, +1 / 2, -1);  //MIDREAR_L 
-            break;
+static uint8_t paramChanged(uint8_t i)
+{
+    uint8_t stored[PARAM_DATA_MAX];
 
-        case MULTITYPE_GIMBAL:
-            servo[1] = constrain(TILT_PITCH_MIDDLE + gimbalGainPitch * angle[PITCH] / 16 + rcCommand[PITCH], TILT_PITCH_MIN, TILT_PITCH_MAX);
-            servo[2] = constrain(TILT_ROLL_MIDDLE + gimbalGainRoll * angle[ROLL] / 16 + rcCommand[ROLL], TILT_ROLL_MIN, TILT_ROLL_MAX);
-            break;
-            
-        case MULTITYPE_FLYING_WING:
-            motor[0] = rcCommand[THROTTLE];
-            //if (passthroughMode) {// use raw stick values to drive output 
-            // follow aux1 as being three way switch **NOTE: better to implement via check boxes in GUI 
-            if (rcData[AUX1] < 1300) {
-                // passthrough
-                servo[1] = constrain(WING_LEFT_MID + PITCH_DIRECTION_L * (rcData[PITCH] - MIDRC) + ROLL_DIRECTION_L * (rcData[ROLL] - MIDRC), WING_LEFT_MIN, WING_LEFT_MAX);    //LEFT
-                servo[2] = constrain(WING_RIGHT_MID + PITCH_DIRECTION_R * (rcData[PITCH] - MIDRC) + ROLL_DIRECTION_R * (rcData[ROLL] - MIDRC), WING_RIGHT_MIN, WING_RIGHT_MAX); //RIGHT
-            } else {                    // use sensors to correct (gyro only or gyro+acc according to aux1/aux2 configuration
-                servo[1] = constrain(WING_LEFT_MID + PITCH_DIRECTION_L * axisPID[PITCH] + ROLL_DIRECTION_L * axisPID[ROLL], WING_LEFT_MIN, WING_LEFT_MAX);      //LEFT
-                servo[2] = constrain(WING_RIGHT_MID + PITCH_DIRECTION_R * axisPID[PITCH] + ROLL_DIRECTION_R * axisPID[ROLL], WING_RIGHT_MIN, WING_RIGHT_MAX);   //RIGHT
-            }
-            break;
+    if (!eep_entry[i].var)
+        return 0;                       // read in place, paramWrite() stored it
+    if (paramAddr[i] == PARAM_NONE)
+        return 1;
+    eeprom_read_block(stored, (void *)(paramAddr[i] + 2), eep_entry[i].size);
+    return memcmp(stored, eep_entry[i].var, eep_entry[i].size) != 0;
+}
 
+static void paramAppend(uint8_t i, const void *data)
+{
+    uint8_t rec[PARAM_RECORD_MAX];
+    uint8_t n = eep_entry[i].size + 2, next, size = paramRecordSize(eep_entry[i].size);
+
+    rec[0] = eep_entry[i].id;
+    rec[1] = eep_entry[i].size;
+    memcpy(rec + 2, data, eep_entry[i].size);
+    rec[n] = crc8(rec, n);
+    if (++n < size)
+        rec[n] = 0xFF;
+    // terminate first, a record cut short by a reset then can't run into stale data
+    if (paramEnd + size < eeprom_size()) {
+        eeprom_read_block(&next, (void *)(paramEnd + size), 1);
+        if (next != 0 && next != 0xFF) {
+            next = 0;
+            eeprom_write_block(&next, (void *)(paramEnd + size), 1);
+        }
     }
+    eeprom_write_block(rec, (void *)paramEnd, size);
+    paramAddr[i] = paramEnd;
+    paramEnd += size;
+}
 
-#ifdef SERVO_TILT
-    if (rcOptions & activate[BOXCAMSTAB]) {
-        servo[1] = constrain(TILT_PITCH_MIDDLE + gimbalGainPitch * angle[PITCH] / 16 + rcData[CAMPITCH] - 1500, TILT_PITCH_MIN, TILT_PITCH_MAX);
-        servo[2] = constrain(TILT_ROLL_MIDDLE + gimbalGainRoll * angle[ROLL] / 16 + rcData[CAMROLL] - 1500, TILT_ROLL_MIN, TILT_ROLL_MAX);
-    } else {
-        servo[1] = constrain(TILT_PITCH_MIDDLE + rcData[CAMPITCH] - 1500, TILT_PITCH_MIN, TILT_PITCH_MAX);
-        servo[2] = constrain(TILT_ROLL_MIDDLE + rcData[CAMROLL] - 1500, TILT_ROLL_MIN, TILT_ROLL_MAX);
-    }
+#if defined(PARAM_IN_PLACE)
+#define PARAM_KEEP_SIZE     (sizeof(customMixerDefault) + sizeof(sensorFilterDefault) + sizeof(vbatAlarmDefault) \
+                             + sizeof(servoRateDefault))
 #endif
 
-#if defined(CAMTRIG)
-    if (camCycle == 1) {
-        if (camState == 0) {
-            servo[3] = CAM_SERVO_HIGH;
-            camState = 1;
-            camTime = millis();
-        } else if (camState == 1) {
-            if ((millis() - camTime) > CAM_TIME_HIGH) {
-                servo[3] = CAM_SERVO_LOW;
-                camState = 2;
-                camTime = millis();
+// writes whatever changed, and entry set (PARAM_UNKNOWN for none) from data, now. Blocking, keep it out of flight
+static void paramStore(uint8_t set, const void *data)
+{
+    uint8_t header[PARAM_HEADER_SIZE];
+    uint16_t need = 0;
+    uint8_t i;
+#if defined(PARAM_IN_PLACE)
+    uint8_t keep[PARAM_KEEP_SIZE];
+    uint8_t k;
+#endif
+
+    eeprom_open();
+    for (i = 0; i < EEBLOCK_SIZE; i++)
+        if (paramChanged(i) || i == set)
+            need += paramRecordSize(eep_entry[i].size);
+    if (need && paramEnd + need > eeprom_size()) {
+#if defined(PARAM_IN_PLACE)
+        // the values read in place go with the log: out to the stack first, back in right after the header
+        for (i = k = 0; i < EEBLOCK_SIZE; i++)
+            if (!eep_entry[i].var && paramAddr[i] != PARAM_NONE && i != set) {
+                eeprom_read_block(keep + k, (void *)(paramAddr[i] + 2), eep_entry[i].size);
+                k += eep_entry[i].size;
             }
-        } else {                //camState ==2
-            if ((millis() - camTime) > CAM_TIME_LOW) {
-                camState = 0;
-                camCycle = 0;
+#endif
+        eeprom_erase();
+        header[0] = PARAM_MAGIC;
+        header[1] = PARAM_VERSION;
+        header[2] = crc8(header, 2);
+        header[3] = 0xFF;
+        eeprom_write_block(header, (void *)0, PARAM_HEADER_SIZE);
+        paramEnd = PARAM_HEADER_SIZE;
+#if defined(PARAM_IN_PLACE)
+        for (i = k = 0; i < EEBLOCK_SIZE; i++)
+            if (!eep_entry[i].var && paramAddr[i] != PARAM_NONE && i != set) {
+                paramAppend(i, keep + k);
+                k += eep_entry[i].size;
             }
-        }
+#endif
+        for (i = 0; i < EEBLOCK_SIZE; i++)
+            if (eep_entry[i].var)
+                paramAddr[i] = PARAM_NONE;
     }
-    if (rcOptions & activate[BOXCAMTRIG])
-        camCycle = 1;
+    for (i = 0; i < EEBLOCK_SIZE; i++)
+        if (paramChanged(i))
+            paramAppend(i, eep_entry[i].var);
+        else if (i == set)
+            paramAppend(i, data);
+    eeprom_close();
+    paramValid = 1;
+    paramDirty = 0;
+#if defined(PARAM_IN_PLACE)
+    if (FRAME == MULTITYPE_CUSTOM)
+        mixerSelect();                  // motorMixer points into the old record
 #endif
+}
 
-    maxMotor = motor[0];
-    for (i = 1; i < numberMotor; i++)
-        if (motor[i] > maxMotor)
-            maxMotor = motor[i];
-    for (i = 0; i < numberMotor; i++) {
-        if (maxMotor > MAXTHROTTLE)     // this is a way to still have good gyro corrections if at least one motor reaches its max.
-            motor[i] -= maxMotor - MAXTHROTTLE;
-        motor[i] = constrain(motor[i], MINTHROTTLE, MAXTHROTTLE);
-        if ((rcData[THROTTLE]) < MINCHECK)
-#ifndef MOTOR_STOP
-            motor[i] = MINTHROTTLE;
-#else
-            motor[i] = MINCOMMAND;
+static void paramCommit(void)
+{
+    paramStore(PARAM_UNKNOWN, NULL);
+}
+
+// a value read in place with PARAM_IN_PLACE, entry i's variable otherwise. Good until the next commit
+static const void *paramData(uint8_t i)
+{
+#if defined(PARAM_IN_PLACE)
+    if (!eep_entry[i].var && paramAddr[i] == PARAM_NONE)
+        return eep_entry[i].def;
+    if (!eep_entry[i].var)
+        return eeprom_map((void *)(paramAddr[i] + 2), eep_entry[i].size);
 #endif
-        if (armed == 0)
-            motor[i] = MINCOMMAND;
-    }
+    return eep_entry[i].var;
+}
 
-#if defined(LOG_VALUES) || (POWERMETER == 1)
-    logMotorsPower();
+// an edit from the GUI: into the variable, to be committed by paramTask(), or with PARAM_IN_PLACE straight to the
+// EEPROM when there is none, but not armed, the write blocks. The caller does the writeParams(). 0 when refused
+static uint8_t paramWrite(uint8_t i, const void *data)
+{
+    if (eep_entry[i].var) {
+        memcpy(eep_entry[i].var, data, eep_entry[i].size);
+        return 1;
+    }
+#if defined(PARAM_IN_PLACE)
+    if (!armed) {
+        paramStore(i, data);
+        return 1;
+    }
 #endif
+    return 0;
 }
 
-/* IMU ------------------------------------------------------------------------------------------------- */
+// lookupRX[], tpaLookup[] and rateSlope[] from the tuning in use
+static void tuningDerive(void)
+{
+    uint8_t i;
 
-void computeIMU()
+    for (i = 0; i < 7; i++)
+        lookupRX[i] = (2500 + rcExpo8 * (i * i - 25)) * i * (int32_t) rcRate8 / 1250;
+    // tpaLookup[0] is throttle 1000, [i] throttle 1000 + 125 * i. An attenuation of 100 % takes P and D to 0
+    tpaLookup[0] = 128;
+    for (i = 1; i < 9; i++)
+        tpaLookup[i] = 128 - (uint16_t) min(tpaCurve[i - 1], 100) * 128 / 100;
+    for (i = 0; i < 8 && !tpaCurve[i]; i++);
+    if (i == 8)
+        for (i = 5; i < 9; i++)
+            tpaLookup[i] = 128 - (uint16_t) min(dynThrPID, 100) * (i - 4) * 32 / 100;
+    // 128 - rateSlope * 500 >> 9 is 128 * (100 - rate) / 100, the factor at full stick
+    rateSlope[ROLL] = rateSlope[PITCH] = ((uint32_t) min(rollPitchRate, 100) * 65536 + 25000) / 50000;
+    rateSlope[YAW] = ((uint32_t) min(yawRate, 100) * 65536 + 25000) / 50000;
+    rcShapeStale = 1;
+}
+
+#if defined(TUNING_PROFILES)
+// the tuning in use into profile k
+static void tuningStore(uint8_t k)
 {
-    uint8_t axis;
-    static int16_t gyroADCprevious[3] = { 0, 0, 0 };
-    int16_t gyroADCp[3];
-    int16_t gyroADCinter[3];
-    static int16_t lastAccADC[3] = { 0, 0, 0 };
-    static uint32_t timeInterleave = 0;
-    static int16_t gyroYawSmooth = 0;
+    tuning_t *t = &tuning[k];
+
+    memcpy(t->P8, (const uint8_t *)P8, sizeof(t->P8));
+    memcpy(t->I8, (const uint8_t *)I8, sizeof(t->I8));
+    memcpy(t->D8, (const uint8_t *)D8, sizeof(t->D8));
+    t->rcRate8 = rcRate8;
+    t->rcExpo8 = rcExpo8;
+    t->rollPitchRate = rollPitchRate;
+    t->yawRate = yawRate;
+    t->dynThrPID = dynThrPID;
+    memcpy(t->tpaCurve, tpaCurve, sizeof(t->tpaCurve));
+}
 
-    //we separate the 2 situations because reading gyro values with a gyro only setup can be achieved at a higher rate
-    //gyro+nunchuk: we must wait for a quite high delay between 2 reads to get both WM+ and Nunchuk data. It works with 3ms
-    //gyro only: the delay to read 2 consecutive values can be reduced to only 0.65ms
-    if (!ACC && nunchuk) {
-        annexCode();
-        while ((micros() - timeInterleave) < INTERLEAVING_DELAY);       //interleaving delay between 2 consecutive reads
-        timeInterleave = micros();
-        WMP_getRawADC();
-        getEstimatedAttitude(); // computation time must last less than one interleaving delay
-#if BARO
-        getEstimatedAltitude();
-#endif
-        while ((micros() - timeInterleave) < INTERLEAVING_DELAY);       //interleaving delay between 2 consecutive reads
-        timeInterleave = micros();
-        while (WMP_getRawADC() != 1);   // For this interleaving reading, we must have a gyro update at this point (less delay)
+// profile k into the tuning in use, without its tables
+static void tuningLoad(uint8_t k)
+{
+    const tuning_t *t = &tuning[k];
+
+    memcpy((uint8_t *)P8, t->P8, sizeof(t->P8));
+    memcpy((uint8_t *)I8, t->I8, sizeof(t->I8));
+    memcpy((uint8_t *)D8, t->D8, sizeof(t->D8));
+    rcRate8 = t->rcRate8;
+    rcExpo8 = t->rcExpo8;
+    rollPitchRate = t->rollPitchRate;
+    yawRate = t->yawRate;
+    dynThrPID = t->dynThrPID;
+    memcpy(tpaCurve, t->tpaCurve, sizeof(t->tpaCurve));
+}
 
-        for (axis = 0; axis < 3; axis++) {
-            // empirical, we take a weighted value of the current and the previous values
-            // /4 is to average 4 values, note: overflow is not possible for WMP gyro here
-            gyroData[axis] = (gyroADC[axis] * 3 + gyroADCprevious[axis] + 2) / 4;
-            gyroADCprevious[axis] = gyroADC[axis];
-        }
-    } else {
-        if (ACC) {
-            ACC_getADC();
-            getEstimatedAttitude();
-#if BARO
-        getEstimatedAltitude();
-#endif                          /* BARO */
-        }
-#if GYRO
-        Gyro_getADC();
-#else
-        WMP_getRawADC();
-#endif                          /* GYRO */
+// switch to profile k: two copies of about 60 bytes, nothing is worked out
+static void tuningSelect(uint8_t k)
+{
+    tuningLoad(k);
+    memcpy(lookupRX, tuningTables[k].lookupRX, sizeof(lookupRX));
+    memcpy(tpaLookup, tuningTables[k].tpaLookup, sizeof(tpaLookup));
+    memcpy(rateSlope, tuningTables[k].rateSlope, sizeof(rateSlope));
+    rcShapeStale = 1;
+    tuningActive = k;
+}
+#endif
 
-        for (axis = 0; axis < 3; axis++)
-            gyroADCp[axis] = gyroADC[axis];
-        timeInterleave = micros();
-        annexCode();
-        while ((micros() - timeInterleave) < 650);  //empirical, interleaving delay between 2 consecutive reads
-#if GYRO
-        Gyro_getADC();
-#else
-        WMP_getRawADC();
+// values derived from the parameters
+static void paramApply(void)
+{
+#if defined(TUNING_PROFILES)
+    uint8_t i;
 #endif
-        for (axis = 0; axis < 3; axis++) {
-            gyroADCinter[axis] = gyroADC[axis] + gyroADCp[axis];
-            // empirical, we take a weighted value of the current and the previous values
-            gyroData[axis] = (gyroADCinter[axis] + gyroADCprevious[axis] + 1) / 3;
-            gyroADCprevious[axis] = gyroADCinter[axis] / 2;
-            if (!ACC)
-                accADC[axis] = 0;
-        }
-    }
 
-    if (mixerConfiguration == MULTITYPE_TRI) { 
-        gyroData[YAW] = (gyroYawSmooth * 2 + gyroData[YAW] + 1) / 3;
-        gyroYawSmooth = gyroData[YAW];
+#if defined(SIM_MIXER)
+    mixerConfiguration = SIM_MIXER;     // host simulator: the frame type is fixed by the build
+#elif defined(FIXED_FRAME)
+    mixerConfiguration = FIXED_FRAME;   // whatever an older firmware left in the EEPROM
+#endif
+
+#if defined(POWERMETER)
+    pAlarm = (uint32_t) powerTrigger1 *(uint32_t) PLEVELSCALE *(uint32_t) PLEVELDIV;    // need to cast before multiplying
+#endif
+#if defined(TUNING_PROFILES)
+    // the tables of every profile, worked out in the variables in use, which then get the one picked back.
+    // tuning[] is up to date: readEEPROM() filled it, writeParams() stored the edits in it
+    for (i = 0; i < TUNING_PROFILES; i++) {
+        tuningLoad(i);
+        tuningDerive();
+        memcpy(tuningTables[i].lookupRX, lookupRX, sizeof(lookupRX));
+        memcpy(tuningTables[i].tpaLookup, tpaLookup, sizeof(tpaLookup));
+        memcpy(tuningTables[i].rateSlope, rateSlope, sizeof(rateSlope));
     }
+    tuningSelect(tuningActive);
+#else
+    tuningDerive();
+#endif
+    if (gyroDlpf > 6)
+        gyroDlpf = 6;
+    pwmServoRate(servoRate);
+    // different rate and lag, and the bias can move with them: recalibrate, which also re-times the filters
+    // (gyroDev is still NULL for the load before initSensors(), init() writes the config itself)
+    if (gyroDev && gyroDev->setConfig && gyroDev->setConfig() && !armed)
+        calibratingG = 400;
+    filterSetup();
 }
 
-#if defined(STAB_OLD_17)
-/// OLD CODE from 1.7 ////
-// ************************************
-// simplified IMU based on Kalman Filter
-// inspired from http://starlino.com/imu_guide.html
-// and http://www.starlino.com/imu_kalman_arduino.html
-// for angles under 25deg, we use an approximation to speed up the angle calculation
-// magnetometer addition for small angles
-// ************************************
-void getEstimatedAttitude()
+void readEEPROM(void)
 {
-    uint8_t axis;
-    float R, RGyro[3];          //R obtained from last estimated value and gyro movement;
-    static float REst[3] = { 0, 0, 1 }; // init acc in stable mode
-    static float A[2];          //angles between projection of R on XZ/YZ plane and Z axis (in Radian)
-    float wGyro = 300;          // gyro weight/smooting factor
-    float invW = 1.0 / (1 + 300);
-    float gyroFactor;
-    static uint8_t small_angle = 1;
-    static uint16_t tPrevious;
-    uint16_t tCurrent, deltaTime;
-    float a[2], mag[2], cos_[2];
-
-    tCurrent = micros();
-    deltaTime = tCurrent - tPrevious;
-    tPrevious = tCurrent;
+#if defined(TUNING_PROFILES)
+    uint8_t i;
+#endif
 
-#if GYRO
-    gyroFactor = deltaTime / 300e6;     //empirical
+#if defined(BIT_EXACT)
+    paramValid = 0;                     // the defaults of checkFirstTime(), the same on the host and every board
 #else
-    gyroFactor = deltaTime / 200e6;     //empirical, depends on WMP on IDG datasheet, tied of deg/ms sensibility
+    eeprom_open();
+    paramValid = paramLoad();
+    eeprom_close();
+#endif
+#if defined(TUNING_PROFILES)
+    // profiles that were never stored start out as copies of profile 1
+    for (i = 1; i < TUNING_PROFILES; i++)
+        if (paramAddr[paramIndex(28 + i)] == PARAM_NONE)
+            tuning[i] = tuning[0];
 #endif
+    paramApply();
+}
 
-    for (axis = 0; axis < 2; axis++)
-        a[axis] = gyroADC[axis] * gyroFactor;
-    for (axis = 0; axis < 3; axis++)
-        accSmooth[axis] = (accSmooth[axis] * 7 + accADC[axis] + 4) / 8;
+void writeParams(void)
+{
+#if defined(TUNING_PROFILES)
+    tuningStore(tuningActive);
+#endif
+    paramApply();
+    paramDirty = 1;
+    paramDirtyTime = currentTime;
+}
 
-    if (accSmooth[YAW] > 0) {   //we want to be sure we are not flying inverted  
-        // a very nice trigonometric approximation: under 25deg, the error of this approximation is less than 1 deg:
-        //   sin(x) =~= x =~= arcsin(x)
-        //   angle_axis = arcsin(ACC_axis/ACC_1G) =~= ACC_axis/ACC_1G
-        // the angle calculation is much more faster in this case
-        if (accSmooth[ROLL] < acc_25deg && accSmooth[ROLL] > -acc_25deg && accSmooth[PITCH] < acc_25deg && accSmooth[PITCH] > -acc_25deg) {
-            for (axis = 0; axis < 2; axis++) {
-                A[axis] += a[axis];
-                A[axis] = ((float) accSmooth[axis] / acc_1G + A[axis] * wGyro) * invW;  // =~= sin axis
-#if MAG
-                cos_[axis] = 1 - A[axis] * A[axis] / 2; // cos(x) =~= 1-x^2/2
+void paramTask(void)
+{
+#if !defined(BIT_EXACT)                 // the parity image keeps the EEPROM as it was
+    if (!paramDirty || armed || currentTime - paramDirtyTime < PARAM_COMMIT_DELAY)
+        return;
+    paramCommit();
+    ledBlink(15);
 #endif
-            }
-            small_angle = 1;
-        } else {
-            //magnitude vector size
-            R = sqrt(square(accSmooth[ROLL]) + square(accSmooth[PITCH]) + square(accSmooth[YAW]));
-            for (axis = 0; axis < 2; axis++) {
-                if (acc_1G * 3 / 5 < R && R < acc_1G * 7 / 5 && small_angle == 0)       //if accel magnitude >1.4G or <0.6G => we neutralize the effect of accelerometers in the angle estimation
-                    A[axis] = atan2(REst[axis], REst[YAW]);
-                A[axis] += a[axis];
-                cos_[axis] = cos(A[axis]);
-                RGyro[axis] = sin(A[axis]) / sqrt(1.0 + square(cos_[axis]) * square(tan(A[1 - axis]))); //reverse calculation of RwGyro from Awz angles
-            }
-            RGyro[YAW] = sqrt(abs(1.0 - square(RGyro[ROLL]) - square(RGyro[PITCH])));
-            for (axis = 0; axis < 3; axis++)
-                REst[axis] = (accADC[axis] / R + wGyro * RGyro[axis]) * invW;   //combine Accelerometer and gyro readings
-            small_angle = 0;
+}
+
+static uint16_t crc16(uint16_t crc, const uint8_t *p, uint8_t n)
+{
+    uint8_t i;
+
+    while (n--) {
+        crc ^= (uint16_t)*p++ << 8;
+        for (i = 0; i < 8; i++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// CRC-16/CCITT of what the EEPROM holds, for the 'j' command: id, size, data of the newest record of every
+// entry in table order, an entry without a record adds only its id. After a commit this matches the same
+// sum over the values 'J' reads back, which is how fleet_config checks that a profile really went to flash
+static uint16_t paramStoredCrc(uint8_t *stored)
+{
+    uint8_t rec[PARAM_DATA_MAX + 2];
+    uint16_t crc = 0xFFFF;
+    uint8_t i;
+
+    *stored = 0;
+    for (i = 0; i < EEBLOCK_SIZE; i++) {
+        if (paramAddr[i] == PARAM_NONE) {
+            rec[0] = eep_entry[i].id;
+            crc = crc16(crc, rec, 1);
+            continue;
         }
-#if defined(HMC5843) || defined(HMC5883)
-        mag[PITCH] = -magADC[PITCH] * cos_[PITCH] + magADC[ROLL] * A[ROLL] * A[PITCH] + magADC[YAW] * cos_[ROLL] * A[PITCH];
-        mag[ROLL] = magADC[ROLL] * cos_[ROLL] - magADC[YAW] * A[ROLL];
-        heading = -degrees(atan2(mag[PITCH], mag[ROLL]));
-#endif
+        eeprom_read_block(rec, (void *)paramAddr[i], eep_entry[i].size + 2);
+        crc = crc16(crc, rec, eep_entry[i].size + 2);
+        (*stored)++;
     }
-    for (axis = 0; axis < 2; axis++)
-        angle[axis] = A[axis] * 572.9577951;    //angle in multiple of 0.1 degree
+    return crc;
 }
 
-#else
+// CRC-32 of a flash range for the 'v' command, see crc_start() in sysdep.h: how the firmware update tool tells
+// the board already runs the image without a trip through the bootloader
+static uint32_t crcCheckAddress, crcCheckWords;
+static uint8_t crcCheckState = 0;       // 0 done (or never asked), 1 running, 2 refused
 
-// **************************************************
-// Simplified IMU based on "Complementary Filter"
-// Inspired by http://starlino.com/imu_guide.html
-//
-// adapted by ziss_dm : http://wbb.multiwii.com/viewtopic.php?f=8&t=198
-//
-// The following ideas was used in this project:
-// 1) Rotation matrix: http://en.wikipedia.org/wiki/Rotation_matrix
-// 2) Small-angle approximation: http://en.wikipedia.org/wiki/Small-angle_approximation
-// 3) C. Hastings approximation for atan2()
-// 4) Optimization tricks: http://www.hackersdelight.org/
-//
-// Currently Magnetometer uses separate CF which is used only
-// for heading approximation.
-//
-// Last Modified: 19/04/2011
-// Version: V1.1
-//
-// code size deduction and tmp vector intermediate step for vector rotation computation: October 2011 by Alex
-// **************************************************
+static void crcCheck(const uint8_t *p)
+{
+    crcCheckAddress = p[0] | (uint16_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    crcCheckWords = p[4] | (uint16_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+    crcCheckState = crc_start(crcCheckAddress, crcCheckWords) ? 1 : 2;
+}
 
-//******  advanced users settings *******************
-/* Set the Low Pass Filter factor for ACC */
-/* Increasing this value would reduce ACC noise (visible in GUI), but would increase ACC lag time*/
-/* Comment this if  you do not want filter at all.*/
-/* Default WMC value: 8*/
-#define ACC_LPF_FACTOR 8
+void crcTask(void)
+{
+    if (crcCheckState == 1 && !crc_busy())
+        crcCheckState = 0;
+}
 
-/* Set the Low Pass Filter factor for Magnetometer */
-/* Increasing this value would reduce Magnetometer noise (not visible in GUI), but would increase Magnetometer lag time*/
-/* Comment this if  you do not want filter at all.*/
-/* Default WMC value: n/a*/
-//#define MG_LPF_FACTOR 4
+void checkFirstTime(void)
+{
+    uint8_t i;
 
-/* Set the Gyro Weight for Gyro/Acc complementary filter */
-/* Increasing this value would reduce and delay Acc influence on the output of the filter*/
-/* Default WMC value: 300*/
-#define GYR_CMPF_FACTOR 310.0f
+    if (paramValid)
+        return;
 
-/* Set the Gyro Weight for Gyro/Magnetometer complementary filter */
-/* Increasing this value would reduce and delay Magnetometer influence on the output of the filter*/
-/* Default WMC value: n/a*/
-#define GYR_CMPFM_FACTOR 200.0f
+    P8[ROLL] = 40;
+    I8[ROLL] = 30;
+    D8[ROLL] = 23;
+    P8[PITCH] = 40;
+    I8[PITCH] = 30;
+    D8[PITCH] = 23;
+    P8[YAW] = 85;
+    I8[YAW] = 0;
+    D8[YAW] = 0;
+    P8[PIDALT] = 47;
+    I8[PIDALT] = 0;
+    D8[PIDALT] = 0;
+    P8[PIDVEL] = 0;
+    I8[PIDVEL] = 0;
+    D8[PIDVEL] = 0;
+    P8[PIDLEVEL] = 90;
+    I8[PIDLEVEL] = 45;
+    P8[PIDMAG] = 40;
+    rcRate8 = 45;               // = 0.9 in GUI
+    rcExpo8 = 65;
+    rollPitchRate = 0;
+    yawRate = 0;
+    dynThrPID = 0;
+    for (i = 0; i < 8; i++)
+        tpaCurve[i] = 0;
+    for (i = 0; i < 8; i++)
+        activate[i] = 0;
+    accTrim[0] = 0;
+    accTrim[1] = 0;
+    powerTrigger1 = 0;
+    mixerConfiguration = MULTITYPE_QUADX;
+    gimbalFlags = 0;
+    gimbalGainPitch = 10;
+    gimbalGainRoll = 10;
+    gimbalLead = 0;
+#if !defined(PARAM_IN_PLACE)
+    servoRate = SERVO_RATE_DEFAULT;     // else the default while there is no record
+#endif
+    serialSpeed = 0;
+#if defined(TUNING_PROFILES)
+    for (i = 0; i < TUNING_PROFILES; i++)
+        tuningStore(i);
+    activateProfile[0] = activateProfile[1] = 0;
+#endif
+    paramApply();
+#if !defined(BIT_EXACT)
+    paramCommit();
+#endif
+    ledBlink(15);               // played once the scheduler runs
+}
 
-//****** end of advanced users settings *************
+/* RX -------------------------------------------------------------------------------- */
+static uint8_t pinRcChannel[8] = { ROLLPIN, PITCHPIN, YAWPIN, THROTTLEPIN, AUX1PIN, AUX2PIN, CAM1PIN, CAM2PIN };
+volatile uint16_t rcPinValue[8] = { 1500, 1500, 1500, 1500, 1500, 1500, 1500, 1500 };   // interval [1000;2000]
 
-#define INV_GYR_CMPF_FACTOR   (1.0f / (GYR_CMPF_FACTOR  + 1.0f))
-#define INV_GYR_CMPFM_FACTOR  (1.0f / (GYR_CMPFM_FACTOR + 1.0f))
-#if GYRO
-// #define GYRO_SCALE ((2000.0f * PI)/((32767.0f / 4.0f ) * 180.0f * 1000000.0f) * 1.155f)
-#define GYRO_SCALE ((2380 * PI)/((32767.0f / 4.0f ) * 180.0f * 1000000.0f))     //should be 2279.44 but 2380 gives better result
+// ***PPM SUM SIGNAL***
+#if defined(SPEKTRUM)
+static uint8_t rcChannel[8] = { PITCH, YAW, THROTTLE, ROLL, AUX1, AUX2, CAMPITCH, CAMROLL };     // throttle, aileron, elevator, rudder, gear, aux..
+#elif defined(SBUS)
+static uint8_t rcChannel[8] = { SBUS };
+#elif defined(SERIAL_RC)
+static uint8_t rcChannel[8] = { SERIAL_RC };
+#elif defined(RCPWM)
+static uint8_t rcChannel[8] = { RCPWM };
+#elif defined(SERIAL_SUM_PPM)
+static uint8_t rcChannel[8] = { SERIAL_SUM_PPM };
+#endif
+volatile uint16_t rcValue[8] = { 1500, 1500, 1500, 1500, 1500, 1500, 1500, 1500 };      // interval [1000;2000]
 
-// +-2000/sec deg scale
-// #define GYRO_SCALE ((200.0f * PI)/((32768.0f / 5.0f / 4.0f ) * 180.0f * 1000000.0f) * 1.5f)
-// +- 200/sec deg scale
-// 1.5 is emperical, not sure what it means
-// should be in rad/sec
-#else
-#define GYRO_SCALE (1.0f/200e6f)
-  // empirical, depends on WMP on IDG datasheet, tied of deg/ms sensibility
-  // !!!!should be adjusted to the rad/sec
+#if defined(STM8) && defined(SERIAL_SUM_PPM)
+static uint16_t rcFrame[8];     // frame being assembled by the capture interrupt, copied to rcValue[] at the sync gap
+/* for single channel PWM input mode */
+static uint16_t riseValue = 0;
+static uint16_t fallValue = 0;
+static uint8_t captureState = 0;
+static uint8_t usePPM = 1;
 #endif
-// Small angle approximation
-#define ssin(val) (val)
-#define scos(val) 1.0f
 
-typedef struct fp_vector {
-    float X;
-    float Y;
-    float Z;
-} t_fp_vector_def;
+#if defined(SPEKTRUM)
+// Satellite frame, one every 11 or 22ms: two header bytes (fades, system) then 7 big endian words
+// F C3 C2 C1 C0 D.. with the channel number and its position, 10 bits in 1024 mode, 11 bits in 2048 mode.
+// Bytes of a frame come back to back, a gap of more than SPEK_FRAME_GAP starts a new one.
+#define SPEK_SPEED          115200
+#define SPEK_FRAME_SIZE     16
+#define SPEK_FRAME_GAP      5000
+#if (SPEKTRUM == 2048)
+#define SPEK_CHAN_SHIFT     3
+#define SPEK_DATA_MASK      0x07ff
+#define SPEK_DATA_SHIFT     1
+#else
+#define SPEK_CHAN_SHIFT     2
+#define SPEK_DATA_MASK      0x03ff
+#define SPEK_DATA_SHIFT     0
+#endif
 
-typedef union {
-    float A[3];
-    t_fp_vector_def V;
-} t_fp_vector;
+// runs from the UART RX interrupt
+static void spektrumReceive(uint8_t c)
+{
+    static uint8_t frame[SPEK_FRAME_SIZE];
+    static uint8_t count = 0;
+    static uint32_t last = 0;
+    uint32_t now = microsISR();
+    uint8_t i, chan;
+
+    if (now - last > SPEK_FRAME_GAP)
+        count = 0;
+    last = now;
+    if (count >= SPEK_FRAME_SIZE)
+        return;             // anything past a whole frame is noise until the next gap
+    frame[count++] = c;
+    if (count < SPEK_FRAME_SIZE)
+        return;
 
-// comeon guys. endian anyone??
-#define fp_is_neg(val) ((((unsigned char *)&val)[0] & 0x80) != 0)
+    for (i = 2; i < SPEK_FRAME_SIZE; i += 2) {
+        chan = (frame[i] >> SPEK_CHAN_SHIFT) & 0x0f;    // unused slots are 0xffff, channel 15
+        if (chan < 8)
+            rcValue[chan] = 988 + ((((uint16_t)frame[i] << 8 | frame[i + 1]) & SPEK_DATA_MASK) >> SPEK_DATA_SHIFT);
+    }
+    rcFrameTime = now;
+    rcLinkTime = now;
+    seq_publish(&rcFrameCount);
+    rcFrameComplete = 1;
+    PROBE_HI(PROBE_LATENCY);
+}
+#endif
 
-int16_t _atan2(float y, float x)
+#if defined(SBUS)
+// Futaba S.BUS, 100000 baud 8E2 on an inverted line. A frame is 25 bytes every 7 or 14ms: 0x0F, 16 channels of
+// 11 bits packed LSB first, a flag byte and an end byte (0x00, S.BUS2 puts its slot number in the high nibble).
+// Bytes come 120us apart, a gap of more than SBUS_FRAME_GAP starts a new frame. Only the first 8 channels
+// are used, that's all rcValue[] has.
+#define SBUS_SPEED          100000
+#define SBUS_FRAME_SIZE     25
+#define SBUS_FRAME_GAP      2000
+#define SBUS_START          0x0F
+#define SBUS_FLAG_LOST      0x04        // receiver missed this frame and repeats the last one
+#define SBUS_FLAG_FAILSAFE  0x08        // receiver is in failsafe, the channels are its presets
+
+// runs from the UART RX interrupt
+static void sbusReceive(uint8_t c)
 {
-    float z = y / x;
-    int16_t zi = abs(((int16_t) (z * 100)));
-    int8_t y_neg = fp_is_neg(y);
-    if (zi < 100) {
-        if (zi > 10)
-            z = z / (1.0f + 0.28f * z * z);
-        if (fp_is_neg(x)) {
-            if (y_neg)
-                z -= PI;
-            else
-                z += PI;
+    static uint8_t frame[SBUS_FRAME_SIZE];
+    static uint8_t count = 0;
+    static uint32_t last = 0;
+    uint32_t now = microsISR();
+    uint32_t bits = 0;
+    uint8_t i, have, chan, flags;
+
+    if (now - last > SBUS_FRAME_GAP)
+        count = 0;
+    last = now;
+    if (count >= SBUS_FRAME_SIZE || (count == 0 && c != SBUS_START))
+        return;             // noise until the next gap
+    frame[count++] = c;
+    if (count < SBUS_FRAME_SIZE)
+        return;
+    if (frame[SBUS_FRAME_SIZE - 1] & 0x0B)
+        return;             // not an end byte, out of step
+
+    // a receiver in failsafe gets no new values and no link time, as if nothing came in
+    flags = frame[23];
+    if (flags & SBUS_FLAG_FAILSAFE)
+        return;
+
+    i = 1;
+    have = 0;
+    for (chan = 0; chan < 8; chan++) {
+        while (have < 11) {
+            bits |= (uint32_t)frame[i++] << have;
+            have += 8;
         }
-    } else {
-        z = (PI / 2.0f) - z / (z * z + 0.28f);
-        if (y_neg)
-            z -= PI;
+        rcValue[chan] = 880 + (((uint16_t)bits & 0x07ff) * 5 >> 3);     // 172..1811 is 987..2011us, 992 is 1500
+        bits >>= 11;
+        have -= 11;
     }
-    z *= (180.0f / PI * 10);
-    return z;
+    rcFrameTime = now;
+    // a lost frame is a repeat, it keeps the sticks where they were but doesn't count as a link
+    if (!(flags & SBUS_FLAG_LOST))
+        rcLinkTime = now;
+    seq_publish(&rcFrameCount);
+    rcFrameComplete = 1;
+    PROBE_HI(PROBE_LATENCY);
 }
+#endif
 
-// Rotate Estimated vector(s) with small angle approximation, according to the gyro data
-void rotateV(struct fp_vector *v, float *delta)
+#if defined(SERIAL_RC)
+// Framed RC from a companion computer or a ground link: SERIALRC_SYNC, SERIALRC_LEN, then 8 channels of 16 bits,
+// little endian in us and in the SERIAL_RC order, then a CRC-8 (polynomial 0xD5) of the length and channel bytes.
+// Parsed a byte at a time in the UART RX interrupt, so the frame is published the moment its last byte is in.
+// Anything that doesn't check out is dropped and the parser waits for the next sync. At SERIALRC_SPEED a frame
+// takes 1.7ms on the wire, the sender picks the rate.
+#define SERIALRC_SPEED      115200
+#define SERIALRC_SYNC       0x5A
+#define SERIALRC_LEN        16
+#define SERIALRC_MIN        750
+#define SERIALRC_MAX        2250
+
+static uint8_t serialRcCrc(uint8_t crc, uint8_t c)
 {
-    struct fp_vector v_tmp = *v;
+    uint8_t i;
+
+    crc ^= c;
+    for (i = 0; i < 8; i++)
+        crc = crc & 0x80 ? (crc << 1) ^ 0xD5 : crc << 1;
+    return crc;
+}
+
+// runs from the UART RX interrupt
+static void serialRcReceive(uint8_t c)
+{
+    static uint8_t frame[SERIALRC_LEN];
+    static uint8_t pos = 0;             // 0 waits for the sync, 1 for the length, then the channels and the CRC
+    static uint8_t crc;
+    uint16_t v;
+    uint8_t chan;
+
+    if (pos == 0) {
+        if (c == SERIALRC_SYNC)
+            pos = 1;
+        return;
+    }
+    if (pos == 1) {
+        pos = c == SERIALRC_LEN ? 2 : 0;
+        crc = serialRcCrc(0, c);
+        return;
+    }
+    if (pos < 2 + SERIALRC_LEN) {
+        frame[pos++ - 2] = c;
+        crc = serialRcCrc(crc, c);
+        return;
+    }
+    pos = 0;
+    if (c != crc)
+        return;
+    for (chan = 0; chan < 8; chan++) {
+        v = frame[chan * 2] | frame[chan * 2 + 1] << 8;
+        if (v < SERIALRC_MIN || v > SERIALRC_MAX)
+            return;
+    }
+    for (chan = 0; chan < 8; chan++)
+        rcValue[chan] = frame[chan * 2] | frame[chan * 2 + 1] << 8;
+    rcFrameTime = rcLinkTime = microsISR();
+    seq_publish(&rcFrameCount);
+    rcFrameComplete = 1;
+    PROBE_HI(PROBE_LATENCY);
+}
+#endif
+
+#if defined(RCPWM)
+// Parallel PWM: the pulses land in rcPwmFrame[] as they come and go out as one frame, so computeRC() never
+// mixes two periods. Receivers send their channels one after the other or all at once, either way the frame is
+// over when every input has a new pulse, or when one comes round again first (fewer leads than inputs), as
+// long as the four sticks are in it.
+#define RCPWM_MIN           750
+#define RCPWM_MAX           2250
+
+static uint16_t rcPwmFrame[8] = { 1500, 1500, 1500, 1500, 1500, 1500, 1500, 1500 };
+static uint8_t rcPwmInputs = 0;
+static uint8_t rcPwmSeen = 0;
+
+static void rcPwmPublish(void)
+{
+    uint8_t chan;
+
+    for (chan = 0; chan < 8; chan++)
+        rcValue[chan] = rcPwmFrame[chan];
+    rcFrameTime = rcLinkTime = microsISR();
+    seq_publish(&rcFrameCount);
+    rcFrameComplete = 1;
+    PROBE_HI(PROBE_LATENCY);
+}
+
+// runs from the timer capture interrupt
+static void rcPwmPulse(uint8_t input, uint16_t width)
+{
+    uint8_t bit = 1 << input;
+
+    if (input == RCPWM_SYNC) {
+        // end of a PPM sum frame, however many channels it had
+        if ((rcPwmSeen & 0x0F) == 0x0F)
+            rcPwmPublish();
+        rcPwmSeen = 0;
+        return;
+    }
+    if (input >= 8 || width < RCPWM_MIN || width > RCPWM_MAX)
+        return;             // glitch or no signal, the link ages
+    if (rcPwmSeen & bit) {
+        if ((rcPwmSeen & 0x0F) == 0x0F)
+            rcPwmPublish();
+        rcPwmSeen = 0;
+    }
+    rcPwmFrame[input] = width;
+    rcPwmSeen |= bit;
+    if (rcPwmSeen == (uint8_t)((1 << rcPwmInputs) - 1)) {
+        rcPwmPublish();
+        rcPwmSeen = 0;
+    }
+}
+#endif
+
+// Configure receiver pins
+void configureReceiver(void)
+{
+    uint8_t chan, a;
+#if defined(SPEKTRUM)
+    rcSerial_init(SPEK_SPEED, RCSERIAL_8N1, spektrumReceive);
+#elif defined(SBUS)
+    rcSerial_init(SBUS_SPEED, RCSERIAL_8E2, sbusReceive);
+#elif defined(SERIAL_RC)
+    rcSerial_init(SERIALRC_SPEED, RCSERIAL_8N1, serialRcReceive);
+#elif defined(RCPWM)
+    rcPwmInputs = rcPwm_init(rcPwmPulse);
+#elif defined(STM8)
+#if defined(SERIAL_SUM_PPM)
+    for (chan = 0; chan < 8; chan++)
+        rcFrame[chan] = rcValue[chan];
+#endif
+    // Configure GPIO pin for ppm input
+    GPIO_Init(GPIOD, GPIO_PIN_2, GPIO_MODE_IN_FL_NO_IT);
+
+    // when we're in camera gimbal mode, allow single PWM rx input for tilt compensation. useful? no idea.
+    if ((mixerConfiguration == MULTITYPE_GIMBAL) && (gimbalFlags & GIMBAL_TILTONLY))
+        usePPM = 0;
+
+    TIM3_TimeBaseInit(TIM3_PRESCALER_8, 0xFFFF);
+    TIM3_ICInit(TIM3_CHANNEL_1, TIM3_ICPOLARITY_RISING, TIM3_ICSELECTION_DIRECTTI, TIM3_ICPSC_DIV1, 0x0);
+    TIM3_ITConfig(TIM3_IT_CC1, ENABLE);
+    TIM3_Cmd(ENABLE);
+#endif
+}
+
+#if defined(STM8) && defined(SERIAL_SUM_PPM)
+__near __interrupt void TIM3_CAP_COM_IRQHandler(void)
+{
+    uint16_t diff;
+    static uint16_t now;
+    static uint16_t last = 0;
+    static uint8_t chan = 0;
+
+#if defined(ADCGYRO)
+    if (TIM3->SR1 & TIM3_SR1_CC2IF) {
+        TIM3->SR1 = (uint8_t)~TIM3_SR1_CC2IF;
+        adcTrigger();
+        if (!(TIM3->SR1 & TIM3_SR1_CC1IF))
+            return;
+    }
+#endif
+
+    if (tim3_cc1Pending()) {
+        last = now;
+        now = tim3_capture1();
+    }
+
+    tim3_cc1Clear();
+
+    if (!usePPM) {
+        // single-channel PWM input
+        if (captureState == 0)
+            riseValue = now;
+        else
+            fallValue = now;
+
+        if (captureState == 0) {
+            // switch states
+            captureState = 1;
+            tim3_cc1Falling(1);
+        } else {
+            // capture compute
+            if (fallValue > riseValue)
+                rcValue[PITCH] = fallValue - riseValue;
+            else
+                rcValue[PITCH] = (0xffff - riseValue) + fallValue;
+            
+            // 0.5us resolution, so we halve it for real stuff. And it ends up in the PITCH channel (camera tilt use)
+            rcValue[PITCH] >>= 1;
+            rcFrameTime = rcLinkTime = microsISR();
+            seq_publish(&rcFrameCount);
+            rcFrameComplete = 1;
+            PROBE_HI(PROBE_LATENCY);
+
+            // switch state
+            captureState = 0;
+            tim3_cc1Falling(0);
+        }
+        return;
+    }
+
+    if (now > last) {
+        diff = (now - last);
+    } else {
+        diff = ((0xFFFF - last) + now);
+    }
+
+    if (diff > 8000) {
+        // sync gap: publish the frame if it had at least the four sticks
+        if (chan >= 4) {
+            for (chan = 0; chan < 8; chan++)
+                rcValue[chan] = rcFrame[chan];
+            rcFrameTime = rcLinkTime = microsISR();
+            seq_publish(&rcFrameCount);
+            rcFrameComplete = 1;
+            PROBE_HI(PROBE_LATENCY);
+        }
+        chan = 0;
+    } else {
+        if (diff > 1500 && diff < 4500 && chan < 8)     // div2, 750 to 2250 ms Only if the signal is between these values it is valid
+            rcFrame[chan] = diff >> 1;
+        chan++;
+    }
+}
+#endif
+
+uint16_t readRawRC(uint8_t chan)
+{
+    return rcValue[rcChannel[chan]];                
+}
+
+// Runs once per received frame. Each channel goes through a first order IIR (alpha 1/2, state in 1/4us)
+// and rcData[] follows the filtered value with the same +-3us hysteresis the old 4 sample mean had.
+void computeRC()
+{
+    static int16_t rcFilter[8] = { 6000, 6000, 6000, 6000, 6000, 6000, 6000, 6000 };
+    uint16_t raw[8];
+    uint8_t chan, frame;
+    int16_t mean;
+#if defined(RC_INTERPOLATION)
+    static uint32_t lastFrameTime = 0;
+    uint32_t at, dt;
+#endif
+
+    // the frame is only rewritten at the next sync, but retry if one slipped in while copying
+    do {
+        frame = seq_begin(&rcFrameCount);
+        rcFrameComplete = 0;
+        for (chan = 0; chan < 8; chan++)
+            raw[chan] = readRawRC(chan);
+#if defined(RC_INTERPOLATION)
+        at = rcFrameTime;
+#endif
+    } while (seq_retry(&rcFrameCount, frame));
+
+#if defined(RC_INTERPOLATION)
+    dt = at - lastFrameTime;
+    lastFrameTime = at;
+    if (dt < RC_PERIOD_MIN || dt > RC_PERIOD_MAX)
+        rcFramePeriod = 0;
+    else if (rcFramePeriod == 0)
+        rcFramePeriod = dt;
+    else
+        rcFramePeriod += ((int16_t)dt - (int16_t)rcFramePeriod) >> 2;
+    if (rcFramePeriod)
+        rcFrameInvQ24 = 16777216UL / rcFramePeriod;
+#endif
+
+    for (chan = 0; chan < 8; chan++) {
+        rcFilter[chan] += ((int16_t)(raw[chan] << 2) - rcFilter[chan]) >> 1;
+        mean = (rcFilter[chan] + 2) >> 2;
+        if (mean < rcData[chan] - 3)
+            rcData[chan] = mean + 2;
+        if (mean > rcData[chan] + 3)
+            rcData[chan] = mean - 2;
+    }
+}
+
+/* OUTPUT ------------------------------------------------------------------------------------- */
+void writeServos()
+{
+    if (!FRAME_SERVO)
+        return;
+
+    // STM8 PWM is actually 0.5us precision, so we double it
+    if (FRAME == MULTITYPE_TRI || FRAME == MULTITYPE_BI) {
+        /* One servo on Motor #4 */
+        pwmWrite(4, servo[0]);
+        if (FRAME == MULTITYPE_BI)
+            pwmWrite(5, servo[1]);
+    } else {
+        /* Two servos for camstab or FLYING_WING */
+        pwmWrite(4, servo[1]);
+        pwmWrite(5, servo[2]);
+    }
+}
+
+#if defined(MOTOR_I2C)
+// BL-Ctrl ESCs on the I2C bus, one queued write job per motor, all of them from the same writeMotors(). A motor whose
+// last byte is still queued gets the new one in place, the job sends whatever is there when its turn comes. How the
+// previous job of a motor ended is counted when the next one is queued
+#define MOTOR_I2C_MAX       8
+
+static i2cJob_t escJob[MOTOR_I2C_MAX];
+static uint8_t escByte[MOTOR_I2C_MAX];
+static uint16_t escNacks[MOTOR_I2C_MAX];        // address not acknowledged: no ESC there or it's in reset
+static uint16_t escErrors[MOTOR_I2C_MAX];       // anything else, jobs refused while the ESC is backed off too
+static uint8_t escCount = 0;
+
+// in initOutput(), which runs before initSensors(), so the bus is brought up here
+static void escInit(void)
+{
+    uint8_t i;
+
+    i2c_init();
+    for (i = 0; i < MOTOR_I2C_MAX; i++) {
+        escJob[i].address = MOTOR_I2C_ADDRESS + 2 * i;
+        escJob[i].subaddr = 0xFF;
+        escJob[i].buf = &escByte[i];
+        escJob[i].len = 1;
+        escJob[i].read = 0;
+        escJob[i].done = NULL;
+        escJob[i].status = I2C_SUCCESS;
+        i2c_deviceSpeed(escJob[i].address, 400000);
+    }
+}
+
+static void escWrite(const int16_t *value, uint8_t count)
+{
+    int16_t v;
+    uint8_t i, status;
+
+    if (++escCount < MOTOR_I2C_DIVIDER)
+        return;
+    escCount = 0;
+    if (count > MOTOR_I2C_MAX)
+        count = MOTOR_I2C_MAX;
+    for (i = 0; i < count; i++) {
+        v = (value[i] - 1000) >> 2;
+        escByte[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+        status = escJob[i].status;
+        if (status == I2C_PENDING)
+            continue;
+        if (status == I2C_SACK_FAILURE)
+            escNacks[i]++;
+        else if (status != I2C_SUCCESS)
+            escErrors[i]++;
+        i2c_submit(&escJob[i]);
+    }
+}
+#elif defined(MOTOR_CAN)
+// CAN ESCs: one broadcast frame with a byte per motor, then whatever the nodes sent since the last loop. A frame
+// that finds the TX queue full is dropped, the next loop's replaces it anyway
+#define MOTOR_CAN_MAX       8
+
+typedef struct {
+    uint16_t erpm;                      // / 100
+    uint16_t voltage;                   // 10mV
+    uint16_t current;                   // 10mA
+    uint8_t temperature;                // C
+    uint32_t time;                      // millis() it came, 0 never
+} escTelemetry_t;
+
+static escTelemetry_t escTelemetry[MOTOR_CAN_MAX];
+
+static void escInit(void)
+{
+    can_init(MOTOR_CAN_BITRATE);
+}
+
+static void escWrite(const int16_t *value, uint8_t count)
+{
+    canFrame_t frame;
+    escTelemetry_t *t;
+    int16_t v;
+    uint8_t i;
+
+    if (count > MOTOR_CAN_MAX)
+        count = MOTOR_CAN_MAX;
+    frame.id = MOTOR_CAN_ID;
+    frame.len = count;
+    for (i = 0; i < count; i++) {
+        v = (value[i] - 1000) >> 2;
+        frame.data[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+    can_send(&frame);
+
+    while (can_receive(&frame)) {
+        i = frame.id - (MOTOR_CAN_ID + 1);
+        if (frame.id <= MOTOR_CAN_ID || i >= MOTOR_CAN_MAX || frame.len < 7)
+            continue;
+        t = &escTelemetry[i];
+        t->erpm = frame.data[0] | frame.data[1] << 8;
+        t->voltage = frame.data[2] | frame.data[3] << 8;
+        t->current = frame.data[4] | frame.data[5] << 8;
+        t->temperature = frame.data[6];
+        t->time = millis() | 1;
+    }
+}
+#endif
+
+void writeMotors(void)
+{
+#if defined(MOTOR_I2C) || defined(MOTOR_CAN)
+    escWrite(motor, FRAME_MOTORS);
+#else
+    pwmWriteAll(motor, FRAME_MOTORS);
+#endif
+}
+
+void writeAllMotors(int16_t mc)
+{
+    uint8_t i;
+    // Sends commands to all motors
+    for (i = 0; i < FRAME_MOTORS; i++)
+        motor[i] = mc;
+    writeMotors();
+}
+
+// ************************************************************************************************************
+// Mixer tables, 1/64 fixed point. 85 and 43 are 4/3 and 2/3, 45 is 0.7
+// ************************************************************************************************************
+static const motorMix_t mixBi[] = {
+    { 64, +64, 0, 0 },                  //LEFT
+    { 64, -64, 0, 0 },                  //RIGHT
+};
+
+static const motorMix_t mixTri[] = {
+    { 64, 0, +85, 0 },                  //REAR
+    { 64, -64, -43, 0 },                //RIGHT
+    { 64, +64, -43, 0 },                //LEFT
+};
+
+static const motorMix_t mixQuadP[] = {
+    { 64, 0, +64, -64 },                //REAR
+    { 64, -64, 0, +64 },                //RIGHT
+    { 64, +64, 0, +64 },                //LEFT
+    { 64, 0, -64, -64 },                //FRONT
+};
+
+static const motorMix_t mixQuadX[] = {
+    { 64, -64, +64, -64 },              //REAR_R
+    { 64, -64, -64, +64 },              //FRONT_R
+    { 64, +64, +64, +64 },              //REAR_L
+    { 64, +64, -64, -64 },              //FRONT_L
+};
+
+static const motorMix_t mixY4[] = {
+    { 64, 0, +64, -64 },                //REAR_1 CW
+    { 64, -64, -64, 0 },                //FRONT_R CCW
+    { 64, 0, +64, +64 },                //REAR_2 CCW
+    { 64, +64, -64, 0 },                //FRONT_L CW
+};
+
+static const motorMix_t mixY6[] = {
+    { 64, 0, +85, +64 },                //REAR
+    { 64, -64, -43, -64 },              //RIGHT
+    { 64, +64, -43, -64 },              //LEFT
+    { 64, 0, +85, -64 },                //UNDER_REAR
+    { 64, -64, -43, +64 },              //UNDER_RIGHT
+    { 64, +64, -43, +64 },              //UNDER_LEFT
+};
+
+static const motorMix_t mixHex6[] = {
+    { 64, -32, +32, +64 },              //REAR_R
+    { 64, -32, -32, -64 },              //FRONT_R
+    { 64, +32, +32, +64 },              //REAR_L
+    { 64, +32, -32, -64 },              //FRONT_L
+    { 64, 0, -64, +64 },                //FRONT
+    { 64, 0, +64, -64 },                //REAR
+};
+
+static const motorMix_t mixHex6X[] = {
+    { 64, -32, +32, +64 },              //REAR_R
+    { 64, -32, -32, +64 },              //FRONT_R
+    { 64, +32, +32, -64 },              //REAR_L
+    { 64, +32, -32, -64 },              //FRONT_L
+    { 64, -64, 0, -64 },                //RIGHT
+    { 64, +64, 0, +64 },                //LEFT
+};
+
+static const motorMix_t mixOctoX8[] = {
+    { 64, -64, +64, -64 },              //REAR_R
+    { 64, -64, -64, +64 },              //FRONT_R
+    { 64, +64, +64, +64 },              //REAR_L
+    { 64, +64, -64, -64 },              //FRONT_L
+    { 64, -64, +64, +64 },              //UNDER_REAR_R
+    { 64, -64, -64, -64 },              //UNDER_FRONT_R
+    { 64, +64, +64, -64 },              //UNDER_REAR_L
+    { 64, +64, -64, +64 },              //UNDER_FRONT_L
+};
+
+static const motorMix_t mixOctoFlatP[] = {
+    { 64, +45, -45, +64 },              //FRONT_L
+    { 64, -45, -45, +64 },              //FRONT_R
+    { 64, -45, +45, +64 },              //REAR_R
+    { 64, +45, +45, +64 },              //REAR_L
+    { 64, 0, -64, -64 },                //FRONT
+    { 64, -64, 0, -64 },                //RIGHT
+    { 64, 0, +64, -64 },                //REAR
+    { 64, +64, 0, -64 },                //LEFT
+};
+
+static const motorMix_t mixOctoFlatX[] = {
+    { 64, +64, -32, +64 },              //MIDFRONT_L
+    { 64, -32, -64, +64 },              //FRONT_R
+    { 64, -64, +32, +64 },              //MIDREAR_R
+    { 64, +32, +64, +64 },              //REAR_L
+    { 64, +32, -64, -64 },              //FRONT_L
+    { 64, -64, -32, -64 },              //MIDFRONT_R
+    { 64, -32, +64, -64 },              //REAR_R
+    { 64, +64, +32, -64 },              //MIDREAR_L
+};
+
+static const motorMix_t mixWing[] = {
+    { 64, 0, 0, 0 },                    // throttle only, the servos do the rest
+};
+
+static const struct {
+    uint8_t motors;
+    const motorMix_t *mix;
+} mixers[MULTITYPE_CUSTOM] = {
+    { 0, NULL },
+    { 3, mixTri },                      // MULTITYPE_TRI
+    { 4, mixQuadP },                    // MULTITYPE_QUADP
+    { 4, mixQuadX },                    // MULTITYPE_QUADX
+    { 2, mixBi },                       // MULTITYPE_BI
+    { 0, NULL },                        // MULTITYPE_GIMBAL
+    { 6, mixY6 },                       // MULTITYPE_Y6
+    { 6, mixHex6 },                     // MULTITYPE_HEX6
+    { 1, mixWing },                     // MULTITYPE_FLYING_WING
+    { 4, mixY4 },                       // MULTITYPE_Y4
+    { 6, mixHex6X },                    // MULTITYPE_HEX6X
+    { 8, mixOctoX8 },                   // MULTITYPE_OCTOX8
+    { 8, mixOctoFlatP },                // MULTITYPE_OCTOFLATP
+    { 8, mixOctoFlatX },                // MULTITYPE_OCTOFLATX
+};
+
+static const motorMix_t *motorMixer = mixQuadX;
+
+// camera stabilization, servo offset for one axis: the attitude, led by gimbalLead of the gyro rate so the
+// servo gets to where the frame is going instead of where it was. Every loop, from the same estimate the PID uses
+static int16_t gimbalTilt(int8_t gain, uint8_t axis)
+{
+    attitudeAngles();
+    return (int32_t)gain * (angle[axis] + ((int32_t)gyroData[axis] * gimbalLead >> (8 + GYRO_FRAC))) / 16;
+}
+
+// numberMotor and motorMixer[] for mixerConfiguration
+static void mixerSelect(void)
+{
+    if (mixerConfiguration == MULTITYPE_CUSTOM) {
+        numberMotor = min(customMixer.motors, 8);
+        motorMixer = customMixer.mix;
+    } else if (mixerConfiguration > 0 && mixerConfiguration < MULTITYPE_CUSTOM) {
+        numberMotor = mixers[mixerConfiguration].motors;
+        motorMixer = mixers[mixerConfiguration].mix;
+    } else
+        numberMotor = 0;
+}
+
+void initOutput()
+{
+    if (FRAME == MULTITYPE_BI || FRAME == MULTITYPE_TRI || FRAME == MULTITYPE_GIMBAL || FRAME == MULTITYPE_FLYING_WING)
+        useServo = 1;
+
+#if defined(SERVO_TILT)
+    useServo = 1;
+#endif
+
+    mixerSelect();
+
+    // This handles motor and servo initialization in one place. The ESCs see idle from here on, the timers
+    // keep the pulses going (with MOTOR_ONESHOT or MOTOR_DSHOT from the first loop) while the sensors come up
+    pwmInit(useServo);
+#if defined(MOTOR_I2C) || defined(MOTOR_CAN)
+    escInit();
+#endif
+#if defined(CAMTRIG)
+    shutter_init();
+#endif
+    writeAllMotors(1000);
+}
+
+void mixTable()
+{
+    int16_t maxMotor, minMotor, spread, shift;
+    uint8_t i, axis;
+
+    if (FRAME_MOTORS > 3) {
+        //prevent "yaw jump" during yaw correction
+        axisPID[YAW] = fix_clamp16(axisPID[YAW], -100 - abs(rcCommand[YAW]), +100 + abs(rcCommand[YAW]));
+    }
+
+    for (i = 0; i < FRAME_MOTORS; i++)
+        motor[i] = ((int32_t)rcCommand[THROTTLE] * motorMixer[i].throttle + (int32_t)axisPID[ROLL] * motorMixer[i].roll
+                    + (int32_t)axisPID[PITCH] * motorMixer[i].pitch + (int32_t)(YAW_DIRECTION * axisPID[YAW]) * motorMixer[i].yaw + 32) >> 6;
+
+    switch (FRAME) {
+        case MULTITYPE_BI:
+            servo[0] = constrain(1500 + YAW_DIRECTION * (axisPID[YAW] + axisPID[PITCH]), 1020, 2000);   //LEFT
+            servo[1] = constrain(1500 + YAW_DIRECTION * (axisPID[YAW] - axisPID[PITCH]), 1020, 2000);   //RIGHT
+            break;
+
+        case MULTITYPE_TRI:
+            servo[0] = constrain(TRI_YAW_MIDDLE + YAW_DIRECTION * axisPID[YAW], TRI_YAW_CONSTRAINT_MIN, TRI_YAW_CONSTRAINT_MAX);        //REAR
+            break;
+
+        case MULTITYPE_GIMBAL:
+            servo[1] = fix_clamp16(TILT_PITCH_MIDDLE + gimbalTilt(gimbalGainPitch, PITCH) + rcCommand[PITCH], TILT_PITCH_MIN, TILT_PITCH_MAX);
+            servo[2] = fix_clamp16(TILT_ROLL_MIDDLE + gimbalTilt(gimbalGainRoll, ROLL) + rcCommand[ROLL], TILT_ROLL_MIN, TILT_ROLL_MAX);
+            break;
+            
+        case MULTITYPE_FLYING_WING:
+            //if (passthroughMode) {// use raw stick values to drive output 
+            // follow aux1 as being three way switch **NOTE: better to implement via check boxes in GUI 
+            if (rcData[AUX1] < 1300) {
+                // passthrough
+                servo[1] = constrain(WING_LEFT_MID + PITCH_DIRECTION_L * (rcData[PITCH] - MIDRC) + ROLL_DIRECTION_L * (rcData[ROLL] - MIDRC), WING_LEFT_MIN, WING_LEFT_MAX);    //LEFT
+                servo[2] = constrain(WING_RIGHT_MID + PITCH_DIRECTION_R * (rcData[PITCH] - MIDRC) + ROLL_DIRECTION_R * (rcData[ROLL] - MIDRC), WING_RIGHT_MIN, WING_RIGHT_MAX); //RIGHT
+            } else {                    // use sensors to correct (gyro only or gyro+acc according to aux1/aux2 configuration
+                servo[1] = constrain(WING_LEFT_MID + PITCH_DIRECTION_L * axisPID[PITCH] + ROLL_DIRECTION_L * axisPID[ROLL], WING_LEFT_MIN, WING_LEFT_MAX);      //LEFT
+                servo[2] = constrain(WING_RIGHT_MID + PITCH_DIRECTION_R * axisPID[PITCH] + ROLL_DIRECTION_R * axisPID[ROLL], WING_RIGHT_MIN, WING_RIGHT_MAX);   //RIGHT
+            }
+            break;
+
+    }
+
+#ifdef SERVO_TILT
+    if (rcOptions & activate[BOXCAMSTAB]) {
+        servo[1] = fix_clamp16(TILT_PITCH_MIDDLE + gimbalTilt(gimbalGainPitch, PITCH) + rcData[CAMPITCH] - 1500, TILT_PITCH_MIN, TILT_PITCH_MAX);
+        servo[2] = fix_clamp16(TILT_ROLL_MIDDLE + gimbalTilt(gimbalGainRoll, ROLL) + rcData[CAMROLL] - 1500, TILT_ROLL_MIN, TILT_ROLL_MAX);
+    } else {
+        servo[1] = constrain(TILT_PITCH_MIDDLE + rcData[CAMPITCH] - 1500, TILT_PITCH_MIN, TILT_PITCH_MAX);
+        servo[2] = constrain(TILT_ROLL_MIDDLE + rcData[CAMROLL] - 1500, TILT_ROLL_MIN, TILT_ROLL_MAX);
+    }
+#endif
+
+    // Desaturation: clipping motors one by one flattens the roll/pitch/yaw differential exactly when it's needed.
+    // Instead the collective is moved so the whole spread fits between MINTHROTTLE and MAXTHROTTLE, and only
+    // if the spread itself is wider than that it is scaled down around mid range.
+    maxMotor = minMotor = motor[0];
+    for (i = 1; i < FRAME_MOTORS; i++) {
+        if (motor[i] > maxMotor)
+            maxMotor = motor[i];
+        if (motor[i] < minMotor)
+            minMotor = motor[i];
+    }
+    shift = 0;
+    if (maxMotor - minMotor > MAXTHROTTLE - MINTHROTTLE) {
+        spread = maxMotor - minMotor;
+        shift = (maxMotor + minMotor) / 2;
+        for (i = 0; i < FRAME_MOTORS; i++)
+            motor[i] = (MAXTHROTTLE + MINTHROTTLE) / 2 + (int32_t)(motor[i] - shift) * (MAXTHROTTLE - MINTHROTTLE) / spread;
+        shift = 0;
+        if (mixScaled < 255)
+            mixScaled++;
+    } else if (maxMotor > MAXTHROTTLE)
+        shift = MAXTHROTTLE - maxMotor;
+    else if (minMotor < MINTHROTTLE)
+        shift = MINTHROTTLE - minMotor;
+    if (shift && mixShifted < 255)
+        mixShifted++;
+    for (i = 0; i < FRAME_MOTORS; i++) {
+        motor[i] = fix_clamp16(motor[i] + shift, MINTHROTTLE, MAXTHROTTLE);
+        if ((rcData[THROTTLE]) < MINCHECK)
+#ifndef MOTOR_STOP
+            motor[i] = MINTHROTTLE;
+#else
+            motor[i] = MINCOMMAND;
+#endif
+        if (armed == 0)
+            motor[i] = MINCOMMAND;
+    }
+}
+
+/* IMU ------------------------------------------------------------------------------------------------- */
+
+#if ACC_DIVIDER > 1
+static uint8_t accFresh = 1;            // accADC[] was read this cycle, the ACC correction runs on it
+#else
+#define accFresh 1
+#endif
+
+#if defined(I2C_SENSOR_CHAIN)
+// The acc read and the first gyro read of a cycle go out as one chain into buffers of their own, then both are
+// decoded. The bus time is the two transfers back to back, with no gap for the main loop to notice the first
+// one. Drivers without a decode() (SPI, analog, the WMP) aren't on the chain and read on their own.
+#define CHAIN_ACC       0
+#define CHAIN_GYRO      1
+static struct {
+    i2cJob_t job[2];
+    uint8_t raw[2][6];
+    const sensorDriver_t *dev[2];
+    uint8_t queued, ok;                 // bit per slot
+} sensorChain;
+
+static void sensorChainRead(void)
+{
+    uint8_t slot, n = 0;
+    i2cJob_t *job;
+
+    PROFILE_BEGIN(sensorChain);
+    sensorChain.dev[CHAIN_ACC] = ACC && accFresh ? accDev : NULL;
+    sensorChain.dev[CHAIN_GYRO] = GYRO ? gyroDev : NULL;
+    sensorChain.queued = 0;
+    for (slot = 0; slot < 2; slot++) {
+        if (!sensorChain.dev[slot] || !sensorChain.dev[slot]->decode)
+            continue;
+        job = &sensorChain.job[n++];
+        job->address = sensorChain.dev[slot]->i2cAddress;
+        job->subaddr = sensorChain.dev[slot]->i2cReg;
+        job->buf = sensorChain.raw[slot];
+        job->len = 6;
+        job->read = 1;
+        sensorChain.queued |= 1 << slot;
+    }
+    sensorChain.ok = i2c_runChain(sensorChain.job, n);
+    if (sensorChain.queued == 2)
+        sensorChain.ok <<= 1;           // the gyro alone went out as job 0
+    PROFILE_END(sensorChain);
+}
+
+// decodes what the chain brought in for this slot, or lets the driver do its own read
+static void sensorChainDecode(uint8_t slot)
+{
+    const sensorDriver_t *dev = sensorChain.dev[slot];
+
+    if (!(sensorChain.queued & (1 << slot)))
+        dev->read();
+    else if (sensorChain.ok & (1 << slot))
+        dev->decode(sensorChain.raw[slot]);
+    // a failed read leaves this cycle out, the error is counted already
+}
+#endif
+
+#if !defined(SENSOR_LINK)
+void computeIMU()
+{
+    uint8_t axis;
+    static int16_t gyroADCprevious[3] = { 0, 0, 0 };
+    int16_t gyroADCp[3];
+#if defined(LOOP_ISR)
+    static int16_t gyroTickPrev[2][3];  // the reads of the last two inner loops
+#elif GYRO_FRAC
+    int32_t gyroADCinter[3];            // two readings, each up to the whole int16 range
+#else
+    int16_t gyroADCinter[3];
+#endif
+    static int16_t lastAccADC[3] = { 0, 0, 0 };
+#if !defined(LOOP_ISR)
+    static uint32_t timeInterleave = 0;
+#endif
+    static int16_t gyroYawSmooth = 0;
+
+    //we separate the 2 situations because reading gyro values with a gyro only setup can be achieved at a higher rate
+    //gyro+nunchuk: we must wait for a quite high delay between 2 reads to get both WM+ and Nunchuk data. It works with 3ms
+    //gyro only: the delay to read 2 consecutive values can be reduced to only 0.65ms
+    if (!ACC && !GYRO && nunchuk) {     // only a WMP build can find one, the others fold this away
+        // WMP_poll() keeps the reads INTERLEAVING_DELAY apart on its own, the loop doesn't wait for them:
+        // the PID runs every cycle on the newest gyro sample, the attitude is updated with each new frame
+        PROFILE_BEGIN(annexCode);
+        annexCode();
+        PROFILE_END(annexCode);
+#if defined(LATENCY_BENCH)
+        latAnnexTime = micros();
+#endif
+        switch (WMP_poll()) {
+        case 1:
+            for (axis = 0; axis < 3; axis++) {
+                // empirical, we take a weighted value of the current and the previous values
+                // /4 is to average 4 values, note: overflow is not possible for WMP gyro here
+                gyroData[axis] = ((int32_t)gyroADC[axis] * 3 + gyroADCprevious[axis] + 2) / 4;
+                gyroADCprevious[axis] = gyroADC[axis];
+            }
+            // fall through
+        case 0:
+            PROFILE_BEGIN(getEstimatedAttitude);
+            getEstimatedAttitude();
+            PROFILE_END(getEstimatedAttitude);
+            break;
+        }
+    } else {
+#if ACC_DIVIDER > 1
+        {
+            static uint8_t accCount = 0;
+
+            if (++accCount >= ACC_DIVIDER)
+                accCount = 0;
+            accFresh = accCount == 0;
+        }
+#endif
+#if defined(I2C_SENSOR_CHAIN)
+        sensorChainRead();
+#endif
+        if (ACC) {
+            if (accFresh) {
+#if defined(I2C_SENSOR_CHAIN)
+                sensorChainDecode(CHAIN_ACC);
+#else
+                accDev->read();
+#endif
+            }
+            PROFILE_BEGIN(getEstimatedAttitude);
+            getEstimatedAttitude();
+            PROFILE_END(getEstimatedAttitude);
+        }
+#if GYRO && defined(I2C_SENSOR_CHAIN)
+        sensorChainDecode(CHAIN_GYRO);
+#elif GYRO
+        gyroDev->read();
+#else
+        WMP_getRawADC();
+#endif                          /* GYRO */
+
+        for (axis = 0; axis < 3; axis++)
+            gyroADCp[axis] = gyroADC[axis];
+#if !defined(LOOP_ISR)
+        timeInterleave = micros();
+#endif
+        PROFILE_BEGIN(annexCode);
+        annexCode();
+        PROFILE_END(annexCode);
+#if defined(LATENCY_BENCH)
+        latAnnexTime = micros();
+#endif
+#if defined(LOOP_ISR)
+        // one read per inner loop, the interrupt period stands in for the interleaving delay: the mean of this
+        // read and the two before it, three samples like the pair and its predecessor below
+        for (axis = 0; axis < 3; axis++) {
+            gyroData[axis] = ((int32_t)gyroADCp[axis] + gyroTickPrev[0][axis] + gyroTickPrev[1][axis] + 1) / 3;
+            gyroTickPrev[1][axis] = gyroTickPrev[0][axis];
+            gyroTickPrev[0][axis] = gyroADCp[axis];
+            if (!ACC)
+                accADC[axis] = 0;
+        }
+#else
+#if defined(GYRO_DRDY)
+        Gyro_waitDataReady();       // sleep until the gyro has a new sample, the loop is paced by the sensor ODR
+#elif !defined(BIT_EXACT)       // the second read gets the step frame's sample again, no need to wait
+        while ((micros() - timeInterleave) < 650);  //empirical, interleaving delay between 2 consecutive reads
+#endif
+#if GYRO
+        gyroDev->read();
+#else
+        WMP_getRawADC();
+#endif
+        for (axis = 0; axis < 3; axis++) {
+            gyroADCinter[axis] = gyroADC[axis] + gyroADCp[axis];
+            // empirical, we take a weighted value of the current and the previous values
+            gyroData[axis] = (gyroADCinter[axis] + gyroADCprevious[axis] + 1) / 3;
+            gyroADCprevious[axis] = gyroADCinter[axis] / 2;
+            if (!ACC)
+                accADC[axis] = 0;
+        }
+#endif
+    }
+
+    if (FRAME == MULTITYPE_TRI) {
+        gyroData[YAW] = ((int32_t)gyroYawSmooth * 2 + gyroData[YAW] + 1) / 3;
+        gyroYawSmooth = gyroData[YAW];
+    }
+}
+#endif                          /* !SENSOR_LINK, its computeIMU() is with the sensor link */
+
+// ************************************************************************************************************
+// Integer trig kernels, angles in 0.1 deg like angle[] and heading
+// ************************************************************************************************************
+static const int16_t atanTable[14] = { 7200, 4250, 2246, 1140, 572, 286, 143, 72, 36, 18, 9, 4, 2, 1 };  // atan(2^-i) in 1/160 deg
+
+// sin() of 0..90 deg in 1 deg steps, Q14
+static const int16_t sinTable[91] = {
+    0, 286, 572, 857, 1143, 1428, 1713, 1997, 2280, 2563, 2845, 3126, 3406, 3686, 3964, 4240, 4516, 4790, 5063, 5334,
+    5604, 5872, 6138, 6402, 6664, 6924, 7182, 7438, 7692, 7943, 8192, 8438, 8682, 8923, 9162, 9397, 9630, 9860, 10087, 10311,
+    10531, 10749, 10963, 11174, 11381, 11585, 11786, 11982, 12176, 12365, 12551, 12733, 12911, 13085, 13255, 13421, 13583, 13741, 13894, 14044,
+    14189, 14330, 14466, 14598, 14726, 14849, 14968, 15082, 15191, 15296, 15396, 15491, 15582, 15668, 15749, 15826, 15897, 15964, 16026, 16083,
+    16135, 16182, 16225, 16262, 16294, 16322, 16344, 16362, 16374, 16382, 16384
+};
+
+// atan2 by CORDIC vectoring, shift and add only. Within 0.07 deg of libm over the whole circle.
+int16_t atan2_dd(int32_t y, int32_t x)
+{
+    int32_t xt, m;
+    int16_t a = 0;                      // 1/160 deg
+    uint8_t i;
+
+    if (x == 0 && y == 0)
+        return 0;
+    // Scale into 2^20..2^28: the shifts keep their resolution and the CORDIC gain (1.65) can't overflow
+    m = (x < 0 ? -x : x) | (y < 0 ? -y : y);
+    while (m >= 0x10000000) {
+        x >>= 1;
+        y >>= 1;
+        m >>= 1;
+    }
+    while (m < 0x100000) {
+        x <<= 1;
+        y <<= 1;
+        m <<= 1;
+    }
+    // Rotate into the right half plane first, CORDIC only converges within +/-99 deg
+    if (x < 0) {
+        xt = x;
+        if (y >= 0) {
+            x = y;
+            y = -xt;
+            a = 14400;
+        } else {
+            x = -y;
+            y = xt;
+            a = -14400;
+        }
+    }
+    for (i = 0; i < 14; i++) {
+        xt = x;
+        if (y > 0) {
+            x += y >> i;
+            y -= xt >> i;
+            a += atanTable[i];
+        } else {
+            x -= y >> i;
+            y += xt >> i;
+            a -= atanTable[i];
+        }
+    }
+    return a >= 0 ? (a + 8) >> 4 : -((8 - a) >> 4);
+}
+
+// sin(a) in Q14 for a in 0.1 deg, table lookup with linear interpolation. Within 2 LSB of libm.
+int16_t sin_dd(int16_t a)
+{
+    int16_t r;
+    uint8_t i, f, neg = 0;
+
+    a %= 3600;
+    if (a < 0)
+        a += 3600;
+    if (a >= 1800) {
+        a -= 1800;
+        neg = 1;
+    }
+    if (a > 900)
+        a = 1800 - a;
+    i = a / 10;
+    f = a % 10;
+    r = sinTable[i];
+    if (f)
+        r += ((int32_t)(sinTable[i + 1] - r) * f) / 10;
+    return neg ? -r : r;
+}
+
+int16_t cos_dd(int16_t a)
+{
+    return sin_dd(a % 3600 + 900);
+}
+
+#if defined(STAB_OLD_17)
+/// OLD CODE from 1.7 ////
+// ************************************
+// simplified IMU based on Kalman Filter
+// inspired from http://starlino.com/imu_guide.html
+// and http://www.starlino.com/imu_kalman_arduino.html
+// for angles under 25deg, we use an approximation to speed up the angle calculation
+// magnetometer addition for small angles
+// ************************************
+void getEstimatedAttitude()
+{
+    uint8_t axis;
+    float R, RGyro[3];          //R obtained from last estimated value and gyro movement;
+    static float REst[3] = { 0, 0, 1 }; // init acc in stable mode
+    static float A[2];          //angles between projection of R on XZ/YZ plane and Z axis (in Radian)
+    float wGyro = 300;          // gyro weight/smooting factor
+    float invW = 1.0 / (1 + 300);
+    float gyroFactor;
+    static uint8_t small_angle = 1;
+    static uint16_t tPrevious;
+    uint16_t tCurrent, deltaTime;
+    float a[2], mag[2], cos_[2];
+
+    tCurrent = micros();
+    deltaTime = tCurrent - tPrevious;
+    tPrevious = tCurrent;
+
+#if GYRO
+    gyroFactor = deltaTime / 300e6 / GYRO_FINE;     //empirical
+#else
+    gyroFactor = deltaTime / 200e6 / GYRO_FINE;     //empirical, depends on WMP on IDG datasheet, tied of deg/ms sensibility
+#endif
+
+    for (axis = 0; axis < 2; axis++)
+        a[axis] = gyroADC[axis] * gyroFactor;
+    for (axis = 0; axis < 3; axis++)
+        accSmooth[axis] = (accSmooth[axis] * 7 + accADC[axis] + 4) / 8;
+
+    if (accSmooth[YAW] > 0) {   //we want to be sure we are not flying inverted  
+        // a very nice trigonometric approximation: under 25deg, the error of this approximation is less than 1 deg:
+        //   sin(x) =~= x =~= arcsin(x)
+        //   angle_axis = arcsin(ACC_axis/ACC_1G) =~= ACC_axis/ACC_1G
+        // the angle calculation is much more faster in this case
+        if (accSmooth[ROLL] < acc_25deg && accSmooth[ROLL] > -acc_25deg && accSmooth[PITCH] < acc_25deg && accSmooth[PITCH] > -acc_25deg) {
+            for (axis = 0; axis < 2; axis++) {
+                A[axis] += a[axis];
+                A[axis] = ((float) accSmooth[axis] / acc_1G + A[axis] * wGyro) * invW;  // =~= sin axis
+#if MAG
+                cos_[axis] = 1 - A[axis] * A[axis] / 2; // cos(x) =~= 1-x^2/2
+#endif
+            }
+            small_angle = 1;
+        } else {
+            //magnitude vector size
+            R = sqrt(square(accSmooth[ROLL]) + square(accSmooth[PITCH]) + square(accSmooth[YAW]));
+            for (axis = 0; axis < 2; axis++) {
+                if (acc_1G * 3 / 5 < R && R < acc_1G * 7 / 5 && small_angle == 0)       //if accel magnitude >1.4G or <0.6G => we neutralize the effect of accelerometers in the angle estimation
+                    A[axis] = atan2(REst[axis], REst[YAW]);
+                A[axis] += a[axis];
+                cos_[axis] = cos(A[axis]);
+                RGyro[axis] = sin(A[axis]) / sqrt(1.0 + square(cos_[axis]) * square(tan(A[1 - axis]))); //reverse calculation of RwGyro from Awz angles
+            }
+            RGyro[YAW] = sqrt(abs(1.0 - square(RGyro[ROLL]) - square(RGyro[PITCH])));
+            for (axis = 0; axis < 3; axis++)
+                REst[axis] = (accADC[axis] / R + wGyro * RGyro[axis]) * invW;   //combine Accelerometer and gyro readings
+            small_angle = 0;
+        }
+#if defined(HMC5843) || defined(HMC5883)
+        mag[PITCH] = -magADC[PITCH] * cos_[PITCH] + magADC[ROLL] * A[ROLL] * A[PITCH] + magADC[YAW] * cos_[ROLL] * A[PITCH];
+        mag[ROLL] = magADC[ROLL] * cos_[ROLL] - magADC[YAW] * A[ROLL];
+        heading = -degrees(atan2(mag[PITCH], mag[ROLL]));
+#endif
+    }
+    for (axis = 0; axis < 2; axis++)
+        angle[axis] = A[axis] * 572.9577951;    //angle in multiple of 0.1 degree
+}
+
+// worked out every loop above
+static void attitudeAngles(void)
+{
+}
+
+static void attitudeHeading(void)
+{
+}
+
+#else
+
+// **************************************************
+// Simplified IMU based on "Complementary Filter"
+// Inspired by http://starlino.com/imu_guide.html
+//
+// adapted by ziss_dm : http://wbb.multiwii.com/viewtopic.php?f=8&t=198
+//
+// The following ideas was used in this project:
+// 1) Rotation matrix: http://en.wikipedia.org/wiki/Rotation_matrix
+// 2) Small-angle approximation: http://en.wikipedia.org/wiki/Small-angle_approximation
+// 3) C. Hastings approximation for atan2()
+// 4) Optimization tricks: http://www.hackersdelight.org/
+//
+// Currently Magnetometer uses separate CF which is used only
+// for heading approximation.
+//
+// Last Modified: 19/04/2011
+// Version: V1.1
+//
+// code size deduction and tmp vector intermediate step for vector rotation computation: October 2011 by Alex
+// **************************************************
+
+//******  advanced users settings *******************
+/* Set the Low Pass Filter factor for ACC */
+/* Increasing this value would reduce ACC noise (visible in GUI), but would increase ACC lag time*/
+/* Comment this if  you do not want filter at all.*/
+/* Default WMC value: 8*/
+#define ACC_LPF_FACTOR 8
+
+/* Set the Low Pass Filter factor for Magnetometer */
+/* Increasing this value would reduce Magnetometer noise (not visible in GUI), but would increase Magnetometer lag time*/
+/* Comment this if  you do not want filter at all.*/
+/* Default WMC value: n/a*/
+//#define MG_LPF_FACTOR 4
+
+/* Set the Gyro Weight for Gyro/Acc complementary filter */
+/* Increasing this value would reduce and delay Acc influence on the output of the filter*/
+/* Default WMC value: 300*/
+#define GYR_CMPF_FACTOR 310.0f
+
+/* Set the Gyro Weight for Gyro/Magnetometer complementary filter */
+/* Increasing this value would reduce and delay Magnetometer influence on the output of the filter*/
+/* Default WMC value: n/a*/
+#define GYR_CMPFM_FACTOR 200.0f
+
+//****** end of advanced users settings *************
+
+// the ACC correction runs every ACC_DIVIDER-th loop, with the weight that keeps GYR_CMPF_FACTOR's time constant
+#define ACC_CMPF_FACTOR       ((GYR_CMPF_FACTOR + 1.0f) / ACC_DIVIDER - 1.0f)
+#define INV_GYR_CMPF_FACTOR   (1.0f / (ACC_CMPF_FACTOR  + 1.0f))
+#define INV_GYR_CMPFM_FACTOR  (1.0f / (GYR_CMPFM_FACTOR + 1.0f))
+#if GYRO
+// #define GYRO_SCALE ((2000.0f * PI)/((32767.0f / 4.0f ) * 180.0f * 1000000.0f) * 1.155f)
+// PI is a double, the cast keeps the products GYRO_SCALE ends up in single precision (on the FPU and off it)
+#define GYRO_SCALE ((float)((2380 * PI)/((32767.0f / 4.0f ) * 180.0f * 1000000.0f)) / GYRO_FINE)     //should be 2279.44 but 2380 gives better result
+
+// +-2000/sec deg scale
+// #define GYRO_SCALE ((200.0f * PI)/((32768.0f / 5.0f / 4.0f ) * 180.0f * 1000000.0f) * 1.5f)
+// +- 200/sec deg scale
+// 1.5 is emperical, not sure what it means
+// should be in rad/sec
+#else
+#define GYRO_SCALE (1.0f/200e6f / GYRO_FINE)
+  // empirical, depends on WMP on IDG datasheet, tied of deg/ms sensibility
+  // !!!!should be adjusted to the rad/sec
+#endif
+// Small angle approximation
+#define ssin(val) (val)
+#define scos(val) 1.0f
+
+typedef struct fp_vector {
+    float X;
+    float Y;
+    float Z;
+} t_fp_vector_def;
+
+typedef union {
+    float A[3];
+    t_fp_vector_def V;
+} t_fp_vector;
+
+int16_t _atan2(float y, float x)
+{
+    // acc and cross product magnitudes stay well inside 2^25, so this can't overflow
+    return atan2_dd((int32_t)(y * 64.0f), (int32_t)(x * 64.0f));
+}
+
+// Rotate Estimated vector(s) with small angle approximation, according to the gyro data
+void rotateV(struct fp_vector *v, float *delta)
+{
+    struct fp_vector v_tmp = *v;
     v->Z -= delta[ROLL] * v_tmp.X + delta[PITCH] * v_tmp.Y;
     v->X += delta[ROLL] * v_tmp.Z - delta[YAW] * v_tmp.Y;
     v->Y += delta[PITCH] * v_tmp.Z + delta[YAW] * v_tmp.X;
 }
 
-void getEstimatedAttitude()
+#if GYRO_BIAS
+// In flight gyro bias tracking. A gyro bias b makes the gyro propagated EstG/EstM sit b * (CMPF_FACTOR + 1)
+// * dt off the ACC/MAG measurement, so the error between the two is integrated into gyroZero[] (the I
+// term of a Mahony filter, on top of the existing one). With the MPU6000 die temperature the bias is
+// modelled as offset + slope * (T - T at calibration), both learned from the same error (LMS).
+#define GYRO_BIAS_KI        0.02f       // rad/s of bias per rad of error per second, ~50s time constant at a 3ms loop
+#define GYRO_BIAS_K         ((int32_t)(4.0f * GYRO_BIAS_KI / (GYRO_SCALE * 1e12f) * 16777216.0f + 0.5f))
+#define GYRO_BIAS_MAX       ((int32_t)64 * GYRO_FINE << 20)     // LSB Q20, off the ground calibration
+#define GYRO_BIAS_SLOPE_MAX ((int32_t)16 * GYRO_FINE << 20)     // LSB per 10 degC Q20
+#define GYRO_BIAS_DT_MAX    5000        // us
+
+static int16_t gyroBiasZero[3];         // gyroZero[] from the last calibration
+static int32_t gyroBiasQ20[3];          // tracked on top of it, LSB Q20
+#if defined(MPU6000SPI)
+static int16_t gyroBiasTemp0;           // die temperature at the calibration, 0.1 degC
+static int32_t gyroBiasSlope[3];        // LSB per 10 degC Q20, kept over recalibrations
+#endif
+
+// after each gyro calibration
+void gyroBiasReset(void)
+{
+    uint8_t axis;
+
+    for (axis = 0; axis < 3; axis++) {
+        gyroBiasZero[axis] = gyroZero[axis];
+        gyroBiasQ20[axis] = 0;
+    }
+#if defined(MPU6000SPI)
+    gyroBiasTemp0 = MPU6000_getTemperature();
+#endif
+}
+
+// Angle between the propagated estimate (sensor units Q4, the steady error is only a few LSB) and the
+// measurement of the same vector, about one gyro axis, as sin() in Q14 and clipped at 1/16 rad.
+// Positive when that gyro reads high.
+static int16_t gyroBiasError(int32_t *est, int16_t *meas, uint8_t axis)
+{
+    int32_t n, cross;
+
+    n = (int32_t)meas[0] * meas[0] + (int32_t)meas[1] * meas[1] + (int32_t)meas[2] * meas[2];
+    if (n < 256)
+        return 0;
+    if (axis == ROLL)
+        cross = (int32_t)est[0] * meas[2] - (int32_t)est[2] * meas[0];
+    else if (axis == PITCH)
+        cross = (int32_t)est[1] * meas[2] - (int32_t)est[2] * meas[1];
+    else
+        cross = (int32_t)est[1] * meas[0] - (int32_t)est[0] * meas[1];
+    cross = constrain(cross, -n, n);
+    return cross * 4 / (n >> 8);
+}
+
+// err[] from gyroBiasError() for the axes set in mask, the others weren't observable this time
+static void gyroBiasTrack(int16_t *err, uint8_t mask, uint16_t dT)
+{
+    int32_t step, total;
+    uint8_t axis;
+#if defined(MPU6000SPI)
+    int16_t dTemp = MPU6000_getTemperature() - gyroBiasTemp0;
+#endif
+
+    if (calibratingG > 0)
+        return;
+    if (dT > GYRO_BIAS_DT_MAX)
+        dT = GYRO_BIAS_DT_MAX;
+    for (axis = 0; axis < 3; axis++) {
+        if (mask & (1 << axis)) {
+            step = (int32_t)err[axis] * dT * GYRO_BIAS_K;      // LSB Q40
+            gyroBiasQ20[axis] = constrain(gyroBiasQ20[axis] + ((step + ((int32_t)1 << 19)) >> 20), -GYRO_BIAS_MAX, GYRO_BIAS_MAX);
+#if defined(MPU6000SPI)
+            step = ((step >> 10) * dTemp / 100) >> 10;
+            gyroBiasSlope[axis] = constrain(gyroBiasSlope[axis] + step, -GYRO_BIAS_SLOPE_MAX, GYRO_BIAS_SLOPE_MAX);
+#endif
+        }
+        total = gyroBiasQ20[axis] >> 4;                         // Q16
+#if defined(MPU6000SPI)
+        total += (gyroBiasSlope[axis] >> 4) * dTemp / 100;
+#endif
+        gyroZero[axis] = gyroBiasZero[axis] + ((total + 32768) >> 16);
+    }
+}
+#endif
+
+#if defined(IMU_FIXED_POINT)
+// Fixed point version of the filter below, same structure and constants.
+// EstG/EstM are 32 bit with the sensor units in the high half (Q16), gyro deltas are radians in Q16.
+#define GYRO_SCALE_Q40          ((int32_t)(GYRO_SCALE * 1099511627776.0f + 0.5f))  // GYRO_SCALE << 40
+#define GYR_CMPF_Q16            ((int32_t)(65536.0f / (ACC_CMPF_FACTOR + 1.0f)))
+#define GYR_CMPFM_Q16           ((int32_t)(65536.0f / (GYR_CMPFM_FACTOR + 1.0f)))
+#define FP_MAX_DT               10000   // us, keeps gyro * scale in 32 bits. Only hit at startup
+
+typedef union {
+    int32_t A[3];
+    struct {
+        int32_t X, Y, Z;
+    } V;
+} t_int_vector;
+
+// v * (rad Q16) -> Q16, 16x16 multiply on the integer part of v
+#define mulQ(rad, v)            ((int32_t)(rad) * (int16_t)((v) >> 16))
+
+void rotateV_fp(t_int_vector *v, int16_t *delta)
+{
+    t_int_vector v_tmp = *v;
+    v->V.Z -= mulQ(delta[ROLL], v_tmp.V.X) + mulQ(delta[PITCH], v_tmp.V.Y);
+    v->V.X += mulQ(delta[ROLL], v_tmp.V.Z) - mulQ(delta[YAW], v_tmp.V.Y);
+    v->V.Y += mulQ(delta[PITCH], v_tmp.V.Z) + mulQ(delta[YAW], v_tmp.V.X);
+}
+
+static t_int_vector EstG, EstM;
+
+void getEstimatedAttitude()
+{
+    uint8_t axis;
+    static int16_t accMag = 0;                  // of the last acc reading
+    static int16_t mgSmooth[3], accTemp[3];     // projection of smoothed and normalized magnetic vector on x/y/z axis, as measured by magnetometer
+    static uint16_t previousT;
+    static int32_t deltaRest[3];                // sub-LSB part of the gyro integration, carried to the next loop
+    int32_t scale, delta;
+    int16_t deltaGyroAngle[3];
+    uint16_t dT;
+#if defined(GYRO_DRDY) && !defined(BIT_EXACT)
+    uint16_t currentT = gyroSampleTime;     // integrate over sensor time, not over when we got around to it
+#else
+    uint16_t currentT = loopMicros();
+#endif
+
+    dT = currentT - previousT;
+    previousT = currentT;
+    if (dT > FP_MAX_DT)
+        dT = FP_MAX_DT;
+    scale = ((int32_t)dT * GYRO_SCALE_Q40) >> 8;       // rad Q32 per gyro LSB
+
+    // Initialization
+    if (accFresh)
+        accMag = 0;
+    for (axis = 0; axis < 3; axis++) {
+        delta = gyroADC[axis] * scale + deltaRest[axis];
+        deltaGyroAngle[axis] = delta >> 16;
+        deltaRest[axis] = delta - ((int32_t)deltaGyroAngle[axis] << 16);
+        if (accFresh) {
+#if defined(ACC_LPF_FACTOR)
+            accTemp[axis] = (accTemp[axis] - (accTemp[axis] >> 4)) + accADC[axis];
+            accSmooth[axis] = accTemp[axis] >> 4;
+#define ACC_VALUE accSmooth[axis]
+#else
+            accSmooth[axis] = accADC[axis];
+#define ACC_VALUE accADC[axis]
+#endif
+            accMag += (ACC_VALUE * 10 / (int16_t) acc_1G) * (ACC_VALUE * 10 / (int16_t) acc_1G);
+        }
+
+#if MAG
+#if defined(MG_LPF_FACTOR)
+        mgSmooth[axis] = (mgSmooth[axis] * (MG_LPF_FACTOR - 1) + magADC[axis]) / MG_LPF_FACTOR; // LPF for Magnetometer values
+#define MAG_VALUE mgSmooth[axis]
+#else
+#define MAG_VALUE magADC[axis]
+#endif
+#endif
+    }
+
+    rotateV_fp(&EstG, deltaGyroAngle);
+#if MAG
+    rotateV_fp(&EstM, deltaGyroAngle);
+#endif
+#if GYRO_BIAS
+    {
+        int32_t est[3];
+        int16_t err[3];
+        uint8_t mask = 0;
+
+        if (36 < accMag && accMag < 196) {
+            for (axis = 0; axis < 3; axis++)
+                est[axis] = EstG.A[axis] >> 12;
+            err[ROLL] = gyroBiasError(est, accSmooth, ROLL);
+            err[PITCH] = gyroBiasError(est, accSmooth, PITCH);
+            mask = 1 << ROLL | 1 << PITCH;
+        }
+#if MAG
+        if (smallAngle25) {
+            for (axis = 0; axis < 3; axis++)
+                est[axis] = EstM.A[axis] >> 12;
+#if defined(MG_LPF_FACTOR)
+            err[YAW] = gyroBiasError(est, mgSmooth, YAW);
+#else
+            err[YAW] = gyroBiasError(est, magADC, YAW);
+#endif
+            mask |= 1 << YAW;
+        }
+#endif
+        gyroBiasTrack(err, mask, dT);
+    }
+#endif
+    if (abs(accSmooth[ROLL]) < acc_25deg && abs(accSmooth[PITCH]) < acc_25deg && accSmooth[YAW] > 0)
+        smallAngle25 = 1;
+    else
+        smallAngle25 = 0;
+
+    // Apply complimentary filter (Gyro drift correction)
+    // EstG = (EstG * GYR_CMPF_FACTOR + acc) / (GYR_CMPF_FACTOR + 1), written as EstG += (acc - EstG) / (GYR_CMPF_FACTOR + 1)
+    if (accFresh)
+        accVibGate(36 < accMag && accMag < 196);
+    if (accFresh && ((36 < accMag && accMag < 196) || smallAngle25))
+        for (axis = 0; axis < 3; axis++) {
+            int16_t acc = ACC_VALUE;
+#ifndef TRUSTED_ACCZ
+            if (smallAngle25 && axis == YAW)
+                acc = acc_1G;
+#endif                          /* !TRUSTED_ACCZ */
+            EstG.A[axis] += ((((int32_t)acc << 16) - EstG.A[axis]) >> 8) * GYR_CMPF_Q16 >> 8;
+        }
+#if MAG
+    for (axis = 0; axis < 3; axis++)
+        EstM.A[axis] += ((((int32_t)MAG_VALUE << 16) - EstM.A[axis]) >> 8) * GYR_CMPFM_Q16 >> 8;
+#endif
+    attitudeStale = ATT_ANGLES | ATT_HEADING;
+}
+
+// Attitude of the estimated vector
+static void attitudeAngles(void)
+{
+    if (!(attitudeStale & ATT_ANGLES))
+        return;
+    attitudeStale &= ~ATT_ANGLES;
+    angle[ROLL] = atan2_dd(EstG.V.X, EstG.V.Z);
+    angle[PITCH] = atan2_dd(EstG.V.Y, EstG.V.Z);
+}
+
+// Attitude of the cross product vector GxM
+static void attitudeHeading(void)
+{
+#if MAG
+    int16_t gx = EstG.V.X >> 16, gy = EstG.V.Y >> 16, gz = EstG.V.Z >> 16;
+    int16_t mx = EstM.V.X >> 16, my = EstM.V.Y >> 16, mz = EstM.V.Z >> 16;
+
+    if (!(attitudeStale & ATT_HEADING))
+        return;
+    attitudeStale &= ~ATT_HEADING;
+    heading = atan2_dd((int32_t)gx * mz - (int32_t)gz * mx, (int32_t)gz * my - (int32_t)gy * mz) / 10;
+#endif
+}
+
+#elif defined(IMU_QUATERNION)
+// Quaternion attitude with a PI correction from the accelerometer and magnetometer (Mahony's non linear
+// complementary filter). The I term tracks the gyro bias, so the attitude holds while the ACC is outside
+// the 0.6-1.4G window instead of drifting off with the raw gyro.
+// The filter frame is the EstG frame above: X = ROLL, Y = PITCH, Z = YAW axis of accADC[],
+// so body rates are (gyro PITCH, -gyro ROLL, -gyro YAW), see rotateV().
+#define IMU_KP                  1.0f    // rad/s per unit of error, about the pull of GYR_CMPF_FACTOR at 3ms loop time
+#define IMU_KI                  0.02f   // rad/s per unit of error per second, gyro bias
+#define IMU_FLOAT_Q20           1048576.0f
+
+float InvSqrt(float x);
+
+static float q0 = 1.0f, q1 = 0.0f, q2 = 0.0f, q3 = 0.0f;
+static float gyroBias[3] = { 0.0f, 0.0f, 0.0f };
+#if MAG
+static float fluxBody[3];               // wx, wy, wz of the last update, for attitudeHeading()
+#endif
+
+void getEstimatedAttitude()
+{
+    uint8_t axis;
+    static int16_t accMag = 0;                  // of the last acc reading
+    static int16_t mgSmooth[3], accTemp[3];
+    static uint16_t previousT;
+    float dT, n, qa, qb, qc;
+    float w[3], e[3] = { 0.0f, 0.0f, 0.0f };
+    float vx, vy, vz;
+#if MAG
+    float mx, my, mz, hx, hy, bx, bz, wx = 0.0f, wy = 0.0f, wz = 0.0f;
+#endif
+#if defined(GYRO_DRDY)
+    uint16_t currentT = gyroSampleTime;     // integrate over sensor time, not over when we got around to it
+#else
+    uint16_t currentT = micros();
+#endif
+
+    dT = (uint16_t)(currentT - previousT) * 1e-6f;
+    previousT = currentT;
+
+    if (accFresh)
+        accMag = 0;
+    for (axis = 0; axis < 3; axis++) {
+        if (accFresh) {
+#if defined(ACC_LPF_FACTOR)
+            accTemp[axis] = (accTemp[axis] - (accTemp[axis] >> 4)) + accADC[axis];
+            accSmooth[axis] = accTemp[axis] >> 4;
+#define ACC_VALUE accSmooth[axis]
+#else
+            accSmooth[axis] = accADC[axis];
+#define ACC_VALUE accADC[axis]
+#endif
+            accMag += (ACC_VALUE * 10 / (int16_t) acc_1G) * (ACC_VALUE * 10 / (int16_t) acc_1G);
+        }
+#if MAG
+#if defined(MG_LPF_FACTOR)
+        mgSmooth[axis] = (mgSmooth[axis] * (MG_LPF_FACTOR - 1) + magADC[axis]) / MG_LPF_FACTOR; // LPF for Magnetometer values
+#define MAG_VALUE mgSmooth[axis]
+#else
+#define MAG_VALUE magADC[axis]
+#endif
+#endif
+    }
+
+    if (abs(accSmooth[ROLL]) < acc_25deg && abs(accSmooth[PITCH]) < acc_25deg && accSmooth[YAW] > 0)
+        smallAngle25 = 1;
+    else
+        smallAngle25 = 0;
+
+    // Estimated gravity in the body frame
+    vx = 2.0f * (q1 * q3 - q0 * q2);
+    vy = 2.0f * (q0 * q1 + q2 * q3);
+    vz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+
+    // ACC correction, same acceptance window as the vector filter. Every ACC_DIVIDER-th loop, as that much stronger
+    if (accFresh)
+        accVibGate(36 < accMag && accMag < 196);
+    if (accFresh && ((36 < accMag && accMag < 196) || smallAngle25)) {
+        float ax = accSmooth[ROLL], ay = accSmooth[PITCH], az = accSmooth[YAW];
+#ifndef TRUSTED_ACCZ
+        if (smallAngle25)
+            az = acc_1G;
+#endif                          /* !TRUSTED_ACCZ */
+        n = InvSqrt(ax * ax + ay * ay + az * az);
+        ax *= n;
+        ay *= n;
+        az *= n;
+#if ACC_DIVIDER > 1
+        vx *= ACC_DIVIDER;
+        vy *= ACC_DIVIDER;
+        vz *= ACC_DIVIDER;
+#endif
+        e[0] = ay * vz - az * vy;
+        e[1] = az * vx - ax * vz;
+        e[2] = ax * vy - ay * vx;
+    }
+#if MAG
+    mx = magADC[ROLL];
+    my = magADC[PITCH];
+    mz = magADC[YAW];
+    if (mx != 0.0f || my != 0.0f || mz != 0.0f) {
+        axis = ROLL;
+        mx = MAG_VALUE;
+        axis = PITCH;
+        my = MAG_VALUE;
+        axis = YAW;
+        mz = MAG_VALUE;
+        n = InvSqrt(mx * mx + my * my + mz * mz);
+        mx *= n;
+        my *= n;
+        mz *= n;
+        // Earth frame flux, flattened to the horizontal direction plus the vertical part
+        hx = 2.0f * (mx * (0.5f - q2 * q2 - q3 * q3) + my * (q1 * q2 - q0 * q3) + mz * (q1 * q3 + q0 * q2));
+        hy = 2.0f * (mx * (q1 * q2 + q0 * q3) + my * (0.5f - q1 * q1 - q3 * q3) + mz * (q2 * q3 - q0 * q1));
+        bz = 2.0f * (mx * (q1 * q3 - q0 * q2) + my * (q2 * q3 + q0 * q1) + mz * (0.5f - q1 * q1 - q2 * q2));
+        n = hx * hx + hy * hy;
+        bx = n > 0.0f ? n * InvSqrt(n) : 0.0f;
+        // and back into the body frame
+        wx = 2.0f * (bx * (0.5f - q2 * q2 - q3 * q3) + bz * (q1 * q3 - q0 * q2));
+        wy = 2.0f * (bx * (q1 * q2 - q0 * q3) + bz * (q0 * q1 + q2 * q3));
+        wz = 2.0f * (bx * (q0 * q2 + q1 * q3) + bz * (0.5f - q1 * q1 - q2 * q2));
+        e[0] += my * wz - mz * wy;
+        e[1] += mz * wx - mx * wz;
+        e[2] += mx * wy - my * wx;
+    }
+#endif
+
+    // Body rates in rad/s, plus bias and proportional correction
+    w[0] = gyroADC[PITCH] * (GYRO_SCALE * 1e6f);
+    w[1] = -gyroADC[ROLL] * (GYRO_SCALE * 1e6f);
+    w[2] = -gyroADC[YAW] * (GYRO_SCALE * 1e6f);
+    for (axis = 0; axis < 3; axis++) {
+        gyroBias[axis] += IMU_KI * e[axis] * dT;
+        w[axis] = (w[axis] + gyroBias[axis] + IMU_KP * e[axis]) * (0.5f * dT);
+    }
+
+    // q += 0.5 * q x w * dT
+    qa = q0;
+    qb = q1;
+    qc = q2;
+    q0 += -qb * w[0] - qc * w[1] - q3 * w[2];
+    q1 += qa * w[0] + qc * w[2] - q3 * w[1];
+    q2 += qa * w[1] - qb * w[2] + q3 * w[0];
+    q3 += qa * w[2] + qb * w[1] - qc * w[0];
+    n = InvSqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    q0 *= n;
+    q1 *= n;
+    q2 *= n;
+    q3 *= n;
+
+#if MAG
+    fluxBody[0] = wx;
+    fluxBody[1] = wy;
+    fluxBody[2] = wz;
+#endif
+    attitudeStale = ATT_ANGLES | ATT_HEADING;
+}
+
+// Same outputs as the vector filter: attitude of the gravity vector, heading of GxM
+static void attitudeAngles(void)
+{
+    float vx, vy, vz;
+
+    if (!(attitudeStale & ATT_ANGLES))
+        return;
+    attitudeStale &= ~ATT_ANGLES;
+    vx = 2.0f * (q1 * q3 - q0 * q2);
+    vy = 2.0f * (q0 * q1 + q2 * q3);
+    vz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+    angle[ROLL] = atan2_dd((int32_t)(vx * IMU_FLOAT_Q20), (int32_t)(vz * IMU_FLOAT_Q20));
+    angle[PITCH] = atan2_dd((int32_t)(vy * IMU_FLOAT_Q20), (int32_t)(vz * IMU_FLOAT_Q20));
+}
+
+static void attitudeHeading(void)
+{
+#if MAG
+    float vx, vy, vz, wx = fluxBody[0], wy = fluxBody[1], wz = fluxBody[2];
+
+    if (!(attitudeStale & ATT_HEADING))
+        return;
+    attitudeStale &= ~ATT_HEADING;
+    vx = 2.0f * (q1 * q3 - q0 * q2);
+    vy = 2.0f * (q0 * q1 + q2 * q3);
+    vz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+    heading = atan2_dd((int32_t)((vx * wz - vz * wx) * IMU_FLOAT_Q20), (int32_t)((vz * wy - vy * wz) * IMU_FLOAT_Q20)) / 10;
+#endif
+}
+
+#else
+
+static t_fp_vector EstG, EstM;
+
+void getEstimatedAttitude()
+{
+    uint8_t axis;
+    static int16_t accMag = 0;                  // of the last acc reading
+    static int16_t mgSmooth[3], accTemp[3];     // projection of smoothed and normalized magnetic vector on x/y/z axis, as measured by magnetometer
+    static uint16_t previousT;
+    float scale, deltaGyroAngle[3];
+    uint16_t dT;
+#if defined(GYRO_DRDY)
+    uint16_t currentT = gyroSampleTime;     // integrate over sensor time, not over when we got around to it
+#else
+    uint16_t currentT = micros();
+#endif
+
+    dT = currentT - previousT;                  // in uint16_t, with a 32 bit int the wrap would come out negative
+    scale = dT * GYRO_SCALE;
+    previousT = currentT;
+
+    // Initialization
+    if (accFresh)
+        accMag = 0;
+    for (axis = 0; axis < 3; axis++) {
+        deltaGyroAngle[axis] = gyroADC[axis] * scale;
+        if (accFresh) {
+#if defined(ACC_LPF_FACTOR)
+            accTemp[axis] = (accTemp[axis] - (accTemp[axis] >> 4)) + accADC[axis];
+            accSmooth[axis] = accTemp[axis] >> 4;
+#define ACC_VALUE accSmooth[axis]
+#else
+            accSmooth[axis] = accADC[axis];
+#define ACC_VALUE accADC[axis]
+#endif
+            accMag += (ACC_VALUE * 10 / (int16_t) acc_1G) * (ACC_VALUE * 10 / (int16_t) acc_1G);
+        }
+
+#if MAG
+#if defined(MG_LPF_FACTOR)
+        mgSmooth[axis] = (mgSmooth[axis] * (MG_LPF_FACTOR - 1) + magADC[axis]) / MG_LPF_FACTOR; // LPF for Magnetometer values
+#define MAG_VALUE mgSmooth[axis]
+#else
+#define MAG_VALUE magADC[axis]
+#endif
+#endif
+    }
+
+    rotateV(&EstG.V, deltaGyroAngle);
+#if MAG
+    rotateV(&EstM.V, deltaGyroAngle);
+#endif
+#if GYRO_BIAS
+    {
+        int32_t est[3];
+        int16_t err[3];
+        uint8_t mask = 0;
+
+        if (36 < accMag && accMag < 196) {
+            for (axis = 0; axis < 3; axis++)
+                est[axis] = EstG.A[axis] * 16.0f;
+            err[ROLL] = gyroBiasError(est, accSmooth, ROLL);
+            err[PITCH] = gyroBiasError(est, accSmooth, PITCH);
+            mask = 1 << ROLL | 1 << PITCH;
+        }
+#if MAG
+        if (smallAngle25) {
+            for (axis = 0; axis < 3; axis++)
+                est[axis] = EstM.A[axis] * 16.0f;
+#if defined(MG_LPF_FACTOR)
+            err[YAW] = gyroBiasError(est, mgSmooth, YAW);
+#else
+            err[YAW] = gyroBiasError(est, magADC, YAW);
+#endif
+            mask |= 1 << YAW;
+        }
+#endif
+        gyroBiasTrack(err, mask, dT);
+    }
+#endif
+    if (abs(accSmooth[ROLL]) < acc_25deg && abs(accSmooth[PITCH]) < acc_25deg && accSmooth[YAW] > 0)
+        smallAngle25 = 1;
+    else
+        smallAngle25 = 0;
+
+    // Apply complimentary filter (Gyro drift correction)
+    // If accel magnitude >1.4G or <0.6G and ACC vector outside of the limit range => we neutralize the effect of accelerometers in the angle estimation.
+    // To do that, we just skip filter, as EstV already rotated by Gyro
+    if (accFresh)
+        accVibGate(36 < accMag && accMag < 196);
+    if (accFresh && ((36 < accMag && accMag < 196) || smallAngle25))
+        for (axis = 0; axis < 3; axis++) {
+            int16_t acc = ACC_VALUE;
+#ifndef TRUSTED_ACCZ
+            if (smallAngle25 && axis == YAW)
+                // We consider ACCZ = acc_1G when the acc on other axis is small.
+                // It's a tweak to deal with some configs where ACC_Z tends to a value < acc_1G when high throttle is applied.
+                // This tweak applies only when the multi is not in inverted position
+                acc = acc_1G;
+#endif                          /* !TRUSTED_ACCZ */
+            EstG.A[axis] = (EstG.A[axis] * ACC_CMPF_FACTOR + acc) * INV_GYR_CMPF_FACTOR;
+        }
+#if MAG
+    for (axis = 0; axis < 3; axis++)
+        EstM.A[axis] = (EstM.A[axis] * GYR_CMPFM_FACTOR + MAG_VALUE) * INV_GYR_CMPFM_FACTOR;
+#endif
+    attitudeStale = ATT_ANGLES | ATT_HEADING;
+}
+
+// Attitude of the estimated vector
+static void attitudeAngles(void)
+{
+    if (!(attitudeStale & ATT_ANGLES))
+        return;
+    attitudeStale &= ~ATT_ANGLES;
+    angle[ROLL] = _atan2(EstG.V.X, EstG.V.Z);
+    angle[PITCH] = _atan2(EstG.V.Y, EstG.V.Z);
+}
+
+// Attitude of the cross product vector GxM
+static void attitudeHeading(void)
+{
+#if MAG
+    if (!(attitudeStale & ATT_HEADING))
+        return;
+    attitudeStale &= ~ATT_HEADING;
+    heading = _atan2(EstG.V.X * EstM.V.Z - EstG.V.Z * EstM.V.X, EstG.V.Z * EstM.V.Y - EstG.V.Y * EstM.V.Z) / 10;
+#endif
+}
+#endif                          /* IMU_FIXED_POINT / IMU_QUATERNION */
+
+#endif                          /* OLD_1_7_STAB_CODE */
+
+#if defined(HW_FPU)
+// VSQRT and VDIV take 14 cycles each, faster than the Newton step and exact
+float InvSqrt(float x)
+{
+    return 1.0f / __builtin_sqrtf(x);
+}
+#else
+float InvSqrt(float x)
+{
+    union {
+        int32_t i;
+        float f;
+    } conv;
+    conv.f = x;
+    conv.i = 0x5f3759df - (conv.i >> 1);
+    return 0.5f * conv.f * (3.0f - x * conv.f * conv.f);
+}
+#endif
+
+int32_t isq(int32_t x)
+{
+    return x * x;
+}
+
+// Vertical estimator, run every control cycle right after the IMU. Acceleration is integrated each cycle
+// and every new baro sample pulls altitude, velocity and the acc bias towards it, weighted with the time
+// since the previous sample, so the PID always sees a fresh velocity whatever the baro rate is.
+// Fixed point: altitude and velocity are cm and cm/s in Q8, the acc bias cm/s^2 in Q16, time steps are
+// seconds in Q16. Products are rounded before they are shifted down, a plain arithmetic shift would leak
+// half an LSB downwards every cycle, and the per cycle altitude step keeps its remainder: at 3ms a slow
+// climb moves less than one Q8 LSB per cycle. EstAlt (cm) and EstVelocity (mm/s) keep their units for the PID
+// and telemetry.
+// TRUSTED_ACCZ: the vertical acceleration is the deviation of |acc| from 1G, linearized as
+// (|acc|^2 - 1G^2) / (2 * 1G) which is within 2% up to +-0.3G. Without it the estimate is baro only.
+#define INIT_DELAY      4000000 // us, let the baro settle first
+#define ALT_KP1         141     // observer velocity gain, 0.55/s^2 in Q8
+#define ALT_KP2         256     // observer position gain, 1.0/s in Q8
+#define ALT_KI          10      // observer acc bias gain, 0.04/s^3 in Q8
+#define ALT_BIAS_MAX    1638400 // cm/s^2 Q16, +-25
+#define ALT_DT_MAX      6554    // s Q16, 100ms: longer gaps (a stall, the first sample) are clipped
+#define ALT_VEL_MAX     256000  // cm/s Q8, +-10m/s, keeps velQ8 * dtQ16 in 32 bits
+
+#if defined(HW_FPU)
+// The same observer in single precision. The state is kept relative to the first baro altitude: a few hundred
+// metres above sea level the float resolution would otherwise swallow a slow climb's per cycle step
+void getEstimatedAltitude()
+{
+    static uint8_t inited = 0;
+    static uint8_t lastSample;
+    static uint32_t lastSampleTime, lastRun;
+    static int32_t altBase;
+    static float alt, vel, bias;
+#if defined(TRUSTED_ACCZ)
+    static float accCmScale;
+#endif
+    float AltError, dt;
+
+    if (!inited) {
+        if ((int32_t)(currentTime - INIT_DELAY) < 0 || baroSamples == 0)
+            return;
+        inited = 1;
+        altBase = BaroAlt;
+        alt = 0;
+        vel = 0;
+        bias = 0;
+        lastSample = baroSamples;
+        lastSampleTime = currentTime;
+        lastRun = currentTime;
+#if defined(TRUSTED_ACCZ)
+        accCmScale = 980.665f / (2.0f * acc_1G * acc_1G);      // |acc|^2 - 1G^2 to cm/s^2
+#endif
+    }
+    PROFILE_BEGIN(getEstimatedAltitude);
+
+    dt = min(currentTime - lastRun, 65535) * 1e-6f;
+    lastRun = currentTime;
+#if defined(TRUSTED_ACCZ)
+    vel += (isq(accADC[ROLL]) + isq(accADC[PITCH]) + isq(accADC[YAW]) - isq(acc_1G)) * accCmScale * dt;
+#endif
+    vel += bias * dt;
+    vel = constrain(vel, -ALT_VEL_MAX / 256.0f, ALT_VEL_MAX / 256.0f);
+    alt += vel * dt;
+
+    if (baroSamples != lastSample) {
+        lastSample = baroSamples;
+        dt = min(currentTime - lastSampleTime, 100000) * 1e-6f;
+        lastSampleTime = currentTime;
+        AltError = constrain((float)(BaroAlt - altBase) - alt, -1000.0f, 1000.0f) * dt;
+        alt += AltError * (ALT_KP2 / 256.0f);
+        vel += AltError * (ALT_KP1 / 256.0f);
+        bias = constrain(bias + AltError * (ALT_KI / 256.0f), -ALT_BIAS_MAX / 65536.0f, ALT_BIAS_MAX / 65536.0f);
+    }
+
+    EstAlt = altBase + (int32_t)alt;
+    EstVelocity = (int32_t)(vel * 10.0f);
+    PROFILE_END(getEstimatedAltitude);
+}
+#else
+void getEstimatedAltitude()
+{
+    static uint8_t inited = 0;
+    static uint8_t lastSample;
+    static uint32_t lastSampleTime, lastRun;
+    static int32_t altQ8, velQ8, biasQ16;
+    static uint16_t altFrac;            // what the altitude step lost below Q8, carried to the next cycle
+#if defined(TRUSTED_ACCZ)
+    static int16_t accDevScale, accCmScale;
+    int32_t accDev;
+#endif
+    int32_t AltError, step;
+    uint16_t dtQ16;
+
+    if (!inited) {
+        if ((int32_t)(currentTime - INIT_DELAY) < 0 || baroSamples == 0)
+            return;
+        inited = 1;
+        altQ8 = BaroAlt << 8;
+        velQ8 = 0;
+        biasQ16 = 0;
+        lastSample = baroSamples;
+        lastSampleTime = currentTime;
+        lastRun = currentTime;
+#if defined(TRUSTED_ACCZ)
+        accDevScale = (32768 + acc_1G / 2) / acc_1G;    // 65536 / (2 * 1G)
+        accCmScale = (251050L + acc_1G / 2) / acc_1G;   // 980.665 cm/s^2 in Q8 per 1G
+#endif
+    }
+    PROFILE_BEGIN(getEstimatedAltitude);
+
+    // us since the last run (outerTask() period) to s in Q16, 65536 / 1000000 = 4295 / 65536
+    dtQ16 = ((uint32_t)min(currentTime - lastRun, 65535) * 4295) >> 16;     // at most 4295, 65ms
+    lastRun = currentTime;
+#if defined(TRUSTED_ACCZ)
+    accDev = ((isq(accADC[ROLL]) + isq(accADC[PITCH]) + isq(accADC[YAW]) - isq(acc_1G)) * accDevScale) >> 16;
+    velQ8 += (accDev * accCmScale * dtQ16 + 32768) >> 16;
+#endif
+    velQ8 += (((biasQ16 + 128) >> 8) * dtQ16 + 32768) >> 16;
+    velQ8 = constrain(velQ8, -ALT_VEL_MAX, ALT_VEL_MAX);
+    step = velQ8 * dtQ16 + altFrac;
+    altQ8 += step >> 16;
+    altFrac = step & 0xffff;
+
+    if (baroSamples != lastSample) {
+        lastSample = baroSamples;
+        dtQ16 = ((uint32_t)(currentTime - lastSampleTime) * 4295) >> 16;
+        if ((uint32_t)(currentTime - lastSampleTime) > 100000)
+            dtQ16 = ALT_DT_MAX;
+        lastSampleTime = currentTime;
+        AltError = constrain(BaroAlt - (altQ8 >> 8), -1000, 1000);
+        AltError *= dtQ16;
+        altQ8 += (AltError * ALT_KP2 + 32768) >> 16;
+        velQ8 += (AltError * ALT_KP1 + 32768) >> 16;
+        biasQ16 = constrain(biasQ16 + ((AltError * ALT_KI + 128) >> 8), -ALT_BIAS_MAX, ALT_BIAS_MAX);
+    }
+
+    EstAlt = altQ8 >> 8;
+    EstVelocity = (velQ8 * 10 + 128) >> 8;
+    PROFILE_END(getEstimatedAltitude);
+}
+#endif
+
+/* SENSORS ------------------------------------------------------------------------------ */
+// ************************************************************************************************************
+// board orientation and setup
+// ************************************************************************************************************
+//default board orientation
+#if !defined(ACC_ORIENTATION)
+#define ACC_ORIENTATION(X, Y, Z)  {accADC[ROLL]  = X; accADC[PITCH]  = Y; accADC[YAW]  = Z;}
+#endif
+#if !defined(GYRO_ORIENTATION)
+#define GYRO_ORIENTATION(X, Y, Z) {gyroADC[ROLL] = X; gyroADC[PITCH] = Y; gyroADC[YAW] = Z;}
+#endif
+#if !defined(MAG_ORIENTATION)
+#define MAG_ORIENTATION(X, Y, Z)  {magADC[ROLL]  = X; magADC[PITCH]  = Y; magADC[YAW]  = Z;}
+#endif
+
+/*** I2C address ***/
+#if !defined(ADXL345_ADDRESS)
+#define ADXL345_ADDRESS 0x3A
+//#define ADXL345_ADDRESS 0xA6   //WARNING: Conflicts with a Wii Motion plus!
+#endif
+
+#if !defined(BMA180_ADDRESS)
+#define BMA180_ADDRESS 0x80
+//#define BMA180_ADDRESS 0x82
+#endif
+
+#if !defined(ITG3200_ADDRESS)
+#define ITG3200_ADDRESS 0XD0
+//#define ITG3200_ADDRESS 0XD2
+#endif
+
+#if !defined(MS561101BA_ADDRESS)
+#define MS561101BA_ADDRESS 0xEE //CBR=0 0xEE I2C address when pin CSB is connected to LOW (GND)
+//#define MS561101BA_ADDRESS 0xEF //CBR=1 0xEF I2C address when pin CSB is connected to HIGH (VCC)
+#endif
+
+uint8_t rawADC[6];
+static uint32_t neutralizeTime = 0;
+
+void i2c_getSixRawADC(uint8_t add, uint8_t reg)
+{
+    uint8_t rv = 0;
+    rv = i2c_read(rawADC, 6, add, reg);
+    if (rv != 0)
+        i2cErrorCounter++;
+}
+
+void i2c_writeReg(uint8_t add, uint8_t reg, uint8_t val)
+{
+    uint8_t buf[3];
+    uint8_t rv = 0;
+    buf[0] = add;
+    buf[1] = reg;
+    buf[2] = val;
+    rv = i2c_write(buf, 3);
+    if (rv != 0)
+        i2cErrorCounter++;
+}
+
+uint8_t i2c_readReg(uint8_t add, uint8_t reg)
+{
+    uint8_t data[1];
+    uint8_t rv = 0;
+    rv = i2c_read(data, 1, add, reg);
+    if (rv != 0)
+        i2cErrorCounter++;
+    return data[0];
+}
+
+// 1 when (reg & mask) == id. A missing chip is expected while probing, so no error count
+uint8_t i2c_probeReg(uint8_t add, uint8_t reg, uint8_t mask, uint8_t id)
+{
+    uint8_t data[1];
+    if (i2c_read(data, 1, add, reg) != 0)
+        return 0;
+    return (data[0] & mask) == id;
+}
+
+// queued, non blocking transactions. Check i2c_jobDone() before touching buf again
+void i2c_submitJob(i2cJob_t *job, uint8_t add, uint8_t reg, uint8_t *buf, uint8_t len, uint8_t read)
+{
+    job->address = add;
+    job->subaddr = reg;
+    job->buf = buf;
+    job->len = len;
+    job->read = read;
+    job->done = NULL;
+    if (i2c_submit(job) != 0)
+        i2cErrorCounter++;
+}
+
+// Queues n jobs back to back and waits for the last one that made it into the queue. The queue runs in order,
+// so by then all of them have finished. Returns a bit per job that succeeded, failures are counted here.
+uint8_t i2c_runChain(i2cJob_t *job, uint8_t n)
+{
+    i2cJob_t *last = NULL;
+    uint8_t i, ok = 0;
+
+    for (i = 0; i < n; i++) {
+        job[i].done = NULL;
+        if (i2c_submit(&job[i]) == I2C_SUCCESS)
+            last = &job[i];
+    }
+    if (last)
+        while (last->status == I2C_PENDING)
+            i2c_poll();
+    for (i = 0; i < n; i++) {
+        if (job[i].status == I2C_SUCCESS)
+            ok |= 1 << i;
+        else
+            i2cErrorCounter++;
+    }
+    return ok;
+}
+
+// 1 once the job has finished, successful or not. Failures are counted here.
+uint8_t i2c_jobDone(i2cJob_t *job)
+{
+    if (job->status == I2C_PENDING)
+        return 0;
+    if (job->status != I2C_SUCCESS) {
+        i2cErrorCounter++;
+        job->status = I2C_SUCCESS;          // count it once
+    }
+    return 1;
+}
+
+#if I2C_BUS
+// Register writes nobody waits for: the job and its byte come from postPool and go back to it from the I2C
+// interrupt once the write is done. An empty pool or a refused job falls back to the blocking i2c_writeReg(), so a
+// post is never lost, it only waits. Failures the interrupt counted go to i2cErrorCounter with the next post
+typedef struct {
+    i2cJob_t job;                       // first, the callback's job pointer is the block
+    uint8_t val;
+} i2cPost_t;
+
+static i2cPost_t postStorage[I2C_POST_POOL];
+static pool_t postPool = POOL_INIT(postStorage);
+static volatile uint8_t postErrors = 0;     // interrupt side
+static uint8_t postErrorsSeen = 0;
+
+static void i2c_postDone(i2cJob_t *job)
+{
+    if (job->status != I2C_SUCCESS)
+        postErrors++;
+    pool_freeIsr(&postPool, job);
+}
+
+void i2c_postReg(uint8_t add, uint8_t reg, uint8_t val)
+{
+    i2cPost_t *post;
+    uint8_t errors = postErrors;
+
+    i2cErrorCounter += (uint8_t)(errors - postErrorsSeen);
+    postErrorsSeen = errors;
+    post = pool_alloc(&postPool);
+    if (post) {
+        post->val = val;
+        post->job.address = add;
+        post->job.subaddr = reg;
+        post->job.buf = &post->val;
+        post->job.len = 1;
+        post->job.read = 0;
+        post->job.done = i2c_postDone;
+        if (i2c_submit(&post->job) == I2C_SUCCESS)
+            return;
+        pool_free(&postPool, post);
+    }
+    i2c_writeReg(add, reg, val);
+}
+
+// what 'q' reports, in this order
+static pool_t *const pools[] = { &postPool };
+#endif
+
+// ****************
+// Sensor filters
+// ****************
+// Direct form I, coefficients from the RBJ cookbook in Q14 normalized to a0. Runs in integer on the
+// sensor samples, the part of the output below 1 LSB is carried over so a constant input comes out exact.
+// With FIX_SIMD the two taps of each delay line sit in one word next to their coefficients, two SMLAD-type
+// multiplies and two PKHBT shifts per sample, the same sums as the scalar code.
+#define FILTER_NOTCH_Q      2           // notch width, higher is narrower
+
+typedef struct biquad_t {
+    int16_t b0, b1, b2, a1, a2;         // b0 == 0: stage off
+#if defined(FIX_SIMD)
+    fix_pair_t b12, a12;                // b1 | b2, a1 | a2
+    fix_pair_t x12, y12;                // x1 | x2, y1 | y2
+#else
+    int16_t x1, x2, y1, y2;
+#endif
+    int32_t rest;
+} biquad_t;
+
+static biquad_t gyroFilter[3][2], accFilter[3][2];     // [axis][low pass, notch]
+static uint16_t gyroSamplePeriod = 0;   // us, measured over the gyro calibration, 0 until then
+static uint16_t accSamplePeriod = 0;
+static uint32_t filterMeasureStart;
+static uint16_t filterAccSamples;
+
+static void biquadSetup(biquad_t *f, uint16_t hz, uint16_t period, uint8_t notch)
+{
+    uint32_t w;
+    int16_t s, c;
+    int32_t alpha, a0;
+
+#if defined(FIX_SIMD)
+    f->x12 = f->y12 = 0;
+#else
+    f->x1 = f->x2 = f->y1 = f->y2 = 0;
+#endif
+    f->rest = 0;
+    f->b0 = 0;
+    w = ((uint32_t)hz * period / 100) * 36 / 100;     // 0.1 deg per sample
+    if (hz == 0 || period == 0 || w > 1620)             // not set, or too close to Nyquist to mean anything
+        return;
+    s = sin_dd(w);
+    c = cos_dd(w);
+    alpha = notch ? s / (2 * FILTER_NOTCH_Q) : ((int32_t)s * 11585) >> 14;     // sin(w) / 2Q, Butterworth Q = 1/sqrt(2)
+    a0 = 16384 + alpha;
+    f->a1 = (int32_t)c * -2 * 16384 / a0;
+    f->a2 = (16384 - alpha) * 16384 / a0;
+    // b from the rounded a, so the gain at DC is exactly 1: b0 + b1 + b2 = 1 + a1 + a2
+    if (notch) {
+        f->b1 = f->a1;
+        f->b0 = (16384 + f->a2) / 2;
+        f->b2 = 16384 + f->a2 - f->b0;
+    } else {
+        f->b0 = (16384 + f->a1 + f->a2) / 4;
+        f->b2 = f->b0;
+        f->b1 = 16384 + f->a1 + f->a2 - 2 * f->b0;
+    }
+#if defined(FIX_SIMD)
+    f->b12 = fix_pack16(f->b1, f->b2);
+    f->a12 = fix_pack16(f->a1, f->a2);
+#endif
+}
+
+#if defined(FIX_SIMD)
+static int16_t biquadApply(biquad_t *f, int16_t x)
+{
+    int32_t acc;
+    int16_t y;
+
+    acc = fix_smlad(f->x12, f->b12, (int32_t)f->b0 * x + f->rest) - fix_smuad(f->y12, f->a12);
+    y = acc >> 14;
+    f->rest = acc & 0x3FFF;
+    f->x12 = fix_push16(f->x12, x);
+    f->y12 = fix_push16(f->y12, y);
+    return y;
+}
+#else
+static int16_t biquadApply(biquad_t *f, int16_t x)
+{
+    int32_t acc;
+    int16_t y;
+
+    acc = (int32_t)f->b0 * x + (int32_t)f->b1 * f->x1 + (int32_t)f->b2 * f->x2
+        - (int32_t)f->a1 * f->y1 - (int32_t)f->a2 * f->y2 + f->rest;
+    y = acc >> 14;
+    f->rest = acc & 0x3FFF;
+    f->x2 = f->x1;
+    f->x1 = x;
+    f->y2 = f->y1;
+    f->y1 = y;
+    return y;
+}
+#endif
+
+// the low pass and notch of one axis
+static int16_t filterAxis(biquad_t *f, int16_t x)
+{
+    if (f[0].b0)
+        x = biquadApply(&f[0], x);
+    if (f[1].b0)
+        x = biquadApply(&f[1], x);
+    return x;
+}
+
+// New cutoffs from paramApply(), or new sample periods after a gyro calibration
+#if defined(DYN_NOTCH)
+static biquad_t gyroDynNotch[3];
+static uint16_t notchHz[3];             // Hz, 0 until a peak was found
+#endif
+
+void filterSetup(void)
+{
+    uint8_t axis;
+
+    for (axis = 0; axis < 3; axis++) {
+        biquadSetup(&gyroFilter[axis][0], sensorFilter.gyroLpf[axis], gyroSamplePeriod, 0);
+        biquadSetup(&gyroFilter[axis][1], sensorFilter.gyroNotch[axis], gyroSamplePeriod, 1);
+        biquadSetup(&accFilter[axis][0], sensorFilter.accLpf[axis], accSamplePeriod, 0);
+        biquadSetup(&accFilter[axis][1], sensorFilter.accNotch[axis], accSamplePeriod, 1);
+#if defined(DYN_NOTCH)
+        gyroDynNotch[axis].b0 = 0;      // notchTask() starts it again at the new rate
+        notchHz[axis] = 0;
+#endif
+    }
+}
+
+#if defined(DYN_NOTCH)
+// ****************
+// Dynamic gyro notch
+// ****************
+// GYRO_Common() keeps the last DYN_NOTCH_N gyro samples per axis after the fixed filters, notchTask() takes one
+// axis per run through a Hann window and a fixed point radix 4 FFT, finds the strongest bin between
+// DYN_NOTCH_MIN_HZ and DYN_NOTCH_MAX_HZ and moves that axis' notch (a third gyro stage) to it. Block scaled:
+// the window is shifted up to use 14 bits, every FFT stage divides by 4, so nothing can overflow and quiet
+// gyros still resolve. The peak is interpolated between bins, a peak less than DYN_NOTCH_SNR times the mean
+// of the band leaves the notch where it was.
+#define DYN_NOTCH_N         256         // power of 4, the ring index is a byte
+#define DYN_NOTCH_SNR       4
+
+static int16_t notchRing[3][DYN_NOTCH_N];
+static uint8_t notchHead = 0;
+static int16_t fftRe[DYN_NOTCH_N], fftIm[DYN_NOTCH_N];
+static int16_t fftSin[DYN_NOTCH_N];     // sin(2 pi i / N) in Q14, cos is N / 4 on
+static uint8_t notchAxis = 0;
+
+// In place decimation in frequency, the output comes out in bit reversed order. W = exp(-2 pi j / N)
+static void fft4(int16_t *re, int16_t *im)
+{
+    uint16_t n1, n2, step, i, j, i1, i2, i3, t;
+    int32_t ar0, ai0, ar1, ai1, br0, bi0, br1, bi1, xr, xi;
+    int16_t c, s;
+
+    for (n2 = DYN_NOTCH_N, step = 1; n2 > 1; n2 >>= 2, step <<= 2) {
+        n1 = n2 >> 2;
+        for (j = 0; j < n1; j++) {
+            t = j * step;
+            for (i = j; i < DYN_NOTCH_N; i += n2) {
+                i1 = i + n1;
+                i2 = i1 + n1;
+                i3 = i2 + n1;
+                ar0 = (int32_t)re[i] + re[i2];
+                ai0 = (int32_t)im[i] + im[i2];
+                ar1 = (int32_t)re[i] - re[i2];
+                ai1 = (int32_t)im[i] - im[i2];
+                br0 = (int32_t)re[i1] + re[i3];
+                bi0 = (int32_t)im[i1] + im[i3];
+                br1 = (int32_t)re[i1] - re[i3];
+                bi1 = (int32_t)im[i1] - im[i3];
+                re[i] = (ar0 + br0) >> 2;
+                im[i] = (ai0 + bi0) >> 2;
+                // (a0 - b0) W^2t
+                xr = ar0 - br0;
+                xi = ai0 - bi0;
+                c = fftSin[(2 * t + DYN_NOTCH_N / 4) & (DYN_NOTCH_N - 1)];
+                s = fftSin[2 * t];
+                re[i1] = (xr * c + xi * s) >> 16;
+                im[i1] = (xi * c - xr * s) >> 16;
+                // (a1 - j b1) W^t
+                xr = ar1 + bi1;
+                xi = ai1 - br1;
+                c = fftSin[(t + DYN_NOTCH_N / 4) & (DYN_NOTCH_N - 1)];
+                s = fftSin[t];
+                re[i2] = (xr * c + xi * s) >> 16;
+                im[i2] = (xi * c - xr * s) >> 16;
+                // (a1 + j b1) W^3t
+                xr = ar1 - bi1;
+                xi = ai1 + br1;
+                c = fftSin[(3 * t + DYN_NOTCH_N / 4) & (DYN_NOTCH_N - 1)];
+                s = fftSin[3 * t];
+                re[i3] = (xr * c + xi * s) >> 16;
+                im[i3] = (xi * c - xr * s) >> 16;
+            }
+        }
+    }
+}
+
+static uint8_t bitrev8(uint8_t v)
+{
+    v = (v & 0xF0) >> 4 | (v & 0x0F) << 4;
+    v = (v & 0xCC) >> 2 | (v & 0x33) << 2;
+    return (v & 0xAA) >> 1 | (v & 0x55) << 1;
+}
+
+// amplitude of bin k
+static uint16_t fftBin(uint8_t k)
+{
+    uint8_t p = bitrev8(k);
+
+    return isqrt32((int32_t)fftRe[p] * fftRe[p] + (int32_t)fftIm[p] * fftIm[p]);
+}
+
+void notchTask(void)
+{
+    uint8_t axis = notchAxis, k, kMin, kMax, kPeak = 0, shift;
+    uint16_t i, a, aPeak = 0, am, ap, w, hz;
+    int16_t m = 0, x;
+    uint32_t sum = 0;
+    int32_t d;
+    biquad_t t;
+
+    if (!gyroSamplePeriod)
+        return;                         // the sample rate isn't known before the gyro calibration
+    if (!fftSin[DYN_NOTCH_N / 4])
+        for (i = 0; i < DYN_NOTCH_N; i++)
+            fftSin[i] = sin_dd(((uint32_t)i * 3600 + DYN_NOTCH_N / 2) / DYN_NOTCH_N);
+    notchAxis = axis < 2 ? axis + 1 : 0;
+
+    for (i = 0; i < DYN_NOTCH_N; i++) {
+        x = abs(notchRing[axis][i]);
+        if (x > m)
+            m = x;
+    }
+    for (shift = 0; shift < 14 && m < 8192; shift++)
+        m <<= 1;
+    for (i = 0; i < DYN_NOTCH_N; i++) {
+        w = (16384 - fftSin[(i + DYN_NOTCH_N / 4) & (DYN_NOTCH_N - 1)]) >> 1;     // Hann
+        fftRe[i] = ((int32_t)(notchRing[axis][(uint8_t)(notchHead + i)] << shift) * w) >> 14;       // oldest first
+        fftIm[i] = 0;
+    }
+    fft4(fftRe, fftIm);
+
+    // bins of the band, the top one kept off Nyquist so it has a neighbour
+    kMin = max((uint32_t)DYN_NOTCH_MIN_HZ * DYN_NOTCH_N * gyroSamplePeriod / 1000000, 1);
+    kMax = min((uint32_t)DYN_NOTCH_MAX_HZ * DYN_NOTCH_N * gyroSamplePeriod / 1000000, DYN_NOTCH_N / 2 - 2);
+    if (kMin >= kMax)
+        return;
+    for (k = kMin; k <= kMax; k++) {
+        a = fftBin(k);
+        sum += a;
+        if (a > aPeak) {
+            aPeak = a;
+            kPeak = k;
+        }
+    }
+    if (!aPeak || (uint32_t)aPeak * (kMax - kMin + 1) < sum * DYN_NOTCH_SNR)
+        return;
+    // between the bins in 1/16: the Hann window's main lobe, from the larger neighbour
+    am = fftBin(kPeak - 1);
+    ap = fftBin(kPeak + 1);
+    d = ap > am ? (int32_t)16 * (2 * ap - aPeak) / (aPeak + ap) : -(int32_t)16 * (2 * am - aPeak) / (aPeak + am);
+    hz = ((int32_t)kPeak * 16 + d) * 15625 / ((uint32_t)gyroSamplePeriod * 64);        // 1e6 / (N * 16)
+    hz = constrain(hz, DYN_NOTCH_MIN_HZ, DYN_NOTCH_MAX_HZ);
+    notchHz[axis] = notchHz[axis] ? (notchHz[axis] + hz + 1) >> 1 : hz;
+    // new coefficients, a running stage keeps its state so the gyro doesn't glitch
+    if (!gyroDynNotch[axis].b0) {
+        biquadSetup(&gyroDynNotch[axis], notchHz[axis], gyroSamplePeriod, 1);
+        return;
+    }
+    biquadSetup(&t, notchHz[axis], gyroSamplePeriod, 1);
+    gyroDynNotch[axis].b0 = t.b0;
+    gyroDynNotch[axis].b1 = t.b1;
+    gyroDynNotch[axis].b2 = t.b2;
+    gyroDynNotch[axis].a1 = t.a1;
+    gyroDynNotch[axis].a2 = t.a2;
+#if defined(FIX_SIMD)
+    gyroDynNotch[axis].b12 = t.b12;
+    gyroDynNotch[axis].a12 = t.a12;
+#endif
+}
+#endif
+
+// ****************
+// Sensor pipeline
+// ****************
+// A driver's ORIENTATION macro rotates and scales its reading into gyroADC[] / accADC[] (folded into the
+// driver at compile time), GYRO_Common() / ACC_Common() take it from there and sensorPass() does the rest in
+// one loop over the axes with the sample in a register: zero offset, the glitch clamp, the filter bank and
+// for the gyro the DYN_NOTCH capture and stage.
+#define GYRO_GLITCH         (800 * GYRO_FINE)   // the most a gyro reading may move from the one before
+
+typedef struct sensorPipe_t {
+    int16_t *zero;                      // subtracted from the raw reading
+    int16_t *last;                      // the last reading after the clamp, NULL: no glitch clamp
+    biquad_t (*filter)[2];              // [axis][low pass, notch]
+#if defined(DYN_NOTCH)
+    biquad_t *notch;                    // per axis, NULL: no dynamic notch
+#endif
+} sensorPipe_t;
+
+static int16_t previousGyroADC[3] = { 0, 0, 0 };
+
+static const sensorPipe_t gyroPipe = {
+    gyroZero, previousGyroADC, gyroFilter,
+#if defined(DYN_NOTCH)
+    gyroDynNotch,
+#endif
+};
+
+static const sensorPipe_t accPipe = {
+    accZero, NULL, accFilter,
+#if defined(DYN_NOTCH)
+    NULL,
+#endif
+};
+
+static void sensorPass(const sensorPipe_t *p, int16_t *v)
+{
+    uint8_t axis;
+    int16_t x;
+
+    for (axis = 0; axis < 3; axis++) {
+        x = v[axis] - p->zero[axis];
+        if (p->last) {
+            x = constrain(x, p->last[axis] - GYRO_GLITCH, p->last[axis] + GYRO_GLITCH);
+            p->last[axis] = x;
+        }
+        x = filterAxis(p->filter[axis], x);
+#if defined(DYN_NOTCH)
+        if (p->notch) {
+            notchRing[axis][notchHead] = x;
+            if (p->notch[axis].b0)
+                x = biquadApply(&p->notch[axis], x);
+        }
+#endif
+        v[axis] = x;
+    }
+#if defined(DYN_NOTCH)
+    if (p->notch)
+        notchHead++;
+#endif
+}
+
+// ****************
+// Calibration
+// ****************
+// Gyro and acc zero are the mean of CALIB_SAMPLES readings, one per sensor read, so the loop keeps running
+// all along. Welford's running mean and variance: no sums to overflow and no sample buffer. A reading too
+// far from the mean so far, or too much spread at the end, means the copter was moved and the run starts
+// over. After CALIB_RESTARTS of those the run is taken as it is, arming can't be held off forever.
+#define CALIB_SAMPLES       400
+#define CALIB_RESTARTS      10
+#define GYRO_CALIB_MOTION   (48 * GYRO_FINE)    // off the running mean, ~12 deg/s at 2000 deg/s full scale
+#define GYRO_CALIB_NOISE    (256 * GYRO_FINE * GYRO_FINE)   // LSB^2, variance over the whole run
+
+typedef struct calib_t {
+    uint16_t n;
+    uint8_t restarts;
+    int32_t mean[3];                    // Q8
+    int32_t m2[3];                      // sum of squared deviations from the mean, LSB^2
+} calib_t;
+
+static calib_t gyroCal, accCal;
+
+static void calibReset(calib_t *c)
+{
+    uint8_t axis;
+
+    c->n = 0;
+    for (axis = 0; axis < 3; axis++) {
+        c->mean[axis] = 0;
+        c->m2[axis] = 0;
+    }
+}
+
+// 0 if v is more than motion LSB away from the mean, nothing is added then
+static uint8_t calibAdd(calib_t *c, int16_t *v, int16_t motion)
+{
+    int32_t d;
+    uint8_t axis;
+
+    if (c->n) {
+        for (axis = 0; axis < 3; axis++) {
+            d = (int32_t)v[axis] * 256 - c->mean[axis];
+            if (abs(d) > (int32_t)motion * 256)
+                return 0;
+        }
+    }
+    c->n++;
+    for (axis = 0; axis < 3; axis++) {
+        d = (int32_t)v[axis] * 256 - c->mean[axis];
+        c->mean[axis] += d / c->n;
+        c->m2[axis] += ((d >> 4) * (((int32_t)v[axis] * 256 - c->mean[axis]) >> 4)) >> 8;
+    }
+    return 1;
+}
+
+// 1 if the run is good to use, every axis below noise LSB^2
+static uint8_t calibQuiet(calib_t *c, int32_t noise)
+{
+    uint8_t axis;
+
+    for (axis = 0; axis < 3; axis++)
+        if (c->m2[axis] / (c->n - 1) > noise)
+            return 0;
+    return 1;
+}
+
+static int16_t calibMean(calib_t *c, uint8_t axis)
+{
+    return (c->mean[axis] + 128) >> 8;
+}
+
+// Called with the raw reading, 0 when the run has to start over. The caller then sets its counter to
+// CALIB_SAMPLES + 1 so the next reading is the first of a new run.
+static uint8_t calibStep(calib_t *c, uint16_t left, int16_t *v, int16_t motion, int32_t noise)
+{
+    if (left == CALIB_SAMPLES)
+        calibReset(c);
+    if (c->restarts >= CALIB_RESTARTS) {
+        calibAdd(c, v, 0x7FFF);
+        return 1;
+    }
+    if (!calibAdd(c, v, motion) || (left == 1 && !calibQuiet(c, noise))) {
+        c->restarts++;
+        return 0;
+    }
+    return 1;
+}
+
+// ****************
+// GYRO common part
+// ****************
+void GYRO_Common()
+{
+    uint8_t axis;
+
+#if defined(HIL_INJECT)
+    if (HIL_ACTIVE())
+        for (axis = 0; axis < 3; axis++)
+            gyroADC[axis] = hilGyro[axis] * GYRO_FINE;
+#endif
+    if (calibratingG > 0) {
+        // the filters need the real sample rates, which depend on the board and the loop: time them here
+        if (calibratingG == CALIB_SAMPLES) {
+            filterMeasureStart = currentTime;
+            filterAccSamples = 0;
+        }
+        if (!calibStep(&gyroCal, calibratingG, gyroADC, GYRO_CALIB_MOTION, GYRO_CALIB_NOISE)) {
+            calibratingG = CALIB_SAMPLES + 1;
+        } else if (calibratingG == 1) {
+            for (axis = 0; axis < 3; axis++)
+                gyroZero[axis] = calibMean(&gyroCal, axis);
+#if GYRO_BIAS
+            gyroBiasReset();
+#endif
+            gyroCal.restarts = 0;
+            gyroSamplePeriod = (currentTime - filterMeasureStart) / (CALIB_SAMPLES - 1);
+            accSamplePeriod = filterAccSamples ? (currentTime - filterMeasureStart) / filterAccSamples : 0;
+            filterSetup();
+            ledBlink(10 * (1 + 3 * nunchuk));
+        }
+        for (axis = 0; axis < 3; axis++) {
+            if (calibratingG > 1)
+                gyroZero[axis] = 0;
+            gyroADC[axis] = gyroZero[axis];     // consumers see 0 until the run is done
+        }
+        calibratingG--;
+    }
+    sensorPass(&gyroPipe, gyroADC);
+}
+
+// ****************
+// ACC vibration monitor
+// ****************
+// Every raw reading feeds a per axis RMS around a short running mean (above ~ a few Hz at the usual loop
+// rates, what the props and motors shake in) and is checked against the driver's full scale. Windows of
+// ACC_VIB_WINDOW readings, the attitude filter reports through accVibGate() whether it could use the ACC.
+#define ACC_VIB_WINDOW      256
+
+static struct {
+    uint16_t rms[3];            // acc LSB, last window
+    uint16_t clip[3];           // readings at full scale since boot, saturating
+    uint8_t rejected;           // % of attitude updates without the ACC correction, last window
+} accVib;
+
+static uint16_t accClip = 0;    // driver full scale in accADC units, set by its init(). 0: not checked
+static int16_t accPeak[3];      // largest |sample| for drivers that hand on a batch average, in accADC axes
+static int32_t accVibMean[3];   // x16
+static uint32_t accVibSq[3];
+static uint16_t accVibCount = 0;
+static uint16_t accVibUpdates = 0, accVibRejects = 0;
+static uint8_t accVibSeeded = 0;
+
+static uint16_t isqrt32(uint32_t v)
+{
+    uint32_t r = 0, b = 1UL << 30;
+
+    while (b > v)
+        b >>= 2;
+    while (b) {
+        if (v >= r + b) {
+            v -= r + b;
+            r = (r >> 1) + b;
+        } else
+            r >>= 1;
+        b >>= 2;
+    }
+    return r;
+}
+
+void accVibGate(uint8_t accepted)
+{
+    accVibUpdates++;
+    if (!accepted)
+        accVibRejects++;
+}
+
+static void accVibSample(void)
+{
+    uint8_t axis;
+    int16_t a, d;
+
+    for (axis = 0; axis < 3; axis++) {
+        a = accADC[axis];
+        if (accClip) {
+            d = abs(a);
+            if (accPeak[axis] > d)
+                d = accPeak[axis];
+            if (d >= accClip - 1 && accVib.clip[axis] < 0xFFFF)
+                accVib.clip[axis]++;
+        }
+        accPeak[axis] = 0;
+        if (!accVibSeeded)
+            accVibMean[axis] = (int32_t)a * 16;    // first reading since boot, nothing to settle from
+        accVibMean[axis] += a - (accVibMean[axis] >> 4);
+        d = constrain(a - (accVibMean[axis] >> 4), -2047, 2047);
+        accVibSq[axis] += (int32_t)d * d;
+    }
+    accVibSeeded = 1;
+    if (++accVibCount < ACC_VIB_WINDOW)
+        return;
+    for (axis = 0; axis < 3; axis++) {
+        accVib.rms[axis] = isqrt32(accVibSq[axis] / ACC_VIB_WINDOW);
+        accVibSq[axis] = 0;
+    }
+    accVib.rejected = accVibUpdates ? (uint32_t)accVibRejects * 100 / accVibUpdates : 0;
+    accVibCount = 0;
+    accVibUpdates = 0;
+    accVibRejects = 0;
+}
+
+// ****************
+// ACC common part
+// ****************
+void ACC_Common()
+{
+    uint8_t axis;
+
+#if defined(HIL_INJECT)
+    if (HIL_ACTIVE())
+        for (axis = 0; axis < 3; axis++)
+            accADC[axis] = hilAcc[axis];
+#endif
+    accVibSample();
+    if (calibratingA > 0) {
+        // 1/16 G off the mean is a moved copter, noise has to stay under 1/32 G
+        if (!calibStep(&accCal, calibratingA, accADC, acc_1G >> 4, sq((int32_t)(acc_1G >> 5)))) {
+            calibratingA = CALIB_SAMPLES + 1;
+        } else if (calibratingA == 1) {
+            // shift Z down by acc_1G and store values in EEPROM at end of calibration
+            accZero[ROLL] = calibMean(&accCal, ROLL);
+            accZero[PITCH] = calibMean(&accCal, PITCH);
+            accZero[YAW] = calibMean(&accCal, YAW) - acc_1G;   // for nunchuk 200=1G
+            accCal.restarts = 0;
+            accTrim[ROLL] = 0;
+            accTrim[PITCH] = 0;
+            writeParams();      // write accZero in EEPROM
+        }
+        for (axis = 0; axis < 3; axis++) {
+            if (calibratingA > 1)
+                accZero[axis] = 0;
+            accADC[axis] = accZero[axis];       // consumers see 0 until the run is done
+        }
+        calibratingA--;
+    }
+    if (calibratingG > 0)
+        filterAccSamples++;
+    sensorPass(&accPipe, accADC);
+}
+
+// ************************************************************************************************************
+// Pressure to altitude, shared by the baro drivers
+// ************************************************************************************************************
+// BaroAlt = 4433000 * (1 - (p / 101325) ^ 0.190295) cm. The soft float pow() is a big library and takes
+// milliseconds on the STM8, so by default it is a linear interpolation in a table of the same formula
+// every 512Pa from 49152Pa (~5500m) to 110592Pa (~-700m): under 9cm off anywhere in that range.
+// BARO_ALT_POW in config.h brings back the float version.
+#if BARO
+#if defined(BARO_ALT_POW)
+static int32_t baroPressureToAlt(int32_t p)
+{
+    return (1.0f - pow(p / 101325.0f, 0.190295f)) * 4433000.0f;
+}
+#else
+#define BARO_ALT_P_MIN      49152
+#define BARO_ALT_P_SHIFT    9
+#define BARO_ALT_POINTS     121
+
+static const int32_t baroAltTable[BARO_ALT_POINTS] = {
+    570116, 562490, 554929, 547429, 539991, 532613, 525293, 518031,
+    510827, 503678, 496584, 489544, 482557, 475622, 468739, 461906,
+    455123, 448389, 441702, 435063, 428471, 421924, 415423, 408966,
+    402553, 396183, 389856, 383570, 377325, 371122, 364958, 358834,
+    352748, 346702, 340692, 334721, 328786, 322887, 317024, 311197,
+    305404, 299645, 293921, 288230, 282572, 276947, 271354, 265793,
+    260263, 254764, 249296, 243858, 238450, 233072, 227722, 222401,
+    217109, 211845, 206609, 201400, 196219, 191064, 185935, 180833,
+    175757, 170707, 165681, 160681, 155706, 150755, 145828, 140926,
+    136047, 131191, 126359, 121549, 116763, 111999, 107257, 102537,
+    97839, 93162, 88507, 83873, 79260, 74667, 70096, 65544,
+    61012, 56501, 52009, 47536, 43083, 38649, 34234, 29838,
+    25460, 21101, 16760, 12437, 8132, 3845, -425, -4677,
+    -8912, -13130, -17330, -21514, -25682, -29833, -33967, -38086,
+    -42188, -46274, -50345, -54400, -58439, -62463, -66471, -70465,
+    -74444
+};
+
+static int32_t baroPressureToAlt(int32_t p)
+{
+    uint16_t i;
+    int16_t frac;
+
+    p -= BARO_ALT_P_MIN;
+    if (p < 0)
+        p = 0;
+    i = p >> BARO_ALT_P_SHIFT;
+    if (i >= BARO_ALT_POINTS - 1)
+        return baroAltTable[BARO_ALT_POINTS - 1];
+    frac = p & ((1 << BARO_ALT_P_SHIFT) - 1);
+    return baroAltTable[i] + (((baroAltTable[i + 1] - baroAltTable[i]) * frac) >> BARO_ALT_P_SHIFT);
+}
+#endif
+#endif
+
+
+// ************************************************************************************************************
+// I2C Barometer BOSCH BMP085
+// ************************************************************************************************************
+// I2C adress: 0xEE (8bit)   0x77 (7bit)
+// principle:
+//  1) read the calibration register (only once at the initialization)
+//  2) read uncompensated temperature (not mandatory at every cycle)
+//  3) read uncompensated pressure
+//  4) raw temp + raw pressure => calculation of the adjusted pressure
+//  the following code uses the maximum precision setting (oversampling setting 3)
+// ************************************************************************************************************
+
+#if defined(BMP085)
+#define BMP085_ADDRESS  0xEE
+#define BMP085_CTRL     0xF4
+#define BMP085_ADC      0xF6
+#define BMP085_TEMP     0x2E
+#define BMP085_DATA     0xAA
+
+static struct {
+    // sensor registers from the BOSCH BMP085 datasheet
+    int16_t ac1, ac2, ac3, b1, b2, mb, mc, md;
+    uint16_t ac4, ac5, ac6;
+    uint16_t ut;                       //uncompensated T
+    uint32_t up;                       //uncompensated P
+    int32_t b3;                        //temperature stage of the datasheet, from i2c_BMP085_Temperature()
+    uint32_t b4;
+    uint8_t tempCount;                 //pressure conversions left before the next temperature one
+    pt_t pt;                           //bmp085Thread()
+    i2cJob_t job;                      // conversions are started and read out without waiting on the bus
+    uint8_t raw[3];
+} bmp085_ctx;
+#define OSS 3
+// Temperature only moves slowly, it is converted once every BMP085_TEMP_EVERY pressure samples
+#if !defined(BMP085_TEMP_EVERY)
+#define BMP085_TEMP_EVERY 8
+#endif
+
+// read a 16 bit register
+int16_t i2c_BMP085_readIntRegister(uint8_t r)
+{
+    uint8_t raw[2];
+
+    i2c_read(raw, 2, BMP085_ADDRESS, r);
+    return (int16_t)raw[0] << 8 | raw[1];
+}
+
+void i2c_BMP085_readCalibration(void)
+{
+    delay(10);
+    bmp085_ctx.ac1 = i2c_BMP085_readIntRegister(0xAA);
+    bmp085_ctx.ac2 = i2c_BMP085_readIntRegister(0xAC);
+    bmp085_ctx.ac3 = i2c_BMP085_readIntRegister(0xAE);
+    bmp085_ctx.ac4 = i2c_BMP085_readIntRegister(0xB0);
+    bmp085_ctx.ac5 = i2c_BMP085_readIntRegister(0xB2);
+    bmp085_ctx.ac6 = i2c_BMP085_readIntRegister(0xB4);
+    bmp085_ctx.b1 = i2c_BMP085_readIntRegister(0xB6);
+    bmp085_ctx.b2 = i2c_BMP085_readIntRegister(0xB8);
+    bmp085_ctx.mb = i2c_BMP085_readIntRegister(0xBA);
+    bmp085_ctx.mc = i2c_BMP085_readIntRegister(0xBC);
+    bmp085_ctx.md = i2c_BMP085_readIntRegister(0xBE);
+}
+
+// read uncompensated temperature value: send command first
+void i2c_BMP085_UT_Start(void)
+{
+    i2c_writeReg(BMP085_ADDRESS, BMP085_CTRL, BMP085_TEMP);
+}
+
+// read uncompensated pressure value: send command first
+void i2c_BMP085_UP_Start(void)
+{
+    i2c_writeReg(BMP085_ADDRESS, BMP085_CTRL, 0x34 + (OSS << 6));      // control register value for oversampling setting 3
+}
+
+// read uncompensated pressure value: read result bytes
+// the datasheet suggests a delay of 25.5 ms (oversampling settings 3) after the send command
+void i2c_BMP085_UP_Read(void)
+{
+    uint8_t raw[3];
+    i2c_read(raw, 3, BMP085_ADDRESS, BMP085_ADC);
+    bmp085_ctx.up = ((((uint32_t)raw[0] << 16) | ((uint32_t)raw[1] << 8) | ((uint32_t)raw[2])) >> (8 - OSS));
+}
+
+// read uncompensated temperature value: read result bytes
+// the datasheet suggests a delay of 4.5 ms after the send command
+void i2c_BMP085_UT_Read(void)
+{
+    uint8_t raw[2];
+
+    i2c_read(raw, 2, BMP085_ADDRESS, BMP085_ADC);
+    bmp085_ctx.ut = (uint16_t)raw[0] << 8 | raw[1];
+}
+
+// The datasheet's calculation in two stages, b3 and b4 only depend on the calibration and UT: worked out
+// once per temperature conversion, the division by x1 + md with them. Every pressure sample is left with b7 / b4.
+// The results are the datasheet's to the bit.
+void i2c_BMP085_Temperature(void)
+{
+    int32_t x1, x2, x3, b5, b6, tmp;
+
+    x1 = ((int32_t) bmp085_ctx.ut - bmp085_ctx.ac6) * bmp085_ctx.ac5 >> 15;
+    x2 = ((int32_t) bmp085_ctx.mc << 11) / (x1 + bmp085_ctx.md);
+    b5 = x1 + x2;
+    b6 = b5 - 4000;
+    x1 = (bmp085_ctx.b2 * (b6 * b6 >> 12)) >> 11;
+    x2 = bmp085_ctx.ac2 * b6 >> 11;
+    x3 = x1 + x2;
+    tmp = bmp085_ctx.ac1;
+    tmp = (tmp * 4 + x3) << OSS;
+    bmp085_ctx.b3 = (tmp + 2) / 4;
+    x1 = bmp085_ctx.ac3 * b6 >> 13;
+    x2 = (bmp085_ctx.b1 * (b6 * b6 >> 12)) >> 16;
+    x3 = ((x1 + x2) + 2) >> 2;
+    bmp085_ctx.b4 = (bmp085_ctx.ac4 * (uint32_t) (x3 + 32768)) >> 15;
+}
+
+void Baro_init(void)
+{
+    delay(10);
+    i2c_BMP085_readCalibration();
+    i2c_BMP085_UT_Start();
+    delay(5);
+    i2c_BMP085_UT_Read();
+    i2c_BMP085_Temperature();
+}
+
+void i2c_BMP085_Calculate(void)
+{
+    int32_t x1, x2, p;
+    uint32_t b4 = bmp085_ctx.b4, b7;
+
+    b7 = ((uint32_t)bmp085_ctx.up - bmp085_ctx.b3) * (50000 >> OSS);
+    p = b7 < 0x80000000 ? (b7 * 2) / b4 : (b7 / b4) * 2;
+    x1 = (p >> 8) * (p >> 8);
+    x1 = (x1 * 3038) >> 16;
+    x2 = (-7357 * p) >> 16;
+    pressure = p + ((x1 + x2 + 3791) >> 4);
+}
+
+// One conversion cycle after the other: the temperature every BMP085_TEMP_EVERY samples, then the pressure.
+// Each wait is for the datasheet conversion time and then for the queued job, the bus never holds up the task
+static uint8_t bmp085Thread(void)
+{
+    pt_t *pt = &bmp085_ctx.pt;
+    uint8_t *raw = bmp085_ctx.raw;
+
+    PT_BEGIN(pt);
+    for (;;) {
+        if (!bmp085_ctx.tempCount) {
+            raw[0] = BMP085_TEMP;
+            i2c_submitJob(&bmp085_ctx.job, BMP085_ADDRESS, BMP085_CTRL, raw, 1, 0);
+            PT_SLEEP(pt, currentTime, 4600);
+            PT_WAIT_UNTIL(pt, i2c_jobDone(&bmp085_ctx.job));
+            i2c_submitJob(&bmp085_ctx.job, BMP085_ADDRESS, BMP085_ADC, raw, 2, 1);
+            PT_WAIT_UNTIL(pt, i2c_jobDone(&bmp085_ctx.job));
+            bmp085_ctx.ut = (uint16_t)raw[0] << 8 | raw[1];
+            i2c_BMP085_Temperature();
+            bmp085_ctx.tempCount = BMP085_TEMP_EVERY;
+        }
+        bmp085_ctx.tempCount--;
+        raw[0] = 0x34 + (OSS << 6);     // control register value for oversampling setting 3
+        i2c_submitJob(&bmp085_ctx.job, BMP085_ADDRESS, BMP085_CTRL, raw, 1, 0);
+        PT_SLEEP(pt, currentTime, 26000);
+        PT_WAIT_UNTIL(pt, i2c_jobDone(&bmp085_ctx.job));
+        i2c_submitJob(&bmp085_ctx.job, BMP085_ADDRESS, BMP085_ADC, raw, 3, 1);
+        PT_WAIT_UNTIL(pt, i2c_jobDone(&bmp085_ctx.job));
+        bmp085_ctx.up = ((((uint32_t)raw[0] << 16) | ((uint32_t)raw[1] << 8) | ((uint32_t)raw[2])) >> (8 - OSS));
+        i2c_BMP085_Calculate();
+        BaroAlt = baroPressureToAlt(pressure);
+        baroSamples++;
+        PT_SLEEP(pt, currentTime, 20000);
+    }
+    PT_END(pt);
+}
+
+void Baro_update()
+{
+    PROFILE_BEGIN(Baro_update);
+    bmp085Thread();
+    PROFILE_END(Baro_update);
+}
+#endif
+
+// ************************************************************************************************************
+// I2C Barometer MS561101BA
+// ************************************************************************************************************
+// first contribution from Fabio
+// modification from Alex (September 2011)
+//
+// specs are here: http://www.meas-spec.com/downloads/MS5611-01BA03.pdf
+// useful info on pages 7 -> 12
+#if defined(MS561101BA)
+
+// registers of the device
+#define MS561101BA_PRESSURE 0x40
+#define MS561101BA_TEMPERATURE 0x50
+#define MS561101BA_RESET 0x1E
+
+// OSR (Over Sampling Ratio) constants
+#define MS561101BA_OSR_256 0x00
+#define MS561101BA_OSR_512 0x02
+#define MS561101BA_OSR_1024 0x04
+#define MS561101BA_OSR_2048 0x06
+#define MS561101BA_OSR_4096 0x08
+
+// Conversions are pipelined on the I2C job queue: when one is due its ADC read and the start of the
+// next conversion are queued together, so the chip converts back to back and the loop never waits on it.
+// Temperature only moves slowly, it is converted once every MS561101BA_TEMP_EVERY pressure samples.
+// The oversampling is baroOsr (0..4 = OSR 256..4096), picked up at the next conversion start.
+#if !defined(MS561101BA_TEMP_EVERY)
+#define MS561101BA_TEMP_EVERY 8
+#endif
+
+// conversion time per OSR, datasheet max plus the time the start command waits behind the ADC read
+static const uint16_t ms561101ba_convTime[5] = { 900, 1500, 2600, 4900, 9500 };
+
+static struct {
+    // sensor registers from the MS561101BA datasheet
+    uint16_t c[7];
+    uint32_t ut;                //uncompensated T
+    uint32_t up;                //uncompensated P
+    uint32_t c5s;               //C5 << 8, from Baro_init()
+    int32_t off;                //OFF >> 7 and
+    uint32_t sens;              //SENS >> 5 of the datasheet at ut, from ms561101ba_temperature()
+    uint8_t converting;         //MS561101BA_TEMPERATURE or MS561101BA_PRESSURE, 0 before the first start
+    uint8_t reading;            //what raw[] is being read for, 0 when nothing is pending
+    uint8_t tempCount;
+    uint32_t deadline;
+    i2cJob_t readJob;
+    i2cJob_t startJob;
+    uint8_t raw[3];
+} ms561101ba_ctx;
+
+void Baro_init(void)
+{
+    uint8_t buf[2];
+    uint8_t i;
+
+    powerUpWait(10);
+    buf[0] = MS561101BA_ADDRESS;
+    buf[1] = MS561101BA_RESET;
+    if (i2c_write(buf, 2) != 0)
+        i2cErrorCounter++;
+    delay(3);                   // PROM reload after reset takes 2.8ms
+    for (i = 0; i < 6; i++) {
+        i2c_read(buf, 2, MS561101BA_ADDRESS, 0xA2 + 2 * i);
+        ms561101ba_ctx.c[i + 1] = (uint16_t)buf[0] << 8 | buf[1];
+    }
+    ms561101ba_ctx.c5s = (uint32_t) ms561101ba_ctx.c[5] << 8;
+    if (baroOsr > 4)
+        baroOsr = 4;
+}
+
+// The datasheet's compensation needs 64 bit products (OFF and SENS alone are 34 and 33 bits), a helper call
+// of hundreds of cycles each on the STM8. Here everything stays in 32 bits: OFF and SENS are kept shifted
+// down, the products with dT (25 bits) are split at the shift so no part overflows, and D1 * SENS is made of
+// three 16 x 16 bit products. The result is P in 1/256 Pa until the last shift, it comes within 1 Pa of the
+// 64 bit formula over the whole range of D1, D2 and the PROM.
+// Temperature only changes OFF and SENS, worked out once per temperature conversion.
+static void ms561101ba_temperature(void)
+{
+    int32_t dT = (int32_t) (ms561101ba_ctx.ut - ms561101ba_ctx.c5s);
+    uint16_t *c = ms561101ba_ctx.c;
+    int32_t sens;
+
+    // OFF = C2 * 2^16 + C4 * dT / 2^7, / 2^7
+    ms561101ba_ctx.off = ((int32_t) c[2] << 9) + (int32_t) c[4] * (dT >> 14) + (int32_t) (((uint32_t) c[4] * (dT & 0x3FFF)) >> 14);
+    // SENS = C1 * 2^15 + C3 * dT / 2^8, / 2^5. Negative only far below the -40C the chip is rated for
+    sens = ((int32_t) c[1] << 10) + (int32_t) c[3] * (dT >> 13) + (int32_t) (((uint32_t) c[3] * (dT & 0x1FFF)) >> 13);
+    ms561101ba_ctx.sens = sens > 0 ? sens : 0;
+}
+
+void i2c_MS561101BA_Calculate(void)
+{
+    // D1 * SENS / 2^21 in 1/256 Pa: D1 = dh * 2^8 + dl, SENS / 2^5 = sh * 2^14 + sl, dl * sl is below 1/2
+    uint16_t dh = ms561101ba_ctx.up >> 8, sh = ms561101ba_ctx.sens >> 14, sl = ms561101ba_ctx.sens & 0x3FFF;
+    uint8_t dl = ms561101ba_ctx.up;
+    int32_t p = (int32_t) (((uint32_t) dh * sh >> 1) + ((uint32_t) dh * sl >> 15) + ((uint32_t) dl * sh >> 9));
+
+    pressure = (p - ms561101ba_ctx.off) >> 8;
+}
+
+void Baro_update(void)
+{
+    uint8_t *raw = ms561101ba_ctx.raw;
+    uint32_t value;
+
+    if (!i2c_jobDone(&ms561101ba_ctx.readJob))
+        return;
+    if (ms561101ba_ctx.reading) {
+        PROFILE_BEGIN(Baro_update);
+        value = ((uint32_t)raw[0] << 16) | ((uint32_t)raw[1] << 8) | raw[2];
+        // 0 means the conversion wasn't finished (or got aborted), drop it
+        if (value && ms561101ba_ctx.reading == MS561101BA_TEMPERATURE) {
+            ms561101ba_ctx.ut = value;
+            ms561101ba_temperature();
+        } else if (value && ms561101ba_ctx.ut) {
+            ms561101ba_ctx.up = value;
+            i2c_MS561101BA_Calculate();
+            BaroAlt = baroPressureToAlt(pressure);
+            baroSamples++;
+        }
+        ms561101ba_ctx.reading = 0;
+        PROFILE_END(Baro_update);
+    }
+
+    if ((int32_t)(currentTime - ms561101ba_ctx.deadline) < 0)
+        return;
+    if (!i2c_jobDone(&ms561101ba_ctx.startJob))
+        return;
+
+    if (ms561101ba_ctx.converting) {
+        i2c_submitJob(&ms561101ba_ctx.readJob, MS561101BA_ADDRESS, 0x00, raw, 3, 1);      // ADC read command
+        ms561101ba_ctx.reading = ms561101ba_ctx.converting;
+    }
+    if (!ms561101ba_ctx.ut || ++ms561101ba_ctx.tempCount >= MS561101BA_TEMP_EVERY) {
+        ms561101ba_ctx.tempCount = 0;
+        ms561101ba_ctx.converting = MS561101BA_TEMPERATURE;
+    } else {
+        ms561101ba_ctx.converting = MS561101BA_PRESSURE;
+    }
+    // command only write: the conversion command goes out as the register address
+    i2c_submitJob(&ms561101ba_ctx.startJob, MS561101BA_ADDRESS, ms561101ba_ctx.converting + 2 * baroOsr, NULL, 0, 0);
+    ms561101ba_ctx.deadline = currentTime + ms561101ba_convTime[baroOsr];
+}
+#endif
+
+
+
+
+// ************************************************************************************************************
+// I2C Accelerometer ADXL345 
+// ************************************************************************************************************
+// I2C adress: 0x3A (8bit)    0x1D (7bit)
+// Resolution: 10bit (Full range - 14bit, but this is autoscaling 10bit ADC to the range +- 16g)
+// principle:
+//  1) CS PIN must be linked to VCC to select the I2C mode
+//  2) SD0 PIN must be linked to VCC to select the right I2C adress
+//  3) bit  b00000100 must be set on register 0x2D to read data (only once at the initialization)
+//  4) bits b00001011 must be set on register 0x31 to select the data format (only once at the initialization)
+// ************************************************************************************************************
+#if defined(ADXL345)
+uint8_t ADXL345_detect(void)
+{
+    return i2c_probeReg(ADXL345_ADDRESS, 0x00, 0xFF, 0xE5);     // DEVID
+}
+
+void ADXL345_init(void)
+{
+    i2c_deviceSpeed(ADXL345_ADDRESS, 400000);   // the ADXL345 is ok with fast mode
+    delay(10);
+    i2c_writeReg(ADXL345_ADDRESS, 0x2D, 1 << 3);        //  register: Power CTRL  -- value: Set measure bit 3 on
+    i2c_writeReg(ADXL345_ADDRESS, 0x31, 0x0B);  //  register: DATA_FORMAT -- value: Set bits 3(full range) and 1 0 on (+/- 16g-range)
+    i2c_writeReg(ADXL345_ADDRESS, 0x2C, 8 + 2 + 1);     // register: BW_RATE     -- value: 200Hz sampling (see table 5 of the spec)
+    acc_1G = 256;
+    accClip = 4096;            // +/-16g
+}
+
+static void ADXL345_decode(const uint8_t *raw)
+{
+    ACC_ORIENTATION(-((raw[3] << 8) | raw[2]), ((raw[1] << 8) | raw[0]), ((raw[5] << 8) | raw[4]));
+    ACC_Common();
+}
+
+void ADXL345_getADC(void)
+{
+    i2c_getSixRawADC(ADXL345_ADDRESS, 0x32);
+    ADXL345_decode(rawADC);
+}
+#endif
+
+#if defined(ADXL345SPI)
+
+/* Private defines */
+#define ADXL_OFF	   GPIO_WriteHigh(GPIOE, GPIO_PIN_5);
+#define ADXL_ON		   GPIO_WriteLow(GPIOE, GPIO_PIN_5);
+
+#define ADXL_DEVID_ADDR    0x00
+#define ADXL_DEVID         0xE5
+#define ADXL_READ_BIT      0x80
+#define ADXL_MULTI_BIT     0x40
+#define ADXL_X0_ADDR       0x32
+#define ADXL_RATE_ADDR     0x2C
+#define ADXL_FIFO_ADDR     0x38
+#define ADXL_RATE_100      0x0A
+#define ADXL_RATE_200      0x0B
+#define ADXL_RATE_400      0x0C
+#define ADXL_RATE_800      0x0D
+#define ADXL_RATE_1600     0x0E
+#define ADXL_RATE_3200     0x0F
+#define ADXL_POWER_ADDR    0x2D
+#define ADXL_MEASURE       0x08
+#define ADXL_FORMAT_ADDR   0x31
+#define ADXL_FULL_RES      0x08
+#define ADXL_4WIRE         0x00
+#define ADXL_RANGE_2G      0x00
+#define ADXL_RANGE_4G      0x01
+#define ADXL_RANGE_8G      0x02
+#define ADXL_RANGE_16G     0x03
+#define ADXL_FIFO_STREAM   0x80
+
+static void ADXL_select(uint8_t on)
+{
+    if (on) {
+        ADXL_ON;
+    } else {
+        ADXL_OFF;
+    }
+}
+
+// SPI mode 3, 5MHz at most for everything
+static spiDevice_t adxlDev = { ADXL_select, 3, 5000000, 5000000 };
+
+static void ADXL_Init(void)
+{
+    // setup ADXL345 rate/range/start measuring
+    // Rate 3200Hz
+    spi_command(&adxlDev, ADXL_RATE_ADDR, ADXL_RATE_800 & 0x0F);
+    // Range 8G
+    spi_command(&adxlDev, ADXL_FORMAT_ADDR, (ADXL_RANGE_8G & 0x03) | ADXL_FULL_RES | ADXL_4WIRE);
+    // Fifo depth = 16
+    spi_command(&adxlDev, ADXL_FIFO_ADDR, (16 & 0x1f) | ADXL_FIFO_STREAM);
+    spi_command(&adxlDev, ADXL_POWER_ADDR, ADXL_MEASURE);
+}
+
+static int16_t adxlPeak[3];     // largest |sample| of the FIFO batch, sensor axes
+
+static uint8_t ADXL_GetAccelValues(void)
+{
+    uint8_t raw[8];             // X0..Z1, FIFO_CTL, FIFO_STATUS in one burst
+    uint8_t i;
+
+    spi_read(&adxlDev, ADXL_X0_ADDR | ADXL_MULTI_BIT | ADXL_READ_BIT, raw, sizeof(raw));
+    for (i = 0; i < 3; i++) {
+        uint8_t i1, i2;
+        int16_t v;
+        i1 = raw[i * 2];
+        i2 = raw[i * 2 + 1];
+        v = abs((int16_t)(i1 | i2 << 8));
+        if (v > adxlPeak[i])
+            adxlPeak[i] = v;
+
+#ifdef LOWPASS_ACC
+        // new result = 0.95 * previous_result + 0.05 * current_data
+        sensorInputs[i + 4] = ((sensorInputs[i + 4] * 19) / 20) + (((i1 | i2 << 8) * 5) / 100);
+#else
+        sensorInputs[i + 4] += (i1 | i2 << 8);
+#endif
+    }
+
+    // FIFO_STATUS register (last few bits = fifo remaining)
+    return raw[7] & 0x7F;       // return number of entires left in fifo
+}
+
+uint8_t ADXL345SPI_detect(void)
+{
+    uint8_t id;
+
+    // SPI ChipSelect for Accel
+    GPIO_Init(GPIOE, GPIO_PIN_5, GPIO_MODE_OUT_PP_HIGH_FAST);
+    spi_device(&adxlDev);
+
+    id = spi_command(&adxlDev, ADXL_DEVID_ADDR | ADXL_READ_BIT, 0xFF);
+    return id == ADXL_DEVID;
+}
+
+void ADXL345SPI_init(void)
+{
+    // SPI ChipSelect for Accel
+    GPIO_Init(GPIOE, GPIO_PIN_5, GPIO_MODE_OUT_PP_HIGH_FAST);
+    spi_device(&adxlDev);
+
+    powerUpWait(10);
+
+    // Accel INT1 input tied to interrupt (TODO). Input-only for now.
+    GPIO_Init(GPIOD, GPIO_PIN_0, GPIO_MODE_IN_FL_NO_IT);
+
+    // Initialize SPI Accelerometer
+    ADXL_Init();
+    acc_1G = 256;
+    accClip = 2048;            // +/-8g
+}
+
+void ADXL345SPI_getADC(void)
+{
+    uint8_t count = 0;
+    uint8_t remaining = 0;
+    uint8_t i = 0;
+
+    // Next up is accel fifo + avg
+    do {
+        count++;
+        remaining = ADXL_GetAccelValues();
+    } while ((count < 32) && (remaining > 0));
+
+    count++;
+
+#ifdef LOWPASS_ACC
+    // commit current values to acc[]
+#else
+    // accel + average
+    sensorInputs[4] = sensorInputs[4] / count;
+    sensorInputs[5] = sensorInputs[5] / count;
+    sensorInputs[6] = sensorInputs[6] / count;
+#endif
+
+    // the average of a batch hardly ever sits at full scale, let the vibration monitor see its peaks
+    ACC_ORIENTATION(adxlPeak[0], adxlPeak[1], adxlPeak[2]);
+    for (i = 0; i < 3; i++) {
+        accPeak[i] = abs(accADC[i]);
+        adxlPeak[i] = 0;
+    }
+    ACC_ORIENTATION(sensorInputs[4], sensorInputs[5], sensorInputs[6]);
+    ACC_Common();
+}
+#endif
+
+#if defined(MPU6000SPI)
+static uint8_t mpuInitialized = 0;
+#if defined(STM32F4)
+#define MPU_OFF            digitalHi(GPIOB, GPIO_Pin_12);
+#define MPU_ON             digitalLo(GPIOB, GPIO_Pin_12);
+#else
+#define MPU_OFF            GPIO_WriteHigh(GPIOB, GPIO_PIN_2);
+#define MPU_ON             GPIO_WriteLow(GPIOB, GPIO_PIN_2);
+#endif
+
+static void MPU6000_select(uint8_t on)
+{
+    if (on) {
+        MPU_ON;
+    } else {
+        MPU_OFF;
+    }
+}
+
+// SPI mode 3. Register access is specified up to 1MHz, the sensor and interrupt registers up to 20MHz
+static spiDevice_t mpuDev = { MPU6000_select, 3, 1000000, 20000000 };
+
+#define MPUREG_WHOAMI               0x75
+#define MPUREG_SMPLRT_DIV           0x19
+#define MPUREG_CONFIG               0x1A
+#define MPUREG_GYRO_CONFIG          0x1B
+#define MPUREG_ACCEL_CONFIG         0x1C
+#define MPUREG_FIFO_EN              0x23
+#define MPUREG_I2C_MST_CTRL         0x24
+#define MPUREG_I2C_SLV0_ADDR        0x25
+#define MPUREG_I2C_SLV0_REG         0x26
+#define MPUREG_I2C_SLV0_CTRL        0x27
+#define MPUREG_I2C_SLV4_ADDR        0x31
+#define MPUREG_I2C_SLV4_REG         0x32
+#define MPUREG_I2C_SLV4_DO          0x33
+#define MPUREG_I2C_SLV4_CTRL        0x34
+#define MPUREG_I2C_SLV4_DI          0x35
+#define MPUREG_I2C_MST_STATUS       0x36
+#define MPUREG_INT_PIN_CFG          0x37
+#define MPUREG_INT_ENABLE           0x38 
+#define MPUREG_ACCEL_XOUT_H         0x3B
+#define MPUREG_ACCEL_XOUT_L         0x3C
+#define MPUREG_ACCEL_YOUT_H         0x3D
+#define MPUREG_ACCEL_YOUT_L         0x3E
+#define MPUREG_ACCEL_ZOUT_H         0x3F
+#define MPUREG_ACCEL_ZOUT_L         0x40
+#define MPUREG_TEMP_OUT_H           0x41
+#define MPUREG_TEMP_OUT_L           0x42
+#define MPUREG_GYRO_XOUT_H          0x43
+#define MPUREG_GYRO_XOUT_L          0x44
+#define MPUREG_GYRO_YOUT_H          0x45
+#define MPUREG_GYRO_YOUT_L          0x46
+#define MPUREG_GYRO_ZOUT_H          0x47
+#define MPUREG_GYRO_ZOUT_L          0x48
+#define MPUREG_EXT_SENS_DATA_00     0x49 // Registers 0x49 to 0x60 - External Sensor Data
+#define MPUREG_I2C_SLV0_DO          0x63 // This register holds the output data written into Slave 0 when Slave 0 is set to write mode.
+#define MPUREG_I2C_MST_DELAY_CTRL   0x67 // I2C Master Delay Control
+#define BIT_I2C_SLV4_DONE           0x40 // in I2C_MST_STATUS
+#define BIT_I2C_SLV0_DLY_EN         0x01 // in I2C_MST_DELAY_CTRL
+#define MPUREG_USER_CTRL            0x6A
+#define MPUREG_PWR_MGMT_1           0x6B
+#define MPUREG_PWR_MGMT_2           0x6C
+#define MPUREG_FIFO_COUNTH          0x72
+#define MPUREG_FIFO_COUNTL          0x73
+#define MPUREG_FIFO_R_W             0x74
+
+// Configuration bits MPU 6000
+#define BIT_SLEEP                   0x40
+#define BIT_H_RESET                 0x80
+#define BITS_CLKSEL                 0x07
+#define MPU_CLK_SEL_PLLGYROX        0x01
+#define MPU_CLK_SEL_PLLGYROZ        0x03
+#define MPU_EXT_SYNC_GYROX          0x02
+#define BITS_AFS_2G                 0x00
+#define BITS_AFS_4G                 0x08
+#define BITS_AFS_8G                 0x10
+#define BITS_AFS_16G                0x18
+#define BITS_FS_250DPS              0x00
+#define BITS_FS_500DPS              0x08
+#define BITS_FS_1000DPS             0x10
+#define BITS_FS_2000DPS             0x18
+#define BITS_FS_MASK                0x18
+// MPU6000_GYRO_DPS / MPU6000_ACC_G: FS_SEL and AFS_SEL, and what the readings are divided by. The gyro comes
+// out as 8192 * GYRO_FINE per 2000 deg/s at any range, the acc full scale is always 2048
+#if MPU6000_GYRO_DPS == 250
+#define MPU6000_GYRO_FS             BITS_FS_250DPS
+#elif MPU6000_GYRO_DPS == 500
+#define MPU6000_GYRO_FS             BITS_FS_500DPS
+#elif MPU6000_GYRO_DPS == 1000
+#define MPU6000_GYRO_FS             BITS_FS_1000DPS
+#else
+#define MPU6000_GYRO_FS             BITS_FS_2000DPS
+#endif
+#define MPU6000_GYRO_DIV            ((4 * 2000 / MPU6000_GYRO_DPS) >> GYRO_FRAC)
+#if MPU6000_ACC_G == 2
+#define MPU6000_ACC_FS              BITS_AFS_2G
+#elif MPU6000_ACC_G == 8
+#define MPU6000_ACC_FS              BITS_AFS_8G
+#elif MPU6000_ACC_G == 16
+#define MPU6000_ACC_FS              BITS_AFS_16G
+#else
+#define MPU6000_ACC_FS              BITS_AFS_4G
+#endif
+#define BITS_DLPF_CFG_256HZ_NOLPF2  0x00
+#define BITS_DLPF_CFG_188HZ         0x01
+#define BITS_DLPF_CFG_98HZ          0x02
+#define BITS_DLPF_CFG_42HZ          0x03
+#define BITS_DLPF_CFG_20HZ          0x04
+#define BITS_DLPF_CFG_10HZ          0x05
+#define BITS_DLPF_CFG_5HZ           0x06
+#define BITS_DLPF_CFG_2100HZ_NOLPF  0x07
+#define BITS_DLPF_CFG_MASK          0x07
+#define BIT_INT_ANYRD_2CLEAR        0x10
+#define BIT_RAW_RDY_EN              0x01
+#define BIT_I2C_IF_DIS              0x10
+#define BIT_I2C_SLV0_EN             0x80
+#define BIT_FIFO_EN                 0x40    // USER_CTRL
+#define BIT_I2C_MST_EN              0x20
+#define BIT_FIFO_RESET              0x04
+#define BITS_FIFO_ALL               0xF9    // FIFO_EN: TEMP | XG | YG | ZG | ACCEL | SLV0
+
+// Sensor snapshot. The burst read goes out through the SPI interrupt into the back frame, and mpuFrameCount is
+// the sequence count of the front one. Consumers decode mpuSnap, the loop's copy of the front frame: with data
+// ready the next burst can complete and a third start into the frame being decoded.
+typedef struct {
+    uint8_t raw[14 + 6];        // Sensor data ACCXYZ|TEMP|GYROXYZ | Magnetometer data
+    uint32_t time;              // micros() when the burst was started
+} mpuFrame_t;
+
+static mpuFrame_t mpuFrame[2];
+static volatile uint8_t mpuFront = 0;           // index of the last complete frame
+static seq_t mpuFrameCount = 0;                 // bumped each time a frame completes
+static mpuFrame_t mpuSnap;
+static uint8_t mpuSnapSeq = 0;                  // frame in mpuSnap
+static volatile uint8_t mpuStreaming = 0;       // data ready edge starts the burst on its own
+
+static spiJob_t mpuJob;
+
+static void MPU6000_readDone(spiJob_t *job)
+{
+    // SPI interrupt context
+    mpuFront ^= 1;
+    seq_publish(&mpuFrameCount);
+#if defined(LOOP_ISR) && defined(MPU6000_DRDY_INT)
+    if (!LOOP_ISR)
+        loopIsr_pend();                 // the inner loop runs on this frame
+#endif
+}
+
+// Register access in between no longer stops the stream, the bus queues the burst until it's done
+static uint8_t MPU6000_startRead(uint32_t now)
+{
+    uint8_t back = mpuFront ^ 1;
+
+    if (mpuJob.busy)
+        return 0;
+    mpuFrame[back].time = now;
+    // ACC X, Y, Z, TEMP, GYRO X, Y, Z, MagData[6]
+    mpuJob.dev = &mpuDev;
+    mpuJob.cmd = MPUREG_ACCEL_XOUT_H | 0x80;
+    mpuJob.buf = mpuFrame[back].raw;
+    mpuJob.len = 14 + 6;
+    mpuJob.done = MPU6000_readDone;
+    return spi_submit(&mpuJob);
+}
+
+static uint8_t gyroSeq = 0;                     // snapshot last decoded by MPU6000_gyroGetADC()
+
+#if defined(MPU6000_DRDY_INT)
+// MPU-6000 INT pin (PB3, on the STM32F4 PC4 through drdy_init()), raw data ready. Pulses high once per sample.
+#if defined(STM32F4)
+static void MPU6000_dataReady(void)
+#else
+__near __interrupt void EXTI_PORTB_IRQHandler(void)
+#endif
+{
+    // If the previous burst is somehow still running, this sample is dropped
+    if (mpuStreaming)
+        MPU6000_startRead(microsISR());
+}
+
+void Gyro_waitDataReady(void)
+{
+    disableInterrupts();
+    while (mpuFrameCount == gyroSeq) {
+        wfi();                  // wfi re-enables interrupts, so the frame can't complete in between the test and the sleep
+        disableInterrupts();
+    }
+    enableInterrupts();
+}
+#endif
+
+static void MPU6000_WriteReg(uint8_t Address, uint8_t Data);
+
+#if defined(MPU6000_FIFO)
+// FIFO records are written in register order, so one record has the same layout as mpuFrame_t.raw
+#define MPU6000_FIFO_RECORD     (14 + 6)
+#define MPU6000_FIFO_CHUNK      4               // records per SPI burst
+#define MPU6000_FIFO_SIZE       1024
+static uint8_t mpuFifoBuf[MPU6000_FIFO_CHUNK * MPU6000_FIFO_RECORD];
+
+static void MPU6000_readBurst(uint8_t reg, uint8_t *buf, uint8_t len)
+{
+    spi_read(&mpuDev, reg | 0x80, buf, len);
+}
+
+static void MPU6000_fifoReset(void)
+{
+    MPU6000_WriteReg(MPUREG_USER_CTRL, BIT_I2C_MST_EN | BIT_I2C_IF_DIS | BIT_FIFO_RESET);
+    MPU6000_WriteReg(MPUREG_USER_CTRL, BIT_FIFO_EN | BIT_I2C_MST_EN | BIT_I2C_IF_DIS);
+}
+
+// Reads out every record queued since last time and puts their average into the back frame, temperature
+// and mag come from the newest record. Returns 0 if there was nothing new.
+static uint8_t MPU6000_drainFifo(uint32_t now)
+{
+    int32_t sum[6] = { 0, 0, 0, 0, 0, 0 };
+    uint8_t count[2], n, i, j, axis;
+    uint16_t queued, total = 0;
+    uint8_t back = mpuFront ^ 1;
+    uint8_t *rec = mpuFifoBuf, *raw = mpuFrame[back].raw;
+    int16_t v;
+
+    MPU6000_readBurst(MPUREG_FIFO_COUNTH, count, 2);
+    queued = count[0] << 8 | count[1];
+    // overflowed, or out of step with the record boundaries (slave 0 wasn't set up yet): start over
+    if (queued > MPU6000_FIFO_SIZE - MPU6000_FIFO_RECORD || queued % MPU6000_FIFO_RECORD) {
+        MPU6000_fifoReset();
+        return 0;
+    }
+    queued /= MPU6000_FIFO_RECORD;
+    while (queued) {
+        n = queued > MPU6000_FIFO_CHUNK ? MPU6000_FIFO_CHUNK : queued;
+        MPU6000_readBurst(MPUREG_FIFO_R_W, mpuFifoBuf, n * MPU6000_FIFO_RECORD);
+        for (i = 0, rec = mpuFifoBuf; i < n; i++, rec += MPU6000_FIFO_RECORD) {
+            for (axis = 0; axis < 6; axis++) {
+                j = axis < 3 ? axis * 2 : axis * 2 + 2;     // ACC X, Y, Z, skip TEMP, GYRO X, Y, Z
+                sum[axis] += (int16_t)(rec[j] << 8 | rec[j + 1]);
+            }
+        }
+        queued -= n;
+        total += n;
+    }
+    if (total == 0)
+        return 0;
+
+    rec -= MPU6000_FIFO_RECORD;
+    for (i = 0; i < MPU6000_FIFO_RECORD; i++)
+        raw[i] = rec[i];
+    for (axis = 0; axis < 6; axis++) {
+        j = axis < 3 ? axis * 2 : axis * 2 + 2;
+        v = sum[axis] / (int16_t)total;
+        raw[j] = v >> 8;
+        raw[j + 1] = v;
+    }
+    mpuFrame[back].time = now;
+    mpuFront = back;
+    seq_publish(&mpuFrameCount);
+    return 1;
+}
+#endif
+
+// Shortest sample period gyroDlpf/gyroRateDiv may ask for. Every sample costs a burst of SPI interrupts,
+// and the FIFO (20 bytes a record) must not fill up between two loops.
+#if defined(MPU6000_FIFO)
+#define MPU6000_MIN_PERIOD      1000    // us
+#else
+#define MPU6000_MIN_PERIOD      500
+#endif
+static uint32_t mpuSamplePeriod = 625;          // us, gyro output rate (8kHz or 1kHz with DLPF) / (SMPLRT_DIV + 1)
+static uint8_t mpuDlpf = 0xFF, mpuRateDiv;      // as written to the sensor, 0xFF before MPU6000_init()
+
+static void MPU6000_writeConfig(void)
+{
+    uint16_t base = gyroDlpf ? 1000 : 125;      // us, gyro output rate 1kHz with the DLPF, 8kHz without
+    uint8_t div = gyroRateDiv;
+
+    if ((uint32_t)base * (div + 1) < MPU6000_MIN_PERIOD)
+        div = MPU6000_MIN_PERIOD / base - 1;
+    MPU6000_WriteReg(MPUREG_SMPLRT_DIV, div);
+    MPU6000_WriteReg(MPUREG_CONFIG, gyroDlpf);
+    mpuSamplePeriod = (uint32_t)base * (div + 1);
+    mpuDlpf = gyroDlpf;
+    mpuRateDiv = gyroRateDiv;
+}
+
+// Makes sure the front frame is no older than one sample period, copies it to mpuSnap and returns its sequence
+// number. With data ready the interrupt keeps it fresh, otherwise whoever asks first in a period does the read.
+static uint8_t MPU6000_snapshot(void)
+{
+    uint8_t seq;
+
+#if !defined(MPU6000_DRDY_INT)
+    static uint32_t lastFetch = 0;
+    uint32_t now = micros();
+
+    if (mpuFrameCount == 0 || now - lastFetch >= mpuSamplePeriod) {
+        lastFetch = now;
+#if defined(MPU6000_FIFO)
+        MPU6000_drainFifo(now);
+#else
+        MPU6000_startRead(now);
+        while (spi_isBusy());
+#endif
+    }
+#endif
+    do {
+        seq = seq_begin(&mpuFrameCount);
+        if (seq == mpuSnapSeq)
+            break;
+        seq_load(&mpuSnap, &mpuFrame[mpuFront], sizeof(mpuSnap));
+    } while (seq_retry(&mpuFrameCount, seq));
+    mpuSnapSeq = seq;
+    return seq;
+}
+
+static uint8_t MPU6000_ReadReg(uint8_t Address)
+{
+    return spi_command(&mpuDev, Address | 0x80, 0xFF); // Address with high bit set = Read operation
+}
+
+static void MPU6000_WriteReg(uint8_t Address, uint8_t Data)
+{ 
+    spi_command(&mpuDev, Address, Data);
+}
+
+// The reset takes 100ms: initSensors() starts it before the baro, detect() and init() wait for what's left.
+// Harmless on a board without the MPU6000, nothing answers the write
+static uint32_t mpuResetDone = 0;
+
+void MPU6000_reset(void)
+{
+#if defined(STM8)
+    // SPI ChipSelect for MPU-6000, spi_init() sets it up on the STM32F4
+    GPIO_Init(GPIOB, GPIO_PIN_2, GPIO_MODE_OUT_PP_HIGH_FAST);
+#endif
+    spi_device(&mpuDev);
+    MPU6000_WriteReg(MPUREG_PWR_MGMT_1, BIT_H_RESET);
+    mpuResetDone = micros() + 100000;
+}
+
+static void MPU6000_resetWait(void)
+{
+    if (mpuResetDone == 0)
+        MPU6000_reset();
+    while ((int32_t)(micros() - mpuResetDone) < 0)
+        ;
+}
+
+uint8_t MPU6000_detect(void)
+{
+    MPU6000_resetWait();
+    return (MPU6000_ReadReg(MPUREG_WHOAMI) & 0x7E) == 0x68;
+}
+
+void MPU6000_init(void)
+{
+    MPU6000_resetWait();
+
+#if defined(STM32F4)
+#if defined(MPU6000_DRDY_INT)
+    drdy_init(MPU6000_dataReady);
+#endif
+#elif defined(MPU6000_DRDY_INT)
+    // MPU-6000 INT pin, rising edge on PB3. EXTI sensitivity can only be changed with interrupts masked.
+    disableInterrupts();
+    EXTI->CR1 = (EXTI->CR1 & (uint8_t)~EXTI_CR1_PBIS) | 0x04;     // PBIS = 01, rising edge only
+    enableInterrupts();
+    GPIO_Init(GPIOB, GPIO_PIN_3, GPIO_MODE_IN_FL_IT);
+#else
+    // MPU-6000 input tied to interrupt. Input-only when data ready isn't used.
+    GPIO_Init(GPIOB, GPIO_PIN_3, GPIO_MODE_IN_FL_NO_IT);
+#endif
+
+    MPU6000_WriteReg(MPUREG_PWR_MGMT_1, MPU_CLK_SEL_PLLGYROZ);      // Set PLL source to gyro output
+    MPU6000_WriteReg(MPUREG_USER_CTRL, 0b00110000);                 // I2C_MST_EN
+    // MPU6000_WriteReg(MPUREG_USER_CTRL, BIT_I2C_IF_DIS);             // Disable I2C bus
+    MPU6000_writeConfig();                                          // SMPLRT_DIV and DLPF from gyroRateDiv/gyroDlpf
+    MPU6000_WriteReg(MPUREG_GYRO_CONFIG, MPU6000_GYRO_FS);          // Gyro scale MPU6000_GYRO_DPS
+    MPU6000_WriteReg(MPUREG_ACCEL_CONFIG, MPU6000_ACC_FS);          // Accel scale MPU6000_ACC_G
+    MPU6000_WriteReg(MPUREG_INT_ENABLE, BIT_RAW_RDY_EN);            // INT: Raw data ready
+    MPU6000_WriteReg(MPUREG_INT_PIN_CFG, BIT_INT_ANYRD_2CLEAR);     // INT: Clear on any read
+#if defined(MPU6000_FIFO)
+    MPU6000_WriteReg(MPUREG_FIFO_EN, BITS_FIFO_ALL);
+    MPU6000_fifoReset();
+#endif
+
+#if defined(MPU6000_DRDY_INT)
+    mpuStreaming = 1;
+#endif
+    mpuInitialized = 1;
+}
+
+void MPU6000_accInit(void)
+{
+    if (!mpuInitialized)
+        MPU6000_init();
+        
+    acc_1G = 256 * 4 / MPU6000_ACC_G;
+    accClip = 2048;            // +/-MPU6000_ACC_G
+}
+
+void MPU6000_accGetADC(void)
+{
+    static uint8_t accSeq = 0;
+    uint8_t seq = MPU6000_snapshot();
+    uint8_t *raw;
+
+    if (seq == accSeq)
+        return;
+    accSeq = seq;
+    raw = mpuSnap.raw;
+    ACC_ORIENTATION(-(int16_t)(raw[0] << 8 | raw[1]) / 16, -(int16_t)(raw[2] << 8 | raw[3]) / 16, (int16_t)(raw[4] << 8 | raw[5]) / 16);
+    ACC_Common();
+}
+
+void MPU6000_gyroInit(void)
+{
+    if (!mpuInitialized)
+        MPU6000_init();
+}
+
+uint8_t MPU6000_setConfig(void)
+{
+    if (mpuDlpf == 0xFF || (mpuDlpf == gyroDlpf && mpuRateDiv == gyroRateDiv))
+        return 0;
+    MPU6000_writeConfig();
+#if defined(MPU6000_FIFO)
+    MPU6000_fifoReset();
+#endif
+    return 1;
+}
+
+void MPU6000_gyroGetADC(void)
+{
+    uint8_t seq = MPU6000_snapshot();
+    uint8_t *raw;
+
+    if (seq == gyroSeq)
+        return;
+    gyroSeq = seq;
+    raw = mpuSnap.raw;
+#if defined(MPU6000_DRDY_INT)
+    gyroSampleTime = mpuSnap.time;
+#endif
+    // range: +/- 8192 * GYRO_FINE * MPU6000_GYRO_DPS / 2000, +/- MPU6000_GYRO_DPS deg/sec. The casts sign extend
+    // where an int is 32 bits
+    GYRO_ORIENTATION(((int16_t)((raw[10] << 8) | raw[11]) / MPU6000_GYRO_DIV), -((int16_t)((raw[8] << 8) | raw[9]) / MPU6000_GYRO_DIV),
+                     -((int16_t)((raw[12] << 8) | raw[13]) / MPU6000_GYRO_DIV));
+    GYRO_Common();
+}
+
+#define HMC5883L_I2C_ADDRESS        0x1e
+#define HMC5883L_ID_REG_A           0x0a
+#define HMC5883L_ID_REG_B           0x0b
+#define HMC5883L_ID_REG_C           0x0c
+#define HMC5883L_CONFIG_A           0x00
+#define HMC5883L_MODE_REG           0x02
+#define HMC5883L_DATA_OUTPUT_X      0x03
+#if defined(MPU6000_FIFO)
+#define HMC5883L_MST_DLY            12  // slave 0 runs every 13th sample: 77Hz, the HMC5883 puts out 75Hz
+#else
+#define HMC5883L_MST_DLY            15  // slave 0 runs every 16th sample: 100Hz, the HMC5883 puts out 75Hz
+#endif
+
+// single register write through the MPU6000 aux I2C master (slave 4), waits up to 10ms for it to go out
+static void MPU6000_auxWrite(uint8_t reg, uint8_t val)
+{
+    uint8_t i;
+
+    MPU6000_WriteReg(MPUREG_I2C_SLV4_ADDR, HMC5883L_I2C_ADDRESS); // Write to 5883
+    MPU6000_WriteReg(MPUREG_I2C_SLV4_REG, reg);
+    MPU6000_WriteReg(MPUREG_I2C_SLV4_DO, val);
+    MPU6000_WriteReg(MPUREG_I2C_SLV4_CTRL, 0x80 | HMC5883L_MST_DLY);   // I2C_SLV4_EN
+    for (i = 0; i < 10; i++) {
+        if (MPU6000_ReadReg(MPUREG_I2C_MST_STATUS) & BIT_I2C_SLV4_DONE)
+            return;
+        delay(1);           // the master runs once per sample
+    }
+}
+
+// The HMC5883 hangs off the MPU6000 aux bus. Slave 0 reads its 6 data registers into EXT_SENS_DATA on its
+// own, they come along at the end of the sensor burst and Device_Mag_getADC() decodes them from the snapshot.
+void Mag_init(void)
+{
+    MPU6000_WriteReg(MPUREG_I2C_MST_CTRL, 0b01000000 | 13); // WAIT_FOR_ES=1, I2C Master Clock Speed 400kHz
+    MPU6000_auxWrite(HMC5883L_CONFIG_A, 0x18);             // 75Hz output rate
+    MPU6000_auxWrite(HMC5883L_MODE_REG, 0x00);             // Continuous-Conversion Mode
+
+    // Prepare I2C Slave 0 for reading out mag data, only every HMC5883L_MST_DLY + 1 samples
+    MPU6000_WriteReg(MPUREG_I2C_SLV0_ADDR, 0x80 | HMC5883L_I2C_ADDRESS); // Read from 5883
+    MPU6000_WriteReg(MPUREG_I2C_SLV0_REG, HMC5883L_DATA_OUTPUT_X);
+    MPU6000_WriteReg(MPUREG_I2C_SLV0_CTRL, 0b10000110); // I2C_SLV0_EN | 6 bytes from mag
+    MPU6000_WriteReg(MPUREG_I2C_MST_DELAY_CTRL, BIT_I2C_SLV0_DLY_EN);
+    delay(1);
+#if defined(MPU6000_FIFO)
+    MPU6000_fifoReset();        // records grow by the 6 mag bytes from here on
+#endif
+}
+
+uint8_t Device_Mag_getADC(void)
+{
+    // Slaved HMC5883 data comes along in the same burst, nothing to read here
+    static uint8_t magSeq = 0;
+    uint8_t seq = MPU6000_snapshot();
+    uint8_t *raw;
+
+    if (seq == magSeq)
+        return 0;
+    magSeq = seq;
+    raw = mpuSnap.raw;
+    MAG_ORIENTATION( ((raw[18] << 8) | raw[19]),  ((raw[14] << 8) | raw[15]),   ((raw[16] << 8) | raw[17])    );
+    return 1;
+}
+
+// Die temperature in 0.1 degC, from the same snapshot. Datasheet: T = raw / 340 + 36.53
+int16_t MPU6000_getTemperature(void)
+{
+    uint8_t *raw;
+
+    MPU6000_snapshot();
+    raw = mpuSnap.raw;
+    return (int16_t)(raw[6] << 8 | raw[7]) / 34 + 365;
+}
+#endif /* MPU6000SPI */
+
+#if defined(STM8) && !defined(GYRO_DRDY)
+// PORTB EXTI is in the vector table, but nothing on this board uses it
+__near __interrupt void EXTI_PORTB_IRQHandler(void)
+{
+}
+#endif
+
+// ************************************************************************************************************
+// contribution initially from opie11 (rc-groups)
+// adaptation from C2po (may 2011)
+// contribution from ziss_dm (June 2011)
+// contribution from ToLuSe (Jully 2011)
+// I2C Accelerometer BMA180
+// ************************************************************************************************************
+// I2C adress: 0x80 (8bit)    0x40 (7bit) (SDO connection to VCC) 
+// I2C adress: 0x82 (8bit)    0x41 (7bit) (SDO connection to VDDIO)
+// Resolution: 14bit
+//
+// Control registers:
+//
+// 0x20    bw_tcs:   |                                           bw<3:0> |                        tcs<3:0> |
+//                   |                                             150Hz |                 !!Calibration!! |
+// ************************************************************************************************************
+#if defined(BMA180)
+uint8_t BMA180_detect(void)
+{
+    return i2c_probeReg(BMA180_ADDRESS, 0x00, 0xFF, 0x03);      // chip_id
+}
+
+void BMA180_init(void)
+{
+    uint8_t control;
+    
+    delay(10);
+    //default range 2G: 1G = 4096 unit.
+    i2c_writeReg(BMA180_ADDRESS, 0x0D, 1 << 4); // register: ctrl_reg0  -- value: set bit ee_w to 1 to enable writing
+    delay(5);
+    control = i2c_readReg(BMA180_ADDRESS, 0x20);
+    control = control & 0x0F;   // register: bw_tcs reg: bits 4-7 to set bw -- value: set low pass filter to 10Hz (bits value = 0000xxxx)
+    control = control | 0x00;
+    i2c_writeReg(BMA180_ADDRESS, 0x20, control);
+    delay(5);
+    control = i2c_readReg(BMA180_ADDRESS, 0x30);
+    control = control & 0xFC;
+    control = control | 0x02;
+    i2c_writeReg(BMA180_ADDRESS, 0x30, control);
+    delay(5);
+    acc_1G = 512;
+    accClip = 1024;            // 14 bit
+}
+
+static void BMA180_decode(const uint8_t *raw)
+{
+    //usefull info is on the 14 bits  [2-15] bits  /4 => [0-13] bits  /8 => 11 bit resolution
+    ACC_ORIENTATION(-((int16_t)((raw[1] << 8) | raw[0])) / 32, -((int16_t)((raw[3] << 8) | raw[2])) / 32, ((int16_t)((raw[5] << 8) | raw[4])) / 32);
+    ACC_Common();
+}
+
+void BMA180_getADC(void)
+{
+#if 0
+    TWBR = ((16000000L / 400000L) - 16) / 2;    // Optional line.  Sensor is good for it in the spec.
+#endif
+    i2c_getSixRawADC(BMA180_ADDRESS, 0x02);
+    BMA180_decode(rawADC);
+}
+#endif
+
+// ************************************************************************************************************
+// contribution from Point65 and mgros (rc-groups)
+// contribution from ziss_dm (June 2011)
+// contribution from ToLuSe (Jully 2011)
+// I2C Accelerometer BMA020
+// ************************************************************************************************************
+// I2C adress: 0x70 (8bit)
+// Resolution: 10bit
+// Control registers:
+//
+// Datasheet: After power on reset or soft reset it is recommended to set the SPI4-bit to the correct value.
+//            0x80 = SPI four-wire = Default setting
+// | 0x15: | SPI4 | enable_adv_INT | new_data_INT | latch_INT | shadow_dis | wake_up_pause<1:0> | wake_up |
+// |       |    1 |              0 |            0 |         0 |          0 |                 00 |       0 |
+//
+// | 0x14: |                       reserved <2:0> |            range <1:0> |               bandwith <2:0> |
+// |       |                      !!Calibration!! |                     2g |                         25Hz |
+//
+// ************************************************************************************************************
+#if defined(BMA020)
+uint8_t BMA020_detect(void)
+{
+    return i2c_probeReg(0x70, 0x00, 0x07, 0x02);       // chip_id, bits 2:0
+}
+
+void BMA020_init(void)
+{
+    uint8_t control;
+
+    i2c_writeReg(0x70, 0x15, 0x80);
+    control = i2c_readReg(0x70, 0x14);
+    control = control & 0xE0;
+    control = control | (0x00 << 3);    //Range 2G 00
+    control = control | 0x00;   //Bandwidth 25 Hz 000
+    i2c_writeReg(0x70, 0x14, control);
+    acc_1G = 255;
+    accClip = 512;             // 10 bit
+}
+
+static void BMA020_decode(const uint8_t *raw)
+{
+    ACC_ORIENTATION(((raw[1] << 8) | raw[0]) / 64, ((raw[3] << 8) | raw[2]) / 64, ((raw[5] << 8) | raw[4]) / 64);
+    ACC_Common();
+}
+
+void BMA020_getADC(void)
+{
+    i2c_getSixRawADC(0x70, 0x02);
+    BMA020_decode(rawADC);
+}
+#endif
+
+// ************************************************************************************************************
+// standalone I2C Nunchuk
+// ************************************************************************************************************
+#if defined(NUNCHACK)
+void NUNCHACK_init(void)
+{
+    i2c_deviceSpeed(0xA4, I2C_WMP_SPEED);
+    i2c_writeReg(0xA4, 0xF0, 0x55);
+    i2c_writeReg(0xA4, 0xFB, 0x00);
+    delay(250);
+    acc_1G = 200;
+}
+
+void NUNCHACK_getADC(void)
+{
+    i2c_getSixRawADC(0xA4, 0x00);
+
+    ACC_ORIENTATION(((rawADC[3] << 2) + ((rawADC[5] >> 4) & 0x2)), -((rawADC[2] << 2) + ((rawADC[5] >> 3) & 0x2)), (((rawADC[4] & 0xFE) << 2) + ((rawADC[5] >> 5) & 0x6)));
+    ACC_Common();
+}
+#endif
+
+// ************************************************************************
+// LIS3LV02 I2C Accelerometer
+//contribution from adver (http://multiwii.com/forum/viewtopic.php?f=8&t=451)
+// ************************************************************************
+#if defined(LIS3LV02)
+#define LIS3A  0x3A             // I2C adress: 0x3A (8bit)
+
+uint8_t LIS3LV02_detect(void)
+{
+    return i2c_probeReg(LIS3A, 0x0F, 0xFF, 0x3A);      // WHO_AM_I
+}
+
+void LIS3LV02_init(void)
+{
+    i2c_deviceSpeed(LIS3A, 400000);
+    i2c_writeReg(LIS3A, 0x20, 0xD7);    // CTRL_REG1   1101 0111 Pwr on, 160Hz 
+    i2c_writeReg(LIS3A, 0x21, 0x50);    // CTRL_REG2   0100 0000 Littl endian, 12 Bit, Boot
+    acc_1G = 256;
+}
+
+void LIS3LV02_getADC(void)
+{
+    i2c_getSixRawADC(LIS3A, 0x28 + 0x80);
+    ACC_ORIENTATION((rawADC[3] << 8 | rawADC[2]) / 4, -(rawADC[1] << 8 | rawADC[0]) / 4, -(rawADC[5] << 8 | rawADC[4]) / 4);
+    ACC_Common();
+}
+#endif
+
+// ************************************************************************************************************
+// I2C Accelerometer LSM303DLx
+// contribution from wektorx (http://www.multiwii.com/forum/viewtopic.php?f=8&t=863)
+// ************************************************************************************************************
+#if defined(LSM303DLx_ACC)
+void LSM303DLx_init(void)
+{
+    delay(10);
+    i2c_writeReg(0x30, 0x20, 0x27);
+    i2c_writeReg(0x30, 0x23, 0x30);
+    i2c_writeReg(0x30, 0x21, 0x00);
+    acc_1G = 256;
+    accClip = 2048;            // 12 bit
+}
+
+static void LSM303DLx_decode(const uint8_t *raw)
+{
+    ACC_ORIENTATION(-((raw[3] << 8) | raw[2]) / 16, ((raw[1] << 8) | raw[0]) / 16, ((raw[5] << 8) | raw[4]) / 16);
+    ACC_Common();
+}
+
+void LSM303DLx_getADC(void)
+{
+    i2c_getSixRawADC(0x30, 0xA8);
+    LSM303DLx_decode(rawADC);
+}
+#endif
+
+// ************************************************************************************************************
+// ADC ACC
+// ************************************************************************************************************
+#if defined(ADCACC)
+void ADCACC_init(void)
+{
+    pinMode(A1, INPUT);
+    pinMode(A2, INPUT);
+    pinMode(A3, INPUT);
+    acc_1G = 75;
+}
+
+void ADCACC_getADC(void)
+{
+    ACC_ORIENTATION(-analogRead(A1), -analogRead(A2), analogRead(A3));
+    ACC_Common();
+}
+#endif
+
+// ************************************************************************************************************
+// Analog Gyroscopes IDG500 + ISZ500
+// ************************************************************************************************************
+#ifdef STM8
+// Oversampling ADC: TIM3 channel 2, as a plain compare on the RX capture timebase, starts a buffered scan of
+// the 4 channels every ADC_SCAN_PERIOD us and the end of conversion interrupt adds it to the bank adcFill
+// points at. The loop takes a snapshot by flipping adcFill, the ISR can't be half way through a bank when
+// that happens, so the bank just left is stable and nothing has to be masked or cleared under the ISR.
+#define ADC_SCAN_TICKS      (ADC_SCAN_PERIOD * 2)       // TIM3 counts 0.5us
+#define ADC_MAX_SAMPLES     32                          // 10 bit sums stay in uint16_t
+
+typedef struct {
+    uint16_t sum[4];
+    uint8_t count;
+} adcBank_t;
+
+static adcBank_t adcBank[2];
+static volatile uint8_t adcFill;            // bank the ISR adds to, only written by the loop
+
+// TIM3 CC2, schedules the next scan a period after this one so the rate doesn't depend on interrupt latency
+void adcTrigger(void)
+{
+    uint16_t next = ((uint16_t)TIM3->CCR2H << 8 | TIM3->CCR2L) + ADC_SCAN_TICKS;
+
+    TIM3->CCR2H = (uint8_t)(next >> 8);
+    TIM3->CCR2L = (uint8_t)next;
+    ADC1_StartConversion();
+}
+
+__near __interrupt void ADC1_IRQHandler(void)
+{
+    adcBank_t *b = &adcBank[adcFill];
+    uint8_t i;
+
+    // the loop stopped reading (config mode, EEPROM write), halve instead of overflowing
+    if (b->count >= ADC_MAX_SAMPLES) {
+        for (i = 0; i < 4; i++)
+            b->sum[i] >>= 1;
+        b->count >>= 1;
+    }
+    for (i = 0; i < 4; i++)
+        b->sum[i] += ADC1_GetBufferValue(i);
+    b->count++;
+
+    ADC1_ClearITPendingBit(ADC1_CSR_EOC);
+}
+
+// Average of the scans since the last call into sensorInputs[0..3], the gyros (0..2) times 5 * GYRO_FINE with the
+// fraction kept. Returns the number of scans, on 0 sensorInputs[] keeps the previous values.
+static uint8_t adcSnapshot(void)
+{
+    adcBank_t *b = &adcBank[adcFill];
+    uint8_t i, n;
+
+    adcFill ^= 1;               // the other bank was cleared by the previous snapshot
+    n = b->count;
+    if (n) {
+        for (i = 0; i < 3; i++)
+            sensorInputs[i] = (uint32_t)b->sum[i] * (5 * GYRO_FINE) / n;
+        sensorInputs[3] = b->sum[3] / n;
+    }
+    for (i = 0; i < 4; i++)
+        b->sum[i] = 0;
+    b->count = 0;
+    return n;
+}
+#endif
+
+#if defined(STM8) && defined(ADCGYRO)
+void ADCGYRO_init(void)
+{
+    // ADC1
+    ADC1_DeInit();
+    GPIO_Init(GPIOB, GPIO_PIN_0 | GPIO_PIN_1 | GPIO_PIN_2 | GPIO_PIN_3, GPIO_MODE_IN_FL_NO_IT);
+    ADC1_Init(ADC1_CONVERSIONMODE_SINGLE, ADC1_CHANNEL_3, ADC1_PRESSEL_FCPU_D2, ADC1_EXTTRIG_TIM, DISABLE, ADC1_ALIGN_RIGHT, ADC1_SCHMITTTRIG_ALL, DISABLE);
+    ADC1_DataBufferCmd(ENABLE);
+    ADC1_ScanModeCmd(ENABLE);
+    ADC1_ITConfig(ADC1_IT_EOCIE, ENABLE);
+
+    // scan pacing, same timebase as the RX capture in configureReceiver()
+    TIM3_TimeBaseInit(TIM3_PRESCALER_8, 0xFFFF);
+    TIM3_OC2Init(TIM3_OCMODE_TIMING, TIM3_OUTPUTSTATE_DISABLE, ADC_SCAN_TICKS, TIM3_OCPOLARITY_HIGH);
+    TIM3_ITConfig(TIM3_IT_CC2, ENABLE);
+    TIM3_Cmd(ENABLE);
+}
+
+void ADCGYRO_getADC(void)
 {
-    uint8_t axis;
-    int16_t accMag = 0;
-    static t_fp_vector EstG, EstM;
-    static int16_t mgSmooth[3], accTemp[3];     // projection of smoothed and normalized magnetic vector on x/y/z axis, as measured by magnetometer
-    static uint16_t previousT;
-    float scale, deltaGyroAngle[3];
-    uint16_t currentT = micros();
+    adcSnapshot();
+    GYRO_ORIENTATION(-sensorInputs[0], sensorInputs[1], -sensorInputs[2]);
+    GYRO_Common();
+}
+#endif
 
-    scale = (currentT - previousT) * GYRO_SCALE;
-    previousT = currentT;
+#if (defined(STM32F1) || defined(ATMEGA)) && defined(ADCGYRO)
+// The dual ADC free runs through a DMA ring from hw_init() on, nothing to start. Its 14 bit means times 5/16 are
+// the AFROV2 scale (10 bit times 5, same 3.3V reference), so the gains carry over between the two boards.
+// The ATmega's interrupt round robin sums 16 conversions to the same 14 bits, on the 3.3V AREF of the CSHRED
+void ADCGYRO_init(void)
+{
 
-    // Initialization
-    for (axis = 0; axis < 3; axis++) {
-        deltaGyroAngle[axis] = gyroADC[axis] * scale;
-#if defined(ACC_LPF_FACTOR)
-        accTemp[axis] = (accTemp[axis] - (accTemp[axis] >> 4)) + accADC[axis];
-        accSmooth[axis] = accTemp[axis] >> 4;
-#define ACC_VALUE accSmooth[axis]
-#else
-        accSmooth[axis] = accADC[axis];
-#define ACC_VALUE accADC[axis]
-#endif
-        accMag += (ACC_VALUE * 10 / (int16_t) acc_1G) * (ACC_VALUE * 10 / (int16_t) acc_1G);
+}
 
-#if MAG
-#if defined(MG_LPF_FACTOR)
-        mgSmooth[axis] = (mgSmooth[axis] * (MG_LPF_FACTOR - 1) + magADC[axis]) / MG_LPF_FACTOR; // LPF for Magnetometer values
-#define MAG_VALUE mgSmooth[axis]
-#else
-#define MAG_VALUE magADC[axis]
-#endif
-#endif
-    }
+void ADCGYRO_getADC(void)
+{
+    int16_t g[3];
+    uint8_t i;
 
-    rotateV(&EstG.V, deltaGyroAngle);
-#if MAG
-    rotateV(&EstM.V, deltaGyroAngle);
+    for (i = 0; i < 3; i++)
+        g[i] = (uint32_t)analogReadOversampled(i) * (5 * GYRO_FINE) / 16;
+    GYRO_ORIENTATION(g[0], g[1], g[2]);
+    GYRO_Common();
+}
 #endif
-    if (abs(accSmooth[ROLL]) < acc_25deg && abs(accSmooth[PITCH]) < acc_25deg && accSmooth[YAW] > 0)
-        smallAngle25 = 1;
-    else
-        smallAngle25 = 0;
 
-    // Apply complimentary filter (Gyro drift correction)
-    // If accel magnitude >1.4G or <0.6G and ACC vector outside of the limit range => we neutralize the effect of accelerometers in the angle estimation.
-    // To do that, we just skip filter, as EstV already rotated by Gyro
-    if ((36 < accMag && accMag < 196) || smallAngle25)
-        for (axis = 0; axis < 3; axis++) {
-            int16_t acc = ACC_VALUE;
-#ifndef TRUSTED_ACCZ
-            if (smallAngle25 && axis == YAW)
-                // We consider ACCZ = acc_1G when the acc on other axis is small.
-                // It's a tweak to deal with some configs where ACC_Z tends to a value < acc_1G when high throttle is applied.
-                // This tweak applies only when the multi is not in inverted position
-                acc = acc_1G;
-#endif                          /* !TRUSTED_ACCZ */
-            EstG.A[axis] = (EstG.A[axis] * GYR_CMPF_FACTOR + acc) * INV_GYR_CMPF_FACTOR;
-        }
-#if MAG
-    for (axis = 0; axis < 3; axis++)
-        EstM.A[axis] = (EstM.A[axis] * GYR_CMPFM_FACTOR + MAG_VALUE) * INV_GYR_CMPFM_FACTOR;
-#endif
-    // Attitude of the estimated vector
-    angle[ROLL] = _atan2(EstG.V.X, EstG.V.Z);
-    angle[PITCH] = _atan2(EstG.V.Y, EstG.V.Z);
-#if MAG
-    // Attitude of the cross product vector GxM
-    heading = _atan2(EstG.V.X * EstM.V.Z - EstG.V.Z * EstM.V.X, EstG.V.Z * EstM.V.Y - EstG.V.Y * EstM.V.Z) / 10;
-#endif
+// ************************************************************************************************************
+// contribution from Ciskje
+// I2C Gyroscope L3G4200D 
+// ************************************************************************************************************
+#if defined(L3G4200D)
+uint8_t L3G4200D_detect(void)
+{
+    return i2c_probeReg(0XD2, 0x0F, 0xFF, 0xD3);       // WHO_AM_I
 }
 
-#endif                          /* OLD_1_7_STAB_CODE */
-
-float InvSqrt(float x)
+void L3G4200D_init(void)
 {
-    union {
-        int32_t i;
-        float f;
-    } conv;
-    conv.f = x;
-    conv.i = 0x5f3759df - (conv.i >> 1);
-    return 0.5f * conv.f * (3.0f - x * conv.f * conv.f);
+    i2c_deviceSpeed(0XD2, 400000);
+    delay(100);
+    i2c_writeReg(0XD2 + 0, 0x20, 0x8F); // CTRL_REG1   400Hz ODR, 20hz filter, run!
+    delay(5);
+    i2c_writeReg(0XD2 + 0, 0x24, 0x02); // CTRL_REG5   low pass filter enable
 }
 
-int32_t isq(int32_t x)
+void L3G4200D_getADC(void)
 {
-    return x * x;
-}
+    i2c_getSixRawADC(0XD2, 0x80 | 0x28);
 
-#define UPDATE_INTERVAL 25000   // 40hz update rate (20hz LPF on acc)
-#define INIT_DELAY      4000000 // 4 sec initialization delay
-#define Kp1 0.55f               // PI observer velocity gain
-#define Kp2 1.0f                // PI observer position gain
-#define Ki  0.001f              // PI observer integral gain (bias cancellation)
-#define dt  (UPDATE_INTERVAL / 1000000.0f)
+    GYRO_ORIENTATION(((rawADC[1] << 8) | rawADC[0]) / (20 >> GYRO_FRAC), ((rawADC[3] << 8) | rawADC[2]) / (20 >> GYRO_FRAC),
+                     -((rawADC[5] << 8) | rawADC[4]) / (20 >> GYRO_FRAC));
+    GYRO_Common();
+}
+#endif
 
-void getEstimatedAltitude()
+// ************************************************************************************************************
+// I2C Gyroscope ITG3200 
+// ************************************************************************************************************
+// I2C adress: 0xD2 (8bit)   0x69 (7bit)
+// I2C adress: 0xD0 (8bit)   0x68 (7bit)
+// principle:
+// 1) VIO is connected to VDD
+// 2) I2C adress is set to 0x69 (AD0 PIN connected to VDD)
+// or 2) I2C adress is set to 0x68 (AD0 PIN connected to GND)
+// 3) sample rate = 8kHz or 1kHz (DLPF_CFG 0 / 1..6) / (gyroRateDiv + 1)
+// ************************************************************************************************************
+#if defined(ITG3200)
+static uint8_t itgDlpf = 0xFF, itgRateDiv;      // as written to the sensor, 0xFF before ITG3200_init()
+
+#if defined(ITG3200_DRDY_INT)
+// Shortest sample period gyroDlpf/gyroRateDiv may ask for. Every sample is a 6 byte read, about 250us of bus
+// at 400kHz, and the acc, baro and mag jobs queue on the same bus.
+#define ITG3200_MIN_PERIOD      500     // us
+
+// INT pulses high for 50us on every sample. Each edge queues a read of the gyro registers, ITG3200_DECIMATION
+// reads are summed into one frame: their mean, stamped with the edge of the last one. An edge that finds the
+// previous read still queued or on the bus is skipped.
+static i2cJob_t itgJob;
+static uint8_t itgRaw[6];
+static uint32_t itgEdge;                        // microsISR() at the edge of the read in progress
+static int32_t itgSum[3];
+static uint8_t itgSummed = 0;
+static int16_t itgFrame[3];
+static uint32_t itgFrameTime;
+static seq_t itgFrameCount = 0;                 // bumped each time a frame completes
+static volatile uint8_t itgFailed = 0;          // reads that failed, free running, ITG3200_getADC() adds the news to i2cErrorCounter
+static uint8_t itgSeq = 0;                      // frame last decoded by ITG3200_getADC()
+
+// from the I2C interrupt
+static void ITG3200_readDone(i2cJob_t *job)
 {
-    static uint8_t inited = 0;
-    static int16_t AltErrorI = 0;
-    static float AccScale = 0.0f;
-    static uint32_t deadLine = INIT_DELAY;
-    int16_t AltError;
-    int16_t InstAcc;
-    int16_t Delta;
+    uint8_t axis;
 
-    if (currentTime < deadLine)
+    if (job->status != I2C_SUCCESS) {
+        itgFailed++;
+        return;
+    }
+    for (axis = 0; axis < 3; axis++)
+        itgSum[axis] += (int16_t)(itgRaw[axis * 2] << 8 | itgRaw[axis * 2 + 1]);
+    if (++itgSummed < ITG3200_DECIMATION)
         return;
-    deadLine = currentTime + UPDATE_INTERVAL;
-    // Soft start
+    for (axis = 0; axis < 3; axis++) {
+        itgFrame[axis] = itgSum[axis] / ITG3200_DECIMATION;
+        itgSum[axis] = 0;
+    }
+    itgSummed = 0;
+    itgFrameTime = itgEdge;
+    seq_publish(&itgFrameCount);
+#if defined(LOOP_ISR)
+    if (!LOOP_ISR)
+        loopIsr_pend();                 // the inner loop runs on this frame
+#endif
+}
 
-    if (!inited) {
-        inited = 1;
-        EstAlt = BaroAlt;
-        EstVelocity = 0;
-        AltErrorI = 0;
-        AccScale = 100 * 9.80665f / acc_1G;
-    }
-    // Estimation Error
-    AltError = BaroAlt - EstAlt;
-    AltErrorI += AltError;
-    AltErrorI = constrain(AltErrorI, -25000, +25000);
-    // Gravity vector correction and projection to the local Z
-    //InstAcc = (accADC[YAW] * (1 - acc_1G * InvSqrt(isq(accADC[ROLL]) + isq(accADC[PITCH]) + isq(accADC[YAW])))) * AccScale + (Ki) * AltErrorI;
-#if defined(TRUSTED_ACCZ)
-    InstAcc = (accADC[YAW] * (1 - acc_1G * InvSqrt(isq(accADC[ROLL]) + isq(accADC[PITCH]) + isq(accADC[YAW])))) * AccScale + AltErrorI / 1000;
+#if defined(STM32F4)
+static void ITG3200_dataReady(void)
 #else
-    InstAcc = AltErrorI / 1000;
+__near __interrupt void EXTI_PORTB_IRQHandler(void)
 #endif
-    // Integrators
-    Delta = InstAcc * dt + (Kp1 * dt) * AltError;
-    EstAlt += (EstVelocity / 5 + Delta) * (dt / 2) + (Kp2 * dt) * AltError;
-    EstVelocity += Delta * 10;
+{
+    if (itgJob.status == I2C_PENDING)
+        return;
+    itgEdge = microsISR();
+    i2c_submit(&itgJob);
 }
 
-/* SENSORS ------------------------------------------------------------------------------ */
-// ************************************************************************************************************
-// board orientation and setup
-// ************************************************************************************************************
-//default board orientation
-#if !defined(ACC_ORIENTATION)
-#define ACC_ORIENTATION(X, Y, Z)  {accADC[ROLL]  = X; accADC[PITCH]  = Y; accADC[YAW]  = Z;}
-#endif
-#if !defined(GYRO_ORIENTATION)
-#define GYRO_ORIENTATION(X, Y, Z) {gyroADC[ROLL] = X; gyroADC[PITCH] = Y; gyroADC[YAW] = Z;}
-#endif
-#if !defined(MAG_ORIENTATION)
-#define MAG_ORIENTATION(X, Y, Z)  {magADC[ROLL]  = X; magADC[PITCH]  = Y; magADC[YAW]  = Z;}
+void Gyro_waitDataReady(void)
+{
+    disableInterrupts();
+    while (itgFrameCount == itgSeq) {
+        wfi();                  // wfi re-enables interrupts, so the frame can't complete in between the test and the sleep
+        disableInterrupts();
+    }
+    enableInterrupts();
+}
 #endif
 
-/*** I2C address ***/
-#if !defined(ADXL345_ADDRESS)
-#define ADXL345_ADDRESS 0x3A
-//#define ADXL345_ADDRESS 0xA6   //WARNING: Conflicts with a Wii Motion plus!
-#endif
+static void ITG3200_writeConfig(void)
+{
+    uint8_t div = gyroRateDiv;
+#if defined(ITG3200_DRDY_INT)
+    uint16_t base = gyroDlpf ? 1000 : 125;      // us, gyro output rate 1kHz with the DLPF, 8kHz without
 
-#if !defined(BMA180_ADDRESS)
-#define BMA180_ADDRESS 0x80
-//#define BMA180_ADDRESS 0x82
+    if ((uint32_t)base * (div + 1) < ITG3200_MIN_PERIOD)
+        div = ITG3200_MIN_PERIOD / base - 1;
 #endif
+    i2c_postReg(ITG3200_ADDRESS, 0x15, div);    //register: Sample Rate Divider
+    i2c_postReg(ITG3200_ADDRESS, 0x16, 0x18 + gyroDlpf);        //register: DLPF_CFG - low pass filter configuration, FS_SEL 2000 deg/s
+    itgDlpf = gyroDlpf;
+    itgRateDiv = gyroRateDiv;
+}
 
-#if !defined(ITG3200_ADDRESS)
-#define ITG3200_ADDRESS 0XD0
-//#define ITG3200_ADDRESS 0XD2
-#endif
+uint8_t ITG3200_setConfig(void)
+{
+    if (itgDlpf == 0xFF || (itgDlpf == gyroDlpf && itgRateDiv == gyroRateDiv))
+        return 0;
+    ITG3200_writeConfig();
+    return 1;
+}
 
-#if !defined(MS561101BA_ADDRESS)
-#define MS561101BA_ADDRESS 0xEE //CBR=0 0xEE I2C address when pin CSB is connected to LOW (GND)
-//#define MS561101BA_ADDRESS 0xEF //CBR=1 0xEF I2C address when pin CSB is connected to HIGH (VCC)
-#endif
+uint8_t ITG3200_detect(void)
+{
+    return i2c_probeReg(ITG3200_ADDRESS, 0x00, 0x7E, 0x68);    // WHO_AM_I, bits 6:1 of the address
+}
 
-//ITG3200 and ITG3205 Gyro LPF setting
-#if defined(ITG3200_LPF_256HZ) || defined(ITG3200_LPF_188HZ) || defined(ITG3200_LPF_98HZ) || defined(ITG3200_LPF_42HZ) || defined(ITG3200_LPF_20HZ) || defined(ITG3200_LPF_10HZ)
-#if defined(ITG3200_LPF_256HZ)
-#define ITG3200_SMPLRT_DIV 0    //8000Hz
-#define ITG3200_DLPF_CFG   0
-#endif
-#if defined(ITG3200_LPF_188HZ)
-#define ITG3200_SMPLRT_DIV 0    //1000Hz
-#define ITG3200_DLPF_CFG   1
-#endif
-#if defined(ITG3200_LPF_98HZ)
-#define ITG3200_SMPLRT_DIV 0
-#define ITG3200_DLPF_CFG   2
-#endif
-#if defined(ITG3200_LPF_42HZ)
-#define ITG3200_SMPLRT_DIV 0
-#define ITG3200_DLPF_CFG   3
-#endif
-#if defined(ITG3200_LPF_20HZ)
-#define ITG3200_SMPLRT_DIV 0
-#define ITG3200_DLPF_CFG   4
-#endif
-#if defined(ITG3200_LPF_10HZ)
-#define ITG3200_SMPLRT_DIV 0
-#define ITG3200_DLPF_CFG   5
-#endif
+void ITG3200_init(void)
+{
+    delay(100);
+    i2c_writeReg(ITG3200_ADDRESS, 0x3E, 0x80);  //register: Power Management  --  value: reset device
+    delay(5);
+    ITG3200_writeConfig();
+    delay(5);
+    i2c_writeReg(ITG3200_ADDRESS, 0x3E, 0x03);  //register: Power Management  --  value: PLL with Z Gyro reference
+    delay(100);
+#if defined(ITG3200_DRDY_INT)
+    itgJob.address = ITG3200_ADDRESS;
+    itgJob.subaddr = 0x1D;                      // GYRO_XOUT_H
+    itgJob.buf = itgRaw;
+    itgJob.len = 6;
+    itgJob.read = 1;
+    itgJob.done = ITG3200_readDone;
+    i2c_writeReg(ITG3200_ADDRESS, 0x17, 0x01);  //register: INT_CFG  --  value: active high 50us pulse, RAW_RDY_EN
+#if defined(STM32F4)
+    drdy_init(ITG3200_dataReady);
 #else
-//Default settings LPF 256Hz/8000Hz sample
-#define ITG3200_SMPLRT_DIV 0    //8000Hz
-#define ITG3200_DLPF_CFG   0
+    // rising edge on PB3. EXTI sensitivity can only be changed with interrupts masked.
+    disableInterrupts();
+    EXTI->CR1 = (EXTI->CR1 & (uint8_t)~EXTI_CR1_PBIS) | 0x04;     // PBIS = 01, rising edge only
+    enableInterrupts();
+    GPIO_Init(GPIOB, GPIO_PIN_3, GPIO_MODE_IN_FL_IT);
 #endif
+#endif
+}
 
-uint8_t rawADC[6];
-static uint32_t neutralizeTime = 0;
-
-void i2c_getSixRawADC(uint8_t add, uint8_t reg)
+#if defined(ITG3200_DRDY_INT)
+void ITG3200_getADC(void)
 {
-    uint8_t rv = 0;
-    rv = i2c_read(rawADC, 6, add, reg);
-    if (rv != 0)
-        i2cErrorCounter++;
+    static uint8_t failedSeen = 0;
+    int16_t v[3];
+    uint32_t t;
+    uint8_t seq, failed;
+
+    failed = itgFailed - failedSeen;
+    failedSeen += failed;
+    i2cErrorCounter += failed;
+    do {
+        seq = seq_begin(&itgFrameCount);
+        if (seq == itgSeq)
+            return;
+        seq_load(v, itgFrame, sizeof(v));
+        seq_load(&t, &itgFrameTime, sizeof(t));
+    } while (seq_retry(&itgFrameCount, seq));
+    itgSeq = seq;
+    gyroSampleTime = t;
+
+    GYRO_ORIENTATION(+(v[1] / (4 >> GYRO_FRAC)), -(v[0] / (4 >> GYRO_FRAC)), -(v[2] / (4 >> GYRO_FRAC)));     // +/- 8192 * GYRO_FINE
+    GYRO_Common();
 }
-
-void i2c_writeReg(uint8_t add, uint8_t reg, uint8_t val)
+#else
+static void ITG3200_decode(const uint8_t *raw)
 {
-    uint8_t buf[3];
-    uint8_t rv = 0;
-    buf[0] = add;
-    buf[1] = reg;
-    buf[2] = val;
-    rv = i2c_write(buf, 3);
-    if (rv != 0)
-        i2cErrorCounter++;
+    GYRO_ORIENTATION(+(((int16_t)((raw[2] << 8) | raw[3])) / (4 >> GYRO_FRAC)),     // range: +/- 8192 * GYRO_FINE
+                     -(((int16_t)((raw[0] << 8) | raw[1])) / (4 >> GYRO_FRAC)), -(((int16_t)((raw[4] << 8) | raw[5])) / (4 >> GYRO_FRAC)));
+    GYRO_Common();
 }
 
-uint8_t i2c_readReg(uint8_t add, uint8_t reg)
+void ITG3200_getADC(void)
 {
-    uint8_t data[1];
-    uint8_t rv = 0;
-    rv = i2c_read(data, 1, add, reg);
-    if (rv != 0)
-        i2cErrorCounter++;
-    return data[0];
+    i2c_getSixRawADC(ITG3200_ADDRESS, 0X1D);
+    ITG3200_decode(rawADC);
 }
+#endif
+#endif
 
-// ****************
-// GYRO common part
-// ****************
-void GYRO_Common()
-{
-    static int16_t previousGyroADC[3] = { 0, 0, 0 };
-    static int32_t g[3];
-    uint8_t axis;
 
-    if (calibratingG > 0) {
-        for (axis = 0; axis < 3; axis++) {
-            // Reset g[axis] at start of calibration
-            if (calibratingG == 400)
-                g[axis] = 0;
-            // Sum up 400 readings
-            g[axis] += gyroADC[axis];
-            // Clear global variables for next reading
-            gyroADC[axis] = 0;
-            gyroZero[axis] = 0;
-            if (calibratingG == 1) {
-                gyroZero[axis] = g[axis] / 400;
-                blinkLED(10, 15, 1 + 3 * nunchuk);
-            }
-        }
-        calibratingG--;
-    }
-    for (axis = 0; axis < 3; axis++) {
-        gyroADC[axis] -= gyroZero[axis];
-        //anti gyro glitch, limit the variation between two consecutive readings
-        gyroADC[axis] = constrain(gyroADC[axis], previousGyroADC[axis] - 800, previousGyroADC[axis] + 800);
-        previousGyroADC[axis] = gyroADC[axis];
-    }
-}
 
-// ****************
-// ACC common part
-// ****************
-void ACC_Common()
+// ************************************************************************************************************
+// I2C Compass common function
+// ************************************************************************************************************
+#if MAG
+void Mag_getADC(void)
 {
-    static int32_t a[3];
+    static uint32_t tCal = 0;
+    static int16_t magZeroTempMin[3];
+    static int16_t magZeroTempMax[3];
+    uint32_t t = currentTime;
     uint8_t axis;
 
-    if (calibratingA > 0) {
+    // each read is spaced by 20ms by the scheduler, the drivers only queue and decode I2C jobs here
+    if (!Device_Mag_getADC())
+        return;                 //nothing new yet, skip this period
+
+    if (calibratingM == 1) {
+        tCal = t;
         for (axis = 0; axis < 3; axis++) {
-            // Reset a[axis] at start of calibration
-            if (calibratingA == 400)
-                a[axis] = 0;
-            // Sum up 400 readings
-            a[axis] += accADC[axis];
-            // Clear global variables for next reading
-            accADC[axis] = 0;
-            accZero[axis] = 0;
+            magZero[axis] = 0;
+            magZeroTempMin[axis] = 0;
+            magZeroTempMax[axis] = 0;
         }
-        // Calculate average, shift Z down by acc_1G and store values in EEPROM at end of calibration
-        if (calibratingA == 1) {
-            accZero[ROLL] = a[ROLL] / 400;
-            accZero[PITCH] = a[PITCH] / 400;
-            accZero[YAW] = a[YAW] / 400 - acc_1G;       // for nunchuk 200=1G
-            accTrim[ROLL] = 0;
-            accTrim[PITCH] = 0;
-            writeParams();      // write accZero in EEPROM
+        calibratingM = 0;
+    }
+    magADC[ROLL] -= magZero[ROLL];
+    magADC[PITCH] -= magZero[PITCH];
+    magADC[YAW] -= magZero[YAW];
+    if (tCal != 0) {
+        if ((t - tCal) < 30000000) {    // 30s: you have 30s to turn the multi in all directions
+            LEDPIN_TOGGLE;
+            for (axis = 0; axis < 3; axis++) {
+                if (magADC[axis] < magZeroTempMin[axis])
+                    magZeroTempMin[axis] = magADC[axis];
+                if (magADC[axis] > magZeroTempMax[axis])
+                    magZeroTempMax[axis] = magADC[axis];
+            }
+        } else {
+            tCal = 0;
+            for (axis = 0; axis < 3; axis++)
+                magZero[axis] = (magZeroTempMin[axis] + magZeroTempMax[axis]) / 2;
+            writeParams();      // only marks magZero dirty, paramTask() writes it once disarmed and idle
         }
-        calibratingA--;
     }
-    accADC[ROLL] -= accZero[ROLL];
-    accADC[PITCH] -= accZero[PITCH];
-    accADC[YAW] -= accZero[YAW];
 }
-
+#endif
 
 // ************************************************************************************************************
-// I2C Barometer BOSCH BMP085
+// I2C Compass HMC5843 & HMC5883
 // ************************************************************************************************************
-// I2C adress: 0xEE (8bit)   0x77 (7bit)
-// principle:
-//  1) read the calibration register (only once at the initialization)
-//  2) read uncompensated temperature (not mandatory at every cycle)
-//  3) read uncompensated pressure
-//  4) raw temp + raw pressure => calculation of the adjusted pressure
-//  the following code uses the maximum precision setting (oversampling setting 3)
+// I2C adress: 0x3C (8bit)   0x1E (7bit)
 // ************************************************************************************************************
-
-#if defined(BMP085)
-#define BMP085_ADDRESS  0xEE
-#define BMP085_CTRL     0xF4
-#define BMP085_ADC      0xF6
-#define BMP085_TEMP     0x2E
-#define BMP085_DATA     0xAA
-
-static struct {
-    // sensor registers from the BOSCH BMP085 datasheet
-    int16_t ac1, ac2, ac3, b1, b2, mb, mc, md;
-    uint16_t ac4, ac5, ac6;
-    uint16_t ut;                       //uncompensated T
-    uint32_t up;                       //uncompensated P
-    uint8_t state;
-    uint32_t deadline;
-} bmp085_ctx;
-#define OSS 3
-
-// read a 16 bit register
-int16_t i2c_BMP085_readIntRegister(uint8_t r)
+#if defined(HMC5843) || defined(HMC5883)
+void Mag_init(void)
 {
-    uint8_t raw[2];
-
-    i2c_read(raw, 2, BMP085_ADDRESS, r);
-    return (int16_t)raw[0] << 8 | raw[1];
+    powerUpWait(100);
+    i2c_writeReg(0X3C, 0x00, 0x18);     //register: Config A  --  value: 75Hz output rate on the HMC5883, 50Hz on the HMC5843
+    i2c_writeReg(0X3C, 0x02, 0x00);     //register: Mode register  --  value: Continuous-Conversion Mode
 }
 
-void i2c_BMP085_readCalibration(void)
+uint8_t Device_Mag_getADC(void)
 {
-    delay(10);
-    bmp085_ctx.ac1 = i2c_BMP085_readIntRegister(0xAA);
-    bmp085_ctx.ac2 = i2c_BMP085_readIntRegister(0xAC);
-    bmp085_ctx.ac3 = i2c_BMP085_readIntRegister(0xAE);
-    bmp085_ctx.ac4 = i2c_BMP085_readIntRegister(0xB0);
-    bmp085_ctx.ac5 = i2c_BMP085_readIntRegister(0xB2);
-    bmp085_ctx.ac6 = i2c_BMP085_readIntRegister(0xB4);
-    bmp085_ctx.b1 = i2c_BMP085_readIntRegister(0xB6);
-    bmp085_ctx.b2 = i2c_BMP085_readIntRegister(0xB8);
-    bmp085_ctx.mb = i2c_BMP085_readIntRegister(0xBA);
-    bmp085_ctx.mc = i2c_BMP085_readIntRegister(0xBC);
-    bmp085_ctx.md = i2c_BMP085_readIntRegister(0xBE);
-}
+    // Decode the read queued last time round and queue the next one, the heading is one mag period old
+    static i2cJob_t job;
+    static uint8_t raw[6];
 
-// read uncompensated temperature value: send command first
-void i2c_BMP085_UT_Start(void)
-{
-    i2c_writeReg(BMP085_ADDRESS, BMP085_CTRL, BMP085_TEMP);
+    if (!i2c_jobDone(&job))
+        return 0;
+#if defined(HMC5843)
+    MAG_ORIENTATION(((raw[0] << 8) | raw[1]), ((raw[2] << 8) | raw[3]), -((raw[4] << 8) | raw[5]));
+#endif
+#if defined (HMC5883)
+    MAG_ORIENTATION((int16_t)((raw[4] << 8) | raw[5]), -(int16_t)((raw[0] << 8) | raw[1]), -(int16_t)((raw[2] << 8) | raw[3]));
+#endif
+    i2c_submitJob(&job, 0X3C, 0X03, raw, 6, 1);
+    return 1;
 }
+#endif
 
-// read uncompensated pressure value: send command first
-void i2c_BMP085_UP_Start(void)
+// ************************************************************************************************************
+// I2C Compass AK8975 (Contribution by EOSBandi)
+// ************************************************************************************************************
+// I2C adress: 0x18 (8bit)   0x0C (7bit)
+// ************************************************************************************************************
+#if defined(AK8975)
+void Mag_init(void)
 {
-    i2c_writeReg(BMP085_ADDRESS, BMP085_CTRL, 0x34 + (OSS << 6));      // control register value for oversampling setting 3
+    powerUpWait(100);
+    i2c_writeReg(0x18, 0x0a, 0x01);     //Start the first conversion
+    delay(10);                          // takes 7.3ms
 }
 
-// read uncompensated pressure value: read result bytes
-// the datasheet suggests a delay of 25.5 ms (oversampling settings 3) after the send command
-void i2c_BMP085_UP_Read(void)
+uint8_t Device_Mag_getADC(void)
 {
-    uint8_t raw[3];
-    i2c_read(raw, 3, BMP085_ADDRESS, BMP085_ADC);
-    bmp085_ctx.up = ((((uint32_t)raw[0] << 16) | ((uint32_t)raw[1] << 8) | ((uint32_t)raw[2])) >> (8 - OSS));
+    // Single measurement mode: each call queues the read of the conversion started last time with the next
+    // start right behind it, so the chip has a whole mag period (at least 9ms) to convert. The result is
+    // decoded on the following call, like the HMC58x3 the heading is one mag period old
+    static i2cJob_t readJob, startJob;
+    static uint8_t raw[6];
+    static uint8_t start = 0x01;
+    static uint8_t pending = 0;
+    uint8_t rv = 0;
+
+    if (!i2c_jobDone(&readJob) || !i2c_jobDone(&startJob))
+        return 0;
+    if (pending) {
+        MAG_ORIENTATION(((raw[3] << 8) | raw[2]), ((raw[1] << 8) | raw[0]), -((raw[5] << 8) | raw[4]));
+        rv = 1;
+    }
+    i2c_submitJob(&readJob, 0x18, 0x03, raw, 6, 1);
+    i2c_submitJob(&startJob, 0x18, 0x0a, &start, 1, 0);     // register CNTL: single measurement
+    pending = 1;
+    return rv;
 }
+#endif
 
-// read uncompensated temperature value: read result bytes
-// the datasheet suggests a delay of 4.5 ms after the send command
-void i2c_BMP085_UT_Read(void)
+#if !GYRO
+// ************************************************************************************************************
+// I2C Wii Motion Plus + optional Nunchuk
+// ************************************************************************************************************
+// I2C adress 1: 0xA6 (8bit)    0x53 (7bit)
+// I2C adress 2: 0xA4 (8bit)    0x52 (7bit)
+// ************************************************************************************************************
+void WMP_init(uint8_t d)
 {
-    uint8_t raw[2];
-
-    i2c_read(raw, 2, BMP085_ADDRESS, BMP085_ADC);
-    bmp085_ctx.ut = (uint16_t)raw[0] << 8 | raw[1];
+    // the rest of the bus keeps I2C_SPEED
+    i2c_deviceSpeed(0xA6, I2C_WMP_SPEED);
+    i2c_deviceSpeed(0xA4, I2C_WMP_SPEED);
+    delay(d);
+    i2c_writeReg(0xA6, 0xF0, 0x55);     // Initialize Extension
+    delay(d);
+    i2c_writeReg(0xA6, 0xFE, 0x05);     // Activate Nunchuck pass-through mode
+    delay(d);
+    if (d > 0) {
+        // We need to set acc_1G for the Nunchuk beforehand; It's used in WMP_getRawADC() and ACC_Common()
+        // If a different accelerometer is used, it will be overwritten by its init() later.
+        uint8_t i;
+        uint8_t numberAccRead = 0;
+        acc_1G = 200;
+        acc_25deg = acc_1G * 0.423;
+        // Read from WMP 100 times, this should return alternating WMP and Nunchuk data
+        for (i = 0; i < 100; i++) {
+            delay(4);
+            if (WMP_getRawADC() == 0)
+                numberAccRead++;        // Count number of times we read from the Nunchuk extension
+        }
+        // If we got at least 25 Nunchuck reads, we assume the Nunchuk is present
+        if (numberAccRead > 25)
+            nunchuk = 1;
+        delay(10);
+    }
 }
 
-void Baro_init(void)
+// one 6 byte WMP passthrough frame, returns 1 for gyro data, 0 for nunchuk data, 2 if it's neither
+static uint8_t WMP_decode(const uint8_t *raw)
 {
-    delay(10);
-    i2c_BMP085_readCalibration();
-    i2c_BMP085_UT_Start();
-    delay(5);
-    i2c_BMP085_UT_Read();
+    uint8_t axis;
+
+    if (micros() < (neutralizeTime + NEUTRALIZE_DELAY)) {       //we neutralize data in case of blocking+hard reset state
+        for (axis = 0; axis < 3; axis++) {
+            gyroADC[axis] = 0;
+            accADC[axis] = 0;
+        }
+        accADC[YAW] = acc_1G;
+        return 1;
+    }
+    // Wii Motion Plus Data
+    if ((raw[5] & 0x03) == 0x02) {
+        // Assemble 14bit data 
+        gyroADC[ROLL] = -(((raw[5] >> 2) << 8) | raw[2]) * GYRO_FINE; //range: +/- 8192 * GYRO_FINE, no bits below
+        gyroADC[PITCH] = -(((raw[4] >> 2) << 8) | raw[1]) * GYRO_FINE;
+        gyroADC[YAW] = -(((raw[3] >> 2) << 8) | raw[0]) * GYRO_FINE;
+        GYRO_Common();
+        // Check if slow bit is set and normalize to fast mode range
+        gyroADC[ROLL] = (raw[3] & 0x01) ? gyroADC[ROLL] / 5 : gyroADC[ROLL]; //the ratio 1/5 is not exactly the IDG600 or ISZ650 specification 
+        gyroADC[PITCH] = (raw[4] & 0x02) >> 1 ? gyroADC[PITCH] / 5 : gyroADC[PITCH]; //we detect here the slow of fast mode WMP gyros values (see wiibrew for more details)
+        gyroADC[YAW] = (raw[3] & 0x02) >> 1 ? gyroADC[YAW] / 5 : gyroADC[YAW];       // this step must be done after zero compensation    
+        return 1;
+    } else if ((raw[5] & 0x03) == 0x00) {    // Nunchuk Data
+        ACC_ORIENTATION(((raw[3] << 2) | ((raw[5] >> 4) & 0x02)), -((raw[2] << 2) | ((raw[5] >> 3) & 0x02)), (((raw[4] >> 1) << 3) | ((raw[5] >> 5) & 0x06)));
+        ACC_Common();
+        return 0;
+    } else
+        return 2;
 }
 
-void i2c_BMP085_Calculate(void)
+uint8_t WMP_getRawADC(void)
 {
-    int32_t x1, x2, x3, b3, b5, b6, p, tmp;
-    uint32_t b4, b7;
-    // Temperature calculations
-    x1 = ((int32_t) bmp085_ctx.ut - bmp085_ctx.ac6) * bmp085_ctx.ac5 >> 15;
-    x2 = ((int32_t) bmp085_ctx.mc << 11) / (x1 + bmp085_ctx.md);
-    b5 = x1 + x2;
-    // Pressure calculations
-    b6 = b5 - 4000;
-    x1 = (bmp085_ctx.b2 * (b6 * b6 >> 12)) >> 11;
-    x2 = bmp085_ctx.ac2 * b6 >> 11;
-    x3 = x1 + x2;
-    tmp = bmp085_ctx.ac1;
-    tmp = (tmp * 4 + x3) << OSS;
-    b3 = (tmp + 2) / 4;
-    x1 = bmp085_ctx.ac3 * b6 >> 13;
-    x2 = (bmp085_ctx.b1 * (b6 * b6 >> 12)) >> 16;
-    x3 = ((x1 + x2) + 2) >> 2;
-    b4 = (bmp085_ctx.ac4 * (uint32_t) (x3 + 32768)) >> 15;
-    // b7 = ((uint32_t) (bmp085_ctx.up >> (8 - OSS)) - b3) * (50000 >> OSS);
-    b7 = ((uint32_t)bmp085_ctx.up - b3) * (50000 >> OSS);
-    p = b7 < 0x80000000 ? (b7 * 2) / b4 : (b7 / b4) * 2;
-    x1 = (p >> 8) * (p >> 8);
-    x1 = (x1 * 3038) >> 16;
-    x2 = (-7357 * p) >> 16;
-    pressure = p + ((x1 + x2 + 3791) >> 4);
+    i2c_getSixRawADC(0xA4, 0x00);
+    return WMP_decode(rawADC);
 }
 
-void Baro_update()
+// Passthrough mode without waiting: a read is queued on the bus at most once per INTERLEAVING_DELAY (the
+// extension needs that long between reads to alternate WMP and nunchuk data) and decoded on a later call.
+// Returns what was decoded like WMP_getRawADC(), 2 while there's nothing new.
+uint8_t WMP_poll(void)
 {
-    if (currentTime < bmp085_ctx.deadline)
-        return;
-
-    bmp085_ctx.deadline = currentTime;
-    switch (bmp085_ctx.state) {
-    case 0:
-        i2c_BMP085_UT_Start();
-        bmp085_ctx.state++;
-        bmp085_ctx.deadline += 4600;
-        break;
-    case 1:
-        i2c_BMP085_UT_Read();
-        bmp085_ctx.state++;
-        break;
-    case 2:
-        i2c_BMP085_UP_Start();
-        bmp085_ctx.state++;
-        bmp085_ctx.deadline += 26000;
-        break;
-    case 3:
-        i2c_BMP085_UP_Read();
-        i2c_BMP085_Calculate();
-        BaroAlt = (1.0f - pow(pressure / 101325.0f, 0.190295f)) * 4433000.0f;
-        bmp085_ctx.state = 0;
-        bmp085_ctx.deadline += 20000;
-        break;
+    static i2cJob_t job;
+    static uint8_t raw[6];
+    static uint8_t queued = 0;
+    static uint32_t readTime;
+    uint8_t rv = 2;
+
+    if (queued) {
+        if (!i2c_jobDone(&job))
+            return 2;
+        queued = 0;
+        rv = WMP_decode(raw);
+    }
+    if (currentTime - readTime >= INTERLEAVING_DELAY) {
+        readTime = currentTime;
+        i2c_submitJob(&job, 0xA4, 0x00, raw, 6, 1);
+        queued = 1;
     }
+    return rv;
 }
-#endif
+#endif                          /* !GYRO */
 
 // ************************************************************************************************************
-// I2C Barometer MS561101BA
+// Driver tables: every gyro/acc compiled in is a candidate, the first one whose id answers is used.
+// Entries that can't be probed go last and are taken as is; with nothing answering the first entry is used.
 // ************************************************************************************************************
-// first contribution from Fabio
-// modification from Alex (September 2011)
-//
-// specs are here: http://www.meas-spec.com/downloads/MS5611-01BA03.pdf
-// useful info on pages 7 -> 12
-#if defined(MS561101BA)
-
-// registers of the device
-#define MS561101BA_PRESSURE 0x40
-#define MS561101BA_TEMPERATURE 0x50
-#define MS561101BA_RESET 0x1E
+#if GYRO
+static const sensorDriver_t gyroDrivers[] = {
+#if defined(MPU6000SPI)
+    { MPU6000_detect, MPU6000_gyroInit, MPU6000_gyroGetADC, MPU6000_setConfig },
+#endif
+#if defined(ITG3200) && defined(ITG3200_DRDY_INT)
+    { ITG3200_detect, ITG3200_init, ITG3200_getADC, ITG3200_setConfig },
+#elif defined(ITG3200)
+    { ITG3200_detect, ITG3200_init, ITG3200_getADC, ITG3200_setConfig, ITG3200_decode, ITG3200_ADDRESS, 0x1D },
+#endif
+#if defined(L3G4200D)
+    { L3G4200D_detect, L3G4200D_init, L3G4200D_getADC, NULL },
+#endif
+#if defined(ADCGYRO)
+    { NULL, ADCGYRO_init, ADCGYRO_getADC, NULL },
+#endif
+};
+#endif
 
-// OSR (Over Sampling Ratio) constants
-#define MS561101BA_OSR_256 0x00
-#define MS561101BA_OSR_512 0x02
-#define MS561101BA_OSR_1024 0x04
-#define MS561101BA_OSR_2048 0x06
-#define MS561101BA_OSR_4096 0x08
+#if ACC
+static const sensorDriver_t accDrivers[] = {
+#if defined(MPU6000SPI)
+    { MPU6000_detect, MPU6000_accInit, MPU6000_accGetADC, NULL },
+#endif
+#if defined(ADXL345SPI)
+    { ADXL345SPI_detect, ADXL345SPI_init, ADXL345SPI_getADC, NULL },
+#endif
+#if defined(ADXL345)
+    { ADXL345_detect, ADXL345_init, ADXL345_getADC, NULL, ADXL345_decode, ADXL345_ADDRESS, 0x32 },
+#endif
+#if defined(BMA180)
+    { BMA180_detect, BMA180_init, BMA180_getADC, NULL, BMA180_decode, BMA180_ADDRESS, 0x02 },
+#endif
+#if defined(BMA020)
+    { BMA020_detect, BMA020_init, BMA020_getADC, NULL, BMA020_decode, 0x70, 0x02 },
+#endif
+#if defined(LIS3LV02)
+    { LIS3LV02_detect, LIS3LV02_init, LIS3LV02_getADC, NULL },
+#endif
+#if defined(LSM303DLx_ACC)
+    { NULL, LSM303DLx_init, LSM303DLx_getADC, NULL, LSM303DLx_decode, 0x30, 0xA8 },
+#endif
+#if defined(ADCACC)
+    { NULL, ADCACC_init, ADCACC_getADC, NULL },
+#endif
+#if defined(NUNCHACK)
+    { NULL, NUNCHACK_init, NUNCHACK_getADC, NULL },
+#endif
+};
+#endif
 
-#define OSR MS561101BA_OSR_4096
+#if (GYRO || ACC) && !defined(SENSOR_LINK)
+static const sensorDriver_t *sensorProbe(const sensorDriver_t *table, uint8_t n)
+{
+    uint8_t i;
 
-static struct {
-    // sensor registers from the MS561101BA datasheet
-    uint16_t c[7];
-    union {
-        uint32_t val;
-        uint8_t raw[4];
-    } ut;                       //uncompensated T
-    union {
-        uint32_t val;
-        uint8_t raw[4];
-    } up;                       //uncompensated P
-    uint8_t state;
-    uint32_t deadline;
-} ms561101ba_ctx;
+    for (i = 0; i < n; i++)
+        if (!table[i].detect || table[i].detect())
+            return &table[i];
+    return &table[0];
+}
+#endif
 
-void i2c_MS561101BA_reset(void)
+void initSensors(void)
 {
-    i2c_writeReg(MS561101BA_ADDRESS, MS561101BA_RESET, 0);
+#if I2C_BUS && !defined(MOTOR_I2C)
+    i2c_init();                         // the motors have it running already
+#endif
+#if defined(SENSOR_LINK)
+    gpsSerial_init(SENSOR_LINK);        // the sensors are on the sensor node
+#else
+    spi_init();
+    powerUpWait(100);
+#if defined(MPU6000SPI)
+    MPU6000_reset();
+#endif
+#if BARO
+    Baro_init();        // while the MPU6000 resets
+#endif
+#if GYRO
+    gyroDev = sensorProbe(gyroDrivers, sizeof(gyroDrivers) / sizeof(gyroDrivers[0]));
+    gyroDev->init();
+#else
+    WMP_init(250);
+#endif
+#if ACC
+    accDev = sensorProbe(accDrivers, sizeof(accDrivers) / sizeof(accDrivers[0]));
+    accDev->init();
+    acc_25deg = acc_1G * 0.423;
+#endif
+#if MAG
+    Mag_init();
+#endif
+#endif                          /* !SENSOR_LINK */
 }
 
-void i2c_MS561101BA_readCalibration(void)
-{
-    union {
-        uint16_t val;
-        uint8_t raw[2];
-    } data;
-    uint8_t i;
+#if defined(SERIAL_STREAM) || defined(BLACKBOX) || defined(WATCH)
+// The stream, watch and blackbox frames go out through these. On a TELEMETRY_PORT they are built in RAM and queued
+// whole on it, a command reply then never waits behind a log chunk. Otherwise they're serial frames like any other
+#if defined(TELEMETRY_PORT)
+static uint8_t teleFrame[128];
+static uint8_t teleLen;
 
-    delay(10);
-    for (i = 0; i < 6; i++) {
-        i2c_rep_start(MS561101BA_ADDRESS + 0);
-        i2c_write(0xA2 + 2 * i);
-        i2c_rep_start(MS561101BA_ADDRESS + 1);  //I2C read direction => 1
-        data.raw[1] = i2c_readAck();    // read a 16 bit register
-        data.raw[0] = i2c_readNak();
-        ms561101ba_ctx.c[i + 1] = data.val;
-    }
+static void teleReset(void)
+{
+    teleLen = 0;
 }
 
-void Baro_init(void)
+static void telePut8(uint8_t a)
 {
-    delay(10);
-    i2c_MS561101BA_reset();
-    delay(10);
-    i2c_MS561101BA_readCalibration();
+    if (teleLen < sizeof(teleFrame))
+        teleFrame[teleLen++] = a;
 }
 
-// read uncompensated temperature value: send command first
-void i2c_MS561101BA_UT_Start(void)
+static void teleCommit(void)
 {
-    i2c_rep_start(MS561101BA_ADDRESS + 0);      // I2C write direction
-    i2c_write(MS561101BA_TEMPERATURE + OSR);    // register selection
+    Telemetry_write(teleFrame, teleLen);
 }
 
-// read uncompensated pressure value: send command first
-void i2c_MS561101BA_UP_Start(void)
+#define teleBusy(len)   (Telemetry_free() < (len))
+#else
+#define teleReset()     Serial_reset()
+#define telePut8(a)     serialize8(a)
+#define teleCommit()    Serial_commitBuffer()
+#define teleBusy(len)   Serial_isTxBusy()
+#endif
+#endif
+
+#if defined(SERIAL_STREAM)
+// ************************************************************************************************************
+// Subscription telemetry: 'T' followed by one rate divider per group (0 = off) selects what is streamed.
+// streamTask() runs at STREAM_PERIOD and sends the due groups in one frame:
+//   0xA5, len, seq, groups, time, group payloads in bit order, xor of len..last payload byte
+// len counts seq, groups, time and the payloads. time is currentTime of the loop the values are from, 32 bit
+// little endian: with the 'y' clock sync the host knows how old they are.
+// The link sets the pace, not the subscription: a due frame that finds the link busy (teleBusy()) was asked for
+// faster than the wire takes it and is skipped whole, and the lowest priority group in use gets its divider doubled,
+// at most STREAM_SCALE_MAX times. STREAM_RECOVER due frames in a row that went out undo one doubling, of the highest
+// priority group that has one. So the stream keeps probing up to what the link carries, the attitude and RC groups
+// slow down last and come back first, and nothing ever waits for the wire. 't' reports the dividers in use.
+// ************************************************************************************************************
+enum {
+    STREAM_ATTITUDE = 0,        // angle[2] (0.1deg), heading                                   6 bytes
+    STREAM_IMU,                 // accSmooth[3], gyroData[3], magADC[3]                         18 bytes
+    STREAM_MOTORS,              // motor[8]                                                     16 bytes
+    STREAM_RC,                  // rcData[8]                                                    16 bytes
+    STREAM_STATUS,              // cycleTime, EstAlt/10, i2cErrorCounter, vbat, armed/modes,   13 bytes
+                                //   then mixer shifted/scaled loop counts since the last one,
+                                //   loop overruns since startup and the task blamed for the last
+    STREAM_OSD,                 // angle[2], heading, EstAlt/10, vbat, GPS_numSat,              15 bytes
+                                //   GPS_distanceToHome, GPS_directionToHome, armed/modes/GPS_fix
+    STREAM_POWER,               // pMeter sum / PLEVELDIV, last powermeter sample, vbat          5 bytes
+    STREAM_NOTCH,               // DYN_NOTCH centre per axis in Hz, 0 while it has none         6 bytes
+    STREAM_GROUPS
+};
+
+#define STREAM_PERIOD       10000       // us, dividers count in these
+#define STREAM_SYNC         0xA5
+#define STREAM_SCALE_MAX    4           // dividers up to 16 times the subscribed ones
+#define STREAM_RECOVER      50          // frames sent
+
+#if defined(OSD_STREAM)
+static uint8_t streamDivider[STREAM_GROUPS] = { 0, 0, 0, 0, 0, OSD_STREAM, 0, 0 };   // the OSD only listens
+#else
+static uint8_t streamDivider[STREAM_GROUPS];
+#endif
+static uint8_t streamCount[STREAM_GROUPS];
+static uint8_t streamSeq = 0;
+static uint8_t streamCheck;
+// slowed down last first
+static const uint8_t streamPriority[STREAM_GROUPS] = {
+    STREAM_ATTITUDE, STREAM_RC, STREAM_STATUS, STREAM_OSD, STREAM_MOTORS, STREAM_IMU, STREAM_POWER, STREAM_NOTCH
+};
+static uint8_t streamScale[STREAM_GROUPS];      // the divider in use is streamDivider << streamScale
+static uint8_t streamSent;                      // frames out since the last skipped or recovered one
+static uint16_t streamSkipped = 0;              // due frames the link was busy for, since startup
+static uint16_t streamBytes, streamThroughput;  // bytes sent in this second, in the last one
+static uint8_t streamTicks;
+
+static uint8_t streamRate(uint8_t g)
 {
-    i2c_rep_start(MS561101BA_ADDRESS + 0);      // I2C write direction
-    i2c_write(MS561101BA_PRESSURE + OSR);       // register selection
+    uint16_t d = (uint16_t)streamDivider[g] << streamScale[g];
+
+    return d > 255 ? 255 : d;
 }
 
-// read uncompensated pressure value: read result bytes
-void i2c_MS561101BA_UP_Read(void)
+static void streamAdapt(uint8_t busy)
 {
-    i2c_rep_start(MS561101BA_ADDRESS + 0);
-    i2c_write(0);
-    i2c_rep_start(MS561101BA_ADDRESS + 1);
-    ms561101ba_ctx.up.raw[2] = i2c_readAck();
-    ms561101ba_ctx.up.raw[1] = i2c_readAck();
-    ms561101ba_ctx.up.raw[0] = i2c_readNak();
+    int8_t i;
+    uint8_t g;
+
+    if (busy) {
+        streamSent = 0;
+        if (streamSkipped < 0xFFFF)
+            streamSkipped++;
+        for (i = STREAM_GROUPS - 1; i >= 0; i--) {
+            g = streamPriority[i];
+            if (streamDivider[g] && streamScale[g] < STREAM_SCALE_MAX && streamRate(g) < 255) {
+                streamScale[g]++;
+                return;
+            }
+        }
+        return;
+    }
+    if (++streamSent < STREAM_RECOVER)
+        return;
+    streamSent = 0;
+    for (i = 0; i < STREAM_GROUPS; i++) {
+        g = streamPriority[i];
+        if (streamScale[g]) {
+            streamScale[g]--;
+            return;
+        }
+    }
 }
 
-// read uncompensated temperature value: read result bytes
-void i2c_MS561101BA_UT_Read(void)
+static void streamPut8(uint8_t a)
 {
-    i2c_rep_start(MS561101BA_ADDRESS + 0);
-    i2c_write(0);
-    i2c_rep_start(MS561101BA_ADDRESS + 1);
-    ms561101ba_ctx.ut.raw[2] = i2c_readAck();
-    ms561101ba_ctx.ut.raw[1] = i2c_readAck();
-    ms561101ba_ctx.ut.raw[0] = i2c_readNak();
+    telePut8(a);
+    streamCheck ^= a;
 }
 
-void i2c_MS561101BA_Calculate(void)
+static void streamPut16(int16_t a)
 {
-    int64_t dT = ms561101ba_ctx.ut.val - ((uint32_t) ms561101ba_ctx.c[5] << 8); // int32_t according to the spec, but int64_t here to avoid cast after
-    int64_t off = ((uint32_t) ms561101ba_ctx.c[2] << 16) + ((dT * ms561101ba_ctx.c[4]) >> 7);
-    int64_t sens = ((uint32_t) ms561101ba_ctx.c[1] << 15) + ((dT * ms561101ba_ctx.c[3]) >> 8);
-    pressure = (((ms561101ba_ctx.up.val * sens) >> 21) - off) >> 15;
+    streamPut8(a);
+    streamPut8(a >> 8 & 0xff);
 }
 
-void Baro_update(void)
+void streamTask(void)
 {
-    if (currentTime < ms561101ba_ctx.deadline)
+    static const uint8_t groupSize[STREAM_GROUPS] = { 6, 18, 16, 16, 13, 15, 5, 6 };
+    uint8_t g, i, due = 0, len = 6;
+
+    if (++streamTicks >= 1000000 / STREAM_PERIOD) {
+        streamTicks = 0;
+        streamThroughput = streamBytes;
+        streamBytes = 0;
+    }
+    for (g = 0; g < STREAM_GROUPS; g++) {
+        if (streamDivider[g] == 0)
+            continue;
+        if (++streamCount[g] >= streamRate(g)) {
+            streamCount[g] = 0;
+            due |= 1 << g;
+            len += groupSize[g];
+        }
+    }
+    if (!due)
         return;
-    ms561101ba_ctx.deadline = currentTime;
-    TWBR = ((16000000L / 400000L) - 16) / 2;    // change the I2C clock rate to 400kHz, MS5611 is ok with this speed
-    switch (ms561101ba_ctx.state) {
-    case 0:
-        i2c_MS561101BA_UT_Start();
-        ms561101ba_ctx.state++;
-        ms561101ba_ctx.deadline += 15000;       // according to the specs, the pause should be at least 8.22ms
-        break;
-    case 1:
-        i2c_MS561101BA_UT_Read();
-        ms561101ba_ctx.state++;
-        break;
-    case 2:
-        i2c_MS561101BA_UP_Start();
-        ms561101ba_ctx.state++;
-        ms561101ba_ctx.deadline += 15000;       // according to the specs, the pause should be at least 8.22ms
-        break;
-    case 3:
-        i2c_MS561101BA_UP_Read();
-        i2c_MS561101BA_Calculate();
-        BaroAlt = (1.0f - pow(pressure / 101325.0f, 0.190295f)) * 4433000.0f;
-        ms561101ba_ctx.state = 0;
-        ms561101ba_ctx.deadline += 30000;
-        break;
+    // never wait for the wire, a late frame is just skipped
+    if (teleBusy(len + 3)) {
+        streamAdapt(1);
+        return;
+    }
+    streamAdapt(0);
+    streamBytes += len + 3;
+
+    teleReset();
+    telePut8(STREAM_SYNC);
+    streamCheck = 0;
+    streamPut8(len);
+    streamPut8(streamSeq++);
+    streamPut8(due);
+    streamPut16(currentTime);
+    streamPut16(currentTime >> 16);
+    if (due & (1 << STREAM_ATTITUDE | 1 << STREAM_OSD)) {
+        attitudeAngles();
+        attitudeHeading();
+    }
+    if (due & (1 << STREAM_ATTITUDE)) {
+        streamPut16(angle[ROLL]);
+        streamPut16(angle[PITCH]);
+        streamPut16(heading);
     }
+    if (due & (1 << STREAM_IMU)) {
+        for (i = 0; i < 3; i++)
+            streamPut16(accSmooth[i]);
+        for (i = 0; i < 3; i++)
+            streamPut16(GYRO_LEGACY(gyroData[i]));
+        for (i = 0; i < 3; i++)
+            streamPut16(magADC[i]);
+    }
+    if (due & (1 << STREAM_MOTORS))
+        for (i = 0; i < 8; i++)
+            streamPut16(motor[i]);
+    if (due & (1 << STREAM_RC))
+        for (i = 0; i < 8; i++)
+            streamPut16(rcData[i]);
+    if (due & (1 << STREAM_STATUS)) {
+        streamPut16(cycleTime);
+        streamPut16(EstAlt / 10);
+        streamPut16(i2cErrorCounter);
+        streamPut8(vbat);
+        streamPut8(armed | accMode << 1 | baroMode << 2 | magMode << 3 | (GPSModeHome | GPSModeHold) << 4);
+        streamPut8(mixShifted);
+        streamPut8(mixScaled);
+        mixShifted = 0;
+        mixScaled = 0;
+        streamPut16(loopOverruns);
+        streamPut8(loopOverrunTask);
+    }
+    if (due & (1 << STREAM_OSD)) {
+        streamPut16(angle[ROLL]);
+        streamPut16(angle[PITCH]);
+        streamPut16(heading);
+        streamPut16(EstAlt / 10);
+        streamPut8(vbat);
+        streamPut8(GPS_numSat);
+        streamPut16(GPS_distanceToHome);
+        streamPut16(GPS_directionToHome);
+        streamPut8(armed | accMode << 1 | baroMode << 2 | magMode << 3 | (GPSModeHome | GPSModeHold) << 4 | GPS_fix << 5);
+    }
+    if (due & (1 << STREAM_POWER)) {
+        streamPut16(pMeter[PMOTOR_SUM] / PLEVELDIV);
+        streamPut16(powerDraw);
+        streamPut8(vbat);
+    }
+    if (due & (1 << STREAM_NOTCH))
+        for (i = 0; i < 3; i++)
+#if defined(DYN_NOTCH)
+            streamPut16(notchHz[i]);
+#else
+            streamPut16(0);
+#endif
+    telePut8(streamCheck);
+    teleCommit();
 }
 #endif
 
-
-
-
-// ************************************************************************************************************
-// I2C Accelerometer ADXL345 
+#if defined(WATCH)
 // ************************************************************************************************************
-// I2C adress: 0x3A (8bit)    0x1D (7bit)
-// Resolution: 10bit (Full range - 14bit, but this is autoscaling 10bit ADC to the range +- 16g)
-// principle:
-//  1) CS PIN must be linked to VCC to select the I2C mode
-//  2) SD0 PIN must be linked to VCC to select the right I2C adress
-//  3) bit  b00000100 must be set on register 0x2D to read data (only once at the initialization)
-//  4) bits b00001011 must be set on register 0x31 to select the data format (only once at the initialization)
+// Live variable watch
 // ************************************************************************************************************
-#if defined(ADXL345)
-void ACC_init()
-{
-    delay(10);
-    i2c_writeReg(ADXL345_ADDRESS, 0x2D, 1 << 3);        //  register: Power CTRL  -- value: Set measure bit 3 on
-    i2c_writeReg(ADXL345_ADDRESS, 0x31, 0x0B);  //  register: DATA_FORMAT -- value: Set bits 3(full range) and 1 0 on (+/- 16g-range)
-    i2c_writeReg(ADXL345_ADDRESS, 0x2C, 8 + 2 + 1);     // register: BW_RATE     -- value: 200Hz sampling (see table 5 of the spec)
-    acc_1G = 256;
-}
-
-void ACC_getADC()
-{
-#ifndef STM8
-    TWBR = ((16000000L / 400000L) - 16) / 2;    // change the I2C clock rate to 400kHz, ADXL435 is ok with this speed
-#endif
-    i2c_getSixRawADC(ADXL345_ADDRESS, 0x32);
-
-    ACC_ORIENTATION(-((rawADC[3] << 8) | rawADC[2]), ((rawADC[1] << 8) | rawADC[0]), ((rawADC[5] << 8) | rawADC[4]));
-    ACC_Common();
-}
+// 'w' sets a loop divider (0 stops) and up to WATCH_SLOTS variables as (32 bit address, size) pairs, all in
+// .data or .bss and 1, 2 or 4 bytes. Every divider-th loop watchSample() copies them into watchRing, one
+// sample of watchSampleLen bytes, the values in slot order and little endian. watchTask() sends whole samples:
+//   0xA7, len, seq, lost, samples, xor of len..last sample byte
+// lost counts the samples the full ring dropped since the frame before, up to 255. Values an interrupt
+// handler writes can be caught half updated.
+#define WATCH_SLOTS         6
+#define WATCH_SYNC          0xA7
+#define WATCH_FRAME         120         // largest len
+#if defined(STM8) || defined(ATMEGA)
+#define WATCH_BUFFER        128         // a power of 2
+#else
+#define WATCH_BUFFER        512
 #endif
 
-#if defined(ADXL345SPI)
-
-/* Private defines */
-#define ADXL_OFF	   GPIO_WriteHigh(GPIOE, GPIO_PIN_5);
-#define ADXL_ON		   GPIO_WriteLow(GPIOE, GPIO_PIN_5);
-
-#define ADXL_READ_BIT      0x80
-#define ADXL_MULTI_BIT     0x40
-#define ADXL_X0_ADDR       0x32
-#define ADXL_RATE_ADDR     0x2C
-#define ADXL_FIFO_ADDR     0x38
-#define ADXL_RATE_100      0x0A
-#define ADXL_RATE_200      0x0B
-#define ADXL_RATE_400      0x0C
-#define ADXL_RATE_800      0x0D
-#define ADXL_RATE_1600     0x0E
-#define ADXL_RATE_3200     0x0F
-#define ADXL_POWER_ADDR    0x2D
-#define ADXL_MEASURE       0x08
-#define ADXL_FORMAT_ADDR   0x31
-#define ADXL_FULL_RES      0x08
-#define ADXL_4WIRE         0x00
-#define ADXL_RANGE_2G      0x00
-#define ADXL_RANGE_4G      0x01
-#define ADXL_RANGE_8G      0x02
-#define ADXL_RANGE_16G     0x03
-#define ADXL_FIFO_STREAM   0x80
-
-static void ADXL_Init(void)
+static uint8_t *watchAddr[WATCH_SLOTS];
+static uint8_t watchSize[WATCH_SLOTS];
+static uint8_t watchSlots = 0;
+static uint8_t watchSampleLen = 0;
+static uint8_t watchDivider = 0;
+static uint8_t watchCount = 0;
+static uint8_t watchRing[WATCH_BUFFER];
+static uint16_t watchHead = 0, watchTail = 0;  // free running, the loop fills, watchTask() drains
+static uint8_t watchLost = 0;
+static uint8_t watchSeq = 0;
+
+// from 'w': p[0] the divider, then 5 bytes per slot. A list with any bad entry is refused whole, 0 returned
+static uint8_t watchSet(const uint8_t *p, uint8_t len)
 {
-    // setup ADXL345 rate/range/start measuring
-    // Rate 3200Hz
-    ADXL_ON;
-    spi_writeByte(ADXL_RATE_ADDR);
-    spi_writeByte(ADXL_RATE_800 & 0x0F);
-    ADXL_OFF;
-
-    // Range 8G
-    ADXL_ON;
-    spi_writeByte(ADXL_FORMAT_ADDR);
-    spi_writeByte((ADXL_RANGE_8G & 0x03) | ADXL_FULL_RES | ADXL_4WIRE);
-    ADXL_OFF;
-
-    // Fifo depth = 16
-    ADXL_ON;
-    spi_writeByte(ADXL_FIFO_ADDR);
-    spi_writeByte((16 & 0x1f) | ADXL_FIFO_STREAM);
-    ADXL_OFF;
-
-    ADXL_ON;
-    spi_writeByte(ADXL_POWER_ADDR);
-    spi_writeByte(ADXL_MEASURE);
-    ADXL_OFF;
+    const uint8_t *s;
+    uint32_t addr;
+    uint8_t i, n, size;
+
+    watchDivider = 0;
+    watchSlots = 0;
+    watchSampleLen = 0;
+    watchHead = watchTail = 0;          // the samples queued are of the old list
+    watchLost = 0;
+    watchCount = 0;
+    n = (len - 1) / 5;
+    if (len < 1 || (len - 1) % 5 || n > WATCH_SLOTS)
+        return 0;
+    for (i = 0, s = p + 1; i < n; i++, s += 5) {
+        addr = s[0] | (uint32_t)s[1] << 8 | (uint32_t)s[2] << 16 | (uint32_t)s[3] << 24;
+        size = s[4];
+        if ((size != 1 && size != 2 && size != 4) || !ram_isStatic(addr, size)) {
+            watchSampleLen = 0;
+            return 0;
+        }
+        watchAddr[i] = (uint8_t *)(size_t)addr;
+        watchSize[i] = size;
+        watchSampleLen += size;
+    }
+    watchSlots = n;
+    watchDivider = n ? p[0] : 0;
+    return n;
 }
 
-static uint8_t ADXL_GetAccelValues(void)
+// end of loop(), at most WATCH_SLOTS * 4 bytes copied
+void watchSample(void)
 {
-    volatile uint8_t i;
-
-    ADXL_ON;
-    spi_writeByte(ADXL_X0_ADDR | ADXL_MULTI_BIT | ADXL_READ_BIT);
-    for (i = 0; i < 3; i++) {
-        uint8_t i1, i2;
-        i1 = spi_readByte();
-        i2 = spi_readByte();
+    uint16_t head = watchHead;
+    uint8_t i, k;
+    const uint8_t *v;
 
-#ifdef LOWPASS_ACC
-        // new result = 0.95 * previous_result + 0.05 * current_data
-        sensorInputs[i + 4] = ((sensorInputs[i + 4] * 19) / 20) + (((i1 | i2 << 8) * 5) / 100);
+    if (!watchDivider || ++watchCount < watchDivider)
+        return;
+    watchCount = 0;
+    if (WATCH_BUFFER - (uint16_t)(head - watchTail) < watchSampleLen) {
+        if (watchLost < 255)
+            watchLost++;
+        return;
+    }
+    for (i = 0; i < watchSlots; i++) {
+        v = watchAddr[i];
+        for (k = 0; k < watchSize[i]; k++)
+#if defined(WIRE_BIG_ENDIAN)
+            watchRing[head++ & (WATCH_BUFFER - 1)] = v[watchSize[i] - 1 - k];
 #else
-        sensorInputs[i + 4] += (i1 | i2 << 8);
+            watchRing[head++ & (WATCH_BUFFER - 1)] = v[k];
 #endif
     }
-
-    // skip over this register
-    spi_readByte();
-    // FIFO_STATUS register (last few bits = fifo remaining)
-    i = spi_readByte();
-    ADXL_OFF;
-
-    return i & 0x7F;            // return number of entires left in fifo
+    watchHead = head;
 }
 
-void ACC_init()
+void watchTask(void)
 {
-    // SPI ChipSelect for Accel
-    GPIO_Init(GPIOE, GPIO_PIN_5, GPIO_MODE_OUT_PP_HIGH_FAST);
-    ADXL_OFF;
-
-    delay(10);
-
-    // Accel INT1 input tied to interrupt (TODO). Input-only for now.
-    GPIO_Init(GPIOD, GPIO_PIN_0, GPIO_MODE_IN_FL_NO_IT);
+    uint16_t tail = watchTail;
+    uint8_t n, len, c, check;
 
-    // Initialize SPI Accelerometer
-    ADXL_Init();
-    acc_1G = 256;
+    if (!watchSampleLen)
+        return;
+    n = (uint16_t)(watchHead - tail) / watchSampleLen;
+    if (n > (WATCH_FRAME - 2) / watchSampleLen)
+        n = (WATCH_FRAME - 2) / watchSampleLen;
+    // lost samples are reported even with none to send
+    if ((!n && !watchLost) || teleBusy(n * watchSampleLen + 5))
+        return;
+    len = 2 + n * watchSampleLen;
+    teleReset();
+    telePut8(WATCH_SYNC);
+    telePut8(len);
+    telePut8(watchSeq);
+    telePut8(watchLost);
+    check = len ^ watchSeq ^ watchLost;
+    watchSeq++;
+    watchLost = 0;
+    for (len -= 2; len; len--) {
+        c = watchRing[tail++ & (WATCH_BUFFER - 1)];
+        telePut8(c);
+        check ^= c;
+    }
+    telePut8(check);
+    teleCommit();
+    watchTail = tail;
 }
-
-void ACC_getADC()
-{
-    uint8_t count = 0;
-    uint8_t remaining = 0;
-    uint8_t i = 0;
-
-    // Next up is accel fifo + avg
-    do {
-        count++;
-        remaining = ADXL_GetAccelValues();
-    } while ((count < 32) && (remaining > 0));
-
-    count++;
-
-#ifdef LOWPASS_ACC
-    // commit current values to acc[]
-#else
-    // accel + average
-    sensorInputs[4] = sensorInputs[4] / count;
-    sensorInputs[5] = sensorInputs[5] / count;
-    sensorInputs[6] = sensorInputs[6] / count;
 #endif
 
-    ACC_ORIENTATION(sensorInputs[4], sensorInputs[5], sensorInputs[6]);
-    ACC_Common();
-}
+#if defined(SENSOR_NODE) || defined(SENSOR_LINK)
+// ************************************************************************************************************
+// Sensor coprocessor
+// ************************************************************************************************************
+// The sensor node sends one packet per loop, right after computeIMU(), in place of the PID and the motors.
+// The flight node's computeIMU() waits for it where the gyro read was, its loop runs at the node's rate:
+//   0xA9, len, seq, gyro sample time, gyroData[3], accSmooth[3], angle[2], heading, flags, xor of len..flags
+// The node's micros() stamps give the flight node its cycleTime, seq the packets lost in between. GUI replies
+// share the node's UART, the flight node's parser skips them.
+#define SENSOR_SYNC         0xA9
+#define SENSOR_SMALL_ANGLE  1           // smallAngle25
+#define SENSOR_CALIBRATING  2           // calibratingG or calibratingA still counting on the node
+
+#ifdef _MSC_VER
+#pragma pack(push, 1)
+#endif
+typedef struct WIRE_PACKED sensorPacket_t {
+    uint8_t sync;                       // SENSOR_SYNC
+    uint8_t len;                        // seq..flags
+    uint8_t seq;
+    uint32_t time;                      // node micros() of the gyro sample
+    uint16_t gyro[3];                   // gyroData
+    uint16_t acc[3];                    // accSmooth
+    uint16_t angle[2];                  // 0.1 deg
+    uint16_t heading;
+    uint8_t flags;
+    uint8_t check;
+} sensorPacket_t;
+#ifdef _MSC_VER
+#pragma pack(pop)
+#endif
 #endif
 
-#if defined(MPU6000SPI)
-static uint8_t mpuInitialized = 0;
-#define MPU_OFF            GPIO_WriteHigh(GPIOB, GPIO_PIN_2);
-#define MPU_ON             GPIO_WriteLow(GPIOB, GPIO_PIN_2);
-
-#define MPUREG_WHOAMI               0x75
-#define MPUREG_SMPLRT_DIV           0x19
-#define MPUREG_CONFIG               0x1A
-#define MPUREG_GYRO_CONFIG          0x1B
-#define MPUREG_ACCEL_CONFIG         0x1C
-#define MPUREG_I2C_MST_CTRL         0x24
-#define MPUREG_I2C_SLV0_ADDR        0x25
-#define MPUREG_I2C_SLV0_REG         0x26
-#define MPUREG_I2C_SLV0_CTRL        0x27
-#define MPUREG_I2C_SLV4_ADDR        0x31
-#define MPUREG_I2C_SLV4_REG         0x32
-#define MPUREG_I2C_SLV4_DO          0x33
-#define MPUREG_I2C_SLV4_CTRL        0x34
-#define MPUREG_I2C_SLV4_DI          0x35
-#define MPUREG_I2C_MST_STATUS       0x36
-#define MPUREG_INT_PIN_CFG          0x37
-#define MPUREG_INT_ENABLE           0x38 
-#define MPUREG_ACCEL_XOUT_H         0x3B
-#define MPUREG_ACCEL_XOUT_L         0x3C
-#define MPUREG_ACCEL_YOUT_H         0x3D
-#define MPUREG_ACCEL_YOUT_L         0x3E
-#define MPUREG_ACCEL_ZOUT_H         0x3F
-#define MPUREG_ACCEL_ZOUT_L         0x40
-#define MPUREG_TEMP_OUT_H           0x41
-#define MPUREG_TEMP_OUT_L           0x42
-#define MPUREG_GYRO_XOUT_H          0x43
-#define MPUREG_GYRO_XOUT_L          0x44
-#define MPUREG_GYRO_YOUT_H          0x45
-#define MPUREG_GYRO_YOUT_L          0x46
-#define MPUREG_GYRO_ZOUT_H          0x47
-#define MPUREG_GYRO_ZOUT_L          0x48
-#define MPUREG_EXT_SENS_DATA_00     0x49 // Registers 0x49 to 0x60 - External Sensor Data
-#define MPUREG_I2C_SLV0_DO          0x63 // This register holds the output data written into Slave 0 when Slave 0 is set to write mode.
-#define MPUREG_I2C_MST_DELAY_CTRL   0x67 // I2C Master Delay Control
-#define MPUREG_USER_CTRL            0x6A
-#define MPUREG_PWR_MGMT_1           0x6B
-#define MPUREG_PWR_MGMT_2           0x6C
-
-// Configuration bits MPU 6000
-#define BIT_SLEEP                   0x40
-#define BIT_H_RESET                 0x80
-#define BITS_CLKSEL                 0x07
-#define MPU_CLK_SEL_PLLGYROX        0x01
-#define MPU_CLK_SEL_PLLGYROZ        0x03
-#define MPU_EXT_SYNC_GYROX          0x02
-#define BITS_AFS_2G                 0x00
-#define BITS_AFS_4G                 0x08
-#define BITS_AFS_8G                 0x10
-#define BITS_AFS_16G                0x18
-#define BITS_FS_250DPS              0x00
-#define BITS_FS_500DPS              0x08
-#define BITS_FS_1000DPS             0x10
-#define BITS_FS_2000DPS             0x18
-#define BITS_FS_MASK                0x18
-#define BITS_DLPF_CFG_256HZ_NOLPF2  0x00
-#define BITS_DLPF_CFG_188HZ         0x01
-#define BITS_DLPF_CFG_98HZ          0x02
-#define BITS_DLPF_CFG_42HZ          0x03
-#define BITS_DLPF_CFG_20HZ          0x04
-#define BITS_DLPF_CFG_10HZ          0x05
-#define BITS_DLPF_CFG_5HZ           0x06
-#define BITS_DLPF_CFG_2100HZ_NOLPF  0x07
-#define BITS_DLPF_CFG_MASK          0x07
-#define BIT_INT_ANYRD_2CLEAR        0x10
-#define BIT_RAW_RDY_EN              0x01
-#define BIT_I2C_IF_DIS              0x10
-#define BIT_I2C_SLV0_EN             0x80
-
-static uint8_t MPU6000_Buffer[14 + 6];   // Sensor data ACCXYZ|TEMP|GYROXYZ | Magnetometer data
+#if defined(SENSOR_NODE)
+static uint8_t sensorSeq = 0;
+static uint16_t sensorSkipped = 0;      // packets the busy UART didn't take, the flight node sees them lost
 
-static uint8_t MPU6000_ReadReg(uint8_t Address)
+void sensorNodeSend(void)
 {
-    uint8_t rv;
-    MPU_ON;
-    spi_writeByte(Address | 0x80); // Address with high bit set = Read operation
-    rv = spi_readByte();
-    MPU_OFF;
-    return rv;
+    sensorPacket_t *p;
+    const uint8_t *b;
+    uint8_t i, check = 0;
+
+    sensorSeq++;
+    if (Serial_isTxBusy()) {
+        sensorSkipped++;
+        return;
+    }
+    Serial_reset();
+    p = Serial_reserve(sizeof(sensorPacket_t));
+    if (!p) {
+        sensorSkipped++;
+        return;
+    }
+    attitudeAngles();
+    attitudeHeading();
+    p->sync = SENSOR_SYNC;
+    p->len = sizeof(sensorPacket_t) - 3;
+    p->seq = sensorSeq;
+#if defined(GYRO_DRDY)
+    p->time = WIRE32(gyroSampleTime);
+#else
+    p->time = WIRE32(currentTime);      // the last gyro read ended computeIMU()
+#endif
+    for (i = 0; i < 3; i++) {
+        p->gyro[i] = WIRE16(GYRO_LEGACY(gyroData[i]));
+        p->acc[i] = WIRE16(accSmooth[i]);
+    }
+    p->angle[ROLL] = WIRE16(angle[ROLL]);
+    p->angle[PITCH] = WIRE16(angle[PITCH]);
+    p->heading = WIRE16(heading);
+    p->flags = (smallAngle25 ? SENSOR_SMALL_ANGLE : 0) | (calibratingG || calibratingA ? SENSOR_CALIBRATING : 0);
+    for (b = &p->len; b < &p->check; b++)
+        check ^= *b;
+    p->check = check;
+    Serial_commitBuffer();
 }
+#endif
 
-static void MPU6000_getSixRawADC(void)
+#if defined(SENSOR_LINK)
+#define SENSOR_LINK_WAIT    5000        // us computeIMU() waits for a packet
+#define SENSOR_LINK_TIMEOUT 20000       // us from the last packet to the link down
+
+static uint8_t sensorRx[sizeof(sensorPacket_t)];
+static uint8_t sensorRxLen = 0;
+static uint8_t sensorSeq;
+static uint32_t sensorNodeTime;         // stamp of the last packet
+static uint32_t sensorLinkTime = 0;     // micros() it came in, 0 before the first
+static uint16_t sensorLinkLost = 0;     // by seq
+static uint16_t sensorLinkErrors = 0;   // bad check or len
+static uint16_t sensorLinkMisses = 0;   // loops that waited SENSOR_LINK_WAIT for nothing
+
+// one byte off the GPS port, 1 when it completes a good packet in sensorRx
+static uint8_t sensorLinkParse(uint8_t c)
 {
-    uint8_t i;
-    MPU_ON;
-    spi_writeByte(MPUREG_ACCEL_XOUT_H | 0x80); // Address with high bit set = Read operation
-    // ACC X, Y, Z, TEMP, GYRO X, Y, Z, MagData[6]
-    for (i = 0; i < 14 + 6; i++)
-        MPU6000_Buffer[i] = spi_readByte();
-    MPU_OFF;
+    uint8_t i, check = 0;
+
+    if (sensorRxLen == 0 && c != SENSOR_SYNC)
+        return 0;
+    if (sensorRxLen == 1 && c != sizeof(sensorPacket_t) - 3) {
+        sensorRxLen = c == SENSOR_SYNC;
+        return 0;
+    }
+    sensorRx[sensorRxLen++] = c;
+    if (sensorRxLen < sizeof(sensorPacket_t))
+        return 0;
+    sensorRxLen = 0;
+    for (i = 1; i < sizeof(sensorPacket_t) - 1; i++)
+        check ^= sensorRx[i];
+    if (check != ((const sensorPacket_t *)sensorRx)->check) {
+        sensorLinkErrors++;
+        return 0;
+    }
+    return 1;
 }
 
-static void MPU6000_WriteReg(uint8_t Address, uint8_t Data)
-{ 
-    MPU_ON;
-    spi_writeByte(Address); 
-    spi_writeByte(Data);
-    MPU_OFF;
-    delay(1);
+static void sensorLinkApply(void)
+{
+    const sensorPacket_t *p = (const sensorPacket_t *)sensorRx;
+    uint32_t t = WIRE32(p->time), dt = t - sensorNodeTime;
+    uint8_t axis;
+
+    if (sensorLinkTime) {
+        sensorLinkLost += (uint8_t)(p->seq - sensorSeq - 1);
+        sensorLinkDt = dt < SENSOR_LINK_TIMEOUT ? dt : 0;
+    }
+    sensorSeq = p->seq;
+    sensorNodeTime = t;
+    sensorLinkTime = micros();
+    for (axis = 0; axis < 3; axis++) {
+        gyroData[axis] = WIRE16(p->gyro[axis]) * GYRO_FINE;
+        accSmooth[axis] = WIRE16(p->acc[axis]);
+    }
+    angle[ROLL] = WIRE16(p->angle[ROLL]);
+    angle[PITCH] = WIRE16(p->angle[PITCH]);
+    heading = WIRE16(p->heading);
+    smallAngle25 = (p->flags & SENSOR_SMALL_ANGLE) != 0;
+    // arming waits for the node's calibration, the stick calibrations have nothing to do here
+    calibratingG = (p->flags & SENSOR_CALIBRATING) != 0;
+    calibratingA = 0;
 }
 
-void MPU6000_init(void)
+void computeIMU()
 {
-    // SPI ChipSelect for MPU-6000
-    GPIO_Init(GPIOB, GPIO_PIN_2, GPIO_MODE_OUT_PP_HIGH_FAST);
-    MPU_OFF;
+    static int16_t gyroYawSmooth = 0;
+    uint32_t t;
+    uint8_t axis, got = 0;
+
+    PROFILE_BEGIN(annexCode);
+    annexCode();
+    PROFILE_END(annexCode);
+#if defined(LATENCY_BENCH)
+    latAnnexTime = micros();
+#endif
+    // the newest packet wins, one still on the way is waited for like the gyro's data ready
+    t = micros();
+    do {
+        while (gpsSerial_available())
+            if (sensorLinkParse(gpsSerial_read())) {
+                sensorLinkApply();
+                got = 1;
+            }
+    } while (!got && micros() - t < SENSOR_LINK_WAIT);
+    if (!got) {
+        sensorLinkMisses++;
+        if (!sensorLinkTime || micros() - sensorLinkTime > SENSOR_LINK_TIMEOUT) {
+            for (axis = 0; axis < 3; axis++)
+                gyroData[axis] = 0;
+            sensorLinkDt = 0;
+            calibratingG = 1;           // no arming, the LED blinks
+        }
+    }
 
-    // MPU-6000 input tied to interrupt (TODO). Input-only for now.
-    GPIO_Init(GPIOB, GPIO_PIN_3, GPIO_MODE_IN_FL_NO_IT);
+    if (FRAME == MULTITYPE_TRI) {
+        gyroData[YAW] = ((int32_t)gyroYawSmooth * 2 + gyroData[YAW] + 1) / 3;
+        gyroYawSmooth = gyroData[YAW];
+    }
+}
+#endif
 
-    MPU6000_WriteReg(MPUREG_PWR_MGMT_1, BIT_H_RESET);
-    delay(100);
-    MPU6000_WriteReg(MPUREG_PWR_MGMT_1, MPU_CLK_SEL_PLLGYROZ);      // Set PLL source to gyro output
-    MPU6000_WriteReg(MPUREG_USER_CTRL, 0b00110000);                 // I2C_MST_EN
-    // MPU6000_WriteReg(MPUREG_USER_CTRL, BIT_I2C_IF_DIS);             // Disable I2C bus
-    MPU6000_WriteReg(MPUREG_SMPLRT_DIV, 0x04);                      // Sample rate = 200Hz    Fsample = 1Khz / (4 + 1) = 200Hz   
-    MPU6000_WriteReg(MPUREG_CONFIG, 0); // BITS_DLPF_CFG_42HZ);            // Fs & DLPF Fs = 1kHz, DLPF = 42Hz (low pass filter)
-    MPU6000_WriteReg(MPUREG_GYRO_CONFIG, BITS_FS_2000DPS);          // Gyro scale 2000/s
-    MPU6000_WriteReg(MPUREG_ACCEL_CONFIG, BITS_AFS_4G);             // Accel scale 4G
-    MPU6000_WriteReg(MPUREG_INT_ENABLE, BIT_RAW_RDY_EN);            // INT: Raw data ready
-    MPU6000_WriteReg(MPUREG_INT_PIN_CFG, BIT_INT_ANYRD_2CLEAR);     // INT: Clear on any read
+#if defined(SYSID)
+// ************************************************************************************************************
+// System identification
+// ************************************************************************************************************
+// The 'e' command starts an excitation of one axis while armed: a sine chirp sweeping f0..f1 linearly, or a
+// square wave of f0 (a train of steps), added to axisPID[axis] between the PID and mixTable() for the
+// duration. Moving that stick past SYSID_ABORT, disarming or a failsafe ends it early. The blackbox logs an
+// 'X' record at the start and an 'S' record every loop while it runs, blackbox_decode.c sysid works out the
+// plant response from the injection, the command and the gyro.
+#define SYSID_ABORT         50          // rcCommand
+#define SYSID_FREQ_MAX      5000        // 0.1Hz
+
+enum { SYSID_OFF = 0, SYSID_STEP, SYSID_CHIRP };
+
+static uint8_t sysidKind = SYSID_OFF, sysidAxis, sysidAmp, sysidLen;   // len in 0.1s
+static uint16_t sysidF0, sysidF1;       // 0.1Hz
+static uint8_t sysidStarted = 0;        // for blackboxLog(), the 'X' record is due
+static uint32_t sysidStart, sysidPhase; // phase in 2^-24 cycles
+static int16_t sysidOut;
+
+static void sysidSet(const uint8_t *p)
+{
+    sysidKind = SYSID_OFF;
+    if (!armed || p[0] > YAW || p[1] > SYSID_CHIRP)
+        return;
+    sysidAxis = p[0];
+    sysidAmp = p[2];
+    sysidF0 = min(p[3] | p[4] << 8, SYSID_FREQ_MAX);
+    sysidF1 = min(p[5] | p[6] << 8, SYSID_FREQ_MAX);
+    sysidLen = p[7];
+    sysidPhase = 0;
+    sysidStart = currentTime;
+    sysidStarted = 1;
+    sysidKind = p[1];
+}
 
-    mpuInitialized = 1;
+// after pidCompute(), once per loop
+void sysidInject(void)
+{
+    uint32_t ms, x;
+    uint16_t f, a;
+
+    if (sysidKind == SYSID_OFF)
+        return;
+    ms = (currentTime - sysidStart) / 1000;
+    if (!armed || failsafeStage != FAILSAFE_NONE || abs(rcCommand[sysidAxis]) > SYSID_ABORT || ms >= sysidLen * 100UL) {
+        sysidKind = SYSID_OFF;
+        return;
+    }
+    f = sysidF0;
+    if (sysidKind == SYSID_CHIRP)
+        f += ((int32_t)sysidF1 - sysidF0) * (int32_t)ms / (sysidLen * 100);
+    // f [0.1Hz] * cycleTime [us] is 1e-7 cycles, * 1.6777 in 2^-24 cycles
+    x = (uint32_t)f * cycleTime;
+    sysidPhase += x + ((x >> 6) * 694 >> 4);
+    a = ((sysidPhase >> 12) & 0xFFF) * 3600UL >> 12;           // 0.1 deg
+    if (sysidKind == SYSID_CHIRP)
+        sysidOut = ((int32_t)sin_dd(a) * sysidAmp + (1 << 13)) >> 14;
+    else
+        sysidOut = a < 1800 ? sysidAmp : -sysidAmp;
+    axisPID[sysidAxis] += sysidOut;
 }
+#endif
+
+#if defined(BLACKBOX)
+// ************************************************************************************************************
+// Blackbox flight recorder
+// ************************************************************************************************************
+// While armed every BLACKBOX'th loop is encoded into a RAM ring, blackboxTask() drains the ring over the
+// serial link (the USB log interface on the STM32) in checksummed chunks shaped like the stream frames:
+//   0xB8, len, payload[len], xor of len..last payload byte
+// and the payloads concatenated are the log. A log is one 'H' record, then 'I'/'P' records with the odd 'O'
+// among them, then 'E' at disarm. All numbers are varints (7 bits per byte, low first, bit 7 set on all but the last byte), signed
+// ones zigzag coded (0, -1, 1, -2 .. as 0, 1, 2, 3 ..):
+//   'H' version (4), field count, numberMotor, BLACKBOX, acc_1G, PID_REF_CYCLE
+//   'I' time us, then every field as a signed value
+//   'P' time since the previous record, then every field as a signed delta to the previous record
+//   'O' a loop past LOOP_OVERRUN: its cycleTime, the slowest task index in it or TASK_NONE. Not a time step
+//   'X' SYSID excitation start: axis, kind (1 step, 2 chirp), amplitude, f0, f1 in 0.1Hz, duration in 0.1s
+//   'S' SYSID sample of every loop the excitation runs, instead of 'I'/'P': time since the previous record,
+//       then the injection, axisPID[axis] with it and gyroData[axis] as signed values
+//   'C' CAMTRIG shot: its number since startup, micros() of the shutter edge. Not a time step
+//   'E' records dropped because the ring was full
+// The fields: gyroData[3], accADC[3], P[3], I[3], D[3] of the rate PID, motor[numberMotor], rcCommand[4].
+// An 'I' record follows every BLACKBOX_I_INTERVAL records and every drop, so a decoder can pick up again.
+#define BLACKBOX_SYNC           0xB8
+#define BLACKBOX_I_INTERVAL     32
+#define BLACKBOX_CHUNK          96              // payload bytes per serial frame
+#define BLACKBOX_FIELDS_MAX     (15 + 8 + 4)
+#if defined(BLACKBOX_SD)
+#define BLACKBOX_BUFFER         16384           // 32 card sectors
+#elif defined(STM8) || defined(ATMEGA)
+#define BLACKBOX_BUFFER         256             // power of 2
+#else
+#define BLACKBOX_BUFFER         2048
+#endif
 
-void ACC_init()
+#if defined(BLACKBOX_SD)
+static uint32_t bbRingWords[BLACKBOX_BUFFER / 4];       // the card DMA takes whole sectors from it in place
+#define bbRing                  ((uint8_t *)bbRingWords)
+#else
+static uint8_t bbRing[BLACKBOX_BUFFER];
+#endif
+static uint16_t bbHead = 0, bbTail = 0;         // head written by blackboxLog(), tail by blackboxTask()
+static uint8_t bbRecord[1 + 5 + BLACKBOX_FIELDS_MAX * 3];
+static int16_t bbPrev[BLACKBOX_FIELDS_MAX];
+static uint32_t bbPrevTime;
+static uint16_t bbDropped;
+static uint8_t bbLogging = 0, bbDivider = 0, bbSinceI = 0;
+
+static uint8_t *bbPutU(uint8_t *p, uint32_t v)
 {
-    if (!mpuInitialized)
-        MPU6000_init();
-        
-    acc_1G = 256;
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
 }
 
-void ACC_getADC()
+static uint8_t *bbPutS(uint8_t *p, int32_t v)
 {
-    MPU6000_getSixRawADC();
-    ACC_ORIENTATION(-(MPU6000_Buffer[0] << 8 | MPU6000_Buffer[1]) / 16, -(MPU6000_Buffer[2] << 8 | MPU6000_Buffer[3]) / 16, (MPU6000_Buffer[4] << 8 | MPU6000_Buffer[5]) / 16);
-    ACC_Common();
+    return bbPutU(p, ((uint32_t) v << 1) ^ (uint32_t)(v >> 31));
 }
 
-void Gyro_init(void)
+// the whole record or nothing
+static uint8_t bbQueue(const uint8_t *rec, uint8_t len)
 {
-    if (!mpuInitialized)
-        MPU6000_init();
+    uint8_t i;
+
+    if (BLACKBOX_BUFFER - 1 - ((bbHead - bbTail) & (BLACKBOX_BUFFER - 1)) < len)
+        return 0;
+    for (i = 0; i < len; i++) {
+        bbRing[bbHead] = rec[i];
+        bbHead = (bbHead + 1) & (BLACKBOX_BUFFER - 1);
+    }
+    return 1;
 }
 
-void Gyro_getADC(void)
+static uint8_t bbFields(int16_t *f)
 {
-    // range: +/- 8192; +/- 2000 deg/sec
-    MPU6000_getSixRawADC();
-    GYRO_ORIENTATION((((MPU6000_Buffer[10] << 8) | MPU6000_Buffer[11]) / 4), -(((MPU6000_Buffer[8] << 8) | MPU6000_Buffer[9]) / 4), -(((MPU6000_Buffer[12] << 8) | MPU6000_Buffer[13]) / 4));
-    GYRO_Common();
+    uint8_t axis, i, n = 0;
+
+    for (axis = 0; axis < 3; axis++)
+        f[n++] = GYRO_LEGACY(gyroData[axis]);
+    for (axis = 0; axis < 3; axis++)
+        f[n++] = accADC[axis];
+    for (axis = 0; axis < 3; axis++)
+        f[n++] = pidState[axis].P;
+    for (axis = 0; axis < 3; axis++)
+        f[n++] = pidState[axis].I;
+    for (axis = 0; axis < 3; axis++)
+        f[n++] = pidState[axis].D;
+    for (i = 0; i < FRAME_MOTORS; i++)
+        f[n++] = motor[i];
+    for (i = 0; i < 4; i++)
+        f[n++] = rcCommand[i];
+    return n;
 }
 
-#define HMC5883L_I2C_ADDRESS        0x1e
-#define HMC5883L_ID_REG_A           0x0a
-#define HMC5883L_ID_REG_B           0x0b
-#define HMC5883L_ID_REG_C           0x0c
-#define HMC5883L_MODE_REG           0x02
-#define HMC5883L_DATA_OUTPUT_X      0x03
+// end of loop(), after the motors are written
+void blackboxLog(void)
+{
+    int16_t f[BLACKBOX_FIELDS_MAX];
+    uint8_t *p = bbRecord;
+    uint8_t i, n;
+
+    if (!armed) {
+        if (bbLogging) {
+            *p++ = 'E';
+            p = bbPutU(p, bbDropped);
+            bbLogging = !bbQueue(bbRecord, p - bbRecord);  // try again on the next loop if it didn't fit
+        }
+        return;
+    }
+    if (!bbLogging) {
+        *p++ = 'H';
+        p = bbPutU(p, 4);
+        p = bbPutU(p, 15 + numberMotor + 4);
+        p = bbPutU(p, numberMotor);
+        p = bbPutU(p, BLACKBOX);
+        p = bbPutU(p, acc_1G);
+        p = bbPutU(p, PID_REF_CYCLE);
+        if (!bbQueue(bbRecord, p - bbRecord))
+            return;
+        bbLogging = 1;
+        bbDropped = 0;
+        bbDivider = 0;
+        bbSinceI = BLACKBOX_I_INTERVAL;
+        p = bbRecord;
+    }
+#if defined(SYSID)
+    if (sysidStarted) {
+        *p++ = 'X';
+        p = bbPutU(p, sysidAxis);
+        p = bbPutU(p, sysidKind);
+        p = bbPutU(p, sysidAmp);
+        p = bbPutU(p, sysidF0);
+        p = bbPutU(p, sysidF1);
+        p = bbPutU(p, sysidLen);
+        if (!bbQueue(bbRecord, p - bbRecord))
+            return;                     // no samples before it, the next loop tries again
+        sysidStarted = 0;
+        p = bbRecord;
+    }
+    if (sysidKind != SYSID_OFF) {
+        *p++ = 'S';
+        p = bbPutU(p, currentTime - bbPrevTime);
+        p = bbPutS(p, sysidOut);
+        p = bbPutS(p, axisPID[sysidAxis]);
+        p = bbPutS(p, GYRO_LEGACY(gyroData[sysidAxis]));
+        if (bbQueue(bbRecord, p - bbRecord))
+            bbPrevTime = currentTime;
+        else if (bbDropped < 0xFFFF)
+            bbDropped++;
+        bbSinceI = BLACKBOX_I_INTERVAL;     // the fields go on from an 'I' afterwards
+        return;
+    }
+#endif
+    if (++bbDivider < BLACKBOX)
+        return;
+    bbDivider = 0;
+
+    n = bbFields(f);
+    if (bbSinceI >= BLACKBOX_I_INTERVAL) {
+        *p++ = 'I';
+        p = bbPutU(p, currentTime);
+        for (i = 0; i < n; i++)
+            p = bbPutS(p, f[i]);
+    } else {
+        *p++ = 'P';
+        p = bbPutU(p, currentTime - bbPrevTime);
+        for (i = 0; i < n; i++)
+            p = bbPutS(p, (int32_t) f[i] - bbPrev[i]);
+    }
+    if (!bbQueue(bbRecord, p - bbRecord)) {
+        if (bbDropped < 0xFFFF)
+            bbDropped++;
+        bbSinceI = BLACKBOX_I_INTERVAL;     // the next record can't be a delta to this one
+        return;
+    }
+    bbSinceI = bbRecord[0] == 'I' ? 1 : bbSinceI + 1;
+    bbPrevTime = currentTime;
+    for (i = 0; i < n; i++)
+        bbPrev[i] = f[i];
+}
 
-void Mag_init(void)
+// from loopDeadline(), ahead of the record of the same loop
+void blackboxOverrun(uint8_t task, uint16_t us)
 {
-    volatile uint8_t i, temp;
-    
-    // Initialize compass for continous measurement mode
-    MPU6000_WriteReg(MPUREG_I2C_MST_CTRL, 0b01000000 | 13); // WAIT_FOR_ES=1, I2C Master Clock Speed 400kHz
-    MPU6000_WriteReg(MPUREG_I2C_SLV4_ADDR, HMC5883L_I2C_ADDRESS); // Write to 5883
-    MPU6000_WriteReg(MPUREG_I2C_SLV4_REG, HMC5883L_MODE_REG);
-    MPU6000_WriteReg(MPUREG_I2C_SLV4_DO, 0x00); // Mode register  --  value: Continuous-Conversion Mode
-    MPU6000_WriteReg(MPUREG_I2C_SLV4_CTRL, 0b11000000); // I2C_SLV4_EN | I2C_SLV4_INT_EN
-    delay(1);
+    uint8_t rec[1 + 3 + 2], *p = rec;
+
+    if (!bbLogging)
+        return;
+    *p++ = 'O';
+    p = bbPutU(p, us);
+    p = bbPutU(p, task);
+    bbQueue(rec, p - rec);              // lost with a full ring, the records around it are counted in 'E'
+}
 
-    // temp = MPU6000_ReadReg(MPUREG_I2C_MST_STATUS);
-    // temp = MPU6000_ReadReg(MPUREG_I2C_SLV4_DI);
+void blackboxCamera(uint16_t shot, uint32_t edge)
+{
+    uint8_t rec[1 + 3 + 5], *p = rec;
 
-    // Prepare I2C Slave 0 for reading out mag data
-    MPU6000_WriteReg(MPUREG_I2C_SLV0_ADDR, 0x80 | HMC5883L_I2C_ADDRESS); // Read from 5883
-    MPU6000_WriteReg(MPUREG_I2C_SLV0_REG, HMC5883L_DATA_OUTPUT_X);
-    MPU6000_WriteReg(MPUREG_I2C_SLV0_CTRL, 0b10000110); // I2C_SLV0_EN | 6 bytes from mag
-    delay(1);
+    if (!bbLogging)
+        return;
+    *p++ = 'C';
+    p = bbPutU(p, shot);
+    p = bbPutU(p, edge);
+    bbQueue(rec, p - rec);
 }
 
-void Device_Mag_getADC(void)
+#if defined(BLACKBOX_SD)
+// With BLACKBOX_SD the log goes to BLACKBOX.BIN in the root directory of a FAT32 card instead of the serial link.
+// The file is found once at boot and has to be one run of clusters already, nothing is allocated here: the records
+// go into its sectors in order, whole sectors straight off the ring tail, up to SD_BATCH of them per multi-block
+// write. Once a log has ended its last partial sector is written too, and stays at the ring tail for the next log
+// to go on filling, then the new length goes into the directory entry, the only FAT work there is. So the logs
+// follow each other in the file, read it with blackbox_decode -r. A file that doesn't start with 'H' is new and
+// counts as empty. The length is only written at disarm: after a power cut the next log starts over that flight.
+#define SD_SECTOR               512
+#define SD_BATCH                16              // sectors per write at most
+#define SD_FAT_EOC              0x0FFFFFF8
+
+static struct {
+    uint32_t start;                     // first sector of the file
+    uint32_t sectors;                   // in its first run of clusters, 0 without a card or file
+    uint32_t tail;                      // file offset of the ring tail, whole sectors
+    uint32_t length;                    // as in the directory entry
+    uint32_t closing;                   // the length being written
+    uint32_t dirSector;                 // with the entry
+    uint32_t inBuf;                     // sector in buf at boot, 0 for none
+    uint16_t dirOffset;
+    uint16_t writing;                   // bytes of the write in flight
+    uint16_t errors;                    // sdcard_errors() at the directory read
+    uint16_t full;                      // sectors dropped with the file full
+    pt_t pt;                            // sdThread()
+    uint32_t buf[SD_SECTOR / 4];        // boot sector, FAT and directory
+} sdLog;
+
+#define sdUsed()                ((uint16_t)((bbHead - bbTail) & (BLACKBOX_BUFFER - 1)))
+#define sdEnd()                 min(sdLog.tail + sdUsed(), sdLog.sectors * SD_SECTOR)
+
+static uint16_t sdGet16(const uint8_t *p)
 {
-    MAG_ORIENTATION( ((MPU6000_Buffer[18] << 8) | MPU6000_Buffer[19]),  ((MPU6000_Buffer[14] << 8) | MPU6000_Buffer[15]),   ((MPU6000_Buffer[16] << 8) | MPU6000_Buffer[17])    );
+    return p[0] | p[1] << 8;
 }
-#endif /* MPU6000SPI */
 
-// ************************************************************************************************************
-// contribution initially from opie11 (rc-groups)
-// adaptation from C2po (may 2011)
-// contribution from ziss_dm (June 2011)
-// contribution from ToLuSe (Jully 2011)
-// I2C Accelerometer BMA180
-// ************************************************************************************************************
-// I2C adress: 0x80 (8bit)    0x40 (7bit) (SDO connection to VCC) 
-// I2C adress: 0x82 (8bit)    0x41 (7bit) (SDO connection to VDDIO)
-// Resolution: 14bit
-//
-// Control registers:
-//
-// 0x20    bw_tcs:   |                                           bw<3:0> |                        tcs<3:0> |
-//                   |                                             150Hz |                 !!Calibration!! |
-// ************************************************************************************************************
-#if defined(BMA180)
-void ACC_init()
+static uint32_t sdGet32(const uint8_t *p)
 {
-    uint8_t control;
-    
-    delay(10);
-    //default range 2G: 1G = 4096 unit.
-    i2c_writeReg(BMA180_ADDRESS, 0x0D, 1 << 4); // register: ctrl_reg0  -- value: set bit ee_w to 1 to enable writing
-    delay(5);
-    control = i2c_readReg(BMA180_ADDRESS, 0x20);
-    control = control & 0x0F;   // register: bw_tcs reg: bits 4-7 to set bw -- value: set low pass filter to 10Hz (bits value = 0000xxxx)
-    control = control | 0x00;
-    i2c_writeReg(BMA180_ADDRESS, 0x20, control);
-    delay(5);
-    control = i2c_readReg(BMA180_ADDRESS, 0x30);
-    control = control & 0xFC;
-    control = control | 0x02;
-    i2c_writeReg(BMA180_ADDRESS, 0x30, control);
-    delay(5);
-    acc_1G = 512;
+    return sdGet16(p) | (uint32_t)sdGet16(p + 2) << 16;
 }
 
-void ACC_getADC()
+// waits, blackboxInit() only
+static uint8_t sdReadWait(uint32_t sector, uint8_t *buf)
 {
-#ifndef STM8
-    TWBR = ((16000000L / 400000L) - 16) / 2;    // Optional line.  Sensor is good for it in the spec.
-#endif
-    i2c_getSixRawADC(BMA180_ADDRESS, 0x02);
-    //usefull info is on the 14 bits  [2-15] bits  /4 => [0-13] bits  /8 => 11 bit resolution
-    ACC_ORIENTATION(-((rawADC[1] << 8) | rawADC[0]) / 32, -((rawADC[3] << 8) | rawADC[2]) / 32, ((rawADC[5] << 8) | rawADC[4]) / 32);
-    ACC_Common();
+    uint16_t errors = sdcard_errors();
+
+    sdLog.inBuf = 0;
+    sdcard_read(sector, buf, 1);
+    while (sdcard_busy())
+        ;
+    if (sdcard_errors() != errors)
+        return 0;
+    if (buf == (uint8_t *)sdLog.buf)
+        sdLog.inBuf = sector;
+    return 1;
 }
-#endif
 
-// ************************************************************************************************************
-// contribution from Point65 and mgros (rc-groups)
-// contribution from ziss_dm (June 2011)
-// contribution from ToLuSe (Jully 2011)
-// I2C Accelerometer BMA020
-// ************************************************************************************************************
-// I2C adress: 0x70 (8bit)
-// Resolution: 10bit
-// Control registers:
-//
-// Datasheet: After power on reset or soft reset it is recommended to set the SPI4-bit to the correct value.
-//            0x80 = SPI four-wire = Default setting
-// | 0x15: | SPI4 | enable_adv_INT | new_data_INT | latch_INT | shadow_dis | wake_up_pause<1:0> | wake_up |
-// |       |    1 |              0 |            0 |         0 |          0 |                 00 |       0 |
-//
-// | 0x14: |                       reserved <2:0> |            range <1:0> |               bandwith <2:0> |
-// |       |                      !!Calibration!! |                     2g |                         25Hz |
-//
-// ************************************************************************************************************
-#if defined(BMA020)
-void ACC_init()
+// the FAT entry of cluster, 0 if it can't be read
+static uint32_t sdFatNext(uint32_t fat, uint32_t cluster)
 {
-    uint8_t control;
+    uint8_t *b = (uint8_t *)sdLog.buf;
 
-    i2c_writeReg(0x70, 0x15, 0x80);
-    control = i2c_readReg(0x70, 0x14);
-    control = control & 0xE0;
-    control = control | (0x00 << 3);    //Range 2G 00
-    control = control | 0x00;   //Bandwidth 25 Hz 000
-    i2c_writeReg(0x70, 0x14, control);
-    acc_1G = 255;
+    if (sdLog.inBuf != fat + cluster / 128 && !sdReadWait(fat + cluster / 128, b))
+        return 0;
+    return sdGet32(b + (cluster % 128) * 4) & 0x0FFFFFFF;
 }
 
-void ACC_getADC()
+// finds the file in setup(), the card stays unused if anything doesn't fit
+void blackboxInit(void)
 {
-    i2c_getSixRawADC(0x70, 0x02);
-    ACC_ORIENTATION(((rawADC[1] << 8) | rawADC[0]) / 64, ((rawADC[3] << 8) | rawADC[2]) / 64, ((rawADC[5] << 8) | rawADC[4]) / 64);
-    ACC_Common();
+    uint8_t *b = (uint8_t *)sdLog.buf;
+    uint32_t lba = 0, fat, data, cluster, next, first = 0, length = 0, runs;
+    uint16_t e;
+    uint8_t perCluster, s, i;
+
+    if (!sdcard_init() || !sdReadWait(0, b) || sdGet16(b + 510) != 0xAA55)
+        return;
+    // the volume is the first FAT32 partition, or the whole card when sector 0 is its boot sector
+    if (memcmp(b + 82, "FAT32   ", 8)) {
+        for (i = 0; i < 4 && b[450 + 16 * i] != 0x0B && b[450 + 16 * i] != 0x0C; i++)
+            ;
+        if (i == 4)
+            return;
+        lba = sdGet32(b + 454 + 16 * i);
+        if (!sdReadWait(lba, b) || memcmp(b + 82, "FAT32   ", 8))
+            return;
+    }
+    if (sdGet16(b + 11) != SD_SECTOR || !b[13])
+        return;
+    perCluster = b[13];
+    fat = lba + sdGet16(b + 14);
+    data = fat + b[16] * sdGet32(b + 36);
+    cluster = sdGet32(b + 44);
+
+    while (!sdLog.dirSector) {
+        if (cluster < 2 || cluster >= SD_FAT_EOC)
+            return;
+        for (s = 0; s < perCluster && !sdLog.dirSector; s++) {
+            if (!sdReadWait(data + (cluster - 2) * perCluster + s, b))
+                return;
+            for (e = 0; e < SD_SECTOR; e += 32) {
+                if (!b[e])
+                    return;             // the end of the directory
+                if (!memcmp(b + e, "BLACKBOXBIN", 11) && !(b[e + 11] & 0x18)) {
+                    sdLog.dirSector = data + (cluster - 2) * perCluster + s;
+                    sdLog.dirOffset = e;
+                    first = (uint32_t)sdGet16(b + e + 20) << 16 | sdGet16(b + e + 26);
+                    length = sdGet32(b + e + 28);
+                    break;
+                }
+            }
+        }
+        if (!sdLog.dirSector)
+            cluster = sdFatNext(fat, cluster);
+    }
+    if (first < 2)
+        return;
+    for (runs = 1, cluster = first; (next = sdFatNext(fat, cluster)) == cluster + 1; runs++)
+        cluster = next;
+
+    sdLog.start = data + (first - 2) * perCluster;
+    length = min(length, runs * perCluster * SD_SECTOR);
+    if (!sdReadWait(sdLog.start, b))
+        return;
+    if (b[0] != 'H')
+        length = 0;
+    // a partial last sector goes back into the ring, the next log is appended to it
+    if ((length & (SD_SECTOR - 1)) && !sdReadWait(sdLog.start + length / SD_SECTOR, bbRing))
+        return;
+    bbHead = length & (SD_SECTOR - 1);
+    sdLog.tail = length - bbHead;
+    sdLog.length = length;
+    sdLog.sectors = runs * perCluster;
 }
-#endif
 
-// ************************************************************************************************************
-// standalone I2C Nunchuk
-// ************************************************************************************************************
-#if defined(NUNCHACK)
-void ACC_init()
+static uint8_t sdThread(void)
 {
-    i2c_writeReg(0xA4, 0xF0, 0x55);
-    i2c_writeReg(0xA4, 0xFB, 0x00);
-    delay(250);
-    acc_1G = 200;
+    pt_t *pt = &sdLog.pt;
+    uint8_t *b = (uint8_t *)sdLog.buf;
+    uint16_t n;
+
+    PT_BEGIN(pt);
+    for (;;) {
+        PT_WAIT_UNTIL(pt, sdUsed() >= SD_SECTOR || (!bbLogging && sdEnd() != sdLog.length));
+        if (sdUsed() >= SD_SECTOR) {
+            n = min(sdUsed() & ~(SD_SECTOR - 1), BLACKBOX_BUFFER - bbTail);
+            n = min(n, SD_BATCH * SD_SECTOR);
+            if (sdLog.tail >= sdLog.sectors * SD_SECTOR) {
+                sdLog.full += n / SD_SECTOR;    // the log is cut at the end of the file
+                bbTail = (bbTail + n) & (BLACKBOX_BUFFER - 1);
+                continue;
+            }
+            sdLog.writing = min(n, sdLog.sectors * SD_SECTOR - sdLog.tail);
+            sdcard_write(sdLog.start + sdLog.tail / SD_SECTOR, bbRing + bbTail, sdLog.writing / SD_SECTOR);
+            PT_WAIT_UNTIL(pt, !sdcard_busy());
+            bbTail = (bbTail + sdLog.writing) & (BLACKBOX_BUFFER - 1);
+            sdLog.tail += sdLog.writing;
+            continue;
+        }
+        // the log has ended: the partial sector, then the length
+        sdLog.closing = sdEnd();
+        if (sdLog.closing > sdLog.tail) {
+            sdcard_write(sdLog.start + sdLog.tail / SD_SECTOR, bbRing + bbTail, 1);
+            PT_WAIT_UNTIL(pt, !sdcard_busy());
+        }
+        sdLog.errors = sdcard_errors();
+        sdcard_read(sdLog.dirSector, b, 1);
+        PT_WAIT_UNTIL(pt, !sdcard_busy());
+        if (sdcard_errors() == sdLog.errors) {
+            b += sdLog.dirOffset + 28;
+            b[0] = sdLog.closing;
+            b[1] = sdLog.closing >> 8;
+            b[2] = sdLog.closing >> 16;
+            b[3] = sdLog.closing >> 24;
+            sdcard_write(sdLog.dirSector, (uint8_t *)sdLog.buf, 1);
+            PT_WAIT_UNTIL(pt, !sdcard_busy());
+        }
+        sdLog.length = sdLog.closing;   // not tried again if it failed
+    }
+    PT_END(pt);
 }
 
-void ACC_getADC(void)
+void blackboxTask(void)
 {
-    TWBR = ((16000000L / I2C_SPEED) - 16) / 2;  // change the I2C clock rate. !! you must check if the nunchuk is ok with this freq
-    i2c_getSixRawADC(0xA4, 0x00);
+    if (sdLog.sectors)
+        sdThread();
+}
+#else
+void blackboxTask(void)
+{
+    uint8_t len, c, check;
 
-    ACC_ORIENTATION(((rawADC[3] << 2) + ((rawADC[5] >> 4) & 0x2)), -((rawADC[2] << 2) + ((rawADC[5] >> 3) & 0x2)), (((rawADC[4] & 0xFE) << 2) + ((rawADC[5] >> 5) & 0x6)));
-    ACC_Common();
+    while (bbHead != bbTail) {
+        len = (bbHead - bbTail) & (BLACKBOX_BUFFER - 1);
+        if (len > BLACKBOX_CHUNK)
+            len = BLACKBOX_CHUNK;
+        if (teleBusy(len + 3))
+            break;
+        teleReset();
+        telePut8(BLACKBOX_SYNC);
+        telePut8(len);
+        check = len;
+        while (len--) {
+            c = bbRing[bbTail];
+            bbTail = (bbTail + 1) & (BLACKBOX_BUFFER - 1);
+            telePut8(c);
+            check ^= c;
+        }
+        telePut8(check);
+        teleCommit();
+    }
 }
 #endif
+#endif
 
-// ************************************************************************
-// LIS3LV02 I2C Accelerometer
-//contribution from adver (http://multiwii.com/forum/viewtopic.php?f=8&t=451)
-// ************************************************************************
-#if defined(LIS3LV02)
-#define LIS3A  0x3A             // I2C adress: 0x3A (8bit)
+/* SERIAL ---------------------------------------------------------------- */
+// GUI link rate. Every link starts at serialSpeeds[0] (SERIAL_COM_SPEED), 'K' moves it to one of the faster ones
+// the UART can do: acknowledged at the old rate, switched once that is out. The first checksummed frame at the
+// new rate confirms it and it is stored as serialSpeed, the rate the next boot starts at. A rate nothing
+// confirms within SERIAL_SPEED_FALLBACK, after a 'K' or at boot, drops back to serialSpeeds[0].
+// Bare commands don't count, line noise at the wrong rate makes plenty of those.
+#define SERIAL_SPEED_SLOTS      5           // rates in the 'K' reply, unused ones are 0
+#define SERIAL_SPEED_FALLBACK   2000000     // us
+
+static const uint32_t serialSpeeds[] = {
+    SERIAL_COM_SPEED,
+#if SERIAL_SPEED_MAX >= 230400
+    230400,
+#endif
+#if SERIAL_SPEED_MAX >= 500000
+    500000,
+#endif
+#if SERIAL_SPEED_MAX >= 1000000
+    1000000,
+#endif
+#if SERIAL_SPEED_MAX >= 2000000
+    2000000,
+#endif
+};
+#define SERIAL_SPEEDS   (sizeof(serialSpeeds) / sizeof(serialSpeeds[0]))
+
+static uint8_t serialSpeedNow = 0;      // index in use
+static uint8_t serialSpeedNext = 0;     // acknowledged, switched to when the acknowledge is out
+static uint8_t serialSpeedConfirmed = 1;
+static uint32_t serialSpeedTime;        // micros() when serialSpeedNow was set
+
+static void serialSpeedSet(uint8_t i)
+{
+    serialSpeedNow = serialSpeedNext = i;
+    serialSpeedConfirmed = i == 0;
+    serialSpeedTime = micros();
+    Serial_begin(serialSpeeds[i]);
+}
 
-void i2c_ACC_init(void)
+// in setup(), once the parameters are loaded. An index past this build's table is from another board
+static void serialSpeedBoot(void)
 {
-    i2c_writeReg(LIS3A, 0x20, 0xD7);    // CTRL_REG1   1101 0111 Pwr on, 160Hz 
-    i2c_writeReg(LIS3A, 0x21, 0x50);    // CTRL_REG2   0100 0000 Littl endian, 12 Bit, Boot
-    acc_1G = 256;
+    if (serialSpeed && serialSpeed < SERIAL_SPEEDS)
+        serialSpeedSet(serialSpeed);
 }
 
-void i2c_ACC_getADC(void)
+static void serialSpeedTask(void)
 {
-    TWBR = ((16000000L / 400000L) - 16) / 2;    // change the I2C clock rate to 400kHz
-    i2c_getSixRawADC(LIS3A, 0x28 + 0x80);
-    ACC_ORIENTATION((rawADC[3] << 8 | rawADC[2]) / 4, -(rawADC[1] << 8 | rawADC[0]) / 4, -(rawADC[5] << 8 | rawADC[4]) / 4);
-    ACC_Common();
+    if (serialSpeedNext != serialSpeedNow) {
+        if (Serial_txIdle())
+            serialSpeedSet(serialSpeedNext);
+    } else if (!serialSpeedConfirmed && micros() - serialSpeedTime > SERIAL_SPEED_FALLBACK) {
+        serialSpeedSet(0);              // the host never followed, or there is none since boot
+    }
 }
-#endif
 
-// ************************************************************************************************************
-// I2C Accelerometer LSM303DLx
-// contribution from wektorx (http://www.multiwii.com/forum/viewtopic.php?f=8&t=863)
-// ************************************************************************************************************
-#if defined(LSM303DLx_ACC)
-void ACC_init()
+// a checksummed frame came in
+static void serialSpeedGood(void)
 {
-    delay(10);
-    i2c_writeReg(0x30, 0x20, 0x27);
-    i2c_writeReg(0x30, 0x23, 0x30);
-    i2c_writeReg(0x30, 0x21, 0x00);
-    acc_1G = 256;
+    if (serialSpeedConfirmed || serialSpeedNext != serialSpeedNow)
+        return;
+    serialSpeedConfirmed = 1;
+    if (serialSpeed != serialSpeedNow) {
+        serialSpeed = serialSpeedNow;
+        paramDirty = 1;                 // committed by paramTask() like any change, there is nothing to apply
+        paramDirtyTime = currentTime;
+    }
 }
 
-void ACC_getADC()
+static void serialSpeedSerialize(void)
 {
-    i2c_getSixRawADC(0x30, 0xA8);
+    uint8_t i;
 
-    ACC_ORIENTATION(-((rawADC[3] << 8) | rawADC[2]) / 16, ((rawADC[1] << 8) | rawADC[0]) / 16, ((rawADC[5] << 8) | rawADC[4]) / 16);
-    ACC_Common();
+    serialize8('K');
+    serialize8(serialSpeedNext);
+    serialize8(SERIAL_SPEEDS);
+    for (i = 0; i < SERIAL_SPEED_SLOTS; i++)
+        serialize16(i < SERIAL_SPEEDS ? serialSpeeds[i] / 100 : 0);
+    serialize8('K');
 }
+
+/* 'M', all data to the MultiWii GUI, in wire layout: guiStateFill() builds it in the serial frame buffer with
+   direct stores, the STM32 UART DMA sends it from there. It is the legacy 125 byte reply the GUI and
+   hostproto.c know by length and version, anything added goes behind debug[] with a new VERSION */
+#ifdef _MSC_VER
+#pragma pack(push, 1)
+#endif
+typedef struct WIRE_PACKED guiState_t {
+    uint8_t start;                      // 'M'
+    uint8_t version;
+    uint16_t accSmooth[3];
+    uint16_t gyro[3];                   // gyroData / 8
+    uint16_t mag[3];                    // magADC / 3
+    uint16_t alt;                       // EstAlt / 10
+    uint16_t heading;
+    uint16_t servo[4];
+    uint16_t motor[8];
+    uint16_t rcData[8];
+    uint8_t sensors;                    // nunchuk ACC BARO MAG GPS, bits 0..4
+    uint8_t modes;                      // acc baro mag GPS
+    uint16_t cycleTime;
+    uint16_t angle[2];                  // angle / 10
+    uint8_t mixer;                      // 11 past MULTITYPE_OCTOX8, the GUI knows no more
+    uint8_t pid[5][3];                  // P I D of ROLL PITCH YAW PIDALT PIDVEL
+    uint8_t levelP, levelI, magP;
+    uint8_t rcRate8, rcExpo8, rollPitchRate, yawRate, dynThrPID;
+    uint8_t activate[8];
+    uint16_t distanceToHome;
+    uint16_t directionToHome;
+    uint8_t numSat, fix, update;
+    uint16_t powerMeterSum;             // 0 0 without POWERMETER
+    uint16_t powerTrigger1;
+    uint8_t vbat;
+    uint16_t baroAlt;                   // BaroAlt / 10
+    uint16_t debug[3];                  // i2cErrorCounter, MPU6000 temperature, serial errors
+    uint8_t end;                        // 'M'
+} guiState_t;
+#ifdef _MSC_VER
+#pragma pack(pop)
+#endif
+
+static void guiStateFill(guiState_t *s)
+{
+    uint16_t v;
+    uint8_t i;
+
+    s->start = 'M';
+    s->version = VERSION;
+    for (i = 0; i < 3; i++) {
+        s->accSmooth[i] = WIRE16(accSmooth[i]);
+        s->gyro[i] = WIRE16(GYRO_LEGACY(gyroData[i]) / 8);
+        s->mag[i] = WIRE16(magADC[i] / 3);
+    }
+    s->alt = WIRE16(EstAlt / 10);
+    s->heading = WIRE16(heading);
+    for (i = 0; i < 4; i++)
+        s->servo[i] = WIRE16(servo[i]);
+    for (i = 0; i < 8; i++) {
+        s->motor[i] = WIRE16(motor[i]);
+        s->rcData[i] = WIRE16(rcData[i]);
+    }
+    s->sensors = nunchuk | ACC << 1 | BARO << 2 | MAG << 3 | GPSPRESENT << 4;
+    s->modes = accMode | baroMode << 1 | magMode << 2 | (GPSModeHome | GPSModeHold) << 3;
+    s->cycleTime = WIRE16(cycleTime);
+    for (i = 0; i < 2; i++)
+        s->angle[i] = WIRE16(angle[i] / 10);
+    s->mixer = mixerConfiguration > 10 ? 11 : mixerConfiguration;
+    for (i = 0; i < 5; i++) {
+        s->pid[i][0] = P8[i];
+        s->pid[i][1] = I8[i];
+        s->pid[i][2] = D8[i];
+    }
+    s->levelP = P8[PIDLEVEL];
+    s->levelI = I8[PIDLEVEL];
+    s->magP = P8[PIDMAG];
+    s->rcRate8 = rcRate8;
+    s->rcExpo8 = rcExpo8;
+    s->rollPitchRate = rollPitchRate;
+    s->yawRate = yawRate;
+    s->dynThrPID = dynThrPID;
+    for (i = 0; i < 8; i++)
+        s->activate[i] = activate[i];
+    s->distanceToHome = WIRE16(GPS_distanceToHome);
+    s->directionToHome = WIRE16(GPS_directionToHome);
+    s->numSat = GPS_numSat;
+    s->fix = GPS_fix;
+    s->update = GPS_update;
+#if defined(POWERMETER)
+    v = pMeter[PMOTOR_SUM] / PLEVELDIV;
+    s->powerMeterSum = WIRE16(v);
+    v = powerTrigger1 * PLEVELSCALE;
+    s->powerTrigger1 = WIRE16(v);
+#else
+    s->powerMeterSum = 0;
+    s->powerTrigger1 = 0;
+#endif
+    s->vbat = vbat;
+    s->baroAlt = WIRE16(BaroAlt / 10);
+    s->debug[0] = WIRE16(i2cErrorCounter);
+#if defined(MPU6000SPI)
+    v = MPU6000_getTemperature();
+    s->debug[1] = WIRE16(v);
+#else
+    s->debug[1] = 0;
 #endif
+    v = serialFrameErrors + Serial_rxOverflow() + Serial_txDropped();
+    s->debug[2] = WIRE16(v);
+    s->end = 'M';
+}
 
+#if defined(SERIAL_BENCH)
 // ************************************************************************************************************
-// ADC ACC
+// Link benchmark
 // ************************************************************************************************************
-#if defined(ADCACC)
-void ACC_init(void)
+// 'g' asks for a burst: count '$' frames of command 'g', each a 16 bit sequence number and filler up to size
+// bytes of payload, sent by benchTask() whenever a TX buffer is free (the telemetry port's free space with port 1).
+// Once the last one is queued, and right away for a count of 0, the report goes out:
+//   'g', frames sent, TX frames dropped, RX bytes lost, bad '$' frames, commands dispatched, us from the first
+//   frame to the last, 'g'
+// A burst counts from its request, a count of 0 from the last report, its own request included. So a host that
+// streams commands between two empty requests learns what the parser made of them. A request ends the burst
+// before it.
+#define BENCH_PAYLOAD_MAX   120         // a frame in one 128 byte TX buffer
+#define BENCH_PER_RUN       4           // frames per benchTask(), the TX buffers hold two
+
+static uint16_t benchLeft = 0, benchSeq, benchCommands = 0;
+static uint16_t benchDropped, benchOverflow, benchErrors;   // at the request
+static uint8_t benchSize, benchPort, benchReport = 0;
+static uint32_t benchFirst, benchLast;
+
+static void benchReset(void)
 {
-    pinMode(A1, INPUT);
-    pinMode(A2, INPUT);
-    pinMode(A3, INPUT);
-    acc_1G = 75;
+    benchSeq = 0;
+    benchCommands = 0;
+    benchDropped = Serial_txDropped();
+    benchOverflow = Serial_rxOverflow();
+    benchErrors = serialFrameErrors;
+    benchFirst = benchLast = 0;
 }
 
-void ACC_getADC(void)
+static void benchRequest(const uint8_t *p)
 {
-    ACC_ORIENTATION(-analogRead(A1), -analogRead(A2), analogRead(A3));
-    ACC_Common();
+    benchLeft = p[0] | p[1] << 8;
+    benchSize = p[2] < 2 ? 2 : p[2] > BENCH_PAYLOAD_MAX ? BENCH_PAYLOAD_MAX : p[2];
+    benchPort = p[3];
+    benchReport = 1;
+    if (benchLeft)
+        benchReset();
 }
+
+static uint8_t benchFrame(void)
+{
+    uint8_t f[4 + BENCH_PAYLOAD_MAX], i, len = benchSize, check;
+
+    f[0] = '$';
+    f[1] = len;
+    f[2] = 'g';
+    f[3] = benchSeq;
+    f[4] = benchSeq >> 8;
+    for (i = 2; i < len; i++)
+        f[3 + i] = i;
+    check = 0;
+    for (i = 1; i < len + 3; i++)
+        check ^= f[i];
+    f[len + 3] = check;
+#if defined(TELEMETRY_PORT)
+    if (benchPort)
+        return Telemetry_write(f, len + 4);
 #endif
+    if (Serial_isTxBusy())
+        return 0;
+    Serial_reset();
+    for (i = 0; i < len + 4; i++)
+        serialize8(f[i]);
+    Serial_commitBuffer();
+    return 1;
+}
 
-// ************************************************************************************************************
-// Analog Gyroscopes IDG500 + ISZ500
-// ************************************************************************************************************
-#ifdef STM8
-static volatile uint8_t adcInProgress = 0;
+void benchTask(void)
+{
+    uint8_t n;
+
+    for (n = 0; n < BENCH_PER_RUN && benchLeft; n++) {
+        if (!benchFrame())
+            return;
+        benchLast = micros();
+        if (!benchSeq)
+            benchFirst = benchLast;
+        benchSeq++;
+        benchLeft--;
+    }
+    if (benchLeft || !benchReport || Serial_isTxBusy())
+        return;
+    benchReport = 0;
+    Serial_reset();
+    serialize8('g');
+    serialize16(benchSeq);
+    serialize16(Serial_txDropped() - benchDropped);
+    serialize16(Serial_rxOverflow() - benchOverflow);
+    serialize16(serialFrameErrors - benchErrors);
+    serialize16(benchCommands);
+    serialize16(benchLast - benchFirst);
+    serialize16((benchLast - benchFirst) >> 16);
+    serialize8('g');
+    Serial_commitBuffer();
+    benchReset();
+}
+#endif
 
-__near __interrupt void ADC1_IRQHandler(void)
+// one complete command, p holds its serialPayloadSize() bytes, len of them for SERIAL_PAYLOAD_FRAMED
+static void serialCommand(uint8_t cmd, const uint8_t *p, uint8_t len)
 {
-    uint8_t i = 0;
+    int16_t a;
+    uint8_t i;
+    guiState_t *gui;
+    sensorFilter_t filter;
+    const uint8_t *value;
+    uint32_t t;
 
-#if 0
-    // clear at start of loop
-    if (adcSampleCount == 0 || adcSampleCount > 30) {
-        sensorInputs[0] = 0;
-        sensorInputs[1] = 0;
-        sensorInputs[2] = 0;
-        sensorInputs[3] = 0;
-        adcSampleCount = 0;
+#if I2C_BUS
+    i2cDeviceStats_t i2cStats;
+#endif
+#if defined(MOTOR_CAN)
+    canStats_t canStats;
+    uint32_t age;
+#endif
+
+#if defined(SERIAL_BENCH)
+    benchCommands++;
+#endif
+#if defined(LCD_CONF) && defined(LCD_TEXTSTAR)
+    if (configurationActive() && (cmd == LCD_MENU_PREV || cmd == LCD_MENU_NEXT || cmd == LCD_VALUE_UP || cmd == LCD_VALUE_DOWN)) {
+        configurationKey(cmd);
+        return;
     }
-    adcSampleCount++;
 #endif
+    switch (cmd) {
+#ifdef LCD_TELEMETRY
+    case 'A':              // button A press
+        if (telemetry == 'A')
+            telemetry = 0;
+        else {
+            telemetry = 'A';
+            lcdClear();
+        }
+        break;
+    case 'B':              // button B press
+        if (telemetry == 'B')
+            telemetry = 0;
+        else {
+            telemetry = 'B';
+            lcdClear();
+        }
+        break;
+    case 'C':              // button C press
+        if (telemetry == 'C')
+            telemetry = 0;
+        else {
+            telemetry = 'C';
+            lcdClear();
+        }
+        break;
+    case 'D':              // button D press
+        if (telemetry == 'D')
+            telemetry = 0;
+        else {
+            telemetry = 'D';
+            lcdClear();
+        }
+        break;
+    case 'a':              // button A release
+    case 'b':              // button B release
+    case 'c':              // button C release
+    case 'd':              // button D release
+        break;
+#endif
+    case 'M':              // Multiwii @ arduino to GUI all data
+        attitudeAngles();
+        attitudeHeading();
+        Serial_reset();
+        gui = Serial_reserve(sizeof(guiState_t));
+        if (gui)
+            guiStateFill(gui);
+        Serial_commitBuffer();
+        break;
+    case 'O':              // arduino to OSD data - contribution from MIS
+        attitudeAngles();
+        attitudeHeading();
+        Serial_reset();
+        serialize8('O');
+        for (i = 0; i < 3; i++)
+            serialize16(accSmooth[i]);
+        for (i = 0; i < 3; i++)
+            serialize16(GYRO_LEGACY(gyroData[i]));
+        serialize16(EstAlt * 10.0f);
+        serialize16(heading);       // compass - 16 bytes
+        for (i = 0; i < 2; i++)
+            serialize16(angle[i]);  //20
+        for (i = 0; i < 6; i++)
+            serialize16(motor[i]);  //32
+        for (i = 0; i < 6; i++) {
+            serialize16(rcData[i]);
+        }                   //44
+        serialize8(nunchuk | ACC << 1 | BARO << 2 | MAG << 3);
+        serialize8(accMode | baroMode << 1 | magMode << 2);
+        serialize8(vbat);   // Vbatt 47
+        serialize8(VERSION);        // MultiWii Firmware version
+        serialize8('O');    //49
+        Serial_commitBuffer();
+        break;
+    case 'R':
+        // into the serial bootloader for a firmware update, never in flight
+        if (!armed) {
+            if (paramDirty)
+                paramCommit();
+            systemBootloader();
+        }
+        break;
+    case 'W':              //GUI write params to eeprom @ arduino
+        for (i = 0; i < 5; i++) {
+            P8[i] = p[3 * i];
+            I8[i] = p[3 * i + 1];
+            D8[i] = p[3 * i + 2];
+        }                   // 15
+        P8[PIDLEVEL] = p[15];
+        I8[PIDLEVEL] = p[16];       // 17
+        P8[PIDMAG] = p[17]; // 18
+        rcRate8 = p[18];
+        rcExpo8 = p[19];    // 20
+        rollPitchRate = p[20];
+        yawRate = p[21];    // 22
+        dynThrPID = p[22];  // 23
+        for (i = 0; i < 8; i++)
+            activate[i] = p[23 + i];    // 31
+#if defined(POWERMETER)
+        powerTrigger1 = (p[31] + 256 * p[32]) / PLEVELSCALE;        // we rely on writeParams() to compute corresponding pAlarm value
+#endif
+        writeParams();
+        break;
+    case 'S':              //GUI to arduino ACC calibration request
+        calibratingA = 400;
+        break;
+    case 'E':              //GUI to arduino MAG calibration request
+        calibratingM = 1;
+        break;
+    case 'I':              // multiwii to GUI - acc vibration: rms[3], clip counts[3], % of ACC rejected updates
+        Serial_reset();
+        serialize8('I');
+        for (i = 0; i < 3; i++)
+            serialize16(accVib.rms[i]);
+        for (i = 0; i < 3; i++)
+            serialize16(accVib.clip[i]);
+        serialize8(accVib.rejected);
+        serialize8('I');
+        Serial_commitBuffer();
+        break;
 
-    // Get 4 ADC readings from buffer
-    for (i = 0; i < 4; i++)
-        sensorInputs[i] = ADC1_GetBufferValue(i);
+    case 'H':              // multiwii to GUI - startup: ms from reset to the end of setup() and to ready to arm, RAM use,
+                           // 1 if the watchdog reset the board, the fixed loop period (0 free running) and the boot loop cost in us
+        Serial_reset();
+        serialize8('H');
+        serialize16(bootSetupMs);
+        serialize16(bootReadyMs);   // 0 while the gyro calibration of the boot runs
+        serialize16(stack_free());  // stack low-water mark, bytes never used since reset
+        serialize16(ram_static());
+        serialize8(watchdog_didReset());
+#if defined(LOOP_RATE_AUTO)
+        serialize16(loopPeriod);
+        serialize16(loopCostMax);
+#else
+        serialize16(0);
+        serialize16(0);
+#endif
+        serialize8('H');
+        Serial_commitBuffer();
+        break;
+#if I2C_BUS
+    case 'Z':              // multiwii to GUI - I2C health: bus recoveries, then address, errors, refused jobs and
+                           // backoff (0 healthy, else retried every 2^n ms) per device
+        Serial_reset();
+        serialize8('Z');
+        serialize16(i2c_busRecoveries());
+        for (i = 0; i2c_deviceStats(i, &i2cStats); i++) {
+            serialize8(i2cStats.address);
+            serialize16(i2cStats.errors);
+            serialize16(i2cStats.refused);
+            serialize8(i2cStats.backoff);
+        }
+        serialize8('Z');
+        Serial_commitBuffer();
+        break;
+    case 'q':              // multiwii to GUI - descriptor pools, I2C posts: per pool block size, blocks, in use, the most
+                           // ever in use and the allocations refused on an empty pool
+        Serial_reset();
+        serialize8('q');
+        for (i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+            serialize8(pools[i]->size);
+            serialize8(pools[i]->count);
+            serialize8(pools[i]->used);
+            serialize8(pools[i]->highWater);
+            serialize16(pools[i]->failed);
+        }
+        serialize8('q');
+        Serial_commitBuffer();
+        break;
+#endif
+#if defined(MOTOR_I2C)
+    case 'm':              // multiwii to GUI - I2C ESC health: count, then unacknowledged and other failed writes per ESC
+        Serial_reset();
+        serialize8('m');
+        serialize8(MOTOR_I2C_MAX);
+        for (i = 0; i < MOTOR_I2C_MAX; i++) {
+            serialize16(escNacks[i]);
+            serialize16(escErrors[i]);
+        }
+        serialize8('m');
+        Serial_commitBuffer();
+        break;
+#endif
+#if defined(MOTOR_CAN)
+    case 'n':              // multiwii to GUI - CAN ESC telemetry: count, per ESC eRPM / 100, 10mV, 10mA, C and the age
+                           // in 10ms (255 for older or never), then the bus: frames dropped and lost, error counters
+        Serial_reset();
+        serialize8('n');
+        serialize8(MOTOR_CAN_MAX);
+        for (i = 0; i < MOTOR_CAN_MAX; i++) {
+            age = (millis() - escTelemetry[i].time) / 10;
+            serialize16(escTelemetry[i].erpm);
+            serialize16(escTelemetry[i].voltage);
+            serialize16(escTelemetry[i].current);
+            serialize8(escTelemetry[i].temperature);
+            serialize8(!escTelemetry[i].time || age > 255 ? 255 : age);
+        }
+        can_stats(&canStats);
+        serialize16(canStats.txDropped);
+        serialize16(canStats.rxOverflow);
+        serialize8(canStats.txErrors);
+        serialize8(canStats.rxErrors);
+        serialize8(canStats.busOff);
+        serialize8('n');
+        Serial_commitBuffer();
+        break;
+#endif
+    case 'G':               // GUI to multiwii - gimbal tuning parameters
+        gimbalFlags = p[0];
+        gimbalGainPitch = p[1];
+        gimbalGainRoll = p[2];
+        writeParams();
+        break;
 
-    ADC1_ClearITPendingBit(ADC1_CSR_EOC);
-    adcInProgress = 0;
+    case 'X':              // GUI to change mixer type. command is X+ascii A + MULTITYPE_XXXX index. i.e. XA for tri, XB for Quad+, XC for QuadX, etc.
+        i = p[0];
+        Serial_reset();
+#if defined(FIXED_FRAME)
+        if (i == '@' + FIXED_FRAME) {
+#else
+        if (i > 64 && i < 64 + MULTITYPE_LAST) {
+#endif
+            serialize8('O');
+            serialize8('K');
+            Serial_commitBuffer();
+            mixerConfiguration = i - '@'; // A..B..C.. index
+            writeParams();
+            paramCommit();              // can't wait for paramTask(), we're about to reboot
+            systemReboot();
+            break;
+        }
+        serialize8('N');
+        serialize8('G');
+        Serial_commitBuffer();
+        break;
+    case 'Q':              // GUI to multiwii - MS561101BA oversampling 0..4 (OSR 256..4096), lower is faster and noisier
+        Serial_reset();
+        if (p[0] <= 4) {
+            baroOsr = p[0];
+            writeParams();
+            serialize8('O');
+            serialize8('K');
+        } else {
+            serialize8('N');
+            serialize8('G');
+        }
+        Serial_commitBuffer();
+        break;
+#if defined(ITG3200) || defined(MPU6000SPI)
+    case 'L':              // GUI to multiwii - gyro DLPF_CFG 0..6 (256Hz..5Hz) and SMPLRT_DIV, applied right away
+        Serial_reset();
+        if (p[0] <= 6) {
+            gyroDlpf = p[0];
+            gyroRateDiv = p[1];
+            writeParams();
+            serialize8('O');
+            serialize8('K');
+        } else {
+            serialize8('N');
+            serialize8('G');
+        }
+        Serial_commitBuffer();
+        break;
+#endif
+#if defined(VBAT)
+    case 'V':              // GUI to multiwii - vbat alarm levels 1..3 and the no battery level, 0.1V
+        Serial_reset();
+        if (p[0] >= p[1] && p[1] >= p[2] && p[2] > p[3] && paramWrite(paramIndex(23), p)) {  // vbatAlarm_t
+            writeParams();
+            serialize8('O');
+            serialize8('K');
+        } else {
+            serialize8('N');
+            serialize8('G');
+        }
+        Serial_commitBuffer();
+        break;
+#endif
+    case 'F':              // GUI to multiwii - sensor filters in Hz, 16 bit: gyro low pass, gyro notch, acc low pass, acc notch, 3 axes each
+        for (i = 0; i < 3; i++) {
+            filter.gyroLpf[i] = p[2 * i] + 256 * p[2 * i + 1];
+            filter.gyroNotch[i] = p[6 + 2 * i] + 256 * p[7 + 2 * i];
+            filter.accLpf[i] = p[12 + 2 * i] + 256 * p[13 + 2 * i];
+            filter.accNotch[i] = p[18 + 2 * i] + 256 * p[19 + 2 * i];
+        }
+        Serial_reset();
+        if (paramWrite(paramIndex(20), &filter)) {
+            writeParams();  // filterSetup() through paramApply()
+            serialize8('O');
+            serialize8('K');
+        } else {
+            serialize8('N');
+            serialize8('G');
+        }
+        Serial_commitBuffer();
+        break;
+    case 'Y':              // GUI to multiwii - custom mixer: motor count, then throttle/roll/pitch/yaw per motor in 1/64. Used after XN
+        Serial_reset();
+        if (p[0] <= 8 && paramWrite(paramIndex(18), p)) {   // customMixer_t, the motor count and the table
+            writeParams();
+            serialize8('O');
+            serialize8('K');
+        } else {
+            serialize8('N');
+            serialize8('G');
+        }
+        Serial_commitBuffer();
+        break;
+    case 'J':              // GUI to multiwii - read parameter id, 0 lists the ids and sizes of the EEPROM layout
+        Serial_reset();
+        serialize8('J');
+        serialize8(p[0]);
+        if (p[0] == 0) {
+            serialize8(EEBLOCK_SIZE);
+            for (i = 0; i < EEBLOCK_SIZE; i++) {
+                serialize8(eep_entry[i].id);
+                serialize8(eep_entry[i].size);
+            }
+        } else if ((i = paramIndex(p[0])) == PARAM_UNKNOWN)
+            serialize8(0);
+        else {
+            serialize8(eep_entry[i].size);
+            value = (const uint8_t *)paramData(i);
+            for (a = 0; a < eep_entry[i].size; a++)
+                serialize8(value[a]);
+        }
+        Serial_commitBuffer();
+        break;
+    case 'U':              // GUI to multiwii - framed only: parameter id, then its data as 'J' returned it
+        Serial_reset();
+        if ((i = paramIndex(p[0])) != PARAM_UNKNOWN && len == eep_entry[i].size + 1 && paramWrite(i, p + 1)) {
+#if defined(TUNING_PROFILES)
+            tuningLoad(tuningActive);   // it may have been the profile in use, writeParams() stores that back
+#endif
+            writeParams();
+            serialize8('O');
+            serialize8('K');
+        } else {
+            serialize8('N');
+            serialize8('G');
+        }
+        Serial_commitBuffer();
+        break;
+    case 'j':              // GUI to multiwii - commit state: a write still pending, records stored, CRC of the stored records
+        Serial_reset();
+        serialize8('j');
+        serialize8(paramDirty);
+        a = paramStoredCrc(&i);
+        serialize8(i);
+        serialize16(a);
+        Serial_commitBuffer();
+        break;
+    case 'v':              // GUI to multiwii - framed only: address and words (32 bit each) start a flash CRC check, no
+                           // payload asks. The reply: state (0 done, 1 running, 2 refused), address, words, CRC-32
+        if (len == 8)
+            crcCheck(p);
+        Serial_reset();
+        serialize8('v');
+        serialize8(crcCheckState);
+        serialize16(crcCheckAddress);
+        serialize16(crcCheckAddress >> 16);
+        serialize16(crcCheckWords);
+        serialize16(crcCheckWords >> 16);
+        serialize16(crcCheckState ? 0 : crc_result());
+        serialize16(crcCheckState ? 0 : crc_result() >> 16);
+        serialize8('v');
+        Serial_commitBuffer();
+        break;
+#if defined(WATCH)
+    case 'w':              // GUI to multiwii - framed only: watch divider, then (address, size) per variable
+        i = watchSet(p, len);
+        Serial_reset();
+        serialize8('w');
+        serialize8(i);
+        serialize8(watchSampleLen);
+        serialize8('w');
+        Serial_commitBuffer();
+        break;
+#endif
+#if defined(SERIAL_STREAM)
+    case 'T':              // GUI to multiwii - telemetry subscription, one rate divider per group
+        for (i = 0; i < STREAM_GROUPS; i++) {
+            streamDivider[i] = p[i];
+            streamScale[i] = 0;
+            streamCount[i] = streamDivider[i] ? streamDivider[i] - 1 : 0;  // first frame on the next tick
+        }
+        streamSent = 0;
+        break;
+    case 't':              // multiwii to GUI - stream link state: dividers in use, frames skipped, bytes/s sent
+        Serial_reset();
+        serialize8('t');
+        for (i = 0; i < STREAM_GROUPS; i++)
+            serialize8(streamRate(i));
+        serialize16(streamSkipped);
+        serialize16(streamThroughput);
+        serialize8('t');
+        Serial_commitBuffer();
+        break;
+#endif
+#if defined(LOOP_PROFILER) && !defined(HOSTSIM)
+    case 'P':              // GUI to multiwii - loop stage timing
+        Serial_reset();
+        profileSerialize();
+        Serial_commitBuffer();
+        break;
+    case 'p':              // GUI to multiwii - loop stage cycles and code placement
+        Serial_reset();
+        profileCyclesSerialize();
+        Serial_commitBuffer();
+        break;
+#endif
+    case 'y':              // host to multiwii - clock sync: a 32 bit token, sent back with micros() when the request
+                           // was taken and when the reply went out, 'y', token, rx, tx, 'y'
+        t = micros();
+        Serial_reset();
+        serialize8('y');
+        for (i = 0; i < 4; i++)
+            serialize8(p[i]);
+        serialize16(t);
+        serialize16(t >> 16);
+        t = micros();
+        serialize16(t);
+        serialize16(t >> 16);
+        serialize8('y');
+        Serial_commitBuffer();
+        break;
+#if defined(HIL_INJECT)
+    case 'h':              // bench harness to multiwii - gyroADC[3], accADC[3], then rcValue[8] as one receiver frame
+                           // (left out when rcValue[0] is 0), all 16 bit
+        for (i = 0; i < 3; i++) {
+            hilGyro[i] = p[i * 2] | p[i * 2 + 1] << 8;
+            hilAcc[i] = p[6 + i * 2] | p[7 + i * 2] << 8;
+        }
+        hilTime = currentTime ? currentTime : 1;
+        if (p[12] | p[13]) {
+            for (i = 0; i < 8; i++)
+                rcValue[i] = p[12 + i * 2] | p[13 + i * 2] << 8;
+            rcFrameTime = rcLinkTime = micros();
+            seq_publish(&rcFrameCount);
+            rcFrameComplete = 1;
+        }
+        break;
+#endif
+#if defined(BIT_EXACT)
+    case 'x':              // parity bench to multiwii - step frame: log time (32 bit), gyroADC[3], accADC[3], then
+                           // rcValue[8] as one receiver frame (left out when rcValue[0] is 0), 16 bit. One loop runs
+                           // on it, see paritySerialize() for the reply
+        parityTime = p[0] | (uint16_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        for (i = 0; i < 3; i++) {
+            hilGyro[i] = p[4 + i * 2] | p[5 + i * 2] << 8;
+            hilAcc[i] = p[10 + i * 2] | p[11 + i * 2] << 8;
+        }
+        if (p[16] | p[17]) {
+            for (i = 0; i < 8; i++)
+                rcValue[i] = p[16 + i * 2] | p[17 + i * 2] << 8;
+            rcFrameTime = rcLinkTime = parityTime;
+            seq_publish(&rcFrameCount);
+            rcFrameComplete = 1;
+        }
+        paritySteps++;
+        parityStep = 1;
+        break;
+#endif
+    case 'K':              // GUI to multiwii - link rate, an index into the rates of the reply or 0xFF to only ask.
+                           // multiwii to GUI - 'K', index acknowledged, count, rate / 100 [5], 'K'
+        if (p[0] < SERIAL_SPEEDS && p[0] != serialSpeedNow) {
+            serialSpeedNext = p[0];
+            if (p[0] == 0 && serialSpeed) {
+                serialSpeed = 0;        // nothing to confirm at the base rate
+                paramDirty = 1;
+                paramDirtyTime = currentTime;
+            }
+        }
+        Serial_reset();
+        serialSpeedSerialize();
+        Serial_commitBuffer();
+        break;
+#if defined(SYSID)
+    case 'e':              // GUI to multiwii - excitation: axis, kind (0 stop, 1 step, 2 chirp), amplitude, f0, f1 in 0.1Hz
+                           // (16 bit), duration in 0.1s. Only while armed, see sysidInject()
+        sysidSet(p);
+        Serial_reset();
+        serialize8(sysidKind != SYSID_OFF ? 'O' : 'N');
+        serialize8(sysidKind != SYSID_OFF ? 'K' : 'G');
+        Serial_commitBuffer();
+        break;
+#endif
+#if defined(LATENCY_BENCH)
+    case 'N':              // multiwii to GUI - stick and gyro to motor latencies, see latencySerialize()
+        Serial_reset();
+        latencySerialize();
+        Serial_commitBuffer();
+        break;
+#endif
+#if defined(SERIAL_BENCH)
+    case 'g':              // host to multiwii - link benchmark: frame count (16 bit), payload size, port (0 serial,
+                           // 1 telemetry port), see benchTask() for the report
+        benchRequest(p);
+        break;
+#endif
+    }
+}
+
+// ************************************************************************************************************
+// Command parser
+// ************************************************************************************************************
+// Two framings share the input. Bare command characters (the GUI protocol) have their fixed size payload
+// collected without blocking. Checksummed frames '$', len, cmd, payload[len], xor of len..payload only run
+// when the checksum and the payload size for cmd both match; SERIAL_PAYLOAD_FRAMED commands take any length
+// and only come framed. A payload that stops arriving for SERIAL_RX_TIMEOUT is dropped, so a garbled byte
+// never leaves the parser waiting.
+#define SERIAL_FRAME_START  '$'
+#define SERIAL_MAX_PAYLOAD  35          // 'U' with a tuning profile
+#define SERIAL_PAYLOAD_FRAMED 0xFF
+#define SERIAL_RX_TIMEOUT   100000      // us
+#define SERIAL_RX_BUDGET    48          // bytes per call, a full RX ring
+
+enum {
+    SERIAL_IDLE = 0,
+    SERIAL_BARE_PAYLOAD,
+    SERIAL_LEN,
+    SERIAL_CMD,
+    SERIAL_PAYLOAD,
+    SERIAL_CHECKSUM
+};
+
+static uint8_t serialPayloadSize(uint8_t cmd)
+{
+    switch (cmd) {
+    case 'W':
+        return 33;
+    case 'G':
+        return 3;
+    case 'X':
+        return 1;
+    case 'Q':
+        return 1;
+#if defined(ITG3200) || defined(MPU6000SPI)
+    case 'L':
+        return 2;
+#endif
+#if defined(VBAT)
+    case 'V':
+        return 4;
+#endif
+    case 'F':
+        return 24;
+    case 'J':
+        return 1;
+    case 'K':
+        return 1;
+    case 'y':
+        return 4;
+#if defined(SERIAL_BENCH)
+    case 'g':
+        return 4;
+#endif
+    case 'U':
+        return SERIAL_PAYLOAD_FRAMED;
+    case 'v':
+        return SERIAL_PAYLOAD_FRAMED;
+    case 'Y':
+        return 1 + 8 * sizeof(motorMix_t);
+#if defined(SYSID)
+    case 'e':
+        return 8;
+#endif
+#if defined(HIL_INJECT)
+    case 'h':
+        return 28;
+#endif
+#if defined(BIT_EXACT)
+    case 'x':
+        return 32;
+#endif
+#if defined(WATCH)
+    case 'w':
+        return SERIAL_PAYLOAD_FRAMED;
+#endif
+#if defined(SERIAL_STREAM)
+    case 'T':
+        return STREAM_GROUPS;
+#endif
+    }
+    return 0;
 }
+
+void serialCom(void)
+{
+    static uint8_t state = SERIAL_IDLE;
+    static uint8_t cmd, len, pos, check;
+    static uint8_t payload[SERIAL_MAX_PAYLOAD];
+    static uint32_t lastByte;
+    const uint8_t *rx;
+    uint8_t avail, i, n, c;
+
+    PROFILE_BEGIN(serialCom);
+    serialSpeedTask();
+    if (state != SERIAL_IDLE && currentTime - lastByte > SERIAL_RX_TIMEOUT)
+        state = SERIAL_IDLE;
+    // bytes are parsed in place and released a run at a time. Replies need a free TX buffer,
+    // whatever is left stays in the RX ring until the next call
+    avail = i = 0;
+#if defined(BIT_EXACT)
+    for (n = 0; n < SERIAL_RX_BUDGET && !Serial_isTxBusy() && !parityStep; n++) {      // one step frame per loop
+#else
+    for (n = 0; n < SERIAL_RX_BUDGET && !Serial_isTxBusy(); n++) {
 #endif
+        if (i == avail) {
+            Serial_consume(i);
+            i = 0;
+            if ((avail = Serial_peek(&rx)) == 0)
+                break;
+        }
+        c = rx[i++];
+        lastByte = currentTime;
+        switch (state) {
+        case SERIAL_IDLE:
+            if (c == SERIAL_FRAME_START) {
+                state = SERIAL_LEN;
+                break;
+            }
+            cmd = c;
+            len = serialPayloadSize(c);
+            pos = 0;
+            if (len == 0)
+                serialCommand(cmd, payload, 0);
+            else if (len != SERIAL_PAYLOAD_FRAMED)
+                state = SERIAL_BARE_PAYLOAD;
+            break;
+        case SERIAL_BARE_PAYLOAD:
+            payload[pos++] = c;
+            if (pos == len) {
+                serialCommand(cmd, payload, len);
+                state = SERIAL_IDLE;
+            }
+            break;
+        case SERIAL_LEN:
+            len = c;
+            check = c;
+            pos = 0;
+            if (len > SERIAL_MAX_PAYLOAD) {
+                serialFrameErrors++;
+                state = SERIAL_IDLE;
+            } else
+                state = SERIAL_CMD;
+            break;
+        case SERIAL_CMD:
+            cmd = c;
+            check ^= c;
+            state = len ? SERIAL_PAYLOAD : SERIAL_CHECKSUM;
+            break;
+        case SERIAL_PAYLOAD:
+            payload[pos++] = c;
+            check ^= c;
+            if (pos == len)
+                state = SERIAL_CHECKSUM;
+            break;
+        case SERIAL_CHECKSUM:
+            if (c == check && (len == serialPayloadSize(cmd) || serialPayloadSize(cmd) == SERIAL_PAYLOAD_FRAMED)) {
+                serialSpeedGood();
+                serialCommand(cmd, payload, len);
+            } else
+                serialFrameErrors++;
+            state = SERIAL_IDLE;
+            break;
+        }
+    }
+    Serial_consume(i);
+    PROFILE_END(serialCom);
+}
 
-#if defined(STM8) && defined(ADCGYRO)
-void Gyro_init(void)
+#if defined(KERNEL_BENCH)
+// **********************
+// kernel benchmark image
+// **********************
+// main() runs kernelBench() in place of setup() and loop(): only the serial port is brought up, no receiver,
+// sensors or motor outputs. Each kernel runs BENCH_RUNS times over the canned inputs of benchWave[], timed
+// with cycles() around the whole batch less the same batch of benchNone(), which leaves out the call and the
+// input stores. Once a second the table goes out as CSV text, one line per frame:
+//   kernel,calls,cycles,per_call,cycles_per_us
+// with cycles the net total of the batch. On the STM8 cycles() is micros(), cycles_per_us is 1 there.
+// annexCode() is timed as rcShape(), the rest of it is the task runner and needs the hardware.
+#define BENCH_RUNS          1000
+#define BENCH_WAVE          16          // a power of two
+#define BENCH_IN(n, phase)  benchWave[((n) + (phase)) & (BENCH_WAVE - 1)]
+
+typedef struct {
+    const char *name;
+    void (*run)(uint16_t n);            // one call of the kernel on input n
+} benchKernel_t;
+
+static const int16_t benchWave[BENCH_WAVE] = { 0, 98, 181, 237, 256, 237, 181, 98, 0, -98, -181, -237, -256, -237, -181, -98 };
+static volatile int32_t benchSink;      // results the compiler has to keep
+
+static void benchNone(uint16_t n)
 {
-    // ADC1
-    ADC1_DeInit();
-    GPIO_Init(GPIOB, GPIO_PIN_0 | GPIO_PIN_1 | GPIO_PIN_2 | GPIO_PIN_3, GPIO_MODE_IN_FL_NO_IT);
-    ADC1_Init(ADC1_CONVERSIONMODE_SINGLE, ADC1_CHANNEL_3, ADC1_PRESSEL_FCPU_D2, ADC1_EXTTRIG_TIM, DISABLE, ADC1_ALIGN_RIGHT, ADC1_SCHMITTTRIG_ALL, DISABLE);
-    ADC1_DataBufferCmd(ENABLE);
-    ADC1_ScanModeCmd(ENABLE);
-    ADC1_ITConfig(ADC1_IT_EOCIE, ENABLE);
+    benchSink = BENCH_IN(n, 0);
 }
 
-void Gyro_getADC(void)
+#if !defined(STAB_OLD_17)
+static void benchAtan2(uint16_t n)
 {
-    // read out
-    adcInProgress = 1;
-    ADC1_StartConversion();
-    while (adcInProgress);      // wait for conversion
+    benchSink = _atan2(BENCH_IN(n, 0) * 2.0f, BENCH_IN(n, 4) + 300.0f);
+}
 
-    GYRO_ORIENTATION(-(sensorInputs[0]) * 5, (sensorInputs[1]) * 5, -(sensorInputs[2]) * 5);
-    GYRO_Common();
+static void benchRotateV(uint16_t n)
+{
+    static struct fp_vector v;
+    float delta[3];
+
+    if (n == 0) {
+        v.X = 0;
+        v.Y = 0;
+        v.Z = acc_1G;
+    }
+    delta[ROLL] = BENCH_IN(n, 0) * 1e-5f;
+    delta[PITCH] = BENCH_IN(n, 4) * 1e-5f;
+    delta[YAW] = BENCH_IN(n, 8) * 1e-5f;
+    rotateV(&v, delta);
 }
 #endif
 
-// ************************************************************************************************************
-// contribution from Ciskje
-// I2C Gyroscope L3G4200D 
-// ************************************************************************************************************
-#if defined(L3G4200D)
-void Gyro_init()
+static void benchInvSqrt(uint16_t n)
 {
-    delay(100);
-    i2c_writeReg(0XD2 + 0, 0x20, 0x8F); // CTRL_REG1   400Hz ODR, 20hz filter, run!
-    delay(5);
-    i2c_writeReg(0XD2 + 0, 0x24, 0x02); // CTRL_REG5   low pass filter enable
+    benchSink = InvSqrt(65536.0f + BENCH_IN(n, 0) * 64.0f) * 1e6f;
 }
 
-void Gyro_getADC()
+static void benchAttitude(uint16_t n)
 {
-    TWBR = ((16000000L / 400000L) - 16) / 2;    // change the I2C clock rate to 400kHz
-    i2c_getSixRawADC(0XD2, 0x80 | 0x28);
+    uint8_t axis;
 
-    GYRO_ORIENTATION(((rawADC[1] << 8) | rawADC[0]) / 20, ((rawADC[3] << 8) | rawADC[2]) / 20, -((rawADC[5] << 8) | rawADC[4]) / 20);
-    GYRO_Common();
+    for (axis = 0; axis < 3; axis++) {
+        gyroADC[axis] = BENCH_IN(n, axis * 4) >> (2 - GYRO_FRAC);
+        accADC[axis] = BENCH_IN(n, axis * 4 + 2) >> 3;
+        magADC[axis] = BENCH_IN(n, axis * 4 + 1);
+    }
+    accADC[YAW] += acc_1G;
+    getEstimatedAttitude();
 }
-#endif
 
-// ************************************************************************************************************
-// I2C Gyroscope ITG3200 
-// ************************************************************************************************************
-// I2C adress: 0xD2 (8bit)   0x69 (7bit)
-// I2C adress: 0xD0 (8bit)   0x68 (7bit)
-// principle:
-// 1) VIO is connected to VDD
-// 2) I2C adress is set to 0x69 (AD0 PIN connected to VDD)
-// or 2) I2C adress is set to 0x68 (AD0 PIN connected to GND)
-// 3) sample rate = 1000Hz ( 1kHz/(div+1) )
-// ************************************************************************************************************
-#if defined(ITG3200)
-void Gyro_init(void)
+static void benchAttitudeOut(uint16_t n)
 {
-    delay(100);
-    i2c_writeReg(ITG3200_ADDRESS, 0x3E, 0x80);  //register: Power Management  --  value: reset device
-    //  delay(5);
-    //  i2c_writeReg(ITG3200_ADDRESS, 0x15, ITG3200_SMPLRT_DIV); //register: Sample Rate Divider  -- default value = 0: OK
-    delay(5);
-    i2c_writeReg(ITG3200_ADDRESS, 0x16, 0x18 + ITG3200_DLPF_CFG);       //register: DLPF_CFG - low pass filter configuration
-    delay(5);
-    i2c_writeReg(ITG3200_ADDRESS, 0x3E, 0x03);  //register: Power Management  --  value: PLL with Z Gyro reference
-    delay(100);
+    benchAttitude(n);
+    attitudeAngles();
+    attitudeHeading();
 }
 
-void Gyro_getADC(void)
+static void benchPid(uint16_t n)
 {
-    i2c_getSixRawADC(ITG3200_ADDRESS, 0X1D);
-    GYRO_ORIENTATION(+(((rawADC[2] << 8) | rawADC[3]) / 4),     // range: +/- 8192; +/- 2000 deg/sec
-                     -(((rawADC[0] << 8) | rawADC[1]) / 4), -(((rawADC[4] << 8) | rawADC[5]) / 4));
-    GYRO_Common();
-}
-#endif
-
+    uint8_t axis;
 
+    for (axis = 0; axis < 3; axis++) {
+        rcCommand[axis] = BENCH_IN(n, axis * 4);
+        gyroData[axis] = BENCH_IN(n, axis * 4 + 1);
+    }
+    pidCompute();
+}
 
-// ************************************************************************************************************
-// I2C Compass common function
-// ************************************************************************************************************
-#if MAG
-void Mag_getADC(void)
+// a gyro reading through the pipeline, zero, clamp, a low pass and a notch on each axis at 1kHz
+static void benchFilter(uint16_t n)
 {
-    static uint32_t t, tCal = 0;
-    static int16_t magZeroTempMin[3];
-    static int16_t magZeroTempMax[3];
+    static biquad_t f[3][2];
+    static int16_t zero[3], last[3];
+    static const sensorPipe_t pipe = {
+        zero, last, f,
+#if defined(DYN_NOTCH)
+        NULL,
+#endif
+    };
+    int16_t v[3];
     uint8_t axis;
 
-    if (currentTime < t)
-        return;                 //each read is spaced by 100ms
-    t = currentTime + 100000;
-
-    Device_Mag_getADC();
-    if (calibratingM == 1) {
-        tCal = t;
+    if (n == 0)
         for (axis = 0; axis < 3; axis++) {
-            magZero[axis] = 0;
-            magZeroTempMin[axis] = 0;
-            magZeroTempMax[axis] = 0;
-        }
-        calibratingM = 0;
-    }
-    magADC[ROLL] -= magZero[ROLL];
-    magADC[PITCH] -= magZero[PITCH];
-    magADC[YAW] -= magZero[YAW];
-    if (tCal != 0) {
-        if ((t - tCal) < 30000000) {    // 30s: you have 30s to turn the multi in all directions
-            LEDPIN_TOGGLE;
-            for (axis = 0; axis < 3; axis++) {
-                if (magADC[axis] < magZeroTempMin[axis])
-                    magZeroTempMin[axis] = magADC[axis];
-                if (magADC[axis] > magZeroTempMax[axis])
-                    magZeroTempMax[axis] = magADC[axis];
-            }
-        } else {
-            tCal = 0;
-            for (axis = 0; axis < 3; axis++)
-                magZero[axis] = (magZeroTempMin[axis] + magZeroTempMax[axis]) / 2;
-            writeParams();
+            biquadSetup(&f[axis][0], 90, 1000, 0);
+            biquadSetup(&f[axis][1], 150, 1000, 1);
         }
-    }
+    for (axis = 0; axis < 3; axis++)
+        v[axis] = BENCH_IN(n, axis * 4) << 2;
+    sensorPass(&pipe, v);
+    benchSink = v[ROLL];
 }
-#endif
 
-// ************************************************************************************************************
-// I2C Compass HMC5843 & HMC5883
-// ************************************************************************************************************
-// I2C adress: 0x3C (8bit)   0x1E (7bit)
-// ************************************************************************************************************
-#if defined(HMC5843) || defined(HMC5883)
-void Mag_init(void)
+static void benchMix(uint16_t n)
 {
-    delay(100);
-    i2c_writeReg(0X3C, 0x02, 0x00);     //register: Mode register  --  value: Continuous-Conversion Mode
+    uint8_t axis;
+
+    rcCommand[THROTTLE] = 1500 + BENCH_IN(n, 0);
+    for (axis = 0; axis < 3; axis++)
+        axisPID[axis] = BENCH_IN(n, axis * 4 + 2);
+    mixTable();
 }
 
-void Device_Mag_getADC(void)
+static void benchRC(uint16_t n)
 {
-    i2c_getSixRawADC(0X3C, 0X03);
-#if defined(HMC5843)
-    MAG_ORIENTATION(((rawADC[0] << 8) | rawADC[1]), ((rawADC[2] << 8) | rawADC[3]), -((rawADC[4] << 8) | rawADC[5]));
-#endif
-#if defined (HMC5883)
-    MAG_ORIENTATION(((rawADC[4] << 8) | rawADC[5]), -((rawADC[0] << 8) | rawADC[1]), -((rawADC[2] << 8) | rawADC[3]));
-#endif
+    (void)n;
+    computeRC();
 }
-#endif
 
-// ************************************************************************************************************
-// I2C Compass AK8975 (Contribution by EOSBandi)
-// ************************************************************************************************************
-// I2C adress: 0x18 (8bit)   0x0C (7bit)
-// ************************************************************************************************************
-#if defined(AK8975)
-void Mag_init(void)
+static void benchRcShape(uint16_t n)
 {
-    delay(100);
-    i2c_writeReg(0x18, 0x0a, 0x01);     //Start the first conversion
-    delay(100);
+    uint8_t axis;
+
+    for (axis = 0; axis < 4; axis++)
+        rcData[axis] = MIDRC + BENCH_IN(n, axis * 4) * 2;
+    rcShape();
 }
 
-void Device_Mag_getADC(void)
+#if defined(BMP085)
+static void benchBaroTemp(uint16_t n)
 {
-    i2c_getSixRawADC(0x18, 0x03);
-    MAG_ORIENTATION(((rawADC[3] << 8) | rawADC[2]), ((rawADC[1] << 8) | rawADC[0]), -((rawADC[5] << 8) | rawADC[4]));
-    //Start another meassurement
-    i2c_writeReg(0x18, 0x0a, 0x01);
+    bmp085_ctx.ut = 27898 + BENCH_IN(n, 0);
+    i2c_BMP085_Temperature();
 }
-#endif
 
-#if !GYRO
-// ************************************************************************************************************
-// I2C Wii Motion Plus + optional Nunchuk
-// ************************************************************************************************************
-// I2C adress 1: 0xA6 (8bit)    0x53 (7bit)
-// I2C adress 2: 0xA4 (8bit)    0x52 (7bit)
-// ************************************************************************************************************
-void WMP_init(uint8_t d)
+static void benchBaro(uint16_t n)
 {
-    delay(d);
-    i2c_writeReg(0xA6, 0xF0, 0x55);     // Initialize Extension
-    delay(d);
-    i2c_writeReg(0xA6, 0xFE, 0x05);     // Activate Nunchuck pass-through mode
-    delay(d);
-    if (d > 0) {
-        // We need to set acc_1G for the Nunchuk beforehand; It's used in WMP_getRawADC() and ACC_Common()
-        // If a different accelerometer is used, it will be overwritten by its ACC_init() later.
-        uint8_t i;
-        uint8_t numberAccRead = 0;
-        acc_1G = 200;
-        acc_25deg = acc_1G * 0.423;
-        // Read from WMP 100 times, this should return alternating WMP and Nunchuk data
-        for (i = 0; i < 100; i++) {
-            delay(4);
-            if (WMP_getRawADC() == 0)
-                numberAccRead++;        // Count number of times we read from the Nunchuk extension
-        }
-        // If we got at least 25 Nunchuck reads, we assume the Nunchuk is present
-        if (numberAccRead > 25)
-            nunchuk = 1;
-        delay(10);
-    }
+    bmp085_ctx.up = (23843L + BENCH_IN(n, 4)) << OSS;
+    i2c_BMP085_Calculate();
 }
+#endif
 
-uint8_t WMP_getRawADC(void)
+#if defined(MS561101BA)
+static void benchMs5611(uint16_t n)
 {
-    uint8_t axis;
-#if 0
-    TWBR = ((16000000L / I2C_SPEED) - 16) / 2;  // change the I2C clock rate
+    ms561101ba_ctx.up = 9085466 + BENCH_IN(n, 0);
+    i2c_MS561101BA_Calculate();
+}
 #endif
-    i2c_getSixRawADC(0xA4, 0x00);
 
-    if (micros() < (neutralizeTime + NEUTRALIZE_DELAY)) {       //we neutralize data in case of blocking+hard reset state
-        for (axis = 0; axis < 3; axis++) {
-            gyroADC[axis] = 0;
-            accADC[axis] = 0;
-        }
-        accADC[YAW] = acc_1G;
-        return 1;
-    }
-    // Wii Motion Plus Data
-    if ((rawADC[5] & 0x03) == 0x02) {
-        // Assemble 14bit data 
-        gyroADC[ROLL] = -(((rawADC[5] >> 2) << 8) | rawADC[2]); //range: +/- 8192
-        gyroADC[PITCH] = -(((rawADC[4] >> 2) << 8) | rawADC[1]);
-        gyroADC[YAW] = -(((rawADC[3] >> 2) << 8) | rawADC[0]);
-        GYRO_Common();
-        // Check if slow bit is set and normalize to fast mode range
-        gyroADC[ROLL] = (rawADC[3] & 0x01) ? gyroADC[ROLL] / 5 : gyroADC[ROLL]; //the ratio 1/5 is not exactly the IDG600 or ISZ650 specification 
-        gyroADC[PITCH] = (rawADC[4] & 0x02) >> 1 ? gyroADC[PITCH] / 5 : gyroADC[PITCH]; //we detect here the slow of fast mode WMP gyros values (see wiibrew for more details)
-        gyroADC[YAW] = (rawADC[3] & 0x02) >> 1 ? gyroADC[YAW] / 5 : gyroADC[YAW];       // this step must be done after zero compensation    
-        return 1;
-    } else if ((rawADC[5] & 0x03) == 0x00) {    // Nunchuk Data
-        ACC_ORIENTATION(((rawADC[3] << 2) | ((rawADC[5] >> 4) & 0x02)), -((rawADC[2] << 2) | ((rawADC[5] >> 3) & 0x02)), (((rawADC[4] >> 1) << 3) | ((rawADC[5] >> 5) & 0x06)));
-        ACC_Common();
-        return 0;
-    } else
-        return 2;
+#if defined(VBAT) && (defined(LOG_VALUES) || (POWERMETER == 1))
+static void benchPower(uint16_t n)
+{
+    uint8_t i;
+
+    currentTime += 2800;
+    for (i = 0; i < numberMotor; i++)
+        motor[i] = 1500 + BENCH_IN(n, i * 2) * 2;
+    logMotorsPower();
 }
-#endif                          /* !GYRO */
+#endif
 
-void initSensors(void)
-{
-    i2c_init();
-    spi_init();
-    delay(100);
-#if GYRO
-    Gyro_init();
-#else
-    WMP_init(250);
+static const benchKernel_t benchKernels[] = {
+#if !defined(STAB_OLD_17)
+    { "_atan2", benchAtan2 },
+    { "rotateV", benchRotateV },
 #endif
-#if BARO
-    Baro_init();
+    { "InvSqrt", benchInvSqrt },
+    { "getEstimatedAttitude", benchAttitude },
+    { "getEstimatedAttitude+angles", benchAttitudeOut },
+    { "pidCompute", benchPid },
+    { "sensorPass", benchFilter },
+    { "mixTable", benchMix },
+    { "computeRC", benchRC },
+    { "annexCode", benchRcShape },
+#if defined(BMP085)
+    { "i2c_BMP085_Temperature", benchBaroTemp },
+    { "i2c_BMP085_Calculate", benchBaro },
 #endif
-#if ACC
-    ACC_init();
-    acc_25deg = acc_1G * 0.423;
+#if defined(MS561101BA)
+    { "i2c_MS561101BA_Calculate", benchMs5611 },
 #endif
-#if MAG
-    Mag_init();
+#if defined(VBAT) && (defined(LOG_VALUES) || (POWERMETER == 1))
+    { "logMotorsPower", benchPower },
 #endif
+};
+
+static uint32_t benchBatch(void (*run)(uint16_t n))
+{
+    uint32_t start;
+    uint16_t n;
+
+    start = cycles();
+    for (n = 0; n < BENCH_RUNS; n++)
+        run(n);
+    return cycles() - start;
 }
 
-/* SERIAL ---------------------------------------------------------------- */
-void serialCom(void)
+static void benchString(const char *s)
 {
-    int16_t a;
-    uint8_t i;
+    while (*s)
+        serialize8(*s++);
+}
 
-    uint16_t intPowerMeterSum, intPowerTrigger1;
-
-    if ((!Serial_isTxBusy()) && Serial_available()) {
-        switch (Serial_read()) {
-#ifdef BTSERIAL
-        case 'K':              //receive RC data from Bluetooth Serial adapter as a remote
-            rcData[THROTTLE] = (Serial.read() * 4) + 1000;
-            rcData[ROLL] = (Serial.read() * 4) + 1000;
-            rcData[PITCH] = (Serial.read() * 4) + 1000;
-            rcData[YAW] = (Serial.read() * 4) + 1000;
-            rcData[AUX1] = (Serial.read() * 4) + 1000;
-            break;
-#endif
-#ifdef LCD_TELEMETRY
-        case 'A':              // button A press
-            if (telemetry == 'A')
-                telemetry = 0;
-            else {
-                telemetry = 'A';
-                LCDprint(12);   /* clear screen */
-            }
-            break;
-        case 'B':              // button B press
-            if (telemetry == 'B')
-                telemetry = 0;
-            else {
-                telemetry = 'B';
-                LCDprint(12);   /* clear screen */
-            }
-            break;
-        case 'C':              // button C press
-            if (telemetry == 'C')
-                telemetry = 0;
-            else {
-                telemetry = 'C';
-                LCDprint(12);   /* clear screen */
-            }
-            break;
-        case 'D':              // button D press
-            if (telemetry == 'D')
-                telemetry = 0;
-            else {
-                telemetry = 'D';
-                LCDprint(12);   /* clear screen */
-            }
-            break;
-        case 'a':              // button A release
-        case 'b':              // button B release
-        case 'c':              // button C release
-        case 'd':              // button D release
-            break;
+static void benchNumber(uint32_t v)
+{
+    char buf[11];
+    uint8_t i = sizeof(buf);
+
+    buf[--i] = 0;
+    do {
+        buf[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    benchString(&buf[i]);
+}
+
+// one line, a frame of its own, sent before the next is built
+static void benchLine(const char *name, uint32_t calls, uint32_t total)
+{
+    while (Serial_isTxBusy());
+    Serial_reset();
+    benchString(name);
+    if (calls) {
+        serialize8(',');
+        benchNumber(calls);
+        serialize8(',');
+        benchNumber(total);
+        serialize8(',');
+        benchNumber(total / calls);
+        serialize8(',');
+        benchNumber(CYCLES_PER_US);
+    }
+    serialize8('\r');
+    serialize8('\n');
+    Serial_commitBuffer();
+}
+
+void kernelBench(void)
+{
+    static uint8_t ready = 0;
+    uint32_t none, total;
+    uint8_t k;
+
+    if (!ready) {
+        LEDPIN_PINMODE;
+        Serial_begin(SERIAL_COM_SPEED);
+        readEEPROM();
+        checkFirstTime();
+        mixerConfiguration = MULTITYPE_QUADX;       // the same mixer everywhere, and no servos to drive
+        mixerSelect();
+        acc_1G = 256;
+        vbat = 111;
+        cycleTime = 2800;
+#if defined(BMP085)
+        // the calibration example of the datasheet
+        bmp085_ctx.ac1 = 408;
+        bmp085_ctx.ac2 = -72;
+        bmp085_ctx.ac3 = -14383;
+        bmp085_ctx.ac4 = 32741;
+        bmp085_ctx.ac5 = 32757;
+        bmp085_ctx.ac6 = 23153;
+        bmp085_ctx.b1 = 6190;
+        bmp085_ctx.b2 = 4;
+        bmp085_ctx.mb = -32768;
+        bmp085_ctx.mc = -8711;
+        bmp085_ctx.md = 2868;
+        bmp085_ctx.ut = 27898;
+        i2c_BMP085_Temperature();
 #endif
-        case 'M':              // Multiwii @ arduino to GUI all data
-            Serial_reset();
-            serialize8('M');
-            serialize8(VERSION);        // MultiWii Firmware version
-            for (i = 0; i < 3; i++)
-                serialize16(accSmooth[i]);
-            for (i = 0; i < 3; i++)
-                serialize16(gyroData[i] / 8);
-            for (i = 0; i < 3; i++)
-                serialize16(magADC[i] / 3);
-            serialize16(EstAlt / 10);
-            serialize16(heading);       // compass
-            for (i = 0; i < 4; i++)
-                serialize16(servo[i]);
-            for (i = 0; i < 8; i++)
-                serialize16(motor[i]);
-            for (i = 0; i < 8; i++)
-                serialize16(rcData[i]);
-            serialize8(nunchuk | ACC << 1 | BARO << 2 | MAG << 3 | GPSPRESENT << 4);
-            serialize8(accMode | baroMode << 1 | magMode << 2 | (GPSModeHome | GPSModeHold) << 3);
-            serialize16(cycleTime);
-            for (i = 0; i < 2; i++)
-                serialize16(angle[i] / 10);
-            serialize8(mixerConfiguration > 10 ? 11 : mixerConfiguration); // hack for multiwiiConf GUI
-            for (i = 0; i < 5; i++) {
-                serialize8(P8[i]);
-                serialize8(I8[i]);
-                serialize8(D8[i]);
-            }
-            serialize8(P8[PIDLEVEL]);
-            serialize8(I8[PIDLEVEL]);
-            serialize8(P8[PIDMAG]);
-            serialize8(rcRate8);
-            serialize8(rcExpo8);
-            serialize8(rollPitchRate);
-            serialize8(yawRate);
-            serialize8(dynThrPID);
-            for (i = 0; i < 8; i++)
-                serialize8(activate[i]);
-            serialize16(GPS_distanceToHome);
-            serialize16(GPS_directionToHome);
-            serialize8(GPS_numSat);
-            serialize8(GPS_fix);
-            serialize8(GPS_update);
-#if defined(POWERMETER)
-            intPowerMeterSum = (pMeter[PMOTOR_SUM] / PLEVELDIV);
-            intPowerTrigger1 = powerTrigger1 * PLEVELSCALE;
-            serialize16(intPowerMeterSum);
-            serialize16(intPowerTrigger1);
-#else
-            serialize16(0);
-            serialize16(0);
-#endif
-            serialize8(vbat);
-            serialize16(BaroAlt / 10);  // 4 variables are here for general monitoring purpose
-            serialize16(i2cErrorCounter);     // debug2
-            serialize16(0);     // debug3
-            serialize16(0);     // debug4
-            serialize8('M');
-            Serial_commitBuffer();     // Serial.write(s,point);
-            break;
-        case 'O':              // arduino to OSD data - contribution from MIS
-            Serial_reset();
-            serialize8('O');
-            for (i = 0; i < 3; i++)
-                serialize16(accSmooth[i]);
-            for (i = 0; i < 3; i++)
-                serialize16(gyroData[i]);
-            serialize16(EstAlt * 10.0f);
-            serialize16(heading);       // compass - 16 bytes
-            for (i = 0; i < 2; i++)
-                serialize16(angle[i]);  //20
-            for (i = 0; i < 6; i++)
-                serialize16(motor[i]);  //32
-            for (i = 0; i < 6; i++) {
-                serialize16(rcData[i]);
-            }                   //44
-            serialize8(nunchuk | ACC << 1 | BARO << 2 | MAG << 3);
-            serialize8(accMode | baroMode << 1 | magMode << 2);
-            serialize8(vbat);   // Vbatt 47
-            serialize8(VERSION);        // MultiWii Firmware version
-            serialize8('O');    //49
-            Serial_commitBuffer();
-            break;
-        case 'R':
-            systemReboot();
-            break;
-        case 'W':              //GUI write params to eeprom @ arduino
-            while (Serial_available() < 33) { }
-            for (i = 0; i < 5; i++) {
-                P8[i] = Serial_read();
-                I8[i] = Serial_read();
-                D8[i] = Serial_read();
-            }                   // 15
-            P8[PIDLEVEL] = Serial_read();
-            I8[PIDLEVEL] = Serial_read();       // 17
-            P8[PIDMAG] = Serial_read(); // 18
-            rcRate8 = Serial_read();
-            rcExpo8 = Serial_read();    // 20
-            rollPitchRate = Serial_read();
-            yawRate = Serial_read();    // 22
-            dynThrPID = Serial_read();  // 23
-            for (i = 0; i < 8; i++)
-                activate[i] = Serial_read();    // 31
-#if defined(POWERMETER)
-            powerTrigger1 = (Serial_read() + 256 * Serial_read()) / PLEVELSCALE;        // we rely on writeParams() to compute corresponding pAlarm value
-#else
-            Serial_read();
-            Serial_read();      // so we unload the two bytes
+#if defined(MS561101BA)
+        // the datasheet's example, D1 9085466 and D2 8569150 come out at 100009 Pa
+        ms561101ba_ctx.c[1] = 40127;
+        ms561101ba_ctx.c[2] = 36924;
+        ms561101ba_ctx.c[3] = 23317;
+        ms561101ba_ctx.c[4] = 23282;
+        ms561101ba_ctx.c[5] = 33464;
+        ms561101ba_ctx.c[6] = 28312;
+        ms561101ba_ctx.c5s = (uint32_t) ms561101ba_ctx.c[5] << 8;
+        ms561101ba_ctx.ut = 8569150;
+        ms561101ba_temperature();
 #endif
-            writeParams();
-            break;
-        case 'S':              //GUI to arduino ACC calibration request
-            calibratingA = 400;
-            break;
-        case 'E':              //GUI to arduino MAG calibration request
-            calibratingM = 1;
-            break;
-
-        case 'G':               // GUI to multiwii - gimbal tuning parameters
-            while (Serial_available() < 3) { }
-            gimbalFlags = Serial_read();
-            gimbalGainPitch = Serial_read();
-            gimbalGainRoll = Serial_read();
-            writeParams();
-            break;
+        ready = 1;
+    }
 
-        case 'X':              // GUI to change mixer type. command is X+ascii A + MULTITYPE_XXXX index. i.e. XA for tri, XB for Quad+, XC for QuadX, etc.
-            while (Serial_available() < 1) { }
-            i = Serial_read();
-            Serial_reset();
-            if (i > 64 && i < 64 + MULTITYPE_LAST) {
-                serialize8('O');
-                serialize8('K');
-                Serial_commitBuffer();
-                mixerConfiguration = i - '@'; // A..B..C.. index
-                writeParams();
-                systemReboot();
-                break;
-            }
-            serialize8('N');
-            serialize8('G');
-            Serial_commitBuffer();
-            break;
-        }
+    LEDPIN_ON;
+    none = benchBatch(benchNone);
+    benchLine("kernel,calls,cycles,per_call,cycles_per_us", 0, 0);
+    for (k = 0; k < sizeof(benchKernels) / sizeof(benchKernels[0]); k++) {
+        total = benchBatch(benchKernels[k].run);
+        benchLine(benchKernels[k].name, BENCH_RUNS, total > none ? total - none : 0);
     }
+    benchLine("end", 0, 0);
+    LEDPIN_OFF;
+    delay(1000);
 }
+#endif
@@ -0,0 +1,852 @@
+/* Host side decoder for the BLACKBOX recorder (see the blackbox section in MultiWii_afro.c)
+ *
+ * Reads a capture of the serial link (or of the USB CDC port), picks the 0xB8 chunks out of whatever else
+ * was on the wire and decodes the records they carry. Everything is done in one pass with fixed size state,
+ * so a capture of any length can be piped through:
+ *   gcc -O2 -o blackbox_decode blackbox_decode.c -lm
+ *   ./blackbox_decode csv flight.bin > flight.csv
+ *
+ * Commands:
+ *   csv       one line per record: time_us, then the fields (gyro[3], acc[3], P[3], I[3], D[3], motor[], rc[4]).
+ *             Each log starts with a "# log n" line and a column header, CAMTRIG shots are "# shot" lines
+ *   jitter    record interval statistics. With BLACKBOX=1 every loop is logged and this is the cycleTime.
+ *             Also counts the loop overruns the board logged
+ *   spectrum  gyro power spectral density per axis (Welch, 256 point Hann windows, 50% overlap), in dB
+ *   step      roll/pitch/yaw step response from rcCommand to gyro (averaged transfer function of 512 point
+ *             windows with stick activity, normalized to 1), plus rise time and overshoot
+ *   sysid     Bode plot of the plant (axisPID to gyro) from the SYSID excitation runs, per axis, and its delay
+ *             from the slope of the phase
+ * -r before the command reads a file that holds the record stream only, without the serial chunks.
+ * The file defaults to stdin.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#define BB_SYNC             0xB8
+#define BB_FIELDS_MAX       (15 + 8 + 4)
+#define SPECTRUM_N          256
+#define STEP_N              512
+#define STEP_LEN            (STEP_N / 2)        // response samples reported
+#define STEP_MIN_RC         20.0                // rcCommand rms of a window that counts as stick activity
+#define SYSID_N             512
+#define SYSID_MIN_COHERENCE 0.8                 // bins the delay fit and the report take
+
+// ************************************************************************************************************
+// Input: serial chunks or raw records, one byte at a time
+// ************************************************************************************************************
+static FILE *in;
+static int rawInput = 0;
+static uint8_t chunk[256];
+static int chunkLen = 0, chunkPos = 0;
+static uint8_t back[258];                       // bytes to scan again after a chunk failed its checksum
+static int backLen = 0, backPos = 0;
+static unsigned long badChunks = 0;
+
+static int wireByte(void)
+{
+    if (backPos < backLen)
+        return back[backPos++];
+    return getc(in);
+}
+
+// next byte of the record stream, EOF at the end of the input
+static int nextByte(void)
+{
+    int c, len, i, check;
+    uint8_t frame[257];
+
+    if (rawInput)
+        return getc(in);
+    while (chunkPos >= chunkLen) {
+        do {
+            c = wireByte();
+        } while (c != EOF && c != BB_SYNC);
+        if (c == EOF || (len = wireByte()) == EOF)
+            return EOF;
+        check = len;
+        for (i = 0; i <= len; i++) {
+            if ((c = wireByte()) == EOF)
+                return EOF;
+            frame[i] = c;
+            if (i < len)
+                check ^= c;
+        }
+        if (check == frame[len]) {
+            memcpy(chunk, frame, len);
+            chunkLen = len;
+            chunkPos = 0;
+        } else {
+            // not a chunk after all, the sync byte may have been data: rescan what follows it
+            badChunks++;
+            i = backLen - backPos;
+            memmove(back + 1 + len + 1, back + backPos, i);
+            back[0] = len;
+            memcpy(back + 1, frame, len + 1);
+            backLen = i + len + 2;
+            backPos = 0;
+        }
+    }
+    return chunk[chunkPos++];
+}
+
+static int getU(uint32_t *v)
+{
+    int c, shift = 0;
+
+    *v = 0;
+    do {
+        if ((c = nextByte()) == EOF || shift > 28)
+            return 0;
+        *v |= (uint32_t)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 1;
+}
+
+static int getS(int32_t *v)
+{
+    uint32_t u;
+
+    if (!getU(&u))
+        return 0;
+    *v = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+    return 1;
+}
+
+// ************************************************************************************************************
+// Records
+// ************************************************************************************************************
+typedef struct {
+    uint32_t version, fields, motors, divider, acc1G, refCycle;
+} bbHeader_t;
+
+typedef struct {
+    uint32_t axis, kind, amplitude, f0, f1, duration;
+} bbSysid_t;
+
+typedef struct {
+    void (*header)(const bbHeader_t *h, int log);
+    void (*frame)(const bbHeader_t *h, uint32_t time, const int32_t *f, int intra);
+    void (*end)(const bbHeader_t *h, uint32_t dropped);
+    void (*overrun)(const bbHeader_t *h, uint32_t time, uint32_t cycleTime, uint32_t task);
+    void (*sysidStart)(const bbHeader_t *h, const bbSysid_t *x);
+    // dt since the previous record, the injection, axisPID with it and the gyro of the run's axis
+    void (*sysidSample)(const bbHeader_t *h, uint32_t dt, int32_t in, int32_t cmd, int32_t gyro);
+    void (*camera)(const bbHeader_t *h, uint32_t shot, uint32_t edge);
+} bbSink_t;
+
+static unsigned long records = 0, badRecords = 0;
+
+static void decode(const bbSink_t *sink)
+{
+    bbHeader_t h;
+    bbSysid_t x;
+    int32_t f[BB_FIELDS_MAX], v, s[3];
+    uint32_t time = 0, u, v32;
+    int c, i, log = 0, haveHeader = 0, haveI = 0, haveX = 0;
+
+    while ((c = nextByte()) != EOF) {
+        switch (c) {
+        case 'H':
+            if (!getU(&h.version) || !getU(&h.fields) || !getU(&h.motors) || !getU(&h.divider)
+                || !getU(&h.acc1G) || !getU(&h.refCycle))
+                return;
+            if (h.version < 1 || h.version > 4 || h.fields > BB_FIELDS_MAX || h.fields != 15 + h.motors + 4) {
+                fprintf(stderr, "blackbox_decode: unsupported header (version %lu, %lu fields)\n",
+                        (unsigned long) h.version, (unsigned long) h.fields);
+                haveHeader = 0;
+                break;
+            }
+            haveHeader = 1;
+            haveI = 0;
+            haveX = 0;
+            if (sink->header)
+                sink->header(&h, ++log);
+            break;
+        case 'I':
+            if (!haveHeader)
+                goto lost;
+            if (!getU(&time))
+                return;
+            for (i = 0; i < (int) h.fields; i++)
+                if (!getS(&f[i]))
+                    return;
+            haveI = 1;
+            records++;
+            if (sink->frame)
+                sink->frame(&h, time, f, 1);
+            break;
+        case 'P':
+            if (!haveHeader || !haveI)
+                goto lost;
+            if (!getU(&u))
+                return;
+            time += u;
+            for (i = 0; i < (int) h.fields; i++) {
+                if (!getS(&v))
+                    return;
+                f[i] += v;
+            }
+            records++;
+            if (sink->frame)
+                sink->frame(&h, time, f, 0);
+            break;
+        case 'O':
+            if (!haveHeader)
+                goto lost;
+            if (!getU(&u) || !getU(&v32))
+                return;
+            if (sink->overrun)
+                sink->overrun(&h, time, u, v32);
+            break;
+        case 'X':
+            if (!haveHeader)
+                goto lost;
+            if (!getU(&x.axis) || !getU(&x.kind) || !getU(&x.amplitude) || !getU(&x.f0) || !getU(&x.f1)
+                || !getU(&x.duration))
+                return;
+            haveX = x.axis < 3;
+            if (haveX && sink->sysidStart)
+                sink->sysidStart(&h, &x);
+            break;
+        case 'S':
+            // the time is only a step: samples can come before the first 'I'
+            if (!haveHeader || !haveX)
+                goto lost;
+            if (!getU(&u) || !getS(&s[0]) || !getS(&s[1]) || !getS(&s[2]))
+                return;
+            time += u;
+            records++;
+            if (sink->sysidSample)
+                sink->sysidSample(&h, u, s[0], s[1], s[2]);
+            break;
+        case 'C':
+            if (!haveHeader)
+                goto lost;
+            if (!getU(&u) || !getU(&v32))
+                return;
+            if (sink->camera)
+                sink->camera(&h, u, v32);
+            break;
+        case 'E':
+            if (!getU(&u))
+                return;
+            if (haveHeader && sink->end)
+                sink->end(&h, u);
+            haveHeader = 0;
+            break;
+        default:
+        lost:
+            // a byte out of step (a chunk lost on the wire): wait for the next header or intra record
+            badRecords++;
+            haveI = 0;
+            haveX = 0;
+            break;
+        }
+    }
+}
+
+// ************************************************************************************************************
+// csv
+// ************************************************************************************************************
+static void csvHeader(const bbHeader_t *h, int log)
+{
+    const char *axis = "rpy";
+    uint32_t i;
+
+    printf("# log %d: %lu motors, every %lu loop(s), acc_1G %lu, PID_REF_CYCLE %lu\n", log,
+           (unsigned long) h->motors, (unsigned long) h->divider, (unsigned long) h->acc1G,
+           (unsigned long) h->refCycle);
+    printf("time");
+    for (i = 0; i < 3; i++)
+        printf(",gyro_%c", axis[i]);
+    for (i = 0; i < 3; i++)
+        printf(",acc_%c", axis[i]);
+    for (i = 0; i < 3; i++)
+        printf(",P_%c", axis[i]);
+    for (i = 0; i < 3; i++)
+        printf(",I_%c", axis[i]);
+    for (i = 0; i < 3; i++)
+        printf(",D_%c", axis[i]);
+    for (i = 0; i < h->motors; i++)
+        printf(",motor%lu", (unsigned long) i);
+    printf(",rc_roll,rc_pitch,rc_yaw,rc_throttle\n");
+}
+
+static void csvFrame(const bbHeader_t *h, uint32_t time, const int32_t *f, int intra)
+{
+    uint32_t i;
+
+    printf("%lu", (unsigned long) time);
+    for (i = 0; i < h->fields; i++)
+        printf(",%ld", (long) f[i]);
+    printf("\n");
+}
+
+static void csvEnd(const bbHeader_t *h, uint32_t dropped)
+{
+    printf("# end, %lu records dropped on the board\n", (unsigned long) dropped);
+}
+
+static void csvSysidStart(const bbHeader_t *h, const bbSysid_t *x)
+{
+    printf("# sysid axis %lu, %s, amplitude %lu, %.1f..%.1f Hz for %.1f s, 'S' samples left out\n",
+           (unsigned long) x->axis, x->kind == 1 ? "step" : "chirp", (unsigned long) x->amplitude, x->f0 / 10.0,
+           x->f1 / 10.0, x->duration / 10.0);
+}
+
+static void csvOverrun(const bbHeader_t *h, uint32_t time, uint32_t cycleTime, uint32_t task)
+{
+    if (task == 0xFF)
+        printf("# overrun after %lu: cycleTime %lu us, no task\n", (unsigned long) time, (unsigned long) cycleTime);
+    else
+        printf("# overrun after %lu: cycleTime %lu us, task %lu\n", (unsigned long) time, (unsigned long) cycleTime,
+               (unsigned long) task);
+}
+
+// the edge time is the board's micros(), the same clock as the 'I' record times
+static void csvCamera(const bbHeader_t *h, uint32_t shot, uint32_t edge)
+{
+    printf("# shot %lu at %lu\n", (unsigned long) shot, (unsigned long) edge);
+}
+
+// ************************************************************************************************************
+// jitter
+// ************************************************************************************************************
+#define JITTER_BINS         1000                // 10us bins of the per loop interval, up to 10ms
+
+static struct {
+    uint32_t lastTime;
+    int have;
+    unsigned long n, bins[JITTER_BINS + 1];
+    double sum, sumSq, min, max;
+    double recordSum;                   // us, record to record
+    unsigned long dropped;
+    unsigned long overruns;
+    uint32_t overrunMax;                // us, cycleTime
+} jit;
+
+static void jitterHeader(const bbHeader_t *h, int log)
+{
+    jit.have = 0;
+}
+
+// time and sample rate of the analysis sinks
+static void intervalTrack(const bbHeader_t *h, uint32_t time)
+{
+    double dt;
+
+    if (jit.have) {
+        dt = (uint32_t)(time - jit.lastTime);
+        jit.recordSum += dt;
+        dt /= h->divider;
+        jit.n++;
+        jit.sum += dt;
+        jit.sumSq += dt * dt;
+        if (jit.n == 1 || dt < jit.min)
+            jit.min = dt;
+        if (jit.n == 1 || dt > jit.max)
+            jit.max = dt;
+        jit.bins[dt / 10 < JITTER_BINS ? (int)(dt / 10) : JITTER_BINS]++;
+    }
+    jit.lastTime = time;
+    jit.have = 1;
+}
+
+static void jitterFrame(const bbHeader_t *h, uint32_t time, const int32_t *f, int intra)
+{
+    intervalTrack(h, time);
+}
+
+static void jitterEnd(const bbHeader_t *h, uint32_t dropped)
+{
+    jit.dropped += dropped;
+}
+
+static void jitterOverrun(const bbHeader_t *h, uint32_t time, uint32_t cycleTime, uint32_t task)
+{
+    jit.overruns++;
+    if (cycleTime > jit.overrunMax)
+        jit.overrunMax = cycleTime;
+}
+
+static double percentile(double p)
+{
+    unsigned long want = (unsigned long)(p * jit.n), seen = 0;
+    int i;
+
+    for (i = 0; i <= JITTER_BINS; i++) {
+        seen += jit.bins[i];
+        if (seen > want)
+            return i * 10 + 5;
+    }
+    return JITTER_BINS * 10;
+}
+
+static void jitterReport(void)
+{
+    double mean, sd;
+
+    if (!jit.n) {
+        printf("no intervals\n");
+        return;
+    }
+    mean = jit.sum / jit.n;
+    sd = sqrt(fmax(jit.sumSq / jit.n - mean * mean, 0));
+    printf("intervals      %lu (per loop, divided by the header's BLACKBOX)\n", jit.n);
+    printf("mean           %.1f us (%.1f Hz)\n", mean, 1e6 / mean);
+    printf("std dev        %.1f us\n", sd);
+    printf("min / max      %.0f / %.0f us\n", jit.min, jit.max);
+    printf("p50 p99 p99.9  %.0f %.0f %.0f us (10us bins)\n", percentile(0.5), percentile(0.99), percentile(0.999));
+    printf("dropped        %lu records on the board\n", jit.dropped);
+    printf("overruns       %lu loops past LOOP_OVERRUN, longest %lu us\n", jit.overruns, (unsigned long) jit.overrunMax);
+}
+
+// ************************************************************************************************************
+// FFT, in place radix 2
+// ************************************************************************************************************
+static void fft(double *re, double *im, int n, int inverse)
+{
+    int i, j, k, len;
+    double t;
+
+    for (i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for (len = 2; len <= n; len <<= 1) {
+        double a = (inverse ? 2 : -2) * M_PI / len;
+        for (i = 0; i < n; i += len) {
+            for (k = 0; k < len / 2; k++) {
+                double wr = cos(a * k), wi = sin(a * k);
+                double *ur = &re[i + k], *ui = &im[i + k], *vr = &re[i + k + len / 2], *vi = &im[i + k + len / 2];
+                double xr = *vr * wr - *vi * wi, xi = *vr * wi + *vi * wr;
+                *vr = *ur - xr;
+                *vi = *ui - xi;
+                *ur += xr;
+                *ui += xi;
+            }
+        }
+    }
+    if (inverse)
+        for (i = 0; i < n; i++) {
+            re[i] /= n;
+            im[i] /= n;
+        }
+}
+
+static double hann(int i, int n)
+{
+    return 0.5 - 0.5 * cos(2 * M_PI * i / n);
+}
+
+// records per second, from the intervals seen so far
+static double recordRate(void)
+{
+    return jit.recordSum > 0 ? 1e6 * jit.n / jit.recordSum : 0;
+}
+
+// ************************************************************************************************************
+// spectrum
+// ************************************************************************************************************
+static struct {
+    double ring[3][SPECTRUM_N];
+    int head, fill, sinceLast;
+    double psd[3][SPECTRUM_N / 2 + 1];
+    unsigned long windows;
+} spec;
+
+static void spectrumHeader(const bbHeader_t *h, int log)
+{
+    jitterHeader(h, log);
+    spec.fill = 0;              // a window never spans two logs
+    spec.sinceLast = 0;
+}
+
+static void spectrumFrame(const bbHeader_t *h, uint32_t time, const int32_t *f, int intra)
+{
+    double re[SPECTRUM_N], im[SPECTRUM_N], mean, w;
+    int axis, i, k;
+
+    intervalTrack(h, time);
+    for (axis = 0; axis < 3; axis++)
+        spec.ring[axis][spec.head] = f[axis];
+    spec.head = (spec.head + 1) % SPECTRUM_N;
+    if (spec.fill < SPECTRUM_N)
+        spec.fill++;
+    if (spec.fill < SPECTRUM_N || ++spec.sinceLast < SPECTRUM_N / 2)
+        return;
+    spec.sinceLast = 0;
+    for (axis = 0; axis < 3; axis++) {
+        for (i = 0, mean = 0; i < SPECTRUM_N; i++)
+            mean += spec.ring[axis][i];
+        mean /= SPECTRUM_N;
+        for (i = 0; i < SPECTRUM_N; i++) {
+            re[i] = (spec.ring[axis][(spec.head + i) % SPECTRUM_N] - mean) * hann(i, SPECTRUM_N);
+            im[i] = 0;
+        }
+        fft(re, im, SPECTRUM_N, 0);
+        for (k = 0; k <= SPECTRUM_N / 2; k++) {
+            w = re[k] * re[k] + im[k] * im[k];
+            spec.psd[axis][k] += (k == 0 || k == SPECTRUM_N / 2) ? w : 2 * w;
+        }
+    }
+    spec.windows++;
+}
+
+static void spectrumReport(void)
+{
+    double rate = recordRate(), norm = 0;
+    int i, k;
+
+    if (!spec.windows || rate <= 0) {
+        printf("# not enough data for a %d point window\n", SPECTRUM_N);
+        return;
+    }
+    for (i = 0; i < SPECTRUM_N; i++)
+        norm += hann(i, SPECTRUM_N) * hann(i, SPECTRUM_N);
+    printf("# gyro PSD over %lu windows at %.1f records/s, dB of gyro units^2/Hz\n", spec.windows, rate);
+    printf("freq_hz,roll,pitch,yaw\n");
+    for (k = 0; k <= SPECTRUM_N / 2; k++) {
+        printf("%.2f", k * rate / SPECTRUM_N);
+        for (i = 0; i < 3; i++)
+            printf(",%.2f", 10 * log10(spec.psd[i][k] / (spec.windows * norm * rate) + 1e-12));
+        printf("\n");
+    }
+}
+
+// ************************************************************************************************************
+// step
+// ************************************************************************************************************
+// H1 estimate per axis: the cross spectrum of rcCommand to gyro over the auto spectrum of rcCommand, both
+// summed over the windows where the stick moved. Its inverse FFT is the impulse response, the running sum of
+// that the step response, normalized to its mean over the second half of what is reported.
+#define FIELD_RC            (15 + h->motors)     // rcCommand[ROLL] in the record
+
+static struct {
+    double in[3][STEP_N], out[3][STEP_N];
+    int head, fill, sinceLast;
+    double sxyRe[3][STEP_N], sxyIm[3][STEP_N], sxx[3][STEP_N];
+    unsigned long windows[3];
+} step;
+
+static void stepHeader(const bbHeader_t *h, int log)
+{
+    jitterHeader(h, log);
+    step.fill = 0;
+    step.sinceLast = 0;
+}
+
+static void stepFrame(const bbHeader_t *h, uint32_t time, const int32_t *f, int intra)
+{
+    double xr[STEP_N], xi[STEP_N], yr[STEP_N], yi[STEP_N], mx, my, rms, w;
+    int axis, i, k, j;
+
+    intervalTrack(h, time);
+    for (axis = 0; axis < 3; axis++) {
+        step.in[axis][step.head] = f[FIELD_RC + axis];
+        step.out[axis][step.head] = f[axis];
+    }
+    step.head = (step.head + 1) % STEP_N;
+    if (step.fill < STEP_N)
+        step.fill++;
+    if (step.fill < STEP_N || ++step.sinceLast < STEP_N / 2)
+        return;
+    step.sinceLast = 0;
+    for (axis = 0; axis < 3; axis++) {
+        for (i = 0, mx = my = 0; i < STEP_N; i++) {
+            mx += step.in[axis][i];
+            my += step.out[axis][i];
+        }
+        mx /= STEP_N;
+        my /= STEP_N;
+        for (i = 0, rms = 0; i < STEP_N; i++) {
+            j = (step.head + i) % STEP_N;
+            w = hann(i, STEP_N);
+            xr[i] = (step.in[axis][j] - mx) * w;
+            yr[i] = (step.out[axis][j] - my) * w;
+            xi[i] = yi[i] = 0;
+            rms += (step.in[axis][j] - mx) * (step.in[axis][j] - mx);
+        }
+        if (sqrt(rms / STEP_N) < STEP_MIN_RC)
+            continue;           // sticks still, nothing to learn about the response
+        fft(xr, xi, STEP_N, 0);
+        fft(yr, yi, STEP_N, 0);
+        for (k = 0; k < STEP_N; k++) {
+            step.sxyRe[axis][k] += xr[k] * yr[k] + xi[k] * yi[k];      // conj(X) Y
+            step.sxyIm[axis][k] += xr[k] * yi[k] - xi[k] * yr[k];
+            step.sxx[axis][k] += xr[k] * xr[k] + xi[k] * xi[k];
+        }
+        step.windows[axis]++;
+    }
+}
+
+static void stepReport(void)
+{
+    static const char *name[3] = { "roll", "pitch", "yaw" };
+    double re[STEP_N], im[STEP_N], resp[3][STEP_LEN], rate = recordRate(), eps, sum, ref;
+    double rise[3], peak[3];
+    int axis, k, t10, t90;
+
+    if (rate <= 0) {
+        printf("# no data\n");
+        return;
+    }
+    for (axis = 0; axis < 3; axis++) {
+        rise[axis] = peak[axis] = NAN;
+        if (!step.windows[axis]) {
+            for (k = 0; k < STEP_LEN; k++)
+                resp[axis][k] = NAN;
+            continue;
+        }
+        // regularize the bins the stick never excited
+        for (k = 0, eps = 0; k < STEP_N; k++)
+            eps += step.sxx[axis][k];
+        eps = eps / STEP_N * 1e-3;
+        for (k = 0; k < STEP_N; k++) {
+            re[k] = step.sxyRe[axis][k] / (step.sxx[axis][k] + eps);
+            im[k] = step.sxyIm[axis][k] / (step.sxx[axis][k] + eps);
+        }
+        fft(re, im, STEP_N, 1);
+        for (k = 0, sum = 0; k < STEP_LEN; k++) {
+            sum += re[k];
+            resp[axis][k] = sum;
+        }
+        for (k = STEP_LEN / 2, ref = 0; k < STEP_LEN; k++)
+            ref += resp[axis][k];
+        ref /= STEP_LEN - STEP_LEN / 2;
+        if (fabs(ref) < 1e-9)
+            continue;
+        for (k = 0, t10 = t90 = -1, peak[axis] = 0; k < STEP_LEN; k++) {
+            resp[axis][k] /= ref;
+            if (t10 < 0 && resp[axis][k] >= 0.1)
+                t10 = k;
+            if (t90 < 0 && resp[axis][k] >= 0.9)
+                t90 = k;
+            if (resp[axis][k] > peak[axis])
+                peak[axis] = resp[axis][k];
+        }
+        if (t10 >= 0 && t90 >= 0)
+            rise[axis] = (t90 - t10) * 1000.0 / rate;
+    }
+    printf("# step response rcCommand -> gyro at %.1f records/s, windows with stick activity:", rate);
+    for (axis = 0; axis < 3; axis++)
+        printf(" %s %lu", name[axis], step.windows[axis]);
+    printf("\n");
+    for (axis = 0; axis < 3; axis++)
+        printf("# %-5s rise 10-90%% %.1f ms, overshoot %.0f%%\n", name[axis], rise[axis], (peak[axis] - 1) * 100);
+    printf("time_ms,roll,pitch,yaw\n");
+    for (k = 0; k < STEP_LEN; k++)
+        printf("%.2f,%.3f,%.3f,%.3f\n", k * 1000.0 / rate, resp[0][k], resp[1][k], resp[2][k]);
+}
+
+// ************************************************************************************************************
+// sysid
+// ************************************************************************************************************
+// The excitation r goes in at the PID output, so with the loop closed the plant input u (axisPID) and output y
+// (gyro) both carry the feedback. The plant response is taken through r: P = Sry / Sru, the cross spectra
+// summed over the windows of every run on the axis. The coherence of r and y says which bins the wind and the
+// noise left alone, the delay is the least squares slope of the unwrapped phase over those.
+static struct {
+    double r[SYSID_N], u[SYSID_N], y[SYSID_N];
+    int axis, head, fill, sinceLast;
+    double sryRe[3][SYSID_N], sryIm[3][SYSID_N], sruRe[3][SYSID_N], sruIm[3][SYSID_N];
+    double srr[3][SYSID_N], syy[3][SYSID_N];
+    unsigned long windows[3], runs[3];
+    double dtSum[3];                    // us, sample to sample
+    unsigned long samples[3];
+    uint32_t f0[3], f1[3];              // 0.1Hz, the range the runs covered
+} sid;
+
+static void sysidHeader(const bbHeader_t *h, int log)
+{
+    sid.fill = 0;
+}
+
+static void sysidStart(const bbHeader_t *h, const bbSysid_t *x)
+{
+    uint32_t lo = x->f0 < x->f1 ? x->f0 : x->f1, hi = x->f0 < x->f1 ? x->f1 : x->f0;
+    int a = x->axis;
+
+    if (x->kind == 1)
+        hi = 0;                         // a step train, its harmonics go up to the sample rate. 0: no limit
+    if (!sid.runs[a]++) {
+        sid.f0[a] = lo;
+        sid.f1[a] = hi;
+    } else {
+        if (lo < sid.f0[a])
+            sid.f0[a] = lo;
+        if (!hi || (sid.f1[a] && hi > sid.f1[a]))
+            sid.f1[a] = hi;
+    }
+    sid.axis = a;
+    sid.fill = 0;                       // a window never spans two runs
+    sid.sinceLast = 0;
+}
+
+static void sysidSample(const bbHeader_t *h, uint32_t dt, int32_t in, int32_t cmd, int32_t gyro)
+{
+    double rr[SYSID_N], ri[SYSID_N], ur[SYSID_N], ui[SYSID_N], yr[SYSID_N], yi[SYSID_N], mr, mu, my, w;
+    int a = sid.axis, i, j, k;
+
+    if (sid.fill) {
+        sid.dtSum[a] += dt;
+        sid.samples[a]++;
+    }
+    sid.r[sid.head] = in;
+    sid.u[sid.head] = cmd;
+    sid.y[sid.head] = gyro;
+    sid.head = (sid.head + 1) % SYSID_N;
+    if (sid.fill < SYSID_N)
+        sid.fill++;
+    if (sid.fill < SYSID_N || ++sid.sinceLast < SYSID_N / 2)
+        return;
+    sid.sinceLast = 0;
+    for (i = 0, mr = mu = my = 0; i < SYSID_N; i++) {
+        mr += sid.r[i];
+        mu += sid.u[i];
+        my += sid.y[i];
+    }
+    mr /= SYSID_N;
+    mu /= SYSID_N;
+    my /= SYSID_N;
+    for (i = 0; i < SYSID_N; i++) {
+        j = (sid.head + i) % SYSID_N;
+        w = hann(i, SYSID_N);
+        rr[i] = (sid.r[j] - mr) * w;
+        ur[i] = (sid.u[j] - mu) * w;
+        yr[i] = (sid.y[j] - my) * w;
+        ri[i] = ui[i] = yi[i] = 0;
+    }
+    fft(rr, ri, SYSID_N, 0);
+    fft(ur, ui, SYSID_N, 0);
+    fft(yr, yi, SYSID_N, 0);
+    for (k = 0; k < SYSID_N; k++) {
+        sid.sryRe[a][k] += rr[k] * yr[k] + ri[k] * yi[k];      // conj(R) Y
+        sid.sryIm[a][k] += rr[k] * yi[k] - ri[k] * yr[k];
+        sid.sruRe[a][k] += rr[k] * ur[k] + ri[k] * ui[k];      // conj(R) U
+        sid.sruIm[a][k] += rr[k] * ui[k] - ri[k] * ur[k];
+        sid.srr[a][k] += rr[k] * rr[k] + ri[k] * ri[k];
+        sid.syy[a][k] += yr[k] * yr[k] + yi[k] * yi[k];
+    }
+    sid.windows[a]++;
+}
+
+static void sysidReport(void)
+{
+    static const char *name[3] = { "roll", "pitch", "yaw" };
+    double rate, f, d, pRe, pIm, coh, gain, phase, last, turn, sw, sf, sp, sff, sfp, tau;
+    int a, k, have = 0;
+
+    for (a = 0; a < 3; a++) {
+        if (!sid.windows[a] || !sid.samples[a])
+            continue;
+        rate = 1e6 * sid.samples[a] / sid.dtSum[a];
+        if (!have++)
+            printf("axis,freq_hz,gain_db,phase_deg,coherence\n");
+        last = turn = 0;
+        sw = sf = sp = sff = sfp = 0;
+        for (k = 1; k < SYSID_N / 2; k++) {
+            f = k * rate / SYSID_N;
+            if (f * 10 < sid.f0[a] || (sid.f1[a] && f * 10 > sid.f1[a]))
+                continue;
+            coh = sid.sryRe[a][k] * sid.sryRe[a][k] + sid.sryIm[a][k] * sid.sryIm[a][k];
+            coh /= sid.srr[a][k] * sid.syy[a][k] + 1e-30;
+            if (coh < SYSID_MIN_COHERENCE)
+                continue;
+            // P = Sry / Sru
+            d = sid.sruRe[a][k] * sid.sruRe[a][k] + sid.sruIm[a][k] * sid.sruIm[a][k] + 1e-30;
+            pRe = (sid.sryRe[a][k] * sid.sruRe[a][k] + sid.sryIm[a][k] * sid.sruIm[a][k]) / d;
+            pIm = (sid.sryIm[a][k] * sid.sruRe[a][k] - sid.sryRe[a][k] * sid.sruIm[a][k]) / d;
+            gain = 20 * log10(sqrt(pRe * pRe + pIm * pIm) + 1e-12);
+            phase = atan2(pIm, pRe) * 180 / M_PI;
+            // unwrap against the last bin taken
+            if (sw > 0) {
+                while (phase + turn - last > 180)
+                    turn -= 360;
+                while (phase + turn - last < -180)
+                    turn += 360;
+            }
+            phase += turn;
+            last = phase;
+            sw += coh;
+            sf += coh * f;
+            sp += coh * phase;
+            sff += coh * f * f;
+            sfp += coh * f * phase;
+            printf("%s,%.2f,%.2f,%.1f,%.3f\n", name[a], f, gain, phase, coh);
+        }
+        d = sw * sff - sf * sf;
+        tau = d > 0 ? -(sw * sfp - sf * sp) / d / 360 : NAN;     // deg/Hz to s
+        printf("# %-5s %lu run(s), %lu windows at %.1f samples/s, delay %.2f ms (%.1f loops) from the phase slope\n",
+               name[a], sid.runs[a], sid.windows[a], rate, tau * 1000, tau * rate);
+    }
+    if (!have)
+        printf("# no SYSID run with a whole %d sample window\n", SYSID_N);
+}
+
+// ************************************************************************************************************
+// main
+// ************************************************************************************************************
+static void usage(void)
+{
+    fprintf(stderr, "usage: blackbox_decode [-r] csv|jitter|spectrum|step|sysid [file]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static const bbSink_t csvSink = { csvHeader, csvFrame, csvEnd, csvOverrun, csvSysidStart, NULL, csvCamera };
+    static const bbSink_t jitterSink = { jitterHeader, jitterFrame, jitterEnd, jitterOverrun };
+    static const bbSink_t spectrumSink = { spectrumHeader, spectrumFrame, jitterEnd, NULL };
+    static const bbSink_t stepSink = { stepHeader, stepFrame, jitterEnd, NULL };
+    static const bbSink_t sysidSink = { sysidHeader, NULL, NULL, NULL, sysidStart, sysidSample };
+    const bbSink_t *sink;
+    void (*report)(void) = NULL;
+    int a = 1;
+
+    if (a < argc && !strcmp(argv[a], "-r")) {
+        rawInput = 1;
+        a++;
+    }
+    if (a >= argc)
+        usage();
+    if (!strcmp(argv[a], "csv")) {
+        sink = &csvSink;
+    } else if (!strcmp(argv[a], "jitter")) {
+        sink = &jitterSink;
+        report = jitterReport;
+    } else if (!strcmp(argv[a], "spectrum")) {
+        sink = &spectrumSink;
+        report = spectrumReport;
+    } else if (!strcmp(argv[a], "step")) {
+        sink = &stepSink;
+        report = stepReport;
+    } else if (!strcmp(argv[a], "sysid")) {
+        sink = &sysidSink;
+        report = sysidReport;
+    } else
+        usage();
+    a++;
+    in = stdin;
+    if (a < argc && !(in = fopen(argv[a], "rb"))) {
+        fprintf(stderr, "blackbox_decode: can't open %s\n", argv[a]);
+        return 1;
+    }
+
+    decode(sink);
+    if (report)
+        report();
+    fprintf(stderr, "blackbox_decode: %lu records, %lu bad chunks, %lu bytes out of step\n",
+            records, badChunks, badRecords);
+    return 0;
+}
@@ -11,10 +11,19 @@
  *  - STM32_CC  OpenPilot CopterControl
 
  * STM32F4      STMicro STM32F40x series
- *  - No targets currently
+ *  - F4DISCO   STM32F4DISCOVERY (F407VG) with an MPU6000 breakout on SPI2
+
+ * ATMEGA       Atmel ATmega644P/1284P against sysdep_avr.c, selected by building with avr-gcc (-mmcu=, -DF_CPU=)
+ *  - CSHRED    Shrediquette board (ATmega644PA, analog gyros and accelerometer, BL-Ctrl ESCs on I2C)
+
+ * HOSTSIM      Native Linux build against sysdep_host.c (software in the loop), selected with -DHOSTSIM
  */
 
+#if defined(__AVR__)
+#define ATMEGA
+#elif !defined(HOSTSIM)
 #define STM8
+#endif
 #ifdef STM8
 #define AFROV2                  // AfroFlight rev2 (ADXL345 on SPI, Invensense Analog gyros on ADC)
 // #define AFROV3                  // AfroFlight rev3 (MPU6000 on SPI, HMC5883L behind it)
@@ -25,6 +34,17 @@
 #ifdef STM32F1
 #define STM32_CC
 #define ATAVRSBIN1
+// #define CC_ADCGYRO              // the CopterControl's own IDG500/ISZ500 analog gyros, used when no ITG3200 answers
+// #define SERIAL_USART1           // GUI/telemetry on the USART1 main port (DMA) instead of USB CDC
+#endif
+
+// #define STM32F4
+#ifdef STM32F4
+#define F4DISCO
+#endif
+
+#ifdef ATMEGA
+#define CSHRED
 #endif
 
 
@@ -32,6 +52,9 @@
 #ifdef STM8
 /* Includes for STM8 */
 #include "stm8s.h"
+
+#define CYCLES_PER_US       1           // no cycle counter, cycles() is micros()
+#define SERIAL_SPEED_MAX    1000000     // fMASTER / 16
 #endif
 
 
@@ -39,10 +62,16 @@
 /* Includes for STM32F1xx */
 #include <stdint.h>
 #include <stdlib.h>
-#include <cross_studio_io.h>
 #include "misc.h"
 #include "stm32f10x_rcc.h"
 #include "stm32f10x_gpio.h"
+#include "stm32f10x_adc.h"
+#include "stm32f10x_dma.h"
+#include "stm32f10x_flash.h"
+#include "stm32f10x_i2c.h"
+#include "stm32f10x_spi.h"
+#include "stm32f10x_tim.h"
+#include "stm32f10x_usart.h"
 #include "usb/usb_cdcacm.h"
 #include "usb/usb.h"
 #include <string.h>
@@ -51,4 +80,94 @@
 #define digitalLo(p, i)    { p->BRR = i; }
 #define digitalToggle(p, i) { p->ODR ^= i; }
 
+#define CYCLES_PER_US       72          // cycles() is the DWT cycle counter
+
+#if !defined(SERIAL_USART1)
+#define TELEMETRY_PORT                  // the USB log interface carries the blackbox and stream frames
+#define SERIAL_SPEED_MAX    0           // USB CDC, there is no line rate
+#else
+#define SERIAL_SPEED_MAX    2000000     // the USB serial adapters, APB2 / 16 would be 4.5MBaud
+#endif
+#endif
+
+#ifdef STM32F4
+/* Includes for STM32F4xx */
+#include <stdint.h>
+#include <stdlib.h>
+#include "misc.h"
+#include "stm32f4xx_rcc.h"
+#include "stm32f4xx_gpio.h"
+#include "stm32f4xx_adc.h"
+#include "stm32f4xx_dma.h"
+#include "stm32f4xx_exti.h"
+#include "stm32f4xx_flash.h"
+#include "stm32f4xx_i2c.h"
+#include "stm32f4xx_spi.h"
+#include "stm32f4xx_syscfg.h"
+#include "stm32f4xx_tim.h"
+#include "stm32f4xx_usart.h"
+#include <string.h>
+
+#define digitalHi(p, i)    { p->BSRRL = i; }
+#define digitalLo(p, i)    { p->BSRRH = i; }
+#define digitalToggle(p, i) { p->ODR ^= i; }
+
+#define CYCLES_PER_US       168         // cycles() is the DWT cycle counter
+#define SERIAL_SPEED_MAX    2000000     // USART2 on APB1, 42MHz / 16 is 2.6MBaud
+
+// single precision FPU: the estimators use their float versions
+#define HW_FPU
+
+// the STM8 intrinsics the sensor drivers use. wfi re-enables interrupts there, a pending one wakes the core anyway
+#define disableInterrupts() __disable_irq()
+#define enableInterrupts() __enable_irq()
+#define wfi() { __WFI(); __enable_irq(); }
+#endif
+
+#if defined(STM32F1) || defined(STM32F4)
+/* Interrupt priorities. hw_init() selects NVIC_PriorityGroup_4, all four bits preempt and there are no
+   subpriorities, lower numbers preempt higher ones. The receiver and sensor paths come first, since their
+   timestamps are only as good as the entry latency. The bus sits above the data ready edge so the burst an
+   edge starts finishes while later edges wait. Serial DMA and the USB top half only move bytes, and the USB
+   handler proper (control transfers included) runs as a PendSV bottom half below everything. The LOOP_ISR inner
+   loop waits on the bus for its reads, it comes after all of them and only preempts main() and the bottom half */
+#define IRQ_PRIO_CAPTURE    0           // receiver timer captures and the serial RC receiver
+#define IRQ_PRIO_BUS        1           // sensor bus: SPI, SPI DMA complete, I2C events and errors
+#define IRQ_PRIO_DRDY       2           // sensor data ready edge
+#define IRQ_PRIO_DMA        3           // GUI serial DMA complete and its USART
+#define IRQ_PRIO_USB        4           // USB top half, masks the line and pends the bottom half
+#define IRQ_PRIO_TICK       5           // SysTick, micros() doesn't depend on it being on time
+#define IRQ_PRIO_LOOP       6           // LOOP_ISR inner loop, the software pended EXTI1 line
+#define IRQ_PRIO_DEFERRED   15          // PendSV bottom halves
+#endif
+
+#ifdef ATMEGA
+/* Includes for the ATmega */
+#include <stdint.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <string.h>
+
+#ifndef F_CPU
+#define F_CPU               20000000UL  // the Shrediquette crystal
+#endif
+#define CYCLES_PER_US       1           // Timer1 is the timebase, cycles() is micros()
+#define SERIAL_SPEED_MAX    (F_CPU / 8) // USART0 in double speed mode
+
+// the STM8 intrinsics the sensor drivers use. The instruction after sei always runs before a pending interrupt,
+// so wfi can't miss the one it waits for. hw_init() enables idle sleep
+#define disableInterrupts() cli()
+#define enableInterrupts() sei()
+#define wfi() __asm__ __volatile__("sei\n\tsleep" ::: "memory")
+#endif
+
+#ifdef HOSTSIM
+/* Includes for the host simulator */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CYCLES_PER_US       1           // cycles() reads the virtual microsecond clock
+#define SERIAL_SPEED_MAX    2000000
 #endif
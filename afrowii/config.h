@@ -11,12 +11,66 @@
 #define MINTHROTTLE 1120
 
 // #define DIGITAL_SERVO      // If high-speed (200hz) refresh is needed on tail servo or for camera stabilization, define this. otherwise 50hz is used.
+                              // This is only the default: parameter 24 ('J'/'U') sets the servo rate at runtime, 50..400Hz
+
+/* Fire one motor pulse per loop, right after the PID, instead of free running 400Hz PWM. The ESC then sees a new
+   value as soon as it is computed rather than up to one PWM frame later. ONESHOT_SCALE shortens the pulses for
+   ESCs that take them: 1 keeps 1-2ms, 8 is OneShot125 (125-250us). Servos keep their normal PWM */
+//#define MOTOR_ONESHOT
+#define ONESHOT_SCALE 1         // 1, 2, 4 or 8
+
+/* DShot digital ESC frames on the motor outputs instead of PWM (STM32F1), sent like MOTOR_ONESHOT right after the
+   PID. The throttle is a number, so there is no ESC calibration, and the timer DMA clocks the bits out. The ESCs
+   must speak DShot. The value is the bit rate in kbit/s: 150, 300 or 600. Servos keep their normal PWM */
+//#define MOTOR_DSHOT 600
+
+/* I2C ESCs (BL-Ctrl and compatible) instead of the motor PWM: motor i at MOTOR_I2C_ADDRESS + 2 * i, one byte per
+   update, 0 stopped to 250 full, all motors queued back to back at 400kHz (about 0.3ms for 8) right after the PID.
+   MOTOR_I2C_DIVIDER sends every n-th loop, so the update rate is the loop's and no PWM frame's. The 'm' serial
+   command reports the unacknowledged and failed writes per ESC. Servos keep their normal PWM.
+   The ATmega backend (CSHRED) always drives its motors this way */
+//#define MOTOR_I2C
+#define MOTOR_I2C_ADDRESS 0x52
+#define MOTOR_I2C_DIVIDER 1
+
+/* CAN ESCs instead of the motor PWM (F4DISCO, CAN1 on PD0/PD1 through a transceiver): every motor in one broadcast
+   frame per loop right after the PID, id MOTOR_CAN_ID, a byte per motor coded like MOTOR_I2C. So 8 motors take
+   one frame and no timer channels. The ESCs (or any node) report on MOTOR_CAN_ID + 1 + motor at a rate of their
+   own: eRPM / 100, voltage in 10mV, current in 10mA (16 bit each, little endian), temperature in C. The 'n' serial
+   command reads back the latest of each and the bus errors. Servos keep their normal PWM */
+//#define MOTOR_CAN
+#define MOTOR_CAN_ID 0x100
+#define MOTOR_CAN_BITRATE 1000000
 
 #define YAW_DIRECTION 1		// if you want to reverse the yaw correction direction
 //#define YAW_DIRECTION -1
 
-//#define I2C_SPEED 100000L	//100kHz normal mode, this value must be used for a genuine WMP
-#define I2C_SPEED 400000L   //400kHz fast mode, it works only with some WMP clones
+/* Build for one frame type: the mixer, the servo output and computeIMU() are compiled for it, with the motor
+   count and the frame checks folded in. The GUI can't change the frame then ('X' only takes this one), leave it
+   out for the firmware that flies any frame */
+//#define FIXED_FRAME MULTITYPE_QUADX
+
+/* I2C bus speed, of every device but the WMP and the nunchuk. They have their own below and the bus is switched
+   between their transfers and the others, so a slow WMP doesn't hold up the baro and the mag */
+//#define I2C_SPEED 100000L	//100kHz normal mode
+#define I2C_SPEED 400000L   //400kHz fast mode
+//#define I2C_WMP_SPEED 100000L	//100kHz normal mode, this value must be used for a genuine WMP
+#define I2C_WMP_SPEED 400000L   //400kHz fast mode, it works only with some WMP clones
+
+/* descriptors for register writes queued without waiting on the bus (the gyro filter set from the GUI, ...).
+   When all of them are out a write waits for the bus instead. The 'q' serial command tells the most ever used */
+//#define I2C_POST_POOL 4
+
+/* I2C gyro and acc (AFROI2C): the acc read and the first gyro read of a cycle are queued together and decoded
+   when both are in, instead of one blocking read after the other. The loop profiler shows the bus time as
+   sensorChain. The baro and the mag are queued from their own tasks either way. */
+//#define I2C_SENSOR_CHAIN
+
+/* Read the accelerometer every ACC_DIVIDER-th loop only, and run the ACC correction of the attitude filter on
+   those loops. The gyro is still read and integrated every loop, the correction weight is raised to keep the
+   filter's time constant. On the I2C boards this takes the acc transfer off most cycles; the ACC low pass runs
+   per reading, so its lag grows with the divider. 1 to 16 */
+#define ACC_DIVIDER 1
 
 //****** advanced users settings   *************
 
@@ -27,49 +81,133 @@
    It's just to have some feedback. This will be removed in the future */
 // #define STAB_OLD_17
 
+/* Run the complementary filter IMU in 32 bit integer math instead of float. Meant for the STM8, which has no FPU.
+   angle[] stays within 0.6 deg of the float version (both are within 0.4 deg of a true atan2), heading within 1 deg */
+//#define IMU_FIXED_POINT
+
+/* Keep tracking the gyro bias in flight: the complementary filter's correction (ACC for roll/pitch, MAG for yaw)
+   slowly moves gyroZero[] after the calibration, so temperature drift doesn't build up in the I terms.
+   On the MPU6000 a per axis temperature coefficient is learned as well. IMU_QUATERNION has a bias
+   estimate of its own, this does nothing there. */
+//#define GYRO_BIAS_TRACKING
+
+/* bits of gyro resolution kept below the MultiWii unit (2000 deg/s = 8192) from the driver through the filters,
+   the attitude estimate and the PID, 0 or 1. The MPU6000, ITG3200 and L3G4200D drivers no longer divide them
+   away; at a fast loop the D term otherwise moves in steps of a whole LSB. The PID gains keep their meaning, and
+   the GUI, telemetry, blackbox and sensor link still see MultiWii units. One bit is what the int16 filter state
+   has headroom for at full scale; 2 on an MPU6000 only build with MPU6000_GYRO_DPS at 1000 or less */
+//#define GYRO_FRAC 1
+
+/* MPU6000 full scale ranges, deg/s (250, 500, 1000, 2000) and g (2, 4, 8, 16). Hover and camera flying never
+   come near 2000 deg/s and 4g; a narrower range puts the ADC bits where the rates are, and with GYRO_FRAC the
+   gyro keeps them as far as the PID. gyroADC[] stays in MultiWii units, so the gains and GYRO_SCALE don't
+   change, the driver just saturates earlier. acc_1G follows the acc range: calibrate the ACC again after
+   changing it */
+//#define MPU6000_GYRO_DPS 1000
+//#define MPU6000_ACC_G 2
+
+/* Quaternion IMU with gyro bias estimation instead of the EstG vector filter. Holds attitude better in
+   hard manoeuvres, but it is float heavy: meant for the STM32 targets, too slow for the STM8 */
+//#define IMU_QUATERNION
+
 /* GPS
-   only available on MEGA boards (this might be possible on 328 based boards in the future)
-   if enabled, define here the Arduino Serial port number and the UART speed
+   only available on the STM32: the receiver TX goes to the main port RX (USART1, PA10), the GUI stays on USB.
+   Also in the host build, replayed from AFROWII_SIM_GPS. Define here the UART speed.
    note: only the RX PIN is used, the GPS is not configured by multiwii
-   the GPS must be configured to output NMEA sentences (which is generally the default conf for most GPS devices)
+   the GPS must be configured to output NMEA GGA sentences, or better the u-blox binary NAV-POSLLH and NAV-SOL
+   messages (UBX): they cost a fraction of the parsing time
 */
 //#define GPS
-//#define GPS_SERIAL Serial3 // should be Serial2 for flyduino v2
 //#define GPS_BAUD   4800
 //#define GPS_BAUD   9600
 
+/* Sensor coprocessor: two boards, one reading the sensors, one flying. Define the link speed on one of them.
+   SENSOR_NODE: the sensor node. It runs the sensors, the filters and the attitude estimate and sends each
+   cycle's gyroData, accSmooth, angle and heading, stamped with the gyro sample time, out of its GUI UART
+   (USART1 on the STM32F1, set SERIAL_USART1). No PID, mixer or motors run on it.
+   SENSOR_LINK: the flight node. The RX pin of its GPS port (see GPS) takes the packets in place of its own sensors,
+   the loop runs at the node's packet rate. Without packets for 20ms the rates read 0 and it won't arm.
+   Calibrate the sensors on the node. The mag and the baro are the node's too: no MAG or BARO modes here */
+//#define SENSOR_NODE 1000000
+//#define SENSOR_LINK 1000000
+
 /* Pseudo-derivative conrtroller for level mode (experimental)
    Additional information: http://wbb.multiwii.com/viewtopic.php?f=8&t=503 */
 //#define LEVEL_PDF
 
+/* loop period (us) the PID gains are tuned at. The I and D terms are scaled by the measured cycle time against
+   it, so a faster or slower loop doesn't change what the gains do. To carry over a tuning unchanged, set it to
+   the cycle time the GUI showed while the gains were tuned */
+#define PID_REF_CYCLE 3000
+
+/* tuning profiles: 2 or 3 complete sets of PIDs, rates, expo and TPA in RAM, each with its lookup tables worked
+   out when it is written. Parameter 28 picks one from the AUX switches the way activate[] does for the boxes, its
+   first byte are the AUX positions of profile 2, the second those of profile 3; none of them is profile 1. The
+   switch is a copy in the next loop, nothing is read from the EEPROM. 'W', the LCD and the trims edit the profile
+   in use, 'U' any of them (profile 1 has the old parameter ids, 2 and 3 are ids 29 and 30), and they are stored
+   the usual way, by paramTask() once disarmed. About 60 bytes of RAM per profile */
+//#define TUNING_PROFILES 3
+
+/* RAM diet: the parameters nothing reads every loop (the custom mixer, the sensor filters, the battery alarm levels
+   and the servo rate, 63 bytes) have no RAM copy, they are read where the EEPROM holds them, which the STM8 and the
+   STM32 map into the address space. An edit of one of them is written at once instead of by paramTask(), and is
+   refused while armed. Not on the ATmega, its EEPROM is only reached through the EEPROM registers */
+//#define PARAM_IN_PLACE
+
+/* fixed loop rate, picked at boot: the first loops run free while the slowest of them is timed, then the loop is
+   paced to the fastest of 2000/1000/500/333/250Hz that leaves a quarter of headroom over it. The PID scaling for
+   the chosen period is worked out once, the period and the measured cost are in the 'H' reply.
+   Not with a data ready gyro (MPU6000_DRDY_INT, ITG3200_DRDY_INT), the sensor paces the loop there */
+//#define LOOP_RATE_AUTO
+
+/* inner loop in an interrupt, STM32 and the simulator: sensors, PID, mixer and motors run from the inner loop interrupt every
+   LOOP_ISR ms of the SysTick, or with 0 on every frame of the data ready gyro (MPU6000_DRDY_INT, ITG3200_DRDY_INT).
+   The slow tasks become the background it preempts, each runs when due for as long as it takes, so GPS, the LCD
+   or a long reply no longer delay a PID iteration. One gyro read per inner loop. Not with LOOP_RATE_AUTO,
+   SENSOR_LINK, SENSOR_NODE or SWO_TRACE */
+//#define LOOP_ISR 2
+
+/* dynamic gyro notch, STM32 only: a background FFT of the last 256 gyro samples of each axis finds the strongest
+   vibration between the two frequencies (Hz) and moves a notch of each axis onto it, on top of the fixed gyro
+   filters ('F'), so it follows the motors through the throttle range. Keep the top below half the loop rate.
+   The notch frequencies are the NOTCH group of SERIAL_STREAM */
+//#define DYN_NOTCH
+#define DYN_NOTCH_MIN_HZ   80
+#define DYN_NOTCH_MAX_HZ   400
+
 /* introduce a deadband around the stick center
    Must be greater than zero, comment if you dont want a deadband on roll, pitch and yaw */
 //#define DEADBAND 6
 
+/* Ramp rcCommand[] ROLL, PITCH and YAW from one RC frame to the next over the measured frame interval, instead
+   of a step per frame the D term kicks on. The ramp starts on the first loop after the frame. Until the
+   interval is known, and after a gap of more than 40ms, the new value is taken as it is */
+//#define RC_INTERPOLATION
+
 /* Failsave settings - added by MIS
    Failsafe check pulse on THROTTLE channel. If the pulse is OFF (on only THROTTLE or on all channels) the failsafe procedure is initiated.
    After FAILSAVE_DELAY time of pulse absence, the level mode is on (if ACC or nunchuk is avaliable), PITCH, ROLL and YAW is centered
-   and THROTTLE is set to FAILSAVE_THR0TTLE value. You must set this value to descending about 1m/s or so for best results. 
+   and THROTTLE held where it was. After FAILSAVE_DESCEND_DELAY more, THROTTLE is set to FAILSAVE_THR0TTLE value. You must set this
+   value to descending about 1m/s or so for best results. 
    This value is depended from your configuration, AUW and some other params. 
    Next, afrer FAILSAVE_OFF_DELAY the copter is disarmed, and motors is stopped.
-   If RC pulse coming back before reached FAILSAVE_OFF_DELAY time, after the small quard time the RC control is returned to normal.
+   The time is taken from the last complete RC frame (PPM: a sync gap after at least the four sticks), so a few good pulses
+   don't hold it off, and each stage starts within one 50Hz RC check of its time.
+   If RC pulse coming back before reached FAILSAVE_OFF_DELAY time, the RC control is returned to normal with the next frame.
    If you use serial sum PPM, the sum converter must completly turn off the PPM SUM pusles for this FailSafe functionality.*/
 #define FAILSAFE		// Alex: comment this line if you want to deactivate the failsafe function
 #define FAILSAVE_DELAY     10	// Guard time for failsafe activation after signal lost. 1 step = 0.1sec - 1sec in example
+#define FAILSAVE_DESCEND_DELAY 0	// Time in level mode at the last throttle before the descent in 0.1sec. 0: descend right away
 #define FAILSAVE_OFF_DELAY 200	// Time for Landing before motors stop in 0.1sec. 1 step = 0.1sec - 20sec in example
 #define FAILSAVE_THR0TTLE  (MINTHROTTLE + 200)	// Throttle level used for landing - may be relative to MINTHROTTLE - as in this case
 
-/* EXPERIMENTAL !!
-  contribution from Luis Correia
-  see http://www.multiwii.com/forum/viewtopic.php?f=18&t=828
-  It uses a Bluetooth Serial module as the input for controlling the device via an Android application
-  As with the SPEKTRUM option, is not possible to use the configuration tool on a mini or promini. */
-//#define BTSERIAL
-
 /* The following lines apply only for a pitch/roll tilt stabilization system
    On promini board, it is not compatible with config with 6 motors or more
    Uncomment the first line to activate it 
-   These constants are also used in MULTITYPE_GIMBAL, in this case no #define is needed */
+   These constants are also used in MULTITYPE_GIMBAL, in this case no #define is needed
+   The servos follow the attitude every loop. At 50Hz most of their jitter is the refresh, not the sensor: digital
+   servos take 200-400Hz (parameter 24). Parameter 25 leads them by the gyro rate, angle + gyroData * n / 256, to
+   make up for the servo lag: about 12 per 20ms of lag with the MPU6000 or ITG3200 */
 // #define SERVO_TILT
 #define TILT_PITCH_MIN    1020	//servo travel min, don't set it below 1020
 #define TILT_PITCH_MAX    2000	//servo travel max, max value=2000
@@ -114,6 +252,14 @@
 /* I2C barometer */
 //#define BMP085
 //#define MS561101BA
+/* MS561101BA oversampling at startup, 0..4 for OSR 256..4096 (0.6 to 9ms per conversion). The GUI can
+   change it at runtime with the 'Q' command, it is saved with the other parameters */
+#define MS561101BA_OSR 4
+/* MS561101BA: convert temperature once every this many pressure samples */
+#define MS561101BA_TEMP_EVERY 8
+/* baro altitude from the float pow() formula instead of the integer table (same result within 9cm,
+   but the STM8 needs the soft float pow() library and milliseconds per sample for it) */
+//#define BARO_ALT_POW
 
 /* I2C magnetometer */
 //#define HMC5843
@@ -127,7 +273,9 @@
    to decrease the LPF frequency, only one step per try. As soon as twitching gone, stick with that setting.
    It will not help on feedback wobbles, so change only when copter is randomly twiching and all dampening and
    balancing options ran out. Uncomment only one option!
-   IMPORTANT! Change low pass filter setting changes PID behaviour, so retune your PID's after changing LPF.*/
+   IMPORTANT! Change low pass filter setting changes PID behaviour, so retune your PID's after changing LPF.
+   This only picks the power up default: the LPF and the sample rate divider of the ITG3200 and the MPU6000
+   are parameters, changed from the GUI ('L' command) or the LCD config and applied without a reboot.*/
 //#define ITG3200_LPF_256HZ     // This is the default setting, no need to uncomment, just for reference
 //#define ITG3200_LPF_188HZ
 //#define ITG3200_LPF_98HZ
@@ -135,6 +283,34 @@
 //#define ITG3200_LPF_20HZ
 //#define ITG3200_LPF_10HZ      // Use this only in extreme cases, rather change motors and/or props
 
+/* ITG3200 data-ready interrupt, INT wired to PB3 (PC4 on the STM32F4) where the AFROV3 has the MPU6000 INT.
+   Every sample is read from the INT edge through the queued I2C bus, ITG3200_DECIMATION of them are averaged
+   into one gyro value and the loop waits for that like with MPU6000_DRDY_INT. A read takes about 250us at
+   400kHz, so the sample rate is held at 2kHz or below: at 8kHz output SMPLRT_DIV is raised to 3. */
+//#define ITG3200_DRDY_INT
+#define ITG3200_DECIMATION 4    // samples per gyro value, a power of 2. 2kHz / 4 = 500Hz
+
+/* MPU6000 (AFROV3) data-ready interrupt. The second gyro read in computeIMU() waits for the INT pin (PB3)
+   instead of spinning a fixed 650us, so the control loop runs in step with the sensor output rate.
+   Comment this line to go back to the fixed interleaving delay. */
+#define MPU6000_DRDY_INT
+
+/* MPU6000 hardware FIFO. The sensor samples at 1kHz into its FIFO and each read drains everything queued since
+   the last one in a single SPI burst, the gyro/acc values handed on are the average of the batch. Every sample
+   gets used instead of only the latest, so vibration doesn't alias into the attitude.
+   Replaces MPU6000_DRDY_INT, the loop goes back to the fixed interleaving delay. */
+//#define MPU6000_FIFO
+
+/* AFROV2 analog gyros: the gyros and vbat are scanned by the ADC every ADC_SCAN_PERIOD us (TIM3 paced) and each
+   loop gets the average of all scans since the previous one, about 15 at a 3ms cycle time. A shorter period
+   oversamples more for one more short interrupt per scan. */
+#define ADC_SCAN_PERIOD 200
+
+/* AFROI2C: compile in the BMA180, ADXL345 (0x3A) and BMA020 drivers and use the accelerometer whose chip id
+   answers at boot, instead of assuming the ALLINONE BMA180. The gyro, baro and mag stay as on the ALLINONE.
+   All of them share one ACC_ORIENTATION, so this is for boards that mount them the same way. */
+//#define SENSOR_AUTODETECT
+
 /* The following lines apply only for specific receiver with only one PPM sum signal, on digital PIN 2
    IF YOUR RECEIVER IS NOT CONCERNED, DON'T UNCOMMENT ANYTHING. Note this is mandatory for a Y6 setup on a promini
    Select the right line depending on your radio brand. Feel free to modify the order in your PPM order is different */
@@ -142,8 +318,29 @@
 #define SERIAL_SUM_PPM         ROLL,PITCH,THROTTLE,YAW,AUX1,AUX2,CAMPITCH,CAMROLL //For Robe/Hitec/Futaba
 //#define SERIAL_SUM_PPM         PITCH,ROLL,THROTTLE,YAW,AUX1,AUX2,CAMPITCH,CAMROLL //For some Hitec/Sanwa/Others
 
-/* The following lines apply only for Spektrum Satellite Receiver on MEGA boards only *///not yet implemented
-//#define SPEKTRUM
+/* Spektrum DSM2/DSMX satellite receiver on the serial port instead of PPM, at 115200: 1024 or 2048 depending on
+   the transmitter's frame resolution. On the STM8 the satellite takes the UART RX, so the GUI can only listen
+   (it keeps working when the satellite is unplugged). On the STM32 it is on USART1 (PA10), the GUI stays on USB */
+//#define SPEKTRUM 1024
+//#define SPEKTRUM 2048
+
+/* Futaba/FrSky S.BUS receiver on the same serial port as the SPEKTRUM option, at 100000 8E2, with the channel order
+   as for SERIAL_SUM_PPM. S.BUS is inverted and none of the UARTs here can invert their RX, so it needs an
+   inverter (one transistor) in front of the pin. Frames flagged as failsafe by the receiver are ignored, so
+   the FAILSAFE option takes over */
+//#define SBUS                   ROLL,PITCH,THROTTLE,YAW,AUX1,AUX2,CAMPITCH,CAMROLL
+
+/* RC from a companion computer, a ground link or a Bluetooth module (it replaces the old BTSERIAL 'K' command) on
+   the same serial port as the SPEKTRUM option, at 115200 8N1: checksummed frames of 8 channels in us, in the
+   channel order given here as for SERIAL_SUM_PPM. The frame format is in the SERIAL_RC section of MultiWii_afro.c.
+   Each frame is a receiver frame for computeRC() the moment it is in, at whatever rate the sender keeps up.
+   The FAILSAFE option takes over when they stop */
+//#define SERIAL_RC              ROLL,PITCH,YAW,THROTTLE,AUX1,AUX2,CAMPITCH,CAMROLL
+
+/* Conventional receiver, one servo lead per channel, STM32 only. The inputs are captured in parallel and handed on
+   as one frame, with the input order given here as for SERIAL_SUM_PPM. On the CopterControl it is the receiver
+   port (PB6, PB5, PB0, PB1, PA0, PA1), on the STM32F4 PB4, PB5, PB0, PB1, PE5, PE6 */
+//#define RCPWM                  ROLL,PITCH,THROTTLE,YAW,AUX1,AUX2,CAMPITCH,CAMROLL
 
 /* interleaving delay in micro seconds between 2 readings WMP/NK in a WMP+NK config
    if the ACC calibration time is very long (20 or 30s), try to increase this delay up to 4000
@@ -153,7 +350,9 @@
 /* for V BAT monitoring
    after the resistor divisor we should get [0V;5V]->[0;1023] on analog V_BATPIN
    with R1=33k and R2=51k
-   vbat = [0;1023]*16/VBATSCALE */
+   vbat = [0;1023]*16/VBATSCALE
+   It's sampled at 10Hz and low pass filtered. The levels below are only the defaults: they are parameters,
+   changed with the 'V' command or the LCD config. */
 #define VBAT			// comment this line to suppress the vbat code
 #define VBATSCALE     91	// change this value if readed Battery voltage is different than real voltage
 #define VBATLEVEL1_3S 107	// 10,7V
@@ -173,11 +372,15 @@
    this value can be increased up to 2000 */
 #define MAXTHROTTLE 2000
 
-/* This is the speed of the serial interface. 115200 kbit/s is the best option for a USB connection.*/
+/* This is the speed of the serial interface. 115200 kbit/s is the best option for a USB connection.
+   Every link starts at it, the 'K' serial command raises it at runtime to what the UART can do (SERIAL_SPEED_MAX
+   in board.h). The rate a host confirmed is kept in the EEPROM for the next boot, which falls back to this one
+   after 2s without a frame */
 #define SERIAL_COM_SPEED 115200
 
 /* In order to save space, it's possibile to desactivate the LCD configuration functions
-   comment this line only if you don't plan to used a LCD */
+   comment this line only if you don't plan to used a LCD.
+   The menu runs next to the main loop: motors, serial and telemetry keep going while it is open */
 // #define LCD_CONF
 
 /* to use Cat's whisker TEXTSTAR LCD, uncomment following line.
@@ -185,6 +388,9 @@
    Configure display as follows: 115K baud, and TTL levels for RXD and TXD, terminal mode
    NO rx / tx line reconfiguration, use natural pins */
 //#define LCD_TEXTSTAR
+/* Eagle Tree Power Panel LCD on the I2C bus. Its writes are queued behind the sensors and sent in short pieces
+   while the bus has nothing else to do, so the menu and the telemetry pages don't hold up a sensor read */
+//#define LCD_ETPP
 /* keys to navigate the LCD menu (preset to TEXTSTAR key-depress codes)*/
 #define LCD_MENU_PREV 'a'
 #define LCD_MENU_NEXT 'c'
@@ -198,13 +404,16 @@
 /* some radios have not a neutral point centered on 1500. can be changed here */
 #define MIDRC 1500
 
-/* experimental
-   camera trigger function : activated via Rc Options in the GUI, servo output=A2 on promini */
+/* camera trigger: the CAMTRIG box (Rc Options in the GUI) takes a picture when it goes on, a CAM_TIME_HIGH pulse
+   on the shutter line. A timer ends the pulse, the loop only starts it, so its width and the time of its leading
+   edge don't depend on the loop. Every shot goes into the blackbox with that time. With CAM_INTERVAL it goes on
+   taking one every CAM_INTERVAL ms for as long as the box stays on.
+   The shutter line is output 6 on the CopterControl (PA2, TIM2), which then drives no motor or servo: no HEX6,
+   HEX6X or Y6, no BI, GIMBAL or FLYING_WING, no SERVO_TILT or RCPWM. The STM8, STM32F4 and ATmega have none */
 //#define CAMTRIG
-#define CAM_SERVO_HIGH 2000	// the position of HIGH state servo
-#define CAM_SERVO_LOW 1020	// the position of LOW state servo
-#define CAM_TIME_HIGH 1000	// the duration of HIGH state servo expressed in ms
-#define CAM_TIME_LOW 1000	// the duration of LOW state servo expressed in ms
+#define CAM_TIME_HIGH 1000	// the duration of the shutter pulse in ms, up to 6553
+#define CAM_TIME_LOW 1000	// the least time in ms from the end of a pulse to the next one
+//#define CAM_INTERVAL 5000	// intervalometer, ms from one shot to the next
 
 /* you can change the tricopter servo travel here */
 #define TRI_YAW_CONSTRAINT_MIN 1020
@@ -229,7 +438,8 @@
 /* allows to set alarm value in GUI or via LCD */
 /* Two options: */
 /* 1 - soft: - (good results +-5% for plush and mystery ESCs @ 2S and 3S, not good with SuperSimple ESC */
-/*      00. relies on your combo of battery type (Voltage, cpacity), ESC, ESC settings, motors, props and multiwii cycle time */
+/*      00. relies on your combo of battery type (Voltage, cpacity), ESC, ESC settings, motors and props */
+/*          the motor outputs are sampled at 10Hz and counted per 20ms like the hard sensor, so the cycle time no longer matters */
 /*      01. set POWERMETER soft. Uses PLEVELSCALE = 50, PLEVELDIV = PLEVELDIVSOFT = 10000 */
 /*      0. output is a value that linearily scales to power (mAh) */
 /*      1. get voltage reading right first */
@@ -274,9 +484,10 @@
 /* Buttons toggle request for page on/off */
 /* The active page on the LCD does get updated automatically */
 /* Easy to use with Terminal application or Textstar LCD - the 4 buttons are preconfigured to send 'A', 'B', 'C', 'D' */
-/* The value represents the refresh interval in cpu time (micro seconds) */
+/* The value represents the shortest refresh interval in cpu time (micro seconds), the slow pages are redrawn less often */
+/* Only the characters that changed are sent, a few per 20ms, so it can stay on while armed */
 //#define LCD_TELEMETRY 100011
-/* to enable automatic hopping between 4 telemetry pages uncomment this. */
+/* to enable automatic hopping between the 4 telemetry pages and page E (acc vibration) uncomment this. */
 /* This may be useful if your LCD has no buttons or the sending is broken */
 /* hopping is activated and deactivated in unarmed mode with throttle=low & roll=left & pitch=forward */
 /* The value represents the hopping interval in cpu time (micro seconds) */
@@ -290,6 +501,101 @@
 /* logging values are visible via LCD config */
 //#define LOG_VALUES
 
+/* time the main loop stages (IMU, PID, mixer, serial, baro...) with cycles(), the DWT cycle counter on the STM32 */
+/* min/max/mean since the last readout and a coarse histogram are sent back on the 'P' serial command */
+/* and the stage means in cycles on the 'p' command */
+//#define LOOP_PROFILER
+
+/* STM32F1: run pidCompute(), mixTable() and getEstimatedAttitude() from SRAM. At 72MHz the flash has 2 wait
+   states and every taken branch stalls on the prefetch buffer, SRAM has none. CrossWorks' startup copies the
+   .fast section there, the THUMB Release RAM configuration of afrowii.hzp sets this. The 'p' reply of the
+   LOOP_PROFILER says which placement ran, for a before/after comparison of the stage cycles */
+//#define RAM_FUNCTIONS
+
+/* trace points on spare pins for a scope or logic analyzer, see PROBE_LOOP and the pins in def.h:
+   the loop and its stages, the sensor interrupts and the serial/timebase interrupts. One store each */
+//#define TIMING_PROBES
+
+/* STM32: trace over SWO at this many bit/s, for an ST-LINK or J-Link SWO viewer (or OpenOCD's tpiu): the ITM out of
+   PB3, where semihosting stopped the core for every line. Text from trace_printf() on stimulus port 0, binary
+   events on port 1 stamped with the DWT cycle counter: each loop's cycleTime, the overruns and the tasks that
+   ran. Queued in RAM and fed to the ITM as it takes them, a full queue drops, so it can stay on in timing builds */
+//#define SWO_TRACE 2000000
+
+/* latency benchmark: stick to motor (from the RC frame sync in the receiver interrupt through computeRC, annexCode
+   and the PID to the motor outputs written) and gyro to motor, as min/max/mean and a histogram on the 'N' serial
+   command, followed by the worst case interrupt entry latencies (STM32F1). With TIMING_PROBES the PROBE_LATENCY pin
+   in def.h is high from each frame sync to its motor outputs, it takes the place of the serial interrupt probe (of
+   the loop probe on the STM8 LED) */
+//#define LATENCY_BENCH
+
+/* hardware in the loop bench: the 'h' serial command hands in gyro and acc readings (and receiver frames) in place
+   of what the sensors read, hil_bench.c on the PC replays a host simulator log through it and reports the loop
+   timing and motor outputs of the real board. Bench only, props off: the sensors are back 50ms after the last frame */
+//#define HIL_INJECT
+
+/* bit exact parity image, with HIL_INJECT: every loop is one 'x' frame of parity_bench.c (log time, gyro, acc and a
+   receiver frame), run on the frame's clock instead of micros(), and answered with motor[]. Between frames the
+   board only listens. The estimators are the integer ones on every target (IMU_FIXED_POINT, no HW_FPU), the
+   parameters the defaults whatever the EEPROM holds (it isn't written), so the host simulator built the same way
+   has to come up with the same motor[] on every step. Bench only, props off and the receiver unplugged; the baro
+   and mag are the board's own, keep the trace out of BARO and MAG mode */
+//#define BIT_EXACT
+
+/* kernel benchmark image, not for flying: in place of the flight code the hot kernels (_atan2, rotateV, InvSqrt,
+   getEstimatedAttitude, the PID, mixTable, computeRC, annexCode and, when built in, the BMP085 compensation and
+   the soft powermeter) run a thousand times each on canned data, the cycles go out as a CSV table on the serial port */
+//#define KERNEL_BENCH
+
+/* serial link benchmark: the 'g' command has the board send a burst of checksummed frames as fast as the link
+   takes them and report what went out, dropped or came in garbled. serial_bench.c on the PC measures frames/s,
+   bytes/s and the round trip of the commands with it, over the UART, the USB port or telemetry_proxy */
+//#define SERIAL_BENCH
+
+/* reset by the independent watchdog if a loop takes longer than this many ms: a hung bus or a stuck driver.
+   Started at the end of setup() and kicked once per loop. Loops past LOOP_OVERRUN are counted either way */
+//#define LOOP_WATCHDOG 250
+
+/* streamed binary telemetry: the 'T' serial command picks field groups (attitude, raw IMU, motors, RC, status, OSD, power)
+   and a rate divider for each, the selected groups are then sent at up to 100Hz in small checksummed frames.
+   A link too slow for the subscription slows the less important groups down on its own, 't' tells by how much.
+   Every frame carries the board time of its values, with the 'y' clock sync the host knows how old they are */
+//#define SERIAL_STREAM
+
+/* OSD output: the stream's OSD group (attitude, altitude, heading, vbat, GPS, flags) is sent from boot without
+   a 'T' subscription, so a listen only OSD needs no polling with 'O'. The value is the divider of the 100Hz
+   stream tick, 10 gives 10Hz. Turns on SERIAL_STREAM */
+//#define OSD_STREAM 10
+
+/* blackbox flight recorder: while armed, gyro, acc, the rate PID terms, motors and rcCommand of every n-th loop
+   are delta coded and streamed over the serial link, the record format is described in the blackbox section of
+   MultiWii_afro.c. The value is n. At 115200 baud on the STM8 every loop is too much, about 3 works for a quad,
+   and the GUI shares the link, expect it to be slow while armed. On the STM32 over USB the log (and SERIAL_STREAM)
+   has a bulk endpoint of its own, interface 2 "Telemetry" next to the CDC port: read it with libusb, the GUI
+   keeps the COM port to itself.
+   blackbox_decode.c turns a capture into csv, loop jitter, gyro spectrum and step response */
+//#define BLACKBOX 1
+
+/* blackbox to an SD card on the SDIO instead of the serial link, F4DISCO. The card is FAT32 with a file
+   BLACKBOX.BIN in its root directory made once on the PC, right after formatting so that it's contiguous, as
+   large as the logs are to be (fsutil file createnew, or dd). Every flight is appended and the file reads with
+   blackbox_decode -r. The length is written at disarm: losing power in flight keeps the data but the next log
+   overwrites it */
+//#define BLACKBOX_SD
+
+/* system identification: while armed and hovering, the 'e' command adds a chirp or a step train to the PID output
+   of one axis for a few seconds and the blackbox logs the injection, the command and the gyro of every loop.
+   blackbox_decode.c sysid turns that into the Bode plot of the plant and its delay. Keep the stick of that axis
+   centred, moving it ends the run. Needs BLACKBOX */
+//#define SYSID
+
+/* live variable watch: the 'w' command hands in a loop divider and up to 6 (address, size) pairs off the map file,
+   every divider-th loop those variables are copied into a ring and streamed in 0xA7 frames, next to the blackbox
+   on the same link. Only .data/.bss addresses are taken, 1, 2 or 4 bytes each, sent little endian. At most
+   24 bytes are copied per loop, a full ring drops the sample and the next frame says how many went.
+   The host simulator takes the addresses of a -no-pie build */
+//#define WATCH
+
 //****** end of advanced users settings *************
 
 //if you want to change to orientation of individual sensor
@@ -0,0 +1,46 @@
+#pragma once
+
+/* Software CRC-32 for the backends without a CRC unit (STM8, ATmega, host sim), the crc_start() contract of
+ * sysdep.h: polynomial 0x04C11DB7 over little endian words, most significant bit first, a nibble per step out
+ * of a 16 entry table, 64 bytes of flash where the byte wide table takes 1K. The backend defines
+ * crcFlashWord(), the flash word at an address, and crcInFlash(), the range check, then includes this once.
+ * crc_busy() takes CRC_SLICE words per call, about 0.6ms on the STM8, so crcTask() spreads a 32K image over
+ * a few seconds and the loop keeps its rate */
+#define CRC_SLICE               32
+
+static const uint32_t crcNibble[16] = {
+    0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005,
+    0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD,
+};
+
+static uint32_t crcValue = 0xFFFFFFFF;
+static uint32_t crcNext, crcLeft = 0;   // the words still to go
+
+uint8_t crc_start(uint32_t address, uint32_t words)
+{
+    if (crcLeft || !crcInFlash(address, words))
+        return 0;
+    crcValue = 0xFFFFFFFF;
+    crcNext = address;
+    crcLeft = words;
+    return 1;
+}
+
+uint8_t crc_busy(void)
+{
+    uint32_t c = crcValue;
+    uint8_t n, i;
+
+    for (n = 0; n < CRC_SLICE && crcLeft; n++, crcLeft--, crcNext += 4) {
+        c ^= crcFlashWord(crcNext);
+        for (i = 0; i < 8; i++)
+            c = c << 4 ^ crcNibble[c >> 28];
+    }
+    crcValue = c;
+    return crcLeft != 0;
+}
+
+uint32_t crc_result(void)
+{
+    return crcValue;
+}
@@ -15,13 +15,45 @@ typedef unsigned long uint32_t;
 typedef long int32_t;
 #define __inline inline
 #define __near 
+#define __tiny
+#define __interrupt
+#elif defined(HOSTSIM) || defined(STM32F1) || defined(STM32F4) || defined(ATMEGA)
+#define __near
+#define __tiny
 #define __interrupt
 #else /* _MSC_VER */
 #define __inline @inline
 #define __near @near
+#define __tiny @tiny                    // zero page, one byte direct addressing, see the hot state in MultiWii_afro.c
 #define __interrupt @interrupt
 #endif
 
+// copied to SRAM by the startup code, see RAM_FUNCTIONS. The SRAM is out of reach of a BL from flash, so calls
+// into it load the address, calls back out go through linker veneers
+#if defined(STM32F1) && defined(RAM_FUNCTIONS)
+#define RAMFUNC __attribute__((section(".fast"), long_call, noinline))
+#else
+#define RAMFUNC
+#endif
+
+// structs in wire layout, built in place with Serial_reserve(): no padding, 16 bit fields little endian like
+// serialize16(). Cosmic doesn't pad on the STM8 but stores big endian, WIRE16() swaps there
+#if defined(__GNUC__)
+#define WIRE_PACKED __attribute__((packed))
+#else
+#define WIRE_PACKED
+#endif
+#if defined(STM8) && !defined(_MSC_VER)
+#define WIRE_BIG_ENDIAN
+#endif
+#if defined(WIRE_BIG_ENDIAN)
+#define WIRE16(x) ((uint16_t)((uint16_t)(x) << 8 | (uint16_t)(x) >> 8))
+#define WIRE32(x) ((uint32_t)WIRE16(x) << 16 | WIRE16((uint32_t)(x) >> 16))
+#else
+#define WIRE16(x) ((uint16_t)(x))
+#define WIRE32(x) ((uint32_t)(x))
+#endif
+
 // Syncronized with GUI. Only exception is mixer > 11, which is always returned as 11 during serialization.
 typedef enum MultiType
 {
@@ -38,7 +70,8 @@ typedef enum MultiType
     MULTITYPE_OCTOX8 = 11,          // XK
     MULTITYPE_OCTOFLATP = 12,	    // XL the GUI is the same for all 8 motor configs
     MULTITYPE_OCTOFLATX = 13,       // XM the GUI is the same for all 8 motor configs
-    MULTITYPE_LAST = 14
+    MULTITYPE_CUSTOM = 14,          // XN mixer table uploaded with 'Y', kept in EEPROM
+    MULTITYPE_LAST = 15
 } MultiType;
 
 // undefine stdlib's abs if encountered
@@ -64,9 +97,64 @@ typedef enum MultiType
 #define MPU6000SPI              // MPU6000 on SPI providing 6DOF + MAG
 #endif
 
+#if defined(STM32F1) && defined(CC_ADCGYRO)
+#define ADCGYRO                 // Analog Gyro, PA3..PA5 on the dual ADC
+#endif
+
+#if defined(STM32F4) && defined(F4DISCO)
+#define MPU6000SPI              // MPU6000 breakout on SPI2, INT on PC4
+#endif
+
+#if defined(ATMEGA) && defined(CSHRED)
+#define ADCGYRO                 // yaw, roll and pitch on ADC0..2, external 3.3V reference
+#define ADCACC                  // roll, pitch and Z on ADC6, ADC7 and ADC5
+#define A1                         6
+#define A2                         7
+#define A3                         5
+#define ACC_ORIENTATION(X, Y, Z)  {accADC[ROLL]  =  X; accADC[PITCH]  = Y; accADC[YAW]  = Z;}
+#define GYRO_ORIENTATION(X, Y, Z) {gyroADC[ROLL] = -Y; gyroADC[PITCH] = Z; gyroADC[YAW] = X;}
+#endif
+
+#if defined(BIT_EXACT)
+#undef HW_FPU                   // the parity image has to round like the STM8 and the host, see config.h
+#define IMU_FIXED_POINT
+#endif
+
+#if defined(HW_FPU)
+#undef IMU_FIXED_POINT          // single precision is faster than the Q16 shifts on the Cortex-M4F
+#endif
+
+#if defined(MPU6000_FIFO)
+#undef MPU6000_DRDY_INT         // the FIFO is drained per loop, there's no per sample burst to wait for
+#endif
+
+#if !defined(ACC_DIVIDER) || defined(SENSOR_LINK)
+#undef ACC_DIVIDER
+#define ACC_DIVIDER 1           // the sensor link brings the acc with every gyro sample
+#elif ACC_DIVIDER < 1 || ACC_DIVIDER > 16
+#error "ACC_DIVIDER is 1 to 16"
+#endif
+
 #if defined(STM8) && defined(AFROI2C)
+#if defined(SENSOR_AUTODETECT)
+#define ITG3200                 // the accelerometer is probed at boot, see accDrivers[]
+#define BMA180
+#define ADXL345
+#define BMA020
+#define BMP085
+#define HMC5883
+#define BMA180_ADDRESS 0x82
+#define ACC_ORIENTATION(X, Y, Z)  {accADC[ROLL]  =  X; accADC[PITCH]  = Y; accADC[YAW]  = Z;}
+#define GYRO_ORIENTATION(X, Y, Z) {gyroADC[ROLL] =  X; gyroADC[PITCH] = Y; gyroADC[YAW] = Z;}
+#define MAG_ORIENTATION(X, Y, Z)  {magADC[ROLL]  = -Y; magADC[PITCH]  = X; magADC[YAW]  = Z;}
+#else
 #define ALLINONE                // CSG_EU's sensor board w/LLC
 #endif
+#endif
+
+#if defined(HOSTSIM)
+#define SIMSENSORS              // ITG3200/BMA180/HMC5883 register models in sysdep_host.c
+#endif
 
 //please submit any correction to this list.
 #if defined(FFIMUv1)
@@ -163,6 +251,17 @@ typedef enum MultiType
 #define MAG_ORIENTATION(X, Y, Z)  {magADC[ROLL]  = -Y; magADC[PITCH]  = X; magADC[YAW]  = Z;}
 #endif
 
+#if defined(SIMSENSORS)
+#define ITG3200
+#define BMA180
+#define HMC5883
+#define BMA180_ADDRESS 0x82
+#define ITG3200_ADDRESS 0XD0
+#define ACC_ORIENTATION(X, Y, Z)  {accADC[ROLL]  =  X; accADC[PITCH]  = Y; accADC[YAW]  = Z;}
+#define GYRO_ORIENTATION(X, Y, Z) {gyroADC[ROLL] =  X; gyroADC[PITCH] = Y; gyroADC[YAW] = Z;}
+#define MAG_ORIENTATION(X, Y, Z)  {magADC[ROLL]  =  X; magADC[PITCH]  = Y; magADC[YAW]  = Z;}
+#endif
+
 #if defined(AEROQUADSHIELDv2)	// to confirm
 #define ITG3200
 #define BMA180
@@ -202,7 +301,8 @@ typedef enum MultiType
 #define ACC 0
 #endif
 
-#if defined(HMC5883) || defined(HMC5843) || defined(AK8975) || defined(MPU6000SPI)
+// a SENSOR_LINK flight node has the attitude from the sensor node and reads none of its own sensors here
+#if (defined(HMC5883) || defined(HMC5843) || defined(AK8975) || defined(MPU6000SPI)) && !defined(SENSOR_LINK)
 #define MAG 1
 #else
 #define MAG 0
@@ -214,12 +314,137 @@ typedef enum MultiType
 #define GYRO 0
 #endif
 
-#if defined(BMP085) || defined(MS561101BA) || defined(MS561101BASPI)
+#if (defined(BMP085) || defined(MS561101BA) || defined(MS561101BASPI)) && !defined(SENSOR_LINK)
 #define BARO 1
 #else
 #define BARO 0
 #endif
 
+// gyro DLPF_CFG and SMPLRT_DIV at power up, run time parameters from there on (ITG3200 and MPU6000 only)
+#if defined(MPU6000SPI) && defined(MPU6000_FIFO)
+#define GYRO_DLPF_DEFAULT   1           // 188Hz, 1kHz output
+#define GYRO_DIV_DEFAULT    0           // 1kHz sample rate
+#elif defined(MPU6000SPI)
+#define GYRO_DLPF_DEFAULT   0           // 256Hz, 8kHz output
+#define GYRO_DIV_DEFAULT    4           // 1.6kHz sample rate
+#elif defined(ITG3200_LPF_188HZ)
+#define GYRO_DLPF_DEFAULT   1
+#elif defined(ITG3200_LPF_98HZ)
+#define GYRO_DLPF_DEFAULT   2
+#elif defined(ITG3200_LPF_42HZ)
+#define GYRO_DLPF_DEFAULT   3
+#elif defined(ITG3200_LPF_20HZ)
+#define GYRO_DLPF_DEFAULT   4
+#elif defined(ITG3200_LPF_10HZ)
+#define GYRO_DLPF_DEFAULT   5
+#else
+#define GYRO_DLPF_DEFAULT   0           // ITG3200_LPF_256HZ, 8kHz output
+#endif
+#if !defined(GYRO_DIV_DEFAULT)
+#define GYRO_DIV_DEFAULT    0
+#endif
+
+// gyroADC[] / gyroData[] in 1 / GYRO_FINE of the MultiWii unit, GYRO_LEGACY() takes them back to it
+#if !defined(GYRO_FRAC)
+#define GYRO_FRAC           0
+#elif GYRO_FRAC < 0 || GYRO_FRAC > 2
+#error "GYRO_FRAC is 0, 1 or 2"
+#endif
+#define GYRO_FINE           (1 << GYRO_FRAC)
+#define GYRO_LEGACY(v)      ((v) >> GYRO_FRAC)
+
+// MPU6000 full scale ranges, the driver scales its readings to the units above either way
+#if !defined(MPU6000_GYRO_DPS)
+#define MPU6000_GYRO_DPS    2000
+#elif MPU6000_GYRO_DPS != 250 && MPU6000_GYRO_DPS != 500 && MPU6000_GYRO_DPS != 1000 && MPU6000_GYRO_DPS != 2000
+#error "MPU6000_GYRO_DPS is 250, 500, 1000 or 2000"
+#endif
+#if !defined(MPU6000_ACC_G)
+#define MPU6000_ACC_G       4
+#elif MPU6000_ACC_G != 2 && MPU6000_ACC_G != 4 && MPU6000_ACC_G != 8 && MPU6000_ACC_G != 16
+#error "MPU6000_ACC_G is 2, 4, 8 or 16"
+#endif
+// the other gyro drivers run at 2000 deg/s, where a second bit overflows the int16 readings
+#if GYRO_FRAC > 1 && (!defined(MPU6000SPI) || defined(ITG3200) || defined(L3G4200D) || defined(ADCGYRO) || MPU6000_GYRO_DPS > 1000)
+#error "GYRO_FRAC 2 needs an MPU6000 only build with MPU6000_GYRO_DPS 1000 or less"
+#endif
+
+// the gyro driver stamps its samples off a data ready interrupt and the loop waits on Gyro_waitDataReady()
+#if defined(MPU6000SPI) && defined(MPU6000_DRDY_INT) && defined(ITG3200) && defined(ITG3200_DRDY_INT)
+#error "MPU6000_DRDY_INT and ITG3200_DRDY_INT share the data ready pin"
+#endif
+#if defined(ITG3200) && defined(ITG3200_DRDY_INT) && !defined(STM8) && !defined(STM32F4)
+#error "ITG3200_DRDY_INT needs the STM8 PB3 or the STM32F4 PC4 interrupt"
+#endif
+#if (defined(MPU6000SPI) && defined(MPU6000_DRDY_INT)) || (defined(ITG3200) && defined(ITG3200_DRDY_INT))
+#define GYRO_DRDY
+#endif
+#if defined(LOOP_RATE_AUTO) && defined(GYRO_DRDY)
+#error "LOOP_RATE_AUTO can't pace a loop the data ready gyro already paces"
+#endif
+
+#if defined(LOOP_ISR)
+#if !defined(STM32F1) && !defined(STM32F4) && !defined(HOSTSIM)
+#error "LOOP_ISR needs the nested interrupts of the STM32"
+#endif
+#if LOOP_ISR == 0 && !defined(GYRO_DRDY)
+#error "LOOP_ISR 0 runs the inner loop on the gyro frames, set MPU6000_DRDY_INT or ITG3200_DRDY_INT"
+#endif
+#if LOOP_ISR < 0 || LOOP_ISR > 20
+#error "LOOP_ISR is 0 to 20 ms"
+#endif
+#if defined(LOOP_RATE_AUTO) || defined(SENSOR_LINK)
+#error "LOOP_ISR paces the inner loop, no LOOP_RATE_AUTO or SENSOR_LINK"
+#endif
+#if defined(SENSOR_NODE)
+#error "LOOP_ISR: the SENSOR_NODE packets would share the reply frame with serialCom()"
+#endif
+#if defined(SWO_TRACE)
+#error "LOOP_ISR: the SWO trace queue is main loop only"
+#endif
+#endif
+
+#if defined(BIT_EXACT)
+#if !defined(HIL_INJECT)
+#error "BIT_EXACT hands its step frames to the HIL_INJECT overrides, set HIL_INJECT"
+#endif
+#if defined(IMU_QUATERNION) || defined(STAB_OLD_17) || defined(BARO_ALT_POW)
+#error "BIT_EXACT: IMU_QUATERNION, STAB_OLD_17 and BARO_ALT_POW are float, each target rounds them its own way"
+#endif
+#if defined(LOOP_ISR) || defined(LOOP_RATE_AUTO) || defined(SENSOR_LINK) || defined(SENSOR_NODE)
+#error "BIT_EXACT runs one loop per step frame, no LOOP_ISR, LOOP_RATE_AUTO, SENSOR_LINK or SENSOR_NODE"
+#endif
+#if defined(GYRO_BIAS_TRACKING) && defined(MPU6000SPI)
+#error "BIT_EXACT: GYRO_BIAS_TRACKING learns from the MPU6000 die temperature, which isn't in the step frames"
+#endif
+#if defined(PARAM_IN_PLACE)
+#error "BIT_EXACT runs on the default parameters, PARAM_IN_PLACE reads them from the EEPROM"
+#endif
+#endif
+
+#if defined(ATMEGA) && !defined(MOTOR_I2C)
+#define MOTOR_I2C                       // the BL-Ctrl motors of the CSHRED are on I2C, it has no motor PWM
+#endif
+
+#if defined(MOTOR_CAN)
+#define CAN_BUS
+#endif
+
+// anything on the I2C bus. Without it the I2C peripheral is never started (AFROV3 gets the mag over the MPU6000)
+#if defined(ITG3200) || defined(L3G4200D) || defined(ADXL345) || defined(BMA020) || defined(BMA180) || defined(NUNCHACK) \
+    || defined(LIS3LV02) || defined(LSM303DLx_ACC) || defined(BMP085) || defined(MS561101BA) || defined(HMC5843) \
+    || defined(HMC5883) || defined(AK8975) || !GYRO || defined(LCD_ETPP) || defined(MOTOR_I2C)
+#define I2C_BUS 1
+#else
+#define I2C_BUS 0
+#endif
+
+#if !defined(I2C_POST_POOL)
+#define I2C_POST_POOL       4
+#elif I2C_POST_POOL < 1 || I2C_POST_POOL > 32
+#error "I2C_POST_POOL is 1 to 32"
+#endif
+
 #if defined(STM32F1)
 #define LEDPIN_PINMODE             // GPIO_Init(GPIOD, GPIO_PIN_7, GPIO_MODE_OUT_PP_LOW_FAST);    // LED
 #define LEDPIN_TOGGLE              digitalToggle(GPIOA, GPIO_Pin_6);
@@ -268,6 +493,146 @@ typedef enum MultiType
 #define V_BATPIN                   3	// Analog PIN 3
 #define PSENSORPIN                 2	// Analog PIN 2
 #endif
+#if defined(STM32F4)
+#define LEDPIN_PINMODE             ;	// PD12, set up in hw_init()
+#define LEDPIN_TOGGLE              digitalToggle(GPIOD, GPIO_Pin_12);
+#define LEDPIN_OFF                 digitalLo(GPIOD, GPIO_Pin_12);
+#define LEDPIN_ON                  digitalHi(GPIOD, GPIO_Pin_12);
+#define BUZZERPIN_PINMODE          // GPIO_Init(GPIOF, GPIO_PIN_4, GPIO_MODE_OUT_PP_LOW_FAST);
+#define BUZZERPIN_ON               // GPIO_WriteHigh(GPIOF, GPIO_PIN_4);
+#define BUZZERPIN_OFF              // GPIO_WriteLow(GPIOF, GPIO_PIN_4);
+#define POWERPIN_PINMODE           ;
+#define POWERPIN_ON                ;
+#define POWERPIN_OFF               ;
+#define I2C_PULLUPS_ENABLE         ;
+#define I2C_PULLUPS_DISABLE        ;
+#define PINMODE_LCD                ;
+#define LCDPIN_OFF                 ;
+#define LCDPIN_ON                  ;
+#define STABLEPIN_PINMODE          ;
+#define STABLEPIN_ON               ;
+#define STABLEPIN_OFF              ;
+#define DIGITAL_SERVO_TRI_PINMODE  ;
+#define DIGITAL_SERVO_TRI_HIGH     ;
+#define DIGITAL_SERVO_TRI_LOW      ;
+#define DIGITAL_TILT_PITCH_PINMODE ;
+#define DIGITAL_TILT_PITCH_HIGH    ;
+#define DIGITAL_TILT_PITCH_LOW     ;
+#define DIGITAL_TILT_ROLL_PINMODE  ;
+#define DIGITAL_TILT_ROLL_HIGH     ;
+#define DIGITAL_TILT_ROLL_LOW      ;
+#define DIGITAL_BI_LEFT_PINMODE    ;
+#define DIGITAL_BI_LEFT_HIGH       ;
+#define DIGITAL_BI_LEFT_LOW        ;
+#define PPM_PIN_INTERRUPT          ;
+#define DIGITAL_CAM_PINMODE        ;
+#define DIGITAL_CAM_HIGH           ;
+#define DIGITAL_CAM_LOW            ;
+//RX PIN assignment inside the port //for PORTD
+#define THROTTLEPIN                2
+#define ROLLPIN                    4
+#define PITCHPIN                   5
+#define YAWPIN                     6
+#define AUX1PIN                    7
+#define AUX2PIN                    7	//unused just for compatibility with MEGA
+#define CAM1PIN                    7	//unused just for compatibility with MEGA
+#define CAM2PIN                    7	//unused just for compatibility with MEGA
+#define ISR_UART                   ISR(USART_UDRE_vect)
+#define V_BATPIN                   0	// PC1, see adcChannel[] in sysdep_stm32f4.c
+#define PSENSORPIN                 1	// PC2
+#endif
+#if defined(ATMEGA) && defined(CSHRED)
+#define LEDPIN_PINMODE             { DDRB |= _BV(1); }         // green LED, active low
+#define LEDPIN_TOGGLE              { PINB = _BV(1); }          // writing PINx toggles the pin
+#define LEDPIN_OFF                 { PORTB |= _BV(1); }
+#define LEDPIN_ON                  { PORTB &= ~_BV(1); }
+#define BUZZERPIN_PINMODE          { DDRC |= _BV(7); }
+#define BUZZERPIN_ON               { PORTC |= _BV(7); }
+#define BUZZERPIN_OFF              { PORTC &= ~_BV(7); }
+#define POWERPIN_PINMODE           ;
+#define POWERPIN_ON                ;
+#define POWERPIN_OFF               ;
+#define I2C_PULLUPS_ENABLE         ;
+#define I2C_PULLUPS_DISABLE        ;
+#define PINMODE_LCD                ;
+#define LCDPIN_OFF                 ;
+#define LCDPIN_ON                  ;
+#define STABLEPIN_PINMODE          { DDRB |= _BV(0); }         // red LED
+#define STABLEPIN_ON               { PORTB |= _BV(0); }
+#define STABLEPIN_OFF              { PORTB &= ~_BV(0); }
+#define DIGITAL_SERVO_TRI_PINMODE  ;
+#define DIGITAL_SERVO_TRI_HIGH     ;
+#define DIGITAL_SERVO_TRI_LOW      ;
+#define DIGITAL_TILT_PITCH_PINMODE ;
+#define DIGITAL_TILT_PITCH_HIGH    ;
+#define DIGITAL_TILT_PITCH_LOW     ;
+#define DIGITAL_TILT_ROLL_PINMODE  ;
+#define DIGITAL_TILT_ROLL_HIGH     ;
+#define DIGITAL_TILT_ROLL_LOW      ;
+#define DIGITAL_BI_LEFT_PINMODE    ;
+#define DIGITAL_BI_LEFT_HIGH       ;
+#define DIGITAL_BI_LEFT_LOW        ;
+#define PPM_PIN_INTERRUPT          ;
+#define DIGITAL_CAM_PINMODE        ;
+#define DIGITAL_CAM_HIGH           ;
+#define DIGITAL_CAM_LOW            ;
+#define THROTTLEPIN                2
+#define ROLLPIN                    4
+#define PITCHPIN                   5
+#define YAWPIN                     6
+#define AUX1PIN                    7
+#define AUX2PIN                    7	//unused just for compatibility with MEGA
+#define CAM1PIN                    7	//unused just for compatibility with MEGA
+#define CAM2PIN                    7	//unused just for compatibility with MEGA
+#define V_BATPIN                   4	// ADC4, the divider on the battery lead
+#define PSENSORPIN                 3	// ADC3, free for a current sensor without the pressure sensor
+#endif
+#if defined(HOSTSIM)
+#define LEDPIN_PINMODE             ;
+#define LEDPIN_TOGGLE              ;
+#define LEDPIN_OFF                 ;
+#define LEDPIN_ON                  ;
+#define BUZZERPIN_PINMODE          ;
+#define BUZZERPIN_ON               ;
+#define BUZZERPIN_OFF              ;
+#define POWERPIN_PINMODE           ;
+#define POWERPIN_ON                ;
+#define POWERPIN_OFF               ;
+#define I2C_PULLUPS_ENABLE         ;
+#define I2C_PULLUPS_DISABLE        ;
+#define PINMODE_LCD                ;
+#define LCDPIN_OFF                 ;
+#define LCDPIN_ON                  ;
+#define STABLEPIN_PINMODE          ;
+#define STABLEPIN_ON               ;
+#define STABLEPIN_OFF              ;
+#define DIGITAL_SERVO_TRI_PINMODE  ;
+#define DIGITAL_SERVO_TRI_HIGH     ;
+#define DIGITAL_SERVO_TRI_LOW      ;
+#define DIGITAL_TILT_PITCH_PINMODE ;
+#define DIGITAL_TILT_PITCH_HIGH    ;
+#define DIGITAL_TILT_PITCH_LOW     ;
+#define DIGITAL_TILT_ROLL_PINMODE  ;
+#define DIGITAL_TILT_ROLL_HIGH     ;
+#define DIGITAL_TILT_ROLL_LOW      ;
+#define DIGITAL_BI_LEFT_PINMODE    ;
+#define DIGITAL_BI_LEFT_HIGH       ;
+#define DIGITAL_BI_LEFT_LOW        ;
+#define PPM_PIN_INTERRUPT          ;
+#define DIGITAL_CAM_PINMODE        ;
+#define DIGITAL_CAM_HIGH           ;
+#define DIGITAL_CAM_LOW            ;
+#define THROTTLEPIN                2
+#define ROLLPIN                    4
+#define PITCHPIN                   5
+#define YAWPIN                     6
+#define AUX1PIN                    7
+#define AUX2PIN                    7	//unused just for compatibility with MEGA
+#define CAM1PIN                    7	//unused just for compatibility with MEGA
+#define CAM2PIN                    7	//unused just for compatibility with MEGA
+#define V_BATPIN                   3
+#define PSENSORPIN                 2
+#endif
 #if defined(STM8)
 #ifndef AFROI2C
 #define LEDPIN_PINMODE             GPIO_Init(GPIOD, GPIO_PIN_7, GPIO_MODE_OUT_PP_LOW_FAST);    // LED
@@ -366,13 +731,283 @@ typedef enum MultiType
 #endif /* AFROI2C */
 #endif
 
+/* TIMING_PROBES trace points. PROBE_HI/LO/TOGGLE() are one write to the set/reset register (a bset/bres/bcpl on
+   the STM8), they don't disturb the other pins of the port and cost nothing worth measuring in an ISR */
+#define PROBE_STAGE                1    // toggles with sensors read and attitude done, PID done, motors written
+#define PROBE_ISR                  2    // high in the sensor interrupts: SPI/DMA done, data ready, I2C
+#if !defined(LATENCY_BENCH)
+#define PROBE_LOOP                 0    // high from the top of loop() to the motors written
+#define PROBE_ISR_COMM             3    // high in the serial TX/RX and timebase interrupts
+#define PROBE_LATENCY              4    // no pin
+#elif defined(STM8)
+// the LED is the only probe there, it shows the latency instead of the loop
+#define PROBE_LOOP                 4
+#define PROBE_ISR_COMM             3
+#define PROBE_LATENCY              0    // high from an RC frame sync to its motor outputs written
+#else
+#define PROBE_LOOP                 0
+#define PROBE_ISR_COMM             4
+#define PROBE_LATENCY              3    // high from an RC frame sync to its motor outputs written
+#endif
+#if defined(TIMING_PROBES) && defined(STM32F1)
+// the receiver header, the firmware takes its RC input on the main port
+#define PROBE_PORT                 GPIOB
+#define PROBE_PIN_0                GPIO_Pin_6
+#define PROBE_PIN_1                GPIO_Pin_5
+#define PROBE_PIN_2                GPIO_Pin_0
+#define PROBE_PIN_3                GPIO_Pin_1
+#define PROBE_PIN_4                0            // writes nothing
+#define PROBE_SET(n)               PROBE_PORT->BSRR = PROBE_PIN_##n
+#define PROBE_CLR(n)               PROBE_PORT->BRR = PROBE_PIN_##n
+#define PROBE_FLIP(n)              PROBE_PORT->BSRR = (PROBE_PORT->ODR & PROBE_PIN_##n) ? PROBE_PIN_##n << 16 : PROBE_PIN_##n
+#elif defined(TIMING_PROBES) && defined(STM32F4)
+// the orange, red and blue LEDs and PD11 next to them on the header
+#define PROBE_PORT                 GPIOD
+#define PROBE_PIN_0                GPIO_Pin_13
+#define PROBE_PIN_1                GPIO_Pin_14
+#define PROBE_PIN_2                GPIO_Pin_15
+#define PROBE_PIN_3                GPIO_Pin_11
+#define PROBE_PIN_4                0            // writes nothing
+#define PROBE_SET(n)               PROBE_PORT->BSRRL = PROBE_PIN_##n
+#define PROBE_CLR(n)               PROBE_PORT->BSRRH = PROBE_PIN_##n
+#define PROBE_FLIP(n)              if (PROBE_PORT->ODR & PROBE_PIN_##n) PROBE_PORT->BSRRH = PROBE_PIN_##n; else PROBE_PORT->BSRRL = PROBE_PIN_##n
+#elif defined(TIMING_PROBES) && defined(STM8)
+// no pin to spare on the Afro boards: the LED carries PROBE_LOOP and stops blinking, the other probes are off
+#define PROBE_PORT                 LED_PROBE_PORT
+#define PROBE_PIN_0                LED_PROBE_PIN
+#define PROBE_SET(n)               PROBE_SET_##n
+#define PROBE_CLR(n)               PROBE_CLR_##n
+#define PROBE_FLIP(n)              PROBE_FLIP_##n
+#define PROBE_SET_0                PROBE_PORT->ODR |= PROBE_PIN_0
+#define PROBE_CLR_0                PROBE_PORT->ODR &= (uint8_t)~PROBE_PIN_0
+#define PROBE_FLIP_0               PROBE_PORT->ODR ^= PROBE_PIN_0
+#define PROBE_SET_1
+#define PROBE_CLR_1
+#define PROBE_FLIP_1
+#define PROBE_SET_2
+#define PROBE_CLR_2
+#define PROBE_FLIP_2
+#define PROBE_SET_3
+#define PROBE_CLR_3
+#define PROBE_FLIP_3
+#define PROBE_SET_4
+#define PROBE_CLR_4
+#define PROBE_FLIP_4
+#ifndef AFROI2C
+#define LED_PROBE_PORT             GPIOD
+#define LED_PROBE_PIN              GPIO_PIN_7
+#else
+#define LED_PROBE_PORT             GPIOE
+#define LED_PROBE_PIN              GPIO_PIN_5
+#endif
+#undef LEDPIN_TOGGLE
+#undef LEDPIN_OFF
+#undef LEDPIN_ON
+#define LEDPIN_TOGGLE              ;
+#define LEDPIN_OFF                 ;
+#define LEDPIN_ON                  ;
+#endif
+#if defined(PROBE_PORT)
+// one more level so PROBE_LOOP and friends are expanded before the pin is pasted
+#define PROBE_HI(n)                { PROBE_SET(n); }
+#define PROBE_LO(n)                { PROBE_CLR(n); }
+#define PROBE_TOGGLE(n)            { PROBE_FLIP(n); }
+#else
+#define PROBE_HI(n)                ;
+#define PROBE_LO(n)                ;
+#define PROBE_TOGGLE(n)            ;
+#endif
+
+
+#if defined(DYN_NOTCH) && (defined(STM8) || defined(ATMEGA))
+#error "DYN_NOTCH needs the STM32, the FFT buffers and the time for them don't fit the STM8 or the ATmega"
+#endif
+
+#if defined(BLACKBOX_SD) && !defined(BLACKBOX)
+#error "BLACKBOX_SD is where the BLACKBOX goes, define both"
+#endif
+
+#if defined(BLACKBOX_SD) && !defined(STM32F4) && !defined(HOSTSIM)
+#error "BLACKBOX_SD needs the SDIO of the STM32F4"
+#endif
+
+#if defined(SYSID) && !defined(BLACKBOX)
+#error "SYSID logs its samples to the BLACKBOX"
+#endif
+
+#if defined(TUNING_PROFILES) && (TUNING_PROFILES < 2 || TUNING_PROFILES > 3)
+#error "TUNING_PROFILES is 2 or 3"
+#endif
+
+#if defined(PARAM_IN_PLACE) && defined(ATMEGA)
+#error "PARAM_IN_PLACE reads the EEPROM in place, the ATmega doesn't map it"
+#endif
+
+#if defined(OSD_STREAM) && !defined(SERIAL_STREAM)
+#define SERIAL_STREAM
+#endif
+
+#if (defined(SPEKTRUM) + defined(SBUS) + defined(SERIAL_RC)) > 1
+#error "SPEKTRUM, SBUS and SERIAL_RC share the serial receiver port"
+#endif
+// a receiver on the rcSerial_init() port
+#if defined(SPEKTRUM) || defined(SBUS) || defined(SERIAL_RC)
+#define RCSERIAL
+#endif
+// the ATmega takes the PPM sum on ICP1, sysdep_avr.c splits it and hands each channel to the RCPWM path as an input
+#if defined(ATMEGA) && defined(SERIAL_SUM_PPM) && !defined(RCSERIAL) && !defined(RCPWM)
+#define RCPWM SERIAL_SUM_PPM
+#endif
+#if defined(ATMEGA) && !defined(UDR1) && defined(RCSERIAL)
+#error "the serial receiver needs USART1, the ATmega644P and up have it"
+#endif
+#if defined(RCPWM)
+#if defined(RCSERIAL)
+#error "RCPWM or a serial receiver, not both"
+#endif
+#if defined(STM8)
+#error "RCPWM needs the STM32, the STM8 has one capture input on the receiver pin"
+#endif
+#if defined(STM32F1) && defined(MOTOR_ONESHOT)
+#error "RCPWM shares the motor timers on the CopterControl, they stop between oneshot pulses"
+#endif
+#if defined(STM32F1) && defined(MOTOR_DSHOT)
+#error "RCPWM shares the motor timers on the CopterControl, DShot runs them at the bit rate"
+#endif
+#if defined(STM32F1) && defined(TIMING_PROBES)
+#error "TIMING_PROBES use the CopterControl receiver port"
+#endif
+#endif
+
+#if defined(SWO_TRACE) && !defined(STM32F1) && !defined(STM32F4)
+#error "SWO_TRACE needs the ITM and SWO pin of the STM32"
+#endif
+
+#if defined(STM8) && defined(RCSERIAL)
+#undef SERIAL_SPEED_MAX
+#define SERIAL_SPEED_MAX    0           // the receiver has the UART, the GUI link rate stays put
+#endif
+
+#if defined(MOTOR_DSHOT)
+#if !defined(STM32F1) && !defined(HOSTSIM)
+#error "MOTOR_DSHOT needs the CopterControl motor timers and their DMA"
+#endif
+#if defined(MOTOR_ONESHOT)
+#error "MOTOR_DSHOT or MOTOR_ONESHOT, not both"
+#endif
+#if MOTOR_DSHOT != 150 && MOTOR_DSHOT != 300 && MOTOR_DSHOT != 600
+#error "MOTOR_DSHOT is 150, 300 or 600"
+#endif
+#endif
+
+#if defined(ATMEGA) && defined(MOTOR_ONESHOT)
+#error "MOTOR_ONESHOT needs the STM timers, the ATmega backend drives BL-Ctrl ESCs on I2C"
+#endif
+#if defined(MOTOR_I2C) && (defined(MOTOR_ONESHOT) || defined(MOTOR_DSHOT))
+#error "MOTOR_I2C drives the motors, no MOTOR_ONESHOT or MOTOR_DSHOT"
+#endif
+#if defined(MOTOR_CAN) && (defined(MOTOR_ONESHOT) || defined(MOTOR_DSHOT) || defined(MOTOR_I2C))
+#error "MOTOR_CAN drives the motors, no MOTOR_ONESHOT, MOTOR_DSHOT or MOTOR_I2C"
+#endif
+#if defined(CAN_BUS) && !defined(STM32F4) && !defined(HOSTSIM)
+#error "CAN needs the F4: the CopterControl's F103 shares PA11/PA12 and the packet RAM between CAN and its USB"
+#endif
+#if defined(CAN_BUS) && MOTOR_CAN_BITRATE != 125000 && MOTOR_CAN_BITRATE != 250000 && MOTOR_CAN_BITRATE != 500000 \
+    && MOTOR_CAN_BITRATE != 1000000
+#error "MOTOR_CAN_BITRATE is 125000, 250000, 500000 or 1000000"
+#endif
+
+#if defined(CAMTRIG)
+#if !defined(STM32F1) && !defined(HOSTSIM)
+#error "CAMTRIG needs the CopterControl output 6 and its timer for the shutter line"
+#endif
+#if defined(SERVO_TILT)
+#error "CAMTRIG takes output 6, one of the SERVO_TILT servos"
+#endif
+#if defined(STM32F1) && defined(RCPWM)
+#error "CAMTRIG runs TIM2 in one pulse mode, RCPWM captures two channels on it"
+#endif
+#if CAM_TIME_HIGH < 1 || CAM_TIME_HIGH > 6553
+#error "CAM_TIME_HIGH is 1..6553 ms"
+#endif
+#if !defined(CAM_INTERVAL)
+#define CAM_INTERVAL 0
+#endif
+#endif
+
+#if defined(FIXED_FRAME) && defined(SIM_MIXER)
+#error "FIXED_FRAME or SIM_MIXER, not both"
+#endif
 
 #if defined(GPS)
+#if defined(STM8)
+#error "GPS needs a UART of its own, the STM8 has only one"
+#endif
+#if defined(STM32F1) && (defined(SERIAL_USART1) || defined(RCSERIAL))
+#error "GPS needs USART1: keep the GUI on USB, no SPEKTRUM, SBUS or SERIAL_RC"
+#endif
+#if defined(STM32F4) && defined(RCSERIAL)
+#error "GPS and the serial receiver both want the USART3 RX pin"
+#endif
+#if defined(ATMEGA) && (!defined(UDR1) || defined(RCSERIAL))
+#error "GPS needs USART1 of the ATmega644P and up, no SPEKTRUM, SBUS or SERIAL_RC"
+#endif
 #define GPSPRESENT 1
 #else
 #define GPSPRESENT 0
 #endif
 
+// sensor coprocessor: the node sends its attitude on the GUI UART, the flight node takes it on the GPS RX pin
+#if defined(SENSOR_NODE) && defined(SENSOR_LINK)
+#error "SENSOR_NODE or SENSOR_LINK, a board is one of the two"
+#endif
+#if defined(SENSOR_NODE)
+#if defined(STM32F1) && !defined(SERIAL_USART1)
+#error "SENSOR_NODE sends on the USART1 TX pin, set SERIAL_USART1"
+#endif
+#undef SERIAL_COM_SPEED
+#define SERIAL_COM_SPEED SENSOR_NODE
+#endif
+#if defined(SENSOR_LINK)
+#if defined(GPS)
+#error "SENSOR_LINK takes the GPS receiver port"
+#endif
+#if defined(STM8)
+#error "SENSOR_LINK needs a UART of its own, the STM8 has only one"
+#endif
+#if defined(STM32F1) && (defined(SERIAL_USART1) || defined(RCSERIAL))
+#error "SENSOR_LINK needs USART1: keep the GUI on USB, no SPEKTRUM, SBUS or SERIAL_RC"
+#endif
+#if defined(STM32F4) && defined(RCSERIAL)
+#error "SENSOR_LINK and the serial receiver both want the USART3 RX pin"
+#endif
+#if defined(ATMEGA) && (!defined(UDR1) || defined(RCSERIAL))
+#error "SENSOR_LINK needs USART1 of the ATmega644P and up, no SPEKTRUM, SBUS or SERIAL_RC"
+#endif
+#if defined(GYRO_DRDY) || defined(LOOP_RATE_AUTO)
+#error "the SENSOR_LINK packets pace the loop, no GYRO_DRDY or LOOP_RATE_AUTO"
+#endif
+#endif
+// gpsSerial_init() and the ring behind it
+#if defined(GPS) || defined(SENSOR_LINK)
+#define GPS_PORT
+#endif
+
+/* LCD: bytes sent per run of the LCD task and its worst case time */
+#if defined(LCD_ETPP) && defined(LCD_TEXTSTAR)
+#error "one LCD, LCD_ETPP or LCD_TEXTSTAR"
+#endif
+#if defined(LCD_ETPP)
+#define LCD_FLUSH_BYTES            6           // one I2C write, about 200us of bus at 400kHz
+#define LCD_TASK_BUDGET            250
+#elif defined(LCD_TEXTSTAR)
+#define LCD_FLUSH_BYTES            24          // into the serial TX buffer
+#define LCD_TASK_BUDGET            300
+#else
+#define LCD_FLUSH_BYTES            1           // bit banged at 9600 baud, about 1ms each
+#define LCD_TASK_BUDGET            1100
+#endif
+
 #if defined(POWERMETER)
 #ifndef VBAT
 #error "to use powermeter, you must also define and configure VBAT"
@@ -0,0 +1,176 @@
+#pragma once
+
+/* Fixed point helpers shared by afrowii, AfroFlight and CShred: saturation, clamps that evaluate their argument
+ * once, Q format multiplies and reciprocal multiplies for constant divisors. Like ringbuf.h everything is
+ * static and the includer brings the stdint types (stdint.h, or stm8s.h under Cosmic).
+ *
+ * Per core: the Cortex-M3/M4 saturate with SSAT. The STM8 has a 16/16 DIVW and the Cortex-M a hardware
+ * divide, so 16 bit divides by constants are fine as they are there. A 32 bit divide is a library loop on
+ * the STM8 and the AVR (which has MUL but no divide at all), FIX_DIV() turns it into a multiply and a shift.
+ * Right shifts of negative values are arithmetic on all three compilers, the existing code relies on it too.
+ *
+ * The Cortex-M4 (the STM32F4) also has the DSP extension, which works on two 16 bit halves of a register at once:
+ * FIX_SIMD is set there and the fix_pair_t helpers below are one instruction each. Everywhere else the scalar code
+ * is used. The C versions give the same results, a host build with -DFIX_SIMD runs the packed code paths with them.
+ */
+
+// Cosmic has no inline keyword, the gcc builds want it so the helpers a file doesn't use don't warn
+#if defined(__GNUC__)
+#define FIX_STATIC          static inline
+#else
+#define FIX_STATIC          static
+#endif
+
+FIX_STATIC int16_t fix_sat16(int32_t x)
+{
+#if defined(__GNUC__) && (defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__))
+    __asm__("ssat %0, #16, %1" : "=r" (x) : "r" (x));
+    return (int16_t)x;
+#else
+    if (x > 32767)
+        return 32767;
+    if (x < -32768)
+        return -32768;
+    return (int16_t)x;
+#endif
+}
+
+FIX_STATIC int16_t fix_clamp16(int16_t x, int16_t low, int16_t high)
+{
+    if (x < low)
+        return low;
+    if (x > high)
+        return high;
+    return x;
+}
+
+FIX_STATIC int32_t fix_clamp32(int32_t x, int32_t low, int32_t high)
+{
+    if (x < low)
+        return low;
+    if (x > high)
+        return high;
+    return x;
+}
+
+// saturating, no wrap from +32767 to -32768
+FIX_STATIC int16_t fix_add16(int16_t a, int16_t b)
+{
+    return fix_sat16((int32_t)a + b);
+}
+
+FIX_STATIC int16_t fix_sub16(int16_t a, int16_t b)
+{
+    return fix_sat16((int32_t)a - b);
+}
+
+// 16x16 into 32 bits. Written this way avr-gcc uses __mulhisi3 and the Cortex-M4 SMULBB, instead of widening
+// both operands to a 32x32 multiply first
+FIX_STATIC int32_t fix_mul16(int16_t a, int16_t b)
+{
+    return (int32_t)a * b;
+}
+
+// a * b in Qq, rounded: a value in Qn times one in Qm comes out in Q(n + m - q)
+#define FIX_MULQ(a, b, q)   ((fix_mul16((a), (b)) + (1L << ((q) - 1))) >> (q))
+
+// x * g / 2^16 rounded, g a Q16 gain below 1, for |x| < 2^30. Two 16x16 multiplies instead of a 32x32 one
+// that overflows
+FIX_STATIC int32_t fix_mulq16(int32_t x, uint16_t g)
+{
+    return (int32_t)(int16_t)(x >> 16) * g + (int32_t)(((uint32_t)(uint16_t)x * g + 0x8000) >> 16);
+}
+
+#if defined(__GNUC__) && defined(__ARM_FEATURE_DSP)
+#define FIX_SIMD
+#define FIX_SIMD_ASM
+#endif
+
+#if defined(FIX_SIMD)
+// two int16_t, lo in bits 0..15, hi in 16..31
+typedef uint32_t fix_pair_t;
+
+FIX_STATIC fix_pair_t fix_pack16(int16_t lo, int16_t hi)
+{
+    return (uint16_t)lo | (uint32_t)(uint16_t)hi << 16;
+}
+
+FIX_STATIC int16_t fix_lo16(fix_pair_t p)
+{
+    return (int16_t)p;
+}
+
+FIX_STATIC int16_t fix_hi16(fix_pair_t p)
+{
+    return (int16_t)(p >> 16);
+}
+
+// v into lo, the old lo moves to hi: two taps of a delay line, PKHBT
+FIX_STATIC fix_pair_t fix_push16(fix_pair_t p, int16_t v)
+{
+#if defined(FIX_SIMD_ASM)
+    fix_pair_t r;
+
+    __asm__("pkhbt %0, %1, %2, lsl #16" : "=r" (r) : "r" (v), "r" (p));
+    return r;
+#else
+    return fix_pack16(v, fix_lo16(p));
+#endif
+}
+
+// acc + a.lo * b.lo + a.hi * b.hi, wrapping like a 32 bit sum, SMLAD
+FIX_STATIC int32_t fix_smlad(fix_pair_t a, fix_pair_t b, int32_t acc)
+{
+#if defined(FIX_SIMD_ASM)
+    __asm__("smlad %0, %1, %2, %3" : "=r" (acc) : "r" (a), "r" (b), "r" (acc));
+    return acc;
+#else
+    return (int32_t)((uint32_t)acc + (uint32_t)fix_mul16(fix_lo16(a), fix_lo16(b))
+                     + (uint32_t)fix_mul16(fix_hi16(a), fix_hi16(b)));
+#endif
+}
+
+// a.lo * b.lo + a.hi * b.hi, SMUAD
+FIX_STATIC int32_t fix_smuad(fix_pair_t a, fix_pair_t b)
+{
+#if defined(FIX_SIMD_ASM)
+    int32_t r;
+
+    __asm__("smuad %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+#else
+    return fix_smlad(a, b, 0);
+#endif
+}
+
+// saturating per half, QADD16 / QSUB16
+FIX_STATIC fix_pair_t fix_qadd16(fix_pair_t a, fix_pair_t b)
+{
+#if defined(FIX_SIMD_ASM)
+    fix_pair_t r;
+
+    __asm__("qadd16 %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+#else
+    return fix_pack16(fix_add16(fix_lo16(a), fix_lo16(b)), fix_add16(fix_hi16(a), fix_hi16(b)));
+#endif
+}
+
+FIX_STATIC fix_pair_t fix_qsub16(fix_pair_t a, fix_pair_t b)
+{
+#if defined(FIX_SIMD_ASM)
+    fix_pair_t r;
+
+    __asm__("qsub16 %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+#else
+    return fix_pack16(fix_sub16(fix_lo16(a), fix_lo16(b)), fix_sub16(fix_hi16(a), fix_hi16(b)));
+#endif
+}
+#endif
+
+/* Division by a constant d as a multiply by FIX_RECIP(d, s) = 2^s / d and a shift by s, rounded to nearest where
+ * x / d truncates. The reciprocal is off by at most d / 2^(s + 1) relative, and |x| * FIX_RECIP(d, s) has to
+ * stay below 2^31: pick the largest s that fits the range of x */
+#define FIX_RECIP(d, s)     (((1UL << (s)) + (d) / 2) / (d))
+#define FIX_DIV(x, d, s)    ((int32_t)(((int32_t)(x) * (int32_t)FIX_RECIP(d, s) + (1L << ((s) - 1))) >> (s)))
@@ -0,0 +1,499 @@
+/* Firmware update through the STM32 ROM bootloader (the USART protocol of ST's AN3155)
+ *
+ * Only what differs is flashed: every erase page the image covers is read back first, pages that already hold
+ * the image are left alone, the others are erased in one command, written in 256 byte blocks (blocks that are
+ * all 0xFF are left erased) and read back again to verify. Each block carries the loader's XOR check and is
+ * acknowledged. An unchanged 32K image is one read of it, about 0.8s at 460800 Bd, a changed page costs a
+ * write and a read more.
+ *   gcc -O2 -o flash_update flash_update.c hostproto.c
+ *   ./flash_update [-r device] [-R baud] [-b baud] [-n] [-g] firmware.bin device
+ * -r sends 'R' to the running firmware (afrowii, CShred) on its own link first, at -R baud (115200), that
+ * reboots it into the loader when it is disarmed. Before that afrowii is asked for the CRC-32 of the flash the
+ * image covers ('v'): when it matches the image, the board already runs it and is left alone. systemBootloader() takes the STM32s to the ROM loader on
+ * USART1, which is the device given last; -b is its rate (115200, it measures it from the first byte).
+ * -n only compares, -g starts the new firmware when done. The run exits with 2 when the board doesn't answer,
+ * a command fails or the verify differs.
+ * The F4's loader also takes USB DFU (dfu-util), the ATmega's boot section talks what its loader talks
+ * (avrdude), -r followed by the tool of choice works for both.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include "hostproto.h"
+
+#define FLASH_BASE          0x08000000
+#define FLASH_MAX           (1024 * 1024)
+#define BLOCK               256         // largest read and write of the loader
+#define ACK                 0x79
+#define NACK                0x1F
+#define TIMEOUT             1.0         // s, per reply
+#define ERASE_TIMEOUT       30.0        // s, a 128K sector of the F4 takes up to 4s
+#define BOOT_DELAY          0.3         // s from 'R' to the loader listening
+#define CRC_TIMEOUT         10.0        // s for the running firmware's flash CRC, ms on the STM32s
+
+static int fd = -1;
+static uint8_t cmdErase = 0x43;         // 0x44 for the loaders with extended erase
+static uint32_t pageSize = 1024;        // uniform pages, 0 for the F4 sectors
+static uint8_t image[FLASH_MAX];
+static uint8_t flash[FLASH_MAX];
+static uint32_t imageLen;
+static unsigned long bytesRead, bytesWritten;
+
+// F40x/F41x/F42x sectors of the first bank, in KB
+static const uint16_t f4Sectors[] = { 16, 16, 16, 16, 64, 128, 128, 128, 128, 128, 128, 128 };
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fail(const char *why)
+{
+    fprintf(stderr, "flash_update: %s\n", why);
+    exit(2);
+}
+
+static speed_t baudCode(long baud)
+{
+    switch (baud) {
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    case 460800:
+        return B460800;
+    case 921600:
+        return B921600;
+    }
+    fprintf(stderr, "flash_update: unsupported baud rate %ld\n", baud);
+    exit(1);
+}
+
+// 8N1 for the firmware, 8E1 for the loader
+static int portOpen(const char *dev, long baud, int even)
+{
+    struct termios tio;
+    int f;
+
+    if ((f = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0)
+        return -1;
+    if (tcgetattr(f, &tio) < 0) {
+        close(f);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, baudCode(baud));
+    cfsetospeed(&tio, baudCode(baud));
+    tio.c_cflag |= CLOCAL | CREAD;
+    if (even)
+        tio.c_cflag |= PARENB;
+    tcsetattr(f, TCSANOW, &tio);
+    tcflush(f, TCIOFLUSH);
+    return f;
+}
+
+static void put(const uint8_t *p, int n)
+{
+    ssize_t w;
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+
+    while (n > 0) {
+        if ((w = write(fd, p, n)) > 0) {
+            p += w;
+            n -= w;
+        } else if (poll(&pfd, 1, 1000) <= 0)
+            fail("write timeout");
+    }
+}
+
+// n bytes within timeout s, 0 if they didn't come
+static int get(uint8_t *p, int n, double timeout)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    double end = now() + timeout;
+    ssize_t r;
+
+    while (n > 0) {
+        if (now() > end)
+            return 0;
+        if (poll(&pfd, 1, 10) <= 0)
+            continue;
+        if ((r = read(fd, p, n)) > 0) {
+            p += r;
+            n -= r;
+        }
+    }
+    return 1;
+}
+
+// ACK, NACK or -1 for none
+static int ack(double timeout)
+{
+    uint8_t c;
+
+    if (!get(&c, 1, timeout))
+        return -1;
+    return c;
+}
+
+// bytes followed by their XOR, a single byte by its complement
+static void putChecked(const uint8_t *p, int n)
+{
+    uint8_t out[BLOCK + 2], check = n == 1 ? 0xFF : 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        check ^= out[i] = p[i];
+    out[n] = check;
+    put(out, n + 1);
+}
+
+static void command(uint8_t c)
+{
+    putChecked(&c, 1);
+    if (ack(TIMEOUT) != ACK)
+        fail("command not acknowledged");
+}
+
+static void address(uint32_t addr)
+{
+    uint8_t a[4] = { addr >> 24, addr >> 16, addr >> 8, addr };
+
+    putChecked(a, 4);
+    if (ack(TIMEOUT) != ACK)
+        fail("address not acknowledged, read protected?");
+}
+
+static void bootSync(void)
+{
+    uint8_t c = 0x7F;
+    int i, r;
+
+    for (i = 0; i < 10; i++) {
+        put(&c, 1);
+        r = ack(0.2);
+        if (r == ACK || r == NACK)      // NACK: it already has its baud rate from an earlier run
+            return;
+    }
+    fail("no answer from the bootloader");
+}
+
+// Get for the erase command, Get ID for the page layout
+static void identify(void)
+{
+    uint8_t b[32];
+    uint16_t pid;
+    int i;
+
+    command(0x00);
+    if (!get(b, 1, TIMEOUT) || b[0] >= sizeof(b) - 1 || !get(b + 1, b[0] + 1, TIMEOUT) || ack(TIMEOUT) != ACK)
+        fail("bad Get reply");
+    for (i = 2; i <= b[0] + 1; i++)
+        if (b[i] == 0x44)
+            cmdErase = 0x44;
+    printf("bootloader %d.%d, %s erase\n", b[1] >> 4, b[1] & 15, cmdErase == 0x44 ? "extended" : "standard");
+    command(0x02);
+    if (!get(b, 3, TIMEOUT) || ack(TIMEOUT) != ACK)
+        fail("bad Get ID reply");
+    pid = b[1] << 8 | b[2];
+    switch (pid) {
+    case 0x412:                         // F1 low and medium density (the CopterControl's F103CB)
+    case 0x410:
+        pageSize = 1024;
+        break;
+    case 0x414:                         // high density, XL density, connectivity line
+    case 0x430:
+    case 0x418:
+        pageSize = 2048;
+        break;
+    case 0x413:                         // F40x/F41x, F42x/F43x
+    case 0x419:
+        pageSize = 0;
+        break;
+    default:
+        fprintf(stderr, "flash_update: unknown chip 0x%03x, taking 1K pages\n", pid);
+    }
+    printf("chip 0x%03x, %s pages\n", pid, pageSize == 1024 ? "1K" : pageSize == 2048 ? "2K" : "F4 sector");
+}
+
+// the page off is in: its number, start and size
+static int pageAt(uint32_t off, uint32_t *start, uint32_t *size)
+{
+    uint32_t s = 0;
+    int i;
+
+    if (pageSize) {
+        *start = off / pageSize * pageSize;
+        *size = pageSize;
+        return off / pageSize;
+    }
+    for (i = 0; i < (int)(sizeof(f4Sectors) / sizeof(f4Sectors[0])); i++) {
+        if (off < s + f4Sectors[i] * 1024U) {
+            *start = s;
+            *size = f4Sectors[i] * 1024U;
+            return i;
+        }
+        s += f4Sectors[i] * 1024U;
+    }
+    fail("image larger than the flash");
+    return -1;
+}
+
+static void readMemory(uint32_t off, uint8_t *p, int n)
+{
+    uint8_t len = n - 1;
+
+    command(0x11);
+    address(FLASH_BASE + off);
+    putChecked(&len, 1);
+    if (ack(TIMEOUT) != ACK || !get(p, n, TIMEOUT))
+        fail("read failed");
+    bytesRead += n;
+}
+
+static void writeMemory(uint32_t off, const uint8_t *p, int n)
+{
+    uint8_t b[BLOCK + 1];
+
+    b[0] = n - 1;
+    memcpy(b + 1, p, n);
+    command(0x31);
+    address(FLASH_BASE + off);
+    putChecked(b, n + 1);               // the check covers the count too
+    if (ack(TIMEOUT) != ACK)
+        fail("write failed");
+    bytesWritten += n;
+}
+
+static void erase(const int *page, int n)
+{
+    uint8_t b[2 * 256 + 2];
+    int i, len = 0;
+
+    if (!n)
+        return;
+    command(cmdErase);
+    if (cmdErase == 0x44) {
+        b[len++] = (n - 1) >> 8;
+        b[len++] = n - 1;
+        for (i = 0; i < n; i++) {
+            b[len++] = page[i] >> 8;
+            b[len++] = page[i];
+        }
+        putChecked(b, len);
+    } else {
+        b[len++] = n - 1;
+        for (i = 0; i < n; i++)
+            b[len++] = page[i];
+        putChecked(b, len);
+    }
+    if (ack(ERASE_TIMEOUT) != ACK)
+        fail("erase failed");
+}
+
+static int blank(const uint8_t *p, int n)
+{
+    while (n--)
+        if (*p++ != 0xFF)
+            return 0;
+    return 1;
+}
+
+// what is in the flash over [off, off + n) of the image, into flash[]
+static void readBack(uint32_t off, uint32_t n)
+{
+    uint32_t i, len;
+
+    for (i = 0; i < n; i += len) {
+        len = n - i < BLOCK ? n - i : BLOCK;
+        readMemory(off + i, flash + off + i, len);
+    }
+}
+
+// CRC-32 of the image the way crc_start() in sysdep.h has it: little endian words, each most significant bit first
+static uint32_t imageCrc(void)
+{
+    uint32_t crc = 0xFFFFFFFF, off;
+    int i;
+
+    for (off = 0; off < imageLen; off += 4) {
+        crc ^= image[off] | image[off + 1] << 8 | (uint32_t)image[off + 2] << 16 | (uint32_t)image[off + 3] << 24;
+        for (i = 0; i < 32; i++)
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+    return crc;
+}
+
+static int crcState;                    // of the last 'v' reply, -1 for none
+static uint32_t crcBoard;
+
+static void crcReply(const hp_frame_t *f, void *user)
+{
+    const uint8_t *p = f->payload;
+
+    if (f->kind != HP_REPLY || f->cmd != 'v' || f->len != 13)
+        return;
+    crcState = p[0];
+    crcBoard = p[9] | p[10] << 8 | (uint32_t)p[11] << 16 | (uint32_t)p[12] << 24;
+}
+
+// the running firmware's CRC of the flash under the image, 1 when it is the image's. A board without 'v' doesn't
+// answer, it gets flashed as before
+static int firmwareMatches(void)
+{
+    hp_parser_t parser;
+    uint8_t frame[12], range[8], c;
+    uint32_t words = imageLen / 4, crc;
+    double end = now() + CRC_TIMEOUT, stop;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        range[i] = (uint32_t)FLASH_BASE >> 8 * i;
+        range[4 + i] = words >> 8 * i;
+    }
+    hp_init(&parser, hp_afrowiiReplies, crcReply, NULL);
+    put(frame, hp_putFrame(frame, 'v', range, 8));
+    for (;;) {
+        crcState = -1;
+        for (stop = now() + TIMEOUT; crcState < 0 && now() < stop;)
+            if (get(&c, 1, 0.05))
+                hp_feed(&parser, &c, 1);
+        if (crcState != 1 || now() > end)
+            break;
+        usleep(50000);
+        put(frame, hp_putFrame(frame, 'v', NULL, 0));
+    }
+    if (crcState != 0)
+        return 0;
+    crc = imageCrc();
+    printf("firmware CRC %08x, image %08x\n", crcBoard, crc);
+    return crcBoard == crc;
+}
+
+static void requestBootloader(const char *dev, long baud)
+{
+    uint8_t frame[4];
+    int f;
+
+    if ((f = portOpen(dev, baud, 0)) < 0) {
+        fprintf(stderr, "flash_update: can't open %s\n", dev);
+        exit(1);
+    }
+    fd = f;
+    if (firmwareMatches()) {
+        printf("the board runs this image already\n");
+        exit(0);
+    }
+    put(frame, hp_putFrame(frame, 'R', NULL, 0));
+    tcdrain(f);
+    close(f);
+    fd = -1;
+    usleep((useconds_t)(BOOT_DELAY * 1e6));
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: flash_update [-r device] [-R baud] [-b baud] [-n] [-g] firmware.bin device\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *reboot = NULL;
+    long baud = 115200, appBaud = 115200;
+    int a, dry = 0, go = 0, changed[256], nChanged = 0, pages = 0, p;
+    uint8_t dirty[256] = { 0 };         // by page number
+    uint32_t off, start, size, n, len;
+    double t;
+    FILE *in;
+
+    for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+        if (!strcmp(argv[a], "-r") && a + 1 < argc)
+            reboot = argv[++a];
+        else if (!strcmp(argv[a], "-R") && a + 1 < argc)
+            appBaud = atol(argv[++a]);
+        else if (!strcmp(argv[a], "-b") && a + 1 < argc)
+            baud = atol(argv[++a]);
+        else if (!strcmp(argv[a], "-n"))
+            dry = 1;
+        else if (!strcmp(argv[a], "-g"))
+            go = 1;
+        else
+            usage();
+    }
+    if (a + 2 != argc)
+        usage();
+    if (!(in = fopen(argv[a], "rb"))) {
+        fprintf(stderr, "flash_update: can't open %s\n", argv[a]);
+        return 1;
+    }
+    imageLen = fread(image, 1, sizeof(image), in);
+    fclose(in);
+    if (!imageLen)
+        fail("empty image");
+    while (imageLen & 3)                // writes go in words
+        image[imageLen++] = 0xFF;
+
+    t = now();
+    if (reboot)
+        requestBootloader(reboot, appBaud);
+    if ((fd = portOpen(argv[a + 1], baud, 1)) < 0) {
+        fprintf(stderr, "flash_update: can't open %s\n", argv[a + 1]);
+        return 1;
+    }
+    bootSync();
+    identify();
+
+    // compare page by page, the part of the last page past the image doesn't matter
+    for (off = 0; off < imageLen; off = start + size) {
+        p = pageAt(off, &start, &size);
+        n = (start + size < imageLen ? start + size : imageLen) - start;
+        readBack(start, n);
+        pages++;
+        if (p > 255)
+            fail("more than 256 pages");
+        if (memcmp(flash + start, image + start, n)) {
+            changed[nChanged++] = p;
+            dirty[p] = 1;
+        }
+    }
+    printf("%u bytes, %d of %d pages differ\n", imageLen, nChanged, pages);
+
+    if (!dry && nChanged) {
+        erase(changed, nChanged);
+        // pages are a multiple of BLOCK, no block straddles two of them
+        for (off = 0; off < imageLen; off += len) {
+            len = imageLen - off < BLOCK ? imageLen - off : BLOCK;
+            if (dirty[pageAt(off, &start, &size)] && !blank(image + off, len))
+                writeMemory(off, image + off, len);
+        }
+        // verify what was written
+        for (off = 0; off < imageLen; off = start + size) {
+            p = pageAt(off, &start, &size);
+            n = (start + size < imageLen ? start + size : imageLen) - start;
+            if (!dirty[p])
+                continue;
+            readBack(start, n);
+            if (memcmp(flash + start, image + start, n))
+                fail("verify failed");
+        }
+    }
+    printf("%lu bytes read, %lu written in %.2fs\n", bytesRead, bytesWritten, now() - t);
+    if (go && !dry) {
+        command(0x21);
+        address(FLASH_BASE);
+    }
+    close(fd);
+    return 0;
+}
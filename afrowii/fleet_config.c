@@ -0,0 +1,610 @@
+/* Fleet provisioning over the parameter protocol (see the 'J', 'U' and 'j' commands in MultiWii_afro.c)
+ *
+ * Pushes one parameter profile to every attached board at once. Each board runs its own exchange and all of
+ * them are multiplexed over poll(), so a batch takes about as long as one board:
+ *   - 'J' 0 reads the board's layout, every id of the profile must be there with the same size
+ *   - 'U' writes the profile entries one by one
+ *   - 'j' is polled until the board has committed them (it only does that disarmed, PARAM_COMMIT_DELAY
+ *     after the last write)
+ *   - 'J' reads back every entry, the profile entries must read back as written
+ *   - 'j' returns the CRC-16/CCITT of the records stored in the EEPROM, which must match the one computed
+ *     here over what was read back, and every entry must have a record
+ * One report line per board goes to stdout, the run exits with 2 when any board failed.
+ *   gcc -O2 -o fleet_config fleet_config.c
+ *   ./fleet_config [-b baud] [-a] dump /dev/ttyACM0 > profile.txt
+ *   ./fleet_config [-b baud] push profile.txt [device...]
+ * Without devices, push takes every /dev/ttyACM* and /dev/ttyUSB* that opens. A profile has one parameter per
+ * line, the id in decimal and its bytes in hex as 'J' returns them; '#' starts a comment. dump writes the
+ * profile of a reference board, without the calibration entries (accZero, magZero, accTrim) and the link rate
+ * (serialSpeed) unless -a: those belong to the board they were measured on.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define BOARDS_MAX          64
+#define PARAM_MAX           64
+#define PARAM_DATA_MAX      34          // largest entry, a tuning profile
+#define REPLY_TIMEOUT       0.5         // s
+#define REPLY_TRIES         3
+#define COMMIT_TIMEOUT      5.0         // s
+#define COMMIT_POLL         0.1         // s
+
+enum { S_LIST, S_WRITE, S_COMMIT, S_READ, S_CRC, S_DONE, S_FAILED };
+
+typedef struct {
+    uint8_t id, size;
+    uint8_t data[PARAM_DATA_MAX];
+} param_t;
+
+typedef struct {
+    const char *dev;
+    int fd;
+    int state;
+    int step;                           // entry of the profile or the layout being written or read
+    int tries;
+    double sent, nextPoll, commitStart, start, end;
+    uint8_t rx[256];
+    int rxLen;
+    param_t layout[PARAM_MAX];          // what 'J' 0 and 'J' id returned
+    int layoutN;
+    int written;
+    uint8_t stored;
+    uint16_t crc;
+    char error[80];
+} board_t;
+
+// the ids of eep_entry[], for the comments of a dump
+static const char *paramName[] = {
+    NULL, "P8", "I8", "D8", "rcRate8", "rcExpo8", "rollPitchRate", "yawRate", "dynThrPID", "accZero",
+    "magZero", "accTrim", "activate", "powerTrigger1", "mixerConfiguration", "gimbalFlags", "gimbalGainPitch",
+    "gimbalGainRoll", "customMixer", "baroOsr", "sensorFilter", "gyroDlpf", "gyroRateDiv", "vbatAlarm",
+    "servoRate", "gimbalLead", "serialSpeed", "tpaCurve"
+};
+#define PARAM_NAMES         (int)(sizeof(paramName) / sizeof(paramName[0]))
+#define PARAM_CALIBRATION(id) ((id) == 9 || (id) == 10 || (id) == 11 || (id) == 26)
+
+static board_t board[BOARDS_MAX];
+static int boards = 0;
+static param_t profile[PARAM_MAX];
+static int profileN = 0;
+static int dumpMode = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static speed_t baudCode(long baud)
+{
+    switch (baud) {
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    case 460800:
+        return B460800;
+    case 921600:
+        return B921600;
+    }
+    fprintf(stderr, "fleet_config: unsupported baud rate %ld\n", baud);
+    exit(1);
+}
+
+static int portOpen(const char *dev, long baud)
+{
+    struct termios tio;
+    int fd;
+
+    if ((fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0)
+        return -1;
+    if (tcgetattr(fd, &tio) < 0) {
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, baudCode(baud));
+    cfsetospeed(&tio, baudCode(baud));
+    tio.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &tio);
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+static void boardAdd(const char *dev, long baud)
+{
+    board_t *b;
+
+    if (boards == BOARDS_MAX) {
+        fprintf(stderr, "fleet_config: more than %d boards, %s left out\n", BOARDS_MAX, dev);
+        return;
+    }
+    b = &board[boards];
+    memset(b, 0, sizeof(*b));
+    b->dev = dev;
+    if ((b->fd = portOpen(dev, baud)) < 0) {
+        b->state = S_FAILED;
+        snprintf(b->error, sizeof(b->error), "can't open");
+    }
+    boards++;
+}
+
+// ************************************************************************************************************
+// Profile: "id byte byte ..." per line, id in decimal, bytes in hex
+// ************************************************************************************************************
+static int profileLoad(const char *name)
+{
+    char line[512], *s, *e;
+    unsigned long v;
+    param_t *p;
+    int n = 0;
+    FILE *f;
+
+    if (!(f = fopen(name, "r")))
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        n++;
+        if ((s = strchr(line, '#')))
+            *s = 0;
+        v = strtoul(line, &e, 10);
+        if (e == line) {
+            while (*e == ' ' || *e == '\t' || *e == '\r' || *e == '\n')
+                e++;
+            if (*e) {
+                fprintf(stderr, "fleet_config: %s:%d: no parameter id\n", name, n);
+                exit(1);
+            }
+            continue;                   // blank or comment
+        }
+        if (v == 0 || v > 254 || profileN == PARAM_MAX) {
+            fprintf(stderr, "fleet_config: %s:%d: bad parameter id\n", name, n);
+            exit(1);
+        }
+        p = &profile[profileN++];
+        p->id = v;
+        p->size = 0;
+        for (s = e;; s = e) {
+            v = strtoul(s, &e, 16);
+            if (e == s)
+                break;
+            if (v > 0xFF || p->size == PARAM_DATA_MAX) {
+                fprintf(stderr, "fleet_config: %s:%d: bad data for id %d\n", name, n, p->id);
+                exit(1);
+            }
+            p->data[p->size++] = v;
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+static void profileDump(const board_t *b, int all)
+{
+    const param_t *p;
+    int i, k;
+
+    printf("# afrowii parameter profile, read from %s\n", b->dev);
+    printf("# id, then the bytes in hex as 'J' returns them\n");
+    for (i = 0; i < b->layoutN; i++) {
+        p = &b->layout[i];
+        if (!all && PARAM_CALIBRATION(p->id))
+            continue;
+        printf("%d", p->id);
+        for (k = 0; k < p->size; k++)
+            printf(" %02x", p->data[k]);
+        if (p->id < PARAM_NAMES)
+            printf("    # %s", paramName[p->id]);
+        printf("\n");
+    }
+}
+
+// ************************************************************************************************************
+// One exchange per board: a request goes out, the state waits for its reply, then moves on
+// ************************************************************************************************************
+static uint16_t crc16(uint16_t crc, const uint8_t *p, int n)
+{
+    int i;
+
+    while (n--) {
+        crc ^= (uint16_t)*p++ << 8;
+        for (i = 0; i < 8; i++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// '$', len, cmd, payload[len], xor of len..payload, the parser's checksummed framing
+static void sendFrame(board_t *b, uint8_t cmd, const uint8_t *p, uint8_t len)
+{
+    uint8_t f[40];
+    uint8_t i, check = len ^ cmd;
+    size_t n = 0;
+    ssize_t w;
+
+    f[n++] = '$';
+    f[n++] = len;
+    f[n++] = cmd;
+    for (i = 0; i < len; i++) {
+        f[n++] = p[i];
+        check ^= p[i];
+    }
+    f[n++] = check;
+    for (i = 0; i < n; i += w)
+        if ((w = write(b->fd, f + i, n - i)) < 0)
+            w = 0;
+    b->sent = now();
+}
+
+static void fail(board_t *b, const char *why, int id)
+{
+    if (id)
+        snprintf(b->error, sizeof(b->error), "%s, id %d", why, id);
+    else
+        snprintf(b->error, sizeof(b->error), "%s", why);
+    b->state = S_FAILED;
+    b->end = now();
+}
+
+static int layoutIndex(const board_t *b, uint8_t id)
+{
+    int i;
+
+    for (i = 0; i < b->layoutN; i++)
+        if (b->layout[i].id == id)
+            return i;
+    return -1;
+}
+
+static void request(board_t *b)
+{
+    uint8_t p[PARAM_DATA_MAX + 1];
+
+    switch (b->state) {
+    case S_LIST:
+        p[0] = 0;
+        sendFrame(b, 'J', p, 1);
+        break;
+    case S_WRITE:
+        p[0] = profile[b->step].id;
+        memcpy(p + 1, profile[b->step].data, profile[b->step].size);
+        sendFrame(b, 'U', p, profile[b->step].size + 1);
+        break;
+    case S_READ:
+        p[0] = b->layout[b->step].id;
+        sendFrame(b, 'J', p, 1);
+        break;
+    case S_COMMIT:
+    case S_CRC:
+        sendFrame(b, 'j', NULL, 0);
+        break;
+    }
+}
+
+// moves to the next state that has something to send
+static void advance(board_t *b, int state)
+{
+    b->state = state;
+    b->step = 0;
+    b->tries = 0;
+    if (b->state == S_WRITE && profileN == 0)
+        b->state = S_COMMIT;
+    if (b->state == S_COMMIT)
+        b->commitStart = now();
+    if (b->state == S_DONE)
+        b->end = now();
+    else
+        request(b);
+}
+
+static void listReply(board_t *b, const uint8_t *r)
+{
+    int i, k;
+
+    b->layoutN = r[2] < PARAM_MAX ? r[2] : PARAM_MAX;
+    for (i = 0; i < b->layoutN; i++) {
+        b->layout[i].id = r[3 + 2 * i];
+        b->layout[i].size = r[4 + 2 * i];
+        if (b->layout[i].size > PARAM_DATA_MAX) {
+            fail(b, "bad layout", b->layout[i].id);
+            return;
+        }
+    }
+    for (i = 0; i < profileN; i++) {
+        if ((k = layoutIndex(b, profile[i].id)) < 0) {
+            fail(b, "not in this firmware", profile[i].id);
+            return;
+        }
+        if (b->layout[k].size != profile[i].size) {
+            fail(b, "size differs from the firmware's", profile[i].id);
+            return;
+        }
+    }
+    advance(b, dumpMode ? S_READ : S_WRITE);
+}
+
+static void verify(board_t *b)
+{
+    uint16_t crc = 0xFFFF;
+    int i, k;
+
+    for (i = 0; i < profileN; i++) {
+        k = layoutIndex(b, profile[i].id);
+        if (memcmp(b->layout[k].data, profile[i].data, profile[i].size)) {
+            fail(b, "reads back different", profile[i].id);
+            return;
+        }
+    }
+    for (i = 0; i < b->layoutN; i++) {
+        crc = crc16(crc, &b->layout[i].id, 1);
+        crc = crc16(crc, &b->layout[i].size, 1);
+        crc = crc16(crc, b->layout[i].data, b->layout[i].size);
+    }
+    if (b->stored != b->layoutN)
+        fail(b, "entries missing in the EEPROM", 0);
+    else if (b->crc != crc)
+        fail(b, "EEPROM CRC mismatch", 0);
+    else
+        advance(b, S_DONE);
+}
+
+// length of the reply of the current request, 0 while rx doesn't hold enough of it to tell
+static int replyLength(const board_t *b)
+{
+    switch (b->state) {
+    case S_LIST:
+        return b->rxLen >= 3 ? 3 + 2 * b->rx[2] : 0;
+    case S_READ:
+        return b->rxLen >= 3 ? 3 + b->rx[2] : 0;
+    case S_WRITE:
+        return 2;
+    case S_COMMIT:
+    case S_CRC:
+        return 5;
+    }
+    return 0;
+}
+
+static int replyStart(const board_t *b)
+{
+    switch (b->state) {
+    case S_LIST:
+        return b->rx[0] == 'J' && (b->rxLen < 2 || b->rx[1] == 0);
+    case S_READ:
+        return b->rx[0] == 'J' && (b->rxLen < 2 || b->rx[1] == b->layout[b->step].id);
+    case S_WRITE:
+        return b->rx[0] == 'O' || b->rx[0] == 'N';
+    case S_COMMIT:
+    case S_CRC:
+        return b->rx[0] == 'j';
+    }
+    return 0;
+}
+
+static void reply(board_t *b, const uint8_t *r)
+{
+    param_t *p;
+
+    switch (b->state) {
+    case S_LIST:
+        listReply(b, r);
+        break;
+    case S_WRITE:
+        if (r[0] != 'O' || r[1] != 'K') {
+            fail(b, "write refused", profile[b->step].id);
+            break;
+        }
+        b->written++;
+        b->tries = 0;
+        if (++b->step == profileN)
+            advance(b, S_COMMIT);
+        else
+            request(b);
+        break;
+    case S_COMMIT:
+        if (r[1] == 0) {
+            advance(b, S_READ);
+            break;
+        }
+        if (now() - b->commitStart > COMMIT_TIMEOUT) {
+            fail(b, "not committed, armed?", 0);
+            break;
+        }
+        b->nextPoll = now() + COMMIT_POLL;
+        break;
+    case S_READ:
+        p = &b->layout[b->step];
+        if (r[2] != p->size) {
+            fail(b, "size differs from the layout", p->id);
+            break;
+        }
+        memcpy(p->data, r + 3, p->size);
+        b->tries = 0;
+        if (++b->step < b->layoutN)
+            request(b);
+        else
+            advance(b, dumpMode ? S_DONE : S_CRC);
+        break;
+    case S_CRC:
+        b->stored = r[2];
+        b->crc = r[3] | r[4] << 8;
+        verify(b);
+        break;
+    }
+}
+
+static void receive(board_t *b)
+{
+    ssize_t n;
+    int len;
+
+    if ((n = read(b->fd, b->rx + b->rxLen, sizeof(b->rx) - b->rxLen)) <= 0) {
+        if (n == 0)
+            fail(b, "device gone", 0);
+        return;
+    }
+    b->rxLen += n;
+    while (b->rxLen && b->state < S_DONE) {
+        // bytes that can't start the reply are left overs of a retried request, or stream frames
+        if (!replyStart(b)) {
+            memmove(b->rx, b->rx + 1, --b->rxLen);
+            continue;
+        }
+        if ((len = replyLength(b)) == 0 || b->rxLen < len)
+            break;
+        reply(b, b->rx);
+        b->rxLen -= len;
+        memmove(b->rx, b->rx + len, b->rxLen);
+        if (b->state == S_COMMIT && b->nextPoll)
+            break;                      // waiting to poll again, whatever else came is stale
+    }
+}
+
+static void tick(board_t *b)
+{
+    double t = now();
+
+    if (b->state >= S_DONE)
+        return;
+    if (b->state == S_COMMIT && b->nextPoll) {
+        if (t >= b->nextPoll) {
+            b->nextPoll = 0;
+            b->rxLen = 0;
+            request(b);
+        }
+        return;
+    }
+    if (t - b->sent < REPLY_TIMEOUT)
+        return;
+    if (++b->tries == REPLY_TRIES) {
+        fail(b, "no reply", b->state == S_WRITE ? profile[b->step].id : 0);
+        return;
+    }
+    b->rxLen = 0;
+    request(b);
+}
+
+static int running(void)
+{
+    int i;
+
+    for (i = 0; i < boards; i++)
+        if (board[i].state < S_DONE)
+            return 1;
+    return 0;
+}
+
+static void run(void)
+{
+    struct pollfd pfd[BOARDS_MAX];
+    int i;
+
+    for (i = 0; i < boards; i++) {
+        board[i].start = now();
+        if (board[i].state == S_LIST)
+            advance(&board[i], S_LIST);
+    }
+    while (running()) {
+        for (i = 0; i < boards; i++) {
+            pfd[i].fd = board[i].state < S_DONE ? board[i].fd : -1;
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+        }
+        poll(pfd, boards, 20);
+        for (i = 0; i < boards; i++) {
+            if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+                fail(&board[i], "device gone", 0);
+            else if (pfd[i].revents & POLLIN)
+                receive(&board[i]);
+            tick(&board[i]);
+        }
+    }
+    for (i = 0; i < boards; i++)
+        if (board[i].fd >= 0)
+            close(board[i].fd);
+}
+
+static int report(void)
+{
+    const board_t *b;
+    int i, ok = 0;
+
+    for (i = 0; i < boards; i++) {
+        b = &board[i];
+        if (b->state == S_DONE) {
+            printf("%-20s OK    %2d written  crc %04x  %5.2fs\n", b->dev, b->written, b->crc, b->end - b->start);
+            ok++;
+        } else
+            printf("%-20s FAIL  %2d written  %s\n", b->dev, b->written, b->error);
+    }
+    printf("%d of %d boards provisioned\n", ok, boards);
+    return ok == boards;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: fleet_config [-b baud] [-a] dump device\n"
+        "       fleet_config [-b baud] push profile [device...]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long baud = 115200;
+    int a, all = 0;
+    size_t i;
+    glob_t g;
+
+    for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+        if (!strcmp(argv[a], "-a"))
+            all = 1;
+        else if (!strcmp(argv[a], "-b") && a + 1 < argc)
+            baud = atol(argv[++a]);
+        else
+            usage();
+    }
+    if (a + 2 == argc && !strcmp(argv[a], "dump")) {
+        dumpMode = 1;
+        boardAdd(argv[a + 1], baud);
+        run();
+        if (board[0].state != S_DONE) {
+            fprintf(stderr, "fleet_config: %s: %s\n", board[0].dev, board[0].error);
+            return 2;
+        }
+        profileDump(&board[0], all);
+        return 0;
+    }
+    if (a + 2 > argc || strcmp(argv[a], "push"))
+        usage();
+    if (!profileLoad(argv[a + 1])) {
+        fprintf(stderr, "fleet_config: can't open %s\n", argv[a + 1]);
+        return 1;
+    }
+    if (a + 2 < argc)
+        for (a += 2; a < argc; a++)
+            boardAdd(argv[a], baud);
+    else {
+        memset(&g, 0, sizeof(g));
+        glob("/dev/ttyACM*", 0, NULL, &g);
+        glob("/dev/ttyUSB*", g.gl_pathc ? GLOB_APPEND : 0, NULL, &g);
+        for (i = 0; i < g.gl_pathc; i++)
+            boardAdd(g.gl_pathv[i], baud);
+    }
+    if (!boards) {
+        fprintf(stderr, "fleet_config: no boards found\n");
+        return 1;
+    }
+    run();
+    return report() ? 0 : 2;
+}
@@ -0,0 +1,625 @@
+/* Hardware in the loop bench harness for HIL_INJECT builds (see the 'h' command in MultiWii_afro.c)
+ *
+ * Replays a host simulator log (the AFROWII_SIM_LOG format of sysdep_host.c: time_us gyro[3] acc[3] mag[3] rc[8])
+ * into a real board over its serial link. The gyro and acc columns go out in 'h' frames at the harness rate and
+ * the rc columns as a receiver frame every 20ms, the way the simulator publishes them; mag and baro stay the
+ * board's own. The motor and status groups of the board's stream come back, so a scripted manoeuvre gives:
+ *   - a trace of the motor outputs on stdout, "time_us motor[8]" per stream frame like AFROWII_SIM_TRACE, with
+ *     the time on the log's clock
+ *   - loop timing on stderr: the cycleTime distribution, loop overruns and the task blamed, stream frames lost
+ *   - with -g, the output response against the simulator's trace of the same log and build: both traces are
+ *     lined up on their first output change and the lag within +-HIL_LAG_SEARCH that fits best, then the rms
+ *     and largest difference per output are reported
+ *   gcc -O2 -o hil_bench hil_bench.c -lm
+ *   ./hil_bench [-b baud] [-n] [-r rate] [-g golden.txt] [-t rms] /dev/ttyUSB0 flight.log > hil_trace.txt
+ * -r is the 'h' frame rate in Hz (default 200, a 115200 baud link carries about 300, 1MBaud about 2500). -n
+ * moves the link from -b to the fastest rate both ends can do with the 'K' command first, the board keeps it
+ * for its next boot. With -t the run exits with 2 when an output's rms difference is above it (us), so a
+ * firmware build can be gated on the bench.
+ * Props off: the board runs its motors on whatever the log and the firmware make of it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define STREAM_SYNC         0xA5
+#define STREAM_GROUPS       8
+#define STREAM_MOTORS       2
+#define STREAM_STATUS       4
+#define RC_FRAME_PERIOD     20000       // us
+#define HIL_LAG_SEARCH      50000       // us
+#define HIL_LAG_STEP        1000        // us
+#define HIL_DRAIN           200000      // us of stream taken after the log ran out
+#define SPEED_SLOTS         5           // rates in the 'K' reply
+#define SPEED_REPLY         (4 + 2 * SPEED_SLOTS)
+#define SPEED_TIMEOUT       0.5         // s
+#define SPEED_FALLBACK      2.2         // s, the board drops back to its base rate after 2s without a frame
+
+static const uint8_t groupSize[STREAM_GROUPS] = { 6, 18, 16, 16, 13, 15, 5, 6 };
+
+typedef struct {
+    size_t n, size;
+    uint32_t *time;
+    int16_t (*out)[8];
+} trace_t;
+
+static int port = -1;
+static trace_t hil, golden;
+static unsigned long frames = 0, framesLost = 0, badFrames = 0;
+static uint32_t cycleHist[65536];
+static unsigned long cycleCount = 0;
+static int haveStatus = 0;
+static uint16_t overrunsFirst, overrunsLast;
+static uint8_t overrunTask = 0xFF;
+static double logStart;                 // host time of the first log sample, s
+static uint32_t logT0;                  // and its time_us
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void traceAdd(trace_t *t, uint32_t time, const int16_t *out)
+{
+    if (t->n == t->size) {
+        t->size = t->size ? t->size * 2 : 4096;
+        t->time = realloc(t->time, t->size * sizeof(*t->time));
+        t->out = realloc(t->out, t->size * sizeof(*t->out));
+        if (!t->time || !t->out) {
+            fprintf(stderr, "hil_bench: out of memory\n");
+            exit(1);
+        }
+    }
+    t->time[t->n] = time;
+    memcpy(t->out[t->n], out, sizeof(t->out[0]));
+    t->n++;
+}
+
+// ************************************************************************************************************
+// Serial link
+// ************************************************************************************************************
+// 0 for rates the host can't set
+static speed_t baudLookup(long baud)
+{
+    switch (baud) {
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    case 460800:
+        return B460800;
+    case 921600:
+        return B921600;
+#if defined(B500000)
+    case 500000:
+        return B500000;
+    case 1000000:
+        return B1000000;
+    case 2000000:
+        return B2000000;
+#endif
+    }
+    return 0;
+}
+
+static speed_t baudCode(long baud)
+{
+    speed_t code = baudLookup(baud);
+
+    if (!code) {
+        fprintf(stderr, "hil_bench: unsupported baud rate %ld\n", baud);
+        exit(1);
+    }
+    return code;
+}
+
+// once what was written is out
+static void portSpeed(long baud)
+{
+    struct termios tio;
+
+    tcdrain(port);
+    tcgetattr(port, &tio);
+    cfsetispeed(&tio, baudCode(baud));
+    cfsetospeed(&tio, baudCode(baud));
+    tcsetattr(port, TCSANOW, &tio);
+    tcflush(port, TCIFLUSH);
+}
+
+static void portOpen(const char *dev, long baud)
+{
+    struct termios tio;
+
+    if ((port = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0 || tcgetattr(port, &tio) < 0) {
+        fprintf(stderr, "hil_bench: can't open %s\n", dev);
+        exit(1);
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, baudCode(baud));
+    cfsetospeed(&tio, baudCode(baud));
+    tio.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(port, TCSANOW, &tio);
+    tcflush(port, TCIOFLUSH);
+}
+
+// '$', len, cmd, payload[len], xor of len..payload, the parser's checksummed framing
+static void sendFrame(uint8_t cmd, const uint8_t *p, uint8_t len)
+{
+    uint8_t f[40];
+    uint8_t i, check = len ^ cmd;
+    size_t n = 0;
+    ssize_t w;
+
+    f[n++] = '$';
+    f[n++] = len;
+    f[n++] = cmd;
+    for (i = 0; i < len; i++) {
+        f[n++] = p[i];
+        check ^= p[i];
+    }
+    f[n++] = check;
+    for (i = 0; i < n; i += w)
+        if ((w = write(port, f + i, n - i)) < 0)
+            w = 0;
+}
+
+// ************************************************************************************************************
+// Rate negotiation: 'K' index asks for a rate, 0xFF only asks. The reply, at the old rate:
+//   'K', index acknowledged, count, rate / 100 [SPEED_SLOTS], 'K'
+// The board switches once its acknowledge is out and keeps the rate when the next frame arrives at it.
+// ************************************************************************************************************
+// the reply to a 'K', NULL after SPEED_TIMEOUT
+static const uint8_t *speedAsk(uint8_t index)
+{
+    static uint8_t r[SPEED_REPLY];
+    struct pollfd pfd = { port, POLLIN, 0 };
+    double end;
+    uint8_t c;
+    int n = 0;
+
+    tcflush(port, TCIFLUSH);            // stream frames left over
+    sendFrame('K', &index, 1);
+    for (end = now() + SPEED_TIMEOUT; now() < end;) {
+        poll(&pfd, 1, 10);
+        while (read(port, &c, 1) == 1) {
+            if (n == 0 && c != 'K')
+                continue;
+            r[n++] = c;
+            if (n == SPEED_REPLY) {
+                if (c == 'K')
+                    return r;
+                n = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+// tries the board's rates from the top down, returns the one in use
+static long negotiate(long baud)
+{
+    const uint8_t *r = speedAsk(0xFF);
+    long rates[SPEED_SLOTS];
+    int count, i;
+
+    if (!r) {
+        fprintf(stderr, "hil_bench: no 'K' reply, staying at %ld baud\n", baud);
+        return baud;
+    }
+    count = r[2] < SPEED_SLOTS ? r[2] : SPEED_SLOTS;
+    for (i = 0; i < count; i++)
+        rates[i] = (r[3 + 2 * i] | r[4 + 2 * i] << 8) * 100L;
+    for (i = count - 1; i > 0; i--) {
+        if (!baudLookup(rates[i]) || !(r = speedAsk(i)) || r[1] != i)
+            continue;
+        portSpeed(rates[i]);
+        usleep(20000);                  // a few loops for the board to follow
+        if ((r = speedAsk(0xFF)) && r[1] == i) {
+            fprintf(stderr, "hil_bench: link at %ld baud\n", rates[i]);
+            return rates[i];
+        }
+        // lost on the way, both ends go back to where they started
+        portSpeed(baud);
+        usleep(SPEED_FALLBACK * 1e6);
+    }
+    return baud;
+}
+
+static void put16(uint8_t *p, int16_t v)
+{
+    p[0] = v;
+    p[1] = (uint16_t)v >> 8;
+}
+
+static void subscribe(uint8_t divider)
+{
+    uint8_t d[STREAM_GROUPS] = { 0 };
+
+    d[STREAM_MOTORS] = divider;
+    d[STREAM_STATUS] = divider;
+    sendFrame('T', d, STREAM_GROUPS);
+}
+
+// ************************************************************************************************************
+// Stream frames: 0xA5, len, seq, groups, time, group payloads, xor of len..last payload byte
+// ************************************************************************************************************
+static void streamFrame(const uint8_t *f, int len, double t)
+{
+    static int haveSeq = 0;
+    static uint8_t lastSeq;
+    static int16_t motor[8];
+    uint8_t groups = f[1];
+    int g, i, pos = 6;                  // the board time isn't needed, the replay keeps its own
+    const uint8_t *p;
+
+    if (logStart == 0)
+        return;                         // from before the replay started
+    if (haveSeq)
+        framesLost += (uint8_t)(f[0] - lastSeq - 1);
+    haveSeq = 1;
+    lastSeq = f[0];
+    frames++;
+    for (g = 0; g < STREAM_GROUPS; g++) {
+        if (!(groups & (1 << g)))
+            continue;
+        if (pos + groupSize[g] > len) {
+            badFrames++;
+            return;
+        }
+        p = f + pos;
+        if (g == STREAM_MOTORS) {
+            for (i = 0; i < 8; i++)
+                motor[i] = p[i * 2] | p[i * 2 + 1] << 8;
+            traceAdd(&hil, logT0 + (uint32_t)((t - logStart) * 1e6), motor);
+        } else if (g == STREAM_STATUS) {
+            cycleHist[p[0] | p[1] << 8]++;
+            cycleCount++;
+            overrunsLast = p[10] | p[11] << 8;
+            if (!haveStatus)
+                overrunsFirst = overrunsLast;
+            else if (overrunsLast != overrunsFirst)
+                overrunTask = p[12];
+            haveStatus = 1;
+        }
+        pos += groupSize[g];
+    }
+}
+
+// whatever arrived, anything that isn't a good stream frame is skipped
+static void receive(void)
+{
+    static uint8_t f[256];
+    static int state = 0, len, pos;
+    static uint8_t check;
+    uint8_t buf[256];
+    ssize_t n, i;
+    double t = now();
+
+    while ((n = read(port, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++) {
+            uint8_t c = buf[i];
+            switch (state) {
+            case 0:
+                if (c == STREAM_SYNC)
+                    state = 1;
+                break;
+            case 1:
+                len = c;
+                check = c;
+                pos = 0;
+                state = len >= 6 ? 2 : 0;
+                break;
+            case 2:
+                f[pos++] = c;
+                check ^= c;
+                if (pos == len)
+                    state = 3;
+                break;
+            case 3:
+                if (c == check)
+                    streamFrame(f, len, t);
+                else
+                    badFrames++;
+                state = 0;
+                break;
+            }
+        }
+    }
+}
+
+// waits until host time t, taking in the stream meanwhile
+static void waitUntil(double t)
+{
+    struct pollfd pfd = { port, POLLIN, 0 };
+    double d;
+
+    while ((d = t - now()) > 0) {
+        poll(&pfd, 1, (int)(d * 1000) + 1);
+        receive();
+    }
+    receive();
+}
+
+// ************************************************************************************************************
+// Log replay
+// ************************************************************************************************************
+static int readSample(FILE *log, uint32_t *t, long *l)
+{
+    char line[256];
+    unsigned long time;
+
+    while (fgets(line, sizeof(line), log)) {
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+            continue;
+        if (sscanf(line, "%lu %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld",
+                   &time, &l[1], &l[2], &l[3], &l[4], &l[5], &l[6], &l[7], &l[8], &l[9],
+                   &l[10], &l[11], &l[12], &l[13], &l[14], &l[15], &l[16], &l[17], &l[18]) != 19) {
+            fprintf(stderr, "hil_bench: bad log line: %s", line);
+            continue;
+        }
+        *t = time;
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned long replay(FILE *log, long rate)
+{
+    uint8_t p[28];
+    long l[19];
+    uint32_t t, lastSent = 0, lastRc = 0;
+    unsigned long sent = 0;
+    int i, first = 1;
+
+    while (readSample(log, &t, l)) {
+        if (first) {
+            logT0 = t;
+            logStart = now();
+        }
+        if (!first && t - lastSent < 1000000 / rate)
+            continue;
+        waitUntil(logStart + (t - logT0) * 1e-6);
+        for (i = 0; i < 6; i++)
+            put16(p + i * 2, l[1 + i]);
+        memset(p + 12, 0, 16);
+        if (first || t - lastRc >= RC_FRAME_PERIOD) {
+            for (i = 0; i < 8; i++)
+                put16(p + 12 + i * 2, l[10 + i]);
+            lastRc = t;
+        }
+        sendFrame('h', p, sizeof(p));
+        lastSent = t;
+        sent++;
+        first = 0;
+    }
+    return sent;
+}
+
+// ************************************************************************************************************
+// Reports
+// ************************************************************************************************************
+static unsigned cyclePercentile(double q)
+{
+    unsigned long want = (unsigned long)(q * (cycleCount - 1)), seen = 0;
+    unsigned i;
+
+    for (i = 0; i < 65536; i++)
+        if ((seen += cycleHist[i]) > want)
+            return i;
+    return 65535;
+}
+
+static void timingReport(unsigned long sent, long rate)
+{
+    double sum = 0;
+    unsigned i, lo = 0, hi = 0;
+
+    fprintf(stderr, "hil_bench: %lu 'h' frames at %ldHz, %lu stream frames back, %lu lost, %lu bad\n",
+            sent, rate, frames, framesLost, badFrames);
+    if (!cycleCount)
+        return;
+    for (i = 0; i < 65536; i++) {
+        if (!cycleHist[i])
+            continue;
+        if (!sum)
+            lo = i;
+        hi = i;
+        sum += (double)i * cycleHist[i];
+    }
+    fprintf(stderr, "  cycleTime us: min %u mean %.1f p50 %u p99 %u max %u\n",
+            lo, sum / cycleCount, cyclePercentile(0.5), cyclePercentile(0.99), hi);
+    fprintf(stderr, "  loop overruns: %u during the run", (uint16_t)(overrunsLast - overrunsFirst));
+    if (overrunTask != 0xFF)
+        fprintf(stderr, ", the last one blamed on task %u", overrunTask);
+    fprintf(stderr, "\n");
+}
+
+static int loadTrace(const char *name, trace_t *t)
+{
+    FILE *f = fopen(name, "r");
+    char line[256];
+    unsigned long time;
+    int v[8], i;
+    int16_t out[8];
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lu %d %d %d %d %d %d %d %d", &time, &v[0], &v[1], &v[2], &v[3],
+                   &v[4], &v[5], &v[6], &v[7]) != 9)
+            continue;
+        for (i = 0; i < 8; i++)
+            out[i] = v[i];
+        traceAdd(t, time, out);
+    }
+    fclose(f);
+    return 1;
+}
+
+static size_t firstChange(const trace_t *t)
+{
+    size_t i;
+
+    for (i = 1; i < t->n; i++)
+        if (memcmp(t->out[i], t->out[0], sizeof(t->out[0])))
+            return i;
+    return 0;
+}
+
+// the golden line in effect at time t (traces are in time order)
+static size_t goldenAt(uint32_t t)
+{
+    size_t lo = 0, hi = golden.n;
+
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (golden.time[mid] <= t)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// per output rms and largest difference with the HIL trace shifted by offset us, over the overlap
+static unsigned long compare(int64_t offset, double *rms, int *maxDiff)
+{
+    unsigned long n = 0;
+    size_t i, g;
+    int k, d;
+    int64_t t;
+
+    for (k = 0; k < 8; k++) {
+        rms[k] = 0;
+        maxDiff[k] = 0;
+    }
+    for (i = 0; i < hil.n; i++) {
+        t = (int64_t)hil.time[i] + offset;
+        if (t < golden.time[0] || t > golden.time[golden.n - 1])
+            continue;
+        g = goldenAt((uint32_t)t);
+        for (k = 0; k < 8; k++) {
+            d = hil.out[i][k] - golden.out[g][k];
+            rms[k] += (double)d * d;
+            if (abs(d) > maxDiff[k])
+                maxDiff[k] = abs(d);
+        }
+        n++;
+    }
+    for (k = 0; k < 8; k++)
+        rms[k] = n ? sqrt(rms[k] / n) : 0;
+    return n;
+}
+
+static int responseReport(double limit)
+{
+    double rms[8], sum, bestSum = -1;
+    int maxDiff[8], k, fail = 0;
+    int64_t base, lag, bestLag = 0;
+    unsigned long n;
+
+    if (!hil.n || !golden.n) {
+        fprintf(stderr, "  output response: nothing to compare\n");
+        return limit > 0;
+    }
+    base = (int64_t)golden.time[firstChange(&golden)] - hil.time[firstChange(&hil)];
+    for (lag = -HIL_LAG_SEARCH; lag <= HIL_LAG_SEARCH; lag += HIL_LAG_STEP) {
+        if (!compare(base + lag, rms, maxDiff))
+            continue;
+        for (sum = 0, k = 0; k < 8; k++)
+            sum += rms[k];
+        if (bestSum < 0 || sum < bestSum) {
+            bestSum = sum;
+            bestLag = lag;
+        }
+    }
+    n = compare(base + bestLag, rms, maxDiff);
+    fprintf(stderr, "  output response: %lu frames against the golden trace, board %+.1fms behind it\n",
+            n, bestLag / 1000.0);
+    for (k = 0; k < 8; k++) {
+        fprintf(stderr, "    output %d: rms %.1f max %d us\n", k, rms[k], maxDiff[k]);
+        if (limit > 0 && rms[k] > limit)
+            fail = 1;
+    }
+    return fail || !n;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: hil_bench [-b baud] [-n] [-r rate] [-g golden] [-t rms] device log\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long baud = 115200, rate = 200;
+    const char *goldenName = NULL;
+    double limit = 0;
+    unsigned long sent;
+    FILE *log;
+    size_t i;
+    int a, k, fail = 0, fast = 0;
+
+    for (a = 1; a < argc && argv[a][0] == '-'; a += 2) {
+        if (!strcmp(argv[a], "-n")) {
+            fast = 1;
+            a--;
+            continue;
+        }
+        if (a + 1 >= argc)
+            usage();
+        if (!strcmp(argv[a], "-b"))
+            baud = atol(argv[a + 1]);
+        else if (!strcmp(argv[a], "-r"))
+            rate = atol(argv[a + 1]);
+        else if (!strcmp(argv[a], "-g"))
+            goldenName = argv[a + 1];
+        else if (!strcmp(argv[a], "-t"))
+            limit = atof(argv[a + 1]);
+        else
+            usage();
+    }
+    if (a + 2 != argc || rate <= 0 || rate > 1000)
+        usage();
+    if (goldenName && !loadTrace(goldenName, &golden)) {
+        fprintf(stderr, "hil_bench: can't open %s\n", goldenName);
+        return 1;
+    }
+    if (!(log = fopen(argv[a + 1], "r"))) {
+        fprintf(stderr, "hil_bench: can't open %s\n", argv[a + 1]);
+        return 1;
+    }
+    portOpen(argv[a], baud);
+    if (fast)
+        negotiate(baud);
+
+    subscribe(1);                       // every stream tick, 100Hz
+    sent = replay(log, rate);
+    waitUntil(now() + HIL_DRAIN * 1e-6);
+    subscribe(0);
+    fclose(log);
+    close(port);
+
+    for (i = 0; i < hil.n; i++) {
+        printf("%lu", (unsigned long)hil.time[i]);
+        for (k = 0; k < 8; k++)
+            printf(" %d", hil.out[i][k]);
+        printf("\n");
+    }
+    timingReport(sent, rate);
+    if (goldenName)
+        fail = responseReport(limit);
+    return fail && limit > 0 ? 2 : 0;
+}
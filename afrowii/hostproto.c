@@ -0,0 +1,353 @@
+/* Host side parsers and serializers for the serial protocols, see hostproto.h
+ *
+ * Built into the host tools, no main() here:
+ *   gcc -O2 -c hostproto.c
+ *   gcc -O2 -shared -fPIC -o libhostproto.so hostproto.c        (for ctypes / P/Invoke)
+ */
+#include <string.h>
+#include "hostproto.h"
+
+const uint8_t hp_afrowiiReplies[256] = {
+    ['M'] = 125,                        // 'M', VERSION .. serialFrameErrors, 'M'
+    ['O'] = 50,                         // 'O', accSmooth[3] .. VERSION, 'O'
+    ['K'] = 14,                         // 'K', index, count, rate / 100 [5], 'K'
+    ['w'] = 4,                          // 'w', slots taken, sample bytes, 'w'
+    ['m'] = 35,                         // 'm', 8, per ESC nacks, errors [8], 'm' (MOTOR_I2C)
+    ['v'] = 15,                         // 'v', state, address, words, crc, 'v'
+    ['n'] = 74,                         // 'n', 8, per ESC erpm .. age [8], bus stats, 'n' (MOTOR_CAN)
+    ['t'] = 14,                         // 't', stream dividers in use [8], skipped, bytes/s, 't' (SERIAL_STREAM)
+    ['y'] = 14,                         // 'y', token, rx, tx, 'y'
+    ['g'] = 16,                         // 'g', sent, dropped, rx lost, bad frames, commands, us, 'g' (SERIAL_BENCH)
+};
+
+static const uint8_t streamGroupSize[HP_STREAM_GROUPS] = { 6, 18, 16, 16, 13, 15, 5, 6 };
+
+void hp_init(hp_parser_t *p, const uint8_t *replyLen, hp_callback_t cb, void *user)
+{
+    memset(p, 0, sizeof(*p));
+    p->replyLen = replyLen;
+    p->cb = cb;
+    p->user = user;
+}
+
+// whole length of the frame d[0] starts, 0 if it starts none, -1 if that takes more than the n bytes there are
+static int frameLength(const hp_parser_t *p, const uint8_t *d, size_t n)
+{
+    uint8_t c = d[0];
+
+    if (c == HP_FRAME_START)
+        return n < 2 ? -1 : d[1] + 4;
+    if (c == HP_STREAM_SYNC || c == HP_BLACKBOX_SYNC || c == HP_WATCH_SYNC)
+        return n < 2 ? -1 : d[1] + 3;
+    if (p->replyLen && p->replyLen[c] >= 2)
+        return p->replyLen[c];
+    return 0;
+}
+
+// the len bytes at d are a frame of the kind d[0] starts: check, then hand it to the callback
+static int frameCheck(hp_parser_t *p, const uint8_t *d, int len)
+{
+    hp_frame_t f;
+    uint8_t check = 0;
+    int i;
+
+    if (d[0] == HP_FRAME_START || d[0] == HP_STREAM_SYNC || d[0] == HP_BLACKBOX_SYNC || d[0] == HP_WATCH_SYNC) {
+        for (i = 1; i < len - 1; i++)
+            check ^= d[i];
+        if (check != d[len - 1])
+            return 0;
+        f.len = d[1];
+        if (d[0] == HP_FRAME_START) {
+            f.kind = HP_FRAME;
+            f.cmd = d[2];
+            f.payload = d + 3;
+        } else {
+            f.kind = d[0] == HP_STREAM_SYNC ? HP_STREAM : d[0] == HP_BLACKBOX_SYNC ? HP_BLACKBOX : HP_WATCH;
+            f.cmd = d[0];
+            f.payload = d + 2;
+        }
+    } else {
+        if (d[len - 1] != d[0])
+            return 0;
+        f.kind = HP_REPLY;
+        f.cmd = d[0];
+        f.len = len - 2;
+        f.payload = d + 1;
+    }
+    p->frames++;
+    if (p->cb)
+        p->cb(&f, p->user);
+    return 1;
+}
+
+// frames in d[0..n), returns the bytes done with. What is left is the start of a frame n doesn't reach the end of
+static size_t scan(hp_parser_t *p, const uint8_t *d, size_t n)
+{
+    size_t i = 0;
+    int len;
+
+    while (i < n) {
+        len = frameLength(p, d + i, n - i);
+        if (len == 0) {
+            p->skipped++;
+            i++;
+            continue;
+        }
+        if (len < 0 || (size_t)len > n - i)
+            break;
+        if (frameCheck(p, d + i, len)) {
+            i += len;
+        } else {
+            // not a frame after all, the start byte may have been data
+            p->badFrames++;
+            p->skipped++;
+            i++;
+        }
+    }
+    return i;
+}
+
+void hp_feed(hp_parser_t *p, const uint8_t *data, size_t n)
+{
+    size_t take, used;
+
+    // a frame split off the last piece is completed in pending, the scan stays there until it runs dry
+    while (p->pendingLen && n) {
+        take = HP_PENDING_MAX - p->pendingLen;
+        if (take > n)
+            take = n;
+        memcpy(p->pending + p->pendingLen, data, take);
+        p->pendingLen += take;
+        data += take;
+        n -= take;
+        used = scan(p, p->pending, p->pendingLen);
+        p->pendingLen -= used;
+        memmove(p->pending, p->pending + used, p->pendingLen);
+    }
+    if (!n)
+        return;
+    // the rest in place, only the frame it ends in (shorter than HP_FRAME_MAX) is kept
+    used = scan(p, data, n);
+    p->pendingLen = n - used;
+    memcpy(p->pending, data + used, p->pendingLen);
+}
+
+size_t hp_putFrame(uint8_t *out, uint8_t cmd, const void *payload, uint8_t len)
+{
+    uint8_t check = len ^ cmd;
+    int i;
+
+    out[0] = HP_FRAME_START;
+    out[1] = len;
+    out[2] = cmd;
+    memcpy(out + 3, payload, len);
+    for (i = 0; i < len; i++)
+        check ^= out[3 + i];
+    out[3 + len] = check;
+    return len + 4;
+}
+
+size_t hp_putChunk(uint8_t *out, uint8_t sync, const void *payload, uint8_t len)
+{
+    uint8_t check = len;
+    int i;
+
+    out[0] = sync;
+    out[1] = len;
+    memcpy(out + 2, payload, len);
+    for (i = 0; i < len; i++)
+        check ^= out[2 + i];
+    out[2 + len] = check;
+    return len + 3;
+}
+
+static int16_t get16(const uint8_t **d)
+{
+    int16_t v = (int16_t)((*d)[0] | (*d)[1] << 8);
+
+    *d += 2;
+    return v;
+}
+
+static void get16n(const uint8_t **d, int16_t *v, int n)
+{
+    while (n--)
+        *v++ = get16(d);
+}
+
+static uint32_t get32(const uint8_t **d)
+{
+    uint32_t v = (uint32_t)(*d)[0] | (uint32_t)(*d)[1] << 8 | (uint32_t)(*d)[2] << 16 | (uint32_t)(*d)[3] << 24;
+
+    *d += 4;
+    return v;
+}
+
+int hp_streamDecode(const hp_frame_t *f, hp_stream_t *s)
+{
+    const uint8_t *d = f->payload;
+    int g, len = 6;
+
+    if (f->kind != HP_STREAM || f->len < 6)
+        return -1;
+    for (g = 0; g < HP_STREAM_GROUPS; g++)
+        if (d[1] & (1 << g))
+            len += streamGroupSize[g];
+    if (len != f->len)
+        return -1;
+
+    s->seq = *d++;
+    s->groups = *d++;
+    s->time = get32(&d);
+    if (s->groups & (1 << HP_STREAM_ATTITUDE)) {
+        get16n(&d, s->attitude.angle, 2);
+        s->attitude.heading = get16(&d);
+    }
+    if (s->groups & (1 << HP_STREAM_IMU)) {
+        get16n(&d, s->imu.acc, 3);
+        get16n(&d, s->imu.gyro, 3);
+        get16n(&d, s->imu.mag, 3);
+    }
+    if (s->groups & (1 << HP_STREAM_MOTORS))
+        get16n(&d, s->motor, 8);
+    if (s->groups & (1 << HP_STREAM_RC))
+        get16n(&d, s->rc, 8);
+    if (s->groups & (1 << HP_STREAM_STATUS)) {
+        s->status.cycleTime = get16(&d);
+        s->status.alt = get16(&d);
+        s->status.i2cErrors = get16(&d);
+        s->status.vbat = *d++;
+        s->status.flags = *d++;
+        s->status.mixShifted = *d++;
+        s->status.mixScaled = *d++;
+        s->status.overruns = get16(&d);
+        s->status.overrunTask = *d++;
+    }
+    if (s->groups & (1 << HP_STREAM_OSD)) {
+        get16n(&d, s->osd.angle, 2);
+        s->osd.heading = get16(&d);
+        s->osd.alt = get16(&d);
+        s->osd.vbat = *d++;
+        s->osd.numSat = *d++;
+        s->osd.distanceToHome = get16(&d);
+        s->osd.directionToHome = get16(&d);
+        s->osd.flags = *d++;
+    }
+    if (s->groups & (1 << HP_STREAM_POWER)) {
+        s->power.meter = get16(&d);
+        s->power.draw = get16(&d);
+        s->power.vbat = *d++;
+    }
+    if (s->groups & (1 << HP_STREAM_NOTCH))
+        get16n(&d, (int16_t *)s->notchHz, 3);
+    return 0;
+}
+
+// ************************************************************************************************************
+// Board clock
+// ************************************************************************************************************
+#define CLOCK_RTT_SLACK     50e-6       // s, on top of 1.5 times the shortest round trip
+#define CLOCK_DRIFT_SPAN    1.0         // s of board time the samples must cover before a drift is fitted
+#define CLOCK_DRIFT_MAX     1e-3        // a crystal is good for 100ppm, more is a bad fit
+
+void hp_clockInit(hp_clock_t *c)
+{
+    memset(c, 0, sizeof(*c));
+}
+
+size_t hp_clockPing(hp_clock_t *c, uint8_t *out, double hostNow)
+{
+    uint8_t token[4];
+
+    c->token = (uint32_t)(hostNow * 1e6) | 1;
+    c->sent = hostNow;
+    token[0] = c->token;
+    token[1] = c->token >> 8;
+    token[2] = c->token >> 16;
+    token[3] = c->token >> 24;
+    return hp_putFrame(out, 'y', token, 4);
+}
+
+static double clockUnwrap(const hp_clock_t *c, uint32_t us)
+{
+    return c->lastBoard + (int32_t)(us - c->lastRaw) * 1e-6;
+}
+
+// least squares line through the samples with a short round trip
+static void clockFit(hp_clock_t *c)
+{
+    int i, n = c->samples < HP_CLOCK_SAMPLES ? c->samples : HP_CLOCK_SAMPLES, k = 0;
+    double limit, b = 0.0, o = 0.0, sbb = 0.0, sbo = 0.0, lo = 0.0, hi = 0.0;
+
+    c->rttMin = c->rtt[0];
+    for (i = 1; i < n; i++)
+        if (c->rtt[i] < c->rttMin)
+            c->rttMin = c->rtt[i];
+    limit = c->rttMin * 1.5 + CLOCK_RTT_SLACK;
+    for (i = 0; i < n; i++)
+        if (c->rtt[i] <= limit) {
+            b += c->board[i];
+            o += c->offset[i];
+            if (!k || c->board[i] < lo)
+                lo = c->board[i];
+            if (!k || c->board[i] > hi)
+                hi = c->board[i];
+            k++;
+        }
+    b /= k;
+    o /= k;
+    c->boardAt = b;
+    c->offsetAt = o;
+    if (hi - lo < CLOCK_DRIFT_SPAN)
+        return;                         // keeps the drift there was
+    for (i = 0; i < n; i++)
+        if (c->rtt[i] <= limit) {
+            sbb += (c->board[i] - b) * (c->board[i] - b);
+            sbo += (c->board[i] - b) * (c->offset[i] - o);
+        }
+    c->drift = sbo / sbb;
+    if (c->drift > CLOCK_DRIFT_MAX || c->drift < -CLOCK_DRIFT_MAX)
+        c->drift = 0.0;
+}
+
+int hp_clockUpdate(hp_clock_t *c, const hp_frame_t *f, double hostNow)
+{
+    const uint8_t *d = f->payload;
+    uint32_t token, rx, tx;
+    double turn, rtt, mid;
+    int i;
+
+    if (f->kind != HP_REPLY || f->cmd != 'y' || f->len != 12 || !c->token)
+        return -1;
+    token = get32(&d);
+    rx = get32(&d);
+    tx = get32(&d);
+    if (token != c->token)
+        return -1;
+    c->token = 0;
+    if (!c->samples) {
+        c->lastRaw = rx;
+        c->lastBoard = rx * 1e-6;
+    }
+    turn = (uint32_t)(tx - rx) * 1e-6;
+    rtt = hostNow - c->sent - turn;
+    mid = clockUnwrap(c, rx) + turn / 2;
+    c->lastBoard = clockUnwrap(c, rx);
+    c->lastRaw = rx;
+
+    i = c->samples % HP_CLOCK_SAMPLES;
+    c->board[i] = mid;
+    c->offset[i] = (c->sent + hostNow) / 2 - mid;
+    c->rtt[i] = rtt > 0.0 ? rtt : 0.0;
+    c->samples++;
+    clockFit(c);
+    c->valid = 1;
+    return 0;
+}
+
+double hp_clockHost(const hp_clock_t *c, uint32_t boardUs)
+{
+    double b = clockUnwrap(c, boardUs);
+
+    return b + c->offsetAt + c->drift * (b - c->boardAt);
+}
@@ -0,0 +1,144 @@
+/* Host side parsers and serializers for the serial protocols of the boards in this repo
+ *
+ * One parser picks every kind of frame the boards send out of a single byte stream:
+ *   HP_FRAME     '$', len, cmd, payload[len], xor of len..payload. afrowii's serialCom() takes requests in it,
+ *                AfroFlight and CShred use it both ways
+ *   HP_REPLY     afrowii's GUI replies, the letter, a fixed size payload and the letter again ('M', 'O', ...).
+ *                Their lengths depend on the firmware, hp_init() takes a table of them
+ *   HP_STREAM    SERIAL_STREAM frames, 0xA5, len, payload[len], xor of len..payload. hp_streamDecode() splits
+ *                the payload into its groups, the board time of the values comes with them
+ *   HP_BLACKBOX  BLACKBOX chunks, the same shape with 0xB8. The payloads concatenated are the record stream
+ *                blackbox_decode.c reads
+ *   HP_WATCH     WATCH frames, the same shape with 0xA7: seq, samples lost before it, then whole samples of the
+ *                variables the 'w' command picked, in its order and little endian
+ * hp_feed() takes the input in pieces of any size and calls back once per frame, nothing is allocated. A frame
+ * that lies inside the piece handed in is passed by pointer into it, only the frames split between two pieces
+ * are copied (into the parser). Bytes that don't start a frame, and the start of frames that fail their
+ * checksum or closing letter, are skipped and the scan goes on from the next byte.
+ * The interface is plain C with fixed size structs, so it can be called from ctypes or P/Invoke as it is.
+ */
+#ifndef HOSTPROTO_H
+#define HOSTPROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HP_FRAME_START      '$'
+#define HP_STREAM_SYNC      0xA5
+#define HP_BLACKBOX_SYNC    0xB8
+#define HP_WATCH_SYNC       0xA7
+#define HP_FRAME_MAX        (4 + 255)           // '$' frame with the largest payload
+#define HP_PENDING_MAX      (2 * HP_FRAME_MAX)  // a split frame and what completes it
+
+enum { HP_FRAME = 0, HP_REPLY, HP_STREAM, HP_BLACKBOX, HP_WATCH, HP_KINDS };
+
+typedef struct {
+    uint8_t kind;                       // HP_FRAME ..
+    uint8_t cmd;                        // command or reply letter, the sync byte of the chunk kinds
+    uint8_t len;
+    const uint8_t *payload;             // only valid during the callback
+} hp_frame_t;
+
+typedef void (*hp_callback_t)(const hp_frame_t *f, void *user);
+
+typedef struct {
+    const uint8_t *replyLen;            // whole length of the HP_REPLY of each letter, 0 for none. NULL: no replies
+    hp_callback_t cb;
+    void *user;
+    uint8_t pending[HP_PENDING_MAX];    // the start of a frame the last piece ended in
+    uint16_t pendingLen;
+    uint32_t frames;                    // good frames
+    uint32_t badFrames;                 // starts that failed the checksum or the closing letter
+    uint32_t skipped;                   // bytes outside of any frame
+} hp_parser_t;
+
+/* the HP_REPLY lengths of this afrowii tree, 'M', 'O', 'K' and 'w' */
+extern const uint8_t hp_afrowiiReplies[256];
+
+void hp_init(hp_parser_t *p, const uint8_t *replyLen, hp_callback_t cb, void *user);
+void hp_feed(hp_parser_t *p, const uint8_t *data, size_t n);
+
+/* serializers, out needs len + 4 (hp_putFrame) or len + 3 (hp_putChunk) bytes. Both return the bytes written */
+size_t hp_putFrame(uint8_t *out, uint8_t cmd, const void *payload, uint8_t len);
+size_t hp_putChunk(uint8_t *out, uint8_t sync, const void *payload, uint8_t len);
+
+/* SERIAL_STREAM payload, the groups in the order of the stream section of MultiWii_afro.c */
+enum {
+    HP_STREAM_ATTITUDE = 0,
+    HP_STREAM_IMU,
+    HP_STREAM_MOTORS,
+    HP_STREAM_RC,
+    HP_STREAM_STATUS,
+    HP_STREAM_OSD,
+    HP_STREAM_POWER,
+    HP_STREAM_NOTCH,
+    HP_STREAM_GROUPS
+};
+
+typedef struct {
+    uint8_t seq;
+    uint8_t groups;                     // bit per group present, only those fields are written
+    uint32_t time;                      // board micros() of the loop the values are from, see hp_clockHost()
+    struct {
+        int16_t angle[2], heading;
+    } attitude;
+    struct {
+        int16_t acc[3], gyro[3], mag[3];
+    } imu;
+    int16_t motor[8];
+    int16_t rc[8];
+    struct {
+        uint16_t cycleTime;
+        int16_t alt;                    // EstAlt / 10
+        uint16_t i2cErrors;
+        uint8_t vbat, flags, mixShifted, mixScaled;
+        uint16_t overruns;
+        uint8_t overrunTask;
+    } status;
+    struct {
+        int16_t angle[2], heading, alt;
+        uint8_t vbat, numSat;
+        uint16_t distanceToHome;
+        int16_t directionToHome;
+        uint8_t flags;
+    } osd;
+    struct {
+        uint16_t meter, draw;
+        uint8_t vbat;
+    } power;
+    uint16_t notchHz[3];                // DYN_NOTCH centres, 0 for none
+} hp_stream_t;
+
+/* 0 when the frame is an HP_STREAM frame of exactly its groups, -1 otherwise */
+int hp_streamDecode(const hp_frame_t *f, hp_stream_t *s);
+
+/* Board clock on the host's. hp_clockPing() writes the 'y' request (8 bytes), hp_clockUpdate() takes the reply:
+ * NTP style, the round trip less the board's turnaround between its rx and tx stamps, the offset at the middle.
+ * Of the last HP_CLOCK_SAMPLES, those within 1.5 times the shortest round trip go into a least squares line,
+ * offset and drift, so a reply that sat in a queue doesn't move the estimate. hp_clockHost() puts a board
+ * micros() (hp_stream_t.time) on the host clock, valid once a reply was taken; the sample age is the host time
+ * the frame came in less that. Host times are seconds of any monotonic clock. The board's 32 bit micros() wraps
+ * every 71 minutes, times within half of that of the last reply are unwrapped */
+#define HP_CLOCK_SAMPLES    16
+
+typedef struct {
+    double board[HP_CLOCK_SAMPLES];     // board s, unwrapped, the middle of the turnaround
+    double offset[HP_CLOCK_SAMPLES];    // host s - board s there
+    double rtt[HP_CLOCK_SAMPLES];       // s, less the turnaround
+    uint32_t samples;                   // replies taken
+    uint32_t token;                     // of the request out, 0 for none
+    double sent;                        // host s it went out
+    uint32_t lastRaw;                   // rx stamp of the last reply, for the unwrapping
+    double lastBoard;
+    double boardAt, offsetAt, drift;    // host = board + offsetAt + drift * (board - boardAt)
+    double rttMin;                      // shortest round trip in the window
+    int valid;
+} hp_clock_t;
+
+void hp_clockInit(hp_clock_t *c);
+size_t hp_clockPing(hp_clock_t *c, uint8_t *out, double hostNow);
+/* 0 when f is the reply to the last ping and was taken, -1 otherwise */
+int hp_clockUpdate(hp_clock_t *c, const hp_frame_t *f, double hostNow);
+double hp_clockHost(const hp_clock_t *c, uint32_t boardUs);
+
+#endif
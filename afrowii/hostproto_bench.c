@@ -0,0 +1,154 @@
+/* Throughput benchmark of the hostproto.c parser
+ *
+ * Builds a capture the way a ground station sees it: SERIAL_STREAM frames with every group, '$' frames,
+ * 'M' replies, BLACKBOX chunks and a few bytes of line noise between them, then feeds it to hp_feed() in
+ * pieces of 1 byte (a per byte read loop), 16, 64, 1024 bytes (serial reads) and all at once. Every stream
+ * frame is decoded with hp_streamDecode() on the way. Per piece size it reports MB/s, frames/s and the
+ * frames found against those built, the run exits with 2 on any difference.
+ *   gcc -O2 -o hostproto_bench hostproto_bench.c hostproto.c
+ *   ./hostproto_bench [MB]
+ * The capture is 16MB unless given, a 1MBaud link carries about 100kB/s.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "hostproto.h"
+
+typedef struct {
+    unsigned long frames[HP_KINDS];     // by kind
+    unsigned long decodeErrors;
+    unsigned long seqGaps;
+    int lastSeq;
+    int32_t sum;                        // of decoded fields, so the decoder can't be left out
+} count_t;
+
+static uint8_t *capture;
+static size_t captureLen;
+static unsigned long built[HP_KINDS];
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void frameSeen(const hp_frame_t *f, void *user)
+{
+    count_t *c = user;
+    hp_stream_t s;
+
+    c->frames[f->kind]++;
+    if (f->kind != HP_STREAM)
+        return;
+    if (hp_streamDecode(f, &s)) {
+        c->decodeErrors++;
+        return;
+    }
+    if (c->lastSeq >= 0 && s.seq != (uint8_t)(c->lastSeq + 1))
+        c->seqGaps++;
+    c->lastSeq = s.seq;
+    c->sum += s.imu.gyro[0] + s.motor[0] + s.status.cycleTime;
+}
+
+static void build(size_t size)
+{
+    uint8_t payload[255], seq = 0;
+    size_t n = 0;
+    unsigned long i;
+    int j, len;
+
+    capture = malloc(size + 1024);
+    if (!capture) {
+        fprintf(stderr, "hostproto_bench: out of memory\n");
+        exit(1);
+    }
+    srand(1);
+    for (i = 0; n < size; i++) {
+        // a stream frame with all 8 groups, the time and 95 bytes of payload
+        payload[0] = seq++;
+        payload[1] = (1 << HP_STREAM_GROUPS) - 1;
+        for (j = 2; j < 101; j++)
+            payload[j] = rand();
+        n += hp_putChunk(capture + n, HP_STREAM_SYNC, payload, 101);
+        built[HP_STREAM]++;
+        if (i % 4 == 0) {
+            len = rand() % 40;
+            for (j = 0; j < len; j++)
+                payload[j] = rand();
+            n += hp_putFrame(capture + n, 'a' + rand() % 26, payload, len);
+            built[HP_FRAME]++;
+        }
+        if (i % 8 == 0) {
+            capture[n] = 'M';
+            for (j = 1; j < hp_afrowiiReplies['M'] - 1; j++)
+                capture[n + j] = rand();
+            capture[n + j] = 'M';
+            n += hp_afrowiiReplies['M'];
+            built[HP_REPLY]++;
+        }
+        if (i % 3 == 0) {
+            for (j = 0; j < 96; j++)
+                payload[j] = rand();
+            n += hp_putChunk(capture + n, HP_BLACKBOX_SYNC, payload, 96);
+            built[HP_BLACKBOX]++;
+        }
+        if (i % 16 == 0)
+            for (j = rand() % 8; j > 0; j--)
+                capture[n++] = rand() % 0x20;   // noise, none of it starts a frame
+    }
+    captureLen = n;
+}
+
+static int run(size_t piece)
+{
+    hp_parser_t p;
+    count_t c;
+    unsigned long total;
+    size_t off, n;
+    double t;
+    int k, ok = 1;
+
+    memset(&c, 0, sizeof(c));
+    c.lastSeq = -1;
+    hp_init(&p, hp_afrowiiReplies, frameSeen, &c);
+    t = now();
+    for (off = 0; off < captureLen; off += n) {
+        n = captureLen - off < piece ? captureLen - off : piece;
+        hp_feed(&p, capture + off, n);
+    }
+    t = now() - t;
+    total = 0;
+    for (k = 0; k < HP_KINDS; k++) {
+        total += c.frames[k];
+        if (c.frames[k] != built[k])
+            ok = 0;
+    }
+    if (c.decodeErrors || c.seqGaps || p.badFrames)
+        ok = 0;
+    printf("%7lu %9.1f %11.0f %9lu %6lu %6lu %5lu  %s\n", (unsigned long)piece, captureLen / t / 1e6, total / t,
+           total, (unsigned long)p.badFrames, c.decodeErrors, c.seqGaps, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t pieces[] = { 1, 16, 64, 1024, 0 };
+    unsigned long total = 0;
+    size_t i;
+    int k, ok = 1;
+
+    build((argc > 1 ? atof(argv[1]) : 16) * 1000000);
+    for (k = 0; k < HP_KINDS; k++)
+        total += built[k];
+    printf("capture %lu bytes, %lu frames (%lu stream, %lu '$', %lu reply, %lu blackbox)\n", (unsigned long)captureLen,
+           total, built[HP_STREAM], built[HP_FRAME], built[HP_REPLY], built[HP_BLACKBOX]);
+    printf("  piece      MB/s    frames/s    frames    bad decode  gaps\n");
+    for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++)
+        ok &= run(pieces[i] ? pieces[i] : captureLen);
+    free(capture);
+    return ok ? 0 : 2;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+/* Register accessors for the interrupt handlers and the per byte/per frame driver paths, shared by afrowii
+ * and AfroFlight. The StdPeriph calls these stand for are out of line, carry an assert_param() and, for the
+ * ones taking a flag or channel argument, decode it at run time; here the argument is a constant and each
+ * accessor comes down to the one or two register accesses it needs. Setup code keeps using StdPeriph.
+ * Like fixmath.h the includer brings the device header (stm8s.h, or the STM32 ones through board.h).
+ *
+ * Cosmic inlines what is marked @inline, gcc whatever is static inline.
+ */
+#if defined(__GNUC__)
+#define HWREG_INLINE        static inline
+#elif defined(__CSMC__) && !defined(_MSC_VER)
+#define HWREG_INLINE        static @inline
+#else
+#define HWREG_INLINE        static
+#endif
+
+#if defined(__STM8S_H)
+// TIM3 channel 1 input capture (the PPM/PWM receiver)
+HWREG_INLINE uint8_t tim3_cc1Pending(void)
+{
+    return TIM3->SR1 & TIM3_SR1_CC1IF;
+}
+
+// TIM3_ClearITPendingBit(TIM3_IT_CC1), reading the capture clears it too
+HWREG_INLINE void tim3_cc1Clear(void)
+{
+    TIM3->SR1 = (uint8_t)~TIM3_SR1_CC1IF;
+}
+
+// high byte first, that latches the low one (TIM3_GetCapture1())
+HWREG_INLINE uint16_t tim3_capture1(void)
+{
+    uint8_t h = TIM3->CCR1H;
+
+    return (uint16_t)h << 8 | TIM3->CCR1L;
+}
+
+// the edge TIM3_ICInit() would select, without taking the channel down and setting it up again
+HWREG_INLINE void tim3_cc1Falling(uint8_t falling)
+{
+    if (falling)
+        TIM3->CCER1 |= TIM3_CCER1_CC1P;
+    else
+        TIM3->CCER1 &= (uint8_t)~TIM3_CCER1_CC1P;
+}
+
+// UART2
+HWREG_INLINE void uart2_put(uint8_t c)
+{
+    UART2->DR = c;
+}
+
+HWREG_INLINE uint8_t uart2_get(void)
+{
+    return UART2->DR;
+}
+
+HWREG_INLINE void uart2_rxneClear(void)
+{
+    UART2->SR = (uint8_t)~UART2_SR_RXNE;
+}
+
+HWREG_INLINE void uart2_txeIrq(uint8_t on)
+{
+    if (on)
+        UART2->CR2 |= UART2_CR2_TIEN;
+    else
+        UART2->CR2 &= (uint8_t)~UART2_CR2_TIEN;
+}
+
+HWREG_INLINE uint8_t uart2_txDone(void)
+{
+    return UART2->SR & UART2_SR_TC;
+}
+
+// ADC1 data buffer, right aligned: low byte first (ADC1_GetBufferValue())
+HWREG_INLINE uint16_t adc1_buffer(uint8_t n)
+{
+    const volatile uint8_t *p = &ADC1->DB0RH + 2 * n;
+    uint8_t l = p[1];
+
+    return (uint16_t)p[0] << 8 | l;
+}
+
+HWREG_INLINE void adc1_eocClear(void)
+{
+    ADC1->CSR &= (uint8_t)~ADC1_CSR_EOC;
+}
+#endif
+
+#if defined(STM32F1) || defined(STM32F4)
+// USART, the same on both
+HWREG_INLINE uint8_t usart_get(USART_TypeDef *usart)
+{
+    return (uint8_t)usart->DR;
+}
+
+HWREG_INLINE void usart_tcClear(USART_TypeDef *usart)
+{
+    usart->SR = (uint16_t)~USART_FLAG_TC;
+}
+
+HWREG_INLINE uint8_t usart_txDone(USART_TypeDef *usart)
+{
+    return (usart->SR & USART_FLAG_TC) != 0;
+}
+#endif
+
+#if defined(STM32F1)
+HWREG_INLINE void dma_enable(DMA_Channel_TypeDef *ch, uint8_t on)
+{
+    if (on)
+        ch->CCR |= DMA_CCR1_EN;
+    else
+        ch->CCR &= (uint16_t)~DMA_CCR1_EN;
+}
+
+HWREG_INLINE void dma_setCount(DMA_Channel_TypeDef *ch, uint16_t n)
+{
+    ch->CNDTR = n;
+}
+
+HWREG_INLINE uint16_t dma_count(DMA_Channel_TypeDef *ch)
+{
+    return ch->CNDTR;
+}
+
+// DMA1_IT_xxx / DMA1_FLAG_xxx, DMA_ClearITPendingBit() for DMA1
+HWREG_INLINE void dma1_clear(uint32_t flags)
+{
+    DMA1->IFCR = flags;
+}
+#endif
+
+#if defined(STM32F4)
+HWREG_INLINE void dma_enable(DMA_Stream_TypeDef *stream, uint8_t on)
+{
+    if (on)
+        stream->CR |= DMA_SxCR_EN;
+    else
+        stream->CR &= ~DMA_SxCR_EN;
+}
+
+HWREG_INLINE void dma_setCount(DMA_Stream_TypeDef *stream, uint16_t n)
+{
+    stream->NDTR = n;
+}
+
+HWREG_INLINE uint16_t dma_count(DMA_Stream_TypeDef *stream)
+{
+    return stream->NDTR;
+}
+
+// DMA_FLAG_xxx of streams 4..7 carry bit 29 and go to HIFCR, DMA_ClearFlag() less its run time decoding
+HWREG_INLINE void dma_clear(DMA_TypeDef *dma, uint32_t flags)
+{
+    if (flags & 0x20000000)
+        dma->HIFCR = flags & 0x0F7D0F7D;
+    else
+        dma->LIFCR = flags & 0x0F7D0F7D;
+}
+#endif
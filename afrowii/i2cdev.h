@@ -0,0 +1,111 @@
+#pragma once
+
+/* I2C device table of the sysdep_*.c bus backends, included once by the backend of the build, in its I2C
+ * section after I2C_MAX_STANDARD_HZ. Per address it keeps the bus speed from i2c_deviceSpeed() and the health
+ * of the device. A device whose jobs fail I2C_FAIL_LIMIT times in a row is backed off: i2c_submit() refuses its
+ * jobs with I2C_BACKOFF, without touching the bus, until a retry 2^backoff ms later. Each failed retry doubles
+ * that, up to I2C_BACKOFF_MAX, and one good job clears it. The table is written from i2c_submit() and the end
+ * of a job with interrupts masked; i2c_deviceSpeed() runs at init, before any job.
+ */
+#if defined(MOTOR_I2C)
+#define I2C_DEVICES         16          // up to 8 ESCs next to the sensors
+#else
+#define I2C_DEVICES         8
+#endif
+#define I2C_FAIL_LIMIT      3
+#define I2C_BACKOFF_MAX     10          // 1s between retries
+
+// us a job may take: twice its bytes on the wire (address, subaddr, restart address, data) at its speed.
+// A slave that doesn't answer fails in 0.5ms at 400kHz, not a fixed worst case for the slowest device
+#define I2C_JOB_TIMEOUT(job)    ((uint16_t)((job)->len + 4) * ((job)->fast ? 50 : 200))
+
+typedef struct {
+    uint8_t address;
+    uint8_t fast;
+    uint8_t failures;                   // in a row
+    uint8_t backoff;                    // 0 healthy, else the retry interval is 2^backoff ms
+    uint32_t retryAt;                   // microsISR()
+    uint16_t errors;                    // failed jobs since startup
+    uint16_t refused;                   // jobs refused while backed off
+} i2cDevice_t;
+
+static i2cDevice_t i2cDevice[I2C_DEVICES];
+static uint8_t i2cDevices = 0;
+
+// the entry of address, a new one starts at I2C_SPEED. NULL when the table is full, the device is then
+// run at I2C_SPEED and never backed off
+static i2cDevice_t *i2cdev_find(uint8_t address)
+{
+    uint8_t i;
+
+    address &= 0xFE;
+    for (i = 0; i < i2cDevices; i++)
+        if (i2cDevice[i].address == address)
+            return &i2cDevice[i];
+    if (i == I2C_DEVICES)
+        return NULL;
+    i2cDevice[i].address = address;
+    i2cDevice[i].fast = I2C_SPEED > I2C_MAX_STANDARD_HZ;
+    i2cDevices++;
+    return &i2cDevice[i];
+}
+
+// from i2c_submit(): fills in job->fast, 0 when the device is backed off and the job is refused
+static uint8_t i2cdev_admit(i2cJob_t *job, uint32_t now)
+{
+    i2cDevice_t *dev = i2cdev_find(job->address);
+
+    if (!dev) {
+        job->fast = I2C_SPEED > I2C_MAX_STANDARD_HZ;
+        return 1;
+    }
+    job->fast = dev->fast;
+    if (dev->backoff && (int32_t)(now - dev->retryAt) < 0) {
+        if (dev->refused < 0xFFFF)
+            dev->refused++;
+        return 0;
+    }
+    return 1;
+}
+
+// from the end of a job, with its final status
+static void i2cdev_result(const i2cJob_t *job, uint8_t status, uint32_t now)
+{
+    i2cDevice_t *dev = i2cdev_find(job->address);
+
+    if (!dev)
+        return;
+    if (status == I2C_SUCCESS) {
+        dev->failures = 0;
+        dev->backoff = 0;
+        return;
+    }
+    if (dev->errors < 0xFFFF)
+        dev->errors++;
+    if (dev->failures < 0xFF)
+        dev->failures++;
+    if (dev->failures >= I2C_FAIL_LIMIT) {
+        if (dev->backoff < I2C_BACKOFF_MAX)
+            dev->backoff++;
+        dev->retryAt = now + (1000UL << dev->backoff);
+    }
+}
+
+void i2c_deviceSpeed(uint8_t address, uint32_t hz)
+{
+    i2cDevice_t *dev = i2cdev_find(address);
+
+    if (dev)
+        dev->fast = hz > I2C_MAX_STANDARD_HZ;
+}
+
+uint8_t i2c_deviceStats(uint8_t index, i2cDeviceStats_t *stats)
+{
+    if (index >= i2cDevices)
+        return 0;
+    stats->address = i2cDevice[index].address;
+    stats->errors = i2cDevice[index].errors;
+    stats->refused = i2cDevice[index].refused;
+    stats->backoff = i2cDevice[index].backoff;
+    return 1;
+}
@@ -4,6 +4,7 @@
 
 void setup(void);
 void loop(void);
+void kernelBench(void);
 
 #ifdef STM32TEST
 void loop2(void)
@@ -23,7 +24,10 @@ void loop2(void)
             do {
                 buf[ptr++] = Serial_read();
             } while (Serial_available() > 0);
-            debug_printf("serial: %s\n", buf);
+#if defined(SWO_TRACE)
+            trace_printf("serial: %s\n", buf);
+            trace_flush();
+#endif
         }
     } 
 }
@@ -46,9 +50,17 @@ void loop3(void)
 
 int main(void)
 {
+    // before anything else has run deep: whatever is still painted at the end has never been stack
+    stack_paint();
+
     // system dependent hardware init
     hw_init();
 
+#if defined(KERNEL_BENCH)
+    for (;;)
+        kernelBench();
+#endif
+
     setup();
 
     for (;;)
@@ -0,0 +1,328 @@
+/* Host against board parity check for BIT_EXACT builds (see the 'x' command in MultiWii_afro.c)
+ *
+ * Turns a host simulator log (the AFROWII_SIM_LOG format of sysdep_host.c: time_us gyro[3] acc[3] mag[3] rc[8])
+ * into step frames, one per sample: its time, gyro and acc, and the rc columns as a receiver frame every 20ms of
+ * log time. The simulator and the board both run one loop per frame on the frame's clock and answer with motor[],
+ * so the same frames have to give the same outputs on both, every step:
+ *   gcc -O2 -o parity_bench parity_bench.c
+ *   gcc -O2 -DHOSTSIM -DHIL_INJECT -DBIT_EXACT -I. -o afrowii_parity main.c MultiWii_afro.c sysdep_host.c -lm
+ *   ./parity_bench -w flight.log > steps.bin
+ *   AFROWII_SIM_SERIAL_IN=steps.bin AFROWII_SIM_SERIAL=host.bin ./afrowii_parity > /dev/null
+ *   ./parity_bench [-b baud] -g host.bin /dev/ttyUSB0 steps.bin > board.txt
+ * The board's outputs go to stdout, "step motor[8]" per frame. With -g they are compared against the simulator's
+ * replies: the steps that differ are counted, the first one printed with both sides, and the run exits with 2.
+ * ./parity_bench -r host.bin prints the simulator's replies the same way.
+ * The board has to be a BIT_EXACT build with the simulator's frame type, gyro and acc (acc_1G = 512), the
+ * sensors it doesn't get from the frames left out of the trace (no BARO or MAG mode). Props off.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define STEP_PAYLOAD        32          // time, gyro[3], acc[3], rc[8]
+#define STEP_FRAME          (STEP_PAYLOAD + 4)
+#define STEP_REPLY          20          // 'x', step, motor[8], 'x'
+#define RC_FRAME_PERIOD     20000       // us
+#define STEP_TIMEOUT        1.0         // s, a loop with every task due is well under that
+
+static int port = -1;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void put16(uint8_t *p, int16_t v)
+{
+    p[0] = v;
+    p[1] = (uint16_t)v >> 8;
+}
+
+// ************************************************************************************************************
+// Step frames: '$', len, 'x', payload[len], xor of len..payload, the parser's checksummed framing
+// ************************************************************************************************************
+static int writeSteps(const char *name)
+{
+    char line[256];
+    uint8_t f[STEP_FRAME], check;
+    unsigned long t, lastRc = 0, steps = 0;
+    long l[19];
+    FILE *log;
+    int i;
+
+    if (!(log = fopen(name, "r"))) {
+        fprintf(stderr, "parity_bench: can't open %s\n", name);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), log)) {
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+            continue;
+        if (sscanf(line, "%lu %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld",
+                   &t, &l[1], &l[2], &l[3], &l[4], &l[5], &l[6], &l[7], &l[8], &l[9],
+                   &l[10], &l[11], &l[12], &l[13], &l[14], &l[15], &l[16], &l[17], &l[18]) != 19) {
+            fprintf(stderr, "parity_bench: bad log line: %s", line);
+            continue;
+        }
+        memset(f, 0, sizeof(f));
+        f[0] = '$';
+        f[1] = STEP_PAYLOAD;
+        f[2] = 'x';
+        f[3] = t;
+        f[4] = t >> 8;
+        f[5] = t >> 16;
+        f[6] = t >> 24;
+        for (i = 0; i < 3; i++) {
+            put16(f + 7 + i * 2, l[1 + i]);
+            put16(f + 13 + i * 2, l[4 + i]);
+        }
+        // the first sample brings the receiver, then one every RC_FRAME_PERIOD like the simulator's
+        if (!steps || t - lastRc >= RC_FRAME_PERIOD) {
+            for (i = 0; i < 8; i++)
+                put16(f + 19 + i * 2, l[10 + i]);
+            lastRc = t;
+        }
+        check = f[1] ^ f[2];
+        for (i = 3; i < STEP_FRAME - 1; i++)
+            check ^= f[i];
+        f[STEP_FRAME - 1] = check;
+        fwrite(f, 1, sizeof(f), stdout);
+        steps++;
+    }
+    fclose(log);
+    fprintf(stderr, "parity_bench: %lu steps\n", steps);
+    return 0;
+}
+
+// ************************************************************************************************************
+// Replies: 'x', step count (16 bit), motor[8], 'x'
+// ************************************************************************************************************
+typedef struct {
+    size_t n, size;
+    uint16_t *step;
+    int16_t (*out)[8];
+} replies_t;
+
+static void replyAdd(replies_t *r, const uint8_t *p)
+{
+    int k;
+
+    if (r->n == r->size) {
+        r->size = r->size ? r->size * 2 : 4096;
+        r->step = realloc(r->step, r->size * sizeof(*r->step));
+        r->out = realloc(r->out, r->size * sizeof(*r->out));
+        if (!r->step || !r->out) {
+            fprintf(stderr, "parity_bench: out of memory\n");
+            exit(1);
+        }
+    }
+    r->step[r->n] = p[1] | p[2] << 8;
+    for (k = 0; k < 8; k++)
+        r->out[r->n][k] = p[3 + k * 2] | p[4 + k * 2] << 8;
+    r->n++;
+}
+
+// the replies in a capture of the simulator's serial output, anything else in between is skipped
+static int loadReplies(const char *name, replies_t *r)
+{
+    uint8_t p[STEP_REPLY];
+    FILE *f = fopen(name, "rb");
+    int c, n = 0;
+
+    if (!f)
+        return 0;
+    while ((c = getc(f)) != EOF) {
+        if (n == 0 && c != 'x')
+            continue;
+        p[n++] = c;
+        if (n == STEP_REPLY) {
+            if (c == 'x')
+                replyAdd(r, p);
+            n = 0;
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+static void printReply(FILE *f, const replies_t *r, size_t i)
+{
+    int k;
+
+    fprintf(f, "%u", r->step[i]);
+    for (k = 0; k < 8; k++)
+        fprintf(f, " %d", r->out[i][k]);
+    fprintf(f, "\n");
+}
+
+// ************************************************************************************************************
+// Board
+// ************************************************************************************************************
+static speed_t baudCode(long baud)
+{
+    switch (baud) {
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    case 460800:
+        return B460800;
+    case 921600:
+        return B921600;
+#if defined(B500000)
+    case 500000:
+        return B500000;
+    case 1000000:
+        return B1000000;
+#endif
+    }
+    fprintf(stderr, "parity_bench: unsupported baud rate %ld\n", baud);
+    exit(1);
+}
+
+static void portOpen(const char *dev, long baud)
+{
+    struct termios tio;
+
+    if ((port = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0 || tcgetattr(port, &tio) < 0) {
+        fprintf(stderr, "parity_bench: can't open %s\n", dev);
+        exit(1);
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, baudCode(baud));
+    cfsetospeed(&tio, baudCode(baud));
+    tio.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(port, TCSANOW, &tio);
+    tcflush(port, TCIOFLUSH);
+}
+
+// one frame out, its reply back. The board runs no loop without a frame, so the link is otherwise quiet
+static int step(const uint8_t *f, uint8_t *reply)
+{
+    struct pollfd pfd = { port, POLLIN, 0 };
+    double end;
+    ssize_t w;
+    size_t i;
+    uint8_t c;
+    int n = 0;
+
+    for (i = 0; i < STEP_FRAME; i += w)
+        if ((w = write(port, f + i, STEP_FRAME - i)) < 0)
+            w = 0;
+    for (end = now() + STEP_TIMEOUT; now() < end;) {
+        poll(&pfd, 1, 10);
+        while (read(port, &c, 1) == 1) {
+            if (n == 0 && c != 'x')
+                continue;
+            reply[n++] = c;
+            if (n == STEP_REPLY) {
+                if (c == 'x')
+                    return 1;
+                n = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static int runBoard(const char *dev, long baud, const char *stepsName, const char *hostName)
+{
+    uint8_t f[STEP_FRAME], reply[STEP_REPLY];
+    replies_t board = { 0 }, host = { 0 };
+    size_t i, diffs = 0, first = 0;
+    FILE *steps;
+
+    if (hostName && !loadReplies(hostName, &host)) {
+        fprintf(stderr, "parity_bench: can't open %s\n", hostName);
+        return 1;
+    }
+    if (!(steps = fopen(stepsName, "rb"))) {
+        fprintf(stderr, "parity_bench: can't open %s\n", stepsName);
+        return 1;
+    }
+    portOpen(dev, baud);
+    while (fread(f, 1, sizeof(f), steps) == sizeof(f)) {
+        if (!step(f, reply)) {
+            fprintf(stderr, "parity_bench: no reply to step %lu\n", (unsigned long)board.n + 1);
+            break;
+        }
+        replyAdd(&board, reply);
+        printReply(stdout, &board, board.n - 1);
+    }
+    fclose(steps);
+    close(port);
+    if (!hostName)
+        return 0;
+
+    for (i = 0; i < board.n && i < host.n; i++) {
+        if (board.step[i] == host.step[i] && !memcmp(board.out[i], host.out[i], sizeof(board.out[0])))
+            continue;
+        if (diffs++ == 0)
+            first = i;
+    }
+    if (board.n != host.n) {
+        fprintf(stderr, "parity_bench: %lu steps from the board, %lu from the simulator\n",
+                (unsigned long)board.n, (unsigned long)host.n);
+        return 2;
+    }
+    if (diffs) {
+        fprintf(stderr, "parity_bench: %lu of %lu steps differ, the first:\n  board ", (unsigned long)diffs,
+                (unsigned long)board.n);
+        printReply(stderr, &board, first);
+        fprintf(stderr, "  host  ");
+        printReply(stderr, &host, first);
+        return 2;
+    }
+    fprintf(stderr, "parity_bench: %lu steps, bit exact\n", (unsigned long)board.n);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: parity_bench -w log > steps\n"
+            "       parity_bench -r replies\n"
+            "       parity_bench [-b baud] [-g replies] device steps\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long baud = 115200;
+    const char *hostName = NULL;
+    replies_t r = { 0 };
+    size_t i;
+    int a;
+
+    if (argc == 3 && !strcmp(argv[1], "-w"))
+        return writeSteps(argv[2]);
+    if (argc == 3 && !strcmp(argv[1], "-r")) {
+        if (!loadReplies(argv[2], &r)) {
+            fprintf(stderr, "parity_bench: can't open %s\n", argv[2]);
+            return 1;
+        }
+        for (i = 0; i < r.n; i++)
+            printReply(stdout, &r, i);
+        return 0;
+    }
+    for (a = 1; a + 1 < argc && argv[a][0] == '-'; a += 2) {
+        if (!strcmp(argv[a], "-b"))
+            baud = atol(argv[a + 1]);
+        else if (!strcmp(argv[a], "-g"))
+            hostName = argv[a + 1];
+        else
+            usage();
+    }
+    if (a + 2 != argc)
+        usage();
+    return runBoard(argv[a], baud, argv[a + 1], hostName);
+}
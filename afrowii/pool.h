@@ -0,0 +1,80 @@
+#pragma once
+
+/* Fixed block pool for the descriptors that live from a request to its completion: a bus transaction handed
+ * to an interrupt driven engine and given back from its completion callback. One pool per block type, sized at
+ * compile time, no heap. Free blocks are a list linked through their first byte, and blocks never handed out
+ * yet come from the end of the storage, so a pool needs no setup and POOL_INIT() puts it in .data:
+ *     static i2cPost_t postStorage[4];
+ *     static pool_t postPool = POOL_INIT(postStorage);
+ * pool_alloc() and pool_free() are for the loop and mask interrupts around the two byte update, the _isr ones
+ * are for interrupt handlers and code that runs with interrupts masked (an i2cJob_t done callback). Handlers
+ * don't nest on one pool, so they need nothing else. Both are O(1).
+ * Every pool counts what it has out, the most it ever had out and the allocations it refused, the 'q' serial
+ * command reports them, so a pool is sized from a flight log rather than a guess. At most 254 blocks. */
+
+#define POOL_END            0xFF
+
+typedef struct {
+    uint8_t *mem;
+    uint8_t size;               // block size, at least 1 byte for the link
+    uint8_t count;
+    uint8_t free;               // first block of the free list, POOL_END for none
+    uint8_t fresh;              // blocks from here on were never handed out
+    uint8_t used;
+    uint8_t highWater;
+    uint16_t failed;            // allocations refused on an empty pool
+} pool_t;
+
+#define POOL_INIT(storage)  { (uint8_t *)(storage), sizeof((storage)[0]), sizeof(storage) / sizeof((storage)[0]), POOL_END, 0, 0, 0, 0 }
+
+#if defined(disableInterrupts)
+#define POOL_LOCK()         disableInterrupts()
+#define POOL_UNLOCK()       enableInterrupts()
+#else
+#define POOL_LOCK()                     // the host simulator's handlers run from the loop
+#define POOL_UNLOCK()
+#endif
+
+static void *pool_allocIsr(pool_t *p)
+{
+    uint8_t *b;
+
+    if (p->free != POOL_END) {
+        b = p->mem + (uint16_t)p->free * p->size;
+        p->free = b[0];
+    } else if (p->fresh < p->count) {
+        b = p->mem + (uint16_t)p->fresh++ * p->size;
+    } else {
+        p->failed++;
+        return NULL;
+    }
+    if (++p->used > p->highWater)
+        p->highWater = p->used;
+    return b;
+}
+
+static void pool_freeIsr(pool_t *p, void *block)
+{
+    uint8_t *b = block;
+
+    b[0] = p->free;
+    p->free = (uint16_t)(b - p->mem) / p->size;
+    p->used--;
+}
+
+static void *pool_alloc(pool_t *p)
+{
+    void *b;
+
+    POOL_LOCK();
+    b = pool_allocIsr(p);
+    POOL_UNLOCK();
+    return b;
+}
+
+static void pool_free(pool_t *p, void *block)
+{
+    POOL_LOCK();
+    pool_freeIsr(p, block);
+    POOL_UNLOCK();
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+/* Protothreads: a driver written as one sequential function ("start the conversion, wait 4.6ms, read it") that
+ * still returns at every wait, so the scheduler task or the loop that calls it never blocks. Each call runs on
+ * from the last wait to the next one:
+ *     static pt_t pt;
+ *     static uint8_t baroThread(void)
+ *     {
+ *         PT_BEGIN(&pt);
+ *         i2c_submitJob(&job, ...start...);
+ *         PT_SLEEP(&pt, currentTime, 4600);
+ *         PT_WAIT_UNTIL(&pt, i2c_jobDone(&job));
+ *         ...
+ *         PT_END(&pt);
+ *     }
+ * The position is kept as a line number and resumed with a switch, there is no stack of its own. So locals don't
+ * survive a wait (anything that has to is static or in the driver's context), the function can't have a switch
+ * of its own around a wait, and there is one wait per source line. A queued I2C job is waited for with
+ * i2c_jobDone(), an SPI transfer with !spi_isBusy(), time with PT_SLEEP() against the caller's clock.
+ * The function returns PT_WAITING from a wait and PT_DONE from PT_END(), the next call starts it over.
+ */
+
+typedef struct {
+    uint16_t line;                      // where the next call resumes, 0 at PT_BEGIN()
+    uint32_t wake;                      // PT_SLEEP() until then
+} pt_t;
+
+#define PT_WAITING  0
+#define PT_DONE     1
+
+#define PT_BEGIN(pt)            switch ((pt)->line) { case 0:
+#define PT_WAIT_UNTIL(pt, cond) do { (pt)->line = __LINE__; case __LINE__: if (!(cond)) return PT_WAITING; } while (0)
+#define PT_YIELD(pt)            do { (pt)->line = __LINE__; return PT_WAITING; case __LINE__:; } while (0)
+// now is read on every call, currentTime or micros()
+#define PT_SLEEP(pt, now, us)   do { (pt)->wake = (now) + (us); PT_WAIT_UNTIL(pt, (int32_t)((now) - (pt)->wake) >= 0); } while (0)
+#define PT_END(pt)              } (pt)->line = 0; return PT_DONE
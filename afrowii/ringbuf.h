@@ -0,0 +1,82 @@
+#pragma once
+
+/* Single producer / single consumer byte ring shared by the serial backends.
+ * The producer (usually an interrupt handler) only calls ring_put(), the consumer only ring_count(),
+ * ring_get() and ring_read(). Each side writes just its own index, so neither has to mask interrupts.
+ * Indices are free running uint8_t wrapped with a mask: the storage size must be a power of two,
+ * at most 128, so there's no division anywhere. A byte that doesn't fit is dropped and counted.
+ */
+
+typedef struct {
+    volatile uint8_t head;      // producer only
+    volatile uint8_t tail;      // consumer only
+    uint8_t mask;               // size - 1
+    uint16_t overflow;          // producer only, bytes dropped on a full ring
+    uint8_t *buf;
+} ring_t;
+
+#define RING_INIT(storage)  { 0, 0, sizeof(storage) - 1, 0, storage }
+
+static uint8_t ring_count(const ring_t *r)
+{
+    return (uint8_t)(r->head - r->tail);
+}
+
+static uint8_t ring_free(const ring_t *r)
+{
+    return r->mask + 1 - ring_count(r);
+}
+
+static uint8_t ring_put(ring_t *r, uint8_t c)
+{
+    uint8_t head = r->head;
+
+    if ((uint8_t)(head - r->tail) > r->mask) {
+        r->overflow++;
+        return 0;
+    }
+    r->buf[head & r->mask] = c;
+    r->head = head + 1;         // publish after the data is in
+    return 1;
+}
+
+static uint8_t ring_get(ring_t *r)
+{
+    uint8_t tail = r->tail;
+    uint8_t c = r->buf[tail & r->mask];
+
+    r->tail = tail + 1;
+    return c;
+}
+
+// contiguous run of unread bytes starting at *data, doesn't consume them
+static uint8_t ring_peek(const ring_t *r, const uint8_t **data)
+{
+    uint8_t tail = r->tail;
+    uint8_t n = (uint8_t)(r->head - tail);
+    uint8_t run = r->mask + 1 - (tail & r->mask);
+
+    *data = &r->buf[tail & r->mask];
+    return n < run ? n : run;
+}
+
+// drop n bytes previously looked at with ring_peek()
+static void ring_skip(ring_t *r, uint8_t n)
+{
+    r->tail += n;
+}
+
+// up to len bytes into dst, returns how many were copied
+static uint8_t ring_read(ring_t *r, uint8_t *dst, uint8_t len)
+{
+    uint8_t tail = r->tail;
+    uint8_t n = (uint8_t)(r->head - tail);
+    uint8_t i;
+
+    if (len > n)
+        len = n;
+    for (i = 0; i < len; i++)
+        dst[i] = r->buf[(uint8_t)(tail + i) & r->mask];
+    r->tail = tail + len;
+    return len;
+}
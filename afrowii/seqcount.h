@@ -0,0 +1,45 @@
+#pragma once
+
+/* Interrupt to loop hand over of anything wider than a byte, without masking interrupts.
+ * The handler writes the data, then bumps the channel's sequence count with seq_publish(). The loop copies
+ * between seq_begin() and seq_retry(), and starts over while a publish came in between:
+ *     do {
+ *         s = seq_begin(&rcFrameCount);
+ *         ...copy...
+ *     } while (seq_retry(&rcFrameCount, s));
+ * The count is a byte, which every target loads in one go, so this also holds on the STM8, where a 16 or 32
+ * bit value is loaded a byte or a word at a time and can tear. A handler runs to completion before the loop
+ * gets the CPU back, so the writer needs nothing else; data put together over several interrupts is built
+ * in a back buffer and published in one step (a double buffer flip, like mpuFront). Handlers that could
+ * nest on the same data would need the odd/even count of a full seqlock, there are none.
+ * Data that isn't volatile is copied with seq_load(), so the compiler can't move its loads out of the loop.
+ * A single value written by one side only (a counter the loop takes the difference of, the head or tail of
+ * a ringbuf.h ring) needs none of this as long as it is a byte.
+ */
+
+typedef volatile uint8_t seq_t;
+
+static uint8_t seq_begin(const seq_t *s)
+{
+    return *s;
+}
+
+static uint8_t seq_retry(const seq_t *s, uint8_t start)
+{
+    return *s != start;
+}
+
+// interrupt side, after the data is written
+static void seq_publish(seq_t *s)
+{
+    *s = *s + 1;
+}
+
+static void seq_load(void *dst, const volatile void *src, uint8_t n)
+{
+    const volatile uint8_t *p = src;
+    uint8_t *d = dst;
+
+    while (n--)
+        *d++ = *p++;
+}
@@ -0,0 +1,446 @@
+/* Serial link benchmark for SERIAL_BENCH builds (see the 'g' command in MultiWii_afro.c)
+ *
+ * Measures one link end to end, through whatever is in between: the UART interrupt or DMA, the USB CDC port, the
+ * parser in serialCom(), telemetry_proxy. Three tests, in this order:
+ *   rtt     round trips of the 'y' clock ping bare and '$' framed, and of the 'M' reply (the biggest GUI reply),
+ *           one request out at a time: min, p50, p90, p99, max and the requests that got no reply
+ *   down    a 'g' burst per payload size: frames/s and bytes/s as they came in, frames lost on the way (sequence
+ *           gaps), and the board's report of what it sent, dropped and how long that took
+ *   up      framed 'y' pings back to back, -w of them in flight: commands/s, replies lost, and between two empty
+ *           'g' requests what the parser made of them: bad frames, RX bytes lost, commands dispatched
+ * The report is one JSON object on stdout, so the runs before and after a change to sysdep_*, usb/ or the parsers
+ * can be diffed or plotted. Progress goes to stderr.
+ *   gcc -O2 -o serial_bench serial_bench.c hostproto.c
+ *   ./serial_bench [-b baud] [-n count] [-w window] [-t device] /dev/ttyUSB0 > report.json
+ *   ./serial_bench localhost:5760 > report.json        (through telemetry_proxy)
+ * -n is the requests per rtt test, the frames per burst and the pings of the up test (500). -t reads the bursts
+ * from the telemetry port device instead (the STM32 USB build's vendor endpoint, port 1 of 'g'). A board or
+ * proxy that doesn't answer the first empty 'g' exits with 1.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "hostproto.h"
+
+#define RTT_TIMEOUT         0.5         // s a request waits for its reply
+#define REPORT_TIMEOUT      2.0         // s past the expected end of a burst
+#define UP_DRAIN            1.0         // s for the last replies of the up test
+#define MAX_WINDOW          64
+#define GUI_REPLY           'M'
+
+static const uint8_t burstSizes[] = { 2, 16, 64, 120 };
+
+typedef struct {
+    uint16_t sent, dropped, rxLost, badFrames, commands;
+    uint32_t us;
+} benchReport_t;
+
+static int port = -1, tele = -1;
+static hp_parser_t linkParser, teleParser;
+static double rxTime;                   // host time of the bytes being parsed
+
+// what the callback looks for
+static uint32_t waitToken;              // 'y' reply, 0 for none
+static uint8_t waitReply;               // other reply letter, 0 for none
+static double replyTime;
+static uint8_t inFlight[MAX_WINDOW];    // up test: 1 while ping i % MAX_WINDOW is out
+static uint32_t upBase;                 // token of ping 0 of the up test, 0 outside of it
+static int waitSlot;
+static unsigned long upReplies;
+static int reportIn;
+static benchReport_t report;
+static unsigned long burstFrames, burstOrder;
+static uint16_t burstNext;
+static double burstFirst, burstLast;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ************************************************************************************************************
+// Link
+// ************************************************************************************************************
+static speed_t baudCode(long baud)
+{
+    switch (baud) {
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    case 460800:
+        return B460800;
+    case 921600:
+        return B921600;
+#if defined(B500000)
+    case 500000:
+        return B500000;
+    case 1000000:
+        return B1000000;
+    case 2000000:
+        return B2000000;
+#endif
+    }
+    fprintf(stderr, "serial_bench: unsupported baud rate %ld\n", baud);
+    exit(1);
+}
+
+// a tty, or host:port of a telemetry_proxy
+static int linkOpen(const char *dev, long baud)
+{
+    struct addrinfo hints, *ai;
+    struct termios tio;
+    char host[256];
+    const char *colon = strrchr(dev, ':');
+    int f;
+
+    if (dev[0] != '/' && colon && (size_t)(colon - dev) < sizeof(host)) {
+        memcpy(host, dev, colon - dev);
+        host[colon - dev] = 0;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, colon + 1, &hints, &ai) || (f = socket(ai->ai_family, SOCK_STREAM, 0)) < 0)
+            return -1;
+        if (connect(f, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(f);
+            f = -1;
+        }
+        freeaddrinfo(ai);
+        if (f >= 0)
+            fcntl(f, F_SETFL, O_NONBLOCK);
+        return f;
+    }
+    if ((f = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0)
+        return -1;
+    if (tcgetattr(f, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, baudCode(baud));
+        cfsetospeed(&tio, baudCode(baud));
+        tio.c_cflag |= CLOCAL | CREAD;
+        tcsetattr(f, TCSANOW, &tio);
+        tcflush(f, TCIOFLUSH);
+    }
+    return f;
+}
+
+static void portSend(const uint8_t *p, size_t n)
+{
+    struct pollfd pfd = { port, POLLOUT, 0 };
+    ssize_t w;
+
+    while (n) {
+        if ((w = write(port, p, n)) > 0) {
+            p += w;
+            n -= w;
+        } else if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            fprintf(stderr, "serial_bench: link write failed: %s\n", strerror(errno));
+            exit(1);
+        } else
+            poll(&pfd, 1, 100);
+    }
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void onFrame(const hp_frame_t *f, void *user)
+{
+    const uint8_t *p = f->payload;
+    uint32_t token;
+    uint16_t seq;
+
+    (void)user;
+    if (f->kind == HP_FRAME && f->cmd == 'g' && f->len >= 2) {
+        seq = p[0] | p[1] << 8;
+        if (!burstFrames)
+            burstFirst = rxTime;
+        else if (seq != burstNext)
+            burstOrder++;
+        burstLast = rxTime;
+        burstNext = seq + 1;
+        burstFrames++;
+    } else if (f->kind == HP_REPLY && f->cmd == 'g') {
+        report.sent = p[0] | p[1] << 8;
+        report.dropped = p[2] | p[3] << 8;
+        report.rxLost = p[4] | p[5] << 8;
+        report.badFrames = p[6] | p[7] << 8;
+        report.commands = p[8] | p[9] << 8;
+        report.us = get32(p + 10);
+        reportIn = 1;
+    } else if (f->kind == HP_REPLY && f->cmd == 'y') {
+        token = get32(p);
+        if (waitToken && token == waitToken) {
+            waitToken = 0;
+            replyTime = rxTime;
+        } else if (upBase && token - upBase < 0x80000000u && inFlight[(token - upBase) % MAX_WINDOW]) {
+            inFlight[(token - upBase) % MAX_WINDOW] = 0;
+            upReplies++;
+        }
+    } else if (f->kind == HP_REPLY && f->cmd == waitReply) {
+        waitReply = 0;
+        replyTime = rxTime;
+    }
+}
+
+// takes what arrives for up to timeout s, or less once done() says so
+static void pump(double timeout, int (*done)(void))
+{
+    struct pollfd pfd[2];
+    uint8_t buf[4096];
+    double end = now() + timeout;
+    ssize_t r;
+    int n, i;
+
+    while (!(done && done())) {
+        double left = end - now();
+        if (left <= 0)
+            return;
+        pfd[0].fd = port;
+        pfd[0].events = POLLIN;
+        n = 1;
+        if (tele >= 0) {
+            pfd[1].fd = tele;
+            pfd[1].events = POLLIN;
+            n = 2;
+        }
+        if (poll(pfd, n, (int)(left * 1000) + 1) <= 0)
+            continue;
+        for (i = 0; i < n; i++)
+            while (pfd[i].revents && (r = read(pfd[i].fd, buf, sizeof(buf))) > 0) {
+                rxTime = now();
+                hp_feed(i ? &teleParser : &linkParser, buf, r);
+            }
+    }
+}
+
+static int replied(void)
+{
+    return !waitToken && !waitReply;
+}
+
+static int slotFree(void)
+{
+    return !inFlight[waitSlot];
+}
+
+static int reported(void)
+{
+    return reportIn;
+}
+
+static int askReport(uint16_t frames, uint8_t size, uint8_t port, double timeout)
+{
+    uint8_t p[4] = { frames, frames >> 8, size, port }, f[8];
+
+    reportIn = 0;
+    portSend(f, hp_putFrame(f, 'g', p, 4));
+    pump(timeout, reported);
+    return reportIn;
+}
+
+// ************************************************************************************************************
+// Tests
+// ************************************************************************************************************
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *v, int n, double q)
+{
+    return v[(int)(q * (n - 1) + 0.5)];
+}
+
+// kind 0: bare 'y', 1: framed 'y', 2: bare 'M'
+static void rttTest(const char *name, int kind, int count, int comma)
+{
+    static uint32_t token = 1;
+    double *rtt = malloc(count * sizeof(double)), sent;
+    uint8_t f[16];
+    size_t n;
+    int i, got = 0;
+
+    if (!rtt) {
+        fprintf(stderr, "serial_bench: out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < count; i++) {
+        if (kind == 2) {
+            f[0] = GUI_REPLY;
+            n = 1;
+            waitReply = GUI_REPLY;
+        } else {
+            token++;
+            waitToken = token;
+            f[0] = token;
+            f[1] = token >> 8;
+            f[2] = token >> 16;
+            f[3] = token >> 24;
+            if (kind == 1) {
+                n = hp_putFrame(f + 4, 'y', f, 4);
+                memmove(f, f + 4, n);
+            } else {
+                memmove(f + 1, f, 4);
+                f[0] = 'y';
+                n = 5;
+            }
+        }
+        sent = now();
+        portSend(f, n);
+        pump(RTT_TIMEOUT, replied);
+        if (replied())
+            rtt[got++] = replyTime - sent;
+        waitToken = 0;
+        waitReply = 0;
+    }
+    qsort(rtt, got, sizeof(double), compareDouble);
+    fprintf(stderr, "serial_bench: rtt %s: %d of %d answered", name, got, count);
+    printf("    \"%s\": { \"requests\": %d, \"lost\": %d", name, count, count - got);
+    if (got) {
+        fprintf(stderr, ", p50 %.3fms", percentile(rtt, got, 0.5) * 1e3);
+        printf(", \"min_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f", rtt[0] * 1e3,
+               percentile(rtt, got, 0.5) * 1e3, percentile(rtt, got, 0.9) * 1e3, percentile(rtt, got, 0.99) * 1e3,
+               rtt[got - 1] * 1e3);
+    }
+    fprintf(stderr, "\n");
+    printf(" }%s\n", comma ? "," : "");
+    free(rtt);
+}
+
+static void downTest(uint8_t size, int count, uint8_t port, int comma)
+{
+    double span, expect = count * (size + 4) * 10.0 / 115200;  // the slowest link it should see
+    int ok;
+
+    burstFrames = burstOrder = 0;
+    ok = askReport(count, size, port, expect + REPORT_TIMEOUT);
+    pump(0.05, NULL);                   // frames of the telemetry port can come in after the report
+    span = burstLast - burstFirst;
+    fprintf(stderr, "serial_bench: down %u bytes: %lu of %d frames", size, burstFrames, count);
+    printf("    { \"payload\": %u, \"frames\": %d, \"received\": %lu, \"lost\": %lu, \"out_of_order\": %lu", size,
+           count, burstFrames, (unsigned long)(ok ? report.sent : count) - burstFrames, burstOrder);
+    if (burstFrames > 1 && span > 0) {
+        fprintf(stderr, ", %.0f frames/s, %.0f bytes/s", (burstFrames - 1) / span, (burstFrames - 1) * (size + 4) / span);
+        printf(", \"frames_per_s\": %.1f, \"bytes_per_s\": %.0f", (burstFrames - 1) / span,
+               (burstFrames - 1) * (size + 4) / span);
+    }
+    if (ok)
+        printf(", \"board\": { \"sent\": %u, \"tx_dropped\": %u, \"us\": %lu }", report.sent, report.dropped,
+               (unsigned long)report.us);
+    else
+        fprintf(stderr, ", no report");
+    fprintf(stderr, "\n");
+    printf(" }%s\n", comma ? "," : "");
+}
+
+static void upTest(int count, int window)
+{
+    double start, span;
+    uint8_t p[4], f[8];
+    int i;
+
+    askReport(0, 0, 0, RTT_TIMEOUT);    // zeroes the board's counts
+    memset(inFlight, 0, sizeof(inFlight));
+    upBase = (uint32_t)(now() * 1e3) | 0x40000000u;
+    upReplies = 0;
+    start = now();
+    for (i = 0; i < count; i++) {
+        uint32_t token = upBase + i;
+        if (i >= window) {
+            waitSlot = (i - window) % MAX_WINDOW;
+            pump(RTT_TIMEOUT, slotFree);
+            inFlight[waitSlot] = 0;     // lost, the slot goes to the next ping
+        }
+        p[0] = token;
+        p[1] = token >> 8;
+        p[2] = token >> 16;
+        p[3] = token >> 24;
+        inFlight[i % MAX_WINDOW] = 1;
+        portSend(f, hp_putFrame(f, 'y', p, 4));
+        pump(0, NULL);
+    }
+    pump(UP_DRAIN, NULL);
+    span = now() - start - UP_DRAIN;
+    upBase = 0;
+    fprintf(stderr, "serial_bench: up: %lu of %d pings answered, %.0f commands/s\n", upReplies, count, upReplies / span);
+    printf("  \"up\": { \"pings\": %d, \"window\": %d, \"answered\": %lu, \"commands_per_s\": %.1f", count, window,
+           upReplies, upReplies / span);
+    if (askReport(0, 0, 0, RTT_TIMEOUT))
+        printf(", \"board\": { \"commands\": %u, \"bad_frames\": %u, \"rx_lost\": %u, \"tx_dropped\": %u }",
+               report.commands, report.badFrames, report.rxLost, report.dropped);
+    printf(" },\n");
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: serial_bench [-b baud] [-n count] [-w window] [-t device] device\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long baud = 115200;
+    int count = 500, window = 4, c;
+    const char *teleDev = NULL;
+    size_t i;
+
+    while ((c = getopt(argc, argv, "b:n:w:t:")) != -1) {
+        switch (c) {
+        case 'b': baud = atol(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 't': teleDev = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1 || count < 1 || count > 65535 || window < 1 || window > MAX_WINDOW)
+        usage();
+    if ((port = linkOpen(argv[optind], baud)) < 0) {
+        fprintf(stderr, "serial_bench: can't open %s\n", argv[optind]);
+        exit(1);
+    }
+    if (teleDev && (tele = linkOpen(teleDev, baud)) < 0) {
+        fprintf(stderr, "serial_bench: can't open %s\n", teleDev);
+        exit(1);
+    }
+    hp_init(&linkParser, hp_afrowiiReplies, onFrame, NULL);
+    hp_init(&teleParser, hp_afrowiiReplies, onFrame, NULL);
+    if (!askReport(0, 0, 0, 1.0)) {
+        fprintf(stderr, "serial_bench: no 'g' report, is it a SERIAL_BENCH build?\n");
+        exit(1);
+    }
+
+    printf("{\n  \"device\": \"%s\", \"baud\": %ld, \"telemetry_port\": %s,\n", argv[optind], baud, tele >= 0 ? "true" : "false");
+    printf("  \"rtt\": {\n");
+    rttTest("y", 0, count, 1);
+    rttTest("y_framed", 1, count, 1);
+    rttTest("M", 2, count, 0);
+    printf("  },\n  \"down\": [\n");
+    for (i = 0; i < sizeof(burstSizes); i++)
+        downTest(burstSizes[i], count, tele >= 0, i + 1 < sizeof(burstSizes));
+    printf("  ],\n");
+    upTest(count, window);
+    printf("  \"parser\": { \"frames\": %lu, \"bad\": %lu, \"skipped\": %lu }\n}\n",
+           (unsigned long)(linkParser.frames + teleParser.frames), (unsigned long)(linkParser.badFrames + teleParser.badFrames),
+           (unsigned long)(linkParser.skipped + teleParser.skipped));
+    return 0;
+}
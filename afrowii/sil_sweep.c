@@ -0,0 +1,395 @@
+/* Software in the loop gain sweep for the host simulator (see AFROWII_SIM_PLANT in sysdep_host.c)
+ *
+ * Runs one afrowii_sim per gain set, as many at a time as there are cores: every instance is its own
+ * process, so the firmware's globals never leak from one run into the next. Each gets the roll and pitch
+ * P/I/D and gyro low pass of its grid point written with framed 'U' commands through AFROWII_SIM_SERIAL_IN
+ * before the scenario starts, flies the closed loop plant through the built in scenario or a log (its gyro
+ * columns as disturbance torques, its sticks as the rates asked for), and the runs are ranked on
+ *   score = mean rms rate error (deg/s) + weight * rms motor change per loop (us)
+ * The gains not swept, and the other axes, stay at the defaults the simulator boots with ('J' once first).
+ *   gcc -O2 -o sil_sweep sil_sweep.c -lm
+ *   ./sil_sweep [-s ./afrowii_sim] [-l flight.log] [-j jobs] [-r 200] [-w 1] [-n 10]
+ *               [-P from:to:step] [-I from:to:step] [-D from:to:step] [-f from:to:step] > ranking.txt
+ * -r is the stick rate of the plant (deg/s at full stick), -w the effort weight, -n how many places are
+ * printed. -f sweeps sensorFilter.gyroLpf in Hz, 0 is no filter. A run that fails or gets a 'U' refused is
+ * listed last with its exit status.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define PID_ITEMS           7           // P8[]/I8[]/D8[]
+#define FILTER_SIZE         24          // sensorFilter_t
+#define ID_P8               1
+#define ID_I8               2
+#define ID_D8               3
+#define ID_FILTER           20
+#define SWEEP_AXES          2           // roll and pitch
+#define PROBE_SAMPLES       500
+
+typedef struct range_t {
+    int from, to, step;
+} range_t;
+
+typedef struct run_t {
+    int p, i, d, lpf;
+    pid_t pid;
+    int status;                 // -1 until it exited, then the exit code, 256 + signal
+    double err[3], effort, score;
+    int ok;
+} run_t;
+
+static const char *simPath = "./afrowii_sim";
+static const char *logPath = NULL;
+static char tmpDir[64];
+static uint8_t defP8[PID_ITEMS], defI8[PID_ITEMS], defD8[PID_ITEMS], defFilter[FILTER_SIZE];
+
+static void cleanup(int count);
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: sil_sweep [-s sim] [-l log] [-j jobs] [-r deg/s] [-w weight] [-n places]\n"
+                    "                 [-P from:to:step] [-I from:to:step] [-D from:to:step] [-f from:to:step]\n");
+    exit(1);
+}
+
+static void parseRange(const char *s, range_t *r)
+{
+    int n = sscanf(s, "%d:%d:%d", &r->from, &r->to, &r->step);
+
+    if (n == 1) {
+        r->to = r->from;
+        r->step = 1;
+    } else if (n == 2)
+        r->step = 1;
+    else if (n != 3)
+        usage();
+    if (r->step <= 0 || r->to < r->from)
+        usage();
+}
+
+static int rangeCount(const range_t *r)
+{
+    return (r->to - r->from) / r->step + 1;
+}
+
+static void putFrame(FILE *f, uint8_t cmd, const uint8_t *payload, uint8_t len)
+{
+    uint8_t x = len ^ cmd;
+    uint8_t i;
+
+    fputc('$', f);
+    fputc(len, f);
+    fputc(cmd, f);
+    for (i = 0; i < len; i++) {
+        fputc(payload[i], f);
+        x ^= payload[i];
+    }
+    fputc(x, f);
+}
+
+static void putParam(FILE *f, uint8_t id, const uint8_t *data, uint8_t size)
+{
+    uint8_t payload[1 + FILTER_SIZE];
+
+    payload[0] = id;
+    memcpy(payload + 1, data, size);
+    putFrame(f, 'U', payload, size + 1);
+}
+
+static void tmpName(char *name, size_t n, const char *what, int index)
+{
+    snprintf(name, n, "%s/%s%d", tmpDir, what, index);
+}
+
+// the child: output files by index, the rest through the environment
+static pid_t spawn(int index, const char *plant, uint32_t samples)
+{
+    char in[96], out[96], err[96], n[16];
+    pid_t pid = fork();
+    int fd;
+
+    if (pid != 0)
+        return pid;
+    tmpName(in, sizeof(in), "in", index);
+    tmpName(out, sizeof(out), "out", index);
+    tmpName(err, sizeof(err), "err", index);
+    setenv("AFROWII_SIM_SERIAL_IN", in, 1);
+    setenv("AFROWII_SIM_SERIAL", out, 1);
+    setenv("AFROWII_SIM_TRACE", "/dev/null", 1);
+    unsetenv("AFROWII_SIM_GOLDEN");
+    if (plant)
+        setenv("AFROWII_SIM_PLANT", plant, 1);
+    else
+        unsetenv("AFROWII_SIM_PLANT");
+    if (samples) {
+        snprintf(n, sizeof(n), "%u", samples);
+        setenv("AFROWII_SIM_SAMPLES", n, 1);
+        unsetenv("AFROWII_SIM_LOG");
+    } else if (logPath)
+        setenv("AFROWII_SIM_LOG", logPath, 1);
+    if ((fd = open(err, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+        dup2(fd, 2);
+        close(fd);
+    }
+    execl(simPath, simPath, (char *)NULL);
+    fprintf(stderr, "sil_sweep: can't run %s\n", simPath);
+    _exit(127);
+}
+
+static int exitCode(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 256 + WTERMSIG(status);
+}
+
+static long readFile(int index, const char *what, uint8_t *buf, long size)
+{
+    char name[96];
+    FILE *f;
+    long n;
+
+    tmpName(name, sizeof(name), what, index);
+    if (!(f = fopen(name, "rb")))
+        return 0;
+    n = fread(buf, 1, size, f);
+    fclose(f);
+    return n;
+}
+
+// 'J' of the gains and the filter from a short open loop run, the defaults the simulator boots with
+static void probe(void)
+{
+    static const uint8_t ids[] = { ID_P8, ID_I8, ID_D8, ID_FILTER };
+    uint8_t *dest[] = { defP8, defI8, defD8, defFilter };
+    uint8_t sizes[] = { PID_ITEMS, PID_ITEMS, PID_ITEMS, FILTER_SIZE };
+    uint8_t buf[512];
+    char name[96];
+    FILE *f;
+    long n, pos = 0;
+    int status;
+    unsigned i, found = 0;
+
+    tmpName(name, sizeof(name), "in", 0);
+    if (!(f = fopen(name, "wb"))) {
+        fprintf(stderr, "sil_sweep: can't create %s\n", name);
+        exit(1);
+    }
+    for (i = 0; i < sizeof(ids); i++)
+        putFrame(f, 'J', &ids[i], 1);
+    fclose(f);
+    waitpid(spawn(0, NULL, PROBE_SAMPLES), &status, 0);
+    n = readFile(0, "out", buf, sizeof(buf));
+    while (pos + 3 <= n) {
+        if (buf[pos] != 'J') {
+            pos++;
+            continue;
+        }
+        for (i = 0; i < sizeof(ids); i++)
+            if (buf[pos + 1] == ids[i] && buf[pos + 2] == sizes[i] && pos + 3 + sizes[i] <= n) {
+                memcpy(dest[i], buf + pos + 3, sizes[i]);
+                found |= 1 << i;
+            }
+        pos += 3 + buf[pos + 2];
+    }
+    if (found != (1u << sizeof(ids)) - 1) {
+        fprintf(stderr, "sil_sweep: %s did not answer 'J' (exit %d), is it a HOSTSIM build?\n", simPath,
+                exitCode(status));
+        cleanup(0);
+        exit(1);
+    }
+}
+
+static void writeInput(int index, const run_t *r)
+{
+    uint8_t p8[PID_ITEMS], i8[PID_ITEMS], d8[PID_ITEMS], filter[FILTER_SIZE];
+    char name[96];
+    FILE *f;
+    int axis;
+
+    memcpy(p8, defP8, sizeof(p8));
+    memcpy(i8, defI8, sizeof(i8));
+    memcpy(d8, defD8, sizeof(d8));
+    memcpy(filter, defFilter, sizeof(filter));
+    for (axis = 0; axis < SWEEP_AXES; axis++) {
+        if (r->p >= 0)
+            p8[axis] = r->p;
+        if (r->i >= 0)
+            i8[axis] = r->i;
+        if (r->d >= 0)
+            d8[axis] = r->d;
+        if (r->lpf >= 0) {
+            filter[2 * axis] = r->lpf;          // gyroLpf[axis], little endian like the host
+            filter[2 * axis + 1] = r->lpf >> 8;
+        }
+    }
+    tmpName(name, sizeof(name), "in", index);
+    if (!(f = fopen(name, "wb"))) {
+        fprintf(stderr, "sil_sweep: can't create %s\n", name);
+        exit(1);
+    }
+    putParam(f, ID_P8, p8, sizeof(p8));
+    putParam(f, ID_I8, i8, sizeof(i8));
+    putParam(f, ID_D8, d8, sizeof(d8));
+    putParam(f, ID_FILTER, filter, sizeof(filter));
+    fclose(f);
+}
+
+// the plant line on stderr, and an "OK" for every 'U'
+static void collect(int index, run_t *r, double weight)
+{
+    char text[4096], *s;
+    uint8_t buf[64];
+    long n, acks = 0, i;
+    float t;
+
+    r->ok = 0;
+    n = readFile(index, "out", buf, sizeof(buf));
+    for (i = 0; i + 1 < n; i++)
+        if (buf[i] == 'O' && buf[i + 1] == 'K')
+            acks++;
+    n = readFile(index, "err", (uint8_t *)text, sizeof(text) - 1);
+    text[n] = 0;
+    if (r->status != 0 || acks != 4 || !(s = strstr(text, "plant ")))
+        return;
+    if (sscanf(s, "plant %f s flying, rms error %lf %lf %lf deg/s, effort %lf", &t, &r->err[0], &r->err[1],
+               &r->err[2], &r->effort) != 5 || t <= 0)
+        return;
+    r->score = (r->err[0] + r->err[1] + r->err[2]) / 3 + weight * r->effort;
+    r->ok = 1;
+}
+
+static int byScore(const void *a, const void *b)
+{
+    const run_t *x = a, *y = b;
+
+    if (x->ok != y->ok)
+        return y->ok - x->ok;
+    if (!x->ok)
+        return 0;
+    return x->score < y->score ? -1 : x->score > y->score;
+}
+
+static void cleanup(int count)
+{
+    static const char *what[] = { "in", "out", "err" };
+    char name[96];
+    int i, k;
+
+    for (i = 0; i <= count; i++)
+        for (k = 0; k < 3; k++) {
+            tmpName(name, sizeof(name), what[k], i);
+            unlink(name);
+        }
+    rmdir(tmpDir);
+}
+
+int main(int argc, char **argv)
+{
+    range_t rp = { -1, -1, 1 }, ri = { -1, -1, 1 }, rd = { -1, -1, 1 }, rf = { -1, -1, 1 };
+    const char *plant = "200";
+    double weight = 1.0;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int places = 10, count, next = 0, running = 0, done = 0, status, i, c;
+    run_t *runs;
+    pid_t pid;
+
+    while ((c = getopt(argc, argv, "s:l:j:r:w:n:P:I:D:f:")) != -1) {
+        switch (c) {
+        case 's': simPath = optarg; break;
+        case 'l': logPath = optarg; break;
+        case 'j': jobs = atol(optarg); break;
+        case 'r': plant = optarg; break;
+        case 'w': weight = atof(optarg); break;
+        case 'n': places = atoi(optarg); break;
+        case 'P': parseRange(optarg, &rp); break;
+        case 'I': parseRange(optarg, &ri); break;
+        case 'D': parseRange(optarg, &rd); break;
+        case 'f': parseRange(optarg, &rf); break;
+        default: usage();
+        }
+    }
+    if (optind != argc || jobs < 1 || atof(plant) <= 0)
+        usage();
+    if (rp.from > 255 || rp.to > 255 || ri.to > 255 || rd.to > 255 || rf.to > 65535) {
+        fprintf(stderr, "sil_sweep: gains are 0..255, filters 0..65535 Hz\n");
+        exit(1);
+    }
+    count = rangeCount(&rp) * rangeCount(&ri) * rangeCount(&rd) * rangeCount(&rf);
+    if (!(runs = calloc(count, sizeof(run_t))))
+        exit(1);
+    for (i = 0; i < count; i++) {
+        int k = i;
+        runs[i].p = rp.from < 0 ? -1 : rp.from + k % rangeCount(&rp) * rp.step;
+        k /= rangeCount(&rp);
+        runs[i].i = ri.from < 0 ? -1 : ri.from + k % rangeCount(&ri) * ri.step;
+        k /= rangeCount(&ri);
+        runs[i].d = rd.from < 0 ? -1 : rd.from + k % rangeCount(&rd) * rd.step;
+        k /= rangeCount(&rd);
+        runs[i].lpf = rf.from < 0 ? -1 : rf.from + k % rangeCount(&rf) * rf.step;
+        runs[i].status = -1;
+    }
+
+    strcpy(tmpDir, "/tmp/sil_sweepXXXXXX");
+    if (!mkdtemp(tmpDir)) {
+        fprintf(stderr, "sil_sweep: can't create a directory in /tmp\n");
+        exit(1);
+    }
+    probe();
+    for (i = 0; i < count; i++) {
+        if (runs[i].p < 0)
+            runs[i].p = defP8[0];
+        if (runs[i].i < 0)
+            runs[i].i = defI8[0];
+        if (runs[i].d < 0)
+            runs[i].d = defD8[0];
+        if (runs[i].lpf < 0)
+            runs[i].lpf = defFilter[0] | defFilter[1] << 8;
+    }
+    fprintf(stderr, "sil_sweep: %d runs, %ld at a time\n", count, jobs);
+
+    // the worker pool: index i + 1 names a run's files, 0 was the probe
+    while (done < count) {
+        while (running < jobs && next < count) {
+            writeInput(next + 1, &runs[next]);
+            if ((runs[next].pid = spawn(next + 1, plant, 0)) < 0) {
+                fprintf(stderr, "sil_sweep: fork failed\n");
+                exit(1);
+            }
+            next++;
+            running++;
+        }
+        if ((pid = wait(&status)) < 0)
+            break;
+        for (i = 0; i < next; i++)
+            if (runs[i].pid == pid && runs[i].status < 0) {
+                runs[i].status = exitCode(status);
+                collect(i + 1, &runs[i], weight);
+                running--;
+                done++;
+                if (done % 50 == 0)
+                    fprintf(stderr, "sil_sweep: %d/%d\n", done, count);
+            }
+    }
+
+    qsort(runs, count, sizeof(run_t), byScore);
+    printf("# stick rate %s deg/s, score = mean rms error + %g * effort%s%s\n", plant, weight,
+           logPath ? ", log " : "", logPath ? logPath : "");
+    printf("# place    P    I    D  lpf  err roll  pitch    yaw  effort   score\n");
+    for (i = 0; i < count; i++) {
+        const run_t *r = &runs[i];
+        if (r->ok && i >= places)
+            continue;
+        if (r->ok)
+            printf("%7d %4d %4d %4d %4d %9.2f %6.2f %6.2f %7.2f %7.2f\n", i + 1, r->p, r->i, r->d, r->lpf,
+                   r->err[0], r->err[1], r->err[2], r->effort, r->score);
+        else
+            printf("   fail %4d %4d %4d %4d exit %d\n", r->p, r->i, r->d, r->lpf, r->status);
+    }
+    cleanup(count);
+    return 0;
+}
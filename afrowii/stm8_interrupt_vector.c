@@ -28,7 +28,7 @@ void @near (* const _vectab[])() =
     NonHandledInterrupt,   /* irq3 - External interrupt 0 (GPIOA) */
 
     (void @near (*)())0x8200,
-    NonHandledInterrupt,   /* irq4 - External interrupt 1 (GPIOB) */
+    EXTI_PORTB_IRQHandler,   /* irq4 - External interrupt 1 (GPIOB) */
 
     (void @near (*)())0x8200,
     NonHandledInterrupt,   /* irq5 - External interrupt 2 (GPIOC) */
@@ -46,7 +46,7 @@ void @near (* const _vectab[])() =
     NonHandledInterrupt,   /* irq9 - CAN Tx/ER/SC interrupt */
 
     (void @near (*)())0x8200,
-    NonHandledInterrupt,   /* irq10 - SPI End of transfer interrupt */
+    SPI_IRQHandler,   /* irq10 - SPI End of transfer interrupt */
 
     (void @near (*)())0x8200,
     NonHandledInterrupt,   /* irq11 - TIM1 Update/Overflow/Trigger/Break interrupt */
@@ -73,7 +73,7 @@ void @near (* const _vectab[])() =
     NonHandledInterrupt,   /* irq18 - UART1 Rx interrupt */
 
     (void @near (*)())0x8200,
-    NonHandledInterrupt,   /* irq19 - I2C interrupt */
+    I2C_IRQHandler,   /* irq19 - I2C interrupt */
 
     (void @near (*)())0x8200,
     UART2_TX_IRQHandler,   /* irq20 - UART2/UART3 Tx interrupt */
@@ -88,7 +88,7 @@ void @near (* const _vectab[])() =
     TIM4_UPD_OVF_IRQHandler,   /* irq23 - TIM4 Update/Overflow interrupt */
 
     (void @near (*)())0x8200,
-    NonHandledInterrupt,   /* irq24 - FLASH interrupt */
+    EEPROM_EEC_IRQHandler,   /* irq24 - FLASH interrupt */
 
     (void @near (*)())0x8200,
     NonHandledInterrupt,   /* irq25 - Reserved */
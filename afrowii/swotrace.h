@@ -0,0 +1,134 @@
+#pragma once
+
+/* SWO trace for the STM32 backends, see SWO_TRACE in config.h and trace_printf() in sysdep.h.
+ * sysdep_stm32f1_cc.c and sysdep_stm32f4.c include this once SWO_TRACE is set and call swoStart() from
+ * hw_init() after systick_init() (which sets TRCENA) with the pin set up. Records are queued in traceBuf,
+ * a length byte (port in bit 7) and the payload, and trace_flush() moves them to the ITM stimulus port a
+ * word at a time for as long as its FIFO reads ready, so nothing waits on the SWO line. The queue is written
+ * from the main loop only, like the serial frames: an interrupt handler must not trace.
+ *   port 0: text, "<micros> <trace_printf() text>"
+ *   port 1: events, 9 bytes each: id, CYCCNT at the event, value, little endian
+ */
+#include <stdarg.h>
+
+#define ITM_STIM(n)             (*(volatile uint32_t *)(0xE0000000 + 4 * (n)))
+#define ITM_STIM8(n)            (*(volatile uint8_t *)(0xE0000000 + 4 * (n)))
+#define ITM_TER                 (*(volatile uint32_t *)0xE0000E00)
+#define ITM_TPR                 (*(volatile uint32_t *)0xE0000E40)
+#define ITM_TCR                 (*(volatile uint32_t *)0xE0000E80)
+#define ITM_LAR                 (*(volatile uint32_t *)0xE0000FB0)
+#define ITM_TCR_ITMENA          BIT(0)
+#define ITM_TCR_SYNCENA         BIT(2)
+#define ITM_TCR_BUSID(n)        ((uint32_t)(n) << 16)
+#define TPIU_ACPR               (*(volatile uint32_t *)0xE0040010)
+#define TPIU_SPPR               (*(volatile uint32_t *)0xE00400F0)
+#define TPIU_FFCR               (*(volatile uint32_t *)0xE0040304)
+#define TPIU_SPPR_NRZ           2
+#define TPIU_FFCR_TRIGIN        BIT(8)  // formatter off, the SWO carries the bare ITM packets
+
+#define TRACE_BUFLEN            512     // a power of 2
+#define TRACE_TEXT_MAX          96      // longer lines are cut
+#define TRACE_PORT_TEXT         0
+#define TRACE_PORT_EVENT        1
+
+static uint8_t traceBuf[TRACE_BUFLEN];
+static uint16_t traceHead = 0;          // free running, trace_printf()/trace_event()
+static uint16_t traceTail = 0;          // free running, trace_flush()
+static uint8_t tracePort;               // of the record trace_flush() is in
+static uint8_t traceLeft = 0;           // its bytes still to go to the ITM
+static uint16_t traceDrops = 0;
+
+// clocks per SWO bit: the TPIU divides the core clock
+static void swoStart(uint32_t coreClock)
+{
+    TPIU_SPPR = TPIU_SPPR_NRZ;
+    TPIU_ACPR = coreClock / SWO_TRACE - 1;
+    TPIU_FFCR = TPIU_FFCR_TRIGIN;
+    ITM_LAR = 0xC5ACCE55;
+    ITM_TCR = ITM_TCR_BUSID(1) | ITM_TCR_SYNCENA | ITM_TCR_ITMENA;
+    ITM_TPR = 0;
+    ITM_TER = BIT(TRACE_PORT_TEXT) | BIT(TRACE_PORT_EVENT);
+}
+
+static void tracePut(uint8_t port, const uint8_t *data, uint8_t len)
+{
+    uint16_t head = traceHead;
+    uint8_t i;
+
+    if (TRACE_BUFLEN - (uint16_t)(head - traceTail) < len + 1) {
+        traceDrops++;
+        return;
+    }
+    traceBuf[head++ & (TRACE_BUFLEN - 1)] = len | port << 7;
+    for (i = 0; i < len; i++)
+        traceBuf[head++ & (TRACE_BUFLEN - 1)] = data[i];
+    traceHead = head;
+}
+
+void trace_printf(const char *fmt, ...)
+{
+    char line[TRACE_TEXT_MAX + 1];
+    va_list ap;
+    int n, len;
+
+    n = snprintf(line, sizeof(line), "%lu ", (unsigned long)micros());
+    va_start(ap, fmt);
+    len = vsnprintf(line + n, sizeof(line) - n, fmt, ap);
+    va_end(ap);
+    len = len < 0 ? n : min(n + len, TRACE_TEXT_MAX);
+    tracePut(TRACE_PORT_TEXT, (const uint8_t *)line, len);
+}
+
+void trace_event(uint8_t id, uint32_t value)
+{
+    uint32_t t = DWT_CYCCNT;
+    uint8_t e[9];
+
+    e[0] = id;
+    e[1] = t;
+    e[2] = t >> 8;
+    e[3] = t >> 16;
+    e[4] = t >> 24;
+    e[5] = value;
+    e[6] = value >> 8;
+    e[7] = value >> 16;
+    e[8] = value >> 24;
+    tracePut(TRACE_PORT_EVENT, e, sizeof(e));
+}
+
+void trace_flush(void)
+{
+    uint16_t tail = traceTail;
+    uint32_t w;
+    uint8_t c, i;
+
+    // a debugger that took the ITM over (or never let it run) would leave the FIFO not ready for good
+    if (!(ITM_TCR & ITM_TCR_ITMENA))
+        return;
+    while (traceLeft || tail != traceHead) {
+        if (!traceLeft) {
+            c = traceBuf[tail++ & (TRACE_BUFLEN - 1)];
+            tracePort = c >> 7;
+            traceLeft = c & 0x7F;
+            continue;
+        }
+        if (!(ITM_STIM(tracePort) & 1))
+            break;                      // FIFO full, the rest goes with the next flush
+        if (traceLeft >= 4) {
+            w = 0;
+            for (i = 0; i < 4; i++)
+                w |= (uint32_t)traceBuf[tail++ & (TRACE_BUFLEN - 1)] << 8 * i;
+            ITM_STIM(tracePort) = w;
+            traceLeft -= 4;
+        } else {
+            ITM_STIM8(tracePort) = traceBuf[tail++ & (TRACE_BUFLEN - 1)];
+            traceLeft--;
+        }
+    }
+    traceTail = tail;
+}
+
+uint16_t trace_dropped(void)
+{
+    return traceDrops;
+}
@@ -28,41 +28,255 @@
 void hw_init(void);
 
 /* SPI */
+/* one per chip on the bus. The bus drives chip select and sets clock and mode for every transaction:
+   register access at slowHz, bursts at fastHz, both rounded down to what the prescaler can do */
+typedef struct {
+    void (*select)(uint8_t on); //chip select, on = 1 asserts
+    uint8_t mode;               //CPOL << 1 | CPHA
+    uint32_t slowHz;
+    uint32_t fastHz;
+    uint8_t prescaler[2];       //filled in by spi_device()
+} spiDevice_t;
+
+/* burst read: clocks out cmd, then len dummy bytes into buf. Queued jobs run back to back from the SPI
+   interrupt, done() runs from there too, after chip select is released */
+typedef struct spiJob_t {
+    spiDevice_t *dev;
+    uint8_t cmd;
+    uint8_t *buf;
+    uint8_t len;
+    void (*done)(struct spiJob_t *job);     //can be NULL
+    volatile uint8_t busy;      //set by spi_submit() until done
+} spiJob_t;
+
 void spi_init(void);
-uint8_t spi_writeByte(uint8_t Data);
-uint8_t spi_readByte(void);
+void spi_device(spiDevice_t *dev);                      //once per chip, before anything else on it
+uint8_t spi_command(spiDevice_t *dev, uint8_t cmd, uint8_t data);  //two byte transaction, returns the second byte in
+uint8_t spi_submit(spiJob_t *job);                      //0 if the queue is full or the job is still busy
+void spi_read(spiDevice_t *dev, uint8_t cmd, uint8_t *buf, uint8_t len);  //spi_submit() and wait
+uint8_t spi_isBusy(void);
+/* sensor data ready line (STM32F4: MPU6000 or ITG3200 INT on PC4), ready() runs from the pin interrupt on every rising edge */
+typedef void (*drdyCallback_t)(void);
+void drdy_init(drdyCallback_t ready);
 /* I2C */
+typedef enum {                  //returns I2C error/success codes
+    I2C_SUCCESS = 0,            //theres only one sort of success
+    I2C_START_TIMEOUT,
+    I2C_RSTART_TIMEOUT,
+    I2C_SACK_FAILURE,
+    I2C_SACK_TIMEOUT,
+    I2C_TX_TIMEOUT,
+    I2C_RX_TIMEOUT,
+    I2C_BUS_ERROR,
+    I2C_QUEUE_FULL,
+    I2C_BACKOFF,                //refused without touching the bus, the device keeps failing and waits for its retry
+    I2C_PENDING                 //job is queued or on the bus
+} I2C_Returntype;
+
+/* queued transaction: writes subaddr (0xFF = none) then either writes buf or reads len bytes into it */
+typedef struct i2cJob_t {
+    uint8_t address;            //8bit address, read bit is added as needed
+    uint8_t subaddr;
+    uint8_t *buf;
+    uint8_t len;
+    uint8_t read;
+    volatile uint8_t status;    //I2C_PENDING until done, then one of the codes above
+    void (*done)(struct i2cJob_t *job);     //runs from the I2C interrupt, can be NULL
+    uint8_t fast;               //filled in by i2c_submit(): bus speed of the device, see i2c_deviceSpeed()
+} i2cJob_t;
+
 void i2c_init(void);
+void i2c_deviceSpeed(uint8_t address, uint32_t hz);    //for the jobs to that address from now on, I2C_SPEED
+                                                        //otherwise. Standard (100kHz) or fast mode (400kHz)
 uint8_t i2c_read(uint8_t *buf, uint8_t size, uint8_t address, uint8_t subaddr);
 uint8_t i2c_write(uint8_t *buf, uint8_t size);
+uint8_t i2c_submit(i2cJob_t *job);
+void i2c_poll(void);            //times out a stuck job, call from the main loop
+uint8_t i2c_isIdle(void);
+/* per device health, one entry per address that had jobs. backoff 0 is healthy, else the device is retried
+   every 2^backoff ms and its jobs fail with I2C_BACKOFF in between */
+typedef struct {
+    uint8_t address;
+    uint16_t errors;            //failed jobs since startup
+    uint16_t refused;           //jobs refused while backed off
+    uint8_t backoff;
+} i2cDeviceStats_t;
+uint8_t i2c_deviceStats(uint8_t index, i2cDeviceStats_t *stats);   //0 past the last device
+uint16_t i2c_busRecoveries(void);       //times a slave held SDA low and was clocked free
 
-/* UART */
+/* UART: Serial_reset() starts a reply frame, serialize8/16() append to it (overflowing frames are dropped)
+   and Serial_commitBuffer() queues it for sending. Serial_reserve() appends len bytes to be filled in place
+   before the next serialize8/16() or commit, 0 when they don't fit (the frame is dropped then).
+   Serial_isTxBusy() is set while no frame buffer is free.
+   Serial_begin() again changes the rate, once Serial_txIdle(): nothing queued and the last stop bit out */
 void serialize8(uint8_t val);
 void serialize16(int16_t val);
+void *Serial_reserve(uint8_t len);
 void Serial_begin(uint32_t speed);
 void Serial_reset(void);
 uint16_t Serial_available(void);
 uint8_t Serial_read(void);
+uint8_t Serial_peek(const uint8_t **data);  /* received bytes readable in place at *data, 0 if none */
+void Serial_consume(uint8_t n);             /* release n bytes returned by Serial_peek() */
+uint16_t Serial_rxOverflow(void);    /* bytes lost to a full RX buffer since startup */
+uint16_t Serial_txDropped(void);     /* frames dropped since startup: too long, no free buffer or no host */
 void Serial_commitBuffer(void);
 uint8_t Serial_isTxBusy(void);
+uint8_t Serial_txIdle(void);
+/* Telemetry port (board.h defines TELEMETRY_PORT where there is one, the STM32 USB build: a vendor bulk IN
+   endpoint next to the CDC port): a second output for the blackbox and stream frames, so they don't queue
+   behind command replies. Telemetry_write() takes all of buf or nothing (returns 0), never waits */
+uint16_t Telemetry_free(void);
+uint8_t Telemetry_write(const uint8_t *buf, uint8_t len);
+/* serial RC receiver: every byte received at speed goes to rx() from the RX interrupt, bytes with a parity or
+   framing error are dropped. On the STM8 this takes over the only UART RX (TX keeps working at the same speed
+   and format), on the STM32F1 it is USART1, on the STM32F4 USART3, on the ATmega USART1. None of these UARTs
+   can invert RX */
+#define RCSERIAL_8N1    0
+#define RCSERIAL_8E2    1       //S.BUS
+typedef void (*rcSerialCallback_t)(uint8_t c);
+void rcSerial_init(uint32_t speed, uint8_t format, rcSerialCallback_t rx);
+/* parallel PWM receiver, STM32 only: one servo lead per channel, each on a timer capture input. pulse() runs from
+   the capture interrupt with the input number and the high time in us. Returns the number of inputs.
+   The ATmega has the one capture input (ICP1) and takes a PPM sum there instead: every channel is an input, in
+   the order of the frame, with the time from its edge to the next. The sync gap ends the frame as RCPWM_SYNC */
+#define RCPWM_SYNC      0xFF
+typedef void (*rcPwmCallback_t)(uint8_t input, uint16_t width);
+uint8_t rcPwm_init(rcPwmCallback_t pulse);
+/* GPS receiver, RX only: bytes wait in a ring until gpsSerial_read(), only call it while gpsSerial_available().
+   On the STM32 it is USART1 (PA10) like the serial receiver, on the ATmega USART1 too, the STM8 has no second UART.
+   Built with GPS or SENSOR_LINK (the sensor node's packets come in here), see GPS_PORT in def.h */
+void gpsSerial_init(uint32_t speed);
+uint8_t gpsSerial_available(void);
+uint8_t gpsSerial_read(void);
+uint16_t gpsSerial_rxOverflow(void);    /* bytes lost to a full ring since startup */
 
 /* System */
 void delay(uint16_t ms);
 uint32_t micros(void);
+uint32_t microsISR(void);  /* same as micros(), but doesn't touch the interrupt mask. Only call from interrupt handlers */
+uint32_t cycles(void);     /* free running count of CYCLES_PER_US per microsecond, wraps. Cheaper and finer than micros() */
 uint32_t millis(void);
+/* interrupt entry latency: the worst case in us from the event to its handler since the last call for that source.
+   Capture is from the timer edge to the receiver capture handler, tick from the SysTick wrap to its handler and
+   deferred from the USB top half to its PendSV bottom half, loop from the pend to the LOOP_ISR inner loop.
+   0 where the target doesn't measure it (STM32F1 does) */
+enum { IRQ_LAT_CAPTURE = 0, IRQ_LAT_TICK, IRQ_LAT_DEFERRED, IRQ_LAT_LOOP, IRQ_LAT_COUNT };
+uint16_t irq_latencyMax(uint8_t source);
+#if defined(LOOP_ISR)
+/* inner loop interrupt (STM32: EXTI1 pended by software at IRQ_PRIO_LOOP, the simulator: from micros()). tick() runs
+   every periodMs SysTick ticks, with 0 on every loopIsr_pend() instead. It may wait on the sensor bus, the bus
+   interrupts preempt it. loopIsr_idle() sleeps in main() until the next interrupt, whichever */
+typedef void (*loopTickCallback_t)(void);
+void loopIsr_init(uint8_t periodMs, loopTickCallback_t tick);
+void loopIsr_pend(void);
+void loopIsr_idle(void);
+#endif
 uint16_t analogRead(uint8_t channel);
+uint16_t analogReadOversampled(uint8_t channel);    /* STM32F1 and ATmega only: the mean in 14 bits, 0..16380 */
 void analogWrite(uint8_t pin, uint16_t value);
 void pinMode(uint8_t pin, uint8_t mode);
 void systemReboot(void);
+/* reboot into the serial bootloader: the ROM loader on the STM32s (USART1 on PA9/PA10, the F4 also takes USB DFU),
+   the boot section on the ATmega. The STM8 starts its loader on every reset, there it's systemReboot() */
+void systemBootloader(void);
+/* independent watchdog: resets unless watchdog_kick() comes within ms of the last one, runs on its own clock */
+void watchdog_init(uint16_t ms);
+void watchdog_kick(void);
+uint8_t watchdog_didReset(void);    /* 1 if the watchdog caused the last reset */
+/* RAM use. stack_paint() fills the free stack with a pattern, call it first thing in main(). stack_free() is
+   the least the stack has had left since, ram_static() the bytes .data and .bss take. Both 0 if unknown */
+void stack_paint(void);
+uint16_t stack_free(void);
+uint16_t ram_static(void);
+uint8_t ram_isStatic(uint32_t addr, uint8_t len);  /* 1 if all of addr..addr + len - 1 is in .data or .bss */
+/* CRC-32 of flash, to check the firmware: words of 4 bytes taken little endian, each most significant bit first
+   through polynomial 0x04C11DB7 from 0xFFFFFFFF, no reflection or final xor. That is the STM32 CRC unit, which a
+   DMA channel feeds there, the others do the same in software (crc32.h) a slice of words per crc_busy() call.
+   Either way call crc_busy() until it is 0, crc_result() holds the CRC then. crc_start() returns 0 while a check
+   is still on or when the range isn't all flash (the ATmega's program memory, from 0) */
+uint8_t crc_start(uint32_t address, uint32_t words);
+uint8_t crc_busy(void);
+uint32_t crc_result(void);
+#if defined(SWO_TRACE)
+/* SWO trace (STM32, see swotrace.h), main loop only. Both queue a record and return, trace_flush() feeds the
+   ITM with what its FIFO takes. trace_printf() is text on stimulus port 0 behind micros(), trace_event() a
+   binary record on port 1 stamped with cycles(). trace_dropped() counts records that found the queue full */
+void trace_printf(const char *fmt, ...);
+void trace_event(uint8_t id, uint32_t value);
+void trace_flush(void);
+uint16_t trace_dropped(void);
+#endif
 
 /* PWM */
 void pwmInit(uint8_t useServo);
 void pwmWrite(uint8_t channel, uint16_t value);
+void pwmServoRate(uint16_t hz);     /* servo outputs refresh, 50..400Hz, right away or from pwmInit(useServo) on */
+void pwmWriteAll(const int16_t *value, uint8_t count);  /* motors 0..count-1 at once, all switch in the same
+                                                           PWM period. MOTOR_ONESHOT, MOTOR_DSHOT: sends their
+                                                           pulses or frames */
+#if defined(CAMTRIG)
+/* camera shutter line (CopterControl output 6, see CAMTRIG in config.h), set up after pwmInit(). shutter_fire()
+   starts a pulse of ms that the timer ends by itself and gives the micros() of its leading edge, 0 and nothing
+   done while the last pulse is still on */
+void shutter_init(void);
+uint8_t shutter_fire(uint16_t ms, uint32_t *edge);
+#endif
+
+#if defined(BLACKBOX_SD)
+/* SD card, 512 byte sectors by number (STM32F4: 4 bit SDIO, see sysdep_stm32f4.c). sdcard_init() brings the card
+   up and returns its sector count, 0 if there is none that answers. It waits, setup() only. sdcard_read() and
+   sdcard_write() start a transfer of count sectors from or into buf, word aligned and reachable by DMA, and return
+   0 with nothing done while sdcard_busy(): the last transfer still on, or a write the card is still programming.
+   sdcard_errors() counts transfers that failed since startup */
+uint32_t sdcard_init(void);
+uint8_t sdcard_read(uint32_t sector, uint8_t *buf, uint16_t count);
+uint8_t sdcard_write(uint32_t sector, const uint8_t *buf, uint16_t count);
+uint8_t sdcard_busy(void);
+uint16_t sdcard_errors(void);
+#endif
+
+#if defined(CAN_BUS)
+/* CAN, standard 11 bit ids (STM32F4: CAN1 on PD0/PD1, see sysdep_stm32f4.c). can_send() queues the frame for the
+   next free TX mailbox and returns 0 if the queue is full, the mailboxes are refilled from their interrupt.
+   Every frame on the bus is received into a ring from the FIFO interrupt, can_receive() takes the oldest of
+   them, 0 if there is none. Bus off recovers by itself */
+typedef struct {
+    uint16_t id;
+    uint8_t len;
+    uint8_t data[8];
+} canFrame_t;
+typedef struct {
+    uint16_t txDropped;         //frames can_send() found no room for
+    uint16_t rxOverflow;        //frames lost to a full ring or a full hardware FIFO
+    uint8_t txErrors;           //transmit error counter, 128 up is error passive
+    uint8_t rxErrors;           //receive error counter
+    uint8_t busOff;
+} canStats_t;
+void can_init(uint32_t bitrate);    /* 125000, 250000, 500000 or 1000000 */
+uint8_t can_send(const canFrame_t *frame);
+uint8_t can_receive(canFrame_t *frame);
+void can_stats(canStats_t *stats);
+#endif
 
+/* EEPROM: eeprom_size() bytes addressed from 0, writes between eeprom_open() and eeprom_close(). On the
+   STM32 it is flash: a byte can only be written once after eeprom_erase(), at an even offset. Erased reads 0xFF.
+   On the STM8 and the ATmega the last writes are still going on in the background after eeprom_close(), reads
+   see them */
 void eeprom_open(void);
 void eeprom_read_block(void *dst, const void *src, size_t n);
 void eeprom_write_block(const void *src, void *dst, size_t n);
 void eeprom_close(void);
+uint16_t eeprom_size(void);
+void eeprom_erase(void);
+#if defined(PARAM_IN_PLACE)
+/* where the n bytes at src can be read in place, up to date with what was written, until the next
+   eeprom_write_block() or eeprom_erase(). Not on the ATmega */
+const void *eeprom_map(const void *src, size_t n);
+#endif
 
-#define sei()
-#define cli()
+#ifdef HOSTSIM
+/* host simulator only: stage timing with the host clock */
+void sim_profileBegin(uint8_t stage);
+void sim_profileEnd(uint8_t stage, const char *name);
+#endif
@@ -0,0 +1,1193 @@
+#include "config.h"
+#include "def.h"
+#include "sysdep.h"
+#include "ringbuf.h"
+#include <avr/wdt.h>
+#include <avr/pgmspace.h>
+
+/* ATmega644P backend, avr-gcc and avr-libc. Everything that moves data runs from its interrupt: the ADC round
+   robin, the TWI job queue, USART0 for the GUI, USART1 for a serial receiver or the GPS, ICP1 for the PPM sum
+   and the EEPROM writes. The AVR doesn't nest interrupts, a handler runs with the others held off until it
+   returns, so the handlers here are kept to a few us and the loop side masks only for a handful of cycles. */
+
+#if !defined(CSHRED)
+#error "sysdep_avr.c has the CSHRED pinout only: BL-Ctrl motors on I2C, the sensors on ADC0..7"
+#endif
+
+#define T1_TOP      (F_CPU / 8 / 1000 - 1)    // Timer1 clears once a millisecond, see TIMING
+#if !defined(BOOT_START)
+#define BOOT_START  0xF800                    // byte address of the boot section, 1K words (BOOTSZ = 10)
+#endif
+#define BOOT_MAGIC  0xB007
+
+static uint8_t resetCause;
+static void eeWait(void);
+// systemBootloader() leaves BOOT_MAGIC here, in RAM the C startup doesn't clear
+static uint16_t bootRequest __attribute__((section(".noinit")));
+
+/* the next start after it goes to the boot section from .init3, before .data and .bss are set up and with the
+   peripherals at their reset state. With BOOTRST programmed the loader has already had its go, this is a second one.
+   Naked code in .init3 has no return, it falls through into the rest of the startup */
+static void __attribute__((naked, used, section(".init3"))) bootCheck(void)
+{
+    if ((MCUSR & _BV(WDRF)) && bootRequest == BOOT_MAGIC) {     // not whatever a power up left in RAM
+        bootRequest = 0;
+        MCUSR = 0;
+        wdt_disable();
+        ((void (*)(void))(BOOT_START / 2))();
+    }
+}
+
+/* HW init */
+void hw_init(void)
+{
+    // a watchdog reset leaves the watchdog running at its shortest timeout, stop it before anything takes long
+    resetCause = MCUSR;
+    MCUSR = 0;
+    wdt_disable();
+
+    // idle sleep for wfi(), the timers, the ADC and the TWI keep running
+    SMCR = _BV(SE);
+
+    // Timer1 at F_CPU / 8, cleared on OCR1A once a millisecond. ICP1 (PD6) is the receiver input
+    TCCR1A = 0;
+    TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(ICNC1) | _BV(ICES1);
+    OCR1A = T1_TOP;
+    TIMSK1 = _BV(OCIE1A);
+
+    // ADC off the external reference, the round robin starts with the first conversion complete
+    DIDR0 = 0xFF;
+    ADMUX = 0;
+    ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS0);
+
+    // Enable interrupts to start stuff up
+    enableInterrupts();
+}
+
+void systemReboot(void)
+{
+    // the watchdog resets into whatever the fuses start, once the background EEPROM writes are done
+    eeWait();
+    wdt_enable(WDTO_15MS);
+    for (;;);
+}
+
+void systemBootloader(void)
+{
+    bootRequest = BOOT_MAGIC;
+    systemReboot();
+}
+
+/* the watchdog runs off its own 128kHz oscillator, 15ms to 2s in powers of 2. The next step up from ms */
+void watchdog_init(uint16_t ms)
+{
+    uint8_t wdto = WDTO_15MS;
+
+    while (wdto < WDTO_2S && (15U << wdto) < ms)
+        wdto++;
+    wdt_enable(wdto);
+}
+
+void watchdog_kick(void)
+{
+    wdt_reset();
+}
+
+uint8_t watchdog_didReset(void)
+{
+    return (resetCause & _BV(WDRF)) != 0;
+}
+
+/* RAM. avr-libc's linker script puts .data and .bss from __data_start up to __heap_start and the stack at
+   RAMEND, growing down towards them. Nothing here calls malloc(), the heap stays empty */
+#define STACK_PAINT 0xA5
+extern uint8_t __data_start[];
+extern uint8_t __heap_start[];
+
+void stack_paint(void)
+{
+    uint8_t here;
+    uint8_t *p = __heap_start;
+
+    // up to a little below the caller's frame
+    while (p < &here - 8)
+        *p++ = STACK_PAINT;
+}
+
+uint16_t stack_free(void)
+{
+    uint8_t here;
+    const uint8_t *p = __heap_start;
+
+    while (p < &here && *p == STACK_PAINT)
+        p++;
+    return p - __heap_start;
+}
+
+uint16_t ram_static(void)
+{
+    return __heap_start - __data_start;
+}
+
+uint8_t ram_isStatic(uint32_t addr, uint8_t len)
+{
+    return addr >= (uint16_t)__data_start && addr + len <= (uint16_t)__heap_start;
+}
+
+/* CRC-32 of the program memory in software, LPM a word at a time */
+static uint32_t crcFlashWord(uint32_t address)
+{
+    return pgm_read_dword((uint16_t)address);
+}
+
+static uint8_t crcInFlash(uint32_t address, uint32_t words)
+{
+    return address <= FLASHEND + 1UL && words <= (FLASHEND + 1UL - address) / 4;
+}
+
+#include "crc32.h"
+
+/* UART */
+/* USART0 carries the GUI. Two frame buffers: Serial_reset() starts a frame in uartBuffer[uartBack],
+   serialize8/16() append to it and Serial_commitBuffer() hands it to the transmitter and swaps to the other
+   buffer. A frame committed while the previous one is still going out is chained by the UDRE interrupt. Bytes
+   past the end of the buffer are dropped and so is the truncated frame */
+#define TX_BUFFER_SIZE 128
+static uint8_t uartBuffer[2][TX_BUFFER_SIZE];
+static uint8_t uartPointer;
+static uint8_t uartBack = 0;
+static uint8_t uartOverflow = 0;
+static uint16_t txDropped = 0;
+
+void serialize16(int16_t a)
+{
+    serialize8(a);
+    serialize8(a >> 8 & 0xff);
+}
+
+void serialize8(uint8_t a)
+{
+    if (uartPointer < TX_BUFFER_SIZE)
+        uartBuffer[uartBack][uartPointer++] = a;
+    else
+        uartOverflow = 1;
+}
+
+void *Serial_reserve(uint8_t len)
+{
+    uint8_t *p = &uartBuffer[uartBack][uartPointer];
+
+    if (len > TX_BUFFER_SIZE - uartPointer) {
+        uartOverflow = 1;
+        return 0;
+    }
+    uartPointer += len;
+    return p;
+}
+
+// ***********************************
+// Interrupt driven UART transmitter
+// ***********************************
+static uint8_t *tx_buf;
+static uint8_t tx_ptr;
+static uint8_t tx_len;
+static volatile uint8_t tx_busy = 0;
+static volatile uint8_t tx_pending = 0;
+static uint8_t tx_pendingLen;
+
+ISR(USART0_UDRE_vect)
+{
+    UDR0 = tx_buf[tx_ptr++];
+    UCSR0A = _BV(U2X0) | _BV(TXC0);     // write 1 to clear, TXC then stands for this byte's stop bit
+    if (tx_ptr == tx_len) {
+        if (tx_pending) {
+            // next frame is the committed one, i.e. not the buffer being built
+            tx_buf = uartBuffer[uartBack ^ 1];
+            tx_len = tx_pendingLen;
+            tx_ptr = 0;
+            tx_pending = 0;
+        } else {
+            UCSR0B &= ~_BV(UDRIE0);
+            tx_busy = 0;
+        }
+    }
+}
+
+void Serial_commitBuffer(void)
+{
+    if (uartPointer == 0 || uartOverflow) {
+        if (uartOverflow)
+            txDropped++;
+        uartPointer = 0;
+        uartOverflow = 0;
+        return;
+    }
+    disableInterrupts();
+    if (!tx_busy) {
+        tx_buf = uartBuffer[uartBack];
+        tx_len = uartPointer;
+        tx_ptr = 0;
+        tx_busy = 1;
+        UCSR0B |= _BV(UDRIE0);          // UDRE is already set, the first byte goes out from the interrupt
+    } else {
+        tx_pending = 1;
+        tx_pendingLen = uartPointer;
+    }
+    uartBack ^= 1;
+    enableInterrupts();
+    uartPointer = 0;
+}
+
+uint8_t Serial_isTxBusy(void)
+{
+    // only when there's no buffer left to build a reply in
+    return tx_pending;
+}
+
+uint8_t Serial_txIdle(void)
+{
+    return !tx_busy && (UCSR0A & _BV(TXC0));
+}
+
+void Serial_reset(void)
+{
+    uint16_t start = (uint16_t)micros();
+
+    // both buffers taken: wait for the one in flight to finish, at most one frame time
+    while (tx_pending && (uint16_t)((uint16_t)micros() - start) < 12000);
+    if (tx_pending) {
+        // still stuck, drop the queued frame rather than overwrite the one on the wire
+        disableInterrupts();
+        if (tx_pending) {
+            tx_pending = 0;
+            txDropped++;
+            uartBack ^= 1;
+        }
+        enableInterrupts();
+    }
+    uartPointer = 0;
+    uartOverflow = 0;
+}
+
+static uint8_t rxBuffer[64];
+static ring_t rxRing = RING_INIT(rxBuffer);
+
+ISR(USART0_RX_vect)
+{
+    ring_put(&rxRing, UDR0);
+}
+
+// double speed mode: UBRR = F_CPU / 8 / speed - 1, rounded to the nearest
+static uint16_t uartDivider(uint32_t speed)
+{
+    return (F_CPU / 4 / speed - 1) / 2;
+}
+
+void Serial_begin(uint32_t speed)
+{
+    UCSR0B = 0;
+    UBRR0 = uartDivider(speed);
+    UCSR0A = _BV(U2X0) | _BV(TXC0);
+    UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+    UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+}
+
+uint16_t Serial_available(void)
+{
+    return ring_count(&rxRing);
+}
+
+uint8_t Serial_read(void)
+{
+    // if the head isn't ahead of the tail, we don't have any characters
+    if (ring_count(&rxRing) == 0)
+        return -1;
+    return ring_get(&rxRing);
+}
+
+uint8_t Serial_peek(const uint8_t **data)
+{
+    return ring_peek(&rxRing, data);
+}
+
+void Serial_consume(uint8_t n)
+{
+    ring_skip(&rxRing, n);
+}
+
+uint16_t Serial_rxOverflow(void)
+{
+    return rxRing.overflow;
+}
+
+uint16_t Serial_txDropped(void)
+{
+    return txDropped;
+}
+
+/* USART1 (PD2) is RX only, for a serial receiver or the GPS. Bytes with a framing or parity error are dropped */
+static rcSerialCallback_t rcSerialRx;
+
+void rcSerial_init(uint32_t speed, uint8_t format, rcSerialCallback_t rx)
+{
+    rcSerialRx = rx;
+
+    UCSR1B = 0;
+    PORTD |= _BV(2);                    // pull up, the line idles high without a receiver
+    UBRR1 = uartDivider(speed);
+    UCSR1A = _BV(U2X1);
+    if (format == RCSERIAL_8E2)
+        UCSR1C = _BV(UPM11) | _BV(USBS1) | _BV(UCSZ11) | _BV(UCSZ10);
+    else
+        UCSR1C = _BV(UCSZ11) | _BV(UCSZ10);
+    UCSR1B = _BV(RXEN1) | _BV(RXCIE1);
+}
+
+ISR(USART1_RX_vect)
+{
+    // the error flags go with the byte in UDR1, read them first
+    uint8_t sr = UCSR1A;
+    uint8_t c = UDR1;
+
+    PROBE_HI(PROBE_ISR_COMM);
+    if (rcSerialRx && !(sr & (_BV(FE1) | _BV(UPE1))))
+        rcSerialRx(c);
+    PROBE_LO(PROBE_ISR_COMM);
+}
+
+#if defined(GPS_PORT)
+/* the GPS takes the same RX pin, gpsTask() drains the ring */
+static uint8_t gpsBuffer[128];
+static ring_t gpsRing = RING_INIT(gpsBuffer);
+
+static void gpsReceive(uint8_t c)
+{
+    ring_put(&gpsRing, c);
+}
+
+void gpsSerial_init(uint32_t speed)
+{
+    rcSerial_init(speed, RCSERIAL_8N1, gpsReceive);
+}
+
+uint8_t gpsSerial_available(void)
+{
+    return ring_count(&gpsRing);
+}
+
+uint8_t gpsSerial_read(void)
+{
+    return ring_get(&gpsRing);
+}
+
+uint16_t gpsSerial_rxOverflow(void)
+{
+    return gpsRing.overflow;
+}
+#endif
+
+/* TIMING */
+/* Timer1 counts F_CPU / 8 (0.4us at 20MHz) and is cleared on OCR1A, T1_TOP, once a millisecond. The compare
+   interrupt adds 1000 to the microsecond base, micros() is the base plus the counter scaled by T1_US_Q16, so it
+   wraps cleanly at 2^32us whatever the clock. A wrap that happened while interrupts were masked is still pending
+   in OCF1A, the reader counts it itself. Otherwise the base is behind by 1000 while the counter has already
+   started over, and micros() would go back by 1ms.
+   TCNT1 is read through the TEMP byte Timer1 shares between all its 16 bit registers, and the capture handler
+   reads ICR1 through it too, so the loop side reads the counter with interrupts masked, for a few cycles. There
+   is no point in a seqcount.h retry on top of that */
+#define T1_US_Q16   ((uint32_t)(8000000ULL * 65536 / F_CPU))
+
+static volatile uint32_t t1Base = 0;
+static volatile uint32_t t1Millis = 0;
+
+ISR(TIMER1_COMPA_vect)
+{
+    t1Base += 1000;
+    t1Millis++;
+}
+
+// a Timer1 count of this millisecond in us
+static uint16_t t1Micros(uint16_t t)
+{
+    return ((uint32_t)t * T1_US_Q16) >> 16;
+}
+
+// with interrupts masked
+static uint32_t microsRead(void)
+{
+    uint32_t m = t1Base;
+    uint16_t t = TCNT1;
+
+    if (TIFR1 & _BV(OCF1A)) {
+        // matched and not counted yet. The counter clears one tick after the match, so a fresh read that is
+        // still at T1_TOP goes with the old base, one past the clear with the next
+        t = TCNT1;
+        if (t < T1_TOP / 2)
+            m += 1000;
+    }
+    return m + t1Micros(t);
+}
+
+uint32_t micros(void)
+{
+    uint32_t res;
+    uint8_t sreg = SREG;
+
+    cli();
+    res = microsRead();
+    SREG = sreg;
+    return res;
+}
+
+uint32_t cycles(void)
+{
+    return micros();
+}
+
+uint32_t microsISR(void)
+{
+    // interrupts are off in every handler, nothing can move the base or TEMP under us
+    return microsRead();
+}
+
+uint16_t irq_latencyMax(uint8_t source)
+{
+    return 0;               // no nesting, nothing to bound
+}
+
+uint32_t millis(void)
+{
+    uint32_t res;
+    uint8_t sreg = SREG;
+
+    cli();
+    res = t1Millis;
+    SREG = sreg;
+    return res;
+}
+
+void delay(uint16_t ms)
+{
+    uint16_t start = (uint16_t)micros();
+
+    while (ms > 0) {
+        if (((uint16_t)micros() - start) >= 1000) {
+            ms--;
+            start += 1000;
+        }
+    }
+}
+
+/* PPM sum on ICP1 (PD6), rising edges. The capture is stamped on the micros() timeline the way microsRead()
+   does it: the capture vector comes before the compare one, so a pending match with a small ICR1 is a wrap the
+   base doesn't have yet. Each edge to edge time is a channel, a gap longer than PPM_SYNC ends the frame */
+#define PPM_SYNC    3000
+
+static rcPwmCallback_t ppmPulse;
+
+ISR(TIMER1_CAPT_vect)
+{
+    static uint32_t last;
+    static uint8_t chan = 0;
+    uint16_t icr = ICR1;
+    uint32_t now = t1Base;
+    uint16_t width;
+
+    if ((TIFR1 & _BV(OCF1A)) && icr < T1_TOP / 2)
+        now += 1000;
+    now += t1Micros(icr);
+    width = now - last > 0xFFFF ? 0xFFFF : now - last;
+    last = now;
+    if (width > PPM_SYNC) {
+        chan = 0;
+        ppmPulse(RCPWM_SYNC, width);
+    } else if (chan < 8) {
+        ppmPulse(chan++, width);
+    }
+}
+
+uint8_t rcPwm_init(rcPwmCallback_t pulse)
+{
+    ppmPulse = pulse;
+    DDRD &= ~_BV(6);
+    PORTD |= _BV(6);                    // pull up
+    TIFR1 = _BV(ICF1);
+    TIMSK1 |= _BV(ICIE1);
+    return 8;
+}
+
+/* ADC round robin: all 8 channels, ADC_OVERSAMPLE conversions each */
+// Every conversion complete starts the next one, so the ADC never idles. At F_CPU / 32 a conversion is
+// 13 ADC clocks, 21us at 20MHz, and a round ~2.7ms. The sums go to the back buffer, which then becomes the
+// front, so a reader never sees half a round. 16 10 bit conversions add up to the 14 bit mean
+// analogReadOversampled() returns, analogRead() drops the extra bits again.
+#define ADC_CHANNELS    8
+#define ADC_OVERSAMPLE  16
+
+static volatile uint16_t adcValue[2][ADC_CHANNELS];
+static volatile uint8_t adcFront = 0;
+
+ISR(ADC_vect)
+{
+    static uint16_t sum[ADC_CHANNELS];
+    static uint8_t channel = 0, count = 0;
+    uint8_t i, back;
+
+    sum[channel] += ADCW;
+    if (++channel == ADC_CHANNELS) {
+        channel = 0;
+        if (++count == ADC_OVERSAMPLE) {
+            count = 0;
+            back = adcFront ^ 1;
+            for (i = 0; i < ADC_CHANNELS; i++) {
+                adcValue[back][i] = sum[i];
+                sum[i] = 0;
+            }
+            adcFront = back;
+        }
+    }
+    // next channel, single conversion mode so the new mux setting applies right away
+    ADMUX = channel;
+    ADCSRA |= _BV(ADSC);
+}
+
+uint16_t analogReadOversampled(uint8_t channel)
+{
+    // the front buffer isn't written again for a round, however the two bytes are read
+    return adcValue[adcFront][channel & (ADC_CHANNELS - 1)];
+}
+
+uint16_t analogRead(uint8_t channel)
+{
+    return analogReadOversampled(channel) >> 4;
+}
+
+void analogWrite(uint8_t pin, uint16_t value)
+{
+
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+
+}
+
+// ***********************************
+// EEPROM, written back in the background
+// ***********************************
+// Changed bytes go into eeQueue[] and the EE_READY interrupt writes them one after the other, ~3.4ms each,
+// so eeprom_close() returns with the last ones still going and the loop goes on. Reads see the queue first,
+// newest entry first. An EEPROM read has to wait for a write in progress, so a read of a byte that isn't
+// queued holds the next write back until it is done. Only a write into a full queue waits for a free slot.
+#define EE_QUEUE_SIZE   32              // must be a power of 2
+
+static struct {
+    uint16_t addr;
+    uint8_t data;
+} eeQueue[EE_QUEUE_SIZE];
+static volatile uint8_t eeHead = 0;     // next free slot, written by eeprom_write_block()
+static volatile uint8_t eeTail = 0;     // next to write, advanced by the interrupt
+
+ISR(EE_READY_vect)
+{
+    uint8_t tail = eeTail;
+
+    if (tail == eeHead) {
+        EECR = 0;                       // nothing left, the interrupt stays asserted while EEPE is clear
+        return;
+    }
+    EEAR = eeQueue[tail].addr;
+    EEDR = eeQueue[tail].data;
+    // EEPE within 4 cycles of EEMPE, the two stores are back to back
+    EECR = _BV(EERIE) | _BV(EEMPE);
+    EECR = _BV(EERIE) | _BV(EEPE);
+    eeTail = (tail + 1) & (EE_QUEUE_SIZE - 1);
+}
+
+// the queue written out and the last write finished
+static void eeWait(void)
+{
+    while (eeTail != eeHead);
+    while (EECR & _BV(EEPE));
+}
+
+static uint8_t eeReadByte(uint16_t addr)
+{
+    uint8_t i, data, tail = eeTail;
+
+    // the slots are written from here only. Newest first, a match is the last write of addr whether it is
+    // still queued or already out, so a tail that moves on during the search does no harm
+    for (i = eeHead; i != tail;) {
+        i = (i - 1) & (EE_QUEUE_SIZE - 1);
+        if (eeQueue[i].addr == addr)
+            return eeQueue[i].data;
+    }
+    EECR &= ~_BV(EERIE);
+    while (EECR & _BV(EEPE));
+    EEAR = addr;
+    EECR |= _BV(EERE);
+    data = EEDR;
+    if (eeTail != eeHead)
+        EECR |= _BV(EERIE);
+    return data;
+}
+
+void eeprom_open(void)
+{
+
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    uint16_t addr = (uint16_t)src;
+    uint8_t *data = (uint8_t *)dst;
+
+    while (n--)
+        *data++ = eeReadByte(addr++);
+}
+
+void eeprom_write_block(const void *src, void *dst, size_t n)
+{
+    uint16_t addr = (uint16_t)dst;
+    const uint8_t *data = (const uint8_t *)src;
+    uint8_t next;
+
+    for (; n--; addr++, data++) {
+        if (eeReadByte(addr) == *data)
+            continue;
+        next = (eeHead + 1) & (EE_QUEUE_SIZE - 1);
+        while (next == eeTail);
+        eeQueue[eeHead].addr = addr;
+        eeQueue[eeHead].data = *data;
+        eeHead = next;
+        EECR |= _BV(EERIE);
+    }
+}
+
+void eeprom_close(void)
+{
+    // the queue drains by itself
+}
+
+uint16_t eeprom_size(void)
+{
+    return E2END + 1;
+}
+
+void eeprom_erase(void)
+{
+    // bytes are rewritten in place, the parameter log zeroes the byte after its end instead
+}
+
+// ************************************************************************************************************
+// SPI general functions
+// ************************************************************************************************************
+// Shared bus manager, as on the STM8. Each chip brings a spiDevice_t, the bus owns chip select and reprograms
+// clock and mode between transactions. Register access (spi_command()) runs blocking at the device's slow
+// clock, bursts (spi_submit()) are queued and run back to back from the SPI interrupt at its fast clock.
+// Nothing on the CSHRED is on SPI, the bus is there for sensor boards on the ISP header (PB4..7).
+#define SPI_CLOCK       F_CPU           // the prescaler divides 2..128
+#define SPI_QUEUE_SIZE  4               // must be a power of 2
+
+static struct {
+    spiJob_t *queue[SPI_QUEUE_SIZE];
+    volatile uint8_t head;              // next free slot, written by spi_submit()
+    volatile uint8_t tail;              // job on the bus, advanced by the interrupt
+    spiJob_t * volatile job;            // current job, NULL when idle
+    uint8_t locked;                     // spi_command() has the bus, queued jobs wait
+    uint8_t ptr;
+    uint8_t skip;                       // the byte clocked in while the command goes out is garbage
+} spiBus;
+
+void spi_init(void)
+{
+    // SS stays an output (the OC0B pressure offset on the CSHRED), so the SPI can't drop out of master mode
+    DDRB |= _BV(4) | _BV(5) | _BV(7);
+    SPCR = _BV(SPE) | _BV(MSTR) | _BV(SPR1) | _BV(SPR0);
+}
+
+// log2 of the divider less one, 0..6
+static uint8_t spi_prescaler(uint32_t hz)
+{
+    uint8_t div = 0;
+
+    while (div < 6 && (SPI_CLOCK >> (div + 1)) > hz)
+        div++;
+    return div;
+}
+
+void spi_device(spiDevice_t *dev)
+{
+    dev->prescaler[0] = spi_prescaler(dev->slowHz);
+    dev->prescaler[1] = spi_prescaler(dev->fastHz);
+    dev->select(0);
+}
+
+// Only with the bus idle and chip select released, the clock line may change level. SPR picks /4, /16, /64
+// or /128, SPI2X halves the first three
+static void spi_setup(spiDevice_t *dev, uint8_t fast)
+{
+    uint8_t div = dev->prescaler[fast];
+
+    SPSR = (div & 1) || div == 6 ? 0 : _BV(SPI2X);
+    SPCR = (SPCR & (_BV(SPE) | _BV(MSTR) | _BV(SPIE))) | (dev->mode & 0x03) << CPHA | (div >> 1);
+}
+
+static uint8_t spi_byte(uint8_t data)
+{
+    SPDR = data;
+    while (!(SPSR & _BV(SPIF)));
+    return SPDR;
+}
+
+// Only called from the SPI interrupt, or with interrupts masked
+static void spi_startNext(void)
+{
+    spiJob_t *job;
+
+    if (spiBus.job || spiBus.locked || spiBus.tail == spiBus.head)
+        return;
+    job = spiBus.job = spiBus.queue[spiBus.tail];
+    spiBus.ptr = 0;
+    spiBus.skip = 1;
+    spi_setup(job->dev, 1);
+    job->dev->select(1);
+    SPCR |= _BV(SPIE);
+    SPDR = job->cmd;
+}
+
+uint8_t spi_command(spiDevice_t *dev, uint8_t cmd, uint8_t data)
+{
+    disableInterrupts();
+    spiBus.locked = 1;
+    enableInterrupts();
+    while (spiBus.job);                 // a burst already on the bus finishes first
+
+    spi_setup(dev, 0);
+    dev->select(1);
+    spi_byte(cmd);
+    data = spi_byte(data);
+    dev->select(0);
+
+    disableInterrupts();
+    spiBus.locked = 0;
+    spi_startNext();
+    enableInterrupts();
+    return data;
+}
+
+// No DMA, so this runs one byte per SPI interrupt
+uint8_t spi_submit(spiJob_t *job)
+{
+    uint8_t next;
+
+    if (job->len == 0)
+        return 0;
+    disableInterrupts();
+    next = (spiBus.head + 1) & (SPI_QUEUE_SIZE - 1);
+    if (job->busy || next == spiBus.tail) {
+        enableInterrupts();
+        return 0;
+    }
+    job->busy = 1;
+    spiBus.queue[spiBus.head] = job;
+    spiBus.head = next;
+    spi_startNext();
+    enableInterrupts();
+    return 1;
+}
+
+void spi_read(spiDevice_t *dev, uint8_t cmd, uint8_t *buf, uint8_t len)
+{
+    spiJob_t job;
+
+    job.dev = dev;
+    job.cmd = cmd;
+    job.buf = buf;
+    job.len = len;
+    job.done = NULL;
+    job.busy = 0;
+    while (!spi_submit(&job));
+    while (job.busy);
+}
+
+uint8_t spi_isBusy(void)
+{
+    return spiBus.job != NULL || spiBus.tail != spiBus.head;
+}
+
+ISR(SPI_STC_vect)
+{
+    spiJob_t *job = spiBus.job;
+    uint8_t data = SPDR;                // SPIF is cleared by taking the vector
+
+    if (spiBus.skip)
+        spiBus.skip = 0;
+    else
+        job->buf[spiBus.ptr++] = data;
+
+    if (spiBus.ptr < job->len) {
+        SPDR = 0xFF;                    // dummy byte clocks in the next register
+    } else {
+        SPCR &= ~_BV(SPIE);
+        job->dev->select(0);
+        spiBus.job = NULL;
+        spiBus.tail = (spiBus.tail + 1) & (SPI_QUEUE_SIZE - 1);
+        job->busy = 0;
+        if (job->done)
+            job->done(job);
+        spi_startNext();
+    }
+}
+
+// ************************************************************************************************************
+// I2C general functions
+// ************************************************************************************************************
+#define I2C_MAX_STANDARD_HZ 100000
+
+// Per device speed and health, see i2cdev.h. TWBR is switched between jobs when the next one wants the other
+// mode, after the STOP of the last one is out.
+#include "i2cdev.h"
+
+// TWI status codes, TWSR with the prescaler bits masked off (util/twi.h has them under longer names)
+#define TW_START            0x08
+#define TW_REP_START        0x10
+#define TW_MT_SLA_ACK       0x18
+#define TW_MT_SLA_NACK      0x20
+#define TW_MT_DATA_ACK      0x28
+#define TW_MT_DATA_NACK     0x30
+#define TW_MR_SLA_ACK       0x40
+#define TW_MR_SLA_NACK      0x48
+#define TW_MR_DATA_ACK      0x50
+#define TW_MR_DATA_NACK     0x58
+
+#define TWCR_GO             (_BV(TWINT) | _BV(TWEN) | _BV(TWIE))
+
+// A slave reset or cut off in the middle of a read holds SDA low until it has clocked out the rest of its byte,
+// and no START gets through. With the TWI off the pins are GPIOs: SCL is clocked until SDA is let go, at most 9
+// times, then START and STOP by hand. Runs from i2c_init(), at boot and after every timeout.
+#define I2C_SCL             _BV(0)      // PC0
+#define I2C_SDA             _BV(1)      // PC1
+
+static uint16_t i2cRecoveries = 0;
+
+static void i2c_halfBit(void)
+{
+    uint32_t t = microsISR();
+
+    while (microsISR() - t < 5)         // 100kHz
+        ;
+}
+
+// open drain by hand: low is an output at 0, high is let go to the pull ups
+static void i2c_line(uint8_t pin, uint8_t high)
+{
+    if (high)
+        DDRC &= ~pin;
+    else
+        DDRC |= pin;
+}
+
+static void i2c_unstick(void)
+{
+    uint8_t i;
+
+    TWCR = 0;
+    PORTC &= ~(I2C_SCL | I2C_SDA);
+    DDRC &= ~(I2C_SCL | I2C_SDA);
+    if (!(PINC & I2C_SDA)) {
+        for (i = 0; i < 9 && !(PINC & I2C_SDA); i++) {
+            i2c_line(I2C_SCL, 0);
+            i2c_halfBit();
+            i2c_line(I2C_SCL, 1);
+            i2c_halfBit();
+        }
+        i2c_line(I2C_SDA, 0);
+        i2c_halfBit();
+        i2c_line(I2C_SDA, 1);
+        i2c_halfBit();
+        i2cRecoveries++;
+    }
+    PORTC |= I2C_SCL | I2C_SDA;         // the internal pull ups on top of the board's
+}
+
+uint16_t i2c_busRecoveries(void)
+{
+    return i2cRecoveries;
+}
+
+static uint8_t i2cFast;
+
+// With the prescaler at 1, SCL is F_CPU / (16 + 2 * TWBR)
+static void i2c_setClock(uint8_t fast)
+{
+    TWBR = ((F_CPU / (fast ? 400000L : I2C_MAX_STANDARD_HZ)) - 16) / 2;
+    i2cFast = fast;
+}
+
+static void i2c_reset(void)
+{
+    i2c_unstick();
+    TWSR = 0;
+    i2c_setClock(I2C_SPEED > I2C_MAX_STANDARD_HZ);
+    TWCR = _BV(TWEN);
+}
+
+// Transactions are queued and run back to back from the TWI interrupt. Nobody spins on the bus
+// except the blocking i2c_read()/i2c_write() wrappers, and those are bounded by I2C_JOB_TIMEOUT.
+#define I2C_QUEUE_SIZE  8               // must be a power of 2
+
+enum {
+    I2C_PHASE_START = 0,
+    I2C_PHASE_ADDR_TX,
+    I2C_PHASE_TX,
+    I2C_PHASE_RSTART,
+    I2C_PHASE_ADDR_RX,
+    I2C_PHASE_RX
+};
+
+static struct {
+    i2cJob_t *queue[I2C_QUEUE_SIZE];
+    volatile uint8_t head;              // next free slot, written by i2c_submit()
+    volatile uint8_t tail;              // job on the bus, advanced by the interrupt
+    i2cJob_t *job;                      // current job, NULL when idle
+    uint8_t phase;
+    uint8_t ptr;
+    uint8_t subaddrSent;
+    uint8_t ready;                      // i2c_init() ran
+    uint32_t started;                   // micros() when the current job got the bus
+} i2cBus;
+
+// The motors bring the bus up from initOutput() (MOTOR_I2C). Only the first call does anything, a second would cut
+// off the jobs already queued
+void i2c_init(void)
+{
+    if (i2cBus.ready)
+        return;
+    i2cBus.ready = 1;
+    i2c_reset();
+}
+
+static void i2c_startNext(void)
+{
+    uint8_t n = 255;
+
+    if (i2cBus.job || i2cBus.tail == i2cBus.head)
+        return;
+    i2cBus.job = i2cBus.queue[i2cBus.tail];
+    i2cBus.ptr = 0;
+    i2cBus.subaddrSent = 0;
+    i2cBus.started = microsISR();
+    if (i2cBus.job->read && i2cBus.job->subaddr == 0xFF)
+        i2cBus.phase = I2C_PHASE_RSTART;            // no register pointer to set up, straight to the read
+    else
+        i2cBus.phase = I2C_PHASE_START;
+    // the STOP of the last job has to be on the wire first, a few us
+    while ((TWCR & _BV(TWSTO)) && --n)
+        ;
+    if (i2cBus.job->fast != i2cFast)
+        i2c_setClock(i2cBus.job->fast);
+    TWCR = TWCR_GO | _BV(TWSTA);
+}
+
+// Only called from the TWI interrupt, or with interrupts masked
+static void i2c_finish(uint8_t status)
+{
+    i2cJob_t *job = i2cBus.job;
+
+    i2cBus.job = NULL;
+    i2cBus.tail = (i2cBus.tail + 1) & (I2C_QUEUE_SIZE - 1);
+
+    i2cdev_result(job, status, microsISR());
+    job->status = status;
+    if (job->done)
+        job->done(job);
+    i2c_startNext();
+}
+
+// STOP, then the next job
+static void i2c_stop(uint8_t status)
+{
+    TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO);
+    i2c_finish(status);
+}
+
+uint8_t i2c_submit(i2cJob_t *job)
+{
+    uint8_t next;
+    uint8_t sreg = SREG;
+
+    cli();
+    if (!i2cdev_admit(job, microsISR())) {
+        SREG = sreg;
+        job->status = I2C_BACKOFF;
+        return I2C_BACKOFF;
+    }
+    next = (i2cBus.head + 1) & (I2C_QUEUE_SIZE - 1);
+    if (next == i2cBus.tail) {
+        SREG = sreg;
+        job->status = I2C_QUEUE_FULL;
+        return I2C_QUEUE_FULL;
+    }
+    job->status = I2C_PENDING;
+    i2cBus.queue[i2cBus.head] = job;
+    i2cBus.head = next;
+    i2c_startNext();
+    SREG = sreg;
+    return I2C_SUCCESS;
+}
+
+void i2c_poll(void)
+{
+    static const uint8_t timeoutCode[] = { I2C_START_TIMEOUT, I2C_SACK_TIMEOUT, I2C_TX_TIMEOUT, I2C_RSTART_TIMEOUT, I2C_SACK_TIMEOUT, I2C_RX_TIMEOUT };
+    uint8_t phase;
+
+    disableInterrupts();
+    if (i2cBus.job && (microsISR() - i2cBus.started) > I2C_JOB_TIMEOUT(i2cBus.job)) {
+        // Slave is holding the bus or never answered. Drop the job and give the TWI a fresh start.
+        phase = i2cBus.phase;
+        i2c_reset();
+        i2c_finish(timeoutCode[phase]);
+    }
+    enableInterrupts();
+}
+
+uint8_t i2c_isIdle(void)
+{
+    return i2cBus.job == NULL;
+}
+
+// the next byte out of the current write, a repeated start for its read, or its STOP
+static void i2c_txNext(i2cJob_t *job)
+{
+    i2cBus.phase = I2C_PHASE_TX;
+    if (!i2cBus.subaddrSent && job->subaddr != 0xFF) {
+        i2cBus.subaddrSent = 1;
+        TWDR = job->subaddr;
+        TWCR = TWCR_GO;
+    } else if (!job->read && i2cBus.ptr < job->len) {
+        TWDR = job->buf[i2cBus.ptr++];
+        TWCR = TWCR_GO;
+    } else if (job->read) {
+        i2cBus.phase = I2C_PHASE_RSTART;
+        TWCR = TWCR_GO | _BV(TWSTA);                // repeated start for the read
+    } else {
+        i2c_stop(I2C_SUCCESS);
+    }
+}
+
+// ACK the byte coming in unless it is the last
+static void i2c_rxNext(i2cJob_t *job)
+{
+    TWCR = i2cBus.ptr + 1 < job->len ? TWCR_GO | _BV(TWEA) : TWCR_GO;
+}
+
+ISR(TWI_vect)
+{
+    i2cJob_t *job = i2cBus.job;
+
+    PROBE_HI(PROBE_ISR);
+    if (!job) {
+        TWCR = _BV(TWEN);
+        PROBE_LO(PROBE_ISR);
+        return;
+    }
+
+    switch (TWSR & 0xF8) {
+    case TW_START:
+    case TW_REP_START:
+        if (i2cBus.phase == I2C_PHASE_START) {
+            i2cBus.phase = I2C_PHASE_ADDR_TX;
+            TWDR = job->address & 0xFE;             // address write
+        } else {
+            i2cBus.phase = I2C_PHASE_ADDR_RX;
+            TWDR = job->address | 0x01;             // address read
+        }
+        TWCR = TWCR_GO;
+        break;
+    case TW_MT_SLA_ACK:
+    case TW_MT_DATA_ACK:
+        i2c_txNext(job);
+        break;
+    case TW_MR_SLA_ACK:
+        i2cBus.phase = I2C_PHASE_RX;
+        i2c_rxNext(job);
+        break;
+    case TW_MR_DATA_ACK:
+        job->buf[i2cBus.ptr++] = TWDR;
+        i2c_rxNext(job);
+        break;
+    case TW_MR_DATA_NACK:
+        job->buf[i2cBus.ptr++] = TWDR;              // the last one, NACKed as it should be
+        i2c_stop(I2C_SUCCESS);
+        break;
+    case TW_MT_SLA_NACK:
+    case TW_MT_DATA_NACK:
+    case TW_MR_SLA_NACK:
+        i2c_stop(I2C_SACK_FAILURE);
+        break;
+    default:
+        // lost arbitration or a bus error: release the bus so the next job can have it
+        i2c_stop(I2C_BUS_ERROR);
+        break;
+    }
+    PROBE_LO(PROBE_ISR);
+}
+
+// Blocking wrapper around a queued job, for init code and the drivers that need the data right now
+static uint8_t i2c_runJob(i2cJob_t *job)
+{
+    if (i2c_submit(job) != I2C_SUCCESS)
+        return job->status;
+    while (job->status == I2C_PENDING)
+        i2c_poll();
+    return job->status;
+}
+
+uint8_t i2c_write(uint8_t *buf, uint8_t size)
+{
+    // buf[0] is the slave address, the rest goes out as is
+    i2cJob_t job;
+    job.address = buf[0];
+    job.subaddr = 0xFF;
+    job.buf = buf + 1;
+    job.len = size - 1;
+    job.read = 0;
+    job.done = NULL;
+    return i2c_runJob(&job);
+}
+
+uint8_t i2c_read(uint8_t *buf, uint8_t size, uint8_t address, uint8_t subaddr)
+{
+    //0xFF as the subaddr disables sub address
+    i2cJob_t job;
+    job.address = address;
+    job.subaddr = subaddr;
+    job.buf = buf;
+    job.len = size;
+    job.read = 1;
+    job.done = NULL;
+    return i2c_runJob(&job);
+}
+
+/* Motors: BL-Ctrl ESCs on the I2C bus, driven by MOTOR_I2C in MultiWii_afro.c (def.h defines it here). No servo
+   outputs */
+void pwmInit(uint8_t useServo)
+{
+
+}
+
+void pwmWrite(uint8_t channel, uint16_t value)
+{
+
+}
+
+void pwmServoRate(uint16_t hz)
+{
+
+}
+
+void pwmWriteAll(const int16_t *value, uint8_t count)
+{
+
+}
@@ -0,0 +1,1160 @@
+/* System dependent file for the host simulator (software in the loop)
+ *
+ * Builds MultiWii_afro.c natively with the ITG3200/BMA180/HMC5883 drivers talking to register models
+ * instead of an I2C bus, so the whole control loop runs off-target at host speed:
+ *   gcc -O2 -DHOSTSIM -I. -o afrowii_sim main.c MultiWii_afro.c sysdep_host.c -lm
+ * Add -pg for gprof, or run the binary under perf/valgrind --tool=callgrind for per function cost.
+ *
+ * Environment:
+ *   AFROWII_SIM_LOG      sensor/RC log to replay, one sample per line, '#' starts a comment:
+ *                        time_us gyro[3] acc[3] mag[3] rc[8]
+ *                        gyro/acc/mag are gyroADC/accADC/magADC units (ROLL, PITCH, YAW; acc_1G = 512),
+ *                        rc is in receiver channel order (rcValue[]), published as a frame every 20ms. Without a log a built in
+ *                        hover scenario is generated: calibrate, arm, then a slow roll stick sweep
+ *   AFROWII_SIM_SAMPLES  length of the built in scenario in 1ms samples (default 20000)
+ *   AFROWII_SIM_TRACE    output trace file (default stdout): time_us motor/servo pwm[8], one line per loop
+ *   AFROWII_SIM_SERIAL   file that gets everything sent through Serial_commitBuffer() (default: dropped)
+ *   AFROWII_SIM_SERIAL_IN  file whose bytes are fed to Serial_read(), all available from the start. With -DBIT_EXACT
+ *                        -DHIL_INJECT it holds the step frames of parity_bench.c: they bring the sensors and the
+ *                        receiver instead of the log or scenario, and the reply to the last one ends the run
+ *   AFROWII_SIM_SERIAL_BAUD  paces the serial TX like a UART at that rate, two frame buffers as on the targets:
+ *                        Serial_isTxBusy() while both hold a frame not out yet, frames committed then are
+ *                        dropped and counted in Serial_txDropped(). Default: no wire, never busy
+ *   AFROWII_SIM_GPS      GPS capture (NMEA or UBX) fed to gpsSerial_read() at GPS_BAUD, with -DGPS. Bytes the
+ *                        128 byte ring of the STM32 would have lost are dropped the same way
+ *   AFROWII_SIM_SDCARD   card image for BLACKBOX_SD, written in place. Transfers take 300us plus 25us a sector
+ *   AFROWII_SIM_FLASH    firmware image the 'v' CRC check reads, at 0x08000000 like the STM32 flash, 1K pages
+ *   AFROWII_SIM_GOLDEN   reference trace: every loop is compared against it, the run exits with 2 on any difference
+ *   AFROWII_SIM_PLANT    closes the loop: the stick rate in deg/s at full deflection. A quad X rigid body is driven
+ *                        by motors 0..3 (thrust lags the pwm by 20ms) and the gyro/acc come from its rates and
+ *                        attitude; the gyro columns of the log or scenario become disturbance torques in deg/s^2.
+ *                        It sits on the ground until the mean thrust is over 25%. On exit the rms error between
+ *                        the stick rate and the body rate while flying and the rms loop to loop motor change
+ *                        (effort, us) are printed, sil_sweep.c ranks gain sets on these
+ *
+ * Replay benchmark: the PROFILE_BEGIN/END stages (PID, mixTable, ...) are timed in ns with the host
+ * clock and printed on exit. The frame type is fixed per build with -DSIM_MIXER=MULTITYPE_xxx, e.g.
+ *   for m in TRI QUADP QUADX BI Y6 HEX6 FLYING_WING Y4 HEX6X OCTOX8 OCTOFLATP OCTOFLATX; do
+ *     gcc -O2 -DHOSTSIM -DSIM_MIXER=MULTITYPE_$m -I. -o sim_$m main.c MultiWii_afro.c sysdep_host.c -lm
+ *     AFROWII_SIM_LOG=flight.log AFROWII_SIM_GOLDEN=golden_$m.txt ./sim_$m > /dev/null
+ *   done
+ * Record the golden traces once from a known good tree (AFROWII_SIM_TRACE=golden_$m.txt), then a change
+ * to the PID or mixer is only bit exact if every frame type still matches.
+ *
+ * Time is virtual: every micros() call costs 1us and delay() advances the clock, so a given log and
+ * build always produce the same trace. When the log runs out the loop count and host time per loop
+ * are printed to stderr and the process exits.
+ */
+#include "config.h"
+#include "def.h"
+#include "sysdep.h"
+#if defined(GPS_PORT)
+#include "ringbuf.h"
+#endif
+#include <time.h>
+
+extern volatile uint16_t rcValue[8];
+extern volatile uint8_t rcFrameComplete;
+extern volatile uint8_t rcFrameCount;
+extern volatile uint32_t rcFrameTime;
+extern volatile uint32_t rcLinkTime;
+
+/* axis order of the sample vectors, same as gyroADC[] */
+#define SIM_ROLL     0
+#define SIM_PITCH    1
+#define SIM_YAW      2
+
+/* simulated clock */
+static uint32_t simTime = 0;
+
+/* current input sample */
+typedef struct simSample_t {
+    uint32_t time;
+    int16_t gyro[3];
+    int16_t acc[3];
+    int16_t mag[3];
+    uint16_t rc[8];
+} simSample_t;
+
+static FILE *simLog = NULL;
+static FILE *simTrace = NULL;
+static FILE *simSerial = NULL;
+static uint32_t simSerialBaud = 0;
+static uint32_t simTxEnd[2];            // the time the frame before the last and the last one are out
+static uint16_t simTxDropped = 0;
+static FILE *simSerialInFile = NULL;
+static uint8_t simSerialIn[256];
+static uint16_t simSerialInLen = 0;
+static uint16_t simSerialInPos = 0;
+#if defined(GPS_PORT)
+static FILE *simGps = NULL;
+static uint32_t simGpsBaud, simGpsStart;
+static uint32_t simGpsPos = 0;          // bytes taken from the file
+static uint8_t simGpsBuffer[128];
+static ring_t simGpsRing = RING_INIT(simGpsBuffer);
+#endif
+static simSample_t simNow, simNext;
+static uint8_t simHaveNext = 0;
+static uint32_t simSampleCount = 0;
+static uint32_t simSamples = 20000;
+static uint32_t simT0 = 0;
+static uint8_t simStarted = 0;
+
+/* outputs */
+static uint16_t simPwm[8];
+static uint8_t simPwmDirty = 0;
+static uint32_t simLoops = 0;
+static struct timespec simWallStart;
+
+/* golden trace comparison */
+static FILE *simGolden = NULL;
+static uint32_t simGoldenDiffs = 0;
+static uint32_t simGoldenFirst = 0;
+
+/* closed loop plant, quad X */
+#define SIM_PLANT_LAG        0.020f      // s, motor/prop thrust response
+#define SIM_PLANT_TORQUE     2000.0f     // deg/s^2 for the full thrust difference on roll and pitch
+#define SIM_PLANT_YAW        400.0f
+#define SIM_PLANT_DRAG       2.0f        // 1/s
+#define SIM_GYRO_LSB         (14.375f / 4.0f)    // gyroADC per deg/s, ITG3200
+static float simPlantStick = 0;         // deg/s at full stick, 0: open loop
+static float simPlantThrust[4];
+static float simPlantRate[3];           // deg/s
+static float simPlantAngle[2];          // deg, roll and pitch
+static int16_t simPlantDisturb[3];
+static uint32_t simPlantTime;
+static uint8_t simPlantFlying = 0;
+static double simPlantErr[3];           // sums while flying
+static double simPlantEffort;
+static double simPlantUs = 0;
+static uint32_t simPlantLoops = 0;
+static uint16_t simPlantPwm[4];
+
+/* stage timing */
+#define SIM_STAGES 16
+static struct {
+    const char *name;
+    uint64_t start;
+    uint64_t sum;
+    uint32_t min, max;
+    uint32_t count;
+} simStage[SIM_STAGES];
+
+static uint64_t sim_nanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sim_finish(void);
+static void sim_serialFill(void);
+
+/* HW init */
+void hw_init(void)
+{
+    const char *s;
+    uint8_t i;
+
+    s = getenv("AFROWII_SIM_LOG");
+    if (s && !(simLog = fopen(s, "r"))) {
+        fprintf(stderr, "afrowii_sim: can't open %s\n", s);
+        exit(1);
+    }
+    s = getenv("AFROWII_SIM_TRACE");
+    simTrace = s ? fopen(s, "w") : stdout;
+    if (!simTrace) {
+        fprintf(stderr, "afrowii_sim: can't create %s\n", s);
+        exit(1);
+    }
+    s = getenv("AFROWII_SIM_SERIAL");
+    if (s)
+        simSerial = fopen(s, "wb");
+    s = getenv("AFROWII_SIM_SERIAL_BAUD");
+    if (s)
+        simSerialBaud = strtoul(s, NULL, 10);
+    s = getenv("AFROWII_SIM_SERIAL_IN");
+    if (s && !(simSerialInFile = fopen(s, "rb"))) {
+        fprintf(stderr, "afrowii_sim: can't open %s\n", s);
+        exit(1);
+    }
+#if defined(BIT_EXACT)
+    sim_serialFill();
+    if (simSerialInLen == 0) {
+        fprintf(stderr, "afrowii_sim: BIT_EXACT runs on the step frames of AFROWII_SIM_SERIAL_IN, there are none\n");
+        exit(1);
+    }
+#endif
+#if defined(GPS_PORT)
+    s = getenv("AFROWII_SIM_GPS");
+    if (s && !(simGps = fopen(s, "rb"))) {
+        fprintf(stderr, "afrowii_sim: can't open %s\n", s);
+        exit(1);
+    }
+#endif
+    s = getenv("AFROWII_SIM_GOLDEN");
+    if (s && !(simGolden = fopen(s, "r"))) {
+        fprintf(stderr, "afrowii_sim: can't open %s\n", s);
+        exit(1);
+    }
+    s = getenv("AFROWII_SIM_SAMPLES");
+    if (s)
+        simSamples = strtoul(s, NULL, 10);
+    s = getenv("AFROWII_SIM_PLANT");
+    if (s)
+        simPlantStick = strtod(s, NULL);
+
+    // level and still until the first sample is consumed
+    memset(&simNow, 0, sizeof(simNow));
+    simNow.acc[SIM_YAW] = 512;
+    simNow.mag[SIM_ROLL] = 200;
+    simNow.mag[SIM_YAW] = -400;
+    for (i = 0; i < 8; i++)
+        simNow.rc[i] = 1500;
+    simNow.rc[2] = 1000;
+
+    clock_gettime(CLOCK_MONOTONIC, &simWallStart);
+}
+
+// built in scenario, receiver order is SERIAL_SUM_PPM: ROLL, PITCH, THROTTLE, YAW, AUX1..
+static uint8_t sim_generate(simSample_t *out)
+{
+    uint32_t t;
+    uint8_t i;
+
+    if (simSampleCount >= simSamples)
+        return 0;
+    t = simSampleCount * 1000;
+    memset(out, 0, sizeof(*out));
+    out->time = t;
+    out->acc[SIM_YAW] = 512;
+    out->mag[SIM_ROLL] = 200;
+    out->mag[SIM_YAW] = -400;
+    for (i = 0; i < 8; i++)
+        out->rc[i] = 1500;
+    if (t < 5000000) {
+        out->rc[2] = 1000;
+        if (t >= 3000000)
+            out->rc[3] = 2000;          // yaw right: arm
+    } else {
+        float a = sinf((t - 5000000) * (TWO_PI * 0.5f / 1000000.0f));
+        out->rc[2] = 1500;
+        out->rc[0] = 1500 + (int16_t)(a * 200.0f);
+        out->gyro[SIM_ROLL] = (int16_t)(a * 150.0f);
+        out->acc[SIM_ROLL] = (int16_t)(a * 40.0f);
+    }
+    return 1;
+}
+
+static uint8_t sim_readLog(simSample_t *out)
+{
+    char line[256];
+    unsigned long t;
+
+    while (fgets(line, sizeof(line), simLog)) {
+        long l[19];
+        uint8_t i;
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+            continue;
+        if (sscanf(line, "%lu %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld",
+                   &t, &l[1], &l[2], &l[3], &l[4], &l[5], &l[6], &l[7], &l[8], &l[9],
+                   &l[10], &l[11], &l[12], &l[13], &l[14], &l[15], &l[16], &l[17], &l[18]) != 19) {
+            fprintf(stderr, "afrowii_sim: bad log line: %s", line);
+            continue;
+        }
+        out->time = t;
+        for (i = 0; i < 3; i++) {
+            out->gyro[i] = l[1 + i];
+            out->acc[i] = l[4 + i];
+            out->mag[i] = l[7 + i];
+        }
+        for (i = 0; i < 8; i++)
+            out->rc[i] = l[10 + i];
+        return 1;
+    }
+    return 0;
+}
+
+static uint8_t sim_nextSample(simSample_t *out)
+{
+    uint8_t rv = simLog ? sim_readLog(out) : sim_generate(out);
+    if (rv)
+        simSampleCount++;
+    return rv;
+}
+
+// one Euler step over the time since the last gyro read, the motors as the last loop left them
+static void sim_plantStep(void)
+{
+    static const int8_t mixRoll[4] = { -1, -1, +1, +1 }, mixPitch[4] = { +1, -1, +1, -1 };
+    static const int8_t mixYaw[4] = { -1, +1, +1, -1 };
+    float dt = (uint32_t)(simTime - simPlantTime) * 1e-6f;
+    float torque[3], mean = 0, ref;
+    uint8_t i;
+
+    simPlantTime = simTime;
+    if (dt > 0.01f)
+        dt = 0.01f;
+    torque[0] = torque[1] = torque[2] = 0;
+    for (i = 0; i < 4; i++) {
+        float u = constrain(((int16_t)simPwm[i] - 1000) / 1000.0f, 0.0f, 1.0f);
+        simPlantThrust[i] += (u - simPlantThrust[i]) * dt / (SIM_PLANT_LAG + dt);
+        torque[0] += mixRoll[i] * simPlantThrust[i];
+        torque[1] += mixPitch[i] * simPlantThrust[i];
+        torque[2] += mixYaw[i] * simPlantThrust[i] * YAW_DIRECTION;
+        mean += simPlantThrust[i] / 4;
+    }
+    simPlantFlying = mean > 0.25f;
+    for (i = 0; i < 3; i++) {
+        if (!simPlantFlying) {
+            simPlantRate[i] = 0;
+            continue;
+        }
+        simPlantRate[i] += (torque[i] * (i == 2 ? SIM_PLANT_YAW : SIM_PLANT_TORQUE) + simPlantDisturb[i]
+                            - SIM_PLANT_DRAG * simPlantRate[i]) * dt;
+        ref = ((int16_t)simNow.rc[i == 2 ? 3 : i] - 1500) / 500.0f * simPlantStick;
+        simPlantErr[i] += (double)(ref - simPlantRate[i]) * (ref - simPlantRate[i]) * dt;
+    }
+    if (simPlantFlying)
+        simPlantUs += dt;
+    else
+        simPlantAngle[0] = simPlantAngle[1] = 0;
+    for (i = 0; i < 2; i++)
+        simPlantAngle[i] += simPlantRate[i] * dt;
+    for (i = 0; i < 3; i++)
+        simNow.gyro[i] = constrain(simPlantRate[i] * SIM_GYRO_LSB, -8000, 8000);
+    simNow.acc[SIM_ROLL] = 512 * sinf(simPlantAngle[0] * (PI / 180));
+    simNow.acc[SIM_PITCH] = 512 * sinf(simPlantAngle[1] * (PI / 180));
+    simNow.acc[SIM_YAW] = 512 * cosf(simPlantAngle[0] * (PI / 180)) * cosf(simPlantAngle[1] * (PI / 180));
+}
+
+// sample and hold: the sample in effect is the last one whose (log relative) time has passed
+static void sim_advance(void)
+{
+#if !defined(BIT_EXACT)
+    uint8_t i;
+#endif
+
+    if (!simStarted) {
+        if (!sim_nextSample(&simNext))
+            sim_finish();
+        simHaveNext = 1;
+        simStarted = 1;
+        simT0 = simTime - simNext.time;
+    }
+    while (simHaveNext && (int32_t)(simTime - simT0 - simNext.time) >= 0) {
+        simNow = simNext;
+        if (!sim_nextSample(&simNext))
+            simHaveNext = 0;
+        if (simPlantStick)
+            memcpy(simPlantDisturb, simNow.gyro, sizeof(simPlantDisturb));
+    }
+#if !defined(BIT_EXACT)                 // the step frames bring the receiver and end the run, see Serial_commitBuffer()
+    // the receiver delivers a frame every 20ms like PPM does, with whatever sample is in effect
+    if ((int32_t)(simTime - rcFrameTime) >= 20000) {
+        for (i = 0; i < 8; i++)
+            rcValue[i] = simNow.rc[i];
+        rcFrameTime = rcLinkTime = simTime;
+        rcFrameCount++;
+        rcFrameComplete = 1;
+    }
+    if (!simHaveNext && (int32_t)(simTime - simT0 - simNow.time) >= 1000)
+        sim_finish();
+#endif
+    if (simPlantStick)
+        sim_plantStep();
+}
+
+static void sim_flushTrace(void)
+{
+    char line[128], ref[128];
+    int n;
+    uint8_t i;
+
+    if (!simPwmDirty)
+        return;
+    n = sprintf(line, "%lu", (unsigned long)simTime);
+    for (i = 0; i < 8; i++)
+        n += sprintf(line + n, " %u", simPwm[i]);
+    if (simPlantFlying) {
+        for (i = 0; i < 4; i++)
+            simPlantEffort += ((int32_t)simPwm[i] - simPlantPwm[i]) * ((int32_t)simPwm[i] - simPlantPwm[i]) / 4.0;
+        simPlantLoops++;
+    }
+    memcpy(simPlantPwm, simPwm, sizeof(simPlantPwm));
+    line[n++] = '\n';
+    line[n] = 0;
+    fputs(line, simTrace);
+    if (simGolden && (!fgets(ref, sizeof(ref), simGolden) || strcmp(ref, line) != 0)) {
+        if (simGoldenDiffs++ == 0)
+            simGoldenFirst = simLoops;
+    }
+    simPwmDirty = 0;
+    simLoops++;
+}
+
+void sim_profileBegin(uint8_t stage)
+{
+    simStage[stage].start = sim_nanos();
+}
+
+void sim_profileEnd(uint8_t stage, const char *name)
+{
+    uint32_t ns = sim_nanos() - simStage[stage].start;
+
+    if (simStage[stage].count == 0 || ns < simStage[stage].min)
+        simStage[stage].min = ns;
+    if (ns > simStage[stage].max)
+        simStage[stage].max = ns;
+    simStage[stage].sum += ns;
+    simStage[stage].count++;
+    simStage[stage].name = name;
+}
+
+static void sim_finish(void)
+{
+    struct timespec now;
+    char line[128];
+    double ns;
+    uint8_t i;
+
+    sim_flushTrace();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (now.tv_sec - simWallStart.tv_sec) * 1e9 + (now.tv_nsec - simWallStart.tv_nsec);
+    fprintf(stderr, "afrowii_sim: %lu samples, %lu loops, %.0f ns/loop host time\n",
+            (unsigned long)simSampleCount, (unsigned long)simLoops, simLoops ? ns / simLoops : 0.0);
+    for (i = 0; i < SIM_STAGES; i++)
+        if (simStage[i].count)
+            fprintf(stderr, "  %-22s %8lu calls %8.0f ns mean %8lu min %8lu max\n", simStage[i].name,
+                    (unsigned long)simStage[i].count, (double)simStage[i].sum / simStage[i].count,
+                    (unsigned long)simStage[i].min, (unsigned long)simStage[i].max);
+    if (simPlantStick)
+        fprintf(stderr, "afrowii_sim: plant %.1f s flying, rms error %.2f %.2f %.2f deg/s, effort %.2f us\n", simPlantUs,
+                simPlantUs ? sqrt(simPlantErr[0] / simPlantUs) : 0.0, simPlantUs ? sqrt(simPlantErr[1] / simPlantUs) : 0.0,
+                simPlantUs ? sqrt(simPlantErr[2] / simPlantUs) : 0.0,
+                simPlantLoops ? sqrt(simPlantEffort / simPlantLoops) : 0.0);
+    fflush(simTrace);
+    if (simSerial)
+        fclose(simSerial);
+    if (simGolden) {
+        if (fgets(line, sizeof(line), simGolden) && simGoldenDiffs++ == 0)
+            simGoldenFirst = simLoops;      // the reference is longer
+        if (simGoldenDiffs) {
+            fprintf(stderr, "afrowii_sim: %lu loops differ from the golden trace, first at loop %lu\n",
+                    (unsigned long)simGoldenDiffs, (unsigned long)simGoldenFirst);
+            exit(2);
+        }
+        fprintf(stderr, "afrowii_sim: matches the golden trace\n");
+    }
+    exit(0);
+}
+
+/* UART */
+static uint8_t uartPointer;
+static uint8_t uartBuffer[128];
+
+// AFROWII_SIM_SERIAL_IN is read as it is used up. Only between a Serial_consume() and the next Serial_peek(),
+// the bytes of the last peek stay where they are until then
+static void sim_serialFill(void)
+{
+    if (!simSerialInFile || simSerialInLen - simSerialInPos >= sizeof(simSerialIn) / 2)
+        return;
+    memmove(simSerialIn, simSerialIn + simSerialInPos, simSerialInLen - simSerialInPos);
+    simSerialInLen -= simSerialInPos;
+    simSerialInPos = 0;
+    simSerialInLen += fread(simSerialIn + simSerialInLen, 1, sizeof(simSerialIn) - simSerialInLen, simSerialInFile);
+}
+
+void serialize16(int16_t a)
+{
+    serialize8(a);
+    serialize8(a >> 8 & 0xff);
+}
+
+void serialize8(uint8_t a)
+{
+    if (uartPointer < sizeof(uartBuffer))
+        uartBuffer[uartPointer++] = a;
+}
+
+void *Serial_reserve(uint8_t len)
+{
+    uint8_t *p = &uartBuffer[uartPointer];
+
+    if (len > sizeof(uartBuffer) - uartPointer)
+        return 0;
+    uartPointer += len;
+    return p;
+}
+
+void Serial_commitBuffer(void)
+{
+    uint32_t start;
+
+    if (simSerialBaud) {
+        if (Serial_isTxBusy()) {
+            simTxDropped++;
+            return;
+        }
+        start = (int32_t)(simTime - simTxEnd[1]) < 0 ? simTxEnd[1] : simTime;
+        simTxEnd[0] = simTxEnd[1];
+        simTxEnd[1] = start + (uint32_t)((uint64_t)uartPointer * 10000000 / simSerialBaud);
+    }
+    if (simSerial)
+        fwrite(uartBuffer, 1, uartPointer, simSerial);
+#if defined(BIT_EXACT)
+    // the reply to the last step frame of the input ends the run
+    sim_serialFill();
+    if (simSerialInPos == simSerialInLen)
+        sim_finish();
+#endif
+}
+
+uint8_t Serial_isTxBusy(void)
+{
+    return simSerialBaud && (int32_t)(simTime - simTxEnd[0]) < 0;
+}
+
+uint8_t Serial_txIdle(void)
+{
+    return !simSerialBaud || (int32_t)(simTime - simTxEnd[1]) >= 0;
+}
+
+void Serial_reset(void)
+{
+    uartPointer = 0;
+}
+
+void Serial_begin(uint32_t speed)
+{
+
+}
+
+uint16_t Serial_available(void)
+{
+    sim_serialFill();
+    return simSerialInLen - simSerialInPos;
+}
+
+uint8_t Serial_read(void)
+{
+    sim_serialFill();
+    if (simSerialInPos == simSerialInLen)
+        return -1;
+    return simSerialIn[simSerialInPos++];
+}
+
+uint8_t Serial_peek(const uint8_t **data)
+{
+    uint16_t n;
+
+    sim_serialFill();
+    n = simSerialInLen - simSerialInPos;
+
+    *data = &simSerialIn[simSerialInPos];
+    return n > 255 ? 255 : n;
+}
+
+void Serial_consume(uint8_t n)
+{
+    simSerialInPos += n;
+}
+
+uint16_t Serial_rxOverflow(void)
+{
+    return 0;
+}
+
+uint16_t Serial_txDropped(void)
+{
+    return simTxDropped;    // without AFROWII_SIM_SERIAL_BAUD everything goes to the file
+}
+
+// the scenario writes rcValue[] directly, there is no serial receiver to feed
+void rcSerial_init(uint32_t speed, uint8_t format, rcSerialCallback_t rx)
+{
+
+}
+
+uint8_t rcPwm_init(rcPwmCallback_t pulse)
+{
+    return 0;
+}
+
+#if defined(GPS_PORT)
+void gpsSerial_init(uint32_t speed)
+{
+    simGpsBaud = speed;
+    simGpsStart = simTime;
+}
+
+// the bytes that arrived at 10 bits each since the start go through the same ring as on the STM32
+uint8_t gpsSerial_available(void)
+{
+    uint32_t due;
+    int c;
+
+#if defined(SENSOR_LINK)
+    sim_advance();                      // no gyro is read, the scenario and the receiver go on from here
+#endif
+    if (!simGps)
+        return 0;
+    due = (uint64_t)(simTime - simGpsStart) * simGpsBaud / 10000000;
+    for (; simGpsPos < due && (c = getc(simGps)) != EOF; simGpsPos++)
+        ring_put(&simGpsRing, c);
+    return ring_count(&simGpsRing);
+}
+
+uint8_t gpsSerial_read(void)
+{
+    return ring_get(&simGpsRing);
+}
+
+uint16_t gpsSerial_rxOverflow(void)
+{
+    return simGpsRing.overflow;
+}
+#endif
+
+/* TIMING */
+#if defined(LOOP_ISR)
+/* The inner loop interrupt comes from micros(), the clock only moves on there, so it lands wherever main() reads
+   the time, like the SysTick pend would. It doesn't nest, and there is no data ready gyro here to pend it */
+static loopTickCallback_t simLoopTick;
+static uint32_t simLoopPeriod;
+static uint32_t simLoopNext;            // simTime it is due
+static uint8_t simInLoopTick = 0;
+
+void loopIsr_init(uint8_t periodMs, loopTickCallback_t tick)
+{
+    simLoopPeriod = (uint32_t)periodMs * 1000;
+    simLoopNext = simTime + simLoopPeriod;
+    simLoopTick = tick;
+}
+
+void loopIsr_pend(void)
+{
+    simLoopNext = simTime;
+}
+
+void loopIsr_idle(void)
+{
+    // nothing else happens until then
+    if ((int32_t)(simLoopNext - simTime) > 0)
+        simTime = simLoopNext;
+    micros();
+}
+
+static void sim_loopTick(void)
+{
+    if (!simLoopTick || simInLoopTick || (int32_t)(simTime - simLoopNext) < 0)
+        return;
+    simLoopNext += simLoopPeriod;
+    if ((int32_t)(simTime - simLoopNext) >= 0)
+        simLoopNext = simTime + simLoopPeriod;     // the pends of a late inner loop collapse into one
+    simInLoopTick = 1;
+    simLoopTick();
+    simInLoopTick = 0;
+}
+#endif
+
+uint32_t micros(void)
+{
+#if defined(LOOP_ISR)
+    uint32_t t = simTime++;
+
+    sim_loopTick();
+    return t;
+#else
+    return simTime++;
+#endif
+}
+
+uint32_t microsISR(void)
+{
+    return micros();
+}
+
+uint16_t irq_latencyMax(uint8_t source)
+{
+    return 0;               // interrupts are function calls here
+}
+
+uint32_t cycles(void)
+{
+    // only looks, unlike micros() it doesn't move the clock on
+    return simTime;
+}
+
+uint32_t millis(void)
+{
+    return simTime / 1000;
+}
+
+void delay(uint16_t ms)
+{
+    simTime += (uint32_t)ms * 1000;
+}
+
+uint16_t analogRead(uint8_t channel)
+{
+    if (channel == V_BATPIN)
+        return 11 * VBATSCALE / 4 * 10 / 8 + 2;     // ~11V once averaged
+    return 0;
+}
+
+void analogWrite(uint8_t pin, uint16_t value)
+{
+
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+
+}
+
+void systemReboot(void)
+{
+    sim_finish();
+}
+
+void systemBootloader(void)
+{
+    sim_finish();
+}
+
+/* the simulation never hangs on hardware */
+void watchdog_init(uint16_t ms)
+{
+}
+
+void watchdog_kick(void)
+{
+}
+
+uint8_t watchdog_didReset(void)
+{
+    return 0;
+}
+
+/* no fixed stack to watch on the host */
+void stack_paint(void)
+{
+}
+
+uint16_t stack_free(void)
+{
+    return 0;
+}
+
+uint16_t ram_static(void)
+{
+    return 0;
+}
+
+// the linker's .data start and the end of .bss, see end(3)
+extern char __data_start[], end[];
+
+uint8_t ram_isStatic(uint32_t addr, uint8_t len)
+{
+    return addr >= (uintptr_t)__data_start && (uintptr_t)addr + len <= (uintptr_t)end;
+}
+
+/* CRC-32 of flash: AFROWII_SIM_FLASH is loaded at SIM_FLASH_BASE, without it there is no flash */
+#define SIM_FLASH_BASE          0x08000000
+#define SIM_FLASH_MAX           (1024 * 1024)
+
+static uint8_t *simFlash = NULL;
+static uint32_t simFlashSize = 0;
+
+static uint32_t crcFlashWord(uint32_t address)
+{
+    const uint8_t *p = simFlash + (address - SIM_FLASH_BASE);
+
+    return p[0] | p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint8_t crcInFlash(uint32_t address, uint32_t words)
+{
+    const char *s = getenv("AFROWII_SIM_FLASH");
+    FILE *f;
+
+    if (!simFlash && s) {
+        if (!(f = fopen(s, "rb"))) {
+            fprintf(stderr, "afrowii_sim: can't open %s\n", s);
+            exit(1);
+        }
+        simFlash = malloc(SIM_FLASH_MAX);
+        memset(simFlash, 0xFF, SIM_FLASH_MAX);  // erased past the image
+        simFlashSize = fread(simFlash, 1, SIM_FLASH_MAX, f);
+        simFlashSize = (simFlashSize + 1023) & ~1023;
+        fclose(f);
+    }
+    return address >= SIM_FLASH_BASE && address <= SIM_FLASH_BASE + simFlashSize
+        && words <= (SIM_FLASH_BASE + simFlashSize - address) / 4;
+}
+
+#include "crc32.h"
+
+#if defined(BLACKBOX_SD)
+/* SD card, an image file */
+static FILE *simCard = NULL;
+static uint32_t simCardDone = 0;        // simTime the last transfer is over
+
+uint32_t sdcard_init(void)
+{
+    const char *s = getenv("AFROWII_SIM_SDCARD");
+
+    if (!s)
+        return 0;
+    if (!(simCard = fopen(s, "r+b"))) {
+        fprintf(stderr, "afrowii_sim: can't open %s\n", s);
+        exit(1);
+    }
+    fseek(simCard, 0, SEEK_END);
+    return ftell(simCard) / 512;
+}
+
+static uint8_t simCardTransfer(uint32_t sector, uint8_t *buf, uint16_t count, uint8_t write)
+{
+    if (sdcard_busy())
+        return 0;
+    simCardDone = simTime + 300 + 25 * count;
+    fseek(simCard, (long)sector * 512, SEEK_SET);
+    if (write)
+        fwrite(buf, 512, count, simCard);
+    else if (fread(buf, 512, count, simCard) != count)
+        memset(buf, 0, (size_t)count * 512);
+    fflush(simCard);
+    return 1;
+}
+
+uint8_t sdcard_read(uint32_t sector, uint8_t *buf, uint16_t count)
+{
+    return simCardTransfer(sector, buf, count, 0);
+}
+
+uint8_t sdcard_write(uint32_t sector, const uint8_t *buf, uint16_t count)
+{
+    return simCardTransfer(sector, (uint8_t *)buf, count, 1);
+}
+
+uint8_t sdcard_busy(void)
+{
+    return (int32_t)(simTime++ - simCardDone) < 0;     // polling costs 1us like micros(), a wait loop ends
+}
+
+uint16_t sdcard_errors(void)
+{
+    return 0;
+}
+#endif
+
+/* EEPROM, volatile */
+static uint8_t eeprom[1024];
+static uint8_t eepromInit = 0;
+
+void eeprom_open(void)
+{
+    if (!eepromInit) {
+        memset(eeprom, 0xFF, sizeof(eeprom));
+        eepromInit = 1;
+    }
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    memcpy(dst, eeprom + (size_t)src, n);
+}
+
+void eeprom_write_block(const void *src, void *dst, size_t n)
+{
+    memcpy(eeprom + (size_t)dst, src, n);
+}
+
+void eeprom_close(void)
+{
+
+}
+
+#if defined(PARAM_IN_PLACE)
+const void *eeprom_map(const void *src, size_t n)
+{
+    return eeprom + (size_t)src;
+}
+#endif
+
+uint16_t eeprom_size(void)
+{
+    return sizeof(eeprom);
+}
+
+void eeprom_erase(void)
+{
+    memset(eeprom, 0xFF, sizeof(eeprom));
+}
+
+// ************************************************************************************************************
+// SPI general functions
+// ************************************************************************************************************
+void spi_init(void)
+{
+
+}
+
+void spi_device(spiDevice_t *dev)
+{
+
+}
+
+uint8_t spi_command(spiDevice_t *dev, uint8_t cmd, uint8_t data)
+{
+    return 0;
+}
+
+uint8_t spi_submit(spiJob_t *job)
+{
+    return 0;
+}
+
+void spi_read(spiDevice_t *dev, uint8_t cmd, uint8_t *buf, uint8_t len)
+{
+    memset(buf, 0, len);
+}
+
+uint8_t spi_isBusy(void)
+{
+    return 0;
+}
+
+// PWM Functions
+void pwmInit(uint8_t useServo)
+{
+
+}
+
+void pwmWrite(uint8_t channel, uint16_t value)
+{
+    // writeMotors() starts at channel 0, so that closes the previous loop's line
+    if (channel == 0)
+        sim_flushTrace();
+    if (channel < 8) {
+        simPwm[channel] = value;
+        simPwmDirty = 1;
+    }
+}
+
+void pwmServoRate(uint16_t hz)
+{
+
+}
+
+void pwmWriteAll(const int16_t *value, uint8_t count)
+{
+    uint8_t i;
+
+    for (i = 0; i < count; i++)
+        pwmWrite(i, value[i]);
+}
+
+#if defined(CAN_BUS)
+/* CAN: the ESCs are modelled. A motor frame goes to the trace like the PWM, and each ESC answers with its
+   telemetry every 20ms, eRPM and current following its last byte */
+#define SIM_CAN_RX              16
+static canFrame_t simCanRx[SIM_CAN_RX];
+static uint8_t simCanHead = 0, simCanTail = 0;
+static uint16_t simCanOverflow = 0;
+static uint32_t simEscReport[8];
+
+void can_init(uint32_t bitrate)
+{
+
+}
+
+static void simCanReceive(const canFrame_t *frame)
+{
+    if ((uint8_t)(simCanHead - simCanTail) >= SIM_CAN_RX) {
+        simCanOverflow++;
+        return;
+    }
+    simCanRx[simCanHead++ % SIM_CAN_RX] = *frame;
+}
+
+uint8_t can_send(const canFrame_t *frame)
+{
+    canFrame_t t;
+    uint16_t current;
+    uint8_t i;
+
+    if (frame->id != MOTOR_CAN_ID)
+        return 1;
+    for (i = 0; i < frame->len; i++) {
+        pwmWrite(i, 1000 + 4 * frame->data[i]);
+        if ((int32_t)(simTime - simEscReport[i]) < 20000)
+            continue;
+        simEscReport[i] = simTime;
+        current = 8 * frame->data[i];
+        t.id = MOTOR_CAN_ID + 1 + i;
+        t.len = 7;
+        t.data[0] = frame->data[i] * 12;
+        t.data[1] = frame->data[i] * 12 >> 8;
+        t.data[2] = (1260 - current / 16) & 0xFF;
+        t.data[3] = (1260 - current / 16) >> 8;
+        t.data[4] = current;
+        t.data[5] = current >> 8;
+        t.data[6] = 30 + frame->data[i] / 16;
+        simCanReceive(&t);
+    }
+    return 1;
+}
+
+uint8_t can_receive(canFrame_t *frame)
+{
+    if (simCanTail == simCanHead)
+        return 0;
+    *frame = simCanRx[simCanTail++ % SIM_CAN_RX];
+    return 1;
+}
+
+void can_stats(canStats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->rxOverflow = simCanOverflow;
+}
+#endif
+
+#if defined(CAMTRIG)
+static uint32_t simShutterEnd = 0;
+
+void shutter_init(void)
+{
+
+}
+
+// a shot goes to stderr, the trace stays the motors and servos
+uint8_t shutter_fire(uint16_t ms, uint32_t *edge)
+{
+    uint32_t now = micros();
+
+    if ((int32_t)(now - simShutterEnd) < 0)
+        return 0;
+    simShutterEnd = now + ms * 1000UL;
+    *edge = now;
+    fprintf(stderr, "afrowii_sim: shutter at %lu us for %u ms\n", (unsigned long)now, ms);
+    return 1;
+}
+#endif
+
+// ************************************************************************************************************
+// I2C sensor models
+// ************************************************************************************************************
+// Each read encodes the current sample the way the driver in MultiWii_afro.c decodes it, so with the
+// identity SIMSENSORS orientation gyroADC/accADC/magADC come out exactly as logged.
+static void sim_put16be(uint8_t *p, int16_t v)
+{
+    p[0] = (uint16_t)v >> 8;
+    p[1] = v & 0xff;
+}
+
+static void sim_put16le(uint8_t *p, int16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (uint16_t)v >> 8;
+}
+
+static uint8_t sim_deviceRead(uint8_t address, uint8_t subaddr, uint8_t *buf, uint8_t len)
+{
+    uint8_t regs[8];
+    uint8_t i;
+
+    memset(regs, 0, sizeof(regs));
+    switch (address) {
+    case ITG3200_ADDRESS:      // XH XL YH YL ZH ZL at 0x1D
+        if (subaddr != 0x1D)
+            break;
+        sim_advance();
+        sim_put16be(regs + 0, -simNow.gyro[SIM_PITCH] * 4);
+        sim_put16be(regs + 2, simNow.gyro[SIM_ROLL] * 4);
+        sim_put16be(regs + 4, -simNow.gyro[SIM_YAW] * 4);
+        break;
+    case BMA180_ADDRESS:       // 14 bit left aligned, X Y Z little endian at 0x02
+        if (subaddr != 0x02)
+            break;
+        sim_put16le(regs + 0, -simNow.acc[SIM_ROLL] * 32);
+        sim_put16le(regs + 2, -simNow.acc[SIM_PITCH] * 32);
+        sim_put16le(regs + 4, simNow.acc[SIM_YAW] * 32);
+        break;
+    case 0x3C:                 // HMC5883: XH XL ZH ZL YH YL at 0x03
+        if (subaddr != 0x03)
+            break;
+        sim_put16be(regs + 0, -simNow.mag[SIM_PITCH]);
+        sim_put16be(regs + 2, -simNow.mag[SIM_YAW]);
+        sim_put16be(regs + 4, simNow.mag[SIM_ROLL]);
+        break;
+    default:
+        return I2C_SACK_FAILURE;
+    }
+    for (i = 0; i < len; i++)
+        buf[i] = i < sizeof(regs) ? regs[i] : 0;
+    return I2C_SUCCESS;
+}
+
+void i2c_init(void)
+{
+
+}
+
+void i2c_deviceSpeed(uint8_t address, uint32_t hz)
+{
+
+}
+
+uint8_t i2c_write(uint8_t *buf, uint8_t size)
+{
+    // configuration writes are accepted and ignored
+    if (buf[0] != ITG3200_ADDRESS && buf[0] != BMA180_ADDRESS && buf[0] != 0x3C)
+        return I2C_SACK_FAILURE;
+    return I2C_SUCCESS;
+}
+
+uint8_t i2c_read(uint8_t *buf, uint8_t size, uint8_t address, uint8_t subaddr)
+{
+    return sim_deviceRead(address, subaddr, buf, size);
+}
+
+uint8_t i2c_submit(i2cJob_t *job)
+{
+    // the bus is instant here, jobs complete before i2c_submit() returns
+    if (job->read)
+        job->status = sim_deviceRead(job->address, job->subaddr, job->buf, job->len);
+    else
+        job->status = I2C_SUCCESS;
+#if defined(MOTOR_I2C)
+    // an ESC write goes to the motor trace as the pulse its byte stands for
+    if (!job->read && job->address >= MOTOR_I2C_ADDRESS && job->address < MOTOR_I2C_ADDRESS + 16)
+        pwmWrite((job->address - MOTOR_I2C_ADDRESS) / 2, 1000 + 4 * job->buf[0]);
+#endif
+    if (job->done)
+        job->done(job);
+    return 0;
+}
+
+void i2c_poll(void)
+{
+
+}
+
+uint8_t i2c_isIdle(void)
+{
+    return 1;
+}
+
+uint8_t i2c_deviceStats(uint8_t index, i2cDeviceStats_t *stats)
+{
+    return 0;
+}
+
+uint16_t i2c_busRecoveries(void)
+{
+    return 0;
+}
@@ -3,13 +3,32 @@
 #include "config.h"
 #include "def.h"
 #include "sysdep.h"
+#include "ringbuf.h"
+#include "hwreg.h"
 
 static void systick_init(void);
+static void adc_init(void);
+static void bootCheck(void);
+#if defined(SWO_TRACE)
+static void trace_init(void);
+#endif
+
+// worst case entry latency per IRQ_LAT_* source since irq_latencyMax() read it, us
+static volatile uint16_t irqLatency[IRQ_LAT_COUNT];
+
+static void irqLatencyAdd(uint8_t source, uint32_t us)
+{
+    if (us > irqLatency[source])
+        irqLatency[source] = us > 0xFFFF ? 0xFFFF : us;
+}
 
 /* HW init */
 void hw_init(void)
 {
+    bootCheck();
     SystemInit();
+    NVIC_PriorityGroupConfig(NVIC_PriorityGroup_4);     // preemption only, see IRQ_PRIO_* in board.h
+    NVIC_SetPriority(PendSV_IRQn, IRQ_PRIO_DEFERRED);
 
     GPIO_InitTypeDef GPIO_InitStructure;
     RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOA | RCC_APB2Periph_GPIOB | RCC_APB2Periph_GPIOC, ENABLE);
@@ -29,6 +48,7 @@ void hw_init(void)
 
     RCC_APB2PeriphClockCmd(RCC_APB2Periph_USART1, ENABLE);
     RCC_APB1PeriphClockCmd(RCC_APB1Periph_USART3, ENABLE);
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_SPI2 | RCC_APB1Periph_I2C2, ENABLE);
 
     /* Configure all unused GPIO as Analog Input */
     GPIO_InitStructure.GPIO_Pin = GPIO_Pin_All;
@@ -46,62 +66,322 @@ void hw_init(void)
     GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
     GPIO_InitStructure.GPIO_Mode = GPIO_Mode_Out_PP;
     GPIO_Init(GPIOA, &GPIO_InitStructure);
+#if defined(TIMING_PROBES)
+    GPIO_InitStructure.GPIO_Pin = PROBE_PIN_0 | PROBE_PIN_1 | PROBE_PIN_2 | PROBE_PIN_3;
+    GPIO_Init(PROBE_PORT, &GPIO_InitStructure);
+#endif
     
     // systick
     systick_init();
+#if defined(SWO_TRACE)
+    trace_init();
+#endif
 
+    // analog inputs free run from here on
+    adc_init();
+
+#if !defined(SERIAL_USART1)
     usb_cdcacm_enable();
+#endif
 
     LEDPIN_ON;
     LEDPIN_OFF;
 }
 
 /* UART */
+#if defined(SERIAL_USART1)
+#if defined(RCSERIAL)
+#error "SPEKTRUM, SBUS and SERIAL_RC need USART1, keep the GUI on USB"
+#endif
+/* USART1, TX on DMA. TX is double buffered: a frame is built in uartBuffer[uartBack] while the
+   other one drains on DMA1 channel 4, a frame committed while that is still going waits in txPending and
+   is started from the transfer complete interrupt. RX goes through the RXNE interrupt into the shared
+   ring, GUI input is a few bytes at a time */
+#define TX_BUFFER_SIZE 128
+
 static uint8_t uartPointer;
-static uint8_t uartBuffer[256];
-static uint8_t tx_ptr;
-static uint8_t tx_busy = 0;
+static uint8_t uartBuffer[2][TX_BUFFER_SIZE];
+static uint8_t uartBack = 0;
+static uint8_t uartOverflow = 0;
+static uint16_t txDropped = 0;
+static volatile uint8_t txActive = 0;
+static volatile uint8_t txPending = 0;
+static uint8_t txPendingLen;
+static uint8_t rxBuffer[64];
+static ring_t rxRing = RING_INIT(rxBuffer);
 
 void serialize16(int16_t a)
 {
-    uartBuffer[uartPointer++] = a;
-    uartBuffer[uartPointer++] = a >> 8 & 0xff;
+    serialize8(a);
+    serialize8(a >> 8 & 0xff);
 }
 
 void serialize8(uint8_t a)
 {
-    uartBuffer[uartPointer++] = a;
+    if (uartPointer < TX_BUFFER_SIZE)
+        uartBuffer[uartBack][uartPointer++] = a;
+    else
+        uartOverflow = 1;
+}
+
+void *Serial_reserve(uint8_t len)
+{
+    uint8_t *p = &uartBuffer[uartBack][uartPointer];
+
+    if (len > TX_BUFFER_SIZE - uartPointer) {
+        uartOverflow = 1;
+        return 0;
+    }
+    uartPointer += len;
+    return p;
+}
+
+static void uartStartTx(uint8_t *buf, uint8_t len)
+{
+    dma_enable(DMA1_Channel4, 0);
+    DMA1_Channel4->CMAR = (uint32_t)buf;
+    dma_setCount(DMA1_Channel4, len);
+    usart_tcClear(USART1);             // DMA writes to DR don't clear it
+    txActive = 1;
+    dma_enable(DMA1_Channel4, 1);
 }
 
-#define USB_TIMEOUT 50
+void DMA1_Channel4_IRQHandler(void)
+{
+    PROBE_HI(PROBE_ISR_COMM);
+    dma1_clear(DMA1_IT_TC4);
+    if (txPending) {
+        // the back buffer was committed while the previous frame drained, it's the one not being built
+        uartStartTx(uartBuffer[uartBack ^ 1], txPendingLen);
+        txPending = 0;
+    } else {
+        dma_enable(DMA1_Channel4, 0);
+        txActive = 0;
+    }
+    PROBE_LO(PROBE_ISR_COMM);
+}
 
 void Serial_commitBuffer(void)
 {
-    if (!(usbIsConnected() && usbIsConfigured()))
+    if (uartPointer == 0 || uartOverflow) {
+        if (uartOverflow)
+            txDropped++;
+        uartPointer = 0;            // a truncated frame is worse than none
+        uartOverflow = 0;
         return;
+    }
+    __disable_irq();
+    if (!txActive)
+        uartStartTx(uartBuffer[uartBack], uartPointer);
+    else {
+        txPending = 1;
+        txPendingLen = uartPointer;
+    }
+    uartBack ^= 1;
+    __enable_irq();
+    uartPointer = 0;
+}
+
+uint8_t Serial_isTxBusy(void)
+{
+    // busy only when both buffers are spoken for
+    return txPending;
+}
+
+uint8_t Serial_txIdle(void)
+{
+    return !txActive && usart_txDone(USART1);
+}
 
-    uint32_t txed = 0;
-    uint32_t old_txed = 0;
+void Serial_reset(void)
+{
     uint32_t start = millis();
-    uint32_t len = uartPointer;
 
-    while (txed < len && (millis() - start < USB_TIMEOUT)) {
-        txed += usb_cdcacm_tx((const uint8_t*)uartBuffer + txed, len - txed);
-        if (old_txed != txed) {
-            start = millis();
+    // the buffer we're about to fill is still queued, give it a frame time to get onto the wire
+    while (txPending && millis() - start < 20);
+    if (txPending) {
+        // still stuck, drop the queued frame rather than overwrite the one on the wire
+        __disable_irq();
+        if (txPending) {
+            txPending = 0;
+            txDropped++;
+            uartBack ^= 1;
         }
-        old_txed = txed;
+        __enable_irq();
+    }
+    uartPointer = 0;
+    uartOverflow = 0;
+}
+
+void Serial_begin(uint32_t speed)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    USART_InitTypeDef USART_InitStructure;
+    DMA_InitTypeDef DMA_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    // PA9 TX, PA10 RX
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_9;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF_PP;
+    GPIO_Init(GPIOA, &GPIO_InitStructure);
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_10;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_IN_FLOATING;
+    GPIO_Init(GPIOA, &GPIO_InitStructure);
+
+    USART_InitStructure.USART_BaudRate = speed;
+    USART_InitStructure.USART_WordLength = USART_WordLength_8b;
+    USART_InitStructure.USART_StopBits = USART_StopBits_1;
+    USART_InitStructure.USART_Parity = USART_Parity_No;
+    USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
+    USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
+    USART_Init(USART1, &USART_InitStructure);
+
+    // TX: normal mode, address and length are set per frame
+    DMA_DeInit(DMA1_Channel4);
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&USART1->DR;
+    DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)uartBuffer[0];
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+    DMA_InitStructure.DMA_BufferSize = 1;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
+    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(DMA1_Channel4, &DMA_InitStructure);
+    DMA_ITConfig(DMA1_Channel4, DMA_IT_TC, ENABLE);
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel4_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_DMA;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+    NVIC_InitStructure.NVIC_IRQChannel = USART1_IRQn;
+    NVIC_Init(&NVIC_InitStructure);
+
+    USART_DMACmd(USART1, USART_DMAReq_Tx, ENABLE);
+    USART_ITConfig(USART1, USART_IT_RXNE, ENABLE);
+    USART_Cmd(USART1, ENABLE);
+}
+
+void USART1_IRQHandler(void)
+{
+    PROBE_HI(PROBE_ISR_COMM);
+    // reading DR clears RXNE (and ORE)
+    ring_put(&rxRing, usart_get(USART1));
+    PROBE_LO(PROBE_ISR_COMM);
+}
+
+uint16_t Serial_available(void)
+{
+    return ring_count(&rxRing);
+}
+
+uint8_t Serial_read(void)
+{
+    if (ring_count(&rxRing) == 0)
+        return -1;
+    return ring_get(&rxRing);
+}
+
+uint8_t Serial_peek(const uint8_t **data)
+{
+    return ring_peek(&rxRing, data);
+}
+
+void Serial_consume(uint8_t n)
+{
+    ring_skip(&rxRing, n);
+}
+
+uint16_t Serial_rxOverflow(void)
+{
+    return rxRing.overflow;
+}
+
+uint16_t Serial_txDropped(void)
+{
+    return txDropped;
+}
+#else
+/* USB CDC. serialize8() writes the frame straight into one of the CDC driver's two packet memory
+   buffers, nothing is copied on the way to the IN endpoint. Serial_isTxBusy() is set while both are
+   queued, a frame started then is dropped whole. Nothing here waits for the host: without one, or
+   with one that stopped reading, frames are dropped and counted. The packet memory only takes 16 bit
+   writes, so a Serial_reserve() block is filled in usbStage and packed into the frame with the next byte
+   or the commit */
+static uint8_t uartOverflow;
+static uint16_t txDropped = 0;
+static uint8_t usbStage[128];
+static uint8_t usbStageLen;
+
+static void usbStageFlush(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < usbStageLen; i++)
+        if (!usb_cdcacm_frame_put(usbStage[i]))
+            uartOverflow = 1;
+    usbStageLen = 0;
+}
+
+void serialize16(int16_t a)
+{
+    serialize8(a);
+    serialize8(a >> 8 & 0xff);
+}
+
+void serialize8(uint8_t a)
+{
+    if (usbStageLen)
+        usbStageFlush();
+    if (!usb_cdcacm_frame_put(a))
+        uartOverflow = 1;
+}
+
+void *Serial_reserve(uint8_t len)
+{
+    if (usbStageLen)
+        usbStageFlush();
+    if (len > sizeof(usbStage)) {
+        uartOverflow = 1;
+        return 0;
+    }
+    usbStageLen = len;
+    return usbStage;
+}
+
+void Serial_commitBuffer(void)
+{
+    if (usbStageLen)
+        usbStageFlush();
+    if (!(usbIsConnected() && usbIsConfigured()) || uartOverflow) {
+        txDropped++;
+        usb_cdcacm_frame_reset();       // a truncated frame is worse than none
+        uartOverflow = 0;
+        return;
     }
+    usb_cdcacm_frame_commit();
 }
 
 uint8_t Serial_isTxBusy(void)
 {
-    return tx_busy;
+    if (!(usbIsConnected() && usbIsConfigured()))
+        return 0;
+    return usb_cdcacm_tx_busy();
+}
+
+uint8_t Serial_txIdle(void)
+{
+    return 1;                           // no line rate to change
 }
 
 void Serial_reset(void)
 {
-    uartPointer = 0;
+    usbStageLen = 0;
+    uartOverflow = !usb_cdcacm_frame_reset();
 }
 
 void Serial_begin(uint32_t speed)
@@ -127,31 +407,236 @@ uint8_t Serial_read(void)
     return buf[0];
 }
 
-uint32_t runMillis = 0;
+uint8_t Serial_peek(const uint8_t **data)
+{
+    if (!(usbIsConnected() && usbIsConfigured()))
+        return 0;
+    return usb_cdcacm_rx_peek(data);
+}
+
+void Serial_consume(uint8_t n)
+{
+    usb_cdcacm_rx_release(n);
+}
+
+uint16_t Serial_rxOverflow(void)
+{
+    return 0;               // the CDC ring NAKs the host instead of dropping
+}
+
+uint16_t Serial_txDropped(void)
+{
+    return txDropped;
+}
+
+/* the log interface of the composite device, see usb_cdcacm_log_write() */
+uint16_t Telemetry_free(void)
+{
+    return usb_cdcacm_log_free();
+}
+
+uint8_t Telemetry_write(const uint8_t *buf, uint8_t len)
+{
+    if (!(usbIsConnected() && usbIsConfigured()))
+        return 1;           // nobody to send it to, gone like a frame to an absent host
+    return usb_cdcacm_log_write(buf, len);
+}
+
+/* USB top half. The handler proper runs the control transfers and copies packet memory, tens of us at a time,
+   so the interrupt only masks its line and pends PendSV, which preempts nothing. The line is unmasked once the
+   bottom half has run, a flag it left set brings the top half straight back */
+static uint32_t usbPendCycles;
+
+void USB_LP_CAN1_RX0_IRQHandler(void)
+{
+    NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+    usbPendCycles = cycles();
+    SCB->ICSR = SCB_ICSR_PENDSVSET;
+}
+
+void PendSV_Handler(void)
+{
+    irqLatencyAdd(IRQ_LAT_DEFERRED, (cycles() - usbPendCycles) / CYCLES_PER_US);
+    __irq_usb_lp_can_rx0();
+    NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+}
+
+/* USART1 is free while the GUI is on USB: RX only on PA10 for a serial receiver */
+static rcSerialCallback_t rcSerialRx;
+
+void rcSerial_init(uint32_t speed, uint8_t format, rcSerialCallback_t rx)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    USART_InitTypeDef USART_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    rcSerialRx = rx;
+
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_10;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_IN_FLOATING;
+    GPIO_Init(GPIOA, &GPIO_InitStructure);
+
+    USART_InitStructure.USART_BaudRate = speed;
+    if (format == RCSERIAL_8E2) {
+        // the word length counts the parity bit
+        USART_InitStructure.USART_WordLength = USART_WordLength_9b;
+        USART_InitStructure.USART_StopBits = USART_StopBits_2;
+        USART_InitStructure.USART_Parity = USART_Parity_Even;
+    } else {
+        USART_InitStructure.USART_WordLength = USART_WordLength_8b;
+        USART_InitStructure.USART_StopBits = USART_StopBits_1;
+        USART_InitStructure.USART_Parity = USART_Parity_No;
+    }
+    USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
+    USART_InitStructure.USART_Mode = USART_Mode_Rx;
+    USART_Init(USART1, &USART_InitStructure);
+
+    NVIC_InitStructure.NVIC_IRQChannel = USART1_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_CAPTURE;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    USART_ITConfig(USART1, USART_IT_RXNE, ENABLE);
+    USART_Cmd(USART1, ENABLE);
+}
+
+void USART1_IRQHandler(void)
+{
+    // reading SR then DR clears RXNE and the error flags
+    uint16_t sr = USART1->SR;
+    uint8_t c = usart_get(USART1);
+
+    PROBE_HI(PROBE_ISR_COMM);
+    if (rcSerialRx && !(sr & (USART_FLAG_PE | USART_FLAG_FE)))
+        rcSerialRx(c);
+    PROBE_LO(PROBE_ISR_COMM);
+}
+
+#if defined(GPS_PORT)
+/* the GPS takes the same RX pin, gpsTask() drains the ring */
+static uint8_t gpsBuffer[128];
+static ring_t gpsRing = RING_INIT(gpsBuffer);
+
+static void gpsReceive(uint8_t c)
+{
+    ring_put(&gpsRing, c);
+}
+
+void gpsSerial_init(uint32_t speed)
+{
+    rcSerial_init(speed, RCSERIAL_8N1, gpsReceive);
+}
+
+uint8_t gpsSerial_available(void)
+{
+    return ring_count(&gpsRing);
+}
+
+uint8_t gpsSerial_read(void)
+{
+    return ring_get(&gpsRing);
+}
+
+uint16_t gpsSerial_rxOverflow(void)
+{
+    return gpsRing.overflow;
+}
+#endif
+#endif
+
+
+volatile uint32_t runMillis = 0;
 
 /* TIMING */
-#define CYCLES_PER_MICROSECOND  72
+/* The timebase is the DWT cycle counter, CYCCNT, which counts core clocks from when systick_init() starts it.
+   SysTick interrupts every SYSTICK_RELOAD_VAL + 1 cycles of the same clock, so the handler keeps the counter
+   value of the last millisecond edge by adding, without reading anything, and micros() is the milliseconds
+   plus the cycles since that edge. That stays monotonic when the tick is held off by a masked section: the
+   cycles since the edge just run past a millisecond */
 #define SYSTICK_RELOAD_VAL      71999 /* takes a cycle to reload */
 #define US_PER_MS               1000
-#define STM32_DELAY_US_MULT     12
+// 2^32 / CYCLES_PER_US rounded up, so (cycles * US_PER_CYCLE_Q32) >> 32 is the exact quotient below 2^32 / CYCLES_PER_US
+#define US_PER_CYCLE_Q32        ((uint32_t)((0x100000000ULL + CYCLES_PER_US - 1) / CYCLES_PER_US))
 
 #define SYSTICK_CSR_ENABLE              BIT(0)
 #define SYSTICK_CSR_CLKSOURCE_CORE      BIT(2)
 #define SYSTICK_CSR_TICKINT_PEND        BIT(1)
 
+#define DEMCR                   (*(volatile uint32_t *)0xE000EDFC)
+#define DEMCR_TRCENA            BIT(24)
+#define DWT_CTRL                (*(volatile uint32_t *)0xE0001000)
+#define DWT_CTRL_CYCCNTENA      BIT(0)
+#define DWT_CYCCNT              (*(volatile uint32_t *)0xE0001004)
+#define SYST_CVR                (*(volatile uint32_t *)0xE000E018)
+
+static volatile uint32_t tickCycles;    // CYCCNT at the last millisecond edge
+
 static void systick_init(void)
 {
     volatile unsigned int *SYSTICK_CSR = (int *)0xE000E010;
     volatile unsigned int *SYSTICK_RVR = (int *)0xE000E014;
-    
-    *SYSTICK_CSR = (SYSTICK_CSR_CLKSOURCE_CORE | SYSTICK_CSR_ENABLE | SYSTICK_CSR_TICKINT_PEND);
+    volatile unsigned int *SYSTICK_CVR = (int *)0xE000E018;
+
+    // the DWT is part of the debug unit, it only counts with trace enabled
+    DEMCR |= DEMCR_TRCENA;
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+
     *SYSTICK_RVR = SYSTICK_RELOAD_VAL;
-    NVIC_SetPriority(SysTick_IRQn, 2);	    // lower priority
+    *SYSTICK_CVR = 0;
+    tickCycles = DWT_CYCCNT;
+    *SYSTICK_CSR = (SYSTICK_CSR_CLKSOURCE_CORE | SYSTICK_CSR_ENABLE | SYSTICK_CSR_TICKINT_PEND);
+    NVIC_SetPriority(SysTick_IRQn, IRQ_PRIO_TICK);
+}
+
+#if defined(LOOP_ISR)
+/* Inner loop interrupt. EXTI1 has no pin behind it (its mask bit stays clear), the NVIC line is only ever pended
+   by software: every loopIsrPeriod ticks from the SysTick, or loopIsr_pend() of the gyro frames */
+static loopTickCallback_t loopIsrTick;
+static uint8_t loopIsrPeriod, loopIsrCount;
+static uint32_t loopPendCycles;
+
+void loopIsr_init(uint8_t periodMs, loopTickCallback_t tick)
+{
+    loopIsrTick = tick;
+    loopIsrPeriod = periodMs;
+    NVIC_SetPriority(EXTI1_IRQn, IRQ_PRIO_LOOP);
+    NVIC_EnableIRQ(EXTI1_IRQn);
+}
+
+void loopIsr_pend(void)
+{
+    loopPendCycles = cycles();
+    NVIC_SetPendingIRQ(EXTI1_IRQn);
+}
+
+void loopIsr_idle(void)
+{
+    __WFI();
+}
+
+void EXTI1_IRQHandler(void)
+{
+    irqLatencyAdd(IRQ_LAT_LOOP, (cycles() - loopPendCycles) / CYCLES_PER_US);
+    loopIsrTick();
 }
+#endif
 
 void SysTick_Handler(void)
 {
+    PROBE_HI(PROBE_ISR_COMM);
+    // the counter reloaded at the wrap and has been counting down since
+    irqLatencyAdd(IRQ_LAT_TICK, (SYSTICK_RELOAD_VAL - SYST_CVR) / CYCLES_PER_US);
+    tickCycles += SYSTICK_RELOAD_VAL + 1;
     runMillis++;
+#if defined(LOOP_ISR)
+    if (loopIsrPeriod && ++loopIsrCount >= loopIsrPeriod) {
+        loopIsrCount = 0;
+        loopIsr_pend();
+    }
+#endif
+    PROBE_LO(PROBE_ISR_COMM);
 }
 
 uint32_t millis(void)
@@ -159,35 +644,66 @@ uint32_t millis(void)
     return runMillis;
 }
 
+uint32_t cycles(void)
+{
+    return DWT_CYCCNT;
+}
+
 uint32_t micros(void)
 {
-    volatile unsigned int *SYSTICK_CNT = (int *)0xE000E018;
-    uint32_t cycle_cnt;
     uint32_t ms;
-    uint32_t res;
+    uint32_t since;
 
+    // the handler writes tickCycles before runMillis, a tick in between shows up as a changed runMillis
     do {
-        ms = millis();
-        cycle_cnt = *SYSTICK_CNT;
-    } while (ms != millis());
+        ms = runMillis;
+        since = DWT_CYCCNT - tickCycles;
+    } while (ms != runMillis);
+
+    return ms * US_PER_MS + (uint32_t)(((uint64_t)since * US_PER_CYCLE_Q32) >> 32);
+}
+
+uint32_t microsISR(void)
+{
+    // micros() doesn't mask interrupts on Cortex-M, so it's safe to use from a handler
+    return micros();
+}
+
+#if defined(SWO_TRACE)
+#include "swotrace.h"
+
+// PB3 is TRACESWO once the JTAG pins are released, SWD stays on PA13/PA14
+static void trace_init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_3;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF_PP;
+    GPIO_Init(GPIOB, &GPIO_InitStructure);
+    DBGMCU->CR = (DBGMCU->CR & ~(BIT(6) | BIT(7))) | BIT(5);   // TRACE_IOEN, TRACE_MODE asynchronous
+    swoStart(SystemCoreClock);
+}
+#endif
 
-    res = (ms * US_PER_MS) + (SYSTICK_RELOAD_VAL + 1 - cycle_cnt) / CYCLES_PER_MICROSECOND;
+uint16_t irq_latencyMax(uint8_t source)
+{
+    uint16_t us;
 
-    return res;
+    // two instructions masked, so a worst case landing between the read and the clear isn't lost
+    __disable_irq();
+    us = irqLatency[source];
+    irqLatency[source] = 0;
+    __enable_irq();
+    return us;
 }
 
-static inline void delay_us(uint32_t us)
+// the cycle counter runs on regardless of flash wait states and interrupts, spin on it
+static void delay_us(uint32_t us)
 {
-    us *= STM32_DELAY_US_MULT;
+    uint32_t start = cycles();
 
-    /* fudge for function call overhead  */
-    us--;
-    __asm volatile("   mov r0, %[us]          \n\t"
-        "1: subs r0, #1            \n\t"
-        "   bhi 1b                 \n\t"
-        :
-    : [us] "r" (us)
-        : "r0");
+    while (cycles() - start < us * CYCLES_PER_US);
 }
 
 void delay(uint16_t ms)
@@ -197,9 +713,105 @@ void delay(uint16_t ms)
         delay_us(1000);
 }
 
+/* ADC: ADC1 and ADC2 in regular simultaneous mode, scanning continuously into a ring of ADC_SCANS scans over
+   DMA1 channel 1. Each word holds an ADC1 result in the low half and the matching ADC2 one in the high half.
+   The scan rate is fixed by the ADC clock, a pair every 7us, 14us a scan, and nothing but the DMA touches a
+   sample: analogRead() sums the ring when it is called, so every read is the mean of the last ADC_SCANS scans
+   (896us). 64 samples of the gyros' own noise carry 14 bits, analogReadOversampled() keeps them.
+   Channel n of analogRead() is adcChannel[n]; even ones are converted by ADC1, odd ones by ADC2 */
+static const uint8_t adcChannel[] = {
+    ADC_Channel_3,      // PA3 gyro X
+    ADC_Channel_4,      // PA4 gyro Y
+    ADC_Channel_5,      // PA5 gyro Z
+    ADC_Channel_7,      // PA7 battery divider (V_BATPIN)
+};
+#define ADC_CHANNELS (sizeof(adcChannel) / sizeof(adcChannel[0]))
+#define ADC_SCANS    64         // a power of 2, 12 bit samples: the sum is 18 bit
+
+static volatile uint32_t adcSamples[ADC_SCANS][ADC_CHANNELS / 2];
+
+static void adc_init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    DMA_InitTypeDef DMA_InitStructure;
+    ADC_InitTypeDef ADC_InitStructure;
+    uint8_t i;
+
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_3 | GPIO_Pin_4 | GPIO_Pin_5 | GPIO_Pin_7;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AIN;
+    GPIO_Init(GPIOA, &GPIO_InitStructure);
+
+    DMA_DeInit(DMA1_Channel1);
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&ADC1->DR;
+    DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)adcSamples;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
+    DMA_InitStructure.DMA_BufferSize = ADC_SCANS * ADC_CHANNELS / 2;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(DMA1_Channel1, &DMA_InitStructure);
+    DMA_Cmd(DMA1_Channel1, ENABLE);
+
+    ADC_InitStructure.ADC_Mode = ADC_Mode_RegSimult;
+    ADC_InitStructure.ADC_ScanConvMode = ENABLE;
+    ADC_InitStructure.ADC_ContinuousConvMode = ENABLE;
+    ADC_InitStructure.ADC_ExternalTrigConv = ADC_ExternalTrigConv_None;
+    ADC_InitStructure.ADC_DataAlign = ADC_DataAlign_Right;
+    ADC_InitStructure.ADC_NbrOfChannel = ADC_CHANNELS / 2;
+    ADC_Init(ADC1, &ADC_InitStructure);
+    ADC_Init(ADC2, &ADC_InitStructure);
+
+    // 12MHz ADC clock, 71.5 + 12.5 cycles is 7us per pair. All timers drive outputs or capture inputs, so the
+    // ADC clock paces the scans instead of a trigger; it is as steady and costs no interrupt either
+    for (i = 0; i < ADC_CHANNELS; i++)
+        ADC_RegularChannelConfig((i & 1) ? ADC2 : ADC1, adcChannel[i], (i >> 1) + 1, ADC_SampleTime_71Cycles5);
+    ADC_DMACmd(ADC1, ENABLE);
+    ADC_ExternalTrigConvCmd(ADC2, ENABLE);      // ADC2 follows ADC1 in dual mode
+
+    ADC_Cmd(ADC1, ENABLE);
+    ADC_ResetCalibration(ADC1);
+    while (ADC_GetResetCalibrationStatus(ADC1));
+    ADC_StartCalibration(ADC1);
+    while (ADC_GetCalibrationStatus(ADC1));
+    ADC_Cmd(ADC2, ENABLE);
+    ADC_ResetCalibration(ADC2);
+    while (ADC_GetResetCalibrationStatus(ADC2));
+    ADC_StartCalibration(ADC2);
+    while (ADC_GetCalibrationStatus(ADC2));
+
+    ADC_SoftwareStartConvCmd(ADC1, ENABLE);
+}
+
+// sum of the channel over the ring. The DMA may replace a sample while this runs, the window then just ends a
+// scan later, every word is written in one go
+static uint32_t adcSum(uint8_t channel)
+{
+    volatile const uint32_t *s = &adcSamples[0][channel >> 1];
+    uint8_t shift = (channel & 1) ? 16 : 0;
+    uint32_t sum = 0;
+    uint8_t i;
+
+    for (i = 0; i < ADC_SCANS; i++, s += ADC_CHANNELS / 2)
+        sum += (*s >> shift) & 0xFFF;
+    return sum;
+}
+
 uint16_t analogRead(uint8_t channel)
 {
-    return 0;
+    if (channel >= ADC_CHANNELS)
+        return 0;
+    return adcSum(channel) / ADC_SCANS;
+}
+
+uint16_t analogReadOversampled(uint8_t channel)
+{
+    if (channel >= ADC_CHANNELS)
+        return 0;
+    return adcSum(channel) / (ADC_SCANS / 4);
 }
 
 void analogWrite(uint8_t pin, uint16_t value)
@@ -212,75 +824,1353 @@ void pinMode(uint8_t pin, uint8_t mode)
 
 }
 
+/* EEPROM in the last two 1K flash pages. Writes program halfwords straight into erased flash, the parameter
+   log above only ever appends and calls eeprom_erase() when it runs out of room */
+#define EEPROM_PAGE     ((uint32_t)0x0801F800)     // second to last page of the 128K STM32F103CB
+#define EEPROM_SIZE     2048
+
 void eeprom_open(void)
 {
-
+    FLASH_Unlock();
+    FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_PGERR | FLASH_FLAG_WRPRTERR);
 }
 
 void eeprom_read_block (void *dst, const void *src, size_t n)
 {
-
+    memcpy(dst, (const uint8_t *)EEPROM_PAGE + (uint32_t)src, n);
 }
 
 void eeprom_write_block(const void *src, void *dst, size_t n)
 {
+    const uint8_t *data = (const uint8_t *)src;
+    uint32_t address = EEPROM_PAGE + (uint32_t)dst;
+    uint16_t half;
+    size_t i;
 
+    if ((uint32_t)dst + n > EEPROM_SIZE)
+        return;
+    for (i = 0; i < n; i += 2) {
+        half = data[i] | (i + 1 < n ? data[i + 1] << 8 : 0xFF00);      // an odd tail stays erased
+        if (FLASH_ProgramHalfWord(address + i, half) != FLASH_COMPLETE)
+            break;
+    }
 }
 
 void eeprom_close(void)
 {
+    FLASH_Lock();
+}
+
+#if defined(PARAM_IN_PLACE)
+const void *eeprom_map(const void *src, size_t n)
+{
+    return (const uint8_t *)EEPROM_PAGE + (uint32_t)src;
+}
+#endif
+
+uint16_t eeprom_size(void)
+{
+    return EEPROM_SIZE;
+}
+
+void eeprom_erase(void)
+{
+    uint32_t page;
 
+    for (page = EEPROM_PAGE; page < EEPROM_PAGE + EEPROM_SIZE; page += 1024)
+        FLASH_ErasePage(page);
 }
 
 // ************************************************************************************************************
 // SPI general functions
 // ************************************************************************************************************
+/* SPI2 on PB13 (SCK), PB14 (MISO), PB15 (MOSI), the bus manager works like the STM8 one: chip select,
+   clock and mode per device, bursts one byte per RXNE interrupt since the DMA channels that serve SPI2
+   are shared with USART1 */
 void spi_init(void)
 {
+    GPIO_InitTypeDef GPIO_InitStructure;
+    SPI_InitTypeDef SPI_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_13 | GPIO_Pin_15;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF_PP;
+    GPIO_Init(GPIOB, &GPIO_InitStructure);
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_14;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_IN_FLOATING;
+    GPIO_Init(GPIOB, &GPIO_InitStructure);
 
+    SPI_I2S_DeInit(SPI2);
+    SPI_InitStructure.SPI_Direction = SPI_Direction_2Lines_FullDuplex;
+    SPI_InitStructure.SPI_Mode = SPI_Mode_Master;
+    SPI_InitStructure.SPI_DataSize = SPI_DataSize_8b;
+    SPI_InitStructure.SPI_CPOL = SPI_CPOL_High;
+    SPI_InitStructure.SPI_CPHA = SPI_CPHA_2Edge;
+    SPI_InitStructure.SPI_NSS = SPI_NSS_Soft;
+    SPI_InitStructure.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_256;   // spi_setup() sets it per device
+    SPI_InitStructure.SPI_FirstBit = SPI_FirstBit_MSB;
+    SPI_InitStructure.SPI_CRCPolynomial = 7;
+    SPI_Init(SPI2, &SPI_InitStructure);
+    SPI_Cmd(SPI2, ENABLE);
+
+    NVIC_InitStructure.NVIC_IRQChannel = SPI2_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_BUS;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
 }
 
-uint8_t spi_writeByte(uint8_t Data)
+#define SPI_CLOCK       36000000L       // APB1, the prescaler divides 2..256
+#define SPI_QUEUE_SIZE  4               // must be a power of 2
+
+static struct {
+    spiJob_t *queue[SPI_QUEUE_SIZE];
+    volatile uint8_t head;              // next free slot, written by spi_submit()
+    volatile uint8_t tail;              // job on the bus, advanced by the interrupt
+    spiJob_t * volatile job;            // current job, NULL when idle
+    uint8_t locked;                     // spi_command() has the bus, queued jobs wait
+    uint8_t ptr;
+    uint8_t skip;                       // the byte clocked in while the command goes out is garbage
+} spiBus;
+
+static uint8_t spi_prescaler(uint32_t hz)
 {
-    return 0;
+    uint8_t br = 0;
+
+    while (br < 7 && (SPI_CLOCK >> (br + 1)) > hz)
+        br++;
+    return br;
 }
 
-uint8_t spi_readByte(void)
+void spi_device(spiDevice_t *dev)
 {
-    return 0;
+    dev->prescaler[0] = spi_prescaler(dev->slowHz);
+    dev->prescaler[1] = spi_prescaler(dev->fastHz);
+    dev->select(0);
 }
 
-// PWM Functions
-void pwmInit(uint8_t useServo)
+// Only with the bus idle and chip select released, the clock line may change level
+static void spi_setup(spiDevice_t *dev, uint8_t fast)
 {
-    
+    SPI2->CR1 = (SPI2->CR1 & ~(SPI_CR1_BR | SPI_CR1_CPOL | SPI_CR1_CPHA)) | (dev->prescaler[fast] << 3) | (dev->mode & 0x03);
 }
 
-void pwmWrite(uint8_t channel, uint16_t value)
+static uint8_t spi_byte(uint8_t data)
 {
-    
-    
+    while (!(SPI2->SR & SPI_I2S_FLAG_TXE));
+    SPI2->DR = data;
+    while (!(SPI2->SR & SPI_I2S_FLAG_RXNE));
+    return SPI2->DR;
 }
 
-// ************************************************************************************************************
-// I2C general functions
-// ************************************************************************************************************
-void i2c_init(void)
+// Only called from the SPI interrupt, or with interrupts masked
+static void spi_startNext(void)
 {
+    spiJob_t *job;
 
+    if (spiBus.job || spiBus.locked || spiBus.tail == spiBus.head)
+        return;
+    job = spiBus.job = spiBus.queue[spiBus.tail];
+    spiBus.ptr = 0;
+    spiBus.skip = 1;
+    spi_setup(job->dev, 1);
+    job->dev->select(1);
+    (void)SPI2->DR;                     // drop anything left over from spi_command()
+    SPI2->CR2 |= SPI_CR2_RXNEIE;
+    SPI2->DR = job->cmd;
 }
 
-uint8_t i2c_write(uint8_t *buf, uint8_t size)
+uint8_t spi_command(spiDevice_t *dev, uint8_t cmd, uint8_t data)
 {
-    return 0;
+#if defined(LOOP_ISR)
+    uint32_t basepri = __get_BASEPRI();
+
+    // the inner loop interrupt would spin on its burst behind the lock forever, hold it off for the two bytes
+    __set_BASEPRI(IRQ_PRIO_LOOP << (8 - __NVIC_PRIO_BITS));
+#endif
+    __disable_irq();
+    spiBus.locked = 1;
+    __enable_irq();
+    while (spiBus.job);                 // a burst already on the bus finishes first
+
+    spi_setup(dev, 0);
+    dev->select(1);
+    spi_byte(cmd);
+    data = spi_byte(data);
+    dev->select(0);
+
+    __disable_irq();
+    spiBus.locked = 0;
+    spi_startNext();
+    __enable_irq();
+#if defined(LOOP_ISR)
+    __set_BASEPRI(basepri);
+#endif
+    return data;
 }
 
-uint8_t i2c_read(uint8_t *buf, uint8_t size, uint8_t address, uint8_t subaddr)
+uint8_t spi_submit(spiJob_t *job)
 {
-    return 0;
+    uint8_t next;
+
+    if (job->len == 0)
+        return 0;
+    __disable_irq();
+    next = (spiBus.head + 1) & (SPI_QUEUE_SIZE - 1);
+    if (job->busy || next == spiBus.tail) {
+        __enable_irq();
+        return 0;
+    }
+    job->busy = 1;
+    spiBus.queue[spiBus.head] = job;
+    spiBus.head = next;
+    spi_startNext();
+    __enable_irq();
+    return 1;
+}
+
+void spi_read(spiDevice_t *dev, uint8_t cmd, uint8_t *buf, uint8_t len)
+{
+    spiJob_t job;
+
+    job.dev = dev;
+    job.cmd = cmd;
+    job.buf = buf;
+    job.len = len;
+    job.done = NULL;
+    job.busy = 0;
+    while (!spi_submit(&job));
+    while (job.busy);
+}
+
+uint8_t spi_isBusy(void)
+{
+    return spiBus.job != NULL || spiBus.tail != spiBus.head;
+}
+
+void SPI2_IRQHandler(void)
+{
+    spiJob_t *job = spiBus.job;
+    uint8_t data = SPI2->DR;            // reading DR clears RXNE
+
+    PROBE_HI(PROBE_ISR);
+    if (spiBus.skip)
+        spiBus.skip = 0;
+    else
+        job->buf[spiBus.ptr++] = data;
+
+    if (spiBus.ptr < job->len) {
+        SPI2->DR = 0xFF;                // dummy byte clocks in the next register
+    } else {
+        SPI2->CR2 &= ~SPI_CR2_RXNEIE;
+        job->dev->select(0);
+        spiBus.job = NULL;
+        spiBus.tail = (spiBus.tail + 1) & (SPI_QUEUE_SIZE - 1);
+        job->busy = 0;
+        if (job->done)
+            job->done(job);
+        spi_startNext();
+    }
+    PROBE_LO(PROBE_ISR);
+}
+
+// PWM Functions
+/* CopterControl servo header, in motor order. All timers count at 1MHz so pwmWrite() takes microseconds
+   as they are. Outputs 5 and 6 are the servo pair when useServo is set and then run at the servo rate */
+static const struct {
+    TIM_TypeDef *tim;
+    uint8_t channel;
+    GPIO_TypeDef *gpio;
+    uint16_t pin;
+} pwmOutput[] = {
+    { TIM4, 4, GPIOB, GPIO_Pin_9 },
+    { TIM4, 3, GPIOB, GPIO_Pin_8 },
+    { TIM4, 2, GPIOB, GPIO_Pin_7 },
+    { TIM1, 1, GPIOA, GPIO_Pin_8 },
+    { TIM3, 1, GPIOB, GPIO_Pin_4 },     // TIM3 partial remap
+#if !defined(CAMTRIG)
+    { TIM2, 3, GPIOA, GPIO_Pin_2 },     // with CAMTRIG the shutter line, see shutter_init()
+#endif
+};
+#define PWM_OUTPUTS (sizeof(pwmOutput) / sizeof(pwmOutput[0]))
+
+static volatile uint16_t *pwmCCR[PWM_OUTPUTS];
+
+// 1ms pulse width
+#define PULSE_1MS       (1000)
+// pulse period (400Hz)
+#define PULSE_PERIOD    (2500)
+// pulse period for digital servo (200Hz)
+#define PULSE_PERIOD_SERVO_DIGITAL  (5000)
+// pulse period for analog servo (50Hz)
+#define PULSE_PERIOD_SERVO_ANALOG  (20000)
+
+#if defined(MOTOR_ONESHOT)
+/* One pulse mode on the motor timers: pwmSync() starts them, they count to ONESHOT_PERIOD once and stop. The
+   output is high from CCR to the end, so pulses are end aligned and the line is low while stopped. Ticks are
+   1us / ONESHOT_SCALE, pwmWrite() still takes the 1000-2000 range */
+#define ONESHOT_PERIOD  (2200)          // longest pulse plus the lead in, in ticks
+
+static TIM_TypeDef *const pwmMotorTimer[] = { TIM4, TIM1, TIM3,
+#if !defined(CAMTRIG)
+    TIM2,
+#endif
+};
+#define PWM_MOTOR_TIMERS (sizeof(pwmMotorTimer) / sizeof(pwmMotorTimer[0]))
+#endif
+
+#if defined(MOTOR_DSHOT)
+/* DShot on the motor outputs. A frame is 16 bit slots of one timer period each, MSB first: 11 bits of throttle
+   (48-2047, 0 stops the motor), the telemetry request and a 4 bit checksum. A 1 is high for 3/4 of the slot, a 0
+   for 3/8. The motor timers count the 72MHz clock with the slot as their period, and each update event has the
+   DMA burst the next slot's compare values through DMAR into the CCRs, so the CPU only encodes the frame and
+   restarts the channel. A trailing slot of 0 keeps the lines low until the next frame.
+   TIM4 carries outputs 0-2 on CCR4-2, TIM1 output 3, TIM3 and TIM2 outputs 4 and 5 unless they drive servos.
+   Their update requests are DMA1 channels 7, 5, 3 and 2: channel 1 is the ADC, 4 the USART1 TX */
+#define DSHOT_SLOT      (72000 / MOTOR_DSHOT)   // timer ticks per bit
+#define DSHOT_ONE       (DSHOT_SLOT * 3 / 4)
+#define DSHOT_ZERO      (DSHOT_SLOT * 3 / 8)
+#define DSHOT_BITS      16
+#define DSHOT_SLOTS     (DSHOT_BITS + 1)
+
+static const struct {
+    TIM_TypeDef *tim;
+    DMA_Channel_TypeDef *dma;
+    uint8_t first;              // lowest channel of the burst
+    uint8_t regs;               // CCRs in it
+} dshotTimer[] = {
+    { TIM4, DMA1_Channel7, 2, 3 },
+    { TIM1, DMA1_Channel5, 1, 1 },
+    { TIM3, DMA1_Channel3, 1, 1 },
+#if !defined(CAMTRIG)
+    { TIM2, DMA1_Channel2, 3, 1 },
+#endif
+};
+#define DSHOT_TIMERS    (sizeof(dshotTimer) / sizeof(dshotTimer[0]))
+
+// per timer, slot after slot, the compare values of its burst in channel order
+static uint16_t dshotBuffer[DSHOT_TIMERS][DSHOT_SLOTS * 3];
+static uint8_t dshotTim[PWM_OUTPUTS], dshotReg[PWM_OUTPUTS];
+static uint8_t dshotOutputs;            // outputs 0..dshotOutputs-1 are DShot, the rest servos
+
+static void dshotInit(uint8_t useServo)
+{
+    DMA_InitTypeDef DMA_InitStructure;
+    uint8_t i, t;
+
+    dshotOutputs = useServo ? 4 : PWM_OUTPUTS;
+    for (i = 0; i < dshotOutputs; i++) {
+        for (t = 0; dshotTimer[t].tim != pwmOutput[i].tim; t++)
+            ;
+        dshotTim[i] = t;
+        dshotReg[i] = pwmOutput[i].channel - dshotTimer[t].first;
+    }
+
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+    for (t = 0; t < DSHOT_TIMERS; t++) {
+        TIM_TypeDef *tim = dshotTimer[t].tim;
+
+        if (t >= 2 && useServo)
+            break;
+        DMA_DeInit(dshotTimer[t].dma);
+        DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&tim->DMAR;
+        DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)dshotBuffer[t];
+        DMA_InitStructure.DMA_BufferSize = DSHOT_SLOTS * dshotTimer[t].regs;
+        DMA_Init(dshotTimer[t].dma, &DMA_InitStructure);
+        TIM_DMAConfig(tim, TIM_DMABase_CCR1 + dshotTimer[t].first - 1, (dshotTimer[t].regs - 1) << 8);
+        TIM_DMACmd(tim, TIM_DMA_Update, ENABLE);
+    }
+}
+
+// the 1000-2000 range pwmWrite() takes, MINCOMMAND and below stop the motor
+static void dshotEncode(uint8_t output, uint16_t value)
+{
+    uint8_t t = dshotTim[output], regs = dshotTimer[t].regs, b;
+    uint16_t *p = &dshotBuffer[t][dshotReg[output]];
+    uint16_t frame;
+
+    if (value <= MINCOMMAND)
+        frame = 0;
+    else
+        frame = 48 + (uint32_t)(constrain(value, 1000, 2000) - 1000) * 1999 / 1000;
+    frame <<= 1;                        // no telemetry
+    frame = frame << 4 | ((frame ^ frame >> 4 ^ frame >> 8) & 0x0F);
+    for (b = 0; b < DSHOT_BITS; b++, frame <<= 1, p += regs)
+        *p = frame & 0x8000 ? DSHOT_ONE : DSHOT_ZERO;
+}
+
+// still sending the last frame, CNDTR is left at the full count until the first dshotSend()
+static uint8_t dshotBusy(uint8_t t)
+{
+    return (dshotTimer[t].dma->CCR & DMA_CCR1_EN) && dshotTimer[t].dma->CNDTR;
+}
+
+static void dshotSend(uint8_t t)
+{
+    DMA_Channel_TypeDef *dma = dshotTimer[t].dma;
+
+    dma->CCR &= ~DMA_CCR1_EN;
+    dma->CNDTR = DSHOT_SLOTS * dshotTimer[t].regs;
+    dma->CCR |= DMA_CCR1_EN;            // the next update event takes the first slot
+}
+#endif
+
+static uint8_t pwmServo;
+#ifdef DIGITAL_SERVO
+static uint16_t pwmServoPeriod = PULSE_PERIOD_SERVO_DIGITAL;
+#else
+static uint16_t pwmServoPeriod = PULSE_PERIOD_SERVO_ANALOG;
+#endif
+
+static void pwmTimerInit(TIM_TypeDef *tim, uint16_t period, uint16_t prescaler)
+{
+    TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure;
+
+    TIM_TimeBaseStructInit(&TIM_TimeBaseStructure);
+    TIM_TimeBaseStructure.TIM_Prescaler = prescaler - 1;   // all timer clocks are 72MHz with APB1 at /2
+    TIM_TimeBaseStructure.TIM_Period = period - 1;
+    TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+    TIM_TimeBaseInit(tim, &TIM_TimeBaseStructure);
+    TIM_ARRPreloadConfig(tim, ENABLE);
+}
+
+void pwmInit(uint8_t useServo)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    TIM_OCInitTypeDef TIM_OCInitStructure;
+    uint16_t servoPeriod = pwmServoPeriod;
+    uint8_t i;
+
+    pwmServo = useServo;
+    GPIO_PinRemapConfig(GPIO_PartialRemap_TIM3, ENABLE);
+#if defined(MOTOR_ONESHOT)
+    pwmTimerInit(TIM4, ONESHOT_PERIOD, 72 / ONESHOT_SCALE);
+    pwmTimerInit(TIM1, ONESHOT_PERIOD, 72 / ONESHOT_SCALE);
+    pwmTimerInit(TIM3, useServo ? servoPeriod : ONESHOT_PERIOD, useServo ? 72 : 72 / ONESHOT_SCALE);
+    pwmTimerInit(TIM2, useServo ? servoPeriod : ONESHOT_PERIOD, useServo ? 72 : 72 / ONESHOT_SCALE);
+#elif defined(MOTOR_DSHOT)
+    pwmTimerInit(TIM4, DSHOT_SLOT, 1);
+    pwmTimerInit(TIM1, DSHOT_SLOT, 1);
+    pwmTimerInit(TIM3, useServo ? servoPeriod : DSHOT_SLOT, useServo ? 72 : 1);
+    pwmTimerInit(TIM2, useServo ? servoPeriod : DSHOT_SLOT, useServo ? 72 : 1);
+#else
+    pwmTimerInit(TIM4, PULSE_PERIOD, 72);
+    pwmTimerInit(TIM1, PULSE_PERIOD, 72);
+    pwmTimerInit(TIM3, useServo ? servoPeriod : PULSE_PERIOD, 72);
+    pwmTimerInit(TIM2, useServo ? servoPeriod : PULSE_PERIOD, 72);
+#endif
+
+    TIM_OCStructInit(&TIM_OCInitStructure);
+    TIM_OCInitStructure.TIM_OutputState = TIM_OutputState_Enable;
+    TIM_OCInitStructure.TIM_OCPolarity = TIM_OCPolarity_High;
+    TIM_OCInitStructure.TIM_OCIdleState = TIM_OCIdleState_Reset;
+
+#if defined(MOTOR_DSHOT)
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_10MHz;  // edges well inside the 3/8 slot of a 0
+#else
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_2MHz;
+#endif
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF_PP;
+    for (i = 0; i < PWM_OUTPUTS; i++) {
+        TIM_TypeDef *tim = pwmOutput[i].tim;
+
+#if defined(MOTOR_ONESHOT)
+        if (i < 4 || !useServo) {
+            TIM_OCInitStructure.TIM_OCMode = TIM_OCMode_PWM2;
+            TIM_OCInitStructure.TIM_Pulse = ONESHOT_PERIOD;
+        } else
+#endif
+        {
+            TIM_OCInitStructure.TIM_OCMode = TIM_OCMode_PWM1;
+            TIM_OCInitStructure.TIM_Pulse = PULSE_1MS;
+#if defined(MOTOR_DSHOT)
+            if (i < 4 || !useServo)
+                TIM_OCInitStructure.TIM_Pulse = 0;      // low between frames
+#endif
+        }
+        GPIO_InitStructure.GPIO_Pin = pwmOutput[i].pin;
+        GPIO_Init(pwmOutput[i].gpio, &GPIO_InitStructure);
+        switch (pwmOutput[i].channel) {
+        case 1:
+            TIM_OC1Init(tim, &TIM_OCInitStructure);
+            TIM_OC1PreloadConfig(tim, TIM_OCPreload_Enable);
+            pwmCCR[i] = &tim->CCR1;
+            break;
+        case 2:
+            TIM_OC2Init(tim, &TIM_OCInitStructure);
+            TIM_OC2PreloadConfig(tim, TIM_OCPreload_Enable);
+            pwmCCR[i] = &tim->CCR2;
+            break;
+        case 3:
+            TIM_OC3Init(tim, &TIM_OCInitStructure);
+            TIM_OC3PreloadConfig(tim, TIM_OCPreload_Enable);
+            pwmCCR[i] = &tim->CCR3;
+            break;
+        case 4:
+            TIM_OC4Init(tim, &TIM_OCInitStructure);
+            TIM_OC4PreloadConfig(tim, TIM_OCPreload_Enable);
+            pwmCCR[i] = &tim->CCR4;
+            break;
+        }
+    }
+
+    TIM_CtrlPWMOutputs(TIM1, ENABLE);   // advanced timer, outputs stay off until MOE is set
+#if defined(MOTOR_ONESHOT)
+    for (i = 0; i < PWM_MOTOR_TIMERS; i++)
+        if (i < 2 || !useServo)
+            TIM_SelectOnePulseMode(pwmMotorTimer[i], TIM_OPMode_Single);
+    if (useServo) {
+        TIM_Cmd(TIM2, ENABLE);
+        TIM_Cmd(TIM3, ENABLE);
+    }
+#else
+#if defined(MOTOR_DSHOT)
+    dshotInit(useServo);
+#endif
+    TIM_Cmd(TIM1, ENABLE);
+    TIM_Cmd(TIM2, ENABLE);
+    TIM_Cmd(TIM3, ENABLE);
+    TIM_Cmd(TIM4, ENABLE);
+#endif
+}
+
+/* PWM write */
+void pwmWrite(uint8_t channel, uint16_t value)
+{
+    if (channel >= PWM_OUTPUTS)
+        return;
+#if defined(MOTOR_ONESHOT)
+    if (channel < 4 || !pwmServo)
+        value = ONESHOT_PERIOD - value;
+#elif defined(MOTOR_DSHOT)
+    if (channel < dshotOutputs) {
+        uint8_t t = dshotTim[channel];
+
+        if (!dshotBusy(t)) {
+            dshotEncode(channel, value);
+            dshotSend(t);
+        }
+        return;
+    }
+#endif
+    *pwmCCR[channel] = value;
+}
+
+#if defined(MOTOR_ONESHOT)
+// A timer still busy with the last pulse keeps it, the new value is latched when it stops
+static void pwmSync(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < PWM_MOTOR_TIMERS; i++) {
+        TIM_TypeDef *tim = pwmMotorTimer[i];
+
+        if ((i >= 2 && pwmServo) || (tim->CR1 & TIM_CR1_CEN))
+            continue;
+        tim->EGR = TIM_EGR_UG;          // loads the new compare values
+        tim->CR1 |= TIM_CR1_CEN;
+    }
+}
+
+// the pulses start together in pwmSync(), see the STM8 version for why there's no update disable
+void pwmWriteAll(const int16_t *value, uint8_t count)
+{
+    uint8_t i;
+
+    if (count > PWM_OUTPUTS)
+        count = PWM_OUTPUTS;
+    for (i = 0; i < count; i++)
+        *pwmCCR[i] = ONESHOT_PERIOD - value[i];
+    pwmSync();
+}
+#elif defined(MOTOR_DSHOT)
+/* A timer still sending the last frame keeps it whole, a half rewritten frame would fail the checksum. Frames
+   take 28us at DShot600, 113us at DShot150, so that only happens with a loop faster than that */
+void pwmWriteAll(const int16_t *value, uint8_t count)
+{
+    uint8_t i, t, busy = 0, send = 0;
+
+    if (count > dshotOutputs)
+        count = dshotOutputs;
+    for (t = 0; t < DSHOT_TIMERS; t++)
+        if (dshotBusy(t))
+            busy |= 1 << t;
+    for (i = 0; i < count; i++) {
+        t = dshotTim[i];
+        if (busy & 1 << t)
+            continue;
+        dshotEncode(i, value[i]);
+        send |= 1 << t;
+    }
+    for (t = 0; t < DSHOT_TIMERS; t++)
+        if (send & 1 << t)
+            dshotSend(t);
+}
+#else
+/* The motor timers' update events are held off (UDIS) while the compare registers are written, so all
+   motors take their new pulse in the same period. The timers share the 1MHz tick and the period */
+void pwmWriteAll(const int16_t *value, uint8_t count)
+{
+    uint8_t i;
+
+    if (count > PWM_OUTPUTS)
+        count = PWM_OUTPUTS;
+    for (i = 0; i < count; i++)
+        pwmOutput[i].tim->CR1 |= TIM_CR1_UDIS;
+    for (i = 0; i < count; i++)
+        *pwmCCR[i] = value[i];
+    for (i = 0; i < count; i++)
+        pwmOutput[i].tim->CR1 &= ~TIM_CR1_UDIS;
+}
+#endif
+
+/* One rate for both servo outputs (TIM3 and TIM2). ARR is preloaded: a running timer finishes its period first */
+void pwmServoRate(uint16_t hz)
+{
+    if (hz < 50)
+        hz = 50;
+    if (hz > 400)
+        hz = 400;
+    pwmServoPeriod = 1000000UL / hz;
+    if (pwmServo) {
+        TIM3->ARR = pwmServoPeriod - 1;
+#if !defined(CAMTRIG)
+        TIM2->ARR = pwmServoPeriod - 1;
+#endif
+    }
+}
+
+#if defined(CAMTRIG)
+/* Camera shutter on PA2, output 6 of the header, TIM2 CH3. pwmInit() left TIM2 running as a plain PWM timer
+   with nothing on it, here it is set up again for 100us ticks in one pulse mode with PWM2 on CH3: the line goes
+   high on the first tick after shutter_fire() starts the counter and low on the update at ARR, where the
+   counter stops by itself */
+#define SHUTTER_TICK    100             // us
+
+void shutter_init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    TIM_OCInitTypeDef TIM_OCInitStructure;
+
+    TIM_Cmd(TIM2, DISABLE);
+    pwmTimerInit(TIM2, 2, 72 * SHUTTER_TICK);
+    TIM_ARRPreloadConfig(TIM2, DISABLE); // shutter_fire() sets ARR for the pulse it starts
+    TIM_SelectOnePulseMode(TIM2, TIM_OPMode_Single);
+
+    TIM_OCStructInit(&TIM_OCInitStructure);
+    TIM_OCInitStructure.TIM_OCMode = TIM_OCMode_PWM2;
+    TIM_OCInitStructure.TIM_OutputState = TIM_OutputState_Enable;
+    TIM_OCInitStructure.TIM_OCPolarity = TIM_OCPolarity_High;
+    TIM_OCInitStructure.TIM_Pulse = 1;
+    TIM_OC3Init(TIM2, &TIM_OCInitStructure);
+    TIM2->CNT = 0;                      // below CCR3: low
+
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_2;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_2MHz;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF_PP;
+    GPIO_Init(GPIOA, &GPIO_InitStructure);
+}
+
+// the counter and its prescaler start from 0, the update that stopped the last pulse reset them
+uint8_t shutter_fire(uint16_t ms, uint32_t *edge)
+{
+    if (TIM2->CR1 & TIM_CR1_CEN)
+        return 0;
+    TIM2->ARR = ms * (1000 / SHUTTER_TICK);   // high for CNT 1..ARR
+    __disable_irq();
+    TIM2->CR1 |= TIM_CR1_CEN;
+    *edge = microsISR() + SHUTTER_TICK;
+    __enable_irq();
+    return 1;
+}
+#endif
+
+/* Parallel PWM receiver on the CopterControl receiver port: PB6 (TIM4 CH1), PB5, PB0, PB1 (TIM3 CH2-4, TIM3 is
+   partially remapped for output 5) and PA0, PA1 (TIM2 CH1-2). The timers are the motor and servo ones, so
+   pwmInit() has set them to 1us ticks and the width wraps at their period, which is always longer than a
+   pulse. Each input captures its rising edge, then flips to the falling one */
+static const struct {
+    TIM_TypeDef *tim;
+    uint8_t channel;
+    GPIO_TypeDef *gpio;
+    uint16_t pin;
+} rcPwmInput[] = {
+    { TIM4, 1, GPIOB, GPIO_Pin_6 },
+    { TIM3, 2, GPIOB, GPIO_Pin_5 },
+    { TIM3, 3, GPIOB, GPIO_Pin_0 },
+    { TIM3, 4, GPIOB, GPIO_Pin_1 },
+    { TIM2, 1, GPIOA, GPIO_Pin_0 },
+    { TIM2, 2, GPIOA, GPIO_Pin_1 },
+};
+#define RCPWM_INPUTS    (sizeof(rcPwmInput) / sizeof(rcPwmInput[0]))
+
+static volatile uint16_t *rcPwmCCR[RCPWM_INPUTS];
+static uint16_t rcPwmRise[RCPWM_INPUTS];
+static rcPwmCallback_t rcPwmPulse;
+
+uint8_t rcPwm_init(rcPwmCallback_t pulse)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    TIM_ICInitTypeDef TIM_ICInitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+    static const uint8_t irq[] = { TIM2_IRQn, TIM3_IRQn, TIM4_IRQn };
+    uint8_t i;
+
+    rcPwmPulse = pulse;
+
+    TIM_ICStructInit(&TIM_ICInitStructure);
+    TIM_ICInitStructure.TIM_ICPolarity = TIM_ICPolarity_Rising;
+    TIM_ICInitStructure.TIM_ICSelection = TIM_ICSelection_DirectTI;
+    TIM_ICInitStructure.TIM_ICPrescaler = TIM_ICPSC_DIV1;
+    TIM_ICInitStructure.TIM_ICFilter = 0x03;           // 8 samples at 72MHz, spikes off the servo leads
+
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_IPD;
+    for (i = 0; i < RCPWM_INPUTS; i++) {
+        TIM_TypeDef *tim = rcPwmInput[i].tim;
+
+        GPIO_InitStructure.GPIO_Pin = rcPwmInput[i].pin;
+        GPIO_Init(rcPwmInput[i].gpio, &GPIO_InitStructure);
+        switch (rcPwmInput[i].channel) {
+        case 1:
+            TIM_ICInitStructure.TIM_Channel = TIM_Channel_1;
+            rcPwmCCR[i] = &tim->CCR1;
+            break;
+        case 2:
+            TIM_ICInitStructure.TIM_Channel = TIM_Channel_2;
+            rcPwmCCR[i] = &tim->CCR2;
+            break;
+        case 3:
+            TIM_ICInitStructure.TIM_Channel = TIM_Channel_3;
+            rcPwmCCR[i] = &tim->CCR3;
+            break;
+        case 4:
+            TIM_ICInitStructure.TIM_Channel = TIM_Channel_4;
+            rcPwmCCR[i] = &tim->CCR4;
+            break;
+        }
+        TIM_ICInit(tim, &TIM_ICInitStructure);
+        TIM_ITConfig(tim, TIM_IT_CC1 << (rcPwmInput[i].channel - 1), ENABLE);
+    }
+
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_CAPTURE;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    for (i = 0; i < sizeof(irq); i++) {
+        NVIC_InitStructure.NVIC_IRQChannel = irq[i];
+        NVIC_Init(&NVIC_InitStructure);
+    }
+    return RCPWM_INPUTS;
+}
+
+static void rcPwmCapture(TIM_TypeDef *tim)
+{
+    uint8_t i;
+
+    for (i = 0; i < RCPWM_INPUTS; i++) {
+        uint16_t flag = TIM_IT_CC1 << (rcPwmInput[i].channel - 1);
+        uint16_t polarity = TIM_CCER_CC1P << ((rcPwmInput[i].channel - 1) * 4);
+        uint16_t now, cnt;
+
+        if (rcPwmInput[i].tim != tim || !(tim->SR & flag))
+            continue;
+        now = *rcPwmCCR[i];             // reading the capture clears the flag
+        cnt = tim->CNT;
+        irqLatencyAdd(IRQ_LAT_CAPTURE, cnt >= now ? cnt - now : cnt + tim->ARR + 1 - now);
+        if (tim->CCER & polarity) {
+            tim->CCER &= ~polarity;
+            if (rcPwmPulse)
+                rcPwmPulse(i, now >= rcPwmRise[i] ? now - rcPwmRise[i] : now + tim->ARR + 1 - rcPwmRise[i]);
+        } else {
+            rcPwmRise[i] = now;
+            tim->CCER |= polarity;
+        }
+    }
+}
+
+// no probes, they sit on the receiver pins
+void TIM2_IRQHandler(void)
+{
+    rcPwmCapture(TIM2);
+}
+
+void TIM3_IRQHandler(void)
+{
+    rcPwmCapture(TIM3);
+}
+
+void TIM4_IRQHandler(void)
+{
+    rcPwmCapture(TIM4);
+}
+
+// ************************************************************************************************************
+// I2C general functions
+// ************************************************************************************************************
+/* I2C2 on PB10 (SCL) / PB11 (SDA), the flexi port. The F1 I2C block is the same design as the STM8 one, so
+   this is the same interrupt driven job queue. The differences: the error flags live in SR1, events and
+   errors come in on separate vectors, and reading SR2 (not SR3) is what clears ADDR */
+#define I2C_MAX_STANDARD_HZ 100000
+#define I2C_MAX_FAST_HZ     400000
+
+// Per device speed and health, see i2cdev.h. The bus is switched between jobs when the next one wants the
+// other mode, with the peripheral off while the clock registers change. The STM's I2C block stops at fast mode.
+#include "i2cdev.h"
+
+// A slave reset or cut off in the middle of a read holds SDA low until it has clocked out the rest of its byte,
+// and no START gets through. With the peripheral off the pins are GPIOs: SCL is clocked until SDA is let go, at
+// most 9 times, then START and STOP by hand. Runs from i2c_init(), at boot and after every timeout.
+static uint16_t i2cRecoveries = 0;
+
+static void i2c_halfBit(void)
+{
+    uint32_t t = microsISR();
+
+    while (microsISR() - t < 5)         // 100kHz
+        ;
+}
+
+static void i2c_unstick(void)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    uint8_t i;
+
+    // PB10 SCL, PB11 SDA. i2c_init() gives them back to the peripheral
+    I2C2->CR1 &= ~I2C_CR1_PE;
+    GPIOB->BSRR = GPIO_Pin_10 | GPIO_Pin_11;
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_10 | GPIO_Pin_11;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_2MHz;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_Out_OD;
+    GPIO_Init(GPIOB, &GPIO_InitStructure);
+    i2c_halfBit();
+    if (GPIOB->IDR & GPIO_Pin_11)
+        return;
+    for (i = 0; i < 9 && !(GPIOB->IDR & GPIO_Pin_11); i++) {
+        GPIOB->BRR = GPIO_Pin_10;
+        i2c_halfBit();
+        GPIOB->BSRR = GPIO_Pin_10;
+        i2c_halfBit();
+    }
+    GPIOB->BRR = GPIO_Pin_11;
+    i2c_halfBit();
+    GPIOB->BSRR = GPIO_Pin_11;
+    i2c_halfBit();
+    i2cRecoveries++;
+}
+
+uint16_t i2c_busRecoveries(void)
+{
+    return i2cRecoveries;
+}
+
+// CCR and TRISE as I2C_Init() works them out for standard and fast mode
+static uint16_t i2cClock[2][2];
+static uint8_t i2cFast;
+
+static void i2c_setClock(uint8_t fast)
+{
+    uint8_t n = 255;
+
+    // the STOP of the last job has to be on the wire before the peripheral goes off
+    while ((I2C2->CR1 & I2C_CR1_STOP) && --n)
+        ;
+    I2C2->CR1 &= ~I2C_CR1_PE;
+    I2C2->CCR = i2cClock[fast][0];
+    I2C2->TRISE = i2cClock[fast][1];
+    I2C2->CR1 |= I2C_CR1_PE | I2C_CR1_ACK;       // PE off cleared ACK
+    i2cFast = fast;
+}
+
+void i2c_init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    I2C_InitTypeDef I2C_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+    uint8_t fast;
+
+    i2c_unstick();
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_10 | GPIO_Pin_11;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_2MHz;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF_OD;
+    GPIO_Init(GPIOB, &GPIO_InitStructure);
+
+    I2C_DeInit(I2C2);
+    I2C_StructInit(&I2C_InitStructure);
+    I2C_InitStructure.I2C_Mode = I2C_Mode_I2C;
+    I2C_InitStructure.I2C_DutyCycle = I2C_DutyCycle_2;
+    I2C_InitStructure.I2C_Ack = I2C_Ack_Enable;
+    I2C_InitStructure.I2C_AcknowledgedAddress = I2C_AcknowledgedAddress_7bit;
+    for (fast = 0; fast < 2; fast++) {
+        I2C_InitStructure.I2C_ClockSpeed = fast ? I2C_MAX_FAST_HZ : I2C_MAX_STANDARD_HZ;
+        I2C_Init(I2C2, &I2C_InitStructure);
+        i2cClock[fast][0] = I2C2->CCR;
+        i2cClock[fast][1] = I2C2->TRISE;
+    }
+    I2C_Cmd(I2C2, ENABLE);
+    i2c_setClock(I2C_SPEED > I2C_MAX_STANDARD_HZ);
+
+    NVIC_InitStructure.NVIC_IRQChannel = I2C2_EV_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_BUS;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+    NVIC_InitStructure.NVIC_IRQChannel = I2C2_ER_IRQn;
+    NVIC_Init(&NVIC_InitStructure);
+}
+
+#define I2C_QUEUE_SIZE  8               // must be a power of 2
+
+#define I2C_SR1_ERRORS  (I2C_SR1_AF | I2C_SR1_BERR | I2C_SR1_ARLO | I2C_SR1_OVR)
+#define I2C_CR2_ITALL   (I2C_CR2_ITEVTEN | I2C_CR2_ITERREN | I2C_CR2_ITBUFEN)
+
+enum {
+    I2C_PHASE_START = 0,
+    I2C_PHASE_ADDR_TX,
+    I2C_PHASE_TX,
+    I2C_PHASE_RSTART,
+    I2C_PHASE_ADDR_RX,
+    I2C_PHASE_RX
+};
+
+static struct {
+    i2cJob_t *queue[I2C_QUEUE_SIZE];
+    volatile uint8_t head;              // next free slot, written by i2c_submit()
+    volatile uint8_t tail;              // job on the bus, advanced by the interrupt
+    i2cJob_t *job;                      // current job, NULL when idle
+    uint8_t phase;
+    uint8_t ptr;
+    uint8_t subaddrSent;
+    uint32_t started;                   // micros() when the current job got the bus
+} i2cBus;
+
+static void i2c_startNext(void);
+
+// Only called from the I2C interrupts, or with interrupts masked
+static void i2c_finish(uint8_t status)
+{
+    i2cJob_t *job = i2cBus.job;
+
+    I2C2->CR2 &= ~I2C_CR2_ITALL;
+    I2C2->CR1 &= ~I2C_CR1_POS;
+    I2C2->CR1 |= I2C_CR1_ACK;
+    i2cBus.job = NULL;
+    i2cBus.tail = (i2cBus.tail + 1) & (I2C_QUEUE_SIZE - 1);
+
+    i2cdev_result(job, status, microsISR());
+    job->status = status;
+    if (job->done)
+        job->done(job);
+    i2c_startNext();
+}
+
+static void i2c_startNext(void)
+{
+    if (i2cBus.job || i2cBus.tail == i2cBus.head)
+        return;
+    i2cBus.job = i2cBus.queue[i2cBus.tail];
+    i2cBus.ptr = 0;
+    i2cBus.subaddrSent = 0;
+    i2cBus.started = microsISR();
+    if (i2cBus.job->read && i2cBus.job->subaddr == 0xFF)
+        i2cBus.phase = I2C_PHASE_RSTART;            // no register pointer to set up, straight to the read
+    else
+        i2cBus.phase = I2C_PHASE_START;
+    if (i2cBus.job->fast != i2cFast)
+        i2c_setClock(i2cBus.job->fast);
+    I2C2->CR2 |= I2C_CR2_ITEVTEN | I2C_CR2_ITERREN;
+    I2C2->CR1 |= I2C_CR1_START;
+}
+
+uint8_t i2c_submit(i2cJob_t *job)
+{
+    uint8_t next;
+
+    __disable_irq();
+    if (!i2cdev_admit(job, microsISR())) {
+        __enable_irq();
+        job->status = I2C_BACKOFF;
+        return I2C_BACKOFF;
+    }
+    next = (i2cBus.head + 1) & (I2C_QUEUE_SIZE - 1);
+    if (next == i2cBus.tail) {
+        __enable_irq();
+        job->status = I2C_QUEUE_FULL;
+        return I2C_QUEUE_FULL;
+    }
+    job->status = I2C_PENDING;
+    i2cBus.queue[i2cBus.head] = job;
+    i2cBus.head = next;
+    i2c_startNext();
+    __enable_irq();
+    return I2C_SUCCESS;
+}
+
+void i2c_poll(void)
+{
+    static const uint8_t timeoutCode[] = { I2C_START_TIMEOUT, I2C_SACK_TIMEOUT, I2C_TX_TIMEOUT, I2C_RSTART_TIMEOUT, I2C_SACK_TIMEOUT, I2C_RX_TIMEOUT };
+    uint8_t phase;
+
+    __disable_irq();
+    if (i2cBus.job && (microsISR() - i2cBus.started) > I2C_JOB_TIMEOUT(i2cBus.job)) {
+        // Slave is holding the bus or never answered. Drop the job and give the peripheral a fresh start.
+        phase = i2cBus.phase;
+        I2C2->CR2 &= ~I2C_CR2_ITALL;
+        I2C2->CR1 |= I2C_CR1_STOP;
+        i2c_init();
+        i2c_finish(timeoutCode[phase]);
+    }
+    __enable_irq();
+}
+
+uint8_t i2c_isIdle(void)
+{
+    return i2cBus.job == NULL;
+}
+
+static void i2c_handler(void)
+{
+    i2cJob_t *job = i2cBus.job;
+    uint16_t sr1 = I2C2->SR1;
+    uint8_t remaining;
+
+    if (!job) {
+        I2C2->CR2 &= ~I2C_CR2_ITALL;
+        return;
+    }
+
+    if (sr1 & I2C_SR1_ERRORS) {
+        I2C2->SR1 = ~I2C_SR1_ERRORS;                // error flags are cleared by writing 0
+        I2C2->CR1 |= I2C_CR1_STOP;                  // release the bus so the next job can have it
+        i2c_finish((sr1 & I2C_SR1_AF) ? I2C_SACK_FAILURE : I2C_BUS_ERROR);
+        return;
+    }
+
+    if (sr1 & I2C_SR1_SB) {
+        if (i2cBus.phase == I2C_PHASE_START) {
+            i2cBus.phase = I2C_PHASE_ADDR_TX;
+            I2C2->DR = job->address & 0xFE;         // address write
+        } else {
+            i2cBus.phase = I2C_PHASE_ADDR_RX;
+            if (job->len == 2)
+                I2C2->CR1 |= I2C_CR1_POS;           // ACK bit applies to the next byte
+            I2C2->DR = job->address | 0x01;         // address read
+        }
+        return;
+    }
+
+    if (sr1 & I2C_SR1_ADDR) {
+        if (i2cBus.phase == I2C_PHASE_ADDR_TX) {
+            (void)I2C2->SR2;                        // SR1 then SR2 clears ADDR
+            i2cBus.phase = I2C_PHASE_TX;
+            I2C2->CR2 |= I2C_CR2_ITBUFEN;
+        } else {
+            i2cBus.phase = I2C_PHASE_RX;
+            if (job->len == 1) {
+                I2C2->CR1 &= ~I2C_CR1_ACK;          // single byte: NACK and STOP before ADDR is cleared
+                (void)I2C2->SR2;
+                I2C2->CR1 |= I2C_CR1_STOP;
+                I2C2->CR2 |= I2C_CR2_ITBUFEN;
+            } else if (job->len == 2) {
+                (void)I2C2->SR2;
+                I2C2->CR1 &= ~I2C_CR1_ACK;          // with POS set, NACKs the second byte. Both come in on BTF
+            } else {
+                (void)I2C2->SR2;
+                I2C2->CR2 |= I2C_CR2_ITBUFEN;
+            }
+        }
+        return;
+    }
+
+    if (i2cBus.phase == I2C_PHASE_TX) {
+        if (sr1 & I2C_SR1_TXE) {
+            if (!i2cBus.subaddrSent && job->subaddr != 0xFF) {
+                i2cBus.subaddrSent = 1;
+                I2C2->DR = job->subaddr;
+                return;
+            }
+            if (!job->read && i2cBus.ptr < job->len) {
+                I2C2->DR = job->buf[i2cBus.ptr++];
+                return;
+            }
+            if (job->subaddr == 0xFF && i2cBus.ptr == 0) {
+                I2C2->CR1 |= I2C_CR1_STOP;          // address only, nothing was clocked out so BTF won't come
+                i2c_finish(I2C_SUCCESS);
+                return;
+            }
+            // Everything is in the shift register, wait for BTF without TXE hammering us
+            I2C2->CR2 &= ~I2C_CR2_ITBUFEN;
+            if (!(sr1 & I2C_SR1_BTF))
+                return;
+        }
+        if (sr1 & I2C_SR1_BTF) {
+            if (job->read) {
+                i2cBus.phase = I2C_PHASE_RSTART;
+                I2C2->CR1 |= I2C_CR1_START;         // repeated start for the read
+            } else {
+                I2C2->CR1 |= I2C_CR1_STOP;
+                i2c_finish(I2C_SUCCESS);
+            }
+        }
+        return;
+    }
+
+    if (i2cBus.phase == I2C_PHASE_RX) {
+        remaining = job->len - i2cBus.ptr;
+        if (remaining == 1) {
+            if (sr1 & I2C_SR1_RXNE) {
+                job->buf[i2cBus.ptr++] = I2C2->DR;  // last byte, NACK and STOP were set up already
+                i2c_finish(I2C_SUCCESS);
+            }
+        } else if (remaining == 2) {
+            if (sr1 & I2C_SR1_BTF) {
+                I2C2->CR1 |= I2C_CR1_STOP;
+                job->buf[i2cBus.ptr++] = I2C2->DR;
+                job->buf[i2cBus.ptr++] = I2C2->DR;
+                i2c_finish(I2C_SUCCESS);
+            }
+        } else if (remaining == 3) {
+            // let two bytes stack up, then NACK, STOP and drain
+            I2C2->CR2 &= ~I2C_CR2_ITBUFEN;
+            if (sr1 & I2C_SR1_BTF) {
+                I2C2->CR1 &= ~I2C_CR1_ACK;
+                job->buf[i2cBus.ptr++] = I2C2->DR;  // third to last
+                I2C2->CR1 |= I2C_CR1_STOP;
+                job->buf[i2cBus.ptr++] = I2C2->DR;  // penultimate
+                I2C2->CR2 |= I2C_CR2_ITBUFEN;       // last one arrives on RXNE
+            }
+        } else if (sr1 & I2C_SR1_RXNE) {
+            job->buf[i2cBus.ptr++] = I2C2->DR;
+        }
+    }
+}
+
+void I2C2_EV_IRQHandler(void)
+{
+    PROBE_HI(PROBE_ISR);
+    i2c_handler();
+    PROBE_LO(PROBE_ISR);
+}
+
+void I2C2_ER_IRQHandler(void)
+{
+    i2c_handler();
+}
+
+// Blocking wrapper around a queued job, for init code and the drivers that need the data right now
+static uint8_t i2c_runJob(i2cJob_t *job)
+{
+    if (i2c_submit(job) != I2C_SUCCESS)
+        return job->status;
+    while (job->status == I2C_PENDING)
+        i2c_poll();
+    return job->status;
+}
+
+uint8_t i2c_write(uint8_t *buf, uint8_t size)
+{
+    // buf[0] is the slave address, the rest goes out as is
+    i2cJob_t job;
+    job.address = buf[0];
+    job.subaddr = 0xFF;
+    job.buf = buf + 1;
+    job.len = size - 1;
+    job.read = 0;
+    job.done = NULL;
+    return i2c_runJob(&job);
+}
+
+uint8_t i2c_read(uint8_t *buf, uint8_t size, uint8_t address, uint8_t subaddr)
+{
+    //0xFF as the subaddr disables sub address
+    i2cJob_t job;
+    job.address = address;
+    job.subaddr = subaddr;
+    job.buf = buf;
+    job.len = size;
+    job.read = 1;
+    job.done = NULL;
+    return i2c_runJob(&job);
 }
 
 void systemReboot(void)
 {
-    
+    NVIC_SystemReset();
+}
+
+/* systemBootloader() leaves BOOT_MAGIC in a backup register, which keeps it through the reset. The start after
+   that goes to the ROM loader before anything is set up, with the clocks back at their reset state */
+#define BOOT_MAGIC          0xB007
+#define SYSTEM_MEMORY       0x1FFFF000
+
+static void bootCheck(void)
+{
+    uint32_t entry;
+
+    RCC->APB1ENR |= RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN;
+    if (BKP->DR1 != BOOT_MAGIC)
+        return;
+    PWR->CR |= PWR_CR_DBP;
+    BKP->DR1 = 0;                       // once, a reset from the loader starts the firmware again
+    RCC_DeInit();
+    entry = *(volatile uint32_t *)(SYSTEM_MEMORY + 4);
+    __set_MSP(*(volatile uint32_t *)SYSTEM_MEMORY);
+    ((void (*)(void))entry)();
+}
+
+void systemBootloader(void)
+{
+    __disable_irq();
+    RCC->APB1ENR |= RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN;
+    PWR->CR |= PWR_CR_DBP;
+    BKP->DR1 = BOOT_MAGIC;
+    NVIC_SystemReset();
+}
+
+/* IWDG off the LSI, nominally 40kHz but anywhere from 30 to 60: divided by 32 it's 0.8ms a step, up to 3.2s.
+   Registers rather than the library, its module isn't in the project */
+void watchdog_init(uint16_t ms)
+{
+    uint32_t reload = (uint32_t)ms * 5 / 4;
+
+    IWDG->KR = 0xCCCC;
+    IWDG->KR = 0x5555;
+    IWDG->PR = 3;               // /32
+    IWDG->RLR = reload > 0xFFF ? 0xFFF : reload < 1 ? 1 : reload;
+    IWDG->KR = 0xAAAA;
+}
+
+void watchdog_kick(void)
+{
+    IWDG->KR = 0xAAAA;
+}
+
+uint8_t watchdog_didReset(void)
+{
+    static uint8_t cause = 0xFF;
+
+    if (cause == 0xFF) {
+        cause = (RCC->CSR & RCC_CSR_IWDGRSTF) != 0;
+        RCC->CSR |= RCC_CSR_RMVF;
+    }
+    return cause;
+}
+
+/* RAM. CrossWorks' flash_placement.xml gives every section __<name>_start__/__end__ symbols. With a process stack
+   configured in the project the startup code runs main() on it (PSP) and leaves the main stack (MSP) to the
+   interrupts, both are watched. Stacks grow down, the untouched part is at their start */
+#define STACK_PAINT 0xA5A5A5A5
+extern uint32_t __data_start__[], __data_end__[], __bss_start__[], __bss_end__[];
+extern uint32_t __stack_start__[], __stack_end__[], __stack_process_start__[], __stack_process_end__[];
+
+static void stackPaint(uint32_t *p, uint32_t *end, const uint32_t *sp)
+{
+    if (sp >= p && sp < end)
+        end = (uint32_t *)sp - 8;       // the stack we are on: up to a little below the caller's frame
+    while (p < end)
+        *p++ = STACK_PAINT;
+}
+
+static uint16_t stackUntouched(const uint32_t *p, const uint32_t *end)
+{
+    const uint32_t *start = p;
+
+    while (p < end && *p == STACK_PAINT)
+        p++;
+    return (p - start) * sizeof(uint32_t);
+}
+
+void stack_paint(void)
+{
+    uint32_t here;
+
+    stackPaint(__stack_start__, __stack_end__, &here);
+    stackPaint(__stack_process_start__, __stack_process_end__, &here);
+}
+
+uint16_t stack_free(void)
+{
+    uint16_t isr = stackUntouched(__stack_start__, __stack_end__);
+    uint16_t main = stackUntouched(__stack_process_start__, __stack_process_end__);
+
+    return isr < main ? isr : main;
+}
+
+uint16_t ram_static(void)
+{
+    return (uint8_t *)__data_end__ - (uint8_t *)__data_start__ + (uint8_t *)__bss_end__ - (uint8_t *)__bss_start__;
+}
+
+uint8_t ram_isStatic(uint32_t addr, uint8_t len)
+{
+    uint32_t end = addr + len;
+
+    return (addr >= (uint32_t)__data_start__ && end <= (uint32_t)__data_end__)
+        || (addr >= (uint32_t)__bss_start__ && end <= (uint32_t)__bss_end__);
+}
+
+/* CRC-32 of flash: the CRC unit fed by DMA1 channel 6 memory to memory, a word per request at the lowest
+   priority, so the sensor and motor channels go first. A transfer takes up to 65535 words, crc_busy() starts
+   the next one of a longer range */
+#define FLASH_SIZE_KB           (*(volatile uint16_t *)0x1FFFF7E0)
+
+static uint32_t crcNext, crcLeft = 0;   // what no transfer has taken yet
+
+static void crcTransfer(void)
+{
+    DMA_InitTypeDef DMA_InitStructure;
+    uint16_t n = crcLeft > 0xFFFF ? 0xFFFF : crcLeft;
+
+    DMA_DeInit(DMA1_Channel6);
+    DMA_InitStructure.DMA_PeripheralBaseAddr = crcNext;
+    DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)&CRC->DR;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
+    DMA_InitStructure.DMA_BufferSize = n;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Enable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Disable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_Low;
+    DMA_InitStructure.DMA_M2M = DMA_M2M_Enable;
+    DMA_Init(DMA1_Channel6, &DMA_InitStructure);
+    DMA_Cmd(DMA1_Channel6, ENABLE);
+    crcNext += 4UL * n;
+    crcLeft -= n;
+}
+
+uint8_t crc_start(uint32_t address, uint32_t words)
+{
+    uint32_t end = FLASH_BASE + FLASH_SIZE_KB * 1024UL;
+
+    if (crc_busy() || address < FLASH_BASE || address > end || words > (end - address) / 4)
+        return 0;
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_CRC, ENABLE);
+    CRC_ResetDR();
+    crcNext = address;
+    crcLeft = words;
+    if (words)
+        crcTransfer();
+    return 1;
+}
+
+uint8_t crc_busy(void)
+{
+    if (dma_count(DMA1_Channel6))
+        return 1;
+    if (!crcLeft)
+        return 0;
+    crcTransfer();
+    return 1;
+}
+
+uint32_t crc_result(void)
+{
+    return CRC_GetCRC();
 }
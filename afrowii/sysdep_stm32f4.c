@@ -1,102 +1,604 @@
+/* System dependent file for the STM32F40x, F4DISCO target: STM32F4DISCOVERY (F407VG) with an MPU6000 breakout.
+   Built against the STM32F4xx StdPeriph library with -mfpu=fpv4-sp-d16 -mfloat-abi=hard.
+
+   PA2/PA3      USART2 TX/RX, GUI and telemetry (TX on DMA1 stream 6)
+   PB11         USART3 RX, serial receiver or GPS
+   PB12-PB15    SPI2 CS/SCK/MISO/MOSI, MPU6000 (DMA1 streams 3 and 4)
+   PC4          MPU6000 INT (EXTI4)
+   PB6/PB9      I2C1 SCL/SDA, external sensors. The audio DAC sits on it at 0x94
+   PE9/PE11/PE13/PE14   motors 1-4, TIM1 CH1-4
+   PC6/PC7      outputs 5/6 (servos or motors), TIM8 CH1-2
+   PC1/PC2      battery divider, current sensor (ADC1 on DMA2 stream 0)
+   PD12         green LED
+   PB4/PB5/PB0/PB1, PE5/PE6   parallel PWM receiver (RCPWM), TIM3 CH1-4 and TIM9 CH1-2
+   PC8-PC11, PC12, PD2   SD card D0-D3, CK, CMD on SDIO (BLACKBOX_SD, DMA2 stream 3). PC10 and PC12 also reach
+                the audio DAC, which stays in reset
+   PD0/PD1      CAN1 RX/TX to a 3.3V transceiver (MOTOR_CAN)
+
+   DMA can't reach the 64K CCM RAM, all buffers handed to it have to stay in the main SRAM */
+#include "board.h"
 #include "config.h"
 #include "def.h"
 #include "sysdep.h"
+#include "ringbuf.h"
+#include "hwreg.h"
+#if defined(BLACKBOX_SD)
+#include "stm32f4xx_sdio.h"
+#endif
+#if defined(CAN_BUS)
+#include "stm32f4xx_can.h"
+#endif
+
+#if !defined(__FPU_USED) || (__FPU_USED != 1)
+#warning "STM32F4 built without the FPU, the float estimators end up in software"
+#endif
+
+static void systick_init(void);
+static void adc_init(void);
+static void bootCheck(void);
+#if defined(SWO_TRACE)
+static void trace_init(void);
+#endif
 
 /* HW init */
 void hw_init(void)
 {
+    GPIO_InitTypeDef GPIO_InitStructure;
+
+    bootCheck();
+    // 168MHz off the 8MHz crystal: APB2 at 84MHz, APB1 at 42MHz, timers at twice that. With __FPU_USED this
+    // also opens CP10/CP11, before then any float instruction faults
+    SystemInit();
+    NVIC_PriorityGroupConfig(NVIC_PriorityGroup_4);     // preemption only, see IRQ_PRIO_* in board.h
+
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOA | RCC_AHB1Periph_GPIOB | RCC_AHB1Periph_GPIOC | RCC_AHB1Periph_GPIOD
+        | RCC_AHB1Periph_GPIOE | RCC_AHB1Periph_DMA1 | RCC_AHB1Periph_DMA2, ENABLE);
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_USART2 | RCC_APB1Periph_USART3 | RCC_APB1Periph_SPI2 | RCC_APB1Periph_I2C1, ENABLE);
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM1 | RCC_APB2Periph_TIM8 | RCC_APB2Periph_ADC1 | RCC_APB2Periph_SYSCFG, ENABLE);
+
+    // LED
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_12;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_OUT;
+    GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+    GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_2MHz;
+    GPIO_Init(GPIOD, &GPIO_InitStructure);
+#if defined(TIMING_PROBES)
+    GPIO_InitStructure.GPIO_Pin = PROBE_PIN_0 | PROBE_PIN_1 | PROBE_PIN_2 | PROBE_PIN_3;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;      // edges within a few ns of the store
+    GPIO_Init(PROBE_PORT, &GPIO_InitStructure);
+#endif
+
+    // systick
+    systick_init();
+#if defined(SWO_TRACE)
+    trace_init();
+#endif
 
+    // analog inputs free run from here on
+    adc_init();
+
+    LEDPIN_ON;
+    LEDPIN_OFF;
+}
+
+static void gpio_af(GPIO_TypeDef *gpio, uint16_t pin, uint8_t source, uint8_t af, GPIOOType_TypeDef type, GPIOPuPd_TypeDef pull)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+
+    GPIO_PinAFConfig(gpio, source, af);
+    GPIO_InitStructure.GPIO_Pin = pin;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+    GPIO_InitStructure.GPIO_OType = type;
+    GPIO_InitStructure.GPIO_PuPd = pull;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_Init(gpio, &GPIO_InitStructure);
 }
 
 /* UART */
+/* USART2, TX on DMA1 stream 6 channel 4. Same scheme as the STM32F1 USART1 backend: a frame is built in
+   uartBuffer[uartBack] while the other one drains, a frame committed while that is still going waits in
+   txPending and is started from the transfer complete interrupt. RX goes through the RXNE interrupt */
+#define TX_BUFFER_SIZE 128
+
 static uint8_t uartPointer;
-static uint8_t uartBuffer[128];
+static uint8_t uartBuffer[2][TX_BUFFER_SIZE];
+static uint8_t uartBack = 0;
+static uint8_t uartOverflow = 0;
+static uint16_t txDropped = 0;
+static volatile uint8_t txActive = 0;
+static volatile uint8_t txPending = 0;
+static uint8_t txPendingLen;
+static uint8_t rxBuffer[64];
+static ring_t rxRing = RING_INIT(rxBuffer);
+
+#define DMA_STREAM6_FLAGS   (DMA_FLAG_TCIF6 | DMA_FLAG_HTIF6 | DMA_FLAG_TEIF6 | DMA_FLAG_DMEIF6 | DMA_FLAG_FEIF6)
+
 void serialize16(int16_t a)
 {
-    uartBuffer[uartPointer++] = a;
-    uartBuffer[uartPointer++] = a >> 8 & 0xff;
+    serialize8(a);
+    serialize8(a >> 8 & 0xff);
 }
 
 void serialize8(uint8_t a)
 {
-    uartBuffer[uartPointer++] = a;
+    if (uartPointer < TX_BUFFER_SIZE)
+        uartBuffer[uartBack][uartPointer++] = a;
+    else
+        uartOverflow = 1;
 }
 
-void Serial_commitBuffer(void)
+void *Serial_reserve(uint8_t len)
 {
+    uint8_t *p = &uartBuffer[uartBack][uartPointer];
 
+    if (len > TX_BUFFER_SIZE - uartPointer) {
+        uartOverflow = 1;
+        return 0;
+    }
+    uartPointer += len;
+    return p;
 }
 
-uint8_t Serial_isTxBusy(void)
+static void uartStartTx(uint8_t *buf, uint8_t len)
 {
-    return tx_busy;
+    // a stream only takes a new address and count while disabled, and with its flags cleared
+    dma_enable(DMA1_Stream6, 0);
+    while (DMA1_Stream6->CR & DMA_SxCR_EN);
+    dma_clear(DMA1, DMA_STREAM6_FLAGS);
+    DMA1_Stream6->M0AR = (uint32_t)buf;
+    dma_setCount(DMA1_Stream6, len);
+    usart_tcClear(USART2);             // DMA writes to DR don't clear it
+    txActive = 1;
+    dma_enable(DMA1_Stream6, 1);
 }
 
-void Serial_reset(void)
+void DMA1_Stream6_IRQHandler(void)
 {
+    PROBE_HI(PROBE_ISR_COMM);
+    dma_clear(DMA1, DMA_FLAG_TCIF6);
+    if (txPending) {
+        // the back buffer was committed while the previous frame drained, it's the one not being built
+        uartStartTx(uartBuffer[uartBack ^ 1], txPendingLen);
+        txPending = 0;
+    } else {
+        txActive = 0;           // the stream has disabled itself
+    }
+    PROBE_LO(PROBE_ISR_COMM);
+}
+
+void Serial_commitBuffer(void)
+{
+    if (uartPointer == 0 || uartOverflow) {
+        if (uartOverflow)
+            txDropped++;
+        uartPointer = 0;            // a truncated frame is worse than none
+        uartOverflow = 0;
+        return;
+    }
+    __disable_irq();
+    if (!txActive)
+        uartStartTx(uartBuffer[uartBack], uartPointer);
+    else {
+        txPending = 1;
+        txPendingLen = uartPointer;
+    }
+    uartBack ^= 1;
+    __enable_irq();
     uartPointer = 0;
 }
 
-#define RX_BUFFER_SIZE 48
-typedef struct ring_buffer
+uint8_t Serial_isTxBusy(void)
 {
-    unsigned char buffer[RX_BUFFER_SIZE];
-    int head;
-    int tail;
-} ring_buffer;
+    // busy only when both buffers are spoken for
+    return txPending;
+}
 
-static ring_buffer rx_buffer  =  { { 0, }, 0, 0 };
+uint8_t Serial_txIdle(void)
+{
+    return !txActive && usart_txDone(USART2);
+}
 
-/* __inline */ void store_char(unsigned char c, ring_buffer *rx_buffer)
+void Serial_reset(void)
 {
-    int i = (unsigned int)(rx_buffer->head + 1) % RX_BUFFER_SIZE;
+    uint32_t start = millis();
 
-    // if we should be storing the received character into the location
-    // just before the tail (meaning that the head would advance to the
-    // current location of the tail), we're about to overflow the buffer
-    // and so we don't write the character or advance the head.
-    if (i != rx_buffer->tail) {
-        rx_buffer->buffer[rx_buffer->head] = c;
-        rx_buffer->head = i;
+    // the buffer we're about to fill is still queued, give it a frame time to get onto the wire
+    while (txPending && millis() - start < 20);
+    if (txPending) {
+        // still stuck, drop the queued frame rather than overwrite the one on the wire
+        __disable_irq();
+        if (txPending) {
+            txPending = 0;
+            txDropped++;
+            uartBack ^= 1;
+        }
+        __enable_irq();
     }
+    uartPointer = 0;
+    uartOverflow = 0;
 }
 
 void Serial_begin(uint32_t speed)
 {
+    USART_InitTypeDef USART_InitStructure;
+    DMA_InitTypeDef DMA_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    gpio_af(GPIOA, GPIO_Pin_2, GPIO_PinSource2, GPIO_AF_USART2, GPIO_OType_PP, GPIO_PuPd_NOPULL);
+    gpio_af(GPIOA, GPIO_Pin_3, GPIO_PinSource3, GPIO_AF_USART2, GPIO_OType_PP, GPIO_PuPd_UP);
+
+    USART_InitStructure.USART_BaudRate = speed;
+    USART_InitStructure.USART_WordLength = USART_WordLength_8b;
+    USART_InitStructure.USART_StopBits = USART_StopBits_1;
+    USART_InitStructure.USART_Parity = USART_Parity_No;
+    USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
+    USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
+    USART_Init(USART2, &USART_InitStructure);
+
+    // TX: normal mode, direct (no FIFO), address and length are set per frame
+    DMA_DeInit(DMA1_Stream6);
+    DMA_StructInit(&DMA_InitStructure);
+    DMA_InitStructure.DMA_Channel = DMA_Channel_4;
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&USART2->DR;
+    DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)uartBuffer[0];
+    DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+    DMA_InitStructure.DMA_BufferSize = 1;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
+    DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+    DMA_Init(DMA1_Stream6, &DMA_InitStructure);
+    DMA_ITConfig(DMA1_Stream6, DMA_IT_TC, ENABLE);
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Stream6_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_DMA;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+    NVIC_InitStructure.NVIC_IRQChannel = USART2_IRQn;
+    NVIC_Init(&NVIC_InitStructure);
 
+    USART_DMACmd(USART2, USART_DMAReq_Tx, ENABLE);
+    USART_ITConfig(USART2, USART_IT_RXNE, ENABLE);
+    USART_Cmd(USART2, ENABLE);
+}
+
+void USART2_IRQHandler(void)
+{
+    PROBE_HI(PROBE_ISR_COMM);
+    // reading DR clears RXNE (and ORE)
+    ring_put(&rxRing, usart_get(USART2));
+    PROBE_LO(PROBE_ISR_COMM);
 }
 
 uint16_t Serial_available(void)
 {
-    return (uint16_t)(RX_BUFFER_SIZE + rx_buffer.head - rx_buffer.tail) % RX_BUFFER_SIZE;
+    return ring_count(&rxRing);
 }
 
 uint8_t Serial_read(void)
 {
-    // if the head isn't ahead of the tail, we don't have any characters
-    if (rx_buffer.head == rx_buffer.tail) {
+    if (ring_count(&rxRing) == 0)
         return -1;
+    return ring_get(&rxRing);
+}
+
+uint8_t Serial_peek(const uint8_t **data)
+{
+    return ring_peek(&rxRing, data);
+}
+
+void Serial_consume(uint8_t n)
+{
+    ring_skip(&rxRing, n);
+}
+
+uint16_t Serial_rxOverflow(void)
+{
+    return rxRing.overflow;
+}
+
+uint16_t Serial_txDropped(void)
+{
+    return txDropped;
+}
+
+/* USART3, RX only on PB11 for a serial receiver */
+static rcSerialCallback_t rcSerialRx;
+
+void rcSerial_init(uint32_t speed, uint8_t format, rcSerialCallback_t rx)
+{
+    USART_InitTypeDef USART_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    rcSerialRx = rx;
+
+    gpio_af(GPIOB, GPIO_Pin_11, GPIO_PinSource11, GPIO_AF_USART3, GPIO_OType_PP, GPIO_PuPd_UP);
+
+    USART_InitStructure.USART_BaudRate = speed;
+    if (format == RCSERIAL_8E2) {
+        // the word length counts the parity bit
+        USART_InitStructure.USART_WordLength = USART_WordLength_9b;
+        USART_InitStructure.USART_StopBits = USART_StopBits_2;
+        USART_InitStructure.USART_Parity = USART_Parity_Even;
     } else {
-        unsigned char c = rx_buffer.buffer[rx_buffer.tail];
-        rx_buffer.tail = (unsigned int)(rx_buffer.tail + 1) % RX_BUFFER_SIZE;
-        return c;
+        USART_InitStructure.USART_WordLength = USART_WordLength_8b;
+        USART_InitStructure.USART_StopBits = USART_StopBits_1;
+        USART_InitStructure.USART_Parity = USART_Parity_No;
     }
+    USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
+    USART_InitStructure.USART_Mode = USART_Mode_Rx;
+    USART_Init(USART3, &USART_InitStructure);
+
+    NVIC_InitStructure.NVIC_IRQChannel = USART3_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_CAPTURE;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    USART_ITConfig(USART3, USART_IT_RXNE, ENABLE);
+    USART_Cmd(USART3, ENABLE);
+}
+
+void USART3_IRQHandler(void)
+{
+    // reading SR then DR clears RXNE and the error flags
+    uint16_t sr = USART3->SR;
+    uint8_t c = usart_get(USART3);
+
+    PROBE_HI(PROBE_ISR_COMM);
+    if (rcSerialRx && !(sr & (USART_FLAG_PE | USART_FLAG_FE)))
+        rcSerialRx(c);
+    PROBE_LO(PROBE_ISR_COMM);
+}
+
+#if defined(GPS_PORT)
+/* the GPS takes the same RX pin, gpsTask() drains the ring */
+static uint8_t gpsBuffer[128];
+static ring_t gpsRing = RING_INIT(gpsBuffer);
+
+static void gpsReceive(uint8_t c)
+{
+    ring_put(&gpsRing, c);
+}
+
+void gpsSerial_init(uint32_t speed)
+{
+    rcSerial_init(speed, RCSERIAL_8N1, gpsReceive);
+}
+
+uint8_t gpsSerial_available(void)
+{
+    return ring_count(&gpsRing);
+}
+
+uint8_t gpsSerial_read(void)
+{
+    return ring_get(&gpsRing);
+}
+
+uint16_t gpsSerial_rxOverflow(void)
+{
+    return gpsRing.overflow;
+}
+#endif
+
+
+volatile uint32_t runMillis = 0;
+
+/* TIMING */
+/* The timebase is the DWT cycle counter, CYCCNT, which counts core clocks from when systick_init() starts it.
+   SysTick interrupts every SYSTICK_RELOAD_VAL + 1 cycles of the same clock, so the handler keeps the counter
+   value of the last millisecond edge by adding, without reading anything, and micros() is the milliseconds
+   plus the cycles since that edge. That stays monotonic when the tick is held off by a masked section: the
+   cycles since the edge just run past a millisecond */
+#define SYSTICK_RELOAD_VAL      167999 /* takes a cycle to reload */
+#define US_PER_MS               1000
+// 2^32 / CYCLES_PER_US rounded up, so (cycles * US_PER_CYCLE_Q32) >> 32 is the exact quotient below 2^32 / CYCLES_PER_US
+#define US_PER_CYCLE_Q32        ((uint32_t)((0x100000000ULL + CYCLES_PER_US - 1) / CYCLES_PER_US))
+
+#define SYSTICK_CSR_ENABLE              BIT(0)
+#define SYSTICK_CSR_CLKSOURCE_CORE      BIT(2)
+#define SYSTICK_CSR_TICKINT_PEND        BIT(1)
+
+#define DEMCR                   (*(volatile uint32_t *)0xE000EDFC)
+#define DEMCR_TRCENA            BIT(24)
+#define DWT_CTRL                (*(volatile uint32_t *)0xE0001000)
+#define DWT_CTRL_CYCCNTENA      BIT(0)
+#define DWT_CYCCNT              (*(volatile uint32_t *)0xE0001004)
+
+static volatile uint32_t tickCycles;    // CYCCNT at the last millisecond edge
+
+static void systick_init(void)
+{
+    volatile unsigned int *SYSTICK_CSR = (int *)0xE000E010;
+    volatile unsigned int *SYSTICK_RVR = (int *)0xE000E014;
+    volatile unsigned int *SYSTICK_CVR = (int *)0xE000E018;
+
+    // the DWT is part of the debug unit, it only counts with trace enabled
+    DEMCR |= DEMCR_TRCENA;
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+
+    *SYSTICK_RVR = SYSTICK_RELOAD_VAL;
+    *SYSTICK_CVR = 0;
+    tickCycles = DWT_CYCCNT;
+    *SYSTICK_CSR = (SYSTICK_CSR_CLKSOURCE_CORE | SYSTICK_CSR_ENABLE | SYSTICK_CSR_TICKINT_PEND);
+    NVIC_SetPriority(SysTick_IRQn, IRQ_PRIO_TICK);
+}
+
+#if defined(LOOP_ISR)
+/* Inner loop interrupt. EXTI1 has no pin behind it (its mask bit stays clear), the NVIC line is only ever pended
+   by software: every loopIsrPeriod ticks from the SysTick, or loopIsr_pend() of the gyro frames */
+static loopTickCallback_t loopIsrTick;
+static uint8_t loopIsrPeriod, loopIsrCount;
+
+void loopIsr_init(uint8_t periodMs, loopTickCallback_t tick)
+{
+    loopIsrTick = tick;
+    loopIsrPeriod = periodMs;
+    NVIC_SetPriority(EXTI1_IRQn, IRQ_PRIO_LOOP);
+    NVIC_EnableIRQ(EXTI1_IRQn);
+}
+
+void loopIsr_pend(void)
+{
+    NVIC_SetPendingIRQ(EXTI1_IRQn);
+}
+
+void loopIsr_idle(void)
+{
+    __WFI();
+}
+
+void EXTI1_IRQHandler(void)
+{
+    loopIsrTick();
+}
+#endif
+
+void SysTick_Handler(void)
+{
+    PROBE_HI(PROBE_ISR_COMM);
+    tickCycles += SYSTICK_RELOAD_VAL + 1;
+    runMillis++;
+#if defined(LOOP_ISR)
+    if (loopIsrPeriod && ++loopIsrCount >= loopIsrPeriod) {
+        loopIsrCount = 0;
+        loopIsr_pend();
+    }
+#endif
+    PROBE_LO(PROBE_ISR_COMM);
+}
+
+uint32_t millis(void)
+{
+    return runMillis;
+}
+
+uint32_t cycles(void)
+{
+    return DWT_CYCCNT;
 }
 
-/* TIMING - TODO Systick */
 uint32_t micros(void)
 {
+    uint32_t ms;
+    uint32_t since;
+
+    // the handler writes tickCycles before runMillis, a tick in between shows up as a changed runMillis
+    do {
+        ms = runMillis;
+        since = DWT_CYCCNT - tickCycles;
+    } while (ms != runMillis);
+
+    return ms * US_PER_MS + (uint32_t)(((uint64_t)since * US_PER_CYCLE_Q32) >> 32);
+}
+
+uint32_t microsISR(void)
+{
+    // micros() doesn't mask interrupts on Cortex-M, so it's safe to use from a handler
+    return micros();
+}
+
+#if defined(SWO_TRACE)
+#include "swotrace.h"
+
+// PB3 AF0 is TRACESWO, the F4DISCOVERY's ST-LINK reads it
+static void trace_init(void)
+{
+    gpio_af(GPIOB, GPIO_Pin_3, GPIO_PinSource3, GPIO_AF_SWJ, GPIO_OType_PP, GPIO_PuPd_NOPULL);
+    DBGMCU->CR = (DBGMCU->CR & ~(BIT(6) | BIT(7))) | BIT(5);   // TRACE_IOEN, TRACE_MODE asynchronous
+    swoStart(SystemCoreClock);
+}
+#endif
 
+uint16_t irq_latencyMax(uint8_t source)
+{
+    return 0;               // not measured here
 }
 
 void delay(uint16_t ms)
 {
+    // flash wait states and the ART accelerator make a counted loop unpredictable here, poll the clock instead
+    uint32_t start = micros();
+
+    while (micros() - start < (uint32_t)ms * US_PER_MS);
+}
+
+/* ADC: ADC1 scanning continuously into adcSamples[] over DMA2 stream 0, so analogRead() is just a load.
+   Channel n of analogRead() is adcChannel[n] */
+static const uint8_t adcChannel[] = {
+    ADC_Channel_11,     // PC1 battery divider (V_BATPIN)
+    ADC_Channel_12,     // PC2 current sensor (PSENSORPIN)
+};
+#define ADC_CHANNELS (sizeof(adcChannel) / sizeof(adcChannel[0]))
+
+static volatile uint16_t adcSamples[ADC_CHANNELS];
+
+static void adc_init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    DMA_InitTypeDef DMA_InitStructure;
+    ADC_CommonInitTypeDef ADC_CommonInitStructure;
+    ADC_InitTypeDef ADC_InitStructure;
+    uint8_t i;
+
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_1 | GPIO_Pin_2;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AN;
+    GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
+    GPIO_Init(GPIOC, &GPIO_InitStructure);
 
+    DMA_DeInit(DMA2_Stream0);
+    DMA_StructInit(&DMA_InitStructure);
+    DMA_InitStructure.DMA_Channel = DMA_Channel_0;
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&ADC1->DR;
+    DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)adcSamples;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralToMemory;
+    DMA_InitStructure.DMA_BufferSize = ADC_CHANNELS;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+    DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+    DMA_Init(DMA2_Stream0, &DMA_InitStructure);
+    DMA_Cmd(DMA2_Stream0, ENABLE);
+
+    ADC_CommonStructInit(&ADC_CommonInitStructure);
+    ADC_CommonInitStructure.ADC_Mode = ADC_Mode_Independent;
+    ADC_CommonInitStructure.ADC_Prescaler = ADC_Prescaler_Div4;    // 21MHz
+    ADC_CommonInit(&ADC_CommonInitStructure);
+
+    ADC_StructInit(&ADC_InitStructure);
+    ADC_InitStructure.ADC_Resolution = ADC_Resolution_12b;
+    ADC_InitStructure.ADC_ScanConvMode = ENABLE;
+    ADC_InitStructure.ADC_ContinuousConvMode = ENABLE;
+    ADC_InitStructure.ADC_ExternalTrigConvEdge = ADC_ExternalTrigConvEdge_None;
+    ADC_InitStructure.ADC_DataAlign = ADC_DataAlign_Right;
+    ADC_InitStructure.ADC_NbrOfConversion = ADC_CHANNELS;
+    ADC_Init(ADC1, &ADC_InitStructure);
+
+    // slow, high impedance dividers: the longest sample time, 480 + 12 cycles is 23us per channel
+    for (i = 0; i < ADC_CHANNELS; i++)
+        ADC_RegularChannelConfig(ADC1, adcChannel[i], i + 1, ADC_SampleTime_480Cycles);
+    ADC_DMARequestAfterLastTransferCmd(ADC1, ENABLE);
+    ADC_DMACmd(ADC1, ENABLE);
+    ADC_Cmd(ADC1, ENABLE);
+
+    ADC_SoftwareStartConv(ADC1);
 }
 
 uint16_t analogRead(uint8_t channel)
 {
-    return 0;
+    if (channel >= ADC_CHANNELS)
+        return 0;
+    return adcSamples[channel];
 }
 
 void analogWrite(uint8_t pin, uint16_t value)
@@ -109,58 +611,1574 @@ void pinMode(uint8_t pin, uint8_t mode)
 
 }
 
-void eeprom_open(void)
+#if defined(BLACKBOX_SD)
+/* SD card on the SDIO, 400kHz on one data line for the identification, then 24MHz on four. The SDIO kernel clock
+   is the 48MHz PLL Q output. Data goes through DMA2 stream 3 channel 4 in 16 byte bursts with the SDIO as the flow
+   controller. Commands are sent and their responses waited for in place, a few us at 24MHz. The data phase, the
+   stop and the card programming a write are polled from sdcard_busy(), so nothing waits for the card itself */
+#define SD_INIT_DIV         118         // 48MHz / (div + 2): 400kHz
+#define SD_FAST_DIV         0           // 24MHz
+#define SD_DMA              DMA2_Stream3
+#define SD_DMA_FLAGS        (DMA_FLAG_FEIF3 | DMA_FLAG_DMEIF3 | DMA_FLAG_TEIF3 | DMA_FLAG_HTIF3 | DMA_FLAG_TCIF3)
+#define SD_DATA_ERRORS      (SDIO_FLAG_DCRCFAIL | SDIO_FLAG_DTIMEOUT | SDIO_FLAG_TXUNDERR | SDIO_FLAG_RXOVERR | SDIO_FLAG_STBITERR)
+#define SD_R1_ERRORS        0xFDFFE008  // card status bits that mean the command failed
+#define SD_STATE_TRAN       4
+#define SD_PROGRAM_MAX      500000      // us a card may stay busy after a write before it counts as failed
+
+enum { SD_IDLE = 0, SD_DATA, SD_PROGRAM };
+static uint8_t sdState = SD_IDLE;
+static uint8_t sdMulti;                 // CMD18/CMD25, ended with CMD12
+static uint8_t sdBlockAddressed;        // SDHC and SDXC take sector numbers, SDSC byte addresses
+static uint16_t sdRca;
+static uint16_t sdErrors = 0;
+static uint32_t sdSince;                // micros() the programming wait started
+
+// 1 when the response came and, for an R1, reports no error. R3 (ACMD41) carries no CRC
+static uint8_t sdCommand(uint8_t index, uint32_t arg, uint32_t response)
 {
+    SDIO_CmdInitTypeDef cmd;
+    uint32_t status, t = micros();
 
+    SDIO_ClearFlag(SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CTIMEOUT | SDIO_FLAG_CMDREND | SDIO_FLAG_CMDSENT);
+    cmd.SDIO_Argument = arg;
+    cmd.SDIO_CmdIndex = index;
+    cmd.SDIO_Response = response;
+    cmd.SDIO_Wait = SDIO_Wait_No;
+    cmd.SDIO_CPSM = SDIO_CPSM_Enable;
+    SDIO_SendCommand(&cmd);
+    for (;;) {
+        status = SDIO->STA;
+        if (response == SDIO_Response_No ? (status & SDIO_FLAG_CMDSENT) : (status & (SDIO_FLAG_CMDREND | SDIO_FLAG_CCRCFAIL)))
+            break;
+        if ((status & SDIO_FLAG_CTIMEOUT) || micros() - t > 1000)
+            return 0;
+    }
+    if (response == SDIO_Response_No || index == 41)
+        return 1;
+    if (status & SDIO_FLAG_CCRCFAIL)
+        return 0;
+    if (response == SDIO_Response_Short && index != 3 && index != 8)
+        return !(SDIO->RESP1 & SD_R1_ERRORS);
+    return 1;
 }
 
-void eeprom_read_block (void *dst, const void *src, size_t n)
+uint32_t sdcard_init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    SDIO_InitTypeDef SDIO_InitStructure;
+    uint32_t ocr = 0, csd1, csd2, sectors;
+    uint16_t i;
+    uint8_t v2;
+
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_SDIO, ENABLE);
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+    GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+    GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_UP;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_8 | GPIO_Pin_9 | GPIO_Pin_10 | GPIO_Pin_11 | GPIO_Pin_12;
+    GPIO_Init(GPIOC, &GPIO_InitStructure);
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_2;
+    GPIO_Init(GPIOD, &GPIO_InitStructure);
+    GPIO_PinAFConfig(GPIOC, GPIO_PinSource8, GPIO_AF_SDIO);
+    GPIO_PinAFConfig(GPIOC, GPIO_PinSource9, GPIO_AF_SDIO);
+    GPIO_PinAFConfig(GPIOC, GPIO_PinSource10, GPIO_AF_SDIO);
+    GPIO_PinAFConfig(GPIOC, GPIO_PinSource11, GPIO_AF_SDIO);
+    GPIO_PinAFConfig(GPIOC, GPIO_PinSource12, GPIO_AF_SDIO);
+    GPIO_PinAFConfig(GPIOD, GPIO_PinSource2, GPIO_AF_SDIO);
+
+    SDIO_DeInit();
+    SDIO_InitStructure.SDIO_ClockDiv = SD_INIT_DIV;
+    SDIO_InitStructure.SDIO_ClockEdge = SDIO_ClockEdge_Rising;
+    SDIO_InitStructure.SDIO_ClockBypass = SDIO_ClockBypass_Disable;
+    SDIO_InitStructure.SDIO_ClockPowerSave = SDIO_ClockPowerSave_Disable;
+    SDIO_InitStructure.SDIO_BusWide = SDIO_BusWide_1b;
+    SDIO_InitStructure.SDIO_HardwareFlowControl = SDIO_HardwareFlowControl_Disable;
+    SDIO_Init(&SDIO_InitStructure);
+    SDIO_SetPowerState(SDIO_PowerState_ON);
+    SDIO_ClockCmd(ENABLE);
+    delay(2);                           // the 74 clocks a card wants before its first command
+
+    sdCommand(0, 0, SDIO_Response_No);
+    v2 = sdCommand(8, 0x1AA, SDIO_Response_Short) && (SDIO->RESP1 & 0xFFF) == 0x1AA;
+    // ACMD41 until the card is out of its power up, a second at most. HCS only to the cards that know CMD8
+    for (i = 0; i < 1000 && !(ocr & BIT(31)); i++) {
+        if (i)
+            delay(1);
+        if (!sdCommand(55, 0, SDIO_Response_Short) || !sdCommand(41, 0x00FF8000 | (v2 ? BIT(30) : 0), SDIO_Response_Short))
+            return 0;
+        ocr = SDIO->RESP1;
+    }
+    if (!(ocr & BIT(31)))
+        return 0;
+    sdBlockAddressed = (ocr & BIT(30)) != 0;
+    if (!sdCommand(2, 0, SDIO_Response_Long) || !sdCommand(3, 0, SDIO_Response_Short))
+        return 0;
+    sdRca = SDIO->RESP1 >> 16;
+    if (!sdCommand(9, (uint32_t)sdRca << 16, SDIO_Response_Long))
+        return 0;
+    // the CSD, bits 127..96 in RESP1 down to 31..1 in RESP4
+    csd1 = SDIO->RESP2;
+    csd2 = SDIO->RESP3;
+    if (SDIO->RESP1 >> 30 == 1)         // CSD 2.0: C_SIZE [69:48] in 512K units
+        sectors = (((csd1 & 0x3F) << 16 | csd2 >> 16) + 1) << 10;
+    else                                // CSD 1.0: C_SIZE [73:62], C_SIZE_MULT [49:47], READ_BL_LEN [83:80]
+        sectors = (((csd1 & 0x3FF) << 2 | csd2 >> 30) + 1) << (((csd2 >> 15) & 7) + 2) << ((csd1 >> 16) & 0xF) >> 9;
+    if (!sdCommand(7, (uint32_t)sdRca << 16, SDIO_Response_Short)
+        || !sdCommand(55, (uint32_t)sdRca << 16, SDIO_Response_Short) || !sdCommand(6, 2, SDIO_Response_Short))
+        return 0;
+    if (!sdBlockAddressed && !sdCommand(16, 512, SDIO_Response_Short))
+        return 0;
+    SDIO_InitStructure.SDIO_ClockDiv = SD_FAST_DIV;
+    SDIO_InitStructure.SDIO_BusWide = SDIO_BusWide_4b;
+    SDIO_Init(&SDIO_InitStructure);
+    SDIO_DMACmd(ENABLE);
+    return sectors;
+}
+
+static uint8_t sdTransfer(uint32_t sector, uint8_t *buf, uint16_t count, uint8_t write)
+{
+    DMA_InitTypeDef DMA_InitStructure;
+    SDIO_DataInitTypeDef SDIO_DataInitStructure;
+    uint32_t address = sdBlockAddressed ? sector : sector * 512;
+    uint8_t cmd;
+
+    if (sdcard_busy())
+        return 0;
+    DMA_Cmd(SD_DMA, DISABLE);
+    while (SD_DMA->CR & DMA_SxCR_EN);
+    DMA_ClearFlag(SD_DMA, SD_DMA_FLAGS);
+    DMA_InitStructure.DMA_Channel = DMA_Channel_4;
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&SDIO->FIFO;
+    DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)buf;
+    DMA_InitStructure.DMA_DIR = write ? DMA_DIR_MemoryToPeripheral : DMA_DIR_PeripheralToMemory;
+    DMA_InitStructure.DMA_BufferSize = 1;       // the SDIO ends the transfer
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
+    DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Enable;
+    DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+    DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_INC4;
+    DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_INC4;
+    DMA_Init(SD_DMA, &DMA_InitStructure);
+    DMA_FlowControllerConfig(SD_DMA, DMA_FlowCtrl_Peripheral);
+    DMA_Cmd(SD_DMA, ENABLE);
+
+    SDIO_ClearFlag(SDIO_STATIC_FLAGS);
+    SDIO_DataInitStructure.SDIO_DataTimeOut = 24000000 / 4;    // SDIO_CK periods, 250ms
+    SDIO_DataInitStructure.SDIO_DataLength = (uint32_t)count * 512;
+    SDIO_DataInitStructure.SDIO_DataBlockSize = SDIO_DataBlockSize_512b;
+    SDIO_DataInitStructure.SDIO_TransferDir = write ? SDIO_TransferDir_ToCard : SDIO_TransferDir_ToSDIO;
+    SDIO_DataInitStructure.SDIO_TransferMode = SDIO_TransferMode_Block;
+    SDIO_DataInitStructure.SDIO_DPSM = SDIO_DPSM_Enable;
+    sdMulti = count > 1;
+    cmd = write ? (sdMulti ? 25 : 24) : (sdMulti ? 18 : 17);
+    // a read has the data path waiting before the command, a write follows the command's response
+    if (!write)
+        SDIO_DataConfig(&SDIO_DataInitStructure);
+    if (!sdCommand(cmd, address, SDIO_Response_Short)) {
+        sdErrors++;
+        SDIO->DCTRL = 0;
+        DMA_Cmd(SD_DMA, DISABLE);
+        return 1;
+    }
+    if (write)
+        SDIO_DataConfig(&SDIO_DataInitStructure);
+    sdState = SD_DATA;
+    return 1;
+}
+
+uint8_t sdcard_read(uint32_t sector, uint8_t *buf, uint16_t count)
+{
+    return sdTransfer(sector, buf, count, 0);
+}
+
+uint8_t sdcard_write(uint32_t sector, const uint8_t *buf, uint16_t count)
+{
+    return sdTransfer(sector, (uint8_t *)buf, count, 1);
+}
+
+uint8_t sdcard_busy(void)
+{
+    uint32_t status;
+
+    if (sdState == SD_DATA) {
+        status = SDIO->STA;
+        // a read is only in memory once the DMA has emptied its FIFO
+        if (!(status & SD_DATA_ERRORS) && (!(status & SDIO_FLAG_DATAEND) || (SD_DMA->CR & DMA_SxCR_EN)))
+            return 1;
+        if (status & SD_DATA_ERRORS)
+            sdErrors++;
+        SDIO_ClearFlag(SDIO_STATIC_FLAGS);
+        if (sdMulti)
+            sdCommand(12, 0, SDIO_Response_Short);
+        sdState = SD_PROGRAM;
+        sdSince = micros();
+    }
+    if (sdState == SD_PROGRAM) {
+        // back in the transfer state and ready for data: the card has what was written
+        if (!sdCommand(13, (uint32_t)sdRca << 16, SDIO_Response_Short)) {
+            sdErrors++;
+        } else if ((SDIO->RESP1 >> 9 & 0xF) != SD_STATE_TRAN || !(SDIO->RESP1 & BIT(8))) {
+            if (micros() - sdSince < SD_PROGRAM_MAX)
+                return 1;
+            sdErrors++;
+        }
+        sdState = SD_IDLE;
+    }
+    return 0;
+}
+
+uint16_t sdcard_errors(void)
 {
+    return sdErrors;
+}
+#endif
+
+#if defined(CAN_BUS)
+/* CAN1, 14 time quanta a bit off the 42MHz APB1, sampled at 12/14. The one filter bank takes every id into FIFO 0.
+   can_send() only queues and pends the TX interrupt, which is the only place mailboxes are loaded, so the
+   queue has one writer on each side and nothing masks interrupts. Automatic retransmission stays on: a motor
+   frame that lost arbitration goes out right after the frame that won */
+#define CAN_TX_QUEUE            8               // powers of 2
+#define CAN_RX_QUEUE            16
+#define CAN_TSR_TME             (CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2)
+
+static canFrame_t canTx[CAN_TX_QUEUE], canRx[CAN_RX_QUEUE];
+static volatile uint8_t canTxHead = 0, canTxTail = 0;   // free running, head main loop, tail interrupt
+static volatile uint8_t canRxHead = 0, canRxTail = 0;   // head interrupt, tail main loop
+static uint16_t canTxDropped = 0, canRxOverflow = 0;
+
+void can_init(uint32_t bitrate)
+{
+    CAN_InitTypeDef CAN_InitStructure;
+    CAN_FilterInitTypeDef CAN_FilterInitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_CAN1, ENABLE);
+    gpio_af(GPIOD, GPIO_Pin_0, GPIO_PinSource0, GPIO_AF_CAN1, GPIO_OType_PP, GPIO_PuPd_UP);
+    gpio_af(GPIOD, GPIO_Pin_1, GPIO_PinSource1, GPIO_AF_CAN1, GPIO_OType_PP, GPIO_PuPd_NOPULL);
+
+    CAN_DeInit(CAN1);
+    CAN_StructInit(&CAN_InitStructure);
+    CAN_InitStructure.CAN_ABOM = ENABLE;        // back on after 128 x 11 recessive bits
+    CAN_InitStructure.CAN_TXFP = ENABLE;        // mailboxes in the order they were loaded, not by id
+    CAN_InitStructure.CAN_Mode = CAN_Mode_Normal;
+    CAN_InitStructure.CAN_SJW = CAN_SJW_1tq;
+    CAN_InitStructure.CAN_BS1 = CAN_BS1_11tq;
+    CAN_InitStructure.CAN_BS2 = CAN_BS2_2tq;
+    CAN_InitStructure.CAN_Prescaler = 42000000 / 14 / bitrate;
+    CAN_Init(CAN1, &CAN_InitStructure);
+
+    CAN_FilterInitStructure.CAN_FilterNumber = 0;
+    CAN_FilterInitStructure.CAN_FilterMode = CAN_FilterMode_IdMask;
+    CAN_FilterInitStructure.CAN_FilterScale = CAN_FilterScale_32bit;
+    CAN_FilterInitStructure.CAN_FilterIdHigh = 0;
+    CAN_FilterInitStructure.CAN_FilterIdLow = 0;
+    CAN_FilterInitStructure.CAN_FilterMaskIdHigh = 0;
+    CAN_FilterInitStructure.CAN_FilterMaskIdLow = 0;
+    CAN_FilterInitStructure.CAN_FilterFIFOAssignment = CAN_Filter_FIFO0;
+    CAN_FilterInitStructure.CAN_FilterActivation = ENABLE;
+    CAN_FilterInit(&CAN_FilterInitStructure);
+
+    NVIC_InitStructure.NVIC_IRQChannel = CAN1_TX_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_BUS;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+    NVIC_InitStructure.NVIC_IRQChannel = CAN1_RX0_IRQn;
+    NVIC_Init(&NVIC_InitStructure);
 
+    CAN_ITConfig(CAN1, CAN_IT_TME | CAN_IT_FMP0 | CAN_IT_FOV0, ENABLE);
+}
+
+uint8_t can_send(const canFrame_t *frame)
+{
+    uint8_t head = canTxHead;
+
+    if ((uint8_t)(head - canTxTail) >= CAN_TX_QUEUE) {
+        canTxDropped++;
+        return 0;
+    }
+    canTx[head & (CAN_TX_QUEUE - 1)] = *frame;
+    canTxHead = head + 1;
+    NVIC_SetPendingIRQ(CAN1_TX_IRQn);
+    return 1;
+}
+
+// a mailbox done (or a frame queued): every empty mailbox gets a frame from the queue
+void CAN1_TX_IRQHandler(void)
+{
+    CanTxMsg msg;
+    canFrame_t *f;
+    uint8_t tail = canTxTail;
+
+    CAN1->TSR = CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2;
+    while (tail != canTxHead && (CAN1->TSR & CAN_TSR_TME)) {
+        f = &canTx[tail++ & (CAN_TX_QUEUE - 1)];
+        msg.StdId = f->id;
+        msg.IDE = CAN_Id_Standard;
+        msg.RTR = CAN_RTR_Data;
+        msg.DLC = f->len;
+        memcpy(msg.Data, f->data, 8);
+        CAN_Transmit(CAN1, &msg);
+    }
+    canTxTail = tail;
+}
+
+void CAN1_RX0_IRQHandler(void)
+{
+    CanRxMsg msg;
+    canFrame_t *f;
+    uint8_t head = canRxHead;
+
+    PROBE_HI(PROBE_ISR_COMM);
+    if (CAN1->RF0R & CAN_RF0R_FOVR0) {
+        CAN1->RF0R = CAN_RF0R_FOVR0;
+        canRxOverflow++;
+    }
+    while (CAN1->RF0R & CAN_RF0R_FMP0) {
+        CAN_Receive(CAN1, CAN_FIFO0, &msg);     // releases the FIFO slot
+        if (msg.IDE != CAN_Id_Standard || msg.RTR != CAN_RTR_Data)
+            continue;
+        if ((uint8_t)(head - canRxTail) >= CAN_RX_QUEUE) {
+            canRxOverflow++;
+            continue;
+        }
+        f = &canRx[head++ & (CAN_RX_QUEUE - 1)];
+        f->id = msg.StdId;
+        f->len = msg.DLC;
+        memcpy(f->data, msg.Data, 8);
+    }
+    canRxHead = head;
+    PROBE_LO(PROBE_ISR_COMM);
+}
+
+uint8_t can_receive(canFrame_t *frame)
+{
+    uint8_t tail = canRxTail;
+
+    if (tail == canRxHead)
+        return 0;
+    *frame = canRx[tail & (CAN_RX_QUEUE - 1)];
+    canRxTail = tail + 1;
+    return 1;
+}
+
+void can_stats(canStats_t *stats)
+{
+    uint32_t esr = CAN1->ESR;
+
+    stats->txDropped = canTxDropped;
+    stats->rxOverflow = canRxOverflow;
+    stats->txErrors = esr >> 16;
+    stats->rxErrors = esr >> 24;
+    stats->busOff = !!(esr & CAN_ESR_BOFF);
+}
+#endif
+
+/* EEPROM in the last 128K flash sector of the 1M F407VG, which nothing else may be placed in. Same contract as
+   the STM32F1: halfwords go straight into erased flash, the parameter log only appends. An erase takes the whole
+   sector, 1-2s, so eeprom_erase() is slow, but the log only calls it when it runs out of room */
+#define EEPROM_PAGE     ((uint32_t)0x080E0000)     // sector 11
+#define EEPROM_SECTOR   FLASH_Sector_11
+#define EEPROM_SIZE     2048
+
+void eeprom_open(void)
+{
+    FLASH_Unlock();
+    FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+}
+
+void eeprom_read_block (void *dst, const void *src, size_t n)
+{
+    memcpy(dst, (const uint8_t *)EEPROM_PAGE + (uint32_t)src, n);
 }
 
 void eeprom_write_block(const void *src, void *dst, size_t n)
 {
+    const uint8_t *data = (const uint8_t *)src;
+    uint32_t address = EEPROM_PAGE + (uint32_t)dst;
+    uint16_t half;
+    size_t i;
 
+    if ((uint32_t)dst + n > EEPROM_SIZE)
+        return;
+    for (i = 0; i < n; i += 2) {
+        half = data[i] | (i + 1 < n ? data[i + 1] << 8 : 0xFF00);      // an odd tail stays erased
+        if (FLASH_ProgramHalfWord(address + i, half) != FLASH_COMPLETE)
+            break;
+    }
 }
 
 void eeprom_close(void)
 {
-    FLASH_Lock(FLASH_MEMTYPE_DATA);
+    FLASH_Lock();
+}
+
+#if defined(PARAM_IN_PLACE)
+const void *eeprom_map(const void *src, size_t n)
+{
+    return (const uint8_t *)EEPROM_PAGE + (uint32_t)src;
+}
+#endif
+
+uint16_t eeprom_size(void)
+{
+    return EEPROM_SIZE;
+}
+
+void eeprom_erase(void)
+{
+    FLASH_EraseSector(EEPROM_SECTOR, VoltageRange_3);
 }
 
 // ************************************************************************************************************
 // SPI general functions
 // ************************************************************************************************************
+/* SPI2 on PB13 (SCK), PB14 (MISO), PB15 (MOSI), the MPU6000 select on PB12 is set up here and driven through
+   its spiDevice_t. Clock and mode come from the device on every transaction: the MPU6000 takes register
+   access at 1MHz at most (656kHz here) and sensor bursts at 20MHz (10.5MHz). A burst runs on DMA straight into
+   the job's buffer: the command byte goes out by hand, then the RX stream (3) takes len bytes while the TX
+   stream (4) repeats one dummy byte. Queued bursts start from the RX stream's interrupt */
+#define SPI_CLOCK       42000000L       // APB1, the prescaler divides 2..256
+#define SPI_QUEUE_SIZE  4               // must be a power of 2
+
+#define DMA_STREAM3_FLAGS   (DMA_FLAG_TCIF3 | DMA_FLAG_HTIF3 | DMA_FLAG_TEIF3 | DMA_FLAG_DMEIF3 | DMA_FLAG_FEIF3)
+#define DMA_STREAM4_FLAGS   (DMA_FLAG_TCIF4 | DMA_FLAG_HTIF4 | DMA_FLAG_TEIF4 | DMA_FLAG_DMEIF4 | DMA_FLAG_FEIF4)
+
+static const uint8_t spiDummy = 0xFF;
+
 void spi_init(void)
 {
+    GPIO_InitTypeDef GPIO_InitStructure;
+    SPI_InitTypeDef SPI_InitStructure;
+    DMA_InitTypeDef DMA_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_12;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_OUT;
+    GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+    GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_Init(GPIOB, &GPIO_InitStructure);
+    digitalHi(GPIOB, GPIO_Pin_12);
+    gpio_af(GPIOB, GPIO_Pin_13, GPIO_PinSource13, GPIO_AF_SPI2, GPIO_OType_PP, GPIO_PuPd_NOPULL);
+    gpio_af(GPIOB, GPIO_Pin_14, GPIO_PinSource14, GPIO_AF_SPI2, GPIO_OType_PP, GPIO_PuPd_UP);
+    gpio_af(GPIOB, GPIO_Pin_15, GPIO_PinSource15, GPIO_AF_SPI2, GPIO_OType_PP, GPIO_PuPd_NOPULL);
+
+    SPI_I2S_DeInit(SPI2);
+    SPI_InitStructure.SPI_Direction = SPI_Direction_2Lines_FullDuplex;
+    SPI_InitStructure.SPI_Mode = SPI_Mode_Master;
+    SPI_InitStructure.SPI_DataSize = SPI_DataSize_8b;
+    SPI_InitStructure.SPI_CPOL = SPI_CPOL_High;
+    SPI_InitStructure.SPI_CPHA = SPI_CPHA_2Edge;
+    SPI_InitStructure.SPI_NSS = SPI_NSS_Soft;
+    SPI_InitStructure.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_256;   // spi_setup() sets it per device
+    SPI_InitStructure.SPI_FirstBit = SPI_FirstBit_MSB;
+    SPI_InitStructure.SPI_CRCPolynomial = 7;
+    SPI_Init(SPI2, &SPI_InitStructure);
+
+    // both streams in normal mode, addresses and counts are set per burst
+    DMA_DeInit(DMA1_Stream3);
+    DMA_DeInit(DMA1_Stream4);
+    DMA_StructInit(&DMA_InitStructure);
+    DMA_InitStructure.DMA_Channel = DMA_Channel_0;
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&SPI2->DR;
+    DMA_InitStructure.DMA_BufferSize = 1;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
+    DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+    DMA_InitStructure.DMA_Memory0BaseAddr = 0;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralToMemory;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_Init(DMA1_Stream3, &DMA_InitStructure);
+    DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)&spiDummy;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Disable;
+    DMA_Init(DMA1_Stream4, &DMA_InitStructure);
+    DMA_ITConfig(DMA1_Stream3, DMA_IT_TC, ENABLE);     // RX done is the end of the burst
 
+    SPI_Cmd(SPI2, ENABLE);
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Stream3_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_BUS;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
 }
 
-uint8_t spi_writeByte(uint8_t Data)
+static struct {
+    spiJob_t *queue[SPI_QUEUE_SIZE];
+    volatile uint8_t head;              // next free slot, written by spi_submit()
+    volatile uint8_t tail;              // job on the bus, advanced by the interrupt
+    spiJob_t * volatile job;            // current job, NULL when idle
+    uint8_t locked;                     // spi_command() has the bus, queued jobs wait
+} spiBus;
+
+static uint8_t spi_prescaler(uint32_t hz)
 {
-    return 0;
+    uint8_t br = 0;
+
+    while (br < 7 && (SPI_CLOCK >> (br + 1)) > hz)
+        br++;
+    return br;
 }
 
-uint8_t spi_readByte(void)
+void spi_device(spiDevice_t *dev)
 {
-    return 0;
+    dev->prescaler[0] = spi_prescaler(dev->slowHz);
+    dev->prescaler[1] = spi_prescaler(dev->fastHz);
+    dev->select(0);
+}
+
+// Only with chip select released, the clock line may change level
+static void spi_setup(spiDevice_t *dev, uint8_t fast)
+{
+    // BR may only change between transfers
+    while (SPI2->SR & SPI_I2S_FLAG_BSY);
+    SPI2->CR1 = (SPI2->CR1 & ~(SPI_CR1_BR | SPI_CR1_CPOL | SPI_CR1_CPHA)) | (dev->prescaler[fast] << 3) | (dev->mode & 0x03);
+}
+
+static uint8_t spi_byte(uint8_t data)
+{
+    while (!(SPI2->SR & SPI_I2S_FLAG_TXE));
+    SPI2->DR = data;
+    while (!(SPI2->SR & SPI_I2S_FLAG_RXNE));
+    return SPI2->DR;
+}
+
+// Only called from the DMA interrupt, or with interrupts masked
+static void spi_startNext(void)
+{
+    spiJob_t *job;
+
+    if (spiBus.job || spiBus.locked || spiBus.tail == spiBus.head)
+        return;
+    job = spiBus.job = spiBus.queue[spiBus.tail];
+    spi_setup(job->dev, 1);
+    job->dev->select(1);
+    (void)SPI2->DR;                     // drop anything left over from spi_command()
+    spi_byte(job->cmd);                 // what comes back with the command is garbage
+
+    dma_clear(DMA1, DMA_STREAM3_FLAGS);
+    dma_clear(DMA1, DMA_STREAM4_FLAGS);
+    DMA1_Stream3->M0AR = (uint32_t)job->buf;
+    dma_setCount(DMA1_Stream3, job->len);
+    dma_setCount(DMA1_Stream4, job->len);
+    dma_enable(DMA1_Stream3, 1);        // RX first, it must be ready for the first byte the TX stream clocks
+    dma_enable(DMA1_Stream4, 1);
+    SPI_I2S_DMACmd(SPI2, SPI_I2S_DMAReq_Rx | SPI_I2S_DMAReq_Tx, ENABLE);
+}
+
+uint8_t spi_command(spiDevice_t *dev, uint8_t cmd, uint8_t data)
+{
+#if defined(LOOP_ISR)
+    uint32_t basepri = __get_BASEPRI();
+
+    // the inner loop interrupt would spin on its burst behind the lock forever, hold it off for the two bytes
+    __set_BASEPRI(IRQ_PRIO_LOOP << (8 - __NVIC_PRIO_BITS));
+#endif
+    __disable_irq();
+    spiBus.locked = 1;
+    __enable_irq();
+    while (spiBus.job);                 // a burst already on the bus finishes first
+
+    spi_setup(dev, 0);
+    dev->select(1);
+    spi_byte(cmd);
+    data = spi_byte(data);
+    dev->select(0);
+
+    __disable_irq();
+    spiBus.locked = 0;
+    spi_startNext();
+    __enable_irq();
+#if defined(LOOP_ISR)
+    __set_BASEPRI(basepri);
+#endif
+    return data;
+}
+
+uint8_t spi_submit(spiJob_t *job)
+{
+    uint8_t next;
+
+    if (job->len == 0)
+        return 0;
+    __disable_irq();
+    next = (spiBus.head + 1) & (SPI_QUEUE_SIZE - 1);
+    if (job->busy || next == spiBus.tail) {
+        __enable_irq();
+        return 0;
+    }
+    job->busy = 1;
+    spiBus.queue[spiBus.head] = job;
+    spiBus.head = next;
+    spi_startNext();
+    __enable_irq();
+    return 1;
+}
+
+void spi_read(spiDevice_t *dev, uint8_t cmd, uint8_t *buf, uint8_t len)
+{
+    spiJob_t job;
+
+    job.dev = dev;
+    job.cmd = cmd;
+    job.buf = buf;
+    job.len = len;
+    job.done = NULL;
+    job.busy = 0;
+    while (!spi_submit(&job));
+    while (job.busy);
+}
+
+uint8_t spi_isBusy(void)
+{
+    return spiBus.job != NULL || spiBus.tail != spiBus.head;
+}
+
+void DMA1_Stream3_IRQHandler(void)
+{
+    spiJob_t *job = spiBus.job;
+
+    PROBE_HI(PROBE_ISR);
+    // both streams have disabled themselves, the last byte is in buf
+    dma_clear(DMA1, DMA_FLAG_TCIF3);
+    SPI_I2S_DMACmd(SPI2, SPI_I2S_DMAReq_Rx | SPI_I2S_DMAReq_Tx, DISABLE);
+    job->dev->select(0);
+    spiBus.job = NULL;
+    spiBus.tail = (spiBus.tail + 1) & (SPI_QUEUE_SIZE - 1);
+    job->busy = 0;
+    if (job->done)
+        job->done(job);
+    spi_startNext();
+    PROBE_LO(PROBE_ISR);
+}
+
+/* MPU6000 or ITG3200 INT on PC4, rising edge */
+static drdyCallback_t drdyReady;
+
+void drdy_init(drdyCallback_t ready)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    EXTI_InitTypeDef EXTI_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    drdyReady = ready;
+
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_4;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_IN;
+    GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
+    GPIO_Init(GPIOC, &GPIO_InitStructure);
+
+    SYSCFG_EXTILineConfig(EXTI_PortSourceGPIOC, EXTI_PinSource4);
+    EXTI_InitStructure.EXTI_Line = EXTI_Line4;
+    EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Interrupt;
+    EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Rising;
+    EXTI_InitStructure.EXTI_LineCmd = ENABLE;
+    EXTI_Init(&EXTI_InitStructure);
+
+    NVIC_InitStructure.NVIC_IRQChannel = EXTI4_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_DRDY;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+}
+
+void EXTI4_IRQHandler(void)
+{
+    PROBE_HI(PROBE_ISR);
+    EXTI_ClearITPendingBit(EXTI_Line4);
+    if (drdyReady)
+        drdyReady();
+    PROBE_LO(PROBE_ISR);
+}
+
+// PWM Functions
+/* Motors 1-4 on TIM1, outputs 5 and 6 on TIM8, both on the 168MHz APB2 timer clock so every ONESHOT_SCALE
+   divides it. The timers count at 1MHz, pwmWrite() takes microseconds as they are. Outputs 5 and 6 are the
+   servo pair when useServo is set and then run at the servo rate */
+static const struct {
+    TIM_TypeDef *tim;
+    uint8_t channel;
+    GPIO_TypeDef *gpio;
+    uint16_t pin;
+    uint8_t source;
+    uint8_t af;
+} pwmOutput[] = {
+    { TIM1, 1, GPIOE, GPIO_Pin_9, GPIO_PinSource9, GPIO_AF_TIM1 },
+    { TIM1, 2, GPIOE, GPIO_Pin_11, GPIO_PinSource11, GPIO_AF_TIM1 },
+    { TIM1, 3, GPIOE, GPIO_Pin_13, GPIO_PinSource13, GPIO_AF_TIM1 },
+    { TIM1, 4, GPIOE, GPIO_Pin_14, GPIO_PinSource14, GPIO_AF_TIM1 },
+    { TIM8, 1, GPIOC, GPIO_Pin_6, GPIO_PinSource6, GPIO_AF_TIM8 },
+    { TIM8, 2, GPIOC, GPIO_Pin_7, GPIO_PinSource7, GPIO_AF_TIM8 },
+};
+#define PWM_OUTPUTS (sizeof(pwmOutput) / sizeof(pwmOutput[0]))
+
+static volatile uint32_t *pwmCCR[PWM_OUTPUTS];
+
+// 1ms pulse width
+#define PULSE_1MS       (1000)
+// pulse period (400Hz)
+#define PULSE_PERIOD    (2500)
+// pulse period for digital servo (200Hz)
+#define PULSE_PERIOD_SERVO_DIGITAL  (5000)
+// pulse period for analog servo (50Hz)
+#define PULSE_PERIOD_SERVO_ANALOG  (20000)
+
+#if defined(MOTOR_ONESHOT)
+/* One pulse mode on the motor timers: pwmSync() starts them, they count to ONESHOT_PERIOD once and stop. The
+   output is high from CCR to the end, so pulses are end aligned and the line is low while stopped. Ticks are
+   1us / ONESHOT_SCALE, pwmWrite() still takes the 1000-2000 range */
+#define ONESHOT_PERIOD  (2200)          // longest pulse plus the lead in, in ticks
+#endif
+
+static uint8_t pwmServo;
+#ifdef DIGITAL_SERVO
+static uint16_t pwmServoPeriod = PULSE_PERIOD_SERVO_DIGITAL;
+#else
+static uint16_t pwmServoPeriod = PULSE_PERIOD_SERVO_ANALOG;
+#endif
+
+static void pwmTimerInit(TIM_TypeDef *tim, uint16_t period, uint16_t prescaler)
+{
+    TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure;
+
+    TIM_TimeBaseStructInit(&TIM_TimeBaseStructure);
+    TIM_TimeBaseStructure.TIM_Prescaler = prescaler - 1;
+    TIM_TimeBaseStructure.TIM_Period = period - 1;
+    TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+    TIM_TimeBaseInit(tim, &TIM_TimeBaseStructure);
+    TIM_ARRPreloadConfig(tim, ENABLE);
+}
+
+void pwmInit(uint8_t useServo)
+{
+    TIM_OCInitTypeDef TIM_OCInitStructure;
+    uint16_t servoPeriod = pwmServoPeriod;
+    uint8_t i;
+
+    pwmServo = useServo;
+#if defined(MOTOR_ONESHOT)
+    pwmTimerInit(TIM1, ONESHOT_PERIOD, 168 / ONESHOT_SCALE);
+    pwmTimerInit(TIM8, useServo ? servoPeriod : ONESHOT_PERIOD, useServo ? 168 : 168 / ONESHOT_SCALE);
+#else
+    pwmTimerInit(TIM1, PULSE_PERIOD, 168);
+    pwmTimerInit(TIM8, useServo ? servoPeriod : PULSE_PERIOD, 168);
+#endif
+
+    TIM_OCStructInit(&TIM_OCInitStructure);
+    TIM_OCInitStructure.TIM_OutputState = TIM_OutputState_Enable;
+    TIM_OCInitStructure.TIM_OCPolarity = TIM_OCPolarity_High;
+    TIM_OCInitStructure.TIM_OCIdleState = TIM_OCIdleState_Reset;
+
+    for (i = 0; i < PWM_OUTPUTS; i++) {
+        TIM_TypeDef *tim = pwmOutput[i].tim;
+
+#if defined(MOTOR_ONESHOT)
+        if (i < 4 || !useServo) {
+            TIM_OCInitStructure.TIM_OCMode = TIM_OCMode_PWM2;
+            TIM_OCInitStructure.TIM_Pulse = ONESHOT_PERIOD;
+        } else
+#endif
+        {
+            TIM_OCInitStructure.TIM_OCMode = TIM_OCMode_PWM1;
+            TIM_OCInitStructure.TIM_Pulse = PULSE_1MS;
+        }
+        gpio_af(pwmOutput[i].gpio, pwmOutput[i].pin, pwmOutput[i].source, pwmOutput[i].af, GPIO_OType_PP, GPIO_PuPd_DOWN);
+        switch (pwmOutput[i].channel) {
+        case 1:
+            TIM_OC1Init(tim, &TIM_OCInitStructure);
+            TIM_OC1PreloadConfig(tim, TIM_OCPreload_Enable);
+            pwmCCR[i] = &tim->CCR1;
+            break;
+        case 2:
+            TIM_OC2Init(tim, &TIM_OCInitStructure);
+            TIM_OC2PreloadConfig(tim, TIM_OCPreload_Enable);
+            pwmCCR[i] = &tim->CCR2;
+            break;
+        case 3:
+            TIM_OC3Init(tim, &TIM_OCInitStructure);
+            TIM_OC3PreloadConfig(tim, TIM_OCPreload_Enable);
+            pwmCCR[i] = &tim->CCR3;
+            break;
+        case 4:
+            TIM_OC4Init(tim, &TIM_OCInitStructure);
+            TIM_OC4PreloadConfig(tim, TIM_OCPreload_Enable);
+            pwmCCR[i] = &tim->CCR4;
+            break;
+        }
+    }
+
+    // advanced timers, outputs stay off until MOE is set
+    TIM_CtrlPWMOutputs(TIM1, ENABLE);
+    TIM_CtrlPWMOutputs(TIM8, ENABLE);
+#if defined(MOTOR_ONESHOT)
+    TIM_SelectOnePulseMode(TIM1, TIM_OPMode_Single);
+    if (useServo)
+        TIM_Cmd(TIM8, ENABLE);
+    else
+        TIM_SelectOnePulseMode(TIM8, TIM_OPMode_Single);
+#else
+    TIM_Cmd(TIM1, ENABLE);
+    TIM_Cmd(TIM8, ENABLE);
+#endif
+}
+
+/* PWM write */
+void pwmWrite(uint8_t channel, uint16_t value)
+{
+    if (channel >= PWM_OUTPUTS)
+        return;
+#if defined(MOTOR_ONESHOT)
+    if (channel < 4 || !pwmServo)
+        value = ONESHOT_PERIOD - value;
+#endif
+    *pwmCCR[channel] = value;
+}
+
+#if defined(MOTOR_ONESHOT)
+// A timer still busy with the last pulse keeps it, the new value is latched when it stops
+static void pwmSync(void)
+{
+    static TIM_TypeDef *const pwmMotorTimer[] = { TIM1, TIM8 };
+    uint8_t i;
+
+    for (i = 0; i < 2; i++) {
+        TIM_TypeDef *tim = pwmMotorTimer[i];
+
+        if ((i == 1 && pwmServo) || (tim->CR1 & TIM_CR1_CEN))
+            continue;
+        tim->EGR = TIM_EGR_UG;          // loads the new compare values
+        tim->CR1 |= TIM_CR1_CEN;
+    }
+}
+
+// the pulses start together in pwmSync(), see the STM8 version for why there's no update disable
+void pwmWriteAll(const int16_t *value, uint8_t count)
+{
+    uint8_t i;
+
+    if (count > PWM_OUTPUTS)
+        count = PWM_OUTPUTS;
+    for (i = 0; i < count; i++)
+        *pwmCCR[i] = ONESHOT_PERIOD - value[i];
+    pwmSync();
+}
+#else
+/* TIM1 and TIM8 hold their update events (UDIS) while the compare registers are written, so all motors
+   take their new pulse in the same period. Both count the same 1MHz tick to the same period */
+void pwmWriteAll(const int16_t *value, uint8_t count)
+{
+    uint8_t i;
+
+    if (count > PWM_OUTPUTS)
+        count = PWM_OUTPUTS;
+    TIM1->CR1 |= TIM_CR1_UDIS;
+    if (count > 4)
+        TIM8->CR1 |= TIM_CR1_UDIS;
+    for (i = 0; i < count; i++)
+        *pwmCCR[i] = value[i];
+    TIM1->CR1 &= ~TIM_CR1_UDIS;
+    TIM8->CR1 &= ~TIM_CR1_UDIS;
+}
+#endif
+
+/* Both servo outputs are on TIM8, so one rate for the two. ARR is preloaded: a running timer finishes its
+   period first */
+void pwmServoRate(uint16_t hz)
+{
+    if (hz < 50)
+        hz = 50;
+    if (hz > 400)
+        hz = 400;
+    pwmServoPeriod = 1000000UL / hz;
+    if (pwmServo)
+        TIM8->ARR = pwmServoPeriod - 1;
+}
+
+/* Parallel PWM receiver on PB4, PB5, PB0, PB1 (TIM3 CH1-4) and PE5, PE6 (TIM9 CH1-2), pins the DISCO board
+   leaves free. Both timers free run at 1us ticks, each input captures its rising edge, then flips to the
+   falling one */
+static const struct {
+    TIM_TypeDef *tim;
+    uint8_t channel;
+    GPIO_TypeDef *gpio;
+    uint16_t pin;
+    uint8_t source;
+    uint8_t af;
+} rcPwmInput[] = {
+    { TIM3, 1, GPIOB, GPIO_Pin_4, GPIO_PinSource4, GPIO_AF_TIM3 },
+    { TIM3, 2, GPIOB, GPIO_Pin_5, GPIO_PinSource5, GPIO_AF_TIM3 },
+    { TIM3, 3, GPIOB, GPIO_Pin_0, GPIO_PinSource0, GPIO_AF_TIM3 },
+    { TIM3, 4, GPIOB, GPIO_Pin_1, GPIO_PinSource1, GPIO_AF_TIM3 },
+    { TIM9, 1, GPIOE, GPIO_Pin_5, GPIO_PinSource5, GPIO_AF_TIM9 },
+    { TIM9, 2, GPIOE, GPIO_Pin_6, GPIO_PinSource6, GPIO_AF_TIM9 },
+};
+#define RCPWM_INPUTS    (sizeof(rcPwmInput) / sizeof(rcPwmInput[0]))
+
+static volatile uint32_t *rcPwmCCR[RCPWM_INPUTS];
+static uint16_t rcPwmRise[RCPWM_INPUTS];
+static rcPwmCallback_t rcPwmPulse;
+
+uint8_t rcPwm_init(rcPwmCallback_t pulse)
+{
+    TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure;
+    TIM_ICInitTypeDef TIM_ICInitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+    static const uint8_t irq[] = { TIM3_IRQn, TIM1_BRK_TIM9_IRQn };
+    uint8_t i;
+
+    rcPwmPulse = pulse;
+
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM3, ENABLE);
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM9, ENABLE);
+    TIM_TimeBaseStructInit(&TIM_TimeBaseStructure);
+    TIM_TimeBaseStructure.TIM_Period = 0xFFFF;
+    TIM_TimeBaseStructure.TIM_Prescaler = 84 - 1;      // 84MHz APB1 timer clock
+    TIM_TimeBaseInit(TIM3, &TIM_TimeBaseStructure);
+    TIM_TimeBaseStructure.TIM_Prescaler = 168 - 1;     // 168MHz APB2 timer clock
+    TIM_TimeBaseInit(TIM9, &TIM_TimeBaseStructure);
+
+    TIM_ICStructInit(&TIM_ICInitStructure);
+    TIM_ICInitStructure.TIM_ICPolarity = TIM_ICPolarity_Rising;
+    TIM_ICInitStructure.TIM_ICSelection = TIM_ICSelection_DirectTI;
+    TIM_ICInitStructure.TIM_ICPrescaler = TIM_ICPSC_DIV1;
+    TIM_ICInitStructure.TIM_ICFilter = 0x03;           // 8 samples at the timer clock, spikes off the servo leads
+
+    for (i = 0; i < RCPWM_INPUTS; i++) {
+        TIM_TypeDef *tim = rcPwmInput[i].tim;
+
+        gpio_af(rcPwmInput[i].gpio, rcPwmInput[i].pin, rcPwmInput[i].source, rcPwmInput[i].af, GPIO_OType_PP, GPIO_PuPd_DOWN);
+        switch (rcPwmInput[i].channel) {
+        case 1:
+            TIM_ICInitStructure.TIM_Channel = TIM_Channel_1;
+            rcPwmCCR[i] = &tim->CCR1;
+            break;
+        case 2:
+            TIM_ICInitStructure.TIM_Channel = TIM_Channel_2;
+            rcPwmCCR[i] = &tim->CCR2;
+            break;
+        case 3:
+            TIM_ICInitStructure.TIM_Channel = TIM_Channel_3;
+            rcPwmCCR[i] = &tim->CCR3;
+            break;
+        case 4:
+            TIM_ICInitStructure.TIM_Channel = TIM_Channel_4;
+            rcPwmCCR[i] = &tim->CCR4;
+            break;
+        }
+        TIM_ICInit(tim, &TIM_ICInitStructure);
+        TIM_ITConfig(tim, TIM_IT_CC1 << (rcPwmInput[i].channel - 1), ENABLE);
+    }
+
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_CAPTURE;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    for (i = 0; i < sizeof(irq); i++) {
+        NVIC_InitStructure.NVIC_IRQChannel = irq[i];
+        NVIC_Init(&NVIC_InitStructure);
+    }
+    TIM_Cmd(TIM3, ENABLE);
+    TIM_Cmd(TIM9, ENABLE);
+    return RCPWM_INPUTS;
+}
+
+static void rcPwmCapture(TIM_TypeDef *tim)
+{
+    uint8_t i;
+
+    for (i = 0; i < RCPWM_INPUTS; i++) {
+        uint16_t flag = TIM_IT_CC1 << (rcPwmInput[i].channel - 1);
+        uint16_t polarity = TIM_CCER_CC1P << ((rcPwmInput[i].channel - 1) * 4);
+        uint16_t now;
+
+        if (rcPwmInput[i].tim != tim || !(tim->SR & flag))
+            continue;
+        now = *rcPwmCCR[i];             // reading the capture clears the flag
+        if (tim->CCER & polarity) {
+            tim->CCER &= ~polarity;
+            if (rcPwmPulse)
+                rcPwmPulse(i, (uint16_t)(now - rcPwmRise[i]));     // 16 bit free running, the wrap takes care of itself
+        } else {
+            rcPwmRise[i] = now;
+            tim->CCER |= polarity;
+        }
+    }
+}
+
+void TIM3_IRQHandler(void)
+{
+    PROBE_HI(PROBE_ISR_COMM);
+    rcPwmCapture(TIM3);
+    PROBE_LO(PROBE_ISR_COMM);
+}
+
+void TIM1_BRK_TIM9_IRQHandler(void)
+{
+    PROBE_HI(PROBE_ISR_COMM);
+    rcPwmCapture(TIM9);
+    PROBE_LO(PROBE_ISR_COMM);
 }
 
 // ************************************************************************************************************
 // I2C general functions
 // ************************************************************************************************************
+/* I2C1 on PB6 (SCL) / PB9 (SDA). The F4 I2C block is the F1 one, so this is the STM32F1 job queue on another
+   peripheral. Sensor transfers are a few bytes, the event interrupts cost less than setting up DMA for them */
+#define I2C_MAX_STANDARD_HZ 100000
+#define I2C_MAX_FAST_HZ     400000
+
+// Per device speed and health, see i2cdev.h. The bus is switched between jobs when the next one wants the
+// other mode, with the peripheral off while the clock registers change. The STM's I2C block stops at fast mode.
+#include "i2cdev.h"
+
+// A slave reset or cut off in the middle of a read holds SDA low until it has clocked out the rest of its byte,
+// and no START gets through. With the peripheral off the pins are GPIOs: SCL is clocked until SDA is let go, at
+// most 9 times, then START and STOP by hand. Runs from i2c_init(), at boot and after every timeout.
+static uint16_t i2cRecoveries = 0;
+
+static void i2c_halfBit(void)
+{
+    uint32_t t = microsISR();
+
+    while (microsISR() - t < 5)         // 100kHz
+        ;
+}
+
+static void i2c_unstick(void)
+{
+    GPIO_InitTypeDef GPIO_InitStructure;
+    uint8_t i;
+
+    // PB6 SCL, PB9 SDA. i2c_init() gives them back to the peripheral
+    I2C1->CR1 &= ~I2C_CR1_PE;
+    GPIOB->BSRRL = GPIO_Pin_6 | GPIO_Pin_9;
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_6 | GPIO_Pin_9;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_OUT;
+    GPIO_InitStructure.GPIO_OType = GPIO_OType_OD;
+    GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_2MHz;
+    GPIO_Init(GPIOB, &GPIO_InitStructure);
+    i2c_halfBit();
+    if (GPIOB->IDR & GPIO_Pin_9)
+        return;
+    for (i = 0; i < 9 && !(GPIOB->IDR & GPIO_Pin_9); i++) {
+        GPIOB->BSRRH = GPIO_Pin_6;
+        i2c_halfBit();
+        GPIOB->BSRRL = GPIO_Pin_6;
+        i2c_halfBit();
+    }
+    GPIOB->BSRRH = GPIO_Pin_9;
+    i2c_halfBit();
+    GPIOB->BSRRL = GPIO_Pin_9;
+    i2c_halfBit();
+    i2cRecoveries++;
+}
+
+uint16_t i2c_busRecoveries(void)
+{
+    return i2cRecoveries;
+}
+
+// CCR and TRISE as I2C_Init() works them out for standard and fast mode
+static uint16_t i2cClock[2][2];
+static uint8_t i2cFast;
+
+static void i2c_setClock(uint8_t fast)
+{
+    uint8_t n = 255;
+
+    // the STOP of the last job has to be on the wire before the peripheral goes off
+    while ((I2C1->CR1 & I2C_CR1_STOP) && --n)
+        ;
+    I2C1->CR1 &= ~I2C_CR1_PE;
+    I2C1->CCR = i2cClock[fast][0];
+    I2C1->TRISE = i2cClock[fast][1];
+    I2C1->CR1 |= I2C_CR1_PE | I2C_CR1_ACK;       // PE off cleared ACK
+    i2cFast = fast;
+}
+
 void i2c_init(void)
 {
+    I2C_InitTypeDef I2C_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+    uint8_t fast;
+
+    i2c_unstick();
+    gpio_af(GPIOB, GPIO_Pin_6, GPIO_PinSource6, GPIO_AF_I2C1, GPIO_OType_OD, GPIO_PuPd_NOPULL);
+    gpio_af(GPIOB, GPIO_Pin_9, GPIO_PinSource9, GPIO_AF_I2C1, GPIO_OType_OD, GPIO_PuPd_NOPULL);
+
+    I2C_DeInit(I2C1);
+    I2C_StructInit(&I2C_InitStructure);
+    I2C_InitStructure.I2C_Mode = I2C_Mode_I2C;
+    I2C_InitStructure.I2C_DutyCycle = I2C_DutyCycle_2;
+    I2C_InitStructure.I2C_Ack = I2C_Ack_Enable;
+    I2C_InitStructure.I2C_AcknowledgedAddress = I2C_AcknowledgedAddress_7bit;
+    for (fast = 0; fast < 2; fast++) {
+        I2C_InitStructure.I2C_ClockSpeed = fast ? I2C_MAX_FAST_HZ : I2C_MAX_STANDARD_HZ;
+        I2C_Init(I2C1, &I2C_InitStructure);
+        i2cClock[fast][0] = I2C1->CCR;
+        i2cClock[fast][1] = I2C1->TRISE;
+    }
+    I2C_Cmd(I2C1, ENABLE);
+    i2c_setClock(I2C_SPEED > I2C_MAX_STANDARD_HZ);
+
+    NVIC_InitStructure.NVIC_IRQChannel = I2C1_EV_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_BUS;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+    NVIC_InitStructure.NVIC_IRQChannel = I2C1_ER_IRQn;
+    NVIC_Init(&NVIC_InitStructure);
+}
+
+#define I2C_QUEUE_SIZE  8               // must be a power of 2
+
+#define I2C_SR1_ERRORS  (I2C_SR1_AF | I2C_SR1_BERR | I2C_SR1_ARLO | I2C_SR1_OVR)
+#define I2C_CR2_ITALL   (I2C_CR2_ITEVTEN | I2C_CR2_ITERREN | I2C_CR2_ITBUFEN)
+
+enum {
+    I2C_PHASE_START = 0,
+    I2C_PHASE_ADDR_TX,
+    I2C_PHASE_TX,
+    I2C_PHASE_RSTART,
+    I2C_PHASE_ADDR_RX,
+    I2C_PHASE_RX
+};
+
+static struct {
+    i2cJob_t *queue[I2C_QUEUE_SIZE];
+    volatile uint8_t head;              // next free slot, written by i2c_submit()
+    volatile uint8_t tail;              // job on the bus, advanced by the interrupt
+    i2cJob_t *job;                      // current job, NULL when idle
+    uint8_t phase;
+    uint8_t ptr;
+    uint8_t subaddrSent;
+    uint32_t started;                   // micros() when the current job got the bus
+} i2cBus;
+
+static void i2c_startNext(void);
+
+// Only called from the I2C interrupts, or with interrupts masked
+static void i2c_finish(uint8_t status)
+{
+    i2cJob_t *job = i2cBus.job;
+
+    I2C1->CR2 &= ~I2C_CR2_ITALL;
+    I2C1->CR1 &= ~I2C_CR1_POS;
+    I2C1->CR1 |= I2C_CR1_ACK;
+    i2cBus.job = NULL;
+    i2cBus.tail = (i2cBus.tail + 1) & (I2C_QUEUE_SIZE - 1);
+
+    i2cdev_result(job, status, microsISR());
+    job->status = status;
+    if (job->done)
+        job->done(job);
+    i2c_startNext();
+}
+
+static void i2c_startNext(void)
+{
+    if (i2cBus.job || i2cBus.tail == i2cBus.head)
+        return;
+    i2cBus.job = i2cBus.queue[i2cBus.tail];
+    i2cBus.ptr = 0;
+    i2cBus.subaddrSent = 0;
+    i2cBus.started = microsISR();
+    if (i2cBus.job->read && i2cBus.job->subaddr == 0xFF)
+        i2cBus.phase = I2C_PHASE_RSTART;            // no register pointer to set up, straight to the read
+    else
+        i2cBus.phase = I2C_PHASE_START;
+    if (i2cBus.job->fast != i2cFast)
+        i2c_setClock(i2cBus.job->fast);
+    I2C1->CR2 |= I2C_CR2_ITEVTEN | I2C_CR2_ITERREN;
+    I2C1->CR1 |= I2C_CR1_START;
+}
+
+uint8_t i2c_submit(i2cJob_t *job)
+{
+    uint8_t next;
 
+    __disable_irq();
+    if (!i2cdev_admit(job, microsISR())) {
+        __enable_irq();
+        job->status = I2C_BACKOFF;
+        return I2C_BACKOFF;
+    }
+    next = (i2cBus.head + 1) & (I2C_QUEUE_SIZE - 1);
+    if (next == i2cBus.tail) {
+        __enable_irq();
+        job->status = I2C_QUEUE_FULL;
+        return I2C_QUEUE_FULL;
+    }
+    job->status = I2C_PENDING;
+    i2cBus.queue[i2cBus.head] = job;
+    i2cBus.head = next;
+    i2c_startNext();
+    __enable_irq();
+    return I2C_SUCCESS;
+}
+
+void i2c_poll(void)
+{
+    static const uint8_t timeoutCode[] = { I2C_START_TIMEOUT, I2C_SACK_TIMEOUT, I2C_TX_TIMEOUT, I2C_RSTART_TIMEOUT, I2C_SACK_TIMEOUT, I2C_RX_TIMEOUT };
+    uint8_t phase;
+
+    __disable_irq();
+    if (i2cBus.job && (microsISR() - i2cBus.started) > I2C_JOB_TIMEOUT(i2cBus.job)) {
+        // Slave is holding the bus or never answered. Drop the job and give the peripheral a fresh start.
+        phase = i2cBus.phase;
+        I2C1->CR2 &= ~I2C_CR2_ITALL;
+        I2C1->CR1 |= I2C_CR1_STOP;
+        i2c_init();
+        i2c_finish(timeoutCode[phase]);
+    }
+    __enable_irq();
+}
+
+uint8_t i2c_isIdle(void)
+{
+    return i2cBus.job == NULL;
+}
+
+static void i2c_handler(void)
+{
+    i2cJob_t *job = i2cBus.job;
+    uint16_t sr1 = I2C1->SR1;
+    uint8_t remaining;
+
+    if (!job) {
+        I2C1->CR2 &= ~I2C_CR2_ITALL;
+        return;
+    }
+
+    if (sr1 & I2C_SR1_ERRORS) {
+        I2C1->SR1 = ~I2C_SR1_ERRORS;                // error flags are cleared by writing 0
+        I2C1->CR1 |= I2C_CR1_STOP;                  // release the bus so the next job can have it
+        i2c_finish((sr1 & I2C_SR1_AF) ? I2C_SACK_FAILURE : I2C_BUS_ERROR);
+        return;
+    }
+
+    if (sr1 & I2C_SR1_SB) {
+        if (i2cBus.phase == I2C_PHASE_START) {
+            i2cBus.phase = I2C_PHASE_ADDR_TX;
+            I2C1->DR = job->address & 0xFE;         // address write
+        } else {
+            i2cBus.phase = I2C_PHASE_ADDR_RX;
+            if (job->len == 2)
+                I2C1->CR1 |= I2C_CR1_POS;           // ACK bit applies to the next byte
+            I2C1->DR = job->address | 0x01;         // address read
+        }
+        return;
+    }
+
+    if (sr1 & I2C_SR1_ADDR) {
+        if (i2cBus.phase == I2C_PHASE_ADDR_TX) {
+            (void)I2C1->SR2;                        // SR1 then SR2 clears ADDR
+            i2cBus.phase = I2C_PHASE_TX;
+            I2C1->CR2 |= I2C_CR2_ITBUFEN;
+        } else {
+            i2cBus.phase = I2C_PHASE_RX;
+            if (job->len == 1) {
+                I2C1->CR1 &= ~I2C_CR1_ACK;          // single byte: NACK and STOP before ADDR is cleared
+                (void)I2C1->SR2;
+                I2C1->CR1 |= I2C_CR1_STOP;
+                I2C1->CR2 |= I2C_CR2_ITBUFEN;
+            } else if (job->len == 2) {
+                (void)I2C1->SR2;
+                I2C1->CR1 &= ~I2C_CR1_ACK;          // with POS set, NACKs the second byte. Both come in on BTF
+            } else {
+                (void)I2C1->SR2;
+                I2C1->CR2 |= I2C_CR2_ITBUFEN;
+            }
+        }
+        return;
+    }
+
+    if (i2cBus.phase == I2C_PHASE_TX) {
+        if (sr1 & I2C_SR1_TXE) {
+            if (!i2cBus.subaddrSent && job->subaddr != 0xFF) {
+                i2cBus.subaddrSent = 1;
+                I2C1->DR = job->subaddr;
+                return;
+            }
+            if (!job->read && i2cBus.ptr < job->len) {
+                I2C1->DR = job->buf[i2cBus.ptr++];
+                return;
+            }
+            if (job->subaddr == 0xFF && i2cBus.ptr == 0) {
+                I2C1->CR1 |= I2C_CR1_STOP;          // address only, nothing was clocked out so BTF won't come
+                i2c_finish(I2C_SUCCESS);
+                return;
+            }
+            // Everything is in the shift register, wait for BTF without TXE hammering us
+            I2C1->CR2 &= ~I2C_CR2_ITBUFEN;
+            if (!(sr1 & I2C_SR1_BTF))
+                return;
+        }
+        if (sr1 & I2C_SR1_BTF) {
+            if (job->read) {
+                i2cBus.phase = I2C_PHASE_RSTART;
+                I2C1->CR1 |= I2C_CR1_START;         // repeated start for the read
+            } else {
+                I2C1->CR1 |= I2C_CR1_STOP;
+                i2c_finish(I2C_SUCCESS);
+            }
+        }
+        return;
+    }
+
+    if (i2cBus.phase == I2C_PHASE_RX) {
+        remaining = job->len - i2cBus.ptr;
+        if (remaining == 1) {
+            if (sr1 & I2C_SR1_RXNE) {
+                job->buf[i2cBus.ptr++] = I2C1->DR;  // last byte, NACK and STOP were set up already
+                i2c_finish(I2C_SUCCESS);
+            }
+        } else if (remaining == 2) {
+            if (sr1 & I2C_SR1_BTF) {
+                I2C1->CR1 |= I2C_CR1_STOP;
+                job->buf[i2cBus.ptr++] = I2C1->DR;
+                job->buf[i2cBus.ptr++] = I2C1->DR;
+                i2c_finish(I2C_SUCCESS);
+            }
+        } else if (remaining == 3) {
+            // let two bytes stack up, then NACK, STOP and drain
+            I2C1->CR2 &= ~I2C_CR2_ITBUFEN;
+            if (sr1 & I2C_SR1_BTF) {
+                I2C1->CR1 &= ~I2C_CR1_ACK;
+                job->buf[i2cBus.ptr++] = I2C1->DR;  // third to last
+                I2C1->CR1 |= I2C_CR1_STOP;
+                job->buf[i2cBus.ptr++] = I2C1->DR;  // penultimate
+                I2C1->CR2 |= I2C_CR2_ITBUFEN;       // last one arrives on RXNE
+            }
+        } else if (sr1 & I2C_SR1_RXNE) {
+            job->buf[i2cBus.ptr++] = I2C1->DR;
+        }
+    }
+}
+
+void I2C1_EV_IRQHandler(void)
+{
+    PROBE_HI(PROBE_ISR);
+    i2c_handler();
+    PROBE_LO(PROBE_ISR);
+}
+
+void I2C1_ER_IRQHandler(void)
+{
+    i2c_handler();
+}
+
+// Blocking wrapper around a queued job, for init code and the drivers that need the data right now
+static uint8_t i2c_runJob(i2cJob_t *job)
+{
+    if (i2c_submit(job) != I2C_SUCCESS)
+        return job->status;
+    while (job->status == I2C_PENDING)
+        i2c_poll();
+    return job->status;
 }
 
 uint8_t i2c_write(uint8_t *buf, uint8_t size)
 {
-    return 0;
+    // buf[0] is the slave address, the rest goes out as is
+    i2cJob_t job;
+    job.address = buf[0];
+    job.subaddr = 0xFF;
+    job.buf = buf + 1;
+    job.len = size - 1;
+    job.read = 0;
+    job.done = NULL;
+    return i2c_runJob(&job);
 }
 
 uint8_t i2c_read(uint8_t *buf, uint8_t size, uint8_t address, uint8_t subaddr)
 {
-    return 0;
+    //0xFF as the subaddr disables sub address
+    i2cJob_t job;
+    job.address = address;
+    job.subaddr = subaddr;
+    job.buf = buf;
+    job.len = size;
+    job.read = 1;
+    job.done = NULL;
+    return i2c_runJob(&job);
+}
+
+void systemReboot(void)
+{
+    NVIC_SystemReset();
+}
+
+/* As on the STM32F1: BOOT_MAGIC in a backup register through the reset, then the ROM loader from the reset state.
+   It takes USART1 (PA9/PA10), USART3 and USB DFU on the OTG FS port, the GUI's USART2 isn't one of them */
+#define BOOT_MAGIC          0xB007
+#define SYSTEM_MEMORY       0x1FFF0000
+
+static void bootCheck(void)
+{
+    uint32_t entry;
+
+    RCC->APB1ENR |= RCC_APB1ENR_PWREN;
+    if (RTC->BKP0R != BOOT_MAGIC)
+        return;
+    PWR->CR |= PWR_CR_DBP;
+    RTC->BKP0R = 0;                     // once, a reset from the loader starts the firmware again
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+    SYSCFG->MEMRMP = 0x01;              // system memory at 0, where the loader expects its vectors
+    entry = *(volatile uint32_t *)(SYSTEM_MEMORY + 4);
+    __set_MSP(*(volatile uint32_t *)SYSTEM_MEMORY);
+    ((void (*)(void))entry)();
+}
+
+void systemBootloader(void)
+{
+    __disable_irq();
+    RCC->APB1ENR |= RCC_APB1ENR_PWREN;
+    PWR->CR |= PWR_CR_DBP;
+    RTC->BKP0R = BOOT_MAGIC;
+    NVIC_SystemReset();
+}
+
+/* IWDG off the 32kHz LSI, divided by 32 it's 1ms a step, up to 4s */
+void watchdog_init(uint16_t ms)
+{
+    IWDG->KR = 0xCCCC;
+    IWDG->KR = 0x5555;
+    IWDG->PR = 3;               // /32
+    IWDG->RLR = ms > 0xFFF ? 0xFFF : ms < 1 ? 1 : ms;
+    IWDG->KR = 0xAAAA;
+}
+
+void watchdog_kick(void)
+{
+    IWDG->KR = 0xAAAA;
+}
+
+uint8_t watchdog_didReset(void)
+{
+    static uint8_t cause = 0xFF;
+
+    if (cause == 0xFF) {
+        cause = (RCC->CSR & RCC_CSR_WDGRSTF) != 0;
+        RCC->CSR |= RCC_CSR_RMVF;
+    }
+    return cause;
+}
+
+/* RAM. The StdPeriph template linker script: .data from _sdata to _edata, .bss from _sbss to _ebss, and one stack
+   for main() and the interrupts from _estack, the top of the main SRAM, growing down towards _ebss */
+#define STACK_PAINT 0xA5A5A5A5
+extern uint32_t _sdata[], _edata[], _sbss[], _ebss[], _estack[];
+
+static void stackPaint(uint32_t *p, uint32_t *end, const uint32_t *sp)
+{
+    if (sp >= p && sp < end)
+        end = (uint32_t *)sp - 8;       // the stack we are on: up to a little below the caller's frame
+    while (p < end)
+        *p++ = STACK_PAINT;
+}
+
+static uint16_t stackUntouched(const uint32_t *p, const uint32_t *end)
+{
+    const uint32_t *start = p;
+
+    while (p < end && *p == STACK_PAINT)
+        p++;
+    return (p - start) * sizeof(uint32_t);
+}
+
+void stack_paint(void)
+{
+    uint32_t here;
+
+    stackPaint(_ebss, _estack, &here);
+}
+
+uint16_t stack_free(void)
+{
+    return stackUntouched(_ebss, _estack);
+}
+
+uint16_t ram_static(void)
+{
+    return (uint8_t *)_edata - (uint8_t *)_sdata + (uint8_t *)_ebss - (uint8_t *)_sbss;
+}
+
+uint8_t ram_isStatic(uint32_t addr, uint8_t len)
+{
+    uint32_t end = addr + len;
+
+    return (addr >= (uint32_t)_sdata && end <= (uint32_t)_edata) || (addr >= (uint32_t)_sbss && end <= (uint32_t)_ebss);
+}
+
+/* CRC-32 of flash: the CRC unit fed by DMA2 stream 1 memory to memory (only DMA2 does that, and only through
+   its FIFO), at the lowest priority behind the ADC and the SD card. A transfer takes up to 65535 words,
+   crc_busy() starts the next one of a longer range */
+#define FLASH_SIZE_KB           (*(volatile uint16_t *)0x1FFF7A22)
+
+static uint32_t crcNext, crcLeft = 0;   // what no transfer has taken yet
+
+static void crcTransfer(void)
+{
+    DMA_InitTypeDef DMA_InitStructure;
+    uint16_t n = crcLeft > 0xFFFF ? 0xFFFF : crcLeft;
+
+    DMA_DeInit(DMA2_Stream1);
+    DMA_StructInit(&DMA_InitStructure);
+    DMA_InitStructure.DMA_Channel = DMA_Channel_0;
+    DMA_InitStructure.DMA_PeripheralBaseAddr = crcNext;         // the source, memory to memory
+    DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)&CRC->DR;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToMemory;
+    DMA_InitStructure.DMA_BufferSize = n;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Enable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Disable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_Low;
+    DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Enable;
+    DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+    DMA_Init(DMA2_Stream1, &DMA_InitStructure);
+    DMA_Cmd(DMA2_Stream1, ENABLE);
+    crcNext += 4UL * n;
+    crcLeft -= n;
+}
+
+uint8_t crc_start(uint32_t address, uint32_t words)
+{
+    uint32_t end = FLASH_BASE + FLASH_SIZE_KB * 1024UL;
+
+    if (crc_busy() || address < FLASH_BASE || address > end || words > (end - address) / 4)
+        return 0;
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_CRC, ENABLE);
+    CRC_ResetDR();
+    crcNext = address;
+    crcLeft = words;
+    if (words)
+        crcTransfer();
+    return 1;
+}
+
+uint8_t crc_busy(void)
+{
+    if (dma_count(DMA2_Stream1))
+        return 1;
+    if (!crcLeft)
+        return 0;
+    crcTransfer();
+    return 1;
+}
+
+uint32_t crc_result(void)
+{
+    return CRC_GetCRC();
 }
@@ -1,6 +1,11 @@
 #include "config.h"
 #include "def.h"
 #include "sysdep.h"
+#include "ringbuf.h"
+#include "seqcount.h"
+#include "hwreg.h"
+
+static void eeWait(void);
 
 /* HW init */
 void hw_init(void)
@@ -25,88 +30,250 @@ void hw_init(void)
 
 void systemReboot(void)
 {
-    // reboot to bootloader
+    // reboot to bootloader, once the background EEPROM writes are done
+    eeWait();
     WWDG_SWReset();
 }
 
+void systemBootloader(void)
+{
+    systemReboot();
+}
+
+/* IWDG off the 128kHz LSI, divided by 256 the counter is 2ms a step: up to 510ms */
+void watchdog_init(uint16_t ms)
+{
+    uint16_t reload = ms / 2;
+
+    IWDG->KR = 0xCC;            // start, it can't be stopped again
+    IWDG->KR = 0x55;            // unlock PR and RLR
+    IWDG->PR = 6;               // /256
+    IWDG->RLR = reload > 255 ? 255 : reload < 1 ? 1 : reload;
+    IWDG->KR = 0xAA;
+}
+
+void watchdog_kick(void)
+{
+    IWDG->KR = 0xAA;
+}
+
+uint8_t watchdog_didReset(void)
+{
+    static uint8_t cause = 0xFF;
+
+    if (cause == 0xFF) {
+        cause = (RST->SR & RST_SR_IWDGF) != 0;
+        RST->SR = RST_SR_IWDGF;         // write 1 to clear, or the next reset still shows it
+    }
+    return cause;
+}
+
+/* RAM. Cosmic's linker file puts the zero page (.bsct/.ubsct, up to __endzp) at 0, .data and .bss from 0x100
+   (up to __memory) and the stack at the top of the RAM (__stack), growing down towards __memory. Interrupts
+   run on the same stack. The C names lose a leading underscore */
+#define RAM_DATA_START 0x100
+#define STACK_PAINT 0xA5
+extern uint8_t _endzp[];
+extern uint8_t _memory[];
+
+void stack_paint(void)
+{
+    uint8_t here;
+    uint8_t *p = _memory;
+
+    // up to a little below the caller's frame
+    while (p < &here - 8)
+        *p++ = STACK_PAINT;
+}
+
+uint16_t stack_free(void)
+{
+    uint8_t here;
+    const uint8_t *p = _memory;
+
+    while (p < &here && *p == STACK_PAINT)
+        p++;
+    return p - _memory;
+}
+
+uint16_t ram_static(void)
+{
+    return (uint16_t)_endzp + (uint16_t)(_memory - (uint8_t *)RAM_DATA_START);
+}
+
+uint8_t ram_isStatic(uint32_t addr, uint8_t len)
+{
+    uint32_t end = addr + len;
+
+    return end <= (uint16_t)_endzp || (addr >= RAM_DATA_START && end <= (uint16_t)_memory);
+}
+
+/* CRC-32 of flash in software, all of it is below 64K. The CPU is big endian, the words are put together by byte */
+static uint32_t crcFlashWord(uint32_t address)
+{
+    const uint8_t *p = (const uint8_t *)(uint16_t)address;
+
+    return p[0] | (uint16_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint8_t crcInFlash(uint32_t address, uint32_t words)
+{
+    return address >= FLASH_PROG_START_PHYSICAL_ADDRESS && address <= FLASH_PROG_END_PHYSICAL_ADDRESS + 1
+        && words <= (FLASH_PROG_END_PHYSICAL_ADDRESS + 1 - address) / 4;
+}
+
+#include "crc32.h"
+
 /* UART */
+/* Two frame buffers: Serial_reset() starts a frame in uartBuffer[uartBack], serialize8/16() append to it
+   and Serial_commitBuffer() hands it to the transmitter and swaps to the other buffer. A frame committed
+   while the previous one is still going out is chained by the TX interrupt. Bytes past the end of the
+   buffer are dropped and so is the truncated frame */
+#define TX_BUFFER_SIZE 128
+static uint8_t uartBuffer[2][TX_BUFFER_SIZE];
 static uint8_t uartPointer;
-static uint8_t uartBuffer[128];
+static uint8_t uartBack = 0;
+static uint8_t uartOverflow = 0;
+static uint16_t txDropped = 0;
+
 void serialize16(int16_t a)
 {
-    uartBuffer[uartPointer++] = a;
-    uartBuffer[uartPointer++] = a >> 8 & 0xff;
+    serialize8(a);
+    serialize8(a >> 8 & 0xff);
 }
 
 void serialize8(uint8_t a)
 {
-    uartBuffer[uartPointer++] = a;
+    if (uartPointer < TX_BUFFER_SIZE)
+        uartBuffer[uartBack][uartPointer++] = a;
+    else
+        uartOverflow = 1;
+}
+
+void *Serial_reserve(uint8_t len)
+{
+    uint8_t *p = &uartBuffer[uartBack][uartPointer];
+
+    if (len > TX_BUFFER_SIZE - uartPointer) {
+        uartOverflow = 1;
+        return 0;
+    }
+    uartPointer += len;
+    return p;
 }
 
 // ***********************************
 // Interrupt driven UART transmitter
 // ***********************************
+static uint8_t *tx_buf;
 static uint8_t tx_ptr;
-static uint8_t tx_busy = 0;
+static uint8_t tx_len;
+static volatile uint8_t tx_busy = 0;
+static volatile uint8_t tx_pending = 0;
+static uint8_t tx_pendingLen;
 
 __near __interrupt void UART2_TX_IRQHandler(void)
 {
-    UART2_SendData8(uartBuffer[tx_ptr++]);
-    if (tx_ptr == uartPointer) {      /* Check if all data is transmitted */
-        UART2_ITConfig(UART2_IT_TXE, DISABLE);  /* Disable transmitter interrupt */
-        tx_busy = 0;
+    uart2_put(tx_buf[tx_ptr++]);
+    if (tx_ptr == tx_len) {
+        if (tx_pending) {
+            // next frame is the committed one, i.e. not the buffer being built
+            tx_buf = uartBuffer[uartBack ^ 1];
+            tx_len = tx_pendingLen;
+            tx_ptr = 0;
+            tx_pending = 0;
+        } else {
+            uart2_txeIrq(0);    /* Disable transmitter interrupt */
+            tx_busy = 0;
+        }
     }
 }
 
 void Serial_commitBuffer(void)
 {
-    tx_ptr = 0;
-    UART2_SendData8(uartBuffer[tx_ptr++]);       /* Start transmission */
-    UART2_ITConfig(UART2_IT_TXE, ENABLE);       /* Enable TX interrupt to continue sending */
+    if (uartPointer == 0 || uartOverflow) {
+        if (uartOverflow)
+            txDropped++;
+        uartPointer = 0;
+        uartOverflow = 0;
+        return;
+    }
+    disableInterrupts();
+    if (!tx_busy) {
+        tx_buf = uartBuffer[uartBack];
+        tx_len = uartPointer;
+        tx_ptr = 0;
+        tx_busy = 1;
+        uart2_txeIrq(1);        /* TXE is already set, the first byte goes out from the interrupt */
+    } else {
+        tx_pending = 1;
+        tx_pendingLen = uartPointer;
+    }
+    uartBack ^= 1;
+    enableInterrupts();
+    uartPointer = 0;
 }
 
 uint8_t Serial_isTxBusy(void)
 {
-    return tx_busy;
+    // only when there's no buffer left to build a reply in
+    return tx_pending;
+}
+
+uint8_t Serial_txIdle(void)
+{
+    return !tx_busy && uart2_txDone();
 }
 
 void Serial_reset(void)
 {
+    uint16_t start = (uint16_t)micros();
+
+    // both buffers taken: wait for the one in flight to finish, at most one frame time
+    while (tx_pending && (uint16_t)((uint16_t)micros() - start) < 12000);
+    if (tx_pending) {
+        // still stuck, drop the queued frame rather than overwrite the one on the wire
+        disableInterrupts();
+        if (tx_pending) {
+            tx_pending = 0;
+            txDropped++;
+            uartBack ^= 1;
+        }
+        enableInterrupts();
+    }
     uartPointer = 0;
+    uartOverflow = 0;
 }
 
 
-#define RX_BUFFER_SIZE 48
-typedef struct ring_buffer
-{
-  unsigned char buffer[RX_BUFFER_SIZE];
-  int head;
-  int tail;
-} ring_buffer;
-
-static ring_buffer rx_buffer  =  { { 0, }, 0, 0 };
+static uint8_t rxBuffer[64];
+static ring_t rxRing = RING_INIT(rxBuffer);
+static rcSerialCallback_t rcSerialRx = 0;
 
-/* __inline */ void store_char(unsigned char c, ring_buffer *rx_buffer)
+__near __interrupt void UART2_RX_IRQHandler(void)
 {
-  int i = (unsigned int)(rx_buffer->head + 1) % RX_BUFFER_SIZE;
+    uint8_t sr, c;
 
-  // if we should be storing the received character into the location
-  // just before the tail (meaning that the head would advance to the
-  // current location of the tail), we're about to overflow the buffer
-  // and so we don't write the character or advance the head.
-  if (i != rx_buffer->tail) {
-    rx_buffer->buffer[rx_buffer->head] = c;
-    rx_buffer->head = i;
-  }
+    sr = UART2->SR;                     // SR then DR clears the error flags with RXNE
+    c = uart2_get();
+    uart2_rxneClear();
+    if (rcSerialRx) {
+        if (!(sr & (UART2_SR_PE | UART2_SR_FE)))
+            rcSerialRx(c);
+    } else
+        ring_put(&rxRing, c);
 }
 
-__near __interrupt void UART2_RX_IRQHandler(void)
+void rcSerial_init(uint32_t speed, uint8_t format, rcSerialCallback_t rx)
 {
-    uint8_t c;
-
-    c = UART2_ReceiveData8();
-    UART2_ClearFlag(UART2_FLAG_RXNE);
-    store_char(c, &rx_buffer);
+    if (format == RCSERIAL_8E2) {
+        // 9 bit words are 8 data bits plus the parity bit
+        UART2_DeInit();
+        UART2_Init(speed, UART2_WORDLENGTH_9D, UART2_STOPBITS_2, UART2_PARITY_EVEN, UART2_SYNCMODE_CLOCK_DISABLE, UART2_MODE_TXRX_ENABLE);
+        UART2_ITConfig(UART2_IT_RXNE_OR, ENABLE);
+    } else
+        Serial_begin(speed);
+    rcSerialRx = rx;
 }
 
 void Serial_begin(uint32_t speed)
@@ -119,80 +286,109 @@ void Serial_begin(uint32_t speed)
 
 uint16_t Serial_available(void)
 {
-    return (uint16_t)(RX_BUFFER_SIZE + rx_buffer.head - rx_buffer.tail) % RX_BUFFER_SIZE;
+    return ring_count(&rxRing);
 }
 
 uint8_t Serial_read(void)
 {
-  // if the head isn't ahead of the tail, we don't have any characters
-  if (rx_buffer.head == rx_buffer.tail) {
-    return -1;
-  } else {
-    unsigned char c = rx_buffer.buffer[rx_buffer.tail];
-    rx_buffer.tail = (unsigned int)(rx_buffer.tail + 1) % RX_BUFFER_SIZE;
-    return c;
-  }
+    // if the head isn't ahead of the tail, we don't have any characters
+    if (ring_count(&rxRing) == 0)
+        return -1;
+    return ring_get(&rxRing);
+}
+
+uint8_t Serial_peek(const uint8_t **data)
+{
+    return ring_peek(&rxRing, data);
+}
+
+void Serial_consume(uint8_t n)
+{
+    ring_skip(&rxRing, n);
+}
+
+uint16_t Serial_rxOverflow(void)
+{
+    return rxRing.overflow;
+}
+
+uint16_t Serial_txDropped(void)
+{
+    return txDropped;
 }
 
 /* TIMING */
-#define F_CPU (16000000L)
-#define clockCyclesPerMicrosecond() ( F_CPU / 1000000L )
-#define clockCyclesToMicroseconds(a) ( ((a) * 1000L) / (F_CPU / 1000L) )
-#define microsecondsToClockCycles(a) ( ((a) * (F_CPU / 1000L)) / 1000L )
-// the prescaler is set so that timer0 ticks every 64 clock cycles, and the
-// the overflow handler is called every 256 ticks.
-#define MICROSECONDS_PER_TIMER0_OVERFLOW (clockCyclesToMicroseconds(64 * 256))
-// the whole number of milliseconds per timer0 overflow
-#define MILLIS_INC (MICROSECONDS_PER_TIMER0_OVERFLOW / 1000)
-// the fractional number of milliseconds per timer0 overflow. we shift right
-// by three to fit these numbers into a byte. (for the clock speeds we care
-// about - 8 and 16 MHz - this doesn't lose precision.)
-#define FRACT_INC ((MICROSECONDS_PER_TIMER0_OVERFLOW % 1000) >> 3)
-#define FRACT_MAX (1000 >> 3)
-
-volatile unsigned long timer0_overflow_count = 0;
-volatile unsigned long timer0_millis = 0;
-static unsigned char timer0_fract = 0;
+/* TIM4 counts 16MHz / 64, 4us per tick, and interrupts on every wrap of its 8 bits (1.024ms). The handler
+   only counts the wraps, together with the counter that is a 40 bit count of ticks, and micros() is its low
+   30 bits shifted up by two: no multiply or divide, and it wraps cleanly at 2^32us.
+   A wrap that happened while interrupts were masked is still pending in UIF, the reader counts it itself.
+   Otherwise the overflow count is behind by one while the counter has already started over, and micros()
+   would go back by 1ms.
+   The overflow count is 32 bit and loads in two steps, micros() reads it under tim4Seq (seqcount.h) instead
+   of masking interrupts, so it adds nothing to the latency of the receiver and sensor interrupts */
+#define TIM4_US_SHIFT   2           // log2(64 / 16MHz in us)
+
+static volatile uint32_t tim4Overflows = 0;
+static seq_t tim4Seq = 0;
 
 __near __interrupt void TIM4_UPD_OVF_IRQHandler(void)
 {
-    // copy these to local variables so they can be stored in registers
-    // (volatile variables must be read from memory on every access)
-    unsigned long m = timer0_millis;
-    unsigned char f = timer0_fract;
-
     // Optimize away a call() - TIM4_ClearITPendingBit(TIM4_IT_UPDATE);
     TIM4->SR1 = (u8)(~TIM4_IT_UPDATE);
+    tim4Overflows++;
+    seq_publish(&tim4Seq);
+}
 
-    m += MILLIS_INC;
-    f += FRACT_INC;
-    if (f >= FRACT_MAX) {
-            f -= FRACT_MAX;
-            m += 1;
-    }
+// with TIM4's interrupt held off, or between two reads of tim4Seq that match
+static uint32_t microsRead(void)
+{
+    uint32_t m = tim4Overflows;
+    uint8_t t = TIM4->CNTR;
 
-    timer0_fract = f;
-    timer0_millis = m;
-    timer0_overflow_count++;
+    if (TIM4->SR1 & TIM4_SR1_UIF) {
+        // wrapped and not counted yet. Once UIF reads set the counter has started over, so a fresh read
+        // goes with m + 1 whether the first one was taken before or after the wrap
+        t = TIM4->CNTR;
+        m++;
+    }
+    return (m << (8 + TIM4_US_SHIFT)) | ((uint16_t)t << TIM4_US_SHIFT);
 }
 
 uint32_t micros(void)
 {
-    unsigned long m;
-    uint8_t t;
+    uint32_t res;
+    uint8_t seq;
 
-    disableInterrupts();
-    m = timer0_overflow_count;
-    t = TIM4->CNTR;
-    enableInterrupts();
+    // a wrap counted in between moves tim4Seq, the read starts over. One pending in UIF is counted by
+    // microsRead(), with interrupts masked (the caller's) as without
+    do {
+        seq = seq_begin(&tim4Seq);
+        res = microsRead();
+    } while (seq_retry(&tim4Seq, seq));
+    return res;
+}
 
-#if 0
-    // if overflow occurred while we were here TODO
-    if (timer0_overflow_count != m)
-        m++;
-#endif
+uint32_t cycles(void)
+{
+    return micros();
+}
 
-    return ((m << 8) + t) * (64 / clockCyclesPerMicrosecond());
+uint32_t microsISR(void)
+{
+    // we're already inside an interrupt handler, so TIM4 can't update the overflow count under us, a pending
+    // wrap is counted by microsRead(). micros() works here too, this just skips the retry
+    return microsRead();
+}
+
+uint16_t irq_latencyMax(uint8_t source)
+{
+    return 0;               // one interrupt level, nothing to bound
+}
+
+// only the camera trigger uses it, the divide is cheaper than keeping a millisecond count in the TIM4 handler
+uint32_t millis(void)
+{
+    return micros() / 1000;
 }
 
 void delay(uint16_t ms)
@@ -222,232 +418,669 @@ void pinMode(uint8_t pin, uint8_t mode)
     
 }
 
+// ***********************************
+// Data EEPROM, written back in the background
+// ***********************************
+// Writes go to a copy of one FLASH_BLOCK_SIZE block in RAM and only the 4 byte words with a byte that
+// changed are marked. The copy is written out when another block is written to and on eeprom_close(): as
+// one block operation when more than EE_BLOCK_WORDS words changed, else word by word from the end of the
+// block down (the parameter log's terminator, behind the record, goes first). Every operation takes about
+// as long as a single byte used to (~6ms), the next one is started from the EOP interrupt and the data
+// EEPROM has read while write, so eeprom_close() returns with the last block still being written and the
+// loop goes on. Only a write or read of another block waits for it.
+#define EE_BLOCK_WORDS  4
+#define EE_NONE         0xFF
+
+static uint8_t eeCache[FLASH_BLOCK_SIZE];
+static uint8_t eeBlock = EE_NONE;       // block in eeCache[]
+static volatile uint8_t eeDirty[FLASH_BLOCK_SIZE / 32];    // bit per word of eeCache[] that differs
+static volatile uint8_t eeBusy = 0;     // an operation is running, the EOP interrupt starts the next
+static volatile uint8_t eeLock = 0;     // eeprom_close() came, lock once the last one is done
+
+static uint8_t eeWordsDirty(void)
+{
+    uint8_t i, b, n = 0;
+
+    for (i = 0; i < sizeof(eeDirty); i++)
+        for (b = eeDirty[i]; b; b &= b - 1)
+            n++;
+    return n;
+}
+
+// starts the next operation on eeCache[], or locks up when there is none. Interrupts off
+static void eeNext(void)
+{
+    uint16_t addr = FLASH_DATA_START_PHYSICAL_ADDRESS + eeBlock * FLASH_BLOCK_SIZE;
+    uint8_t w;
+
+    if (eeWordsDirty() > EE_BLOCK_WORDS) {
+        memset((void *)eeDirty, 0, sizeof(eeDirty));
+        eeBusy = 1;
+        FLASH_ProgramBlock(eeBlock, FLASH_MEMTYPE_DATA, FLASH_PROGRAMMODE_STANDARD, eeCache);
+        return;
+    }
+    for (w = FLASH_BLOCK_SIZE / 4; w-- > 0;) {
+        if (eeDirty[w >> 3] & (1 << (w & 7))) {
+            eeDirty[w >> 3] &= ~(1 << (w & 7));
+            eeBusy = 1;
+            FLASH_ProgramWord(addr + w * 4, *(uint32_t *)(eeCache + w * 4));
+            return;
+        }
+    }
+    eeBusy = 0;
+    if (eeLock) {
+        eeLock = 0;
+        FLASH_Lock(FLASH_MEMTYPE_DATA);
+    }
+}
+
+__near __interrupt void EEPROM_EEC_IRQHandler(void)
+{
+    (void)FLASH->IAPSR;                 // reading clears EOP
+    eeNext();
+}
+
+static void eeFlush(void)
+{
+    disableInterrupts();
+    if (!eeBusy)
+        eeNext();
+    enableInterrupts();
+}
+
+// eeCache[] written back and the data EEPROM idle
+static void eeWait(void)
+{
+    eeFlush();
+    while (eeBusy);
+}
+
 void eeprom_open(void)
 {
+    disableInterrupts();
+    eeLock = 0;
+    enableInterrupts();
     FLASH_SetProgrammingTime(FLASH_PROGRAMTIME_STANDARD);
     FLASH_Unlock(FLASH_MEMTYPE_DATA);
+    FLASH_ITConfig(ENABLE);
 }
 
 void eeprom_read_block (void *dst, const void *src, size_t n)
 {
-    uint32_t _address = FLASH_DATA_START_PHYSICAL_ADDRESS + (uint32_t)src;
-    memcpy(dst, (void *)_address, n);
+    uint16_t offset = (uint16_t)src;
+    uint8_t *data = (uint8_t *)dst;
+
+    if (offset / FLASH_BLOCK_SIZE != eeBlock || (offset + n - 1) / FLASH_BLOCK_SIZE != eeBlock) {
+        eeWait();
+        memcpy(dst, (void *)(FLASH_DATA_START_PHYSICAL_ADDRESS + offset), n);
+        return;
+    }
+    while (n--)
+        *data++ = eeCache[offset++ % FLASH_BLOCK_SIZE];
 }
 
 void eeprom_write_block(const void *src, void *dst, size_t n)
 {
-    uint32_t _address = FLASH_DATA_START_PHYSICAL_ADDRESS + (uint32_t)dst;
-    uint8_t j;
-
+    uint16_t offset = (uint16_t)dst;
     uint8_t *data = (uint8_t *)src;
-    for (j = 0; j < n; j++)
-        FLASH_ProgramByte(_address++, *data++);
+    uint8_t i;
+
+    for (; n--; offset++, data++) {
+        if (offset / FLASH_BLOCK_SIZE != eeBlock) {
+            eeWait();
+            eeBlock = offset / FLASH_BLOCK_SIZE;
+            memcpy(eeCache, (void *)(FLASH_DATA_START_PHYSICAL_ADDRESS + eeBlock * FLASH_BLOCK_SIZE), FLASH_BLOCK_SIZE);
+        }
+        i = offset % FLASH_BLOCK_SIZE;
+        if (eeCache[i] != *data) {
+            // the word may be programmed from the interrupt right now, marked after the byte it's done again
+            eeCache[i] = *data;
+            disableInterrupts();
+            eeDirty[i >> 5] |= 1 << ((i >> 2) & 7);
+            enableInterrupts();
+        }
+    }
 }
 
 void eeprom_close(void)
 {
-    FLASH_Lock(FLASH_MEMTYPE_DATA);
+    disableInterrupts();
+    eeLock = 1;
+    if (!eeBusy)
+        eeNext();
+    enableInterrupts();
+}
+
+uint16_t eeprom_size(void)
+{
+    return FLASH_DATA_END_PHYSICAL_ADDRESS - FLASH_DATA_START_PHYSICAL_ADDRESS + 1;
+}
+
+#if defined(PARAM_IN_PLACE)
+const void *eeprom_map(const void *src, size_t n)
+{
+    uint16_t offset = (uint16_t)src;
+    uint8_t first = offset / FLASH_BLOCK_SIZE, last = (offset + n - 1) / FLASH_BLOCK_SIZE;
+
+    // eeCache[] is ahead of its block until the words are written, the other blocks are up to date
+    if (first == eeBlock && last == eeBlock)
+        return eeCache + offset % FLASH_BLOCK_SIZE;
+    if (first == eeBlock || last == eeBlock)
+        eeWait();
+    return (const void *)(FLASH_DATA_START_PHYSICAL_ADDRESS + offset);
+}
+#endif
+
+void eeprom_erase(void)
+{
+    // bytes are rewritten in place, the parameter log zeroes the byte after its end instead
 }
 
 // ************************************************************************************************************
 // SPI general functions
 // ************************************************************************************************************
+// Shared bus manager. Each chip brings a spiDevice_t, the bus owns chip select and reprograms clock and
+// mode between transactions. Register access (spi_command()) runs blocking at the device's slow clock,
+// bursts (spi_submit()) are queued and run back to back from the interrupt at its fast clock.
+#define SPI_CLOCK       16000000L       // fMASTER, the prescaler divides 2..256
+#define SPI_QUEUE_SIZE  4               // must be a power of 2
+
+static struct {
+    spiJob_t *queue[SPI_QUEUE_SIZE];
+    volatile uint8_t head;              // next free slot, written by spi_submit()
+    volatile uint8_t tail;              // job on the bus, advanced by the interrupt
+    spiJob_t * volatile job;            // current job, NULL when idle
+    uint8_t locked;                     // spi_command() has the bus, queued jobs wait
+    uint8_t ptr;
+    uint8_t skip;                       // the byte clocked in while the command goes out is garbage
+} spiBus;
+
 void spi_init(void)
 {
     SPI_DeInit();
-    SPI_Init(SPI_FIRSTBIT_MSB, SPI_BAUDRATEPRESCALER_2, SPI_MODE_MASTER, SPI_CLOCKPOLARITY_HIGH, SPI_CLOCKPHASE_2EDGE, SPI_DATADIRECTION_2LINES_FULLDUPLEX, SPI_NSS_SOFT, 0x07);
+    SPI_Init(SPI_FIRSTBIT_MSB, SPI_BAUDRATEPRESCALER_256, SPI_MODE_MASTER, SPI_CLOCKPOLARITY_HIGH, SPI_CLOCKPHASE_2EDGE, SPI_DATADIRECTION_2LINES_FULLDUPLEX, SPI_NSS_SOFT, 0x07);
     SPI_Cmd(ENABLE);
 }
 
-uint8_t spi_writeByte(uint8_t Data)
+static uint8_t spi_prescaler(uint32_t hz)
+{
+    uint8_t br = 0;
+
+    while (br < 7 && (SPI_CLOCK >> (br + 1)) > hz)
+        br++;
+    return br;
+}
+
+void spi_device(spiDevice_t *dev)
+{
+    dev->prescaler[0] = spi_prescaler(dev->slowHz);
+    dev->prescaler[1] = spi_prescaler(dev->fastHz);
+    dev->select(0);
+}
+
+// Only with the bus idle and chip select released, the clock line may change level
+static void spi_setup(spiDevice_t *dev, uint8_t fast)
+{
+    SPI->CR1 = (uint8_t)((SPI->CR1 & ~(SPI_CR1_BR | SPI_CR1_CPOL | SPI_CR1_CPHA)) | (dev->prescaler[fast] << 3) | (dev->mode & 0x03));
+}
+
+static uint8_t spi_byte(uint8_t data)
 {
-    /* Wait until the transmit buffer is empty */
-    while (SPI_GetFlagStatus(SPI_FLAG_TXE) == RESET);
-    /* Send the byte */
-    SPI_SendData(Data);
-    /* Wait to receive a byte */
-    while (SPI_GetFlagStatus(SPI_FLAG_RXNE) == RESET);
-    /*Return the byte read from the SPI bus */
-    return SPI_ReceiveData();
+    while (!(SPI->SR & SPI_SR_TXE));
+    SPI->DR = data;
+    while (!(SPI->SR & SPI_SR_RXNE));
+    return SPI->DR;
 }
 
-uint8_t spi_readByte(void)
+// Only called from the SPI interrupt, or with interrupts masked
+static void spi_startNext(void)
 {
-    volatile uint8_t data = 0;
-    /* Wait until the transmit buffer is empty */
-    while (SPI_GetFlagStatus(SPI_FLAG_TXE) == RESET);
-    /* Send the byte */
-    SPI_SendData(0xFF);         // Dummy Byte
-    /* Wait until a data is received */
-    while (SPI_GetFlagStatus(SPI_FLAG_RXNE) == RESET);
-    /* Get the received data */
-    data = SPI_ReceiveData();
-    /* Return the shifted data */
+    spiJob_t *job;
+
+    if (spiBus.job || spiBus.locked || spiBus.tail == spiBus.head)
+        return;
+    job = spiBus.job = spiBus.queue[spiBus.tail];
+    spiBus.ptr = 0;
+    spiBus.skip = 1;
+    spi_setup(job->dev, 1);
+    job->dev->select(1);
+    (void)SPI->DR;                      // drop anything left over from spi_command()
+    SPI->ICR |= SPI_ICR_RXEI;
+    SPI->DR = job->cmd;
+}
+
+uint8_t spi_command(spiDevice_t *dev, uint8_t cmd, uint8_t data)
+{
+    disableInterrupts();
+    spiBus.locked = 1;
+    enableInterrupts();
+    while (spiBus.job);                 // a burst already on the bus finishes first
+
+    spi_setup(dev, 0);
+    dev->select(1);
+    spi_byte(cmd);
+    data = spi_byte(data);
+    dev->select(0);
+
+    disableInterrupts();
+    spiBus.locked = 0;
+    spi_startNext();
+    enableInterrupts();
     return data;
 }
 
+// No DMA on STM8S105, so this runs one byte per RXNE interrupt
+uint8_t spi_submit(spiJob_t *job)
+{
+    uint8_t next;
+
+    if (job->len == 0)
+        return 0;
+    disableInterrupts();
+    next = (spiBus.head + 1) & (SPI_QUEUE_SIZE - 1);
+    if (job->busy || next == spiBus.tail) {
+        enableInterrupts();
+        return 0;
+    }
+    job->busy = 1;
+    spiBus.queue[spiBus.head] = job;
+    spiBus.head = next;
+    spi_startNext();
+    enableInterrupts();
+    return 1;
+}
+
+void spi_read(spiDevice_t *dev, uint8_t cmd, uint8_t *buf, uint8_t len)
+{
+    spiJob_t job;
+
+    job.dev = dev;
+    job.cmd = cmd;
+    job.buf = buf;
+    job.len = len;
+    job.done = NULL;
+    job.busy = 0;
+    while (!spi_submit(&job));
+    while (job.busy);
+}
+
+uint8_t spi_isBusy(void)
+{
+    return spiBus.job != NULL || spiBus.tail != spiBus.head;
+}
+
+__near __interrupt void SPI_IRQHandler(void)
+{
+    // Register access instead of SPI_ReceiveData()/SPI_SendData(), we're here once per byte
+    spiJob_t *job = spiBus.job;
+    uint8_t data = SPI->DR;             // reading DR clears RXNE
+
+    if (spiBus.skip)
+        spiBus.skip = 0;
+    else
+        job->buf[spiBus.ptr++] = data;
+
+    if (spiBus.ptr < job->len) {
+        SPI->DR = 0xFF;                 // dummy byte clocks in the next register
+    } else {
+        SPI->ICR &= (uint8_t)~SPI_ICR_RXEI;
+        job->dev->select(0);
+        spiBus.job = NULL;
+        spiBus.tail = (spiBus.tail + 1) & (SPI_QUEUE_SIZE - 1);
+        job->busy = 0;
+        if (job->done)
+            job->done(job);
+        spi_startNext();
+    }
+}
+
 // ************************************************************************************************************
 // I2C general functions
 // ************************************************************************************************************
+#define I2C_MAX_STANDARD_HZ 100000
+
+// Per device speed and health, see i2cdev.h. The bus is switched between jobs when the next one wants the
+// other mode, with the peripheral off while the clock registers change. The STM's I2C block stops at fast mode.
+#include "i2cdev.h"
+
+// A slave reset or cut off in the middle of a read holds SDA low until it has clocked out the rest of its byte,
+// and no START gets through. With the peripheral off the pins are GPIOs: SCL is clocked until SDA is let go, at
+// most 9 times, then START and STOP by hand. Runs from i2c_init(), at boot and after every timeout.
+static uint16_t i2cRecoveries = 0;
+
+static void i2c_halfBit(void)
+{
+    uint32_t t = microsISR();
+
+    while (microsISR() - t < 5)         // 100kHz
+        ;
+}
+
+static void i2c_unstick(void)
+{
+    uint8_t i;
+
+    // PB4 SCL, PB5 SDA
+    I2C->CR1 &= (uint8_t)~I2C_CR1_PE;
+    GPIO_Init(GPIOB, GPIO_PIN_4 | GPIO_PIN_5, GPIO_MODE_OUT_OD_HIZ_FAST);
+    if (!GPIO_ReadInputPin(GPIOB, GPIO_PIN_5)) {
+        for (i = 0; i < 9 && !GPIO_ReadInputPin(GPIOB, GPIO_PIN_5); i++) {
+            GPIO_WriteLow(GPIOB, GPIO_PIN_4);
+            i2c_halfBit();
+            GPIO_WriteHigh(GPIOB, GPIO_PIN_4);
+            i2c_halfBit();
+        }
+        GPIO_WriteLow(GPIOB, GPIO_PIN_5);
+        i2c_halfBit();
+        GPIO_WriteHigh(GPIOB, GPIO_PIN_5);
+        i2c_halfBit();
+        i2cRecoveries++;
+    }
+    GPIO_Init(GPIOB, GPIO_PIN_4 | GPIO_PIN_5, GPIO_MODE_IN_FL_NO_IT);
+}
+
+uint16_t i2c_busRecoveries(void)
+{
+    return i2cRecoveries;
+}
+
+// CCRL, CCRH and TRISER as I2C_Init() works them out for standard and fast mode
+static uint8_t i2cClock[2][3];
+static uint8_t i2cFast;
+
+static void i2c_setClock(uint8_t fast)
+{
+    uint8_t n = 255;
+
+    // the STOP of the last job has to be on the wire before the peripheral goes off
+    while ((I2C->CR2 & I2C_CR2_STOP) && --n)
+        ;
+    I2C->CR1 &= (uint8_t)~I2C_CR1_PE;
+    I2C->CCRL = i2cClock[fast][0];
+    I2C->CCRH = i2cClock[fast][1];
+    I2C->TRISER = i2cClock[fast][2];
+    I2C->CR1 |= I2C_CR1_PE;
+    I2C->CR2 |= I2C_CR2_ACK;            // PE off cleared it
+    i2cFast = fast;
+}
+
 void i2c_init(void)
 {
+    uint8_t fast;
+
+    i2c_unstick();
     I2C_DeInit();
-#if (I2C_SPEED == 100000)
-    // retarded slow speed for broken boards
-    I2C_Init(I2C_MAX_STANDARD_FREQ, 0xA0, I2C_DUTYCYCLE_2, I2C_ACK_CURR, I2C_ADDMODE_7BIT, I2C_MAX_INPUT_FREQ);
-#else
-    I2C_Init(I2C_MAX_FAST_FREQ, 0xA0, I2C_DUTYCYCLE_2, I2C_ACK_CURR, I2C_ADDMODE_7BIT, I2C_MAX_INPUT_FREQ);
-#endif
+    for (fast = 0; fast < 2; fast++) {
+        I2C_Init(fast ? I2C_MAX_FAST_FREQ : I2C_MAX_STANDARD_FREQ, 0xA0, I2C_DUTYCYCLE_2, I2C_ACK_CURR,
+                 I2C_ADDMODE_7BIT, I2C_MAX_INPUT_FREQ);
+        i2cClock[fast][0] = I2C->CCRL;
+        i2cClock[fast][1] = I2C->CCRH;
+        i2cClock[fast][2] = I2C->TRISER;
+    }
     I2C_Cmd(ENABLE);
+    i2c_setClock(I2C_SPEED > I2C_MAX_STANDARD_HZ);
 }
 
-#define I2C_TIMEOUT 0x600
+// Transactions are queued and run back to back from the I2C interrupt. Nobody spins on the bus
+// except the blocking i2c_read()/i2c_write() wrappers, and those are bounded by I2C_JOB_TIMEOUT.
+#define I2C_QUEUE_SIZE  8               // must be a power of 2
 
-typedef enum {                  //returns I2C error/success codes
-    I2C_SUCCESS = 0,            //theres only one sort of success
-    I2C_START_TIMEOUT,
-    I2C_RSTART_TIMEOUT,
-    I2C_SACK_FAILURE,
-    I2C_SACK_TIMEOUT,
-    I2C_TX_TIMEOUT,
-    I2C_RX_TIMEOUT
-} I2C_Returntype;
+enum {
+    I2C_PHASE_START = 0,
+    I2C_PHASE_ADDR_TX,
+    I2C_PHASE_TX,
+    I2C_PHASE_RSTART,
+    I2C_PHASE_ADDR_RX,
+    I2C_PHASE_RX
+};
 
-uint8_t i2c_write(uint8_t *buf, uint8_t size)
+static struct {
+    i2cJob_t *queue[I2C_QUEUE_SIZE];
+    volatile uint8_t head;              // next free slot, written by i2c_submit()
+    volatile uint8_t tail;              // job on the bus, advanced by the interrupt
+    i2cJob_t *job;                      // current job, NULL when idle
+    uint8_t phase;
+    uint8_t ptr;
+    uint8_t subaddrSent;
+    uint32_t started;                   // micros() when the current job got the bus
+} i2cBus;
+
+static void i2c_startNext(void);
+
+// Only called from the I2C interrupt, or with interrupts masked
+static void i2c_finish(uint8_t status)
 {
-    // Sets up an i2c device
-    uint8_t n;
-    uint16_t tm = 0;
-    I2C_GenerateSTART(ENABLE);
-    while (!I2C_CheckEvent(I2C_EVENT_MASTER_MODE_SELECT)) {
-        tm++;
-        if (tm > I2C_TIMEOUT)
-            return I2C_START_TIMEOUT;
-    }
-    tm = 0;
-    I2C_Send7bitAddress(buf[0], I2C_DIRECTION_TX);      //Address write
-    while (!I2C_CheckEvent(I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED)) {
-        tm++;
-        if (tm > I2C_TIMEOUT)
-            return I2C_SACK_TIMEOUT;
-        if (SET == I2C_GetFlagStatus(I2C_FLAG_ACKNOWLEDGEFAILURE)) {
-            I2C_ClearFlag(I2C_FLAG_ACKNOWLEDGEFAILURE);
-            I2C_GenerateSTOP(ENABLE);   //Enable the STOP here - so hardware is ready again
-            return I2C_SACK_FAILURE;    //Slave did not ack
-        }
+    i2cJob_t *job = i2cBus.job;
+
+    I2C->ITR = 0;
+    I2C->CR2 &= (uint8_t)~I2C_CR2_POS;
+    I2C->CR2 |= I2C_CR2_ACK;
+    i2cBus.job = NULL;
+    i2cBus.tail = (i2cBus.tail + 1) & (I2C_QUEUE_SIZE - 1);
+
+    i2cdev_result(job, status, microsISR());
+    job->status = status;
+    if (job->done)
+        job->done(job);
+    i2c_startNext();
+}
+
+static void i2c_startNext(void)
+{
+    if (i2cBus.job || i2cBus.tail == i2cBus.head)
+        return;
+    i2cBus.job = i2cBus.queue[i2cBus.tail];
+    i2cBus.ptr = 0;
+    i2cBus.subaddrSent = 0;
+    i2cBus.started = microsISR();
+    if (i2cBus.job->read && i2cBus.job->subaddr == 0xFF)
+        i2cBus.phase = I2C_PHASE_RSTART;            // no register pointer to set up, straight to the read
+    else
+        i2cBus.phase = I2C_PHASE_START;
+    if (i2cBus.job->fast != i2cFast)
+        i2c_setClock(i2cBus.job->fast);
+    I2C->ITR = I2C_ITR_ITEVTEN | I2C_ITR_ITERREN;
+    I2C->CR2 |= I2C_CR2_START;
+}
+
+uint8_t i2c_submit(i2cJob_t *job)
+{
+    uint8_t next;
+
+    disableInterrupts();
+    if (!i2cdev_admit(job, microsISR())) {
+        enableInterrupts();
+        job->status = I2C_BACKOFF;
+        return I2C_BACKOFF;
     }
-    for (n = 1; n < size; n++) {
-        tm = 0;
-        I2C_SendData(buf[n]);   //Write rest of string (registers)
-        while (!I2C_CheckEvent(I2C_EVENT_MASTER_BYTE_TRANSMITTED)) {
-            tm++;
-            if (tm > I2C_TIMEOUT)
-                return I2C_TX_TIMEOUT;
-        }
+    next = (i2cBus.head + 1) & (I2C_QUEUE_SIZE - 1);
+    if (next == i2cBus.tail) {
+        enableInterrupts();
+        job->status = I2C_QUEUE_FULL;
+        return I2C_QUEUE_FULL;
+    }
+    job->status = I2C_PENDING;
+    i2cBus.queue[i2cBus.head] = job;
+    i2cBus.head = next;
+    i2c_startNext();
+    enableInterrupts();
+    return I2C_SUCCESS;
+}
+
+void i2c_poll(void)
+{
+    static const uint8_t timeoutCode[] = { I2C_START_TIMEOUT, I2C_SACK_TIMEOUT, I2C_TX_TIMEOUT, I2C_RSTART_TIMEOUT, I2C_SACK_TIMEOUT, I2C_RX_TIMEOUT };
+    uint8_t phase;
+
+    disableInterrupts();
+    if (i2cBus.job && (microsISR() - i2cBus.started) > I2C_JOB_TIMEOUT(i2cBus.job)) {
+        // Slave is holding the bus or never answered. Drop the job and give the peripheral a fresh start.
+        phase = i2cBus.phase;
+        I2C->ITR = 0;
+        I2C->CR2 |= I2C_CR2_STOP;
+        i2c_init();
+        i2c_finish(timeoutCode[phase]);
     }
-    I2C_GenerateSTOP(ENABLE);   //Finally send the stop bit
-    return I2C_SUCCESS;         //Completed ok
+    enableInterrupts();
 }
 
-uint8_t i2c_read(uint8_t *buf, uint8_t size, uint8_t address, uint8_t subaddr)
+uint8_t i2c_isIdle(void)
+{
+    return i2cBus.job == NULL;
+}
+
+__near __interrupt void I2C_IRQHandler(void)
 {
-    int8_t n = 0;               //0xFF as the Sub_Addr disables sub address
-    uint16_t tm = 0;
-    if (subaddr != 0xFF) {      //0xFF disables this - so we wont setup addr pointer
-        I2C_GenerateSTART(ENABLE);
-        while (!I2C_CheckEvent(I2C_EVENT_MASTER_MODE_SELECT)) {
-            tm++;
-            if (tm > I2C_TIMEOUT)
-                return I2C_START_TIMEOUT;
+    i2cJob_t *job = i2cBus.job;
+    uint8_t sr1 = I2C->SR1;
+    uint8_t sr2 = I2C->SR2;
+    uint8_t remaining;
+
+    if (!job) {
+        I2C->ITR = 0;
+        return;
+    }
+
+    if (sr2 & (I2C_SR2_AF | I2C_SR2_BERR | I2C_SR2_ARLO | I2C_SR2_OVR)) {
+        I2C->SR2 = 0;
+        I2C->CR2 |= I2C_CR2_STOP;                   // release the bus so the next job can have it
+        i2c_finish((sr2 & I2C_SR2_AF) ? I2C_SACK_FAILURE : I2C_BUS_ERROR);
+        return;
+    }
+
+    if (sr1 & I2C_SR1_SB) {
+        if (i2cBus.phase == I2C_PHASE_START) {
+            i2cBus.phase = I2C_PHASE_ADDR_TX;
+            I2C->DR = job->address & 0xFE;          // address write
+        } else {
+            i2cBus.phase = I2C_PHASE_ADDR_RX;
+            if (job->len == 2)
+                I2C->CR2 |= I2C_CR2_POS;            // ACK bit applies to the next byte, ref man p713
+            I2C->DR = job->address | 0x01;          // address read
         }
-        tm = 0;
-
-        I2C_Send7bitAddress(address, I2C_DIRECTION_TX); //Address write
-        while (!I2C_CheckEvent(I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED)) {
-            tm++;
-            if (tm > I2C_TIMEOUT)
-                return I2C_SACK_TIMEOUT;        //Checks that the slave acknowledged
-            if (SET == I2C_GetFlagStatus(I2C_FLAG_ACKNOWLEDGEFAILURE)) {
-                I2C_ClearFlag(I2C_FLAG_ACKNOWLEDGEFAILURE);
-                I2C_GenerateSTOP(ENABLE);       //Enable the STOP here - so hardware is ready again
-                return I2C_SACK_FAILURE;        //Slave did not ack
+        return;
+    }
+
+    if (sr1 & I2C_SR1_ADDR) {
+        if (i2cBus.phase == I2C_PHASE_ADDR_TX) {
+            (void)I2C->SR3;                         // SR1 then SR3 clears ADDR
+            i2cBus.phase = I2C_PHASE_TX;
+            I2C->ITR |= I2C_ITR_ITBUFEN;
+        } else {
+            i2cBus.phase = I2C_PHASE_RX;
+            if (job->len == 1) {
+                I2C->CR2 &= (uint8_t)~I2C_CR2_ACK;  // single byte: NACK and STOP before ADDR is cleared
+                (void)I2C->SR3;
+                I2C->CR2 |= I2C_CR2_STOP;
+                I2C->ITR |= I2C_ITR_ITBUFEN;
+            } else if (job->len == 2) {
+                (void)I2C->SR3;
+                I2C->CR2 &= (uint8_t)~I2C_CR2_ACK;  // with POS set, NACKs the second byte. Both come in on BTF
+            } else {
+                (void)I2C->SR3;
+                I2C->ITR |= I2C_ITR_ITBUFEN;
             }
         }
-        tm = 0;
-        I2C_SendData(subaddr);  //Write sub address register
-        while (!I2C_CheckEvent(I2C_EVENT_MASTER_BYTE_TRANSMITTED)) {
-            tm++;
-            if (tm > I2C_TIMEOUT)
-                return I2C_TX_TIMEOUT;
-        }
-        //I2C_GenerateSTOP( I2C1, ENABLE ); //This code doesnt _seem_ to be needed
-        //while(I2C_GetFlagStatus(I2C1,I2C_FLAG_BUSY)==SET); //Wait for bus to go inactive
-    }
-    tm = 0;
-    I2C_GenerateSTART(ENABLE);  //Repeated start or the first start
-    while (!I2C_CheckEvent(I2C_EVENT_MASTER_MODE_SELECT)) {
-        tm++;
-        if (tm > I2C_TIMEOUT)
-            return I2C_RSTART_TIMEOUT;  //note that if we disable sub addr, then a start error
-    }                           //becomes a repeated start error
-    tm = 0;
-    I2C_Send7bitAddress(address | 0x01, I2C_DIRECTION_RX);      //Address to read
-    while (!I2C_CheckEvent(I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED)) {
-        tm++;
-        if (tm > I2C_TIMEOUT)
-            return I2C_SACK_TIMEOUT;    //Checks that the slave acknowledged
-        if (SET == I2C_GetFlagStatus(I2C_FLAG_ACKNOWLEDGEFAILURE)) {
-            I2C_ClearFlag(I2C_FLAG_ACKNOWLEDGEFAILURE);
-            I2C_GenerateSTOP(ENABLE);   //Enable the STOP here - so hardware is ready again
-            return I2C_SACK_FAILURE;    //Slave did not ack
-        }
-    }                           //We now auto switch to rx mode
-    if (size > 2) {             //More than two bytes to receive
-        tm = 0;
-        while (!I2C_CheckEvent(I2C_EVENT_MASTER_BYTE_RECEIVED)) {       //Wait for the first byte
-            tm++;
-            if (tm > I2C_TIMEOUT)
-                return I2C_RX_TIMEOUT;
-        }
-        for (; n < ((int8_t) size - 3); n++) {
-            tm = 0;
-            buf[n] = I2C_ReceiveData();
-            while (!I2C_CheckEvent(I2C_EVENT_MASTER_BYTE_RECEIVED)) {
-                tm++;
-                if (tm > I2C_TIMEOUT)
-                    return I2C_RX_TIMEOUT;
+        return;
+    }
+
+    if (i2cBus.phase == I2C_PHASE_TX) {
+        if (sr1 & I2C_SR1_TXE) {
+            if (!i2cBus.subaddrSent && job->subaddr != 0xFF) {
+                i2cBus.subaddrSent = 1;
+                I2C->DR = job->subaddr;
+                return;
             }
+            if (!job->read && i2cBus.ptr < job->len) {
+                I2C->DR = job->buf[i2cBus.ptr++];
+                return;
+            }
+            if (job->subaddr == 0xFF && i2cBus.ptr == 0) {
+                I2C->CR2 |= I2C_CR2_STOP;           // address only, nothing was clocked out so BTF won't come
+                i2c_finish(I2C_SUCCESS);
+                return;
+            }
+            // Everything is in the shift register, wait for BTF without TXE hammering us
+            I2C->ITR &= (uint8_t)~I2C_ITR_ITBUFEN;
+            if (!(sr1 & I2C_SR1_BTF))
+                return;
         }
-        tm = 0;
-        while (I2C_GetFlagStatus(I2C_FLAG_TRANSFERFINISHED) != SET) {   //Wait for two bytes to be received - ref man p712
-            tm++;
-            if (tm > I2C_TIMEOUT)
-                return I2C_RX_TIMEOUT;
-        }
-        I2C_AcknowledgeConfig(DISABLE); //Do not ack the last byte
-        buf[n++] = I2C_ReceiveData();   //Third to last byte
-        I2C_GenerateSTOP(ENABLE);       //Enable the STOP here
-        buf[n++] = I2C_ReceiveData();   //Read the Penultimate from buffer
-        tm = 0;
-        while (I2C_GetFlagStatus(I2C_FLAG_RXNOTEMPTY) != SET) { //Last byte received here with a NACK and STOP
-            tm++;
-            if (tm > I2C_TIMEOUT)
-                return I2C_RX_TIMEOUT;
+        if (sr1 & I2C_SR1_BTF) {
+            if (job->read) {
+                i2cBus.phase = I2C_PHASE_RSTART;
+                I2C->CR2 |= I2C_CR2_START;          // repeated start for the read
+            } else {
+                I2C->CR2 |= I2C_CR2_STOP;
+                i2c_finish(I2C_SUCCESS);
+            }
         }
-    } else {
-        I2C_AcknowledgeConfig(DISABLE); //Do not ack the last byte
-        tm = 0;
-        while (I2C_GetFlagStatus(I2C_FLAG_TRANSFERFINISHED) != SET) {   //Wait for two bytes to be received - ref man p713
-            tm++;
-            if (tm > I2C_TIMEOUT)
-                return I2C_RX_TIMEOUT;
+        return;
+    }
+
+    if (i2cBus.phase == I2C_PHASE_RX) {
+        remaining = job->len - i2cBus.ptr;
+        if (remaining == 1) {
+            if (sr1 & I2C_SR1_RXNE) {
+                job->buf[i2cBus.ptr++] = I2C->DR;   // last byte, NACK and STOP were set up already
+                i2c_finish(I2C_SUCCESS);
+            }
+        } else if (remaining == 2) {
+            if (sr1 & I2C_SR1_BTF) {
+                I2C->CR2 |= I2C_CR2_STOP;
+                job->buf[i2cBus.ptr++] = I2C->DR;
+                job->buf[i2cBus.ptr++] = I2C->DR;
+                i2c_finish(I2C_SUCCESS);
+            }
+        } else if (remaining == 3) {
+            // Same dance as the old polled read: let two bytes stack up, then NACK, STOP and drain
+            I2C->ITR &= (uint8_t)~I2C_ITR_ITBUFEN;
+            if (sr1 & I2C_SR1_BTF) {
+                I2C->CR2 &= (uint8_t)~I2C_CR2_ACK;
+                job->buf[i2cBus.ptr++] = I2C->DR;   // third to last
+                I2C->CR2 |= I2C_CR2_STOP;
+                job->buf[i2cBus.ptr++] = I2C->DR;   // penultimate
+                I2C->ITR |= I2C_ITR_ITBUFEN;        // last one arrives on RXNE
+            }
+        } else if (sr1 & I2C_SR1_RXNE) {
+            job->buf[i2cBus.ptr++] = I2C->DR;
         }
-        I2C_GenerateSTOP(ENABLE);       //Enable the STOP here
-        buf[n++] = I2C_ReceiveData();   //First byte to lowest location
     }
-    buf[n] = I2C_ReceiveData(); //Clear the buffer (last byte is in it)
-    I2C_AcknowledgeConfig(ENABLE);      //Re-enable ACK
-    return I2C_SUCCESS;         //Exit ok
+}
+
+// Blocking wrapper around a queued job, for init code and the drivers that need the data right now
+static uint8_t i2c_runJob(i2cJob_t *job)
+{
+    if (i2c_submit(job) != I2C_SUCCESS)
+        return job->status;
+    while (job->status == I2C_PENDING)
+        i2c_poll();
+    return job->status;
+}
+
+uint8_t i2c_write(uint8_t *buf, uint8_t size)
+{
+    // buf[0] is the slave address, the rest goes out as is
+    i2cJob_t job;
+    job.address = buf[0];
+    job.subaddr = 0xFF;
+    job.buf = buf + 1;
+    job.len = size - 1;
+    job.read = 0;
+    job.done = NULL;
+    return i2c_runJob(&job);
+}
+
+uint8_t i2c_read(uint8_t *buf, uint8_t size, uint8_t address, uint8_t subaddr)
+{
+    //0xFF as the subaddr disables sub address
+    i2cJob_t job;
+    job.address = address;
+    job.subaddr = subaddr;
+    job.buf = buf;
+    job.len = size;
+    job.read = 1;
+    job.done = NULL;
+    return i2c_runJob(&job);
 }
 
 /* Fixed lookup table for TIM1/2 Pulse Width registers */
@@ -472,8 +1105,101 @@ static const struct {
 // pulse period for analog servo (50Hz)
 #define PULSE_PERIOD_SERVO_ANALOG  (40000)
 
+static uint8_t pwmServo;
+#ifdef DIGITAL_SERVO
+static uint16_t pwmServoPeriod = PULSE_PERIOD_SERVO_DIGITAL;
+#else
+static uint16_t pwmServoPeriod = PULSE_PERIOD_SERVO_ANALOG;
+#endif
+
+#if defined(MOTOR_ONESHOT)
+/* One pulse mode: pwmSync() starts the counter, it runs to ONESHOT_PERIOD once and stops. The output is high
+   from CCR to the end, so the pulse is end aligned and the line is low while the timer is stopped. The
+   prescaler is cut by ONESHOT_SCALE so pulses still come out in 0.5us / ONESHOT_SCALE ticks */
+#define ONESHOT_PERIOD  (2200 * 2)      // longest pulse plus the lead in, in ticks
+#define ONESHOT_TIM1_PSC    (8 / ONESHOT_SCALE - 1)
+#define ONESHOT_TIM2_PSC    ((TIM2_Prescaler_TypeDef)(ONESHOT_SCALE == 8 ? 0 : ONESHOT_SCALE == 4 ? 1 : ONESHOT_SCALE == 2 ? 2 : 3))
+
+void pwmInit(uint8_t useServo)
+{
+    pwmServo = useServo;
+
+    TIM1_DeInit();
+    TIM1_TimeBaseInit(ONESHOT_TIM1_PSC, TIM1_COUNTERMODE_UP, ONESHOT_PERIOD, 0);
+    TIM1_OC1Init(TIM1_OCMODE_PWM2, TIM1_OUTPUTSTATE_ENABLE, TIM1_OUTPUTNSTATE_DISABLE, ONESHOT_PERIOD, TIM1_OCPOLARITY_HIGH, TIM1_OCNPOLARITY_HIGH, TIM1_OCIDLESTATE_RESET, TIM1_OCNIDLESTATE_RESET);
+    TIM1_OC1PreloadConfig(ENABLE);
+    TIM1_OC2Init(TIM1_OCMODE_PWM2, TIM1_OUTPUTSTATE_ENABLE, TIM1_OUTPUTNSTATE_DISABLE, ONESHOT_PERIOD, TIM1_OCPOLARITY_HIGH, TIM1_OCNPOLARITY_HIGH, TIM1_OCIDLESTATE_RESET, TIM1_OCNIDLESTATE_RESET);
+    TIM1_OC2PreloadConfig(ENABLE);
+    TIM1_OC3Init(TIM1_OCMODE_PWM2, TIM1_OUTPUTSTATE_ENABLE, TIM1_OUTPUTNSTATE_DISABLE, ONESHOT_PERIOD, TIM1_OCPOLARITY_HIGH, TIM1_OCNPOLARITY_HIGH, TIM1_OCIDLESTATE_RESET, TIM1_OCNIDLESTATE_RESET);
+    TIM1_OC3PreloadConfig(ENABLE);
+    TIM1_OC4Init(TIM1_OCMODE_PWM2, TIM1_OUTPUTSTATE_ENABLE, ONESHOT_PERIOD, TIM1_OCPOLARITY_HIGH, TIM1_OCIDLESTATE_RESET);
+    TIM1_OC4PreloadConfig(ENABLE);
+    TIM1_ARRPreloadConfig(ENABLE);
+    TIM1_SelectOnePulseMode(TIM1_OPMODE_SINGLE);
+    TIM1_CtrlPWMOutputs(ENABLE);
+
+    TIM2_DeInit();
+    if (!useServo) {
+        TIM2_TimeBaseInit(ONESHOT_TIM2_PSC, ONESHOT_PERIOD);
+        TIM2_OC1Init(TIM2_OCMODE_PWM2, TIM2_OUTPUTSTATE_ENABLE, ONESHOT_PERIOD, TIM2_OCPOLARITY_HIGH);
+        TIM2_OC1PreloadConfig(ENABLE);
+        TIM2_OC2Init(TIM2_OCMODE_PWM2, TIM2_OUTPUTSTATE_ENABLE, ONESHOT_PERIOD, TIM2_OCPOLARITY_HIGH);
+        TIM2_OC2PreloadConfig(ENABLE);
+        TIM2_ARRPreloadConfig(ENABLE);
+        TIM2_SelectOnePulseMode(TIM2_OPMODE_SINGLE);
+    } else {
+        TIM2_TimeBaseInit(TIM2_PRESCALER_8, pwmServoPeriod);
+        TIM2_OC1Init(TIM2_OCMODE_PWM2, TIM2_OUTPUTSTATE_ENABLE, PULSE_1MS, TIM2_OCPOLARITY_LOW);
+        TIM2_OC1PreloadConfig(ENABLE);
+        TIM2_OC2Init(TIM2_OCMODE_PWM2, TIM2_OUTPUTSTATE_ENABLE, PULSE_1MS, TIM2_OCPOLARITY_LOW);
+        TIM2_OC2PreloadConfig(ENABLE);
+        TIM2_ARRPreloadConfig(ENABLE);
+        TIM2_Cmd(ENABLE);
+    }
+}
+
+void pwmWrite(uint8_t channel, uint16_t value)
+{
+    uint16_t pulse = (value << 1);
+
+    if (channel < 4 || !pwmServo)
+        pulse = ONESHOT_PERIOD - pulse;
+    *TimerAddress[channel].addressH = (uint8_t) (pulse >> 8);
+    *TimerAddress[channel].addressL = (uint8_t) (pulse);
+}
+
+// A timer still busy with the last pulse keeps it, the new value is latched when it stops
+static void pwmSync(void)
+{
+    if (!(TIM1->CR1 & TIM1_CR1_CEN)) {
+        TIM1->EGR = TIM1_EGR_UG;        // loads the new compare values
+        TIM1->CR1 |= TIM1_CR1_CEN;
+    }
+    if (!pwmServo && !(TIM2->CR1 & TIM2_CR1_CEN)) {
+        TIM2->EGR = TIM2_EGR_UG;
+        TIM2->CR1 |= TIM2_CR1_CEN;
+    }
+}
+
+/* The pulses of all motors start together in pwmSync(), so they can't latch apart. No update disable
+   here: a read-modify-write of CR1 could set CEN again on a timer that just stopped itself */
+void pwmWriteAll(const int16_t *value, uint8_t count)
+{
+    uint16_t pulse;
+    uint8_t i;
+
+    for (i = 0; i < count; i++) {
+        pulse = ONESHOT_PERIOD - (value[i] << 1);
+        *TimerAddress[i].addressH = (uint8_t) (pulse >> 8);
+        *TimerAddress[i].addressL = (uint8_t) (pulse);
+    }
+    pwmSync();
+}
+#else
 void pwmInit(uint8_t useServo)
 {
+    pwmServo = useServo;
+
     // Motor PWM timers at 400Hz
     TIM1_DeInit();
     TIM1_TimeBaseInit(7, TIM1_COUNTERMODE_UP, PULSE_PERIOD, 0);
@@ -501,11 +1227,7 @@ void pwmInit(uint8_t useServo)
         // Servos
         // Enable TIM2 for servo output - slower rates
         TIM2_DeInit();
-#ifdef DIGITAL_SERVO
-        TIM2_TimeBaseInit(TIM2_PRESCALER_8, PULSE_PERIOD_SERVO_DIGITAL);
-#else
-        TIM2_TimeBaseInit(TIM2_PRESCALER_8, PULSE_PERIOD_SERVO_ANALOG);
-#endif
+        TIM2_TimeBaseInit(TIM2_PRESCALER_8, pwmServoPeriod);
         TIM2_OC1Init(TIM2_OCMODE_PWM2, TIM2_OUTPUTSTATE_ENABLE, PULSE_1MS, TIM2_OCPOLARITY_LOW);
         TIM2_OC1PreloadConfig(ENABLE);
         TIM2_OC2Init(TIM2_OCMODE_PWM2, TIM2_OUTPUTSTATE_ENABLE, PULSE_1MS, TIM2_OCPOLARITY_LOW);
@@ -524,3 +1246,39 @@ void pwmWrite(uint8_t channel, uint16_t value)
     *TimerAddress[channel].addressH = (uint8_t) (pulse >> 8);
     *TimerAddress[channel].addressL = (uint8_t) (pulse);
 }
+
+/* The update events are held off (UDIS) while the compare preload registers are written, so no motor
+   takes its new pulse a period before the others, or a CCRxH of one loop with the CCRxL of the last.
+   TIM1 and TIM2 count the same 0.5us ticks to the same period from pwmInit() on, so they stay in step */
+void pwmWriteAll(const int16_t *value, uint8_t count)
+{
+    uint16_t pulse;
+    uint8_t i;
+
+    TIM1->CR1 |= TIM1_CR1_UDIS;
+    if (count > 4)
+        TIM2->CR1 |= TIM2_CR1_UDIS;
+    for (i = 0; i < count; i++) {
+        pulse = value[i] << 1;
+        *TimerAddress[i].addressH = (uint8_t) (pulse >> 8);
+        *TimerAddress[i].addressL = (uint8_t) (pulse);
+    }
+    TIM1->CR1 &= ~TIM1_CR1_UDIS;
+    TIM2->CR1 &= ~TIM2_CR1_UDIS;
+}
+#endif
+
+/* Both servo outputs are on TIM2, so one rate for the two. ARR is preloaded: a running timer finishes its
+   period first */
+void pwmServoRate(uint16_t hz)
+{
+    if (hz < 50)
+        hz = 50;
+    if (hz > 400)
+        hz = 400;
+    pwmServoPeriod = 2000000UL / hz;
+    if (pwmServo) {
+        TIM2->ARRH = (uint8_t) (pwmServoPeriod >> 8);
+        TIM2->ARRL = (uint8_t) (pwmServoPeriod);
+    }
+}
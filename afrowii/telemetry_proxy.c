@@ -0,0 +1,609 @@
+/* Telemetry proxy: one board link shared by any number of host programs
+ *
+ * Owns the serial port, runs what the board sends through the hostproto.c parser once and hands every good
+ * frame to all connected clients, so the GUI, MultiWiiConf, a logger and an OSD preview watch the same stream
+ * without each of them asking the board for it again:
+ *   - TCP clients (-p) get the frames back to back as the board sent them, they read it like the serial port
+ *   - WebSocket clients (-w, RFC 6455) get one binary message per frame
+ * Bytes outside of any frame and frames that fail their checksum are not passed on. A client that doesn't keep
+ * up loses whole frames, never parts of one, and never holds the others back.
+ * What clients send goes to the board, one client at a time: the first one to send holds the link until it has
+ * been quiet for CMD_HOLD or disconnects, what the others send meanwhile is dropped. The replies reach every
+ * client like the rest of the stream. -r drops everything clients send.
+ * While no client holds the link the proxy pings the board every CLOCK_PING ('y', hp_clockPing()) to put its
+ * clock on the host's, and with that takes the age of every stream frame: the time it came in less the board
+ * time of its values, the serial latency plus the transmit queue on the board. Its replies go to the clients too.
+ *   gcc -O2 -o telemetry_proxy telemetry_proxy.c hostproto.c
+ *   ./telemetry_proxy [-b baud] [-p port] [-w port] [-a] [-r] /dev/ttyUSB0
+ * -b is the link rate (115200), -p the TCP port (5760, 0 for none), -w the WebSocket port (5761, 0 for none).
+ * The ports listen on 127.0.0.1, -a takes connections from anywhere. The device can also be a FIFO or a file,
+ * e.g. a capture to replay. Counts per frame kind and per client, and the stream frame ages, are printed on exit
+ * (SIGINT, SIGTERM).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "hostproto.h"
+
+#define MAX_CLIENTS         16
+#define CLIENT_OUT          32768       // bytes queued per client, a frame that doesn't fit is dropped
+#define CLIENT_IN           4096        // HTTP request or WebSocket frames that haven't completed yet
+#define LINK_OUT            4096        // commands queued for the board
+#define CMD_HOLD            1.0         // s a client keeps the command link after its last byte
+#define CLOCK_PING          1.0         // s between clock pings
+#define WS_GUID             "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+enum { CLIENT_TCP = 0, CLIENT_WS_HTTP, CLIENT_WS };
+
+typedef struct {
+    int fd;                             // -1 for a free slot
+    uint8_t type;
+    char name[32];
+    uint8_t in[CLIENT_IN];
+    size_t inLen;
+    uint8_t out[CLIENT_OUT];
+    size_t outHead, outLen;             // outLen bytes waiting from out[outHead]
+    unsigned long frames, dropped, refused;
+} client_t;
+
+static client_t clients[MAX_CLIENTS];
+static int linkFd = -1;
+static uint8_t linkOut[LINK_OUT];
+static size_t linkOutLen = 0;
+static int owner = -1;                  // client holding the command link
+static double ownerLast;
+static int readOnly = 0;
+static unsigned long kindCount[HP_KINDS], linkDropped = 0;
+static hp_parser_t parser;
+static hp_clock_t boardClock;
+static double linkRead, lastPing = 0.0;    // host time of the bytes being parsed, of the last ping
+static int pinging = 1;                 // not into a read only device
+static unsigned long ageCount = 0;
+static double ageSum = 0.0, ageMin = 0.0, ageMax = 0.0;
+static volatile sig_atomic_t quit = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static speed_t baudCode(long baud)
+{
+    switch (baud) {
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    case 460800:
+        return B460800;
+    case 921600:
+        return B921600;
+    }
+    fprintf(stderr, "telemetry_proxy: unsupported baud rate %ld\n", baud);
+    exit(1);
+}
+
+// 8N1 raw. Anything that isn't a tty (a FIFO, a capture) is read as it is
+static int portOpen(const char *dev, long baud)
+{
+    struct termios tio;
+    int f;
+
+    if ((f = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0 && (f = open(dev, O_RDONLY | O_NONBLOCK)) < 0)
+        return -1;
+    if (tcgetattr(f, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, baudCode(baud));
+        cfsetospeed(&tio, baudCode(baud));
+        tio.c_cflag |= CLOCAL | CREAD;
+        tcsetattr(f, TCSANOW, &tio);
+        tcflush(f, TCIOFLUSH);
+    }
+    return f;
+}
+
+static int listenOn(int port, int any)
+{
+    struct sockaddr_in a;
+    int s, one = 1;
+
+    if (!port)
+        return -1;
+    if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(any ? INADDR_ANY : INADDR_LOOPBACK);
+    if (bind(s, (struct sockaddr *)&a, sizeof(a)) < 0 || listen(s, 4) < 0) {
+        fprintf(stderr, "telemetry_proxy: can't listen on port %d: %s\n", port, strerror(errno));
+        exit(1);
+    }
+    fcntl(s, F_SETFL, O_NONBLOCK);
+    return s;
+}
+
+// ************************************************************************************************************
+// SHA-1 and base64, all the WebSocket handshake needs
+// ************************************************************************************************************
+#define ROL(x, n)           ((x) << (n) | (x) >> (32 - (n)))
+
+static void sha1(const uint8_t *msg, size_t len, uint8_t digest[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint8_t block[64];
+    size_t done = 0, total = (len + 8) / 64 * 64 + 64;
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    int i;
+
+    for (done = 0; done < total; done += 64) {
+        for (i = 0; i < 64; i++) {
+            size_t at = done + i;
+            if (at < len)
+                block[i] = msg[at];
+            else if (at == len)
+                block[i] = 0x80;
+            else if (at >= total - 8)
+                block[i] = (uint8_t)((uint64_t)len * 8 >> 8 * (total - 1 - at));
+            else
+                block[i] = 0;
+        }
+        for (i = 0; i < 16; i++)
+            w[i] = (uint32_t)block[4 * i] << 24 | block[4 * i + 1] << 16 | block[4 * i + 2] << 8 | block[4 * i + 3];
+        for (i = 16; i < 80; i++)
+            w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (i = 0; i < 80; i++) {
+            if (i < 20)
+                f = (b & c) | (~b & d), k = 0x5A827999;
+            else if (i < 40)
+                f = b ^ c ^ d, k = 0x6ED9EBA1;
+            else if (i < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+            else
+                f = b ^ c ^ d, k = 0xCA62C1D6;
+            t = ROL(a, 5) + f + e + k + w[i];
+            e = d, d = c, c = ROL(b, 30), b = a, a = t;
+        }
+        h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+    }
+    for (i = 0; i < 20; i++)
+        digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static void base64(const uint8_t *in, size_t n, char *out)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i;
+
+    for (i = 0; i < n; i += 3) {
+        uint32_t v = (uint32_t)in[i] << 16 | (i + 1 < n ? in[i + 1] << 8 : 0) | (i + 2 < n ? in[i + 2] : 0);
+        *out++ = digits[v >> 18 & 63];
+        *out++ = digits[v >> 12 & 63];
+        *out++ = i + 1 < n ? digits[v >> 6 & 63] : '=';
+        *out++ = i + 2 < n ? digits[v & 63] : '=';
+    }
+    *out = 0;
+}
+
+// ************************************************************************************************************
+// Clients
+// ************************************************************************************************************
+static void clientClose(int i, const char *why)
+{
+    client_t *c = &clients[i];
+
+    fprintf(stderr, "telemetry_proxy: %s left (%s): %lu frames, %lu dropped, %lu bytes refused\n", c->name, why,
+            c->frames, c->dropped, c->refused);
+    close(c->fd);
+    c->fd = -1;
+    if (owner == i)
+        owner = -1;
+}
+
+static void clientAccept(int s, uint8_t type)
+{
+    struct sockaddr_in a;
+    socklen_t alen = sizeof(a);
+    int fd, i, one = 1;
+
+    if ((fd = accept(s, (struct sockaddr *)&a, &alen)) < 0)
+        return;
+    for (i = 0; i < MAX_CLIENTS && clients[i].fd >= 0; i++);
+    if (i == MAX_CLIENTS) {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(&clients[i], 0, sizeof(client_t));
+    clients[i].fd = fd;
+    clients[i].type = type;
+    snprintf(clients[i].name, sizeof(clients[i].name), "%s:%u", inet_ntoa(a.sin_addr), ntohs(a.sin_port));
+    fprintf(stderr, "telemetry_proxy: %s %s\n", type == CLIENT_TCP ? "tcp" : "websocket", clients[i].name);
+}
+
+// all of it or nothing, so a client never gets part of a frame
+static int clientQueue(client_t *c, const uint8_t *head, size_t headLen, const uint8_t *data, size_t len)
+{
+    size_t tail, n = headLen + len, i;
+
+    if (c->outLen + n > CLIENT_OUT)
+        return 0;
+    tail = (c->outHead + c->outLen) % CLIENT_OUT;
+    for (i = 0; i < n; i++)
+        c->out[(tail + i) % CLIENT_OUT] = i < headLen ? head[i] : data[i - headLen];
+    c->outLen += n;
+    return 1;
+}
+
+static void clientFlush(int i)
+{
+    client_t *c = &clients[i];
+    ssize_t w;
+
+    while (c->outLen) {
+        size_t run = CLIENT_OUT - c->outHead;
+        if (run > c->outLen)
+            run = c->outLen;
+        if ((w = write(c->fd, c->out + c->outHead, run)) <= 0) {
+            if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                clientClose(i, strerror(errno));
+            return;
+        }
+        c->outHead = (c->outHead + w) % CLIENT_OUT;
+        c->outLen -= w;
+    }
+}
+
+// what a client sends: commands for the board, while it holds the link
+static void command(int i, const uint8_t *data, size_t n)
+{
+    double t = now();
+
+    if (readOnly || (owner >= 0 && owner != i && t - ownerLast < CMD_HOLD)) {
+        clients[i].refused += n;
+        return;
+    }
+    owner = i;
+    ownerLast = t;
+    if (linkOutLen + n > LINK_OUT) {
+        linkDropped += n;
+        return;
+    }
+    memcpy(linkOut + linkOutLen, data, n);
+    linkOutLen += n;
+}
+
+static void wsSend(client_t *c, uint8_t opcode, const uint8_t *data, size_t len)
+{
+    uint8_t head[4];
+    size_t headLen = 2;
+
+    head[0] = 0x80 | opcode;            // FIN, never fragmented
+    if (len < 126)
+        head[1] = len;
+    else {
+        head[1] = 126;
+        head[2] = len >> 8;
+        head[3] = len;
+        headLen = 4;
+    }
+    if (!clientQueue(c, head, headLen, data, len))
+        c->dropped++;
+}
+
+// the upgrade request up to its blank line, the answer carries the key's SHA-1
+static int wsHandshake(client_t *c)
+{
+    char *end, *key, *eol, accept[32], reply[256];
+    uint8_t digest[20];
+    char buf[128];
+    int n;
+
+    c->in[c->inLen < CLIENT_IN ? c->inLen : CLIENT_IN - 1] = 0;
+    if (!(end = strstr((char *)c->in, "\r\n\r\n")))
+        return c->inLen < CLIENT_IN - 1 ? 0 : -1;
+    if (!(key = strstr((char *)c->in, "Sec-WebSocket-Key:")))
+        return -1;
+    key += strlen("Sec-WebSocket-Key:");
+    while (*key == ' ')
+        key++;
+    if (!(eol = strstr(key, "\r\n")) || eol - key > 64)
+        return -1;
+    n = snprintf(buf, sizeof(buf), "%.*s%s", (int)(eol - key), key, WS_GUID);
+    sha1((const uint8_t *)buf, n, digest);
+    base64(digest, sizeof(digest), accept);
+    n = snprintf(reply, sizeof(reply), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                 "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+    clientQueue(c, NULL, 0, (const uint8_t *)reply, n);
+    end += 4;
+    c->inLen -= end - (char *)c->in;
+    memmove(c->in, end, c->inLen);
+    c->type = CLIENT_WS;
+    return 1;
+}
+
+// complete client frames out of c->in: data goes to command(), ping is answered, close closes
+static int wsReceive(int i)
+{
+    client_t *c = &clients[i];
+    uint8_t *p, opcode;
+    size_t len, at;
+    unsigned j;
+
+    while (c->inLen >= 2) {
+        p = c->in;
+        opcode = p[0] & 0x0F;
+        len = p[1] & 0x7F;
+        at = 2;
+        if (len == 126) {
+            if (c->inLen < 4)
+                return 0;
+            len = p[2] << 8 | p[3];
+            at = 4;
+        } else if (len == 127)
+            return -1;                  // nothing a command needs
+        if (!(p[1] & 0x80))
+            return -1;                  // clients must mask
+        if (at + 4 + len > CLIENT_IN)
+            return -1;
+        if (c->inLen < at + 4 + len)
+            return 0;
+        for (j = 0; j < len; j++)
+            p[at + 4 + j] ^= p[at + j % 4];
+        if (opcode == 0x8)
+            return -1;
+        if (opcode == 0x9)
+            wsSend(c, 0xA, p + at + 4, len);
+        else if (opcode <= 0x2)
+            command(i, p + at + 4, len);
+        c->inLen -= at + 4 + len;
+        memmove(c->in, p + at + 4 + len, c->inLen);
+    }
+    return 0;
+}
+
+static void clientRead(int i)
+{
+    client_t *c = &clients[i];
+    uint8_t buf[1024];
+    ssize_t r;
+    int rv = 0;
+
+    if (c->type == CLIENT_TCP) {
+        if ((r = read(c->fd, buf, sizeof(buf))) > 0)
+            command(i, buf, r);
+    } else if ((r = read(c->fd, c->in + c->inLen, CLIENT_IN - 1 - c->inLen)) > 0) {
+        c->inLen += r;
+        if (c->type == CLIENT_WS_HTTP)
+            rv = wsHandshake(c);
+        if (rv >= 0 && c->type == CLIENT_WS)
+            rv = wsReceive(i);
+    }
+    if (r == 0)
+        clientClose(i, "closed");
+    else if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        clientClose(i, strerror(errno));
+    else if (rv < 0)
+        clientClose(i, "protocol error");
+}
+
+// ************************************************************************************************************
+// Board stream
+// ************************************************************************************************************
+static void streamAge(const hp_frame_t *f)
+{
+    const uint8_t *d = f->payload + 2;
+    double age = linkRead - hp_clockHost(&boardClock, d[0] | d[1] << 8 | d[2] << 16 | (uint32_t)d[3] << 24);
+
+    if (!ageCount || age < ageMin)
+        ageMin = age;
+    if (!ageCount || age > ageMax)
+        ageMax = age;
+    ageSum += age;
+    ageCount++;
+}
+
+static void fanOut(const hp_frame_t *f, void *user)
+{
+    uint8_t frame[HP_FRAME_MAX];
+    size_t n;
+    int i;
+
+    (void)user;
+    kindCount[f->kind]++;
+    hp_clockUpdate(&boardClock, f, linkRead);
+    if (f->kind == HP_STREAM && f->len >= 6 && boardClock.valid)
+        streamAge(f);
+    switch (f->kind) {
+    case HP_FRAME:
+        n = hp_putFrame(frame, f->cmd, f->payload, f->len);
+        break;
+    case HP_REPLY:
+        frame[0] = f->cmd;
+        memcpy(frame + 1, f->payload, f->len);
+        frame[f->len + 1] = f->cmd;
+        n = f->len + 2;
+        break;
+    default:
+        n = hp_putChunk(frame, f->cmd, f->payload, f->len);
+        break;
+    }
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        client_t *c = &clients[i];
+        if (c->fd < 0 || c->type == CLIENT_WS_HTTP)
+            continue;
+        if (c->type == CLIENT_WS)
+            wsSend(c, 0x2, frame, n);
+        else if (!clientQueue(c, NULL, 0, frame, n))
+            c->dropped++;
+        c->frames++;
+    }
+}
+
+static void linkFlush(void)
+{
+    ssize_t w;
+
+    if (!linkOutLen)
+        return;
+    if ((w = write(linkFd, linkOut, linkOutLen)) > 0) {
+        linkOutLen -= w;
+        memmove(linkOut, linkOut + w, linkOutLen);
+    } else if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        linkDropped += linkOutLen;      // a read only device
+        linkOutLen = 0;
+        pinging = 0;
+    }
+}
+
+// only between commands, a ping must not land in the middle of a client's frame
+static void clockPing(void)
+{
+    double t = now();
+
+    if (!pinging || linkOutLen || t - lastPing < CLOCK_PING || (owner >= 0 && t - ownerLast < CMD_HOLD))
+        return;
+    lastPing = t;
+    linkOutLen = hp_clockPing(&boardClock, linkOut, t);
+}
+
+static void onSignal(int sig)
+{
+    (void)sig;
+    quit = 1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: telemetry_proxy [-b baud] [-p port] [-w port] [-a] [-r] device\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *kinds[HP_KINDS] = { "frame", "reply", "stream", "blackbox", "watch" };
+    struct pollfd pfd[2 + 1 + MAX_CLIENTS];
+    int slot[2 + 1 + MAX_CLIENTS];
+    long baud = 115200;
+    int tcpPort = 5760, wsPort = 5761, any = 0, tcp, ws, n, i, c, eof = 0;
+    uint8_t buf[4096];
+    ssize_t r;
+
+    while ((c = getopt(argc, argv, "b:p:w:ar")) != -1) {
+        switch (c) {
+        case 'b': baud = atol(optarg); break;
+        case 'p': tcpPort = atoi(optarg); break;
+        case 'w': wsPort = atoi(optarg); break;
+        case 'a': any = 1; break;
+        case 'r': readOnly = 1; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1 || (!tcpPort && !wsPort))
+        usage();
+    if ((linkFd = portOpen(argv[optind], baud)) < 0) {
+        fprintf(stderr, "telemetry_proxy: can't open %s: %s\n", argv[optind], strerror(errno));
+        exit(1);
+    }
+    tcp = listenOn(tcpPort, any);
+    ws = listenOn(wsPort, any);
+    for (i = 0; i < MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+    hp_init(&parser, hp_afrowiiReplies, fanOut, NULL);
+    hp_clockInit(&boardClock);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    while (!quit) {
+        n = 0;
+        if (!eof) {
+            pfd[n].fd = linkFd;
+            pfd[n].events = POLLIN | (linkOutLen ? POLLOUT : 0);
+            slot[n++] = -1;
+        }
+        if (tcp >= 0) {
+            pfd[n].fd = tcp;
+            pfd[n].events = POLLIN;
+            slot[n++] = -2;
+        }
+        if (ws >= 0) {
+            pfd[n].fd = ws;
+            pfd[n].events = POLLIN;
+            slot[n++] = -3;
+        }
+        for (i = 0; i < MAX_CLIENTS; i++)
+            if (clients[i].fd >= 0) {
+                pfd[n].fd = clients[i].fd;
+                pfd[n].events = POLLIN | (clients[i].outLen ? POLLOUT : 0);
+                slot[n++] = i;
+            }
+        if (poll(pfd, n, 1000) < 0)
+            continue;
+        for (i = 0; i < n; i++) {
+            if (!pfd[i].revents)
+                continue;
+            if (slot[i] == -1) {
+                if (pfd[i].revents & POLLOUT)
+                    linkFlush();
+                if ((r = read(linkFd, buf, sizeof(buf))) > 0) {
+                    linkRead = now();
+                    hp_feed(&parser, buf, r);
+                } else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    // the end of a capture, or the adapter went away: the clients keep what they got
+                    fprintf(stderr, "telemetry_proxy: linkFd closed\n");
+                    eof = 1;
+                }
+            } else if (slot[i] == -2)
+                clientAccept(tcp, CLIENT_TCP);
+            else if (slot[i] == -3)
+                clientAccept(ws, CLIENT_WS_HTTP);
+            else if (clients[slot[i]].fd == pfd[i].fd) {
+                if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    clientRead(slot[i]);
+                if (clients[slot[i]].fd >= 0 && (pfd[i].revents & POLLOUT))
+                    clientFlush(slot[i]);
+            }
+        }
+        // frames queued in this round go out without waiting for the next poll
+        for (i = 0; i < MAX_CLIENTS; i++)
+            if (clients[i].fd >= 0 && clients[i].outLen)
+                clientFlush(i);
+        clockPing();
+        linkFlush();
+    }
+
+    fprintf(stderr, "telemetry_proxy:");
+    for (i = 0; i < HP_KINDS; i++)
+        fprintf(stderr, " %lu %s", kindCount[i], kinds[i]);
+    fprintf(stderr, ", %lu bad, %lu bytes skipped, %lu command bytes dropped\n", (unsigned long)parser.badFrames,
+            (unsigned long)parser.skipped, linkDropped);
+    if (ageCount)
+        fprintf(stderr, "telemetry_proxy: stream age %.2f/%.2f/%.2fms min/mean/max of %lu frames, clock %lu pings, "
+                "rtt %.2fms, drift %.1fppm\n", ageMin * 1e3, ageSum / ageCount * 1e3, ageMax * 1e3, ageCount,
+                (unsigned long)boardClock.samples, boardClock.rttMin * 1e3, boardClock.drift * 1e6);
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i].fd >= 0)
+            clientClose(i, "shutdown");
+    return 0;
+}
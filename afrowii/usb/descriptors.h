@@ -32,6 +32,12 @@
 #define USB_DESCRIPTOR_TYPE_STRING        0x03
 #define USB_DESCRIPTOR_TYPE_INTERFACE     0x04
 #define USB_DESCRIPTOR_TYPE_ENDPOINT      0x05
+#define USB_DESCRIPTOR_TYPE_IAD           0x0B
+
+/* composite device: the class is in the interface association descriptors */
+#define USB_DEVICE_CLASS_MISC             0xEF
+#define USB_DEVICE_SUBCLASS_COMMON        0x02
+#define USB_DEVICE_PROTOCOL_IAD           0x01
 
 #define USB_DEVICE_CLASS_CDC              0x02
 #define USB_DEVICE_SUBCLASS_CDC           0x00
@@ -39,6 +45,7 @@
 /* CDC Abstract Control Model */
 #define USB_INTERFACE_SUBCLASS_CDC_ACM    0x02
 #define USB_INTERFACE_CLASS_DIC           0x0A
+#define USB_INTERFACE_CLASS_VENDOR        0xFF
 
 #define USB_CONFIG_ATTR_BUSPOWERED        0b10000000
 #define USB_CONFIG_ATTR_SELF_POWERED      0b11000000
@@ -113,6 +120,17 @@ extern "C" {
     } __packed USB_Descriptor_Interface;
 
 
+    typedef struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bFirstInterface;
+        uint8_t bInterfaceCount;
+        uint8_t bFunctionClass;
+        uint8_t bFunctionSubClass;
+        uint8_t bFunctionProtocol;
+        uint8_t iFunction;
+    } __packed USB_Descriptor_IAD;
+
     typedef struct {
         uint8_t bLength;
         uint8_t bDescriptorType;
@@ -124,6 +142,7 @@ extern "C" {
 
     typedef struct {
         USB_Descriptor_Config_Header Config_Header;
+        USB_Descriptor_IAD CDC_IAD;
         USB_Descriptor_Interface CCI_Interface;
          CDC_FUNCTIONAL_DESCRIPTOR(2) CDC_Functional_IntHeader;
          CDC_FUNCTIONAL_DESCRIPTOR(2) CDC_Functional_CallManagement;
@@ -133,6 +152,8 @@ extern "C" {
         USB_Descriptor_Interface DCI_Interface;
         USB_Descriptor_Endpoint DataOutEndpoint;
         USB_Descriptor_Endpoint DataInEndpoint;
+        USB_Descriptor_Interface Log_Interface;
+        USB_Descriptor_Endpoint LogInEndpoint;
     } __packed USB_Descriptor_Config;
 
     typedef struct {
@@ -147,6 +168,7 @@ extern "C" {
     extern const uint8_t usbVcomDescriptor_LangID[USB_DESCRIPTOR_STRING_LEN(1)];
     extern const uint8_t usbVcomDescriptor_iManufacturer[USB_DESCRIPTOR_STRING_LEN(8)];
     extern const uint8_t usbVcomDescriptor_iProduct[USB_DESCRIPTOR_STRING_LEN(10)];
+    extern const uint8_t usbVcomDescriptor_iLog[USB_DESCRIPTOR_STRING_LEN(9)];
 
 #if defined(__cplusplus)
 }
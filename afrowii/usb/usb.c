@@ -162,7 +162,8 @@ void usbResume(RESUME_STATE eResumeSetVal)
 }
 
 #define SUSPEND_ENABLED 1
-void USB_LP_CAN1_RX0_IRQHandler(void)
+/* runs as the PendSV bottom half, USB_LP_CAN1_RX0_IRQHandler() in the sysdep masks the line and pends it */
+void __irq_usb_lp_can_rx0(void)
 {
     uint16_t istr = USB_BASE->ISTR;
 
@@ -40,9 +40,12 @@
 #include "usb_type.h"
 #include "usb_core.h"
 #include "usb_def.h"
+#include "../ringbuf.h"
+#include "../board.h"
 
 static void vcomDataTxCb(void);
 static void vcomDataRxCb(void);
+static void vcomLogTxCb(void);
 static uint8_t *vcomGetSetLineCoding(uint16_t);
 
 static void usbInit(void);
@@ -62,24 +65,35 @@ static void usbSetDeviceAddress(void);
 
 #define VCOM_CTRL_EPNUM           0x00
 #define VCOM_CTRL_RX_ADDR         0x40
-#define VCOM_CTRL_TX_ADDR         0x80
-#define VCOM_CTRL_EPSIZE          0x40
+#define VCOM_CTRL_TX_ADDR         0x60
+#define VCOM_CTRL_EPSIZE          0x20    /* 32 byte control packets leave room for the log endpoint */
 
+/* PMA layout (512 bytes): BTABLE 0x000, notification 0x030, EP0 0x040/0x060, log IN 0x080, OUT 0x0C0,
+ * then the two IN frame buffers 0x100 and 0x180 */
 #define VCOM_TX_ENDP              1
 #define VCOM_TX_EPNUM             0x01
-#define VCOM_TX_ADDR              0xC0
+#define VCOM_TX_ADDR              0x100
 #define VCOM_TX_EPSIZE            0x40
+#define VCOM_TX_FRAMELEN          0x80    /* per frame buffer, a frame goes out in up to two packets */
 
 #define VCOM_NOTIFICATION_ENDP    2
 #define VCOM_NOTIFICATION_EPNUM   0x02
-#define VCOM_NOTIFICATION_ADDR    0x100
-#define VCOM_NOTIFICATION_EPSIZE  0x40
+#define VCOM_NOTIFICATION_ADDR    0x30
+#define VCOM_NOTIFICATION_EPSIZE  0x10    /* SERIAL_STATE is 10 bytes, and never sent */
 
 #define VCOM_RX_ENDP              3
 #define VCOM_RX_EPNUM             0x03
-#define VCOM_RX_ADDR              0x110
+#define VCOM_RX_ADDR              0xC0
 #define VCOM_RX_EPSIZE            0x40
-#define VCOM_RX_BUFLEN            (VCOM_RX_EPSIZE * 3)
+#define VCOM_RX_BUFLEN            (VCOM_RX_EPSIZE * 2)    /* ring, power of two, at most 128 */
+
+/* the log function: a vendor interface with one bulk IN endpoint for the blackbox and stream
+ * frames, so they don't queue behind command replies on the CDC data interface */
+#define VCOM_LOG_ENDP             4
+#define VCOM_LOG_EPNUM            0x04
+#define VCOM_LOG_ADDR             0x80
+#define VCOM_LOG_EPSIZE           0x40
+#define VCOM_LOG_BUFLEN           512     /* RAM ring in front of it, power of two */
 
 /*
  * CDC ACM Requests
@@ -96,21 +110,19 @@ static void usbSetDeviceAddress(void);
  * Descriptors
  */
 
-#define USB_DEVICE_CLASS_CDC              0x02
-#define USB_DEVICE_SUBCLASS_CDC           0x00
 #define STMICRO_ID_VENDOR                0x0483
 #define VCOM_ID_PRODUCT                  0xFEAD
 const USB_Descriptor_Device usbVcomDescriptor_Device = {
     .bLength = sizeof(USB_Descriptor_Device),
     .bDescriptorType = USB_DESCRIPTOR_TYPE_DEVICE,
     .bcdUSB = 0x0200,
-    .bDeviceClass = USB_DEVICE_CLASS_CDC,
-    .bDeviceSubClass = USB_DEVICE_SUBCLASS_CDC,
-    .bDeviceProtocol = 0x00,
-    .bMaxPacketSize0 = 0x40,
+    .bDeviceClass = USB_DEVICE_CLASS_MISC,
+    .bDeviceSubClass = USB_DEVICE_SUBCLASS_COMMON,
+    .bDeviceProtocol = USB_DEVICE_PROTOCOL_IAD,
+    .bMaxPacketSize0 = VCOM_CTRL_EPSIZE,
     .idVendor = STMICRO_ID_VENDOR,
     .idProduct = VCOM_ID_PRODUCT,
-    .bcdDevice = 0x0200,
+    .bcdDevice = 0x0300,        /* composite from 3.00 on, the host doesn't reuse the old CDC only setup */
     .iManufacturer = 0x01,
     .iProduct = 0x02,
     .iSerialNumber = 0x00,
@@ -123,7 +135,7 @@ const USB_Descriptor_Config usbVcomDescriptor_Config = {
                       .bLength = sizeof(USB_Descriptor_Config_Header),
                       .bDescriptorType = USB_DESCRIPTOR_TYPE_CONFIGURATION,
                       .wTotalLength = sizeof(USB_Descriptor_Config),
-                      .bNumInterfaces = 0x02,
+                      .bNumInterfaces = 0x03,
                       .bConfigurationValue = 0x01,
                       .iConfiguration = 0x00,
                       .bmAttributes = (USB_CONFIG_ATTR_BUSPOWERED | USB_CONFIG_ATTR_SELF_POWERED),
@@ -131,6 +143,19 @@ const USB_Descriptor_Config usbVcomDescriptor_Config = {
                       }
     ,
 
+    /* binds the two CDC interfaces into one function, the log interface stands on its own */
+    .CDC_IAD = {
+                .bLength = sizeof(USB_Descriptor_IAD),
+                .bDescriptorType = USB_DESCRIPTOR_TYPE_IAD,
+                .bFirstInterface = 0x00,
+                .bInterfaceCount = 0x02,
+                .bFunctionClass = USB_INTERFACE_CLASS_CDC,
+                .bFunctionSubClass = USB_INTERFACE_SUBCLASS_CDC_ACM,
+                .bFunctionProtocol = 0x01,
+                .iFunction = 0x00,
+                }
+    ,
+
     .CCI_Interface = {
                       .bLength = sizeof(USB_Descriptor_Interface),
                       .bDescriptorType = USB_DESCRIPTOR_TYPE_INTERFACE,
@@ -222,6 +247,29 @@ const USB_Descriptor_Config usbVcomDescriptor_Config = {
                        .bInterval = 0x00,
                        }
     ,
+
+    .Log_Interface = {
+                      .bLength = sizeof(USB_Descriptor_Interface),
+                      .bDescriptorType = USB_DESCRIPTOR_TYPE_INTERFACE,
+                      .bInterfaceNumber = 0x02,
+                      .bAlternateSetting = 0x00,
+                      .bNumEndpoints = 0x01,
+                      .bInterfaceClass = USB_INTERFACE_CLASS_VENDOR,
+                      .bInterfaceSubClass = 0x00,
+                      .bInterfaceProtocol = 0x00,
+                      .iInterface = 0x03,
+                      }
+    ,
+
+    .LogInEndpoint = {
+                      .bLength = sizeof(USB_Descriptor_Endpoint),
+                      .bDescriptorType = USB_DESCRIPTOR_TYPE_ENDPOINT,
+                      .bEndpointAddress = (USB_DESCRIPTOR_ENDPOINT_IN | VCOM_LOG_EPNUM),
+                      .bmAttributes = EP_TYPE_BULK,
+                      .wMaxPacketSize = VCOM_LOG_EPSIZE,
+                      .bInterval = 0x00,
+                      }
+    ,
 };
 
 /*
@@ -254,6 +302,14 @@ const uint8_t usbVcomDescriptor_iProduct[USB_DESCRIPTOR_STRING_LEN(10)] = {
     'a', 0, 'l', 0
 };
 
+const uint8_t usbVcomDescriptor_iLog[USB_DESCRIPTOR_STRING_LEN(9)] = {
+    USB_DESCRIPTOR_STRING_LEN(9),
+    USB_DESCRIPTOR_TYPE_STRING,
+    'T', 0, 'e', 0, 'l', 0, 'e', 0,
+    'm', 0, 'e', 0, 't', 0, 'r', 0,
+    'y', 0
+};
+
 ONE_DESCRIPTOR Device_Descriptor = {
     (uint8_t *) & usbVcomDescriptor_Device,
     sizeof(USB_Descriptor_Device)
@@ -264,7 +320,7 @@ ONE_DESCRIPTOR Config_Descriptor = {
     sizeof(USB_Descriptor_Config)
 };
 
-ONE_DESCRIPTOR String_Descriptor[3] = {
+ONE_DESCRIPTOR String_Descriptor[4] = {
     {(uint8_t *) & usbVcomDescriptor_LangID, USB_DESCRIPTOR_STRING_LEN(1)}
     ,
     {(uint8_t *) & usbVcomDescriptor_iManufacturer,
@@ -272,6 +328,9 @@ ONE_DESCRIPTOR String_Descriptor[3] = {
     ,
     {(uint8_t *) & usbVcomDescriptor_iProduct,
      USB_DESCRIPTOR_STRING_LEN(10)}
+    ,
+    {(uint8_t *) & usbVcomDescriptor_iLog,
+     USB_DESCRIPTOR_STRING_LEN(9)}
 };
 
 /*
@@ -299,12 +358,34 @@ USB_Line_Coding line_coding = {
     .paritytype = 0x00,
     .datatype = 0x08
 };
-uint8_t vcomBufferRx[VCOM_RX_BUFLEN];
-volatile uint32_t countTx = 0;
-volatile uint32_t recvBufIn = 0;
-volatile uint32_t recvBufOut = 0;
-volatile uint32_t maxNewBytes = VCOM_RX_BUFLEN;
-volatile uint32_t newBytes = 0;
+/* OUT packets land in a ring; the endpoint is only re-armed while a whole packet still fits,
+ * otherwise it's left NAKing and usb_cdcacm_rx() re-arms it once enough has been read. The host
+ * just retries, so nothing is dropped. */
+static uint8_t vcomBufferRx[VCOM_RX_BUFLEN];
+static ring_t vcomRxRing = RING_INIT(vcomBufferRx);
+static volatile uint8_t vcomRxStalled = 0;
+/* IN side: frames are written straight into one of two PMA buffers, usb_cdcacm_frame_put() packs the
+ * bytes into the 16 bit PMA words as they come. A committed frame is sent from where it was written, a
+ * packet at a time by moving the endpoint's buffer address along, while the next one is built in the
+ * other buffer. vcomTxActive is set while a packet is on the endpoint. */
+static const uint16_t vcomTxFrame[2] = { VCOM_TX_ADDR, VCOM_TX_ADDR + VCOM_TX_FRAMELEN };
+static uint8_t vcomTxCur = 0;               /* on the endpoint (or last on it), the other one is built in */
+static volatile uint8_t vcomTxActive = 0;
+static volatile uint8_t vcomTxPending = 0;  /* the other buffer is committed as well, waiting its turn */
+static uint8_t vcomTxLen[2];
+static uint8_t vcomTxSent;                  /* of the frame on the endpoint, the packet in flight included */
+static uint8_t vcomTxLast = 0;              /* size of the packet in flight */
+static uint8_t vcomFill;                    /* bytes in the frame being built */
+static uint8_t vcomBuilding;                /* frame_reset() found the other buffer free */
+static uint16_t vcomLow;                    /* even byte, written with the odd one that follows it */
+/* log endpoint: usb_cdcacm_log_write() appends whole frames to a RAM ring, the IN callback moves up to
+ * a packet at a time from it into the endpoint's buffer. Free running indices, head written by the
+ * main loop only, tail by the callback only, like ring_t but longer than 128 */
+static uint8_t vcomLogBuf[VCOM_LOG_BUFLEN];
+static volatile uint16_t vcomLogHead = 0;
+static volatile uint16_t vcomLogTail = 0;
+static volatile uint8_t vcomLogActive = 0;
+static uint8_t vcomLogLast = 0;             /* size of the packet in flight */
 RESET_STATE reset_state = DTR_UNSET;
 uint8_t line_dtr_rts = 0;
 
@@ -313,7 +394,7 @@ uint8_t line_dtr_rts = 0;
  */
 
 static void (*ep_int_in[7]) (void) = {
-vcomDataTxCb, NOP_Process, NOP_Process, NOP_Process, NOP_Process, NOP_Process, NOP_Process};
+vcomDataTxCb, NOP_Process, NOP_Process, vcomLogTxCb, NOP_Process, NOP_Process, NOP_Process};
 
 static void (*ep_int_out[7]) (void) = {
 NOP_Process, NOP_Process, vcomDataRxCb, NOP_Process, NOP_Process, NOP_Process, NOP_Process};
@@ -322,13 +403,13 @@ NOP_Process, NOP_Process, vcomDataRxCb, NOP_Process, NOP_Process, NOP_Process, N
  * Globals required by usb_lib/
  */
 
-#define NUM_ENDPTS                0x04
+#define NUM_ENDPTS                0x05
 DEVICE Device_Table = {
     .Total_Endpoint = NUM_ENDPTS,
     .Total_Configuration = 1
 };
 
-#define MAX_PACKET_SIZE            0x40 /* 64B, maximum for USB FS Devices */
+#define MAX_PACKET_SIZE            VCOM_CTRL_EPSIZE     /* of EP0, 64B would be the maximum for USB FS Devices */
 DEVICE_PROP Device_Property = {
     .Init = usbInit,
     .Reset = usbReset,
@@ -379,74 +460,223 @@ void usb_cdcacm_putc(char ch)
     while (!usb_cdcacm_tx((uint8_t *) & ch, 1));
 }
 
-/* This function is non-blocking.
- *
- * It copies data from a usercode buffer into the USB peripheral TX
- * buffer and return the number placed in that buffer.
- */
+/* Puts the next packet of the frame on the endpoint onto it, or starts the pending frame. Called from
+ * the IN callback, or with interrupts off when the endpoint is idle. A transfer that ends on a full
+ * packet gets a zero length packet so the host doesn't sit waiting for more. */
+static void vcomTxKick(void)
+{
+    uint8_t n = vcomTxLen[vcomTxCur] - vcomTxSent;
+
+    if (n == 0) {
+        if (vcomTxPending) {
+            vcomTxCur ^= 1;
+            vcomTxPending = 0;
+            vcomTxSent = 0;
+            n = vcomTxLen[vcomTxCur];
+        } else if (vcomTxLast != VCOM_TX_EPSIZE) {
+            vcomTxActive = 0;
+            vcomTxLast = 0;
+            return;
+        }
+    }
+    if (n > VCOM_TX_EPSIZE)
+        n = VCOM_TX_EPSIZE;
+    usb_set_ep_tx_addr(VCOM_TX_ENDP, vcomTxFrame[vcomTxCur] + vcomTxSent);
+    usb_set_ep_tx_count(VCOM_TX_ENDP, n);
+    vcomTxSent += n;
+    vcomTxActive = 1;
+    vcomTxLast = n;
+    usb_set_ep_tx_stat(VCOM_TX_ENDP, USB_EP_STAT_TX_VALID);
+}
+
+/* Starts a new frame in the free PMA buffer, dropping whatever was built and not committed. Returns 0
+ * when both buffers are still queued: the frame_put() calls up to the next reset then all fail. */
+uint8_t usb_cdcacm_frame_reset(void)
+{
+    vcomFill = 0;
+    vcomBuilding = !vcomTxPending;
+    return vcomBuilding;
+}
+
+/* Appends one byte to the frame, 0 if there's no buffer or it is full */
+uint8_t usb_cdcacm_frame_put(uint8_t c)
+{
+    volatile uint32_t *pma;
+
+    if (!vcomBuilding || vcomFill >= VCOM_TX_FRAMELEN)
+        return 0;
+    if (vcomFill & 1) {
+        /* PMA words sit at a 32 bit stride and only take 16 bit writes */
+        pma = usb_pma_ptr(vcomTxFrame[vcomTxCur ^ 1]);
+        pma[vcomFill >> 1] = vcomLow | (uint16_t)c << 8;
+    } else {
+        vcomLow = c;
+    }
+    vcomFill++;
+    return 1;
+}
+
+/* Queues the frame. It goes out right away if the endpoint is idle, otherwise after the one on it */
+void usb_cdcacm_frame_commit(void)
+{
+    volatile uint32_t *pma;
+    uint8_t b = vcomTxCur ^ 1;
+
+    if (!vcomBuilding || vcomFill == 0)
+        return;
+    if (vcomFill & 1) {
+        pma = usb_pma_ptr(vcomTxFrame[b]);
+        pma[vcomFill >> 1] = vcomLow;
+    }
+    vcomTxLen[b] = vcomFill;
+    vcomBuilding = 0;
+    vcomFill = 0;
+
+    __disable_irq();
+    if (!vcomTxActive) {
+        vcomTxCur = b;
+        vcomTxSent = 0;
+        vcomTxKick();
+    } else {
+        vcomTxPending = 1;
+    }
+    __enable_irq();
+}
+
+/* set while both frame buffers are queued, a frame started now would be dropped */
+uint8_t usb_cdcacm_tx_busy(void)
+{
+    return vcomTxPending;
+}
+
+/* Nonblocking send as one frame, returns how many bytes of buf were queued (0 when no buffer is free). */
 uint32_t usb_cdcacm_tx(const uint8_t * buf, uint32_t len)
 {
-    /* Last transmission hasn't finished, abort */
-    if (countTx) {
+    uint32_t i;
+
+    if (!usb_cdcacm_frame_reset())
         return 0;
+    for (i = 0; i < len; i++) {
+        if (!usb_cdcacm_frame_put(buf[i]))
+            break;
     }
-    // We can only put VCOM_TX_EPSIZE bytes in the buffer
-    /* FIXME then why are we only copying half as many? */
-    if (len > VCOM_TX_EPSIZE / 2) {
-        len = VCOM_TX_EPSIZE / 2;
+    usb_cdcacm_frame_commit();
+    return i;
+}
+
+/* Moves the next packet from the log ring onto the endpoint. Called from the IN callback, or with
+ * interrupts off when the endpoint is idle. Ends on a zero length packet like the CDC side */
+static void vcomLogKick(void)
+{
+    volatile uint32_t *pma = usb_pma_ptr(VCOM_LOG_ADDR);
+    uint16_t tail = vcomLogTail;
+    uint16_t n = (uint16_t)(vcomLogHead - tail);
+    uint16_t i, w;
+
+    if (n == 0 && vcomLogLast != VCOM_LOG_EPSIZE) {
+        vcomLogActive = 0;
+        vcomLogLast = 0;
+        return;
     }
-    // Try to load some bytes if we can
-    if (len) {
-        usb_copy_to_pma(buf, len, VCOM_TX_ADDR);
-        usb_set_ep_tx_count(VCOM_TX_ENDP, len);
-        countTx += len;
-        usb_set_ep_tx_stat(VCOM_TX_ENDP, USB_EP_STAT_TX_VALID);
+    if (n > VCOM_LOG_EPSIZE)
+        n = VCOM_LOG_EPSIZE;
+    for (i = 0; i < n; i += 2) {
+        w = vcomLogBuf[(tail + i) & (VCOM_LOG_BUFLEN - 1)];
+        if (i + 1 < n)
+            w |= (uint16_t)vcomLogBuf[(tail + i + 1) & (VCOM_LOG_BUFLEN - 1)] << 8;
+        pma[i >> 1] = w;
     }
+    vcomLogTail = tail + n;
+    usb_set_ep_tx_count(VCOM_LOG_ENDP, n);
+    vcomLogActive = 1;
+    vcomLogLast = n;
+    usb_set_ep_tx_stat(VCOM_LOG_ENDP, USB_EP_STAT_TX_VALID);
+}
 
-    return len;
+/* room in the log ring */
+uint16_t usb_cdcacm_log_free(void)
+{
+    return VCOM_LOG_BUFLEN - (uint16_t)(vcomLogHead - vcomLogTail);
+}
+
+/* Queues all of buf on the log endpoint, or nothing (returns 0) when it doesn't fit. Never waits, a
+ * host that doesn't read the log interface just leaves the ring full */
+uint8_t usb_cdcacm_log_write(const uint8_t * buf, uint16_t len)
+{
+    uint16_t head = vcomLogHead;
+    uint16_t i;
+
+    if (usb_cdcacm_log_free() < len)
+        return 0;
+    for (i = 0; i < len; i++)
+        vcomLogBuf[(head + i) & (VCOM_LOG_BUFLEN - 1)] = buf[i];
+    vcomLogHead = head + len;       /* publish after the data is in */
+
+    __disable_irq();
+    if (!vcomLogActive)
+        vcomLogKick();
+    __enable_irq();
+    return 1;
 }
 
 /* returns the number of available bytes are in the recv FIFO */
 uint32_t usb_cdcacm_data_available(void)
 {
-    return newBytes;
+    return ring_count(&vcomRxRing);
 }
 
 uint16_t usb_cdcacm_get_pending()
 {
-    return countTx;
+    uint16_t n;
+
+    __disable_irq();
+    n = vcomTxActive ? vcomTxLen[vcomTxCur] - vcomTxSent + vcomTxLast : 0;
+    if (vcomTxPending)
+        n += vcomTxLen[vcomTxCur ^ 1];
+    __enable_irq();
+    return n;
 }
 
 /* Nonblocking byte receive.
  *
  * Copies up to len bytes from our private data buffer (*NOT* the PMA)
  * into buf and deq's the FIFO. */
-uint32_t usb_cdcacm_rx(uint8_t * buf, uint32_t len)
+/* The endpoint can't complete while NAKing, so the callback won't race this */
+static void vcomRxRearm(void)
 {
-    static uint32_t rx_offset = 0;
-    int i;
-
-    if (len > newBytes) {
-        len = newBytes;
+    if (vcomRxStalled && ring_free(&vcomRxRing) >= VCOM_RX_EPSIZE) {
+        vcomRxStalled = 0;
+        usb_set_ep_rx_count(VCOM_RX_ENDP, VCOM_RX_EPSIZE);
+        usb_set_ep_rx_stat(VCOM_RX_ENDP, USB_EP_STAT_RX_VALID);
     }
+}
 
-    for (i = 0; i < len; i++) {
-        buf[i] = vcomBufferRx[i + rx_offset];
+uint32_t usb_cdcacm_rx(uint8_t * buf, uint32_t len)
+{
+    if (len > VCOM_RX_BUFLEN) {
+        len = VCOM_RX_BUFLEN;
     }
 
-    newBytes -= len;
-    rx_offset += len;
-
-    /* Re-enable the RX endpoint, which we had set to receive 0 bytes */
-    if (newBytes == 0) {
-        usb_set_ep_rx_count(VCOM_RX_ENDP, VCOM_RX_EPSIZE);
-        usb_set_ep_rx_stat(VCOM_RX_ENDP, USB_EP_STAT_RX_VALID);
-        rx_offset = 0;
-    }
+    len = ring_read(&vcomRxRing, buf, len);
+    vcomRxRearm();
 
     return len;
 }
 
+/* Zero copy receive: points *data at the next contiguous run of received bytes and returns its
+ * length. Nothing is consumed until usb_cdcacm_rx_release(), which also re-arms the endpoint as
+ * soon as a whole packet fits again. */
+uint32_t usb_cdcacm_rx_peek(const uint8_t ** data)
+{
+    return ring_peek(&vcomRxRing, data);
+}
+
+void usb_cdcacm_rx_release(uint32_t len)
+{
+    ring_skip(&vcomRxRing, len);
+    vcomRxRearm();
+}
+
 uint8_t usb_cdcacm_get_dtr()
 {
     return ((line_dtr_rts & CONTROL_LINE_DTR) != 0);
@@ -463,17 +693,37 @@ uint8_t usb_cdcacm_get_rts()
 
 static void vcomDataTxCb(void)
 {
-    /* assumes tx transactions are atomic 64 bytes (nearly certain they are) */
-    countTx = 0;
+    vcomTxKick();
+}
+
+static void vcomLogTxCb(void)
+{
+    vcomLogKick();
 }
 
 static void vcomDataRxCb(void)
 {
-    /* setEPRxCount on the previous cycle should guarantee we haven't received more bytes than we can fit */
-    newBytes = usb_get_ep_rx_count(VCOM_RX_ENDP);
-    usb_set_ep_rx_stat(VCOM_RX_ENDP, USB_EP_STAT_RX_NAK);
-    usb_copy_from_pma(vcomBufferRx, newBytes, VCOM_RX_ADDR);
-    // debug_printf("Received %d bytes from USB (%02x)\n", newBytes, vcomBufferRx[0]);
+    volatile uint32_t *pma = usb_pma_ptr(VCOM_RX_ADDR);
+    uint32_t n, i;
+    uint16_t w;
+
+    /* the endpoint was only armed with a full packet free in the ring, so all of this fits. Straight
+     * from the PMA words into the ring, the parser reads it in place through usb_cdcacm_rx_peek() */
+    n = usb_get_ep_rx_count(VCOM_RX_ENDP);
+    for (i = 0; i < n; i += 2) {
+        w = pma[i >> 1];
+        ring_put(&vcomRxRing, w);
+        if (i + 1 < n)
+            ring_put(&vcomRxRing, w >> 8);
+    }
+
+    if (ring_free(&vcomRxRing) >= VCOM_RX_EPSIZE) {
+        usb_set_ep_rx_count(VCOM_RX_ENDP, VCOM_RX_EPSIZE);
+        usb_set_ep_rx_stat(VCOM_RX_ENDP, USB_EP_STAT_RX_VALID);
+    } else {
+        vcomRxStalled = 1;
+        usb_set_ep_rx_stat(VCOM_RX_ENDP, USB_EP_STAT_RX_NAK);
+    }
 }
 
 static uint8_t *vcomGetSetLineCoding(uint16_t length)
@@ -503,7 +753,7 @@ static void usbInit(void)
     // nvic_irq_enable(NVIC_USB_LP_CAN_RX0);
     NVIC_InitTypeDef NVIC_InitStructure;
     NVIC_InitStructure.NVIC_IRQChannel = USB_LP_CAN1_RX0_IRQn;
-    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PRIO_USB;
     NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
     NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
     NVIC_Init(&NVIC_InitStructure);
@@ -542,8 +792,8 @@ static void usbReset(void)
 
     /* set up data endpoint OUT (RX) */
     usb_set_ep_type(VCOM_RX_ENDP, USB_EP_EP_TYPE_BULK);
-    usb_set_ep_rx_addr(VCOM_RX_ENDP, 0x110);
-    usb_set_ep_rx_count(VCOM_RX_ENDP, 64);
+    usb_set_ep_rx_addr(VCOM_RX_ENDP, VCOM_RX_ADDR);
+    usb_set_ep_rx_count(VCOM_RX_ENDP, VCOM_RX_EPSIZE);
     usb_set_ep_rx_stat(VCOM_RX_ENDP, USB_EP_STAT_RX_VALID);
 
     /* set up data endpoint IN (TX)  */
@@ -552,14 +802,27 @@ static void usbReset(void)
     usb_set_ep_tx_stat(VCOM_TX_ENDP, USB_EP_STAT_TX_NAK);
     usb_set_ep_rx_stat(VCOM_TX_ENDP, USB_EP_STAT_RX_DISABLED);
 
+    /* set up the log endpoint IN */
+    usb_set_ep_type(VCOM_LOG_ENDP, USB_EP_EP_TYPE_BULK);
+    usb_set_ep_tx_addr(VCOM_LOG_ENDP, VCOM_LOG_ADDR);
+    usb_set_ep_tx_stat(VCOM_LOG_ENDP, USB_EP_STAT_TX_NAK);
+    usb_set_ep_rx_stat(VCOM_LOG_ENDP, USB_EP_STAT_RX_DISABLED);
+
     USBLIB->state = USB_ATTACHED;
     SetDeviceAddress(0);
 
     /* reset the rx fifo */
-    recvBufIn = 0;
-    recvBufOut = 0;
-    maxNewBytes = VCOM_RX_EPSIZE;
-    countTx = 0;
+    vcomRxRing.head = vcomRxRing.tail = 0;
+    vcomRxStalled = 0;
+    vcomTxActive = 0;
+    vcomTxPending = 0;
+    vcomTxLen[0] = vcomTxLen[1] = 0;
+    vcomTxSent = 0;
+    vcomTxLast = 0;
+    vcomBuilding = 0;
+    vcomLogTail = vcomLogHead;      /* the tail is ours, what a new host never asked for goes */
+    vcomLogActive = 0;
+    vcomLogLast = 0;
 }
 
 static RESULT usbDataSetup(uint8_t request)
@@ -653,7 +916,7 @@ static RESULT usbGetInterfaceSetting(uint8_t interface, uint8_t alt_setting)
 {
     if (alt_setting > 0) {
         return USB_UNSUPPORT;
-    } else if (interface > 1) {
+    } else if (interface > 2) {
         return USB_UNSUPPORT;
     }
 
@@ -674,7 +937,7 @@ static uint8_t *usbGetStringDescriptor(uint16_t length)
 {
     uint8_t wValue0 = pInformation->USBwValue0;
 
-    if (wValue0 > 2) {
+    if (wValue0 > 3) {
         return NULL;
     }
     return Standard_GetDescriptorData(length, &String_Descriptor[wValue0]);
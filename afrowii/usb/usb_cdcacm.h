@@ -43,10 +43,20 @@ void usb_cdcacm_disable(void);
 
 void usb_cdcacm_putc(char ch);
 uint32_t usb_cdcacm_tx(const uint8_t * buf, uint32_t len);
+/* a frame built in place in packet memory: reset, put, commit. At most 128 bytes */
+uint8_t usb_cdcacm_frame_reset(void);      /* 0 if no buffer is free */
+uint8_t usb_cdcacm_frame_put(uint8_t c);   /* 0 if it didn't fit */
+void usb_cdcacm_frame_commit(void);
 uint32_t usb_cdcacm_rx(uint8_t * buf, uint32_t len);
+uint32_t usb_cdcacm_rx_peek(const uint8_t ** data);
+void usb_cdcacm_rx_release(uint32_t len);
 
 uint32_t usb_cdcacm_data_available(void);   /* in RX buffer */
-uint16_t usb_cdcacm_get_pending(void);
+uint16_t usb_cdcacm_get_pending(void);     /* queued or on the IN endpoint */
+uint8_t usb_cdcacm_tx_busy(void);          /* both frame buffers queued */
+/* the log interface's bulk IN endpoint, whole buffers or nothing */
+uint8_t usb_cdcacm_log_write(const uint8_t * buf, uint16_t len);
+uint16_t usb_cdcacm_log_free(void);
 
 uint8_t usb_cdcacm_get_dtr(void);
 uint8_t usb_cdcacm_get_rts(void);